@@ -0,0 +1,40 @@
+/*
+
+  boot_profile.h - DWT cycle counter based boot timeline
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if BOOT_PROFILE_ENABLE
+
+// Records the end of the boot phase <name> (a string literal), may be called before grbl is up.
+void boot_profile_mark (const char *name);
+void boot_profile_init (void);
+
+#define BOOT_MARK(name) boot_profile_mark(name)
+
+#else
+
+#define BOOT_MARK(name)
+
+#endif // BOOT_PROFILE_ENABLE
+
+/*EOF*/
@@ -32,4 +32,46 @@ bool  is_cache_aligned(void *ptr, uint32_t len);
 void* cache_aligned_calloc(size_t num, size_t size);
 void  cache_aligned_free(void* ptr);
 
+// Size of the blocks in the DMA buffer pool, must be a multiple of the cache line size
+#ifndef DMA_BUFFER_POOL_BLOCK_SIZE
+#define DMA_BUFFER_POOL_BLOCK_SIZE 512
+#endif
+
+// Number of blocks in the DMA buffer pool, max 32
+#ifndef DMA_BUFFER_POOL_BLOCKS
+#define DMA_BUFFER_POOL_BLOCKS 4
+#endif
+
+void* dma_buffer_alloc(size_t size);
+void  dma_buffer_free(void* ptr);
+
+/*
+ * Non-cacheable DMA arena, 14KB at the end of RAM_D1_DMA configured as normal non-cacheable memory
+ * by MPU_Config(). Static DMA buffers declared with DMA_BUFFER are placed here when enabled and the
+ * dma_buffer_clean()/dma_buffer_invalidate() cache maintenance calls for them compile to nothing.
+ * Without the arena DMA_BUFFER just aligns to the cache line size.
+ */
+#define DMA_ARENA_BASE 0x2400C800
+#define DMA_ARENA_SIZE 0x3800
+
+#if DMA_ARENA_ENABLE
+
+#define DMA_BUFFER __attribute__((section(".dma_arena"), aligned(__SCB_DCACHE_LINE_SIZE)))
+#define dma_buffer_clean(addr, size)
+#define dma_buffer_invalidate(addr, size)
+
+static inline bool is_dma_arena (const void *ptr)
+{
+    return (uint32_t)ptr - DMA_ARENA_BASE < DMA_ARENA_SIZE;
+}
+
+#else
+
+#define DMA_BUFFER __ALIGNED(__SCB_DCACHE_LINE_SIZE)
+#define dma_buffer_clean(addr, size) SCB_CleanDCache_by_Addr((uint32_t *)(addr), size)
+#define dma_buffer_invalidate(addr, size) SCB_InvalidateDCache_by_Addr((uint32_t *)(addr), size)
+#define is_dma_arena(ptr) false
+
+#endif
+
 #endif
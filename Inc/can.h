@@ -0,0 +1,31 @@
+/*
+  can.h - FDCAN1 dedicated RX buffers and bus statistics
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#ifdef CAN_PORT
+
+#include "grbl/canbus.h"
+
+// Routes frames with exactly this ID to a dedicated RX buffer, they are not lost when the FIFO overflows.
+bool can_add_buffer_filter (uint32_t id, bool ext_id, can_rx_ptr callback);
+
+#endif
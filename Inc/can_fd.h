@@ -0,0 +1,37 @@
+/*
+  can_fd.h - CAN-FD frames with bit rate switching on FDCAN1
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if CAN_FD_ENABLE
+
+// Called from the FDCAN interrupt for each frame matched by the filter, len is up to 64.
+typedef void (*can_fd_rx_ptr)(uint32_t id, const uint8_t *data, uint8_t len);
+
+// Starts FDCAN1 at the nominal baud rate unless already started by the core CAN bus plugin.
+bool can_fd_start (uint32_t baud);
+bool can_fd_add_filter (uint32_t id, uint32_t mask, bool ext_id, can_fd_rx_ptr callback);
+// Changes the data phase bit rate, a running peripheral is restarted with its filters kept.
+bool can_fd_set_data_baud (uint32_t baud);
+// Sends an FD frame with bit rate switching, zero padded to the next FD length above 8 bytes.
+bool can_fd_put (uint32_t id, bool ext_id, const uint8_t *data, uint8_t len);
+
+#endif
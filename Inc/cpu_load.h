@@ -0,0 +1,39 @@
+/*
+  cpu_load.h - DWT cycle counter based CPU utilization: interrupts, foreground and idle
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if CPU_LOAD_ENABLE
+
+// Shares of the last CPU_LOAD_WINDOW_MS window in tenths of a percent.
+typedef struct {
+    uint16_t isr;               // 0 without ISR_PROFILE_ENABLE, interrupt time is then in fg and idle
+    uint16_t fg;
+    uint16_t idle;
+    uint16_t idle_min;          // lowest idle window since reset
+} cpu_load_t;
+
+void cpu_load_get (cpu_load_t *load);
+
+// Hooks the realtime loop and hal.stream_blocking_callback and registers $CPU.
+void cpu_load_init (void);
+
+#endif
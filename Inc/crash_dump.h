@@ -0,0 +1,54 @@
+/*
+  crash_dump.h - fault and watchdog reset records in backup SRAM
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "driver.h"
+
+#if CRASH_DUMP_ENABLE
+
+#ifndef CRASH_TRACE_EVENTS
+#define CRASH_TRACE_EVENTS 32   // power of 2
+#endif
+
+typedef struct {
+    uint32_t cycles;
+    uint32_t id;
+    uint32_t payload;
+} crash_trace_t;
+
+extern crash_trace_t crash_trace[CRASH_TRACE_EVENTS];
+extern uint32_t crash_trace_head;
+
+// Keeps the last CRASH_TRACE_EVENTS trace events in RAM for the crash record, called by trace_event().
+static inline __attribute__((always_inline)) void crash_dump_trace (uint32_t id, uint32_t payload)
+{
+    crash_trace_t *t = &crash_trace[crash_trace_head++ & (CRASH_TRACE_EVENTS - 1)];
+
+    t->cycles = DWT->CYCCNT;
+    t->id = id;
+    t->payload = payload;
+}
+
+// Checks the reset cause and registers $CRASH, call early in driver_init().
+void crash_dump_init (void);
+
+#endif
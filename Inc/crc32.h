@@ -0,0 +1,34 @@
+/*
+  crc32.h - CRC-32 on the hardware CRC unit with a table driven fallback
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "driver.h"
+
+// CRC-32 (IEEE 802.3, as zlib): crc is 0 for the first call and the previous result for the next part.
+uint32_t crc32_update (uint32_t crc, const void *data, size_t len);
+void crc32_init (void);
+
+static inline uint32_t crc32_calc (const void *data, size_t len)
+{
+    return crc32_update(0, data, len);
+}
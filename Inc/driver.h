@@ -41,11 +41,20 @@
 #define I2C_ENABLE 1
 #endif
 
+// The pendant (PENDANT_ENABLE) uses the keypad strobe input, needed before the board map is included
+#if PENDANT_ENABLE
+#define I2C_ENABLE 1
+#ifndef I2C_STROBE_ENABLE
+#define I2C_STROBE_ENABLE 1
+#endif
+#endif
+
 #define OPTS_POSTPROCESSING
 
 #include "grbl/driver_opts.h"
 
 #include "timers.h"
+#include "irq_priority.h"
 
 #define DIGITAL_OUT(port, bit, on) { port->BSRR = (on) ? (bit) : ((bit) << 16); }
 #define DIGITAL_IN(port, bit) (!!(port->IDR & (bit)))
@@ -70,6 +79,8 @@
 #define timerocmc(p, c) (TIM_CCMR ## p ##_OC ## c ## M|TIM_CCMR ## p ##_CC ## c ## S)
 #define timerCCR(t, c) timerccr(t, c)
 #define timerccr(t, c) TIM ## t->CCR ## c
+#define timerDMAREQ(t, r) timerdmareq(t, r)
+#define timerdmareq(t, r) DMA_REQUEST_TIM ## t ## _ ## r
 #define timerCCP(c, n) timerccp(c, n)
 #define timerccp(c, n) TIM_CCER_CC ## c ## n ## P
 #define timerCR2OIS(c, n) timercr2ois(c, n)
@@ -84,6 +95,22 @@
 #define usarthandler(t) USART ## t ## _IRQHandler
 #define usartCLKEN(t) usartclken(t)
 #define usartclken(t) __HAL_RCC_USART ## t ## _CLK_ENABLE
+#define usartDMARX(t) usartdmarx(t)
+#define usartdmarx(t) DMA_REQUEST_USART ## t ## _RX
+#define usartDMATX(t) usartdmatx(t)
+#define usartdmatx(t) DMA_REQUEST_USART ## t ## _TX
+#define dmaStream(d, s) dmastream(d, s)
+#define dmastream(d, s) DMA ## d ## _Stream ## s
+#define dmaINT(d, s) dmaint(d, s)
+#define dmaint(d, s) DMA ## d ## _Stream ## s ## _IRQn
+#define dmaHANDLER(d, s) dmahandler(d, s)
+#define dmahandler(d, s) DMA ## d ## _Stream ## s ## _IRQHandler
+// Stream s transfer complete flag, in LISR/LIFCR for streams 0 - 3 and in HISR/HIFCR for 4 - 7
+#define dmaTCIF(s) (DMA_LISR_TCIF0 << (((s) & 3) * 6 + ((s) & 2) * 2))
+#define dmaISR(d, s) dmaisr(d, s)
+#define dmaisr(d, s) ((s) < 4 ? DMA ## d->LISR : DMA ## d->HISR)
+#define dmaIFCR(d, s) dmaifcr(d, s)
+#define dmaifcr(d, s) (*((s) < 4 ? &DMA ## d->LIFCR : &DMA ## d->HIFCR))
 
 #define TIMER_CLOCK_MUL(d) (d == RCC_HCLK_DIV1 ? 1 : (d == RCC_HCLK_DIV2 ? 2 : (d == RCC_HCLK_DIV4 ? 4 : 8)))
 
@@ -201,18 +228,207 @@
 
 #endif
 
+// Spindle synchronized motion: segment corrections by a Q16.16 fixed-point PID with the encoder
+// position read in integer arithmetic instead of the float pidf() and SpindleData_AngularPosition
+#ifndef SPINDLE_SYNC_PID_Q16
+#define SPINDLE_SYNC_PID_Q16 0
+#endif
+#if SPINDLE_SYNC_PID_Q16 && !(SPINDLE_SYNC_ENABLE && SPINDLE_ENCODER_ENABLE)
+#undef SPINDLE_SYNC_PID_Q16
+#define SPINDLE_SYNC_PID_Q16 0
+#endif
+
 #if TRINAMIC_UART_ENABLE
 #ifndef TMC_UART_TIMER_N
 #define TMC_UART_TIMER_N        7
 #endif
 #define TMC_UART_TIMER_BASE         timerBase(TMC_UART_TIMER_N)
+// Generate and sample the TMC UART bits by timer paced DMA instead of an interrupt per bit
+#ifndef TMC_UART_DMA
+#define TMC_UART_DMA 0
+#endif
+#endif
+
+// Post the TMC UART writes made at boot and send them a frame per GPIO port to all motors with
+// a UART pin on it, IFCNT verified in a single pass at the end
+#ifndef TMC_UART_BATCH
+#define TMC_UART_BATCH 0
+#endif
+#if TMC_UART_BATCH && !(TRINAMIC_UART_ENABLE && TMC_UART_DMA)
+#warning "Batched TMC UART writes require TRINAMIC_UART_ENABLE and TMC_UART_DMA!"
+#undef TMC_UART_BATCH
+#define TMC_UART_BATCH 0
+#endif
+
+// Keep copies of the TMC configuration registers written, reads of them are answered without a round trip
+#ifndef TMC_UART_SHADOW
+#define TMC_UART_SHADOW 0
+#endif
+#if TMC_UART_SHADOW && !(TRINAMIC_UART_ENABLE && TMC_UART_DMA)
+#warning "TMC UART register shadow requires TRINAMIC_UART_ENABLE and TMC_UART_DMA!"
+#undef TMC_UART_SHADOW
+#define TMC_UART_SHADOW 0
+#endif
+
+// Background sampling of TMC2209 StallGuard and CoolStep status, needs the non-blocking DMA UART
+#ifndef TMC_TELEMETRY_ENABLE
+#define TMC_TELEMETRY_ENABLE 0
+#endif
+#if TMC_TELEMETRY_ENABLE && !(TRINAMIC_UART_ENABLE && TMC_UART_DMA)
+#warning "TMC telemetry requires TRINAMIC_UART_ENABLE and TMC_UART_DMA!"
+#undef TMC_TELEMETRY_ENABLE
+#define TMC_TELEMETRY_ENABLE 0
+#endif
+
+// Limit inputs are TMC2209 DIAG outputs (sensorless homing), stalls are latched by the pin interrupt while homing
+#ifndef TMC_DIAG_HOMING
+#define TMC_DIAG_HOMING 0
+#endif
+#if TMC_DIAG_HOMING && !TRINAMIC_ENABLE
+#warning "TMC_DIAG_HOMING requires TRINAMIC_ENABLE!"
+#undef TMC_DIAG_HOMING
+#define TMC_DIAG_HOMING 0
+#endif
+
+// Lower the TMC2209 microstep resolution while an axis steps fast, switched from the step ISR
+#ifndef TMC_MRES_SWITCH_ENABLE
+#define TMC_MRES_SWITCH_ENABLE 0
+#endif
+#if TMC_MRES_SWITCH_ENABLE && !(TRINAMIC_UART_ENABLE && TMC_UART_DMA)
+#warning "TMC microstep switching requires TRINAMIC_UART_ENABLE and TMC_UART_DMA!"
+#undef TMC_MRES_SWITCH_ENABLE
+#define TMC_MRES_SWITCH_ENABLE 0
+#endif
+
+// Trinamic SPI drivers daisy chained on the X motor chip select, a datagram for each driver per transfer
+#ifndef TRINAMIC_SPI_CHAIN
+#define TRINAMIC_SPI_CHAIN 0
+#endif
+#if TRINAMIC_SPI_CHAIN && (!TRINAMIC_SPI_ENABLE || defined(TRINAMIC_SOFT_SPI))
+#warning "TRINAMIC_SPI_CHAIN requires hardware SPI!"
+#undef TRINAMIC_SPI_CHAIN
+#define TRINAMIC_SPI_CHAIN 0
+#endif
+
+// EDM: sample the gap voltage divider on EDM_GAP_ADC_PORT/PIN (an ADC1/ADC2 pin) by TIM6 triggered ADC
+// with circular DMA (DMA2 stream 5), analog watchdog interrupts signal short and open gap states.
+#ifndef EDM_GAP_ADC_ENABLE
+#define EDM_GAP_ADC_ENABLE 0
+#endif
+#if EDM_GAP_ADC_ENABLE
+#if !EDM_ENABLE || !defined(EDM_GAP_ADC_PORT) || !defined(EDM_GAP_ADC_PIN)
+#error "EDM gap voltage sensing requires EDM_ENABLE and EDM_GAP_ADC_PORT/EDM_GAP_ADC_PIN!"
+#endif
+#define EDM_GAP_ADC_TIMER_N         6
+#define EDM_GAP_ADC_TIMER_BASE      timerBase(EDM_GAP_ADC_TIMER_N)
+#define EDM_GAP_ADC_TIMER           timer(EDM_GAP_ADC_TIMER_N)
+#define EDM_GAP_ADC_TIMER_CLKEN     timerCLKEN(EDM_GAP_ADC_TIMER_N)
+#endif
+
+// EDM: analog gap servo reference on EDM_SERVO_REF_PORT/PIN for an external servo Z head, DAC1 on
+// PA4/PA5, else PWM at EDM_SERVO_REF_PWM_HZ for an external RC filter, updated per PULSER sample
+#ifndef EDM_SERVO_REF_ENABLE
+#define EDM_SERVO_REF_ENABLE 0
+#endif
+#if EDM_SERVO_REF_ENABLE && (!EDM_ENABLE || !defined(EDM_SERVO_REF_PORT) || !defined(EDM_SERVO_REF_PIN))
+#error "EDM servo reference output requires EDM_ENABLE and EDM_SERVO_REF_PORT/EDM_SERVO_REF_PIN!"
+#endif
+
+// Modbus RTU master on serial stream instance MODBUS_DMA_STREAM (1: SERIAL1_PORT, 2: SERIAL2_PORT) with DMA
+// transfers, receiver timeout frame detection and a request queue serviced from the realtime loop, $MB and M570
+#ifndef MODBUS_DMA_ENABLE
+#define MODBUS_DMA_ENABLE 0
+#endif
+#if !MODBUS_DMA_ENABLE
+#undef MODBUS_DMA_STREAM
+#define MODBUS_DMA_STREAM 0
+#elif !defined(MODBUS_DMA_STREAM)
+#define MODBUS_DMA_STREAM 1
+#endif
+#if MODBUS_DMA_ENABLE
+#if !((MODBUS_DMA_STREAM == 1 && defined(SERIAL1_PORT)) || (MODBUS_DMA_STREAM == 2 && defined(SERIAL2_PORT)))
+#error "MODBUS_DMA_STREAM must select a serial port defined by the board map (SERIAL1_PORT or SERIAL2_PORT)!"
+#endif
+#if defined(MODBUS_RTU_STREAM) && MODBUS_ENABLE && MODBUS_RTU_STREAM == MODBUS_DMA_STREAM
+#error "MODBUS_DMA_STREAM is used by the core Modbus RTU stream!"
+#endif
+#endif
+
+// Closed-loop dielectric flush pressure: PI control of the pump from a pressure sensor on the analog aux input
+// FLUSH_CTRL_SENSOR_PORT, driving the analog (PWM) aux output FLUSH_CTRL_PWM_PORT or a Modbus drive at
+// FLUSH_CTRL_MODBUS_ADDRESS. Setpoint by M571, $FLUSH
+#ifndef FLUSH_CTRL_ENABLE
+#define FLUSH_CTRL_ENABLE 0
+#endif
+#if FLUSH_CTRL_ENABLE
+#if !AUX_ANALOG_SCAN || !defined(FLUSH_CTRL_SENSOR_PORT)
+#error "Flush pressure control requires AUX_ANALOG_SCAN and FLUSH_CTRL_SENSOR_PORT!"
+#endif
+#if defined(FLUSH_CTRL_PWM_PORT) == defined(FLUSH_CTRL_MODBUS_ADDRESS)
+#error "Flush pressure control requires one of FLUSH_CTRL_PWM_PORT or FLUSH_CTRL_MODBUS_ADDRESS!"
+#endif
+#if defined(FLUSH_CTRL_MODBUS_ADDRESS) && !MODBUS_DMA_ENABLE
+#error "Flush pump control over Modbus requires MODBUS_DMA_ENABLE!"
+#endif
+#endif
+
+// CMSIS-DSP filters and spectra: gap ADC channel decimation and low-pass ($GAPDSP), EDM log spectrum
+// (M550 S3). Links the prebuilt arm_cortexM7lfdp_math library, see the [dsp] section of platformio.ini.
+#ifndef DSP_ENABLE
+#define DSP_ENABLE 0
+#endif
+
+// EDM: generate the pulses on the PULSER gate output with its PWM timer instead of a static enable,
+// with per-pulse on-times written to CCR by DMA (DMA2 stream 6) on each timer update.
+#ifndef EDM_GATE_PWM_ENABLE
+#define EDM_GATE_PWM_ENABLE 0
+#endif
+#if EDM_GATE_PWM_ENABLE && !EDM_ENABLE
+#warning "EDM gate PWM requires EDM_ENABLE!"
+#undef EDM_GATE_PWM_ENABLE
+#define EDM_GATE_PWM_ENABLE 0
+#endif
+
+// EDM: hardware gate kill by the break input EDM_GATE_BREAK_PORT/PIN of the gate PWM timer, for a gate on
+// a TIM1/TIM8 channel (e.g. PA8), with the break input wired to a short/fault comparator and the e-stop.
+#ifndef EDM_GATE_BREAK_ENABLE
+#define EDM_GATE_BREAK_ENABLE 0
+#endif
+#if EDM_GATE_BREAK_ENABLE
+#if !EDM_GATE_PWM_ENABLE || !defined(EDM_GATE_BREAK_PORT) || !defined(EDM_GATE_BREAK_PIN)
+#error "EDM gate break input requires EDM_GATE_PWM_ENABLE and EDM_GATE_BREAK_PORT/EDM_GATE_BREAK_PIN!"
+#endif
+#endif
+
+// EDM: count and time discharges from a pulse signal on EDM_PULSE_CAPTURE_PORT/PIN (a timer channel 1 pin)
+// by input capture, with the captures copied to memory by DMA (DMA2 stream EDM_PULSE_CAPTURE_DMA_STREAM).
+#ifndef EDM_PULSE_CAPTURE_ENABLE
+#define EDM_PULSE_CAPTURE_ENABLE 0
+#endif
+#ifndef EDM_PULSE_CAPTURE_DMA_STREAM
+#define EDM_PULSE_CAPTURE_DMA_STREAM 7
+#endif
+#if EDM_PULSE_CAPTURE_ENABLE
+#if !EDM_ENABLE || !defined(EDM_PULSE_CAPTURE_PORT) || !defined(EDM_PULSE_CAPTURE_PIN)
+#error "EDM pulse capture requires EDM_ENABLE and EDM_PULSE_CAPTURE_PORT/EDM_PULSE_CAPTURE_PIN!"
+#endif
+#endif
+
+// Quadrature encoder (x4) on QUADRATURE_A/B_PORT/PIN with optional QUADRATURE_INDEX_PORT/PIN, channels 1, 2
+// and 3 of a 32-bit timer (TIM2, TIM23, TIM24) in encoder mode, see quadrature.c
+#ifndef QUADRATURE_ENABLE
+#define QUADRATURE_ENABLE 0
+#endif
+#if QUADRATURE_ENABLE && !(defined(QUADRATURE_A_PORT) && defined(QUADRATURE_A_PIN) && defined(QUADRATURE_B_PORT) && defined(QUADRATURE_B_PIN))
+#error "Quadrature encoder requires QUADRATURE_A_PORT/PIN and QUADRATURE_B_PORT/PIN!"
 #endif
 
 #define IS_TIMER_CLAIMED(INSTANCE) (((INSTANCE) == STEPPER_TIMER_BASE) || \
                                     ((INSTANCE) == PULSE_TIMER_BASE) || \
                                     ((INSTANCE) == RPM_TIMER_BASE) || \
                                     ((INSTANCE) == RPM_COUNTER_BASE) || \
-                                    ((INSTANCE) == TMC_UART_TIMER_BASE))
+                                    ((INSTANCE) == TMC_UART_TIMER_BASE) || \
+                                    ((INSTANCE) == EDM_GAP_ADC_TIMER_BASE))
 
 // Adjust STEP_PULSE_LATENCY to get accurate step pulse length when required, e.g if using high step rates.
 // The default value is calibrated for 10 microseconds length.
@@ -233,6 +449,14 @@
 #define SPI_PORT 1
 #endif
 
+// EDM: I2C peripheral (1-4) dedicated to the PULSER, 0 to share I2C_PORT with the other I2C devices
+#ifndef EDM_PULSER_I2C_PORT
+#define EDM_PULSER_I2C_PORT 0
+#endif
+#if EDM_PULSER_I2C_PORT && EDM_PULSER_I2C_PORT == I2C_PORT
+#error "EDM_PULSER_I2C_PORT must differ from I2C_PORT!"
+#endif
+
 #if KEYPAD_ENABLE == 1 && !defined(I2C_STROBE_PORT)
 #error Keypad plugin not supported!
 #elif I2C_STROBE_ENABLE && !defined(I2C_STROBE_PORT)
@@ -248,15 +472,848 @@
 #define L1_CACHE_ENABLE 1
 #endif
 
+// Static fixed size class pools and boot arena for long lived driver allocations instead of the heap
+#ifndef MEMPOOL_ENABLE
+#define MEMPOOL_ENABLE 0
+#endif
+
+// Place DMA buffers in a non-cacheable MPU region instead of maintaining the cache per transfer,
+// needs a linker script with the .dma_arena section (all *_FLASH*.ld)
+#ifndef DMA_ARENA_ENABLE
+#define DMA_ARENA_ENABLE 0
+#endif
+
+// Continuous scan of all analog aux inputs with hardware oversampling and circular DMA (DMA2 streams 2-4),
+// reads return the latest value from memory instead of starting a conversion
+#ifndef AUX_ANALOG_SCAN
+#define AUX_ANALOG_SCAN 0
+#endif
+
 #ifndef USE_SPI_DMA
 #define USE_SPI_DMA 1
 #endif
 
+#ifndef SERIAL_FIFO
+#define SERIAL_FIFO 0
+#endif
+
+#ifndef SERIAL_RX_DMA
+#define SERIAL_RX_DMA 0
+#endif
+
+#ifndef SERIAL_TX_DMA
+#define SERIAL_TX_DMA 0
+#endif
+
+// Auto baud rate detection on the main UART stream from the first character received, which must have
+// bit 0 set (e.g. '?' or 'G'), up to the UART clock / 16. Rates set explicitly reach the UART clock / 8,
+// 8x oversampling is selected when closer to the requested rate.
+#ifndef SERIAL_AUTOBAUD
+#define SERIAL_AUTOBAUD 0
+#endif
+
+// RTS/CTS flow control on UART streams, mask of stream instances: bit 0 SERIAL_PORT, bit 1 SERIAL1_PORT,
+// bit 2 SERIAL2_PORT. CTS pauses the transmitter in hardware, RTS follows the input buffer level.
+#ifndef SERIAL_HW_FLOW
+#define SERIAL_HW_FLOW 0
+#endif
+
+// Switch the SD card to the 4-bit bus and high speed (SDR25, up to 50 MHz) once initialized
+#ifndef SDMMC_HIGH_SPEED
+#define SDMMC_HIGH_SPEED 0
+#endif
+#if SDMMC_HIGH_SPEED && !SDCARD_ENABLE
+#warning "SDMMC high speed requires SDCARD_ENABLE!"
+#undef SDMMC_HIGH_SPEED
+#define SDMMC_HIGH_SPEED 0
+#endif
+
+// $SDBENCH SD card sequential read throughput and per call latency
+#ifndef SD_BENCH_ENABLE
+#define SD_BENCH_ENABLE 0
+#endif
+#if SD_BENCH_ENABLE && !SDCARD_ENABLE
+#warning "SD card benchmark requires SDCARD_ENABLE!"
+#undef SD_BENCH_ENABLE
+#define SD_BENCH_ENABLE 0
+#endif
+
+// LRU cache of SD_CACHE_SECTORS sectors for the FatFs FAT/directory window ($SDCACHE),
+// must be set as a build flag since ff.c does not include this file
+#ifndef SD_CACHE_ENABLE
+#define SD_CACHE_ENABLE 0
+#endif
+#if SD_CACHE_ENABLE && !SDCARD_ENABLE
+#warning "SD sector cache requires SDCARD_ENABLE!"
+#undef SD_CACHE_ENABLE
+#define SD_CACHE_ENABLE 0
+#endif
+
+// $FS SD card program runs from two read-ahead buffers refilled from the realtime loop
+#ifndef SD_STREAM_ENABLE
+#define SD_STREAM_ENABLE 0
+#endif
+#if SD_STREAM_ENABLE && !SDCARD_ENABLE
+#warning "SD card streaming requires SDCARD_ENABLE!"
+#undef SD_STREAM_ENABLE
+#define SD_STREAM_ENABLE 0
+#endif
+
+// $FSR resume from line, modal state checkpoints are recorded while $FS runs
+#ifndef FS_INDEX_ENABLE
+#define FS_INDEX_ENABLE 0
+#endif
+#if FS_INDEX_ENABLE && !SD_STREAM_ENABLE
+#warning "Resume index requires SD_STREAM_ENABLE!"
+#undef FS_INDEX_ENABLE
+#define FS_INDEX_ENABLE 0
+#endif
+
+// $SDLOG EDM log recording to a contiguous preallocated file with raw multi-block writes (needs FF_USE_EXPAND)
+#ifndef SD_LOG_ENABLE
+#define SD_LOG_ENABLE 0
+#endif
+#if SD_LOG_ENABLE && !(SDCARD_ENABLE && EDM_ENABLE)
+#warning "SD log recording requires SDCARD_ENABLE and EDM_ENABLE!"
+#undef SD_LOG_ENABLE
+#define SD_LOG_ENABLE 0
+#endif
+
+// $JOBQ queue of $FS programs run back to back with a setup block and touch-off each, results logged on the card
+#ifndef JOB_QUEUE_ENABLE
+#define JOB_QUEUE_ENABLE 0
+#endif
+#if JOB_QUEUE_ENABLE && !SD_STREAM_ENABLE
+#warning "Job queue requires SD_STREAM_ENABLE!"
+#undef JOB_QUEUE_ENABLE
+#define JOB_QUEUE_ENABLE 0
+#endif
+
+// Macros and subprograms read through MACRO_CACHE_PATH are kept compacted in RAM, LRU, checked against the source on open, $MCACHE
+#ifndef MACRO_CACHE_ENABLE
+#define MACRO_CACHE_ENABLE 0
+#endif
+#if MACRO_CACHE_ENABLE && !(LITTLEFS_ENABLE || SDCARD_ENABLE)
+#warning "Macro cache requires LITTLEFS_ENABLE or SDCARD_ENABLE!"
+#undef MACRO_CACHE_ENABLE
+#define MACRO_CACHE_ENABLE 0
+#endif
+
+// Supply dip (PVD) turns the EDM gate off and saves position and $FS progress in backup SRAM, $PWRLOSS
+#ifndef POWER_LOSS_ENABLE
+#define POWER_LOSS_ENABLE 0
+#endif
+#if POWER_LOSS_ENABLE && !FS_INDEX_ENABLE
+#warning "Power loss resume requires FS_INDEX_ENABLE!"
+#undef POWER_LOSS_ENABLE
+#define POWER_LOSS_ENABLE 0
+#endif
+#ifndef POWER_LOSS_PVD_LEVEL
+#define POWER_LOSS_PVD_LEVEL 6      // PWR_CR1 PLS: 0-6 VDD 1.95V-2.85V, 7 PVD_IN pin
+#endif
+#define POWER_LOSS_RECORD_SIZE 128  // bytes at the top of the backup SRAM
+
+// $FWUPDATE A/B firmware update into the inactive flash bank over $UPLOAD blocks, $FW swaps banks,
+// link with STM32H743ZITX_FLASH_AB.ld
+#ifndef FW_UPDATE_ENABLE
+#define FW_UPDATE_ENABLE 0
+#endif
+#if FW_UPDATE_ENABLE && !defined(STM32H743xx)
+#warning "Firmware update requires the dual bank STM32H743!"
+#undef FW_UPDATE_ENABLE
+#define FW_UPDATE_ENABLE 0
+#endif
+#if FW_UPDATE_ENABLE && !UPLOAD_ENABLE
+#undef UPLOAD_ENABLE
+#define UPLOAD_ENABLE 1
+#endif
+
+// $UPLOAD block transfer of files to the SD card or littlefs with CRC-32 checked, windowed blocks
+#ifndef UPLOAD_ENABLE
+#define UPLOAD_ENABLE 0
+#endif
+#if UPLOAD_ENABLE && !(SDCARD_ENABLE || LITTLEFS_ENABLE || FW_UPDATE_ENABLE)
+#warning "File upload requires SDCARD_ENABLE or LITTLEFS_ENABLE!"
+#undef UPLOAD_ENABLE
+#define UPLOAD_ENABLE 0
+#endif
+
+// Raw TCP G-code stream on TCP_STREAM_PORT, received pbufs are read in place without copying
+#ifndef TCP_STREAM_ENABLE
+#define TCP_STREAM_ENABLE 0
+#endif
+#if TCP_STREAM_ENABLE && !ETHERNET_ENABLE
+#warning "TCP stream requires ETHERNET_ENABLE!"
+#undef TCP_STREAM_ENABLE
+#define TCP_STREAM_ENABLE 0
+#endif
+
+// Binary UDP broadcast of position, state and EDM gap state at 100 - 1000 Hz ($UDPTLM)
+#ifndef UDP_TELEMETRY_ENABLE
+#define UDP_TELEMETRY_ENABLE 0
+#endif
+#if UDP_TELEMETRY_ENABLE && !ETHERNET_ENABLE
+#warning "UDP telemetry requires ETHERNET_ENABLE!"
+#undef UDP_TELEMETRY_ENABLE
+#define UDP_TELEMETRY_ENABLE 0
+#endif
+
+// WebSocket G-code stream with binary telemetry frames (samples at up to 1 kHz, EDM log) on WS_TELEMETRY_PORT ($WSTLM)
+#ifndef WS_TELEMETRY_ENABLE
+#define WS_TELEMETRY_ENABLE 0
+#endif
+#if WS_TELEMETRY_ENABLE && !ETHERNET_ENABLE
+#warning "WebSocket telemetry requires ETHERNET_ENABLE!"
+#undef WS_TELEMETRY_ENABLE
+#define WS_TELEMETRY_ENABLE 0
+#endif
+
+// Composite USB device: vendor bulk IN endpoint next to the CDC for binary telemetry and EDM log ($USBTLM, $USBLOG).
+// Must be a build flag, the USB_DEVICE(_H723) files do not include driver.h.
+#ifndef USB_BULK_ENABLE
+#define USB_BULK_ENABLE 0
+#endif
+#if USB_BULK_ENABLE && !USB_SERIAL_CDC
+#warning "USB bulk telemetry requires USB_SERIAL_CDC!"
+#undef USB_BULK_ENABLE
+#define USB_BULK_ENABLE 0
+#endif
+
+// HTTP POST/PUT /upload/<path> streamed to the SD card or littlefs in fixed chunks with a CRC-32 check (HTTP_UPLOAD_PORT)
+#ifndef HTTP_UPLOAD_ENABLE
+#define HTTP_UPLOAD_ENABLE 0
+#endif
+#if HTTP_UPLOAD_ENABLE && !(ETHERNET_ENABLE && (SDCARD_ENABLE || LITTLEFS_ENABLE))
+#warning "HTTP upload requires ETHERNET_ENABLE and SDCARD_ENABLE or LITTLEFS_ENABLE!"
+#undef HTTP_UPLOAD_ENABLE
+#define HTTP_UPLOAD_ENABLE 0
+#endif
+
+// IEEE 1588 slave on the ETH MAC timestamp unit, report and log stamps in PTP time ($PTP, needs LWIP_IGMP)
+#ifndef PTP_ENABLE
+#define PTP_ENABLE 0
+#endif
+#if PTP_ENABLE && !ETHERNET_ENABLE
+#warning "PTP requires ETHERNET_ENABLE!"
+#undef PTP_ENABLE
+#define PTP_ENABLE 0
+#endif
+
+// Per job metrics (cut time, pulses, shorts, energy, alarms) published to an MQTT broker ($MQTTM)
+#ifndef MQTT_METRICS_ENABLE
+#define MQTT_METRICS_ENABLE 0
+#endif
+#if MQTT_METRICS_ENABLE && !ETHERNET_ENABLE
+#warning "MQTT job metrics require ETHERNET_ENABLE!"
+#undef MQTT_METRICS_ENABLE
+#define MQTT_METRICS_ENABLE 0
+#endif
+
+// mDNS services with port and capability TXT records for host discovery (_spark._tcp)
+#ifndef MDNS_SERVICES_ENABLE
+#define MDNS_SERVICES_ENABLE 0
+#endif
+#if MDNS_SERVICES_ENABLE && !(ETHERNET_ENABLE && MDNS_ENABLE)
+#warning "mDNS services require ETHERNET_ENABLE and MDNS_ENABLE!"
+#undef MDNS_SERVICES_ENABLE
+#define MDNS_SERVICES_ENABLE 0
+#endif
+
+// LwIP Rx pool and ETH DMA descriptors in D2 SRAM instead of the start of D1 RAM, needs the
+// *_ETHD2.ld linker script variant. Descriptor ring sizes: ETH_RX_DESC_CNT/ETH_TX_DESC_CNT.
+#ifndef ETH_BUFFERS_D2
+#define ETH_BUFFERS_D2 0
+#endif
+
+// $ETHSTAT Ethernet receive drop counters (descriptor exhaustion, FIFO overflow, CRC), on-chip MAC only
+#ifndef ETH_STATS_ENABLE
+#define ETH_STATS_ENABLE 0
+#endif
+#if ETH_STATS_ENABLE && (!ETHERNET_ENABLE || defined(_WIZCHIP_))
+#warning "Ethernet statistics require ETHERNET_ENABLE with the on-chip MAC!"
+#undef ETH_STATS_ENABLE
+#define ETH_STATS_ENABLE 0
+#endif
+
+// W5x00 socket buffer reads/writes as queued SPI DMA bursts, aligned DMA directly into lwIP pbufs
+#ifndef W5X00_SPI_BURST
+#define W5X00_SPI_BURST 1
+#endif
+#if W5X00_SPI_BURST && !(ETHERNET_ENABLE && defined(_WIZCHIP_) && USE_SPI_DMA)
+#undef W5X00_SPI_BURST
+#define W5X00_SPI_BURST 0
+#endif
+
+// Output to streams other than the active one (hal.stream) drops whole lines instead of blocking
+// when the client does not keep up, see stream_fanout.h
+#ifndef STREAM_FANOUT_NONBLOCK
+#define STREAM_FANOUT_NONBLOCK 0
+#endif
+
+// Periodic and every pass tasks with rate, budget and priority run from a single realtime loop hook, $SCHED
+#ifndef RT_SCHED_ENABLE
+#define RT_SCHED_ENABLE 0
+#endif
+
+// Input lines compacted (whitespace, ; comments) into a ring from the realtime loop ahead of the parser, $PRESCAN
+#ifndef GCODE_PRESCAN_ENABLE
+#define GCODE_PRESCAN_ENABLE 0
+#endif
+
+// Compact binary status frame (positions in steps, state, buffer levels, EDM gap summary, CRC)
+// returned for the STATUS_BINARY_CMD realtime character, $STATBIN
+#ifndef STATUS_BINARY_ENABLE
+#define STATUS_BINARY_ENABLE 0
+#endif
+
+// Fault handlers and watchdog resets store registers, stack, trace and EDM log tail in backup SRAM, $CRASH
+#ifndef CRASH_DUMP_ENABLE
+#define CRASH_DUMP_ENABLE 0
+#endif
+
+// IWDG reloaded from the realtime loop only while the registered subsystems (stepper interrupt, EDM
+// PULSER samples) report within their deadlines, $WDT
+#ifndef WATCHDOG_ENABLE
+#define WATCHDOG_ENABLE 0
+#endif
+#if WATCHDOG_ENABLE && !defined(WATCHDOG_STEP_DEADLINE_MS)
+#define WATCHDOG_STEP_DEADLINE_MS 500   // must exceed the longest stepper interrupt period in use
+#endif
+
+#ifndef STREAM_BENCH_ENABLE
+#define STREAM_BENCH_ENABLE 0
+#endif
+
+// $STEPBENCH step rate sweep, step output looped back to STEP_BENCH_PORT/PIN (a timer channel 1 pin),
+// direction optionally to STEP_BENCH_DIR_PORT/PIN (channel 3 of the same timer), captures copied to
+// memory by DMA (DMA2 stream STEP_BENCH_DMA_STREAM)
+#ifndef STEP_BENCH_ENABLE
+#define STEP_BENCH_ENABLE 0
+#endif
+#if STEP_BENCH_ENABLE
+#if !defined(STEP_BENCH_PORT) || !defined(STEP_BENCH_PIN)
+#error "Step benchmark requires STEP_BENCH_PORT/STEP_BENCH_PIN!"
+#endif
+#ifndef STEP_BENCH_DMA_STREAM
+#if EDM_PULSE_CAPTURE_ENABLE && EDM_PULSE_CAPTURE_DMA_STREAM == 7
+#error "DMA2_Stream7 is used by EDM pulse capture, set STEP_BENCH_DMA_STREAM to a free stream!"
+#endif
+#define STEP_BENCH_DMA_STREAM 7
+#endif
+#endif
+
+// DMA2 streams with a fixed use: 0 and 1 serial RX/TX DMA, 5 gap ADC, 6 gate PWM.
+#define DMA2_STREAM_TAKEN(s) ((SERIAL_RX_DMA && (s) == 0) || (SERIAL_TX_DMA && (s) == 1) || \
+                              (EDM_GAP_ADC_ENABLE && (s) == 5) || (EDM_GATE_PWM_ENABLE && (s) == 6))
+#if EDM_PULSE_CAPTURE_ENABLE && (EDM_PULSE_CAPTURE_DMA_STREAM > 7 || DMA2_STREAM_TAKEN(EDM_PULSE_CAPTURE_DMA_STREAM))
+#error "EDM pulse capture DMA stream is in use or invalid, set EDM_PULSE_CAPTURE_DMA_STREAM to a free stream!"
+#endif
+#if STEP_BENCH_ENABLE && (STEP_BENCH_DMA_STREAM > 7 || DMA2_STREAM_TAKEN(STEP_BENCH_DMA_STREAM) || \
+                          (EDM_PULSE_CAPTURE_ENABLE && STEP_BENCH_DMA_STREAM == EDM_PULSE_CAPTURE_DMA_STREAM))
+#error "Step benchmark DMA stream is in use or invalid, set STEP_BENCH_DMA_STREAM to a free stream!"
+#endif
+
+#ifndef ISR_PROFILE_ENABLE
+#define ISR_PROFILE_ENABLE 0
+#endif
+
+// $BOOT boot timeline, DWT timestamps per init phase
+#ifndef BOOT_PROFILE_ENABLE
+#define BOOT_PROFILE_ENABLE 0
+#endif
+
+// H723 core clock at 550MHz (VOS0) once the CPU frequency boost option bit is set with
+// $CLOCKS=BOOST, 25MHz crystal boards only. Must be a build flag as usbd_conf.c does not include
+// driver.h
+#ifndef CPU_FREQ_550MHZ
+#define CPU_FREQ_550MHZ 0
+#endif
+#if CPU_FREQ_550MHZ && (!defined(STM32H723xx) || defined(NUCLEO_H723))
+#warning "550MHz core clock is for H723 boards with a 25MHz crystal only!"
+#undef CPU_FREQ_550MHZ
+#define CPU_FREQ_550MHZ 0
+#endif
+
+// Sleep (WFI) in the main loop after IDLE_SLEEP_DELAY ms in Idle state without input or EDM activity
+#ifndef IDLE_SLEEP_ENABLE
+#define IDLE_SLEEP_ENABLE 0
+#endif
+
+// $PERF consolidated performance report: realtime loop rate and CPU idle, EDM poll rate and I2C latency,
+// retract latency, stepper interrupt maximums (with ISR_PROFILE_ENABLE), stream rates and buffer high-water marks
+#ifndef PERF_DASH_ENABLE
+#define PERF_DASH_ENABLE 0
+#endif
+
+// $CPU rolling interrupt, foreground and idle shares of the core from the DWT cycle counter, interrupt
+// time needs ISR_PROFILE_ENABLE
+#ifndef CPU_LOAD_ENABLE
+#define CPU_LOAD_ENABLE 0
+#endif
+
+// Binary event trace of hot path events (TRACE_BACKEND 1: ITM stimulus ports on SWO, 2: Segger RTT)
+#ifndef TRACE_ENABLE
+#define TRACE_ENABLE 0
+#endif
+#ifndef TRACE_BACKEND
+#define TRACE_BACKEND 1
+#endif
+
+// Defer slow init steps that nothing else depends on (littlefs mount, SD card mount, PULSER
+// I2C speed negotiation) to foreground tasks run once the controller takes commands
+#ifndef BOOT_DEFER_INIT
+#define BOOT_DEFER_INIT 0
+#endif
+
+// $MEMMAP per region memory usage report, needs the region symbols from the *_FLASH*.ld scripts
+#ifndef MEMMAP_ENABLE
+#define MEMMAP_ENABLE 0
+#endif
+
+// Tightly coupled memory placement (zero wait state, not cached) for the step generation
+// hot path, sections are set up in the linker scripts and initialized by the startup code.
+// NOTE: DTCM is not accessible by the DMA controllers.
+#define ITCM_CODE __attribute__((section(".itcm_text")))
+#define DTCM_DATA __attribute__((section(".dtcm_data")))
+#define DTCM_BSS  __attribute__((section(".dtcm_bss")))
+
+// Planner block buffer ($398 blocks) allocated from the DTCM left free by the linker (at most
+// PLANNER_DTCM_SIZE bytes if defined) instead of the heap, the link must wrap plan_reset, malloc,
+// realloc and free (see planner_dtcm.c)
+#ifndef PLANNER_DTCM_ENABLE
+#define PLANNER_DTCM_ENABLE 0
+#endif
+
+// Planner blocks that must fit in DTCM after the EDM log, checked against EDM_LOG_SIZE at
+// compile time (plugin_edm.c)
+#ifndef PLANNER_DTCM_MIN_BLOCKS
+#define PLANNER_DTCM_MIN_BLOCKS 32
+#endif
+
+// Output steps and directions with one BSRR write per GPIO port from lookup tables
+// built on settings changes, for pin maps where the pins are spread across ports.
+// The set of ports written is derived from the board map at compile time, see pin_masks.h.
+#ifndef STEPDIR_BSRR_TABLE
+#define STEPDIR_BSRR_TABLE 0
+#endif
+
+// End step pulses by timer triggered DMA writes to the step port BSRR registers instead of
+// from the pulse timer interrupt. Not used when a step pulse delay is configured.
+#ifndef STEP_PULSE_DMA
+#define STEP_PULSE_DMA 0
+#endif
+
+// Step pulses timed by a timer in one-pulse mode, without a pulse end interrupt, on boards where the
+// step pins are channels of one timer. The board map defines STEP_OPM_TIMER_N, STEP_OPM_AF and
+// <axis>_STEP_OPM_CH (channel 1 - 4) per axis.
+#ifndef STEP_PULSE_OPM
+#define STEP_PULSE_OPM 0
+#endif
+
+// Queue debounced limit, control and aux input events from the EXTI handlers to the foreground
+// in a lock-free ring instead of adding a delayed task per edge.
+#ifndef PIN_EVENT_QUEUE
+#define PIN_EVENT_QUEUE 0
+#endif
+#ifndef PIN_EVENT_QUEUE_SIZE
+#define PIN_EVENT_QUEUE_SIZE 16 // power of 2
+#endif
+
+// Debounce aux inputs by sampling them on a periodic timer with an N-sample integrator per pin
+// instead of by a level check after PIN_DEBOUNCE_MS, the latency is then PIN_FILTER_SAMPLES *
+// PIN_FILTER_PERIOD_US from a stable state. Claims a hal.timer.
+#ifndef PIN_FILTER_ENABLE
+#define PIN_FILTER_ENABLE 0
+#endif
+#ifndef PIN_FILTER_PERIOD_US
+#define PIN_FILTER_PERIOD_US 250
+#endif
+#ifndef PIN_FILTER_SAMPLES
+#define PIN_FILTER_SAMPLES 8    // 1..255
+#endif
+
+// Limit and control state reads by one IDR read per port and lookup tables, see gpio_gather.c
+#ifndef INPUT_GATHER
+#define INPUT_GATHER 0
+#endif
+
+// M561: aux output changes queued against planner blocks and applied by the stepper interrupt
+// when the next block starts instead of after a buffer sync, see ioports.c
+#ifndef AUX_OUT_SYNC_ENABLE
+#define AUX_OUT_SYNC_ENABLE 0
+#endif
+
+// $PWMPROF/$PWMLOOP: aux PWM output duty ramps and waveforms written to CCR by DMA on the timer
+// update event, see pwm.c
+#ifndef PWM_PROFILE_ENABLE
+#define PWM_PROFILE_ENABLE 0
+#endif
+#ifndef PWM_PROFILE_SIZE
+#define PWM_PROFILE_SIZE 256    // entries, 4 bytes each in DMA_BUFFER
+#endif
+#ifndef PWM_PROFILE_DMA_STREAM
+#define PWM_PROFILE_DMA_STREAM DMA1_Stream7
+#endif
+
+// EDM: number of steps recorded (power of 2, 2 bytes each in DTCM) for retracting along the
+// actual path across block boundaries, 0 to retract along the current segment only.
+#ifndef EDM_RETRACT_HISTORY
+#define EDM_RETRACT_HISTORY 0
+#endif
+
+// EDM: step rate profile of retract and re-advance, ramped per step in the step generator (M568).
+#ifndef EDM_RETRACT_PROFILE
+#define EDM_RETRACT_PROFILE 0
+#endif
+#if EDM_RETRACT_PROFILE && !EDM_ENABLE
+#warning "EDM retract profile requires EDM_ENABLE!"
+#undef EDM_RETRACT_PROFILE
+#define EDM_RETRACT_PROFILE 0
+#endif
+
+// EDM: the first STEP_PERIOD_DMA_STEPS steps of retract profile ramps written to the step timer period
+// by DMA on the timer update event from tables built when the profile changes, instead of computed and
+// written per step by the stepper interrupt
+#ifndef STEP_PERIOD_DMA
+#define STEP_PERIOD_DMA 0
+#endif
+#ifndef STEP_PERIOD_DMA_STEPS
+#define STEP_PERIOD_DMA_STEPS 64    // 15 words per step in DMA_BUFFER
+#endif
+#if STEP_PERIOD_DMA && !EDM_RETRACT_PROFILE
+#warning "Step period DMA requires EDM_RETRACT_PROFILE!"
+#undef STEP_PERIOD_DMA
+#define STEP_PERIOD_DMA 0
+#endif
+#if STEP_PERIOD_DMA && PWM_PROFILE_ENABLE && !defined(STEP_PERIOD_DMA_STREAM)
+#error "Step period DMA and PWM profiles both default to DMA1 stream 7, set STEP_PERIOD_DMA_STREAM to a free stream!"
+#endif
+#ifndef STEP_PERIOD_DMA_STREAM
+#define STEP_PERIOD_DMA_STREAM DMA1_Stream7
+#endif
+
+// EDM: retract along a configured vector, e.g. the tool axis, instead of back along the path (M574).
+#ifndef EDM_RETRACT_VECTOR
+#define EDM_RETRACT_VECTOR 0
+#endif
+#if EDM_RETRACT_VECTOR && !EDM_ENABLE
+#warning "EDM retract vector requires EDM_ENABLE!"
+#undef EDM_RETRACT_VECTOR
+#define EDM_RETRACT_VECTOR 0
+#endif
+#if EDM_RETRACT_VECTOR && EDM_RETRACT_HISTORY
+#error "EDM_RETRACT_VECTOR and EDM_RETRACT_HISTORY cannot be combined!"
+#endif
+
+// Queued step injection: bursts of steps at a given rate on claimed motors or a shared axis, output
+// from a periodic timer without foreground involvement per step.
+#ifndef STEP_INJECT_BURST
+#define STEP_INJECT_BURST 0
+#endif
+#ifndef STEP_INJECT_BURST_QUEUE
+#define STEP_INJECT_BURST_QUEUE 8 // power of 2
+#endif
+#if STEP_INJECT_BURST && !STEP_INJECT_ENABLE
+#warning "Queued step injection requires STEP_INJECT_ENABLE!"
+#undef STEP_INJECT_BURST
+#define STEP_INJECT_BURST 0
+#endif
+
+// EDM: compensate electrode wear with Z steps injected along the feed (M555).
+#ifndef EDM_WEAR_COMP_ENABLE
+#define EDM_WEAR_COMP_ENABLE 0
+#endif
+#if EDM_WEAR_COMP_ENABLE && !(EDM_ENABLE && STEP_INJECT_BURST)
+#warning "EDM wear compensation requires EDM_ENABLE and STEP_INJECT_BURST!"
+#undef EDM_WEAR_COMP_ENABLE
+#define EDM_WEAR_COMP_ENABLE 0
+#endif
+
+// EDM: lift-and-return flushing cycles on short ratio or interval (M556).
+#ifndef EDM_FLUSH_ENABLE
+#define EDM_FLUSH_ENABLE 0
+#endif
+#if EDM_FLUSH_ENABLE && !(EDM_ENABLE && STEP_INJECT_BURST)
+#warning "EDM flushing cycles require EDM_ENABLE and STEP_INJECT_BURST!"
+#undef EDM_FLUSH_ENABLE
+#define EDM_FLUSH_ENABLE 0
+#endif
+
+// EDM: feed hold while cutting turns the gate off at once, backs Z off once stopped and returns it
+// on resume with a slow approach under the gap servo (M576).
+#ifndef EDM_GAP_HOLD_ENABLE
+#define EDM_GAP_HOLD_ENABLE 0
+#endif
+#if EDM_GAP_HOLD_ENABLE && !(EDM_ENABLE && STEP_INJECT_BURST)
+#warning "EDM gap hold requires EDM_ENABLE and STEP_INJECT_BURST!"
+#undef EDM_GAP_HOLD_ENABLE
+#define EDM_GAP_HOLD_ENABLE 0
+#endif
+
+// EDM: PULSER max duty adapted to the short/open ratios within set bounds (M558).
+#ifndef EDM_ADAPT_ENABLE
+#define EDM_ADAPT_ENABLE 0
+#endif
+#if EDM_ADAPT_ENABLE && !EDM_ENABLE
+#warning "EDM adaptive pulse duty requires EDM_ENABLE!"
+#undef EDM_ADAPT_ENABLE
+#define EDM_ADAPT_ENABLE 0
+#endif
+
+// EDM: arcs told apart from normal discharges, answered by off-time, retract and flushing (M559).
+#ifndef EDM_ARC_ENABLE
+#define EDM_ARC_ENABLE 0
+#endif
+#if EDM_ARC_ENABLE && !EDM_ENABLE
+#warning "EDM arc detection requires EDM_ENABLE!"
+#undef EDM_ARC_ENABLE
+#define EDM_ARC_ENABLE 0
+#endif
+
+// EDM: pre/post-trigger captures of the PULSER telemetry around shorts, arcs, alarms and probe contact (M563).
+#ifndef EDM_CAPTURE_ENABLE
+#define EDM_CAPTURE_ENABLE 0
+#endif
+#if EDM_CAPTURE_ENABLE && !EDM_ENABLE
+#warning "EDM event capture requires EDM_ENABLE!"
+#undef EDM_CAPTURE_ENABLE
+#define EDM_CAPTURE_ENABLE 0
+#endif
+
+// EDM: derate pulse current from the PULSER temperature, optional PWM fan output (M564).
+#ifndef EDM_THERMAL_ENABLE
+#define EDM_THERMAL_ENABLE 0
+#endif
+#if EDM_THERMAL_ENABLE && !EDM_ENABLE
+#warning "EDM thermal derating requires EDM_ENABLE!"
+#undef EDM_THERMAL_ENABLE
+#define EDM_THERMAL_ENABLE 0
+#endif
+
+// EDM: lower the TMC2209 current of axes standing still while burning, restored ahead of their motion.
+#ifndef EDM_HOLD_CURRENT_ENABLE
+#define EDM_HOLD_CURRENT_ENABLE 0
+#endif
+#if EDM_HOLD_CURRENT_ENABLE && !(EDM_ENABLE && TMC_UART_SHADOW)
+#warning "EDM hold current reduction requires EDM_ENABLE and TMC_UART_SHADOW!"
+#undef EDM_HOLD_CURRENT_ENABLE
+#define EDM_HOLD_CURRENT_ENABLE 0
+#endif
+
+// EDM: pulse recipes (M565~M567), steps of M503/M504 parameters switched by energized time, depth
+// or pulse count, e.g. rough -> semi -> finish or alternating polarity
+#ifndef EDM_RECIPE_ENABLE
+#define EDM_RECIPE_ENABLE 0
+#endif
+#if EDM_RECIPE_ENABLE && !EDM_ENABLE
+#warning "EDM pulse recipes require EDM_ENABLE!"
+#undef EDM_RECIPE_ENABLE
+#define EDM_RECIPE_ENABLE 0
+#endif
+
+// EDM: relay feedback auto-tuning of the gap servo gains (M569), stored per recipe step with
+// EDM_RECIPE_ENABLE
+#ifndef EDM_AUTOTUNE_ENABLE
+#define EDM_AUTOTUNE_ENABLE 0
+#endif
+#if EDM_AUTOTUNE_ENABLE && !EDM_ENABLE
+#warning "EDM servo auto-tuning requires EDM_ENABLE!"
+#undef EDM_AUTOTUNE_ENABLE
+#define EDM_AUTOTUNE_ENABLE 0
+#endif
+
+// EDM: two-speed Z touch-off cycle by current sensing (M572)
+#ifndef EDM_TOUCHOFF_ENABLE
+#define EDM_TOUCHOFF_ENABLE 0
+#endif
+#if EDM_TOUCHOFF_ENABLE && !EDM_ENABLE
+#warning "EDM touch-off cycle requires EDM_ENABLE!"
+#undef EDM_TOUCHOFF_ENABLE
+#define EDM_TOUCHOFF_ENABLE 0
+#endif
+
+// EDM: surface map by touch-off on a grid and Z height compensation by injected steps (M573)
+#ifndef EDM_SURFACE_MAP_ENABLE
+#define EDM_SURFACE_MAP_ENABLE 0
+#endif
+#if EDM_SURFACE_MAP_ENABLE && !(EDM_TOUCHOFF_ENABLE && STEP_INJECT_BURST)
+#warning "EDM surface map requires EDM_TOUCHOFF_ENABLE and STEP_INJECT_BURST!"
+#undef EDM_SURFACE_MAP_ENABLE
+#define EDM_SURFACE_MAP_ENABLE 0
+#endif
+
+// EDM: circular or square orbit of the electrode in XY (M557) by injected steps on the claimed
+// X and Y motors, superimposed on the programmed Z feed.
+#ifndef EDM_ORBIT_ENABLE
+#define EDM_ORBIT_ENABLE 0
+#endif
+#if EDM_ORBIT_ENABLE && !(EDM_ENABLE && STEP_INJECT_BURST)
+#warning "EDM orbit requires EDM_ENABLE and STEP_INJECT_BURST!"
+#undef EDM_ORBIT_ENABLE
+#define EDM_ORBIT_ENABLE 0
+#endif
+
+// EDM: M551 P1 appends the log to EDM_LOG_FILE on littlefs or the SD card in a compact page format
+#ifndef EDM_LOG_PERSIST
+#define EDM_LOG_PERSIST 0
+#endif
+#if EDM_LOG_PERSIST && !(EDM_ENABLE && (LITTLEFS_ENABLE || SDCARD_ENABLE))
+#warning "EDM log persisting requires EDM_ENABLE and LITTLEFS_ENABLE or SDCARD_ENABLE!"
+#undef EDM_LOG_PERSIST
+#define EDM_LOG_PERSIST 0
+#endif
+#if EDM_LOG_PERSIST && !defined(EDM_LOG_FILE)
+#if LITTLEFS_ENABLE
+#define EDM_LOG_FILE "/littlefs/edm.log"
+#else
+#define EDM_LOG_FILE "/edm.log"
+#endif
+#endif
+
+// Settings stored as a wear levelled journal in the flash EEPROM emulation sector, a save appends
+// the changed parts instead of erasing the sector
+#ifndef FLASH_JOURNAL
+#define FLASH_JOURNAL 0
+#endif
+#if FLASH_JOURNAL && EEPROM_ENABLE
+#warning "Journaled flash settings are not available with EEPROM_ENABLE!"
+#undef FLASH_JOURNAL
+#define FLASH_JOURNAL 0
+#endif
+
+// EDM: electrode library in the flash journal (M575), applied on M6 by tool number: wear compensation
+// area and wear factor, recipe start step and the touch-off offset to the reference electrode
+#ifndef EDM_ELECTRODE_ENABLE
+#define EDM_ELECTRODE_ENABLE 0
+#endif
+#if EDM_ELECTRODE_ENABLE && !(EDM_ENABLE && FLASH_JOURNAL)
+#warning "EDM electrode library requires EDM_ENABLE and FLASH_JOURNAL!"
+#undef EDM_ELECTRODE_ENABLE
+#define EDM_ELECTRODE_ENABLE 0
+#endif
+#ifndef EDM_ELECTRODES
+#define EDM_ELECTRODES 8        // one journal key each
+#endif
+
+// I2C EEPROM/FRAM settings (EEPROM_ENABLE) through a RAM mirror, changed pages written back whole from
+// the realtime loop with ACK polling instead of blocking byte writes, $EEPROM
+#ifndef EEPROM_ASYNC_ENABLE
+#define EEPROM_ASYNC_ENABLE 0
+#endif
+#if EEPROM_ASYNC_ENABLE && !(EEPROM_ENABLE && defined(I2C_PORT))
+#warning "Asynchronous EEPROM writes require EEPROM_ENABLE and I2C_PORT!"
+#undef EEPROM_ASYNC_ENABLE
+#define EEPROM_ASYNC_ENABLE 0
+#endif
+
+// I2C pendant/keypad read on the strobe interrupt as a high priority queued transfer, continuous jog
+// moves generated on the controller while a key is held, $PENDANT. Replaces the keypad plugin
+#ifndef PENDANT_ENABLE
+#define PENDANT_ENABLE 0
+#endif
+#if PENDANT_ENABLE && KEYPAD_ENABLE
+#error "PENDANT_ENABLE replaces the keypad plugin, disable KEYPAD_ENABLE!"
+#endif
+
+// CAN-FD on FDCAN1 with bit rate switching, data phase at CAN_FD_DATA_BAUD (a rate the FDCAN
+// clock divides into at least 4 time quanta, e.g. 2000000 or 4000000 with 48 MHz), 64 byte frames
+#ifndef CAN_FD_ENABLE
+#define CAN_FD_ENABLE 0
+#endif
+#if CAN_FD_ENABLE && !defined(CAN_PORT)
+#warning "CAN-FD requires a board with CAN_PORT!"
+#undef CAN_FD_ENABLE
+#define CAN_FD_ENABLE 0
+#endif
+#ifndef CAN_FD_DATA_BAUD
+#define CAN_FD_DATA_BAUD 4000000
+#endif
+
+// EDM: PULSER pushes its telemetry over CAN-FD instead of being polled over I2C
+#ifndef EDM_PULSER_CAN
+#define EDM_PULSER_CAN 0
+#endif
+#if EDM_PULSER_CAN && !(EDM_ENABLE && CAN_FD_ENABLE)
+#warning "PULSER telemetry over CAN requires EDM_ENABLE and CAN_FD_ENABLE!"
+#undef EDM_PULSER_CAN
+#define EDM_PULSER_CAN 0
+#endif
+
+// EDM: replace PULSER with an on-MCU stochastic gap model driven by the Z position, for bench tuning (M562).
+#ifndef EDM_PULSER_SIM
+#define EDM_PULSER_SIM 0
+#endif
+#if EDM_PULSER_SIM && !EDM_ENABLE
+#warning "PULSER simulator requires EDM_ENABLE!"
+#undef EDM_PULSER_SIM
+#define EDM_PULSER_SIM 0
+#endif
+#if EDM_PULSER_SIM && EDM_PULSER_CAN
+#warning "PULSER telemetry over CAN is not used with the PULSER simulator!"
+#undef EDM_PULSER_CAN
+#define EDM_PULSER_CAN 0
+#endif
+
+#if STEP_PULSE_OPM && (!defined(STEP_OPM_TIMER_N) || N_AXIS > 4 || SPINDLE_SYNC_ENABLE || STEP_INJECT_ENABLE || \
+                       defined(X2_STEP_PORT) || defined(Y2_STEP_PORT) || defined(Z2_STEP_PORT))
+#warning "One-pulse mode step pulses require a board map with STEP_OPM_TIMER_N and up to four unganged axes, and are not available with spindle sync or step injection!"
+#undef STEP_PULSE_OPM
+#define STEP_PULSE_OPM 0
+#endif
+#if STEP_PULSE_OPM
+#undef STEP_PULSE_DMA
+#define STEP_PULSE_DMA 0
+#endif
+
+#if STEP_PULSE_DMA && (!STEPDIR_BSRR_TABLE || SPINDLE_SYNC_ENABLE || STEP_INJECT_ENABLE)
+#warning "DMA step pulse generation requires STEPDIR_BSRR_TABLE and is not available with spindle sync or step injection!"
+#undef STEP_PULSE_DMA
+#define STEP_PULSE_DMA 0
+#endif
+
 #if LITTLEFS_ENABLE
 #undef SPIFLASH_ENABLE
 #define SPIFLASH_ENABLE 1
 #endif
 
+// SPI flash erase/program as background jobs polled from the realtime loop
+#ifndef SPIFLASH_ASYNC
+#define SPIFLASH_ASYNC 0
+#endif
+#if SPIFLASH_ASYNC && !SPIFLASH_ENABLE
+#warning "Background SPI flash jobs require SPIFLASH_ENABLE!"
+#undef SPIFLASH_ASYNC
+#define SPIFLASH_ASYNC 0
+#endif
+
+// $SPIFBENCH SPI flash memory mapped read benchmark
+#ifndef SPIFLASH_BENCH
+#define SPIFLASH_BENCH 0
+#endif
+
+// Execute cold code in place from the memory mapped SPI flash, needs board_build.ldscript =
+// STM32H723ZETX_FLASH_XIP.ld. The first SPIFLASH_XIP_SIZE bytes of the flash hold the code,
+// littlefs uses the rest.
+#ifndef SPIFLASH_XIP
+#define SPIFLASH_XIP 0
+#endif
+#if SPIFLASH_XIP && (!SPIFLASH_ENABLE || SPIFLASH_ASYNC)
+#warning "SPI flash execute in place requires SPIFLASH_ENABLE and is not available with SPIFLASH_ASYNC!"
+#undef SPIFLASH_XIP
+#define SPIFLASH_XIP 0
+#endif
+#ifndef SPIFLASH_XIP_SIZE
+#define SPIFLASH_XIP_SIZE (1024 * 1024) // must match QSPI_FLASH in the linker script
+#endif
+
+// Code placement in the SPI flash, the function must not be called from interrupt handlers
+// (memory mapped mode is off while the flash is programmed or erased).
+#if SPIFLASH_XIP
+#define QSPI_CODE __attribute__((section(".qspi_text"), noinline))
+#else
+#define QSPI_CODE
+#endif
+
 #ifndef STEP_PINMODE
 #define STEP_PINMODE PINMODE_OUTPUT
 #endif
@@ -281,6 +1338,9 @@ typedef struct {
     volatile bool active;
     ioport_interrupt_callback_ptr interrupt_callback;
     ADC_HandleTypeDef *adc;
+#if AUX_ANALOG_SCAN
+    volatile uint32_t *adc_value;
+#endif
     const char *description;
 } input_signal_t;
 
@@ -316,11 +1376,49 @@ void board_init (void);
 bool driver_init (void);
 void Driver_IncTick (void);
 void gpio_irq_enable (const input_signal_t *input, pin_irq_mode_t irq_mode);
+void gpio_irq_map (void);
 void ioports_init(pin_group_pins_t *aux_inputs, pin_group_pins_t *aux_outputs);
 #if AUX_ANALOG
 void ioports_init_analog (pin_group_pins_t *aux_inputs, pin_group_pins_t *aux_outputs);
 #endif
+#if AUX_ANALOG || EDM_GAP_ADC_ENABLE
+bool adc_get_channel (GPIO_TypeDef *port, uint8_t pin, ADC_TypeDef **adc, uint32_t *channel);
+#endif
 void ioports_event (input_signal_t *input);
+// Sets the aux outputs flagged in mask to the states in values, one BSRR write per GPIO port.
+void ioports_digital_out_mask (uint32_t mask, uint32_t values);
+#if AUX_OUT_SYNC_ENABLE
+// Called by the stepper interrupt when a new block starts, applies the M561 changes due.
+void ioports_block_started (void);
+#endif
 const pwm_signal_t *get_pwm_timer (GPIO_TypeDef *port, uint8_t pin);
+#if STEP_INJECT_BURST
+// Queues steps, one every 1/rate seconds, on claimed motors (hal.stepper.claim_motor) or on a
+// single unclaimed axis shared with normal motion, stepped only while that motion runs in the
+// same direction. Returns false if the queue is full. Not reentrant.
+bool stepperInjectBurst (axes_signals_t step, axes_signals_t dir, uint32_t steps, float rate);
+// Outputs one step on claimed motors unless an injected step pulse is in progress, for generators
+// running from a claimed hal.timer (same interrupt priority as the burst timer). Returns false if
+// the step was not output.
+bool stepperInjectStep (axes_signals_t step, axes_signals_t dir);
+bool stepperInjectBusy (void);
+// Stops the running burst and drops the queued ones, a step pulse in progress is completed.
+void stepperInjectAbort (void);
+#endif
+
+// RTC wall time with hal.get_micros() read at the same instant, a t_us from the same clock is at
+// wall time epoch + us + (t_us - stamp.t_us). The sub-second resolution is that of the RTC (~4 ms),
+// PTP time (UTC, microsecond resolution) is used instead when PTP_ENABLE and synchronized.
+typedef struct {
+    uint32_t epoch;     // seconds since 1970-01-01, RTC time zone
+    uint32_t us;        // microseconds within the second
+    uint32_t t_us;      // lower 32 bits of hal.get_micros()
+} rtc_stamp_t;
+
+// Returns false if the RTC is not available or not set.
+bool rtc_stamp_get (rtc_stamp_t *stamp);
+// Writes ",rtc=<YYYY-MM-DDThh:mm:ss.uuuuuu>,rtc_us=<t_us>" for report lines, an empty string if the
+// RTC is not set. ",rtc_src=ptp" is appended for PTP time. Returns the length.
+int rtc_stamp_print (char *buf, size_t size);
 
 #endif // __DRIVER_H__
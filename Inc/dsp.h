@@ -0,0 +1,58 @@
+/*
+  dsp.h - CMSIS-DSP based filters, statistics and spectra
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if DSP_ENABLE
+
+#include "arm_math.h"
+
+#ifndef DSP_FFT_MAX
+#define DSP_FFT_MAX 1024        // power of 2, 32 - 4096
+#endif
+
+typedef struct {
+    float mean;
+    float rms;
+    float std;
+    float min;
+    float max;
+} dsp_stats_t;
+
+typedef struct {
+    float hz;
+    float amplitude;            // of a sine at hz, in input units
+} dsp_peak_t;
+
+// Input of dsp_spectrum(), shared by all callers: fill from foreground code only.
+extern float dsp_fft_in[DSP_FFT_MAX];
+
+void dsp_stats (const float *x, uint32_t n, dsp_stats_t *stats);
+// Windowed-sinc (Hamming) low-pass FIR for decimation by factor, unity DC gain.
+void dsp_fir_decimator (float *coeffs, uint16_t taps, uint16_t factor);
+// Butterworth low-pass biquad, coefficients in arm_biquad_cascade_df2T_f32() order.
+void dsp_biquad_lowpass (float coeffs[5], float fs, float fc);
+// Hann windowed spectrum of the first n (power of 2, 32 - DSP_FFT_MAX) samples of dsp_fft_in,
+// mean removed, sampled at fs. Returns the number of peaks stored, largest first.
+// stats may be NULL. dsp_fft_in is overwritten.
+uint_fast8_t dsp_spectrum (uint32_t n, float fs, dsp_stats_t *stats, dsp_peak_t *peaks, uint_fast8_t max_peaks);
+
+#endif // DSP_ENABLE
@@ -0,0 +1,52 @@
+/*
+  edm_gap_adc.h - timer triggered ADC sampling of the EDM gap voltage
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if EDM_GAP_ADC_ENABLE
+
+typedef enum {
+    EdmGap_Open = 0,
+    EdmGap_Discharge,
+    EdmGap_Short
+} edm_gap_state_t;
+
+typedef struct {
+    uint32_t opens;         // transitions to open gap
+    uint32_t discharges;    // transitions to discharge
+    uint32_t shorts;        // confirmed shorts
+    uint32_t dips;          // short level dips that ended before being confirmed
+} edm_gap_stats_t;
+
+// Gap state change callback, called from interrupt context.
+// EdmGap_Short is only reported once the gap has stayed below the short threshold for
+// EDM_GAP_ADC_SHORT_SAMPLES conversions.
+typedef void (*edm_gap_event_ptr)(edm_gap_state_t state);
+
+// Starts sampling, returns false if the pin is not on ADC1/ADC2 or a resource is not available.
+bool edm_gap_adc_init (edm_gap_event_ptr on_event);
+bool edm_gap_adc_running (void);
+edm_gap_state_t edm_gap_adc_state (void);
+// Mean gap voltage over the last EDM_GAP_ADC_BUFFER conversions.
+float edm_gap_adc_voltage (void);
+void edm_gap_adc_get_stats (edm_gap_stats_t *stats, bool reset);
+
+#endif
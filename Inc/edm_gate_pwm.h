@@ -0,0 +1,51 @@
+/*
+  edm_gate_pwm.h - timer generated EDM pulses on the PULSER gate output
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if EDM_GATE_PWM_ENABLE
+
+// Claims the timer channel of PULSER_GATE_PORT/PIN, returns false if the pin has no free PWM timer.
+// The gate is left off (driven low).
+bool edm_gate_pwm_init (void);
+// Sets the nominal pulse on-time and duty cycle (1 - 100%), only call with the gate off.
+bool edm_gate_pwm_configure (float on_us, float duty_pct);
+// Starts or stops the pulse train, may be called from interrupt context.
+void edm_gate_pwm_enable (bool on);
+// Scales the on-time of the following pulses (0 - 1) keeping the period, may be called from interrupt context.
+void edm_gate_pwm_scale (float scale);
+
+#if EDM_GATE_BREAK_ENABLE
+
+// Called from the break interrupt, after the hardware has cut the gate.
+typedef void (*edm_gate_break_ptr)(void);
+
+// Enables the break input EDM_GATE_BREAK_PORT/PIN of the gate timer, returns false if the gate is not
+// on TIM1/TIM8 or the pin is not a break input of that timer. Call after edm_gate_pwm_init().
+bool edm_gate_pwm_break_init (edm_gate_break_ptr on_break);
+// True after a break until rearmed.
+bool edm_gate_pwm_tripped (void);
+// Enables the timer outputs again after a break, returns false while the break input is still active.
+bool edm_gate_pwm_rearm (void);
+
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+/*
+  edm_pulse_capture.h - timer input capture of EDM discharge pulses
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if EDM_PULSE_CAPTURE_ENABLE
+
+typedef struct {
+    uint32_t pulses;        // discharges since the previous read, exact
+    uint32_t measured;      // of which the width was captured, older entries are lost on buffer overrun
+    uint32_t width_ns;      // sum of the measured discharge widths
+} edm_pulse_capture_t;
+
+// Claims the timer of EDM_PULSE_CAPTURE_PORT/PIN, returns false if the pin has no channel 1
+// input capture or the timer is not available.
+bool edm_pulse_capture_init (void);
+bool edm_pulse_capture_running (void);
+// Collects the discharges captured since the previous call, may be called from interrupt context.
+void edm_pulse_capture_read (edm_pulse_capture_t *capture);
+
+#endif
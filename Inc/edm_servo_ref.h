@@ -0,0 +1,34 @@
+/*
+  edm_servo_ref.h - analog gap servo reference output for external servo drives
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if EDM_SERVO_REF_ENABLE
+
+// Claims EDM_SERVO_REF_PORT/PIN: DAC1 on PA4/PA5, else its PWM timer channel. Returns false if neither.
+// The output is left at mid-scale (zero velocity).
+bool edm_servo_ref_init (void);
+// Sets the reference, -1 (full retract) - 0 (stop) - 1 (full feed), may be called from interrupt context.
+void edm_servo_ref_set (float ref);
+// True when the output is the DAC, false for filtered PWM.
+bool edm_servo_ref_is_dac (void);
+
+#endif
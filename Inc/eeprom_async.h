@@ -0,0 +1,29 @@
+/*
+  eeprom_async.h - I2C EEPROM/FRAM settings storage with a RAM mirror and background page writes
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if EEPROM_ASYNC_ENABLE
+
+// Reads the EEPROM into the mirror and sets up hal.nvs, call instead of i2c_eeprom_init().
+void eeprom_async_init (void);
+
+#endif
@@ -35,7 +35,34 @@
 #define min(a,b) (((a) < (b)) ? (a) : (b))
 #endif
 
+void *flash_emul_base (void);
+bool flash_emul_erase (void);
+bool flash_sector_erase (uint32_t address);
+bool flash_program (uint32_t address, const void *source, uint32_t size);
+bool flash_emul_program (uint32_t offset, const void *source, uint32_t size);
+
 bool memcpy_from_flash (uint8_t *dest);
 bool memcpy_to_flash (uint8_t *source);
 
+#if FLASH_JOURNAL
+
+// Journal keys, FLASH_KV_NVS is the settings image.
+#define FLASH_KV_NVS        0
+#define FLASH_KV_EDM_WEAR   1
+#define FLASH_KV_EDM_RECIPE 2
+#define FLASH_KV_EDM_GAINS  3
+#define FLASH_KV_EDM_ELECTRODE 4    // EDM_ELECTRODES keys from here
+#if EDM_ELECTRODE_ENABLE
+#define FLASH_KV_KEYS       (FLASH_KV_EDM_ELECTRODE + EDM_ELECTRODES)
+#else
+#define FLASH_KV_KEYS       4
+#endif
+#define FLASH_KV_SIZE       64  // max value size
+
+bool flash_kv_read (uint16_t key, void *data, uint16_t len);
+bool flash_kv_write (uint16_t key, const void *data, uint16_t len);
+void flash_journal_init (void);
+
+#endif
+
 #endif
@@ -0,0 +1,33 @@
+/*
+  flush_ctrl.h - closed-loop dielectric flush pressure control
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if FLUSH_CTRL_ENABLE
+
+// Setpoint in bar, 0 stops the pump.
+void flush_ctrl_set (float setpoint);
+// Filtered pressure in bar, negative on a sensor fault.
+float flush_ctrl_pressure (void);
+// Claims the sensor input and pump output, call after the aux ports are initialized.
+void flush_ctrl_init (void);
+
+#endif // FLUSH_CTRL_ENABLE
@@ -0,0 +1,49 @@
+/*
+  fs_index.h - line index with modal state checkpoints for resuming file runs
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if FS_INDEX_ENABLE
+
+typedef struct {
+    uint32_t line;              // lines before the checkpoint
+    uint32_t offset;            // file offset of the first character after them
+    float feed_rate;            // mm/min
+    uint8_t motion;             // 0, 1: G0/G1, 80: other (not restored)
+    uint8_t plane;              // plane_select_t
+    uint8_t coord;              // coord_system_id_t
+    uint8_t feed_mode;          // feed_mode_t
+    bool imperial;
+    bool incremental;
+} fs_checkpoint_t;
+
+// Starts indexing a run, the index is kept if name and size match the last indexed file.
+void fs_index_start (const char *name, uint32_t size);
+// Call with the first character of every line, before it is returned to the parser.
+void fs_index_line (uint32_t line, uint32_t offset);
+// Last checkpoint before the 1-based line number, NULL if none.
+const fs_checkpoint_t *fs_index_find (const char *name, uint32_t line);
+// G-code block restoring the modal state of a checkpoint, LF terminated.
+void fs_index_preamble (const fs_checkpoint_t *cp, char *buf, size_t size);
+// Number of checkpoints and their line interval.
+uint_fast16_t fs_index_count (uint32_t *every);
+
+#endif
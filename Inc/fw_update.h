@@ -0,0 +1,36 @@
+/*
+  fw_update.h - A/B firmware update into the inactive flash bank
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "driver.h"
+
+#if FW_UPDATE_ENABLE
+
+// Image sink for $FWUPDATE (upload.c), called from the realtime loop.
+bool fw_update_begin (uint32_t size);
+bool fw_update_write (const void *data, uint32_t len);
+// Flushes and verifies the image against crc when ok, returns NULL when it is staged or an error message.
+const char *fw_update_end (bool ok, uint32_t crc);
+void fw_update_init (void);
+
+#endif
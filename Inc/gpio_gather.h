@@ -0,0 +1,66 @@
+/*
+  gpio_gather.h - batched GPIO input reads mapped to signal bits by lookup tables
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if INPUT_GATHER
+
+#ifndef GPIO_GATHER_PINS
+#define GPIO_GATHER_PINS 16     // per plan
+#endif
+
+// Output bits for the 16 values of one IDR nibble.
+typedef struct {
+    uint8_t port;               // index in gpio_gather_t.port[]
+    uint8_t shift;              // nibble position in IDR
+    uint32_t bits[16];
+} gpio_gather_lut_t;
+
+// Gather plan: each port IDR is read once, the output is the OR of the table entries selected
+// by the nibbles that have pins in the plan.
+typedef struct {
+    uint_fast8_t n_ports;
+    uint_fast8_t n_luts;
+    uint32_t present;           // output bits with a pin
+    GPIO_TypeDef *port[GPIO_GATHER_PINS];
+    gpio_gather_lut_t lut[GPIO_GATHER_PINS];
+} gpio_gather_t;
+
+void gpio_gather_clear (gpio_gather_t *plan);
+// Maps the pin to the output bits (set when the pin reads high), false if the plan is full.
+bool gpio_gather_add (gpio_gather_t *plan, GPIO_TypeDef *port, uint8_t pin, uint32_t bits);
+
+__attribute__((always_inline)) static inline uint32_t gpio_gather_read (const gpio_gather_t *plan)
+{
+    uint_fast8_t i;
+    uint32_t idr[GPIO_GATHER_PINS], bits = 0;
+    const gpio_gather_lut_t *lut = plan->lut;
+
+    for(i = 0; i < plan->n_ports; i++)
+        idr[i] = plan->port[i]->IDR;
+
+    for(i = plan->n_luts; i; i--, lut++)
+        bits |= lut->bits[(idr[lut->port] >> lut->shift) & 0xF];
+
+    return bits;
+}
+
+#endif // INPUT_GATHER
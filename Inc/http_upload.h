@@ -0,0 +1,34 @@
+/*
+  http_upload.h - streaming HTTP file upload to the SD card or littlefs
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if HTTP_UPLOAD_ENABLE
+
+#ifndef HTTP_UPLOAD_PORT
+#define HTTP_UPLOAD_PORT 8082
+#endif
+
+// Starts listening on HTTP_UPLOAD_PORT, call once the lwIP stack is initialized (after enet_start())
+// and the filesystems are mounted.
+bool http_upload_init (void);
+
+#endif
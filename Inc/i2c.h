@@ -24,6 +24,75 @@
 #include "driver.h"
 #include "grbl/plugins.h"
 
+// Completion callback for non-blocking transfers, called from interrupt context.
+typedef void (*i2c_complete_ptr)(bool ok, void *context);
+
+typedef enum {
+    I2C_PriorityLow = 0,
+    I2C_PriorityHigh,
+    I2C_PriorityN
+} i2c_priority_t;
+
+typedef enum {
+    I2C_OpMemRead = 0,
+    I2C_OpMemWrite,
+    I2C_OpReceive,
+    I2C_OpSend
+} i2c_op_t;
+
+// I2C_BusPulser is EDM_PULSER_I2C_PORT, or the main bus (I2C_PORT) when that is not set.
+typedef enum {
+    I2C_BusMain = 0,
+#if EDM_PULSER_I2C_PORT
+    I2C_BusPulser,
+    I2C_BusN
+#else
+    I2C_BusN,
+    I2C_BusPulser = I2C_BusMain
+#endif
+} i2c_bus_id_t;
+
+typedef struct i2c_transaction {
+    i2c_bus_id_t bus;                   // I2C_BusMain (0) unless set
+    i2c_op_t op;
+    i2c_priority_t priority;
+    i2c_address_t address;
+    uint16_t word_addr;                 // register address for I2C_OpMemRead and I2C_OpMemWrite
+    uint8_t word_addr_bytes;            // 1 or 2
+    uint16_t count;
+    uint8_t *data;
+    i2c_complete_ptr callback;
+    void *context;
+    struct i2c_transaction *next;       // used by the queue
+} i2c_transaction_t;
+
+bool i2c_queue_transaction (i2c_transaction_t *transaction);
+bool i2c_set_speed (uint32_t khz);
+uint32_t i2c_get_speed (void);
+bool i2c_negotiate (i2c_address_t i2cAddr);
+bool i2c_busy (void);
+bool i2c_transfer_async (i2c_transfer_t *i2c, i2c_complete_ptr callback, void *context);
+
+// Error counters, a bus recovery clocks out a slave holding SDA low and re-initialises the peripheral.
+typedef struct {
+    uint32_t transfers;         // completed ok
+    uint32_t errors;            // failed or aborted
+    uint32_t nack;
+    uint32_t bus_error;         // misplaced START/STOP or arbitration lost
+    uint32_t timeout;           // SCL held low too long or transfer watchdog expired
+    uint32_t busy;              // bus not free when a transfer was started
+    uint32_t recoveries;
+} i2c_stats_t;
+
+void i2c_get_stats (i2c_stats_t *stats, bool reset);
+
+// Bus specific variants, the functions above operate on I2C_BusMain.
+bool i2c_bus_transfer (i2c_bus_id_t bus, i2c_transfer_t *i2c, bool read);
+bool i2c_bus_negotiate (i2c_bus_id_t bus, i2c_address_t i2cAddr);
+uint32_t i2c_bus_get_speed (i2c_bus_id_t bus);
+bool i2c_bus_busy (i2c_bus_id_t bus);
+void i2c_bus_get_stats (i2c_bus_id_t bus, i2c_stats_t *stats, bool reset);
+
 #if TRINAMIC_ENABLE == 2130 && TRINAMIC_I2C
 
 #include "motors/trinamic.h"
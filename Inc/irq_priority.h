@@ -0,0 +1,113 @@
+/*
+
+  irq_priority.h - NVIC preemption priority map
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  HAL_Init() selects NVIC_PRIORITYGROUP_4: 16 preemption levels, no subpriority.
+  A lower number preempts a higher one, handlers at the same level never preempt
+  each other. All priorities are set from this table, any entry can be overridden
+  from the build flags.
+
+  Level  Source
+    0    PULSE    step pulse end timer
+    0    EDM      gate PWM break, gap ADC and its trigger timer, pulse capture DMA
+    0    POWER    supply dip (PVD), turns the gate off (POWER_LOSS_ENABLE)
+    1    STEPPER  main stepper timer
+    2    INPUT    EXTI control, limit and probe inputs, spindle encoder counter
+    3    TIMER    general purpose timers claimed via timers.c, $STEPBENCH capture DMA
+    4    I2C      PULSER/keypad I2C event and error
+    5    SERIAL   UART streams and their DMA
+    6    TMC      Trinamic UART and its DMA
+    6    SPI      SPI and its DMA
+    6    CAN      FDCAN
+    7    USB      USB OTG (CDC stream)
+    8    SDMMC    SD card
+    9    DSP      gap ADC block filtering (DMA half/full transfer)
+
+  The stepper, pulse and EDM sources must stay strictly above everything else,
+  this is checked below. Realtime commands received while the stepper ISR runs
+  are delayed by at most one stepper interrupt, use $ISRPROF to verify the
+  resulting entry latency.
+*/
+
+#pragma once
+
+#ifndef IRQ_PRIO_PULSE
+#define IRQ_PRIO_PULSE      0
+#endif
+#ifndef IRQ_PRIO_EDM
+#define IRQ_PRIO_EDM        0
+#endif
+#ifndef IRQ_PRIO_POWER
+#define IRQ_PRIO_POWER      0
+#endif
+#ifndef IRQ_PRIO_STEPPER
+#define IRQ_PRIO_STEPPER    1
+#endif
+#ifndef IRQ_PRIO_INPUT
+#define IRQ_PRIO_INPUT      2
+#endif
+#ifndef IRQ_PRIO_TIMER
+#define IRQ_PRIO_TIMER      3
+#endif
+#ifndef IRQ_PRIO_I2C
+#define IRQ_PRIO_I2C        4
+#endif
+#ifndef IRQ_PRIO_SERIAL
+#define IRQ_PRIO_SERIAL     5
+#endif
+#ifndef IRQ_PRIO_TMC
+#define IRQ_PRIO_TMC        6
+#endif
+#ifndef IRQ_PRIO_SPI
+#define IRQ_PRIO_SPI        6
+#endif
+#ifndef IRQ_PRIO_CAN
+#define IRQ_PRIO_CAN        6
+#endif
+#ifndef IRQ_PRIO_USB
+#define IRQ_PRIO_USB        7
+#endif
+#ifndef IRQ_PRIO_SDMMC
+#define IRQ_PRIO_SDMMC      8
+#endif
+#ifndef IRQ_PRIO_DSP
+#define IRQ_PRIO_DSP        9
+#endif
+
+#define IRQ_PRIO_MOTION_MAX ((IRQ_PRIO_STEPPER > IRQ_PRIO_PULSE ? IRQ_PRIO_STEPPER : IRQ_PRIO_PULSE) > IRQ_PRIO_EDM ? \
+                             (IRQ_PRIO_STEPPER > IRQ_PRIO_PULSE ? IRQ_PRIO_STEPPER : IRQ_PRIO_PULSE) : IRQ_PRIO_EDM)
+
+#if IRQ_PRIO_PULSE > IRQ_PRIO_STEPPER
+#error "IRQ_PRIO_PULSE must not be lower than IRQ_PRIO_STEPPER, the step pulse would be stretched by the stepper ISR!"
+#endif
+
+#if IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_INPUT || IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_TIMER || IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_I2C || \
+    IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_SERIAL || IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_TMC || IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_SPI || \
+    IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_CAN || IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_USB || IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_SDMMC || \
+    IRQ_PRIO_MOTION_MAX >= IRQ_PRIO_DSP
+#error "Stepper, pulse and EDM interrupt priorities must be strictly higher than all other sources!"
+#endif
+
+#if IRQ_PRIO_DSP > 15 || IRQ_PRIO_SDMMC > 15 || IRQ_PRIO_USB > 15 || IRQ_PRIO_CAN > 15 || IRQ_PRIO_SPI > 15 || IRQ_PRIO_TMC > 15 || IRQ_PRIO_SERIAL > 15
+#error "NVIC preemption priority must be in the range 0 - 15!"
+#endif
+
+/*EOF*/
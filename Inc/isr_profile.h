@@ -0,0 +1,98 @@
+/*
+
+  isr_profile.h - DWT cycle counter based interrupt handler profiling
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "driver.h"
+
+#if ISR_PROFILE_ENABLE
+
+typedef enum {
+    IsrProfile_Stepper = 0,
+    IsrProfile_Pulse,
+    IsrProfile_EXTI0,
+    IsrProfile_EXTI1,
+    IsrProfile_EXTI2,
+    IsrProfile_EXTI3,
+    IsrProfile_EXTI4,
+    IsrProfile_EXTI9_5,
+    IsrProfile_EXTI15_10,
+    IsrProfile_UART0,
+    IsrProfile_N
+} isr_profile_id_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} isr_profile_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max;
+} isr_latency_t;
+
+extern isr_profile_t isr_profile[IsrProfile_N];
+extern isr_latency_t isr_latency_stepper;
+
+// Times include any higher priority interrupts that preempted the handler.
+static inline __attribute__((always_inline)) void isr_profile_update (isr_profile_id_t id, uint32_t cycles)
+{
+    isr_profile_t *p = &isr_profile[id];
+
+    p->count++;
+    p->total += cycles;
+    if(cycles > p->max)
+        p->max = cycles;
+    if(cycles < p->min)
+        p->min = cycles;
+}
+
+#define ISR_PROFILE_ENTER() uint32_t isr_profile_t0 = DWT->CYCCNT
+#define ISR_PROFILE_EXIT(id) isr_profile_update(id, DWT->CYCCNT - isr_profile_t0)
+
+// Entry latency of a down counting timer update interrupt: the counter reloads from ARR on underflow
+// so ARR - CNT is the number of timer ticks elapsed since the interrupt was raised.
+static inline __attribute__((always_inline)) void isr_latency_update (isr_latency_t *l, uint32_t arr, uint32_t cnt)
+{
+    if(cnt <= arr) {
+        l->count++;
+        if(arr - cnt > l->max)
+            l->max = arr - cnt;
+    }
+}
+
+#define ISR_LATENCY_STEPPER(timer) isr_latency_update(&isr_latency_stepper, (timer)->ARR, (timer)->CNT)
+
+void isr_profile_init (void);
+
+#else
+
+#define ISR_PROFILE_ENTER()
+#define ISR_PROFILE_EXIT(id)
+#define ISR_LATENCY_STEPPER(timer)
+
+#endif // ISR_PROFILE_ENABLE
+
+/*EOF*/
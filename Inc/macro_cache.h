@@ -0,0 +1,33 @@
+/*
+  macro_cache.h - RAM cache of compacted macro and subprogram files
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if MACRO_CACHE_ENABLE
+
+// Mounts MACRO_CACHE_PATH and registers $MCACHE.
+void macro_cache_init (void);
+
+// Drops the cached copy of a source file, path as passed to vfs_open().
+// Called by the in-tree writers when a file has been replaced.
+void macro_cache_invalidate (const char *path);
+
+#endif
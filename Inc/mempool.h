@@ -0,0 +1,79 @@
+/*
+
+  mempool.h - fixed size class pools and boot time bump allocator
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+#pragma once
+
+#include <stdlib.h>
+
+#include "driver.h"
+
+#if MEMPOOL_ENABLE
+
+// Block counts per size class, sizes are 16, 32, 64, 128 and 256 bytes
+#ifndef MEMPOOL_BLOCKS_16
+#define MEMPOOL_BLOCKS_16   32
+#endif
+#ifndef MEMPOOL_BLOCKS_32
+#define MEMPOOL_BLOCKS_32   32
+#endif
+#ifndef MEMPOOL_BLOCKS_64
+#define MEMPOOL_BLOCKS_64   16
+#endif
+#ifndef MEMPOOL_BLOCKS_128
+#define MEMPOOL_BLOCKS_128  8
+#endif
+#ifndef MEMPOOL_BLOCKS_256
+#define MEMPOOL_BLOCKS_256  4
+#endif
+// Size of the arena for allocations that are never freed
+#ifndef MEMPOOL_BOOT_SIZE
+#define MEMPOOL_BOOT_SIZE   4096
+#endif
+
+#define MEMPOOL_N_CLASSES   5
+
+typedef struct {
+    uint16_t size;
+    uint16_t blocks;
+    uint16_t used;
+    uint16_t max_used;  // high-water mark
+    uint32_t fallback;  // requests passed on to the heap when the class was exhausted
+} mem_pool_stats_t;
+
+// Both return zeroed memory, requests that do not fit are passed on to calloc().
+void *mem_pool_alloc (size_t size);
+void mem_pool_free (void *ptr);
+void *mem_boot_alloc (size_t size);
+
+uint32_t mem_pool_get_free (void);
+bool mem_pool_get_stats (uint_fast8_t idx, mem_pool_stats_t *stats);
+void mem_boot_get_stats (uint32_t *used, uint32_t *size, uint32_t *fallback);
+
+#else
+
+#define mem_pool_alloc(size) calloc(1, size)
+#define mem_pool_free(ptr) free(ptr)
+#define mem_boot_alloc(size) calloc(1, size)
+#define mem_pool_get_free() 0
+
+#endif // MEMPOOL_ENABLE
+
+/*EOF*/
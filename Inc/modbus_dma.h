@@ -0,0 +1,62 @@
+/*
+  modbus_dma.h - Modbus RTU master with DMA transfers and a request queue
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if MODBUS_DMA_ENABLE
+
+#ifndef MODBUS_DMA_MAX_REGS
+#define MODBUS_DMA_MAX_REGS 16      // registers per read
+#endif
+
+typedef enum {
+    ModbusDMA_OK = 0,
+    ModbusDMA_Timeout,
+    ModbusDMA_CRC,                  // or malformed response
+    ModbusDMA_Exception,
+    ModbusDMA_Aborted
+} modbus_dma_status_t;
+
+typedef struct {
+    modbus_dma_status_t status;
+    uint8_t address;
+    uint8_t function;
+    uint16_t reg;
+    uint8_t exception;              // exception code for ModbusDMA_Exception
+    uint8_t n_regs;                 // registers read
+    uint16_t regs[MODBUS_DMA_MAX_REGS];
+} modbus_dma_result_t;
+
+// Called from the realtime loop (foreground) when a request has completed.
+typedef void (*modbus_dma_done_ptr)(const modbus_dma_result_t *result, void *context);
+
+// Queue a request, return false if the queue is full or the arguments are invalid.
+// function is 3 (holding registers) or 4 (input registers). done may be NULL.
+bool modbus_dma_read (uint8_t address, uint8_t function, uint16_t reg, uint8_t count, modbus_dma_done_ptr done, void *context);
+// Write single register (function 6), address 0 is a broadcast without response.
+bool modbus_dma_write (uint8_t address, uint16_t reg, uint16_t value, modbus_dma_done_ptr done, void *context);
+uint_fast8_t modbus_dma_pending (void);
+// Completes queued requests with ModbusDMA_Aborted.
+void modbus_dma_flush (void);
+void modbus_dma_irq_handler (void);
+void modbus_dma_init (void);
+
+#endif // MODBUS_DMA_ENABLE
@@ -0,0 +1,155 @@
+/*
+
+  pin_masks.h - compile time per GPIO port step and direction pin masks
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Derived from the board map, all expressions are constant and fold away when a
+  port is passed as the GPIOx peripheral symbol:
+
+  STEP_PORT_PINS(port) - step pins of all motors on the port
+  DIR_PORT_PINS(port)  - direction pins of all motors on the port
+  <x>_PORT_SLOT(port)  - index of the port among the ports used by STEP_ or DIR_PORT_PINS,
+                         ports are ordered by address (GPIOA first).
+
+  Must be included after driver.h.
+*/
+
+#pragma once
+
+#define PORT_PIN(port, pin_port, bit) ((uint32_t)(pin_port) == (uint32_t)(port) ? (uint32_t)(bit) : 0UL)
+
+#ifdef X2_STEP_PIN
+#define X2_STEP_ON(port) PORT_PIN(port, X2_STEP_PORT, X2_STEP_BIT)
+#else
+#define X2_STEP_ON(port) 0UL
+#endif
+#ifdef Y2_STEP_PIN
+#define Y2_STEP_ON(port) PORT_PIN(port, Y2_STEP_PORT, Y2_STEP_BIT)
+#else
+#define Y2_STEP_ON(port) 0UL
+#endif
+#ifdef Z2_STEP_PIN
+#define Z2_STEP_ON(port) PORT_PIN(port, Z2_STEP_PORT, Z2_STEP_BIT)
+#else
+#define Z2_STEP_ON(port) 0UL
+#endif
+#ifdef A_AXIS
+#define A_STEP_ON(port) PORT_PIN(port, A_STEP_PORT, A_STEP_BIT)
+#else
+#define A_STEP_ON(port) 0UL
+#endif
+#ifdef B_AXIS
+#define B_STEP_ON(port) PORT_PIN(port, B_STEP_PORT, B_STEP_BIT)
+#else
+#define B_STEP_ON(port) 0UL
+#endif
+#ifdef C_AXIS
+#define C_STEP_ON(port) PORT_PIN(port, C_STEP_PORT, C_STEP_BIT)
+#else
+#define C_STEP_ON(port) 0UL
+#endif
+#ifdef U_AXIS
+#define U_STEP_ON(port) PORT_PIN(port, U_STEP_PORT, U_STEP_BIT)
+#else
+#define U_STEP_ON(port) 0UL
+#endif
+#ifdef V_AXIS
+#define V_STEP_ON(port) PORT_PIN(port, V_STEP_PORT, V_STEP_BIT)
+#else
+#define V_STEP_ON(port) 0UL
+#endif
+
+#define STEP_PORT_PINS(port) (PORT_PIN(port, X_STEP_PORT, X_STEP_BIT) | PORT_PIN(port, Y_STEP_PORT, Y_STEP_BIT) | \
+                              PORT_PIN(port, Z_STEP_PORT, Z_STEP_BIT) | X2_STEP_ON(port) | Y2_STEP_ON(port) | \
+                              Z2_STEP_ON(port) | A_STEP_ON(port) | B_STEP_ON(port) | C_STEP_ON(port) | \
+                              U_STEP_ON(port) | V_STEP_ON(port))
+
+#ifdef X2_DIRECTION_PIN
+#define X2_DIR_ON(port) PORT_PIN(port, X2_DIRECTION_PORT, X2_DIRECTION_BIT)
+#else
+#define X2_DIR_ON(port) 0UL
+#endif
+#ifdef Y2_DIRECTION_PIN
+#define Y2_DIR_ON(port) PORT_PIN(port, Y2_DIRECTION_PORT, Y2_DIRECTION_BIT)
+#else
+#define Y2_DIR_ON(port) 0UL
+#endif
+#ifdef Z2_DIRECTION_PIN
+#define Z2_DIR_ON(port) PORT_PIN(port, Z2_DIRECTION_PORT, Z2_DIRECTION_BIT)
+#else
+#define Z2_DIR_ON(port) 0UL
+#endif
+#ifdef A_AXIS
+#define A_DIR_ON(port) PORT_PIN(port, A_DIRECTION_PORT, A_DIRECTION_BIT)
+#else
+#define A_DIR_ON(port) 0UL
+#endif
+#ifdef B_AXIS
+#define B_DIR_ON(port) PORT_PIN(port, B_DIRECTION_PORT, B_DIRECTION_BIT)
+#else
+#define B_DIR_ON(port) 0UL
+#endif
+#ifdef C_AXIS
+#define C_DIR_ON(port) PORT_PIN(port, C_DIRECTION_PORT, C_DIRECTION_BIT)
+#else
+#define C_DIR_ON(port) 0UL
+#endif
+#ifdef U_AXIS
+#define U_DIR_ON(port) PORT_PIN(port, U_DIRECTION_PORT, U_DIRECTION_BIT)
+#else
+#define U_DIR_ON(port) 0UL
+#endif
+#ifdef V_AXIS
+#define V_DIR_ON(port) PORT_PIN(port, V_DIRECTION_PORT, V_DIRECTION_BIT)
+#else
+#define V_DIR_ON(port) 0UL
+#endif
+
+#define DIR_PORT_PINS(port) (PORT_PIN(port, X_DIRECTION_PORT, X_DIRECTION_BIT) | PORT_PIN(port, Y_DIRECTION_PORT, Y_DIRECTION_BIT) | \
+                             PORT_PIN(port, Z_DIRECTION_PORT, Z_DIRECTION_BIT) | X2_DIR_ON(port) | Y2_DIR_ON(port) | \
+                             Z2_DIR_ON(port) | A_DIR_ON(port) | B_DIR_ON(port) | C_DIR_ON(port) | \
+                             U_DIR_ON(port) | V_DIR_ON(port))
+
+// Port slots, GPIOA - GPIOK in address order.
+
+#define PORT_USED(pins, port) (pins(port) != 0)
+
+#define PORT_SLOT_A(pins) 0
+#define PORT_SLOT_B(pins) (PORT_SLOT_A(pins) + PORT_USED(pins, GPIOA))
+#define PORT_SLOT_C(pins) (PORT_SLOT_B(pins) + PORT_USED(pins, GPIOB))
+#define PORT_SLOT_D(pins) (PORT_SLOT_C(pins) + PORT_USED(pins, GPIOC))
+#define PORT_SLOT_E(pins) (PORT_SLOT_D(pins) + PORT_USED(pins, GPIOD))
+#define PORT_SLOT_F(pins) (PORT_SLOT_E(pins) + PORT_USED(pins, GPIOE))
+#define PORT_SLOT_G(pins) (PORT_SLOT_F(pins) + PORT_USED(pins, GPIOF))
+#define PORT_SLOT_H(pins) (PORT_SLOT_G(pins) + PORT_USED(pins, GPIOG))
+#ifdef GPIOI
+#define PORT_SLOT_I(pins) (PORT_SLOT_H(pins) + PORT_USED(pins, GPIOH))
+#endif
+#ifdef GPIOJ
+#define PORT_SLOT_J(pins) (PORT_SLOT_I(pins) + PORT_USED(pins, GPIOI))
+#endif
+#ifdef GPIOK
+#define PORT_SLOT_K(pins) (PORT_SLOT_J(pins) + PORT_USED(pins, GPIOJ))
+#endif
+
+#define STEP_PORT_SLOT(l) PORT_SLOT_##l(STEP_PORT_PINS)
+#define DIR_PORT_SLOT(l)  PORT_SLOT_##l(DIR_PORT_PINS)
+
+/*EOF*/
@@ -0,0 +1,29 @@
+/*
+  planner_dtcm.h - planner block buffer allocated in DTCM
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if PLANNER_DTCM_ENABLE
+
+// Bytes taken from the DTCM arena, its size and the number of planner allocations passed on to the heap.
+void planner_dtcm_get_stats (uint32_t *used, uint32_t *size, uint32_t *fallback);
+
+#endif
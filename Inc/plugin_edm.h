@@ -0,0 +1,125 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+/*
+ * Interface between Spark EDM plugin (plugin_edm.c) and the step generator
+ * in driver.c. Everything here may be called from the stepper interrupt.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Gap servo step period multiplier in Q16 fixed point.
+// 65536: programmed feed rate. Larger values slow down motion.
+extern volatile uint32_t edm_servo_period_q16;
+
+// Step rate profile after a direction reversal (EDM_RETRACT_PROFILE, M568),
+// rates in steps/s of the dominant axis. Retract ramps from v_start up to
+// v_retract regardless of the segment rate, re-advance ramps from v_start
+// until it reaches the segment rate. Set by the plugin, enabled last.
+typedef struct {
+  bool enabled;
+  float v_start;
+  float v_retract;
+  float accel2;  // 2 * acceleration, steps/s^2
+} edm_retract_profile_t;
+
+extern volatile edm_retract_profile_t edm_retract_profile;
+
+// Rebuilds the step period tables for the profile (STEP_PERIOD_DMA), called
+// with the profile disabled after it changed. Owned by the step generator.
+void edm_retract_profile_changed(void);
+
+// Retract vector in X, Y and Z (EDM_RETRACT_VECTOR, M574). Each step tick
+// of a retract adds rate_q16 to a per axis accumulator and steps that axis
+// when it passes 65536, the dominant axis has 65536 and steps every tick.
+// dir: bit set for the negative direction. Set by the plugin, enabled last.
+typedef struct {
+  bool enabled;
+  uint8_t dir;
+  uint32_t rate_q16[3];
+} edm_retract_vector_t;
+
+extern volatile edm_retract_vector_t edm_retract_vector;
+
+// Steps per axis the electrode is off the core's position after vector
+// retracts, worked off while going forward again. Owned by the step generator.
+extern volatile int32_t edm_retract_excursion[];
+
+// Notifies the plugin that a new motion block started executing.
+void edm_block_started(void);
+
+// Notifies the plugin that the first step in retract direction was emitted.
+void edm_retract_started(void);
+
+// Notifies the plugin that retract motion ended (normal direction resumed).
+void edm_retract_ended(void);
+
+// Stretches step timer period by current gap servo feed override, saturating.
+static inline __attribute__((always_inline)) uint32_t edm_servo_cycles(
+    uint32_t cycles_per_tick) {
+  uint64_t cycles = ((uint64_t)cycles_per_tick * edm_servo_period_q16) >> 16;
+  return cycles > UINT32_MAX ? UINT32_MAX : (uint32_t)cycles;
+}
+
+// True while the plugin needs the realtime loop at full rate: discharge
+// energized, log streaming or persisting, or PULSER polled from the loop.
+bool edm_active(void);
+
+// Turns the gate outputs off at once, from any context including interrupts
+// above the stepper priority, e.g. on a supply dip (power_loss.c). Register
+// writes only, the plugin state follows from the realtime loop.
+void edm_gate_force_off(void);
+
+// Recipe step in use (1-based, M565~M567), 0 when no recipe is running.
+uint8_t edm_recipe_step(void);
+
+// Latest EDM state for telemetry publishers (udp_telemetry.c).
+typedef struct {
+  uint32_t t_us;  // PULSER sample time, lower 32 bits of hal.get_micros()
+  uint8_t r_pulse;
+  uint8_t r_short;
+  uint8_t r_open;
+  bool energized;
+  bool retracting;
+  uint32_t servo_period_q16;  // edm_servo_period_q16
+  uint32_t pulses;            // since boot or job statistics reset
+  uint32_t shorts;
+  uint32_t retracts;
+  uint32_t cut_ms;  // energized time since boot
+  float energy_j;   // discharge energy estimate, persistent (M554 clears)
+} edm_telemetry_t;
+
+// Fills a snapshot from the foreground, cheap enough to call at 1kHz.
+void edm_get_telemetry(edm_telemetry_t* t);
+
+// PULSER sampling performance for the performance report (perf_dash.c).
+// Counters run since boot, readers take differences.
+#define EDM_PERF_LAT_BINS 16
+
+typedef struct {
+  uint32_t polls;       // samples processed
+  uint32_t poll_errs;
+  uint32_t poll_skips;  // previous poll still in flight
+  uint32_t poll_hz;     // sampling rate in use
+  // I2C poll start to completion, bin 0: < 1us, bin n: 2^(n-1)..2^n-1 us,
+  // the last bin holds everything longer.
+  uint32_t lat_hist[EDM_PERF_LAT_BINS];
+  uint32_t rlat_last_us;  // detect-to-retract latency
+  uint32_t rlat_max_us;
+  uint32_t rlat_count;
+} edm_perf_t;
+
+void edm_get_perf(edm_perf_t* p);
+
+// Packed log entry: t_us (LE), status_flags, r_open, r_short, r_pulse,
+// n_pulse.
+#define EDM_LOG_ENTRY_SIZE 9
+
+// Copies up to n newest log entries, oldest first, to buf. Plain memory
+// reads only, safe to call from a fault handler. Returns entries copied.
+uint32_t edm_log_tail(uint8_t* buf, uint32_t n);
+
+// Copies up to n (< 1000, the minimum log depth) entries added after entry number *seq,
+// oldest first, and advances *seq past them. Entries overwritten before they
+// were read are skipped, seq jumps accordingly. Foreground only.
+uint32_t edm_log_since(uint32_t* seq, uint8_t* buf, uint32_t n);
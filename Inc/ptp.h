@@ -0,0 +1,32 @@
+/*
+  ptp.h - IEEE 1588 (PTPv2) slave on the ETH MAC timestamp unit
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if PTP_ENABLE
+
+// PTP time (UTC when the master announces a valid UTC offset) with hal.get_micros() read at the
+// same instant. Returns false unless synchronized to a master, or in holdover for PTP_HOLDOVER_MS.
+bool ptp_stamp_get (rtc_stamp_t *stamp);
+// Registers $PTP and the UDP ports 319/320, call after enet_start().
+bool ptp_init (void);
+
+#endif // PTP_ENABLE
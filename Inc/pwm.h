@@ -41,3 +41,9 @@ bool pwm_enable (const pwm_signal_t *pwm);
 bool pwm_config (const pwm_signal_t *pwm, uint32_t prescaler, uint32_t period, bool inverted);
 bool pwm_is_available (GPIO_TypeDef *port, uint8_t pin);
 uint32_t pwm_get_clock_hz (const pwm_signal_t *pwm);
+
+// PWM_PROFILE_ENABLE
+bool pwm_profile_start (const pwm_signal_t *pwm, const uint32_t *points, uint_fast8_t n_points, uint32_t ms, bool loop);
+void pwm_profile_stop (const pwm_signal_t *pwm);
+bool pwm_profile_active (const pwm_signal_t *pwm);
+uint_fast16_t pwm_profile_info (uint32_t *hold, bool *loop);
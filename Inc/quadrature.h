@@ -0,0 +1,42 @@
+/*
+  quadrature.h - quadrature encoder position by timer encoder interface
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if QUADRATURE_ENABLE
+
+typedef struct {
+    int32_t position;           // counts (x4), from init or the last reset
+    int32_t index_position;     // position latched by the last index pulse
+    bool index_seen;            // index_position is valid
+    float velocity;             // counts/s, averaged over QUADRATURE_VELOCITY_MS
+} quadrature_data_t;
+
+// Claims the timer of the A/B (and index) pins, returns false if they are not channels 1 and 2
+// (and 3) of the same 32-bit timer or it is not available.
+bool quadrature_init (void);
+// Counts (x4), a single register read. Safe from any context.
+int32_t quadrature_get_position (void);
+// Position within the revolution, 0 .. QUADRATURE_PPR * 4 - 1, counted from the last index pulse.
+uint32_t quadrature_get_angle (void);
+void quadrature_get_data (quadrature_data_t *data);
+
+#endif
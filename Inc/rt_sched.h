@@ -0,0 +1,54 @@
+/*
+  rt_sched.h - periodic tasks run from the realtime loop
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if RT_SCHED_ENABLE
+
+typedef void (*rt_task_fn)(void *context);
+
+// Task descriptor, owned by the caller (static storage) and linked in by rt_task_register().
+// Set name, fn, context, period_us, budget_us and priority, the rest is maintained by the scheduler.
+typedef struct rt_task {
+    const char *name;
+    rt_task_fn fn;
+    void *context;
+    uint32_t period_us;         // 0: run on every pass of the realtime loop
+    uint32_t budget_us;         // expected worst case run time, 0: not checked
+    uint8_t priority;           // 0 is highest, runs first when several tasks are due
+    volatile bool suspended;    // skipped without a call while set, owned by the caller
+    // statistics
+    uint32_t due_us;
+    uint32_t runs;
+    uint32_t late;              // started more than a period after it was due
+    uint32_t overruns;          // ran longer than budget_us
+    uint32_t deferred;          // postponed to a later pass, pass budget used up
+    uint32_t max_us;            // longest run time
+    uint32_t max_lag_us;        // longest start delay after due
+    struct rt_task *next;
+} rt_task_t;
+
+// Adds a task, the first run is one period from now or on the next pass for period 0. Returns
+// false if the task is already registered, has no function or RT_SCHED_MAX_HOOKS is reached.
+bool rt_task_register (rt_task_t *task);
+void rt_sched_init (void);
+
+#endif
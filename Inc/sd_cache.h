@@ -0,0 +1,33 @@
+/*
+  sd_cache.h - LRU sector cache for the FatFs FAT and directory window
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+// Included by ff.c, do not add driver.h.
+
+#include "ff.h"
+#include "diskio.h"
+
+// Called by ff.c in place of disk_initialize(), disk_write() and the sector window disk_read().
+DSTATUS sd_cache_initialize (BYTE pdrv);
+DRESULT sd_cache_read (BYTE pdrv, BYTE *buff, LBA_t sector, UINT count);
+DRESULT sd_cache_write (BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count);
+
+// Registers $SDCACHE, call after sdcard_init().
+void sd_cache_init (void);
@@ -0,0 +1,45 @@
+/*
+  sd_stream.h - SD card program streaming with double buffered read-ahead
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if SD_STREAM_ENABLE
+
+#include "fs_index.h"
+
+// Called once when a run started by sd_stream_run() ends, completed is false when it was
+// aborted by a reset or a read error. Called from the parser's stream read, flag work only.
+typedef void (*sd_stream_on_end_ptr)(bool completed);
+
+// Registers $FS, call after sdcard_init().
+void sd_stream_init (void);
+// Runs a file as $FS does. The preamble, LF terminated G-code lines or NULL, is fed to the parser
+// ahead of the file and must stay valid while the run is active.
+status_code_t sd_stream_run (const char *name, const char *preamble, sd_stream_on_end_ptr on_end);
+// Name and lines read by the parser of the running job, false if none. Plain reads only,
+// may be called from an interrupt.
+bool sd_stream_progress (const char **name, uint32_t *lines);
+#if FS_INDEX_ENABLE
+// Runs a file from a checkpoint as $FSR does, e.g. one saved over a power loss.
+status_code_t sd_stream_resume_at (const char *name, const fs_checkpoint_t *cp);
+#endif
+
+#endif
@@ -38,6 +38,22 @@
 
 #pragma once
 
+#include "driver.h"
+
 void serialRegisterStreams (void);
 
+#if MODBUS_DMA_ENABLE
+
+typedef struct {
+    USART_TypeDef *uart;
+    uint32_t clock;             // kernel clock, Hz
+    uint32_t dma_rx_request;
+    uint32_t dma_tx_request;
+    IRQn_Type irq;
+} serial_raw_port_t;
+
+bool serialClaimRaw (uint8_t instance, serial_raw_port_t *raw);
+
+#endif
+
 /*EOF*/
@@ -29,5 +29,38 @@ uint8_t spi_get_byte (void);
 uint8_t spi_put_byte (uint8_t byte);
 void spi_write (uint8_t *data, uint16_t len);
 void spi_read (uint8_t *data, uint16_t len);
+void spi_transfer (uint8_t *tx, uint8_t *rx, uint16_t len);
+
+// Completion callback for non-blocking transfers, called from interrupt context.
+typedef void (*spi_complete_ptr)(bool ok, void *context);
+
+typedef struct spi_transaction {
+    uint8_t *tx;                    // NULL for receive only
+    uint8_t *rx;                    // NULL for transmit only, should be cache aligned to be eligible for DMA
+    uint16_t len;
+    GPIO_TypeDef *cs_port;          // optional chip select, asserted (low) for the duration of the transfer
+    uint8_t cs_pin;
+    spi_complete_ptr callback;
+    void *context;
+    struct spi_transaction *next;   // used by the queue
+} spi_transaction_t;
+
+bool spi_transfer_async (spi_transaction_t *transaction);
+bool spi_busy (void);
+
+// Transfer counters, RX buffers that are not cache aligned are bounced through a scratch buffer
+// (spi_read) or fall back to polled/interrupt mode (spi_transfer, spi_transfer_async).
+// Use dma_buffer_alloc() or cache_aligned_calloc() for RX buffers to avoid this.
+typedef struct {
+    uint32_t tx_dma;
+    uint32_t tx_poll;
+    uint32_t rx_dma;
+    uint32_t rx_poll;
+    uint32_t rx_bounce;
+    uint32_t rx_bounce_bytes;
+    uint32_t rx_unaligned;
+} spi_stats_t;
+
+void spi_get_stats (spi_stats_t *stats, bool reset);
 
 #endif
@@ -31,9 +31,19 @@
 
 // Public function prototypes
 void spiflash_init(void);
+#if SPIFLASH_XIP
+void spiflash_xip_init(void);
+#endif
 int  spiflash_read(uint32_t offset, uint8_t *buffer, size_t buffer_size);
 int  spiflash_program(uint32_t offset, const uint8_t *buffer, size_t buffer_size);
 int  spiflash_sector_erase(uint32_t address);
+#if SPIFLASH_ASYNC
+// Queued, return false when the queue is full. Done in the background, see spiflash.c.
+bool spiflash_sector_erase_async(uint32_t address);
+bool spiflash_program_async(uint32_t offset, const uint8_t *buffer, size_t buffer_size);
+bool spiflash_busy(void);
+int  spiflash_flush(void);
+#endif
 
 // SPI flash settings
 #ifndef SPIFLASH_BASE_ADDRESS
@@ -44,6 +54,16 @@ int  spiflash_sector_erase(uint32_t address);
 #define SPIFLASH_MEMORY_MAPPED  1
 #endif
 
+// Read mode: 0 = fastest detected (SFDP), 1 = 1-4-4 SDR, 2 = try 1-4-4 DTR even without SFDP
+#ifndef SPIFLASH_READ_MODE
+#define SPIFLASH_READ_MODE      0
+#endif
+
+// Mode + dummy clocks of Fast Read Quad I/O DTR (0xED)
+#ifndef SPIFLASH_DTR_DUMMY
+#define SPIFLASH_DTR_DUMMY      8
+#endif
+
 #ifndef SPIFLASH_SIZE
 #define SPIFLASH_SIZE           32        // 32 Mb = 4 MB
 #endif
@@ -163,6 +183,7 @@ typedef struct {
     lines_t            addr_lines  : 2; // Address Lines
     addr_size_t        addr_size   : 2; // Address Size
     uint8_t            data_lines  : 2; // Data Lines
+    uint8_t            dtr         : 1; // Address and data phases DTR
     uint8_t            dummy;           // Dummy Cycles
 } flash_cmd_t;
 
@@ -191,6 +212,7 @@ enum {
 
     CMD_PP,         // Page Program
     CMD_READ,       // Read Data Bytes
+    CMD_RDSFDP,     // Read SFDP parameters
 
     CMD_COUNT,
 };
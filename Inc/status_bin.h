@@ -0,0 +1,33 @@
+/*
+  status_bin.h - compact binary realtime status report
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if STATUS_BINARY_ENABLE
+
+#ifndef STATUS_BINARY_CMD
+#define STATUS_BINARY_CMD 0xB0  // realtime command requesting a frame, must be in the 0x80 - 0xBF range
+#endif
+
+// Registers $STATBIN and the STATUS_BINARY_CMD realtime command.
+void status_bin_init (void);
+
+#endif
@@ -219,8 +219,17 @@
 #define  USE_HAL_WWDG_REGISTER_CALLBACKS    0U /* WWDG register callback disabled    */
 
 /* ########################### Ethernet Configuration ######################### */
+/* Descriptor rings live in the 512 byte .RxDecripSection/.TxDecripSection areas of the
+   linker scripts, 24 bytes per descriptor (ETH_DMADescTypeDef): at most 21 each */
+#ifndef ETH_TX_DESC_CNT
 #define ETH_TX_DESC_CNT        12  /* number of Ethernet Tx DMA descriptors */
+#endif
+#ifndef ETH_RX_DESC_CNT
 #define ETH_RX_DESC_CNT         4  /* number of Ethernet Rx DMA descriptors */
+#endif
+#if ETH_TX_DESC_CNT > 21 || ETH_RX_DESC_CNT > 21
+#error "ETH descriptor rings do not fit the 512 byte descriptor sections!"
+#endif
 
 #define ETH_MAC_ADDR0    (0x02UL)
 #define ETH_MAC_ADDR1    (0x00UL)
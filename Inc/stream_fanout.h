@@ -0,0 +1,77 @@
+/*
+  stream_fanout.h - non-blocking output to secondary streams
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Output written to a stream that is not the active input stream (hal.stream), e.g. messages
+  sent to all connected clients, never waits for buffer space. The stream drivers check each
+  write against their free output space and drop whole lines instead of calling
+  hal.stream_blocking_callback(): a line is only started with STREAM_FANOUT_RESERVE characters
+  free, if a part of a started line does not fit the rest of the line is dropped. Lines are
+  assumed to end with ASCII_EOL at the end of a write, as the core writes them.
+
+  The active stream keeps the blocking behaviour, so a stuck monitoring client cannot stall
+  the controller or the G-code stream.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if STREAM_FANOUT_NONBLOCK
+
+#include "grbl/hal.h"
+
+#ifndef STREAM_FANOUT_RESERVE
+#define STREAM_FANOUT_RESERVE 128
+#endif
+
+typedef struct {
+    bool dropping;      // rest of the current line is dropped
+    bool mid_line;      // last write did not end a line
+    uint32_t dropped;   // lines dropped, whole or in part
+} stream_fanout_t;
+
+// Returns true if length characters from s are to be written to a secondary stream
+// with free characters of output buffer space.
+static inline bool stream_fanout_accept (stream_fanout_t *fanout, const char *s, uint16_t length, uint16_t free)
+{
+    bool eol;
+
+    if(length == 0)
+        return true;
+
+    eol = s[length - 1] == '\n';
+
+    if(!fanout->dropping && (length > free || (!fanout->mid_line && free < STREAM_FANOUT_RESERVE))) {
+        fanout->dropping = true;
+        fanout->dropped++;
+    }
+
+    if(fanout->dropping) {
+        fanout->dropping = !eol;
+        fanout->mid_line = false;
+        return false;
+    }
+
+    fanout->mid_line = !eol;
+
+    return true;
+}
+
+#endif // STREAM_FANOUT_NONBLOCK
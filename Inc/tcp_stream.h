@@ -0,0 +1,33 @@
+/*
+  tcp_stream.h - raw TCP G-code stream with zero-copy receive
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if TCP_STREAM_ENABLE
+
+#ifndef TCP_STREAM_PORT
+#define TCP_STREAM_PORT 2323
+#endif
+
+// Starts listening on TCP_STREAM_PORT, call once the lwIP stack is initialized (after enet_start()).
+bool tcp_stream_init (void);
+
+#endif
@@ -24,10 +24,63 @@
 
 /* Internal API */
 
+typedef enum {
+    TimerEvent_Update = 0,
+    TimerEvent_CC1,
+    TimerEvent_CC2,
+    TimerEvent_CC3,
+    TimerEvent_CC4
+} timer_event_t;
+
+typedef enum {
+    TimerCapture_Rising = 0,
+    TimerCapture_Falling,
+    TimerCapture_Both
+} timer_capture_edge_t;
+
+typedef struct {
+    bool indirect;                  // capture the input of the paired channel (TI2 for CC1, TI1 for CC2, ...)
+    timer_capture_edge_t edge;
+    uint8_t filter;                 // ICxF, 0 - 15
+    uint8_t prescaler;              // ICxPSC, capture every 1, 2, 4 or 8 events (0 - 3)
+} timer_capture_t;
+
+// TRGO source, values are CR2 MMS.
+typedef enum {
+    TimerTrgo_Reset = 0,
+    TimerTrgo_Enable = 1,
+    TimerTrgo_Update = 2,
+    TimerTrgo_CC1 = 3,
+    TimerTrgo_OC1Ref = 4,
+    TimerTrgo_OC2Ref = 5,
+    TimerTrgo_OC3Ref = 6,
+    TimerTrgo_OC4Ref = 7
+} timer_trgo_t;
+
+// Slave mode, values are SMCR SMS.
+typedef enum {
+    TimerSlave_Off = 0,
+    TimerSlave_Reset = 4,
+    TimerSlave_Gated = 5,
+    TimerSlave_Trigger = 6,
+    TimerSlave_ExternalClock = 7
+} timer_slave_mode_t;
+
 bool timer_claim (TIM_TypeDef *timer);
 bool timer_is_claimed (TIM_TypeDef *timer);
 uint32_t timer_clk_enable (TIM_TypeDef *timer);
 uint32_t timer_get_clock_hz (TIM_TypeDef *timer);
+TIM_TypeDef *timer_get_instance (hal_timer_t timer);
+// Configures channel (1 - 4) for input capture and enables it.
+bool timer_capture_cfg (TIM_TypeDef *timer, uint_fast8_t channel, const timer_capture_t *cfg);
+// Returns the DMAMUX request of event, 0 if the timer has none.
+uint32_t timer_dma_request (TIM_TypeDef *timer, timer_event_t event);
+bool timer_dma_enable (TIM_TypeDef *timer, timer_event_t event, bool on);
+// Sets up a DMA burst of count transfers through DMAR starting at reg, e.g. &timer->CCR1.
+bool timer_dma_burst (TIM_TypeDef *timer, volatile uint32_t *reg, uint_fast8_t count);
+bool timer_trgo_cfg (TIM_TypeDef *timer, timer_trgo_t trgo);
+// Slaves timer to the TRGO of master, returns false if master is not one of its internal triggers.
+bool timer_slave_cfg (TIM_TypeDef *timer, TIM_TypeDef *master, timer_slave_mode_t mode);
 
 /* HAL API */
 
@@ -0,0 +1,33 @@
+/*
+  tmc_mres.h - speed dependent TMC2209 microstep resolution switching
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if TMC_MRES_SWITCH_ENABLE
+
+#include "grbl/hal.h"
+
+// Called from the step pulse start handlers before the outputs are set, rewrites stepper->step_out
+// to the pulses to be output at the current driver resolution.
+void tmc_mres_step_filter (stepper_t *stepper);
+void tmc_mres_init (void);
+
+#endif
@@ -0,0 +1,32 @@
+/*
+  tmc_spi.h - daisy chained Trinamic SPI driver access
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if TRINAMIC_SPI_ENABLE && TRINAMIC_SPI_CHAIN
+
+#include "trinamic/common.h"
+
+// Read a register from every driver in the chain, datagram[n] holds the address for motor n
+// on entry and the register value on return. status may be NULL.
+TMC_spi_status_t tmc_spi_read_all (TMC_spi_datagram_t datagram[], TMC_spi_status_t status[]);
+
+#endif
@@ -0,0 +1,52 @@
+/*
+  tmc_uart.h - non-blocking TMC2209 register access
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if TRINAMIC_UART_ENABLE
+
+// True while a datagram is being bit-banged, interrupt driven users of other buses hold off then.
+// Always false with TMC_UART_DMA.
+bool tmc_uart_busy (void);
+
+#if TMC_UART_DMA
+
+#ifndef TMC_UART_QUEUE_SIZE
+#define TMC_UART_QUEUE_SIZE 16 // power of 2
+#endif
+
+// Completion callback for queued register accesses, called from interrupt context.
+// value is the register content for reads, ok is false on timeout or CRC error.
+typedef void (*tmc_uart_complete_ptr)(uint8_t motor, bool ok, uint8_t reg, uint32_t value, void *context);
+
+// Queue a register read or write for motor (0 - X, 1 - Y, ...), returns false if the queue is full.
+// Requests are executed in order in the background, interleaved with blocking accesses.
+bool tmc_uart_read_async (uint8_t motor, uint8_t reg, tmc_uart_complete_ptr callback, void *context);
+bool tmc_uart_write_async (uint8_t motor, uint8_t reg, uint32_t value, tmc_uart_complete_ptr callback, void *context);
+
+#if TMC_UART_SHADOW
+// Copy of a configuration register (GCONF, IHOLD_IRUN, CHOPCONF or PWMCONF), returns false if not known.
+bool tmc_uart_shadow_get (uint8_t motor, uint8_t reg, uint32_t *value);
+#endif
+
+#endif // TMC_UART_DMA
+
+#endif
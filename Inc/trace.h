@@ -0,0 +1,79 @@
+/*
+  trace.h - binary event trace over ITM stimulus ports or an RTT channel
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+
+#include "driver.h"
+
+#if TRACE_ENABLE
+
+#if CRASH_DUMP_ENABLE
+#include "crash_dump.h"
+#endif
+
+typedef enum {
+    TraceEvent_Segment = 0,     // stepper segment loaded, payload cycles per step tick
+    TraceEvent_RetractOn,       // payload retract count
+    TraceEvent_RetractOff,      // payload retract duration (us)
+    TraceEvent_EdmPoll,         // PULSER sample, payload n_pulse | r_pulse << 8 | r_short << 16 | r_open << 24
+    TraceEvent_StreamRx,        // USB CDC packet received, payload length
+    TraceEvent_N
+} trace_event_t;
+
+extern uint32_t trace_dropped;
+
+#if TRACE_BACKEND == 1
+
+// ITM stimulus port TRACE_ITM_PORT + id, one 32-bit write. Events are dropped, not waited for,
+// when the port FIFO is full or tracing is not enabled by the debugger.
+#define TRACE_ITM_PORT 8
+
+static inline __attribute__((always_inline)) void trace_event (trace_event_t id, uint32_t payload)
+{
+    uint32_t port = TRACE_ITM_PORT + id;
+
+#if CRASH_DUMP_ENABLE
+    crash_dump_trace(id, payload);
+#endif
+
+    if((ITM->TCR & ITM_TCR_ITMENA_Msk) && (ITM->TER & (1UL << port)) && ITM->PORT[port].u32)
+        ITM->PORT[port].u32 = payload;
+    else
+        trace_dropped++;
+}
+
+#else
+
+void trace_event (trace_event_t id, uint32_t payload);
+
+#endif
+
+void trace_init (void);
+
+#define TRACE(id, payload) trace_event(id, payload)
+
+#else
+
+#define TRACE(id, payload)
+
+#endif // TRACE_ENABLE
+
+/*EOF*/
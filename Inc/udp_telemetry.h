@@ -0,0 +1,34 @@
+/*
+  udp_telemetry.h - periodic binary UDP broadcast of motion and EDM state
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if UDP_TELEMETRY_ENABLE
+
+#ifndef UDP_TELEMETRY_PORT
+#define UDP_TELEMETRY_PORT 5555
+#endif
+
+// Registers $UDPTLM and starts broadcasting at UDP_TELEMETRY_HZ, call once the lwIP stack is
+// initialized (after enet_start()).
+bool udp_telemetry_init (void);
+
+#endif
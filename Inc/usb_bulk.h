@@ -0,0 +1,36 @@
+/*
+  usb_bulk.h - vendor bulk IN interface next to the USB CDC for binary telemetry
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if USB_BULK_ENABLE
+
+#ifndef USB_BULK_BUFFER_SIZE
+#define USB_BULK_BUFFER_SIZE 8192   // transmit ring buffer, power of 2
+#endif
+
+// Queues a frame for the bulk IN endpoint, sent from the realtime loop. The frame is queued whole
+// or not at all: returns false when the host is not connected or not reading. Foreground only.
+bool usb_bulk_write (const void *data, uint32_t len);
+// Registers $USBTLM and $USBLOG, call after usbInit().
+bool usb_bulk_init (void);
+
+#endif // USB_BULK_ENABLE
@@ -0,0 +1,29 @@
+/*
+  w5x00_spi.h - WIZnet W5x00 socket buffer bursts as queued SPI DMA transfers
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if W5X00_SPI_BURST
+
+// Replaces the ioLibrary burst callbacks, call after wizchip_initialize() (enet_start()).
+void w5x00_spi_init (void);
+
+#endif
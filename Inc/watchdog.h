@@ -0,0 +1,60 @@
+/*
+  watchdog.h - independent watchdog fed on per-subsystem liveness
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "driver.h"
+
+#if WATCHDOG_ENABLE
+
+#ifndef WATCHDOG_CLIENTS
+#define WATCHDOG_CLIENTS 8
+#endif
+
+typedef uint_fast8_t watchdog_id_t;
+
+typedef struct {
+    const char *name;
+    uint32_t deadline_ms;
+    volatile bool armed;
+    volatile uint32_t alive_ms;
+} watchdog_client_t;
+
+extern watchdog_client_t watchdog_clients[WATCHDOG_CLIENTS + 1]; // last entry is a sink for registrations that do not fit
+extern __IO uint32_t uwTick;
+
+// Reports liveness, cheap enough for interrupt handlers.
+static inline __attribute__((always_inline)) void watchdog_alive (watchdog_id_t id)
+{
+    watchdog_clients[id].alive_ms = uwTick;
+}
+
+// Registers a subsystem that must report liveness within deadline_ms while armed,
+// returns an id for watchdog_alive() and watchdog_arm().
+watchdog_id_t watchdog_register (const char *name, uint32_t deadline_ms, bool armed);
+// Starts or stops deadline checking, arming counts as a liveness report.
+void watchdog_arm (watchdog_id_t id, bool on);
+// Allows the foreground to block for up to ms, for known long operations such as flash erases.
+void watchdog_extend (uint32_t ms);
+void watchdog_init (void);
+
+#endif
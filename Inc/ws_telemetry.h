@@ -0,0 +1,34 @@
+/*
+  ws_telemetry.h - WebSocket G-code stream with a binary telemetry channel
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+
+#if WS_TELEMETRY_ENABLE
+
+#ifndef WS_TELEMETRY_PORT
+#define WS_TELEMETRY_PORT 8081
+#endif
+
+// Starts listening on WS_TELEMETRY_PORT and registers $WSTLM, call once the lwIP stack is
+// initialized (after enet_start()).
+bool ws_telemetry_init (void);
+
+#endif
@@ -23,6 +23,15 @@
 #include "ff.h"			/* Declarations of FatFs API */
 #include "diskio.h"		/* Declarations of device I/O functions */
 
+#if SD_CACHE_ENABLE
+#include "sd_cache.h"		/* Sector cache for the FAT and directory window */
+#define disk_initialize(pdrv) sd_cache_initialize(pdrv)
+#define disk_write(pdrv, buff, sector, count) sd_cache_write(pdrv, buff, sector, count)
+#define window_read sd_cache_read
+#else
+#define window_read disk_read
+#endif
+
 
 /*--------------------------------------------------------------------------
 
@@ -1057,7 +1066,7 @@ static FRESULT move_window (	/* Returns FR_OK or FR_DISK_ERR */
 		res = sync_window(fs);		/* Flush the window */
 #endif
 		if (res == FR_OK) {			/* Fill sector window with new data */
-			if (disk_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
+			if (window_read(fs->pdrv, fs->win, sect, 1) != RES_OK) {
 				sect = (LBA_t)0 - 1;	/* Invalidate window if read data is not valid */
 				res = FR_DISK_ERR;
 			}
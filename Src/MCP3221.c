@@ -25,10 +25,92 @@
 
 #ifdef MCP3221_ENABLE
 
+/*
+  With MCP3221_SAMPLE_RATE > 0 the ADC is read continuously in the background through the
+  asynchronous I2C queue, paced from the realtime loop. MCP3221_read() then returns the moving
+  average of the last MCP3221_RING_SIZE samples immediately, without a bus transfer.
+*/
+
 #include "i2c.h"
 #include "MCP3221.h"
+#include "grbl/hal.h"
 
-uint16_t MCP3221_read (void)
+#ifndef MCP3221_SAMPLE_RATE
+#define MCP3221_SAMPLE_RATE 200 // Hz, 0 to disable background sampling
+#endif
+#ifndef MCP3221_RING_SIZE
+#define MCP3221_RING_SIZE   16  // power of 2, moving average length
+#endif
+
+#if (MCP3221_RING_SIZE & (MCP3221_RING_SIZE - 1)) != 0
+#error "MCP3221_RING_SIZE must be a power of 2!"
+#endif
+
+#if MCP3221_SAMPLE_RATE
+
+typedef struct {
+    volatile bool busy;
+    uint8_t data[2];
+    uint_fast8_t head;
+    volatile uint_fast8_t count;
+    volatile uint32_t sum;
+    uint16_t sample[MCP3221_RING_SIZE];
+    uint32_t last_us;
+    i2c_transaction_t transaction;
+} mcp3221_sampler_t;
+
+static mcp3221_sampler_t sampler = {0};
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+
+// Called from interrupt context when a background read has completed.
+static void sample_complete (bool ok, void *context)
+{
+    if(ok) {
+
+        uint16_t value = ((sampler.data[0] << 8) | sampler.data[1]) & 0x0FFF;
+
+        if(sampler.count == MCP3221_RING_SIZE)
+            sampler.sum -= sampler.sample[sampler.head];
+        else
+            sampler.count++;
+
+        sampler.sample[sampler.head] = value;
+        sampler.sum += value;
+        sampler.head = (sampler.head + 1) & (MCP3221_RING_SIZE - 1);
+    }
+
+    sampler.busy = false;
+}
+
+static void sample_poll (void)
+{
+    uint32_t now = (uint32_t)hal.get_micros();
+
+    if(!sampler.busy && now - sampler.last_us >= 1000000UL / MCP3221_SAMPLE_RATE) {
+        sampler.last_us = now;
+        sampler.busy = true;
+        if(!i2c_queue_transaction(&sampler.transaction))
+            sampler.busy = false;
+    }
+}
+
+static void sample_execute_realtime (sys_state_t state)
+{
+    sample_poll();
+
+    on_execute_realtime(state);
+}
+
+static void sample_execute_delay (sys_state_t state)
+{
+    sample_poll();
+
+    on_execute_delay(state);
+}
+
+#endif // MCP3221_SAMPLE_RATE
+
+static uint16_t read_blocking (void)
 {
     uint8_t value[2];
 
@@ -37,9 +119,48 @@ uint16_t MCP3221_read (void)
     return (value[0] << 8) | value[1];
 }
 
+// Returns the filtered value when background sampling is active, else reads the ADC.
+uint16_t MCP3221_read (void)
+{
+#if MCP3221_SAMPLE_RATE
+    uint32_t sum;
+    uint_fast8_t count;
+
+    __disable_irq();
+    sum = sampler.sum;
+    count = sampler.count;
+    __enable_irq();
+
+    if(count)
+        return (uint16_t)((sum + (count >> 1)) / count);
+#endif
+
+    return read_blocking();
+}
+
 bool MCP3221_init (void)
 {
-    return i2c_start().ok && i2c_probe(MCP3221_ENABLE);
+    bool ok = i2c_start().ok && i2c_probe(MCP3221_ENABLE);
+
+#if MCP3221_SAMPLE_RATE
+    if(ok) {
+
+        sampler.transaction.op = I2C_OpReceive;
+        sampler.transaction.priority = I2C_PriorityLow;
+        sampler.transaction.address = MCP3221_ENABLE;
+        sampler.transaction.data = sampler.data;
+        sampler.transaction.count = 2;
+        sampler.transaction.callback = sample_complete;
+
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = sample_execute_realtime;
+
+        on_execute_delay = grbl.on_execute_delay;
+        grbl.on_execute_delay = sample_execute_delay;
+    }
+#endif
+
+    return ok;
 }
 
 #endif
@@ -0,0 +1,121 @@
+/*
+
+  boot_profile.c - DWT cycle counter based boot timeline
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  BOOT_MARK(<name>) calls in main(), driver_init() and driver_setup() timestamp the end of each
+  init phase with the DWT cycle counter, which main() starts first thing. The time of a phase is
+  converted with the core clock at its start, so the clock configuration phase is counted at the
+  HSI clock it mostly runs at. The time from reset to main() (startup code, .data/.bss init) is
+  not included.
+
+  The "ready" mark is taken on the first run of the realtime loop, i.e. when the controller
+  starts to take commands. Phases deferred by BOOT_DEFER_INIT are marked when their foreground
+  task has run, after "ready".
+
+  $BOOT - report the timeline, times in microseconds from main():
+          [BOOT|<phase>,t=<end>,dt=<duration>]
+*/
+
+#include "driver.h"
+#include "boot_profile.h"
+
+#if BOOT_PROFILE_ENABLE
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#ifndef BOOT_PROFILE_MARKS
+#define BOOT_PROFILE_MARKS 32
+#endif
+
+typedef struct {
+    const char *name;
+    uint32_t t_us;
+} boot_mark_t;
+
+typedef struct {
+    uint_fast8_t n;
+    bool ready;
+    uint32_t cycles;            // DWT->CYCCNT at the last mark
+    uint32_t t_us;
+    boot_mark_t mark[BOOT_PROFILE_MARKS];
+} boot_profile_t;
+
+static boot_profile_t boot = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+void boot_profile_mark (const char *name)
+{
+    uint32_t cycles = DWT->CYCCNT;
+
+    boot.t_us += (cycles - boot.cycles) / (SystemCoreClock / 1000000UL);
+    boot.cycles = cycles;
+
+    if(boot.n < BOOT_PROFILE_MARKS) {
+        boot.mark[boot.n].name = name;
+        boot.mark[boot.n++].t_us = boot.t_us;
+    }
+}
+
+static void boot_profile_execute_realtime (sys_state_t state)
+{
+    if(!boot.ready) {
+        boot.ready = true;
+        boot_profile_mark("ready");
+    }
+
+    on_execute_realtime(state);
+}
+
+static status_code_t boot_profile_report (sys_state_t state, char *args)
+{
+    char buf[60];
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < boot.n; idx++) {
+        snprintf(buf, sizeof(buf), "[BOOT|%s,t=%lu,dt=%lu]" ASCII_EOL, boot.mark[idx].name, boot.mark[idx].t_us,
+                  boot.mark[idx].t_us - (idx ? boot.mark[idx - 1].t_us : 0));
+        hal.stream.write(buf);
+    }
+
+    return Status_OK;
+}
+
+void boot_profile_init (void)
+{
+    static const sys_command_t boot_command_list[] = {
+        {"BOOT", boot_profile_report, { .noargs = On }, { .str = "report the boot timeline" } }
+    };
+
+    static sys_commands_t boot_commands = {
+        .n_commands = sizeof(boot_command_list) / sizeof(sys_command_t),
+        .commands = boot_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = boot_profile_execute_realtime;
+
+    system_register_commands(&boot_commands);
+}
+
+#endif // BOOT_PROFILE_ENABLE
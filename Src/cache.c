@@ -161,3 +161,71 @@ void cache_aligned_free(void* ptr)
     free(p);
     }
 }
+
+/*
+ * DMA safe buffer pool.
+ *
+ * Callers that know up front they will pass a buffer to DMA (e.g. filesystem sector buffers)
+ * can take it from here instead of the heap, so drivers can use it directly without bouncing
+ * through a scratch buffer. Blocks are carved from a single cache_aligned_calloc() allocation
+ * made on first use, or from the non-cacheable DMA arena when enabled. Requests larger than a
+ * block or made when the pool is exhausted fall back to cache_aligned_calloc().
+ *
+ * Buffers **must** be returned with dma_buffer_free().
+ */
+
+#if (DMA_BUFFER_POOL_BLOCK_SIZE % __SCB_DCACHE_LINE_SIZE) != 0 || DMA_BUFFER_POOL_BLOCKS > 32
+#error "DMA_BUFFER_POOL_BLOCK_SIZE must be a multiple of the cache line size and DMA_BUFFER_POOL_BLOCKS max 32!"
+#endif
+
+#if DMA_ARENA_ENABLE
+static uint8_t dma_pool_arena[DMA_BUFFER_POOL_BLOCKS * DMA_BUFFER_POOL_BLOCK_SIZE] DMA_BUFFER;
+static uint8_t *dma_pool = dma_pool_arena;
+#else
+static uint8_t *dma_pool = NULL;
+#endif
+static volatile uint32_t dma_pool_used = 0; // bitmask of allocated blocks
+
+void* dma_buffer_alloc(size_t size)
+{
+    void* ptr = NULL;
+    uint_fast8_t block;
+
+    if(size == 0)
+        return NULL;
+
+    if(size <= DMA_BUFFER_POOL_BLOCK_SIZE) {
+
+        if(dma_pool == NULL)
+            dma_pool = cache_aligned_calloc(DMA_BUFFER_POOL_BLOCKS, DMA_BUFFER_POOL_BLOCK_SIZE);
+
+        if(dma_pool) {
+            __disable_irq();
+            for(block = 0; block < DMA_BUFFER_POOL_BLOCKS; block++) {
+                if(!(dma_pool_used & (1 << block))) {
+                    dma_pool_used |= (1 << block);
+                    ptr = dma_pool + block * DMA_BUFFER_POOL_BLOCK_SIZE;
+                    break;
+                }
+            }
+            __enable_irq();
+
+            if(ptr)
+                memset(ptr, 0, size);
+        }
+    }
+
+    return ptr ? ptr : cache_aligned_calloc(1, size);
+}
+
+void dma_buffer_free(void* ptr)
+{
+    uint32_t offset;
+
+    if(dma_pool && (uint8_t*)ptr >= dma_pool && (offset = (uint8_t*)ptr - dma_pool) < DMA_BUFFER_POOL_BLOCKS * DMA_BUFFER_POOL_BLOCK_SIZE) {
+        __disable_irq();
+        dma_pool_used &= ~(1 << (offset / DMA_BUFFER_POOL_BLOCK_SIZE));
+        __enable_irq();
+    } else
+        cache_aligned_free(ptr);
+}
@@ -24,17 +24,147 @@
 
 #include "driver.h"
 #include <stdio.h>
+#include <string.h>
 
 #ifdef CAN_PORT
 
 #define CAN_MAX_FILTERS 32
 
+#include "grbl/hal.h"
 #include "grbl/task.h"
+#include "grbl/system.h"
 #include "grbl/canbus.h"
 
+/*
+  Message RAM: CAN_RX_FIFO_SIZE elements in RX FIFO 0, CAN_RX_BUFFERS dedicated RX buffers and
+  CAN_TX_FIFO_SIZE elements in the TX FIFO. Elements are 4 words (8 data bytes) or, with
+  CAN_FD_ENABLE, 18 words (64 bytes); the layout must fit the 2560 words of message RAM together
+  with the filters (a word per standard, two per extended ID filter).
+
+  The dedicated RX buffers are for high priority IDs added with can_add_buffer_filter(), a frame
+  for them is not lost when the FIFO overflows during a burst.
+
+  The interrupt handler drains all pending frames of the FIFO and the buffers into a lock-free
+  queue of CAN_RX_QUEUE_SIZE messages, the realtime loop hands them on to the core rx_enqueue
+  function. Frames lost by a full FIFO or queue are counted, as are bus errors.
+
+  Bit timings are calculated from the FDCAN kernel clock for the requested baud rate, with the
+  sample point at CAN_SAMPLE_POINT (CAN_FD_DATA_SAMPLE_POINT for the FD data phase). A baud rate
+  change restarts the peripheral, the filters and their callbacks are kept.
+
+  $CAN[=R] - [CAN|rx=,fifo_lost=,queue_drop=,bus_off=,passive=,warning=,proto=,tec=,rec=]
+*/
+
+#ifndef CAN_RX_FIFO_SIZE
+#define CAN_RX_FIFO_SIZE 32     // max 64
+#endif
+#ifndef CAN_RX_BUFFERS
+#define CAN_RX_BUFFERS 4        // max 64
+#endif
+#ifndef CAN_TX_FIFO_SIZE
+#define CAN_TX_FIFO_SIZE 16     // max 32
+#endif
+#ifndef CAN_RX_QUEUE_SIZE
+#define CAN_RX_QUEUE_SIZE 64    // power of 2
+#endif
+#ifndef CAN_SAMPLE_POINT
+#define CAN_SAMPLE_POINT 875    // nominal phase, 1/1000 of the bit time
+#endif
+#ifndef CAN_FD_DATA_SAMPLE_POINT
+#define CAN_FD_DATA_SAMPLE_POINT 750
+#endif
+
+#if CAN_FD_ENABLE
+
+/*
+  CAN-FD with bit rate switching: the data phase of FD frames runs at CAN_FD_DATA_BAUD, classic
+  frames (can_put) are still sent and received as before.
+
+  FD frames matched by a filter added with can_fd_add_filter() are passed to its callback from the
+  interrupt handler as they arrive, bypassing the 8 byte message queue of the core.
+*/
+
+#include "can_fd.h"
+
+#define CAN_ELMT_SIZE FDCAN_DATA_BYTES_64
+#define CAN_ELMT_WORDS 18
+#define CAN_DATA_MAX 64
+
+static can_fd_rx_ptr fd_callbacks[CAN_MAX_FILTERS] = {0};
+static uint32_t data_baud = CAN_FD_DATA_BAUD;
+
+#else
+
+#define CAN_ELMT_SIZE FDCAN_DATA_BYTES_8
+#define CAN_ELMT_WORDS 4
+#define CAN_DATA_MAX 8
+
+#endif // CAN_FD_ENABLE
+
+#if CAN_RX_FIFO_SIZE > 64 || CAN_RX_BUFFERS > 64 || CAN_TX_FIFO_SIZE > 32
+#error "CAN FIFO or buffer count out of range!"
+#endif
+
+#if CAN_MAX_FILTERS * 3 + (CAN_RX_FIFO_SIZE + CAN_RX_BUFFERS + CAN_TX_FIFO_SIZE) * CAN_ELMT_WORDS > 2560
+#error "CAN message RAM layout exceeds 2560 words!"
+#endif
+
+#if CAN_RX_QUEUE_SIZE & (CAN_RX_QUEUE_SIZE - 1)
+#error "CAN_RX_QUEUE_SIZE must be a power of 2!"
+#endif
+
+#include "can.h"
+
+typedef struct {
+    canbus_message_t message;
+    can_rx_ptr callback;
+} can_rx_entry_t;
+
+typedef struct {
+    volatile uint_fast16_t head;
+    volatile uint_fast16_t tail;
+    can_rx_entry_t entry[CAN_RX_QUEUE_SIZE];
+} can_rx_queue_t;
+
+typedef struct {
+    uint32_t rx;
+    uint32_t fifo_lost;
+    uint32_t queue_drop;
+    uint32_t bus_off;
+    uint32_t passive;
+    uint32_t warning;
+    uint32_t proto;
+} can_stats_t;
+
+typedef struct {
+    uint32_t prescaler;
+    uint32_t seg1;
+    uint32_t seg2;
+    uint32_t sjw;
+} can_bit_timing_t;
+
+typedef struct {
+    uint32_t prescaler;
+    uint32_t seg1;
+    uint32_t seg2;
+    uint32_t sjw;
+} can_timing_limits_t;
+
+static can_rx_queue_t rx_queue = {0};
+static can_stats_t stats = {0};
+static uint8_t buffer_index = 0;
+static can_rx_ptr buffer_callbacks[CAN_RX_BUFFERS ? CAN_RX_BUFFERS : 1] = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void can_stats_init (void);
+
 static FDCAN_HandleTypeDef hfdcan1 = {
     .Instance = FDCAN1,
+#if CAN_FD_ENABLE
+    .Init.FrameFormat = FDCAN_FRAME_FD_BRS,
+#else
     .Init.FrameFormat = FDCAN_FRAME_CLASSIC,
+#endif
     .Init.Mode = FDCAN_MODE_NORMAL,
     .Init.AutoRetransmission = DISABLE,
     .Init.TransmitPause = DISABLE,
@@ -42,18 +172,23 @@ static FDCAN_HandleTypeDef hfdcan1 = {
     .Init.MessageRAMOffset = 0,
     .Init.StdFiltersNbr = CAN_MAX_FILTERS,
     .Init.ExtFiltersNbr = CAN_MAX_FILTERS,
-    .Init.RxFifo0ElmtsNbr = 4,
-    .Init.RxFifo0ElmtSize = FDCAN_DATA_BYTES_8,
+    .Init.RxFifo0ElmtsNbr = CAN_RX_FIFO_SIZE,
+    .Init.RxFifo0ElmtSize = CAN_ELMT_SIZE,
     .Init.RxFifo1ElmtsNbr = 0,
-    .Init.RxBuffersNbr = 0,
+    .Init.RxBuffersNbr = CAN_RX_BUFFERS,
+    .Init.RxBufferSize = CAN_ELMT_SIZE,
     .Init.TxEventsNbr = 0,
     .Init.TxBuffersNbr = 0,
-    .Init.TxFifoQueueElmtsNbr = 4,
+    .Init.TxFifoQueueElmtsNbr = CAN_TX_FIFO_SIZE,
     .Init.TxFifoQueueMode = FDCAN_TX_FIFO_OPERATION,
-    .Init.TxElmtSize = FDCAN_DATA_BYTES_8
+    .Init.TxElmtSize = CAN_ELMT_SIZE
 };
+static bool started = false;
+static uint8_t filter_index = 0;
 static can_rx_enqueue_fn rx_enqueue;
 static can_rx_ptr rx_callbacks[CAN_MAX_FILTERS] = {0};
+static FDCAN_FilterTypeDef filters[CAN_MAX_FILTERS];
+static uint32_t nominal_baud = 0;
 
 bool can_put (canbus_message_t message, bool ext_id)
 {
@@ -77,131 +212,287 @@ bool can_put (canbus_message_t message, bool ext_id)
 
 bool can_add_filter (uint32_t id, uint32_t mask, bool ext_id, can_rx_ptr callback)
 {
-    static uint8_t index = 0;
-
     static FDCAN_FilterTypeDef sFilterConfig = {
         .FilterType = FDCAN_FILTER_MASK,
         .FilterConfig = FDCAN_FILTER_TO_RXFIFO0,
     };
 
-    if (index == CAN_MAX_FILTERS)
+    if (filter_index == CAN_MAX_FILTERS)
         return false;
 
     sFilterConfig.IdType = ext_id ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
     sFilterConfig.FilterID1 = id;
     sFilterConfig.FilterID2 = mask;
 
-    sFilterConfig.FilterIndex = index;
+    sFilterConfig.FilterIndex = filter_index;
+
+    //debug_printf("can_add_filter(), adding new filter - id:%lu, idx:%u\n", id, filter_index);
 
-    //debug_printf("can_add_filter(), adding new filter - id:%lu, idx:%u\n", id, index);
+    // kept for restoring the filters on a restart
+    filters[filter_index] = sFilterConfig;
+    rx_callbacks[filter_index++] = callback;
+
+    return HAL_FDCAN_ConfigFilter(&hfdcan1, &sFilterConfig) == HAL_OK;
+}
+
+bool can_add_buffer_filter (uint32_t id, bool ext_id, can_rx_ptr callback)
+{
+    FDCAN_FilterTypeDef sFilterConfig = {
+        .FilterConfig = FDCAN_FILTER_TO_RXBUFFER,
+        .IdType = ext_id ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID,
+        .FilterID1 = id,
+        .RxBufferIndex = buffer_index
+    };
+
+    if (buffer_index == CAN_RX_BUFFERS || filter_index == CAN_MAX_FILTERS)
+        return false;
 
-    rx_callbacks[index++] = callback;
+    sFilterConfig.FilterIndex = filter_index;
+    filters[filter_index++] = sFilterConfig;
+    buffer_callbacks[buffer_index++] = callback;
 
     return HAL_FDCAN_ConfigFilter(&hfdcan1, &sFilterConfig) == HAL_OK;
 }
 
+#if CAN_FD_ENABLE
+
+bool can_fd_put (uint32_t id, bool ext_id, const uint8_t *data, uint8_t len)
+{
+    static const uint8_t fd_len[] = { 12, 16, 20, 24, 32, 48, 64 };
+
+    uint8_t frame[CAN_DATA_MAX] = {0};
+    uint32_t dlc = len;
+    FDCAN_TxHeaderTypeDef TxHeader = {0};
+
+    if (len > CAN_DATA_MAX)
+        return false;
+
+    // FD lengths above 8 are coded, the frame is zero padded to the next one
+    if (len > 8) {
+        for (dlc = 9; fd_len[dlc - 9] < len; dlc++);
+    }
+
+    memcpy(frame, data, len);
+
+    TxHeader.TxFrameType = FDCAN_DATA_FRAME;
+    TxHeader.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+    TxHeader.BitRateSwitch = FDCAN_BRS_ON;
+    TxHeader.FDFormat = FDCAN_FD_CAN;
+    TxHeader.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
+    TxHeader.MessageMarker = 0;
+
+    TxHeader.IdType = ext_id ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+    TxHeader.Identifier = id;
+    TxHeader.DataLength = dlc << 16;
+
+    return HAL_FDCAN_AddMessageToTxFifoQ(&hfdcan1, &TxHeader, frame) == HAL_OK;
+}
+
+bool can_fd_add_filter (uint32_t id, uint32_t mask, bool ext_id, can_fd_rx_ptr callback)
+{
+    uint8_t index = filter_index;
+
+    if (!can_add_filter(id, mask, ext_id, NULL))
+        return false;
+
+    fd_callbacks[index] = callback;
+
+    return true;
+}
+
+bool can_fd_start (uint32_t baud)
+{
+    return started || can_start(baud, NULL);
+}
+
+#endif // CAN_FD_ENABLE
+
 bool can_stop(void)
 {
     HAL_FDCAN_Stop(&hfdcan1);
     HAL_FDCAN_DeInit(&hfdcan1);
 
+    started = false;
+
     return true;
 }
 
-bool can_set_baud (uint32_t baud)
+/*
+ * Bit timing for the baud rate from the kernel clock, with the lowest prescaler (the most time
+ * quanta per bit) that divides the clock exactly and keeps the segments within the limits of
+ * the phase. Phase segment 2 is sized for a sample point as close as possible to sample_point
+ * (in 1/1000 of the bit time), the resynchronization jump width is set to phase segment 2.
+ */
+static bool can_bit_timing (uint32_t clock, uint32_t baud, uint32_t sample_point, const can_timing_limits_t *limits, can_bit_timing_t *timing)
 {
-    // unable to stop/start the peripheral to change the baud rate, as filters/callbacks would be lost
+    uint32_t prescaler, tq, seg1, seg2;
 
-    report_message("A hard reset of the controller is required after changing the CAN baud rate", Message_Info);
+    if (baud == 0)
+        return false;
 
-    return true;
+    for (prescaler = 1; prescaler <= limits->prescaler; prescaler++) {
+
+        if (clock % (prescaler * baud))
+            continue;
+
+        tq = clock / (prescaler * baud);
+
+        /* One quantum is the sync segment */
+        if (tq < 4 || tq > 1 + limits->seg1 + limits->seg2)
+            continue;
+
+        seg2 = tq - (tq * sample_point + 500) / 1000;
+        if (seg2 < 1)
+            seg2 = 1;
+        else if (seg2 > limits->seg2)
+            seg2 = limits->seg2;
+
+        if ((seg1 = tq - 1 - seg2) > limits->seg1)
+            continue;
+
+        timing->prescaler = prescaler;
+        timing->seg1 = seg1;
+        timing->seg2 = seg2;
+        timing->sjw = seg2 > limits->sjw ? limits->sjw : seg2;
+
+        debug_printf("can_bit_timing(), baud:%lu, prescaler:%lu, tq:%lu, seg1:%lu, seg2:%lu\n", baud, prescaler, tq, seg1, seg2);
+
+        return true;
+    }
+
+    return false;
 }
 
-bool can_start (uint32_t baud, can_rx_enqueue_fn callback)
+/* Initializes and starts the peripheral, the filters added so far are configured again */
+static bool can_init (uint32_t baud)
 {
-    uint8_t unknown_rate = 0;
+    static const can_timing_limits_t nominal_limits = { .prescaler = 512, .seg1 = 256, .seg2 = 128, .sjw = 128 };
+    can_bit_timing_t timing;
+    uint_fast8_t idx;
 
-    rx_enqueue = callback;
     /*
-     * Can bit time calculations taken from http://www.bittiming.can-wiki.info/ - pre-calculated
-     * for supported CAN peripheral clock speeds and baud rates.
-     *
-     * Unable to query the FDCAN peripheral clock speed until it's initialised, so getting clock speed
-     * directly from the RCC_PLL1_DIVQ clock source. This is 48MHz for all currently supported boards..
+     * The FDCAN kernel clock is PLL1_Q, 48MHz for all currently supported boards, but the timings
+     * are calculated for whatever it is configured to.
      */
-    PLL1_ClocksTypeDef pll1_clocks;
-    HAL_RCCEx_GetPLL1ClockFreq(&pll1_clocks);
-    uint32_t pll1_q_freq = pll1_clocks.PLL1_Q_Frequency;
-    debug_printf("can_start(), PLL1_Q frequency: %lu\n", pll1_q_freq);
-
-    switch (pll1_q_freq) {
-
-        case 48000000:
-            /* FDCAN peripheral running with 48MHz clock, calculated bit timings for all supported baud rates */
-            switch (baud) {
-
-                case 125000:
-                    hfdcan1.Init.NominalPrescaler = 24;
-                    hfdcan1.Init.NominalTimeSeg1 = 13;
-                    hfdcan1.Init.NominalTimeSeg2 = 2;
-                    hfdcan1.Init.NominalSyncJumpWidth = 1;
-                    break;
-
-                case 250000:
-                    hfdcan1.Init.NominalPrescaler = 12;
-                    hfdcan1.Init.NominalTimeSeg1 = 13;
-                    hfdcan1.Init.NominalTimeSeg2 = 2;
-                    hfdcan1.Init.NominalSyncJumpWidth = 1;
-                    break;
-
-                case 500000:
-                    hfdcan1.Init.NominalPrescaler = 6;
-                    hfdcan1.Init.NominalTimeSeg1 = 13;
-                    hfdcan1.Init.NominalTimeSeg2 = 2;
-                    hfdcan1.Init.NominalSyncJumpWidth = 1;
-                    break;
-
-                case 1000000:
-                    hfdcan1.Init.NominalPrescaler = 3;
-                    hfdcan1.Init.NominalTimeSeg1 = 13;
-                    hfdcan1.Init.NominalTimeSeg2 = 2;
-                    hfdcan1.Init.NominalSyncJumpWidth = 1;
-                    break;
-
-                default:
-                    /* Unsupported baud rate */
-                    unknown_rate = 1;
-                    break;
-            }
-            break;
+    uint32_t clock = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+    debug_printf("can_init(), FDCAN kernel clock frequency: %lu\n", clock);
 
-        default:
-            /* unsupported CAN peripheral clock frequency */
-            unknown_rate = 1;
-            break;
+    if (!can_bit_timing(clock, baud, CAN_SAMPLE_POINT, &nominal_limits, &timing)) {
+        debug_printf("can_init(), error - unable to calculate bit timings\n");
+        return(0);
     }
 
-    if (unknown_rate) {
-        debug_printf("can_start(), error - unable to calculate bit timings\n");
+    hfdcan1.Init.NominalPrescaler = timing.prescaler;
+    hfdcan1.Init.NominalTimeSeg1 = timing.seg1;
+    hfdcan1.Init.NominalTimeSeg2 = timing.seg2;
+    hfdcan1.Init.NominalSyncJumpWidth = timing.sjw;
+
+#if CAN_FD_ENABLE
+    static const can_timing_limits_t data_limits = { .prescaler = 32, .seg1 = 32, .seg2 = 16, .sjw = 16 };
+
+    if (!can_bit_timing(clock, data_baud, CAN_FD_DATA_SAMPLE_POINT, &data_limits, &timing)) {
+        debug_printf("can_init(), error - unable to calculate data phase bit timings\n");
         return(0);
     }
 
+    hfdcan1.Init.DataPrescaler = timing.prescaler;
+    hfdcan1.Init.DataTimeSeg1 = timing.seg1;
+    hfdcan1.Init.DataTimeSeg2 = timing.seg2;
+    hfdcan1.Init.DataSyncJumpWidth = timing.sjw;
+#endif
+
     if (HAL_FDCAN_Init(&hfdcan1) != HAL_OK)
     {
         return(0);
     }
 
+#if CAN_FD_ENABLE
+    /* The transceiver loop delay exceeds a data bit time, sample the transmitted bits at the data sample point */
+    HAL_FDCAN_ConfigTxDelayCompensation(&hfdcan1, hfdcan1.Init.DataPrescaler * hfdcan1.Init.DataTimeSeg1, 0);
+    HAL_FDCAN_EnableTxDelayCompensation(&hfdcan1);
+#endif
+
     /* Configure global filter to reject all non-matching frames */
     HAL_FDCAN_ConfigGlobalFilter(&hfdcan1, FDCAN_REJECT, FDCAN_REJECT, FDCAN_REJECT_REMOTE, FDCAN_REJECT_REMOTE);
 
+    /* Init clears the message RAM, restore the filters of a previous start */
+    for (idx = 0; idx < filter_index; idx++)
+        HAL_FDCAN_ConfigFilter(&hfdcan1, &filters[idx]);
+
     /* Start the CAN peripheral (calls the MspInit function) */
     if(HAL_FDCAN_Start(&hfdcan1) != HAL_OK)
     {
         return(0);
     }
 
-    /* Add the callback for received data */
-    return HAL_FDCAN_ActivateNotification(&hfdcan1, FDCAN_IT_RX_FIFO0_NEW_MESSAGE, 0) == HAL_OK;
+    nominal_baud = baud;
+
+    /* Add the callbacks for received data and errors */
+    return HAL_FDCAN_ActivateNotification(&hfdcan1, FDCAN_IT_RX_FIFO0_NEW_MESSAGE|FDCAN_IT_RX_FIFO0_MESSAGE_LOST|
+                                                     FDCAN_IT_RX_BUFFER_NEW_MESSAGE|FDCAN_IT_BUS_OFF|
+                                                      FDCAN_IT_ERROR_PASSIVE|FDCAN_IT_ERROR_WARNING|
+                                                       FDCAN_IT_ARB_PROTOCOL_ERROR|FDCAN_IT_DATA_PROTOCOL_ERROR, 0) == HAL_OK;
+}
+
+/* Restarts the peripheral at the new rate, falls back to the previous rate if it cannot be set */
+static bool can_restart (uint32_t baud)
+{
+    uint32_t previous = nominal_baud;
+
+    if (!started)
+        return false;
+
+    can_stop();
+
+    if (!(started = can_init(baud))) {
+        report_message("Unable to set the CAN baud rate for the FDCAN clock", Message_Warning);
+        started = can_init(previous);
+        return false;
+    }
+
+    return true;
+}
+
+bool can_set_baud (uint32_t baud)
+{
+    // filters and callbacks are kept across the restart, a not yet started peripheral picks up the rate on start
+    return !started || baud == nominal_baud || can_restart(baud);
+}
+
+#if CAN_FD_ENABLE
+
+bool can_fd_set_data_baud (uint32_t baud)
+{
+    uint32_t previous = data_baud;
+
+    if (baud == data_baud)
+        return true;
+
+    data_baud = baud;
+
+    if (started && !can_restart(nominal_baud)) {
+        data_baud = previous;
+        started = can_init(nominal_baud);
+        return false;
+    }
+
+    return true;
+}
+
+#endif
+
+bool can_start (uint32_t baud, can_rx_enqueue_fn callback)
+{
+    if (callback)
+        rx_enqueue = callback;
+
+    // already started by another user, keep its filters
+    if (started)
+        return true;
+
+    can_stats_init();
+
+    return (started = can_init(baud));
 }
 
 /**
@@ -226,7 +517,7 @@ void HAL_FDCAN_MspInit(FDCAN_HandleTypeDef* hfdcan)
 
         HAL_GPIO_Init(CAN_PORT, &GPIO_InitStruct);
 
-        HAL_NVIC_SetPriority(FDCAN1_IT0_IRQn, 0, 0);
+        HAL_NVIC_SetPriority(FDCAN1_IT0_IRQn, IRQ_PRIO_CAN, 0);
         HAL_NVIC_EnableIRQ(FDCAN1_IT0_IRQn);
 
         static const periph_pin_t rx = {
@@ -277,16 +568,57 @@ void FDCAN1_IT0_IRQHandler(void)
     HAL_FDCAN_IRQHandler(&hfdcan1);
 }
 
+// Queues a received frame for the realtime loop, called from the interrupt handler only.
+static void rx_queue_put (const FDCAN_RxHeaderTypeDef *header, const uint8_t *data, can_rx_ptr callback)
+{
+    can_rx_entry_t *entry;
+    uint_fast16_t next = (rx_queue.head + 1) & (CAN_RX_QUEUE_SIZE - 1);
+
+    if (next == rx_queue.tail) {
+        stats.queue_drop++;
+        return;
+    }
+
+    entry = &rx_queue.entry[rx_queue.head];
+    entry->message.id = header->Identifier;
+    // DLC has to be right shifted by 16bits for the FDCAN driver
+    entry->message.len = header->DataLength >> 16;
+    if (entry->message.len > 8)     // FD frame for a classic filter
+        entry->message.len = 8;
+    memcpy(entry->message.data, data, entry->message.len);
+    entry->callback = callback;
+
+    rx_queue.head = next;
+}
+
+// Hands the queued frames to the core.
+static void can_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    while (rx_queue.tail != rx_queue.head) {
+        if (rx_enqueue)
+            rx_enqueue(rx_queue.entry[rx_queue.tail].message, rx_queue.entry[rx_queue.tail].callback);
+        rx_queue.tail = (rx_queue.tail + 1) & (CAN_RX_QUEUE_SIZE - 1);
+    }
+}
+
 void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo0ITs)
 {
-    canbus_message_t message;
     FDCAN_RxHeaderTypeDef RxHeader;
+    uint8_t data[CAN_DATA_MAX];
+
+    if (RxFifo0ITs & FDCAN_IT_RX_FIFO0_MESSAGE_LOST)
+        stats.fifo_lost++;
 
     if((RxFifo0ITs & FDCAN_IT_RX_FIFO0_NEW_MESSAGE) != RESET) {
 
+        // Drain all pending frames, not just the one that raised the interrupt
         while (HAL_FDCAN_GetRxFifoFillLevel(hfdcan, FDCAN_RX_FIFO0)) {
 
-            if (HAL_FDCAN_GetRxMessage(&hfdcan1, FDCAN_RX_FIFO0, &RxHeader, message.data) == HAL_OK) {
+            if (HAL_FDCAN_GetRxMessage(&hfdcan1, FDCAN_RX_FIFO0, &RxHeader, data) == HAL_OK) {
+
+                stats.rx++;
 
                 /* Sanity check the filter index.
                  *
@@ -294,29 +626,107 @@ void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo0ITs)
                  * In this case FilterIndex is set to the maximum value(?), and rx_callbacks would
                  * point outside of the valid array..
                  */
-                if (RxHeader.FilterIndex > CAN_MAX_FILTERS) {
+                if (RxHeader.FilterIndex >= CAN_MAX_FILTERS) {
                     debug_printf("HAL_FDCAN_RxFifo0Callback(), unexpected message received - id:%lu, idx:%lu\n",
                             RxHeader.Identifier, RxHeader.FilterIndex);
-                    return;
+                    continue;
                 }
 
-                /* Attempt to add incoming message to the RX queue.
-                 *
-                 * Note: not currently checking for success, if there is no space available we
-                 * would just end up dropping messages somewhere else (i.e. in the CAN RX fifo)..
-                 */
+#if CAN_FD_ENABLE
+                if (fd_callbacks[RxHeader.FilterIndex]) {
+                    static const uint8_t fd_len[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64 };
+                    fd_callbacks[RxHeader.FilterIndex](RxHeader.Identifier, data, fd_len[(RxHeader.DataLength >> 16) & 0x0F]);
+                    continue;
+                }
+#endif
 
-                //debug_printf("HAL_FDCAN_RxFifo0Callback(), adding new msg to RX queue - id:%lu, idx:%lu\n",
-                //        RxHeader.Identifier, RxHeader.FilterIndex);
+                if (rx_callbacks[RxHeader.FilterIndex])
+                    rx_queue_put(&RxHeader, data, rx_callbacks[RxHeader.FilterIndex]);
+            }
+        }
+    }
+}
 
-                message.id = RxHeader.Identifier;
-                // DLC has to be right shifted by 16bits for the FDCAN driver
-                message.len = RxHeader.DataLength >> 16;
+void HAL_FDCAN_RxBufferNewMessageCallback(FDCAN_HandleTypeDef *hfdcan)
+{
+    uint_fast8_t idx;
+    FDCAN_RxHeaderTypeDef RxHeader;
+    uint8_t data[CAN_DATA_MAX];
 
-                rx_enqueue(message, rx_callbacks[RxHeader.FilterIndex]);
-            }
+    for (idx = 0; idx < buffer_index; idx++) {
+        if (HAL_FDCAN_IsRxBufferMessageAvailable(hfdcan, idx) &&
+             HAL_FDCAN_GetRxMessage(hfdcan, FDCAN_RX_BUFFER0 + idx, &RxHeader, data) == HAL_OK) {
+            stats.rx++;
+            rx_queue_put(&RxHeader, data, buffer_callbacks[idx]);
         }
     }
 }
 
+void HAL_FDCAN_ErrorStatusCallback(FDCAN_HandleTypeDef *hfdcan, uint32_t ErrorStatusITs)
+{
+    if (ErrorStatusITs & FDCAN_IT_BUS_OFF) {
+        stats.bus_off++;
+        // the controller stays in init mode after bus off, leaving it starts the recovery sequence
+        CLEAR_BIT(hfdcan->Instance->CCCR, FDCAN_CCCR_INIT);
+    }
+
+    if (ErrorStatusITs & FDCAN_IT_ERROR_PASSIVE)
+        stats.passive++;
+
+    if (ErrorStatusITs & FDCAN_IT_ERROR_WARNING)
+        stats.warning++;
+}
+
+void HAL_FDCAN_ErrorCallback(FDCAN_HandleTypeDef *hfdcan)
+{
+    if (hfdcan->ErrorCode & (HAL_FDCAN_ERROR_PROTOCOL_ARBT|HAL_FDCAN_ERROR_PROTOCOL_DATA))
+        stats.proto++;
+
+    hfdcan->ErrorCode = HAL_FDCAN_ERROR_NONE;
+}
+
+static status_code_t can_stats_report (sys_state_t state, char *args)
+{
+    char buf[140];
+    FDCAN_ErrorCountersTypeDef counters = {0};
+
+    if (args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    HAL_FDCAN_GetErrorCounters(&hfdcan1, &counters);
+
+    snprintf(buf, sizeof(buf), "[CAN|rx=%lu,fifo_lost=%lu,queue_drop=%lu,bus_off=%lu,passive=%lu,warning=%lu,proto=%lu,tec=%lu,rec=%lu]" ASCII_EOL,
+              stats.rx, stats.fifo_lost, stats.queue_drop, stats.bus_off, stats.passive, stats.warning, stats.proto,
+               counters.TxErrorCnt, counters.RxErrorCnt);
+    hal.stream.write(buf);
+
+    if (args)
+        memset(&stats, 0, sizeof(stats));
+
+    return Status_OK;
+}
+
+static void can_stats_init (void)
+{
+    static bool init_ok = false;
+
+    static const sys_command_t can_command_list[] = {
+        {"CAN", can_stats_report, {}, { .str = "report CAN frame and error counters, $CAN=R to clear" } }
+    };
+
+    static sys_commands_t can_commands = {
+        .n_commands = sizeof(can_command_list) / sizeof(sys_command_t),
+        .commands = can_command_list
+    };
+
+    if (!init_ok) {
+        init_ok = true;
+
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = can_execute_realtime;
+
+        system_register_commands(&can_commands);
+    }
+}
+
 #endif // CAN_PORT
@@ -0,0 +1,166 @@
+/*
+  clocks.c - clock tree report and CPU frequency boost option byte
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  $CLOCKS
+
+    Reports the clocks as configured by SystemClock_Config(), in Hz, with the voltage scale,
+    flash wait states and the state of the CPU frequency boost option bit:
+
+    [CLOCKS|sysclk=,hclk=,pclk1=,pclk2=,vos=,ws=,boost=,sdmmc=,spi123=,fdcan=,usb=]
+
+  $CLOCKS=BOOST
+
+    With CPU_FREQ_550MHZ, sets the CPU frequency boost option bit that the H723 requires for a
+    550MHz core clock. The bit is kept by the option bytes, the new clock is used after the next
+    reset; until then, or without the bit, the core runs at 480MHz. Only accepted in Idle state.
+*/
+
+#include "driver.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "clocks.h"
+
+static uint_fast8_t voltage_scale (void)
+{
+    switch(HAL_PWREx_GetVoltageRange()) {
+
+        case PWR_REGULATOR_VOLTAGE_SCALE0:
+            return 0;
+
+        case PWR_REGULATOR_VOLTAGE_SCALE1:
+            return 1;
+
+        case PWR_REGULATOR_VOLTAGE_SCALE2:
+            return 2;
+
+        default:
+            return 3;
+    }
+}
+
+static const char *usb_source (void)
+{
+    switch(__HAL_RCC_GET_USB_SOURCE()) {
+
+        case RCC_USBCLKSOURCE_PLL:
+            return "pll1q";
+
+        case RCC_USBCLKSOURCE_PLL3:
+            return "pll3q";
+
+        case RCC_USBCLKSOURCE_HSI48:
+            return "hsi48";
+
+        default:
+            return "off";
+    }
+}
+
+static bool boost_enabled (void)
+{
+#ifdef FLASH_OPTSR2_CPUFREQ_BOOST
+    return !!(FLASH->OPTSR2_CUR & FLASH_OPTSR2_CPUFREQ_BOOST);
+#else
+    return false;
+#endif
+}
+
+#if CPU_FREQ_550MHZ
+
+static status_code_t clocks_boost (void)
+{
+    HAL_StatusTypeDef ret;
+    FLASH_OBProgramInitTypeDef ob = {
+        .OptionType = OPTIONBYTE_FREQ_BOOST,
+        .FreqBoostState = OB_CPUFREQ_BOOST_ENABLE
+    };
+
+    if(state_get() != STATE_IDLE)
+        return Status_IdleError;
+
+    if(!boost_enabled()) {
+
+        HAL_FLASH_Unlock();
+        HAL_FLASH_OB_Unlock();
+
+        if((ret = HAL_FLASHEx_OBProgram(&ob)) == HAL_OK)
+            ret = HAL_FLASH_OB_Launch();
+
+        HAL_FLASH_OB_Lock();
+        HAL_FLASH_Lock();
+
+        if(ret != HAL_OK) {
+            hal.stream.write("[MSG:CPU frequency boost option byte write failed]" ASCII_EOL);
+            return Status_InvalidStatement;
+        }
+    }
+
+    hal.stream.write("[MSG:CPU frequency boost set, reset to run at 550MHz]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+#endif // CPU_FREQ_550MHZ
+
+static status_code_t clocks_command (sys_state_t state, char *args)
+{
+    char buf[200];
+
+#if CPU_FREQ_550MHZ
+    if(args && !strcmp(args, "BOOST"))
+        return clocks_boost();
+#endif
+
+    if(args)
+        return Status_InvalidStatement;
+
+    snprintf(buf, sizeof(buf), "[CLOCKS|sysclk=%lu,hclk=%lu,pclk1=%lu,pclk2=%lu,vos=%u,ws=%lu,boost=%d,sdmmc=%lu,spi123=%lu,fdcan=%lu,usb=%s]" ASCII_EOL,
+              HAL_RCC_GetSysClockFreq(), HAL_RCC_GetHCLKFreq(), HAL_RCC_GetPCLK1Freq(), HAL_RCC_GetPCLK2Freq(),
+               (unsigned int)voltage_scale(), (uint32_t)(FLASH->ACR & FLASH_ACR_LATENCY), boost_enabled(),
+                HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SDMMC), HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SPI123),
+                 HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN), usb_source());
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void clocks_init (void)
+{
+    static const sys_command_t clocks_command_list[] = {
+#if CPU_FREQ_550MHZ
+        {"CLOCKS", clocks_command, {}, { .str = "report the clock tree, $CLOCKS=BOOST enables 550MHz from the next reset" } }
+#else
+        {"CLOCKS", clocks_command, {}, { .str = "report the clock tree" } }
+#endif
+    };
+
+    static sys_commands_t clocks_commands = {
+        .n_commands = sizeof(clocks_command_list) / sizeof(sys_command_t),
+        .commands = clocks_command_list
+    };
+
+    system_register_commands(&clocks_commands);
+}
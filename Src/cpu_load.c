@@ -0,0 +1,230 @@
+/*
+  cpu_load.c - DWT cycle counter based CPU utilization: interrupts, foreground and idle
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Tells how much headroom the protocol loop has left, e.g. before raising the PULSER sampling rate
+  or step rates. The DWT cycle count is split at each pass of the realtime loop and at entry and
+  exit of hal.stream_blocking_callback, every interval goes to one of:
+
+    isr   - interrupt handler time, the growth of the ISR_PROFILE_ENABLE handler totals within the
+            interval. Handlers that are not profiled count as the interval they preempted.
+    idle  - waits in hal.stream_blocking_callback (stream output and I2C waiting for space or
+            completion) and empty realtime loop passes: passes that took no more than
+            CPU_LOAD_EMPTY_FACTOR times the shortest pass seen.
+    fg    - anything else: the parser, planner, segment preparation and realtime plugin work.
+
+  Shares are taken over CPU_LOAD_WINDOW_MS windows. Time in WFI with IDLE_SLEEP_ENABLE is not seen
+  as the cycle counter stops, a sleeping machine shows the load of its waking time.
+
+  $CPU   - report: [CPU|isr=,fg=,idle=,idle_min=,empty_cyc=,waits=], shares in percent,
+           idle_min is the lowest idle window since reset, empty_cyc the empty pass cost
+  $CPU=R - reset, then report
+*/
+
+#include "driver.h"
+
+#if CPU_LOAD_ENABLE
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "cpu_load.h"
+#include "isr_profile.h"
+
+#ifndef CPU_LOAD_WINDOW_MS
+#define CPU_LOAD_WINDOW_MS 1000
+#endif
+#ifndef CPU_LOAD_EMPTY_FACTOR
+#define CPU_LOAD_EMPTY_FACTOR 2
+#endif
+
+typedef struct {
+    uint32_t mark;              // DWT->CYCCNT at the last split
+    uint32_t isr_mark;          // lower 32 bits of the ISR profile totals at the last split
+    bool waited;                // the last split was a blocking callback return
+    bool waiting;               // in the blocking callback
+    uint32_t pass_min;          // shortest realtime loop pass, interrupts excluded
+    uint32_t waits;             // blocking callback calls since reset
+    uint64_t isr;               // current window
+    uint64_t fg;
+    uint64_t idle;
+    uint32_t window_ms;         // window start
+    cpu_load_t load;            // last window
+} cpu_acc_t;
+
+static cpu_acc_t acc = {0};
+static bool (*blocking_callback)(void);
+static on_execute_realtime_ptr on_execute_realtime;
+
+// Returns the interval since the last split less interrupt time, which is accounted.
+static inline uint32_t cpu_split (void)
+{
+    uint32_t now = DWT->CYCCNT, cyc = now - acc.mark;
+
+    acc.mark = now;
+
+#if ISR_PROFILE_ENABLE
+    uint_fast8_t idx = IsrProfile_N;
+    uint32_t isr_total = 0, isr_cyc;
+
+    do {
+        isr_total += (uint32_t)isr_profile[--idx].total;
+    } while(idx);
+
+    // Nested handlers are counted twice and $ISRPROF=R goes backwards, clamped to the interval.
+    if((isr_cyc = isr_total - acc.isr_mark) > cyc)
+        isr_cyc = cyc;
+    acc.isr_mark = isr_total;
+    acc.isr += isr_cyc;
+    cyc -= isr_cyc;
+#endif
+
+    return cyc;
+}
+
+static bool cpu_blocking_callback (void)
+{
+    bool ok;
+    uint32_t cyc = cpu_split();
+
+    // Spinning since the previous call returned, or the work that led to the wait.
+    if(acc.waited)
+        acc.idle += cyc;
+    else
+        acc.fg += cyc;
+
+    acc.waits++;
+    acc.waiting = true;
+
+    ok = blocking_callback();
+
+    acc.idle += cpu_split();
+    acc.waited = true;
+    acc.waiting = false;
+
+    return ok;
+}
+
+static uint16_t cpu_share (uint64_t cyc, uint64_t total)
+{
+    return (uint16_t)(cyc * 1000 / total);
+}
+
+static void cpu_window (uint32_t now_ms)
+{
+    uint64_t total = acc.isr + acc.fg + acc.idle;
+
+    acc.window_ms = now_ms;
+
+    if(total) {
+        acc.load.isr = cpu_share(acc.isr, total);
+        acc.load.idle = cpu_share(acc.idle, total);
+        acc.load.fg = 1000 - acc.load.isr - acc.load.idle;
+        if(acc.load.idle < acc.load.idle_min)
+            acc.load.idle_min = acc.load.idle;
+    }
+
+    acc.isr = acc.fg = acc.idle = 0;
+}
+
+static void cpu_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    uint32_t cyc = cpu_split();
+
+    if(acc.waited) {
+        acc.idle += cyc;
+        acc.waited = false;
+    } else {
+        // Passes run from the blocking callback start at its entry, not at the previous pass.
+        if(cyc < acc.pass_min && !acc.waiting)
+            acc.pass_min = cyc;
+        if(cyc <= (uint64_t)acc.pass_min * CPU_LOAD_EMPTY_FACTOR)
+            acc.idle += cyc;
+        else
+            acc.fg += cyc;
+    }
+
+    // The core may set the callback after the plugins are initialized.
+    if(hal.stream_blocking_callback != cpu_blocking_callback && hal.stream_blocking_callback) {
+        blocking_callback = hal.stream_blocking_callback;
+        hal.stream_blocking_callback = cpu_blocking_callback;
+    }
+
+    uint32_t now_ms = hal.get_elapsed_ticks();
+    if(now_ms - acc.window_ms >= CPU_LOAD_WINDOW_MS)
+        cpu_window(now_ms);
+}
+
+static void cpu_load_reset (void)
+{
+    acc.pass_min = UINT32_MAX;
+    acc.waits = 0;
+    acc.load.idle_min = acc.load.idle;
+}
+
+void cpu_load_get (cpu_load_t *load)
+{
+    *load = acc.load;
+}
+
+static status_code_t cpu_load_command (sys_state_t state, char *args)
+{
+    char buf[100];
+
+    if(args) {
+        if(!(args[0] == 'R' && args[1] == '\0'))
+            return Status_InvalidStatement;
+        cpu_load_reset();
+    }
+
+    snprintf(buf, sizeof(buf), "[CPU|isr=%.1f,fg=%.1f,idle=%.1f,idle_min=%.1f,empty_cyc=%lu,waits=%lu]" ASCII_EOL,
+              acc.load.isr / 10.0f, acc.load.fg / 10.0f, acc.load.idle / 10.0f, acc.load.idle_min / 10.0f,
+               acc.pass_min == UINT32_MAX ? 0 : acc.pass_min, acc.waits);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void cpu_load_init (void)
+{
+    static const sys_command_t cpu_command_list[] = {
+        {"CPU", cpu_load_command, {}, { .str = "report CPU utilization, $CPU=R to reset" } }
+    };
+
+    static sys_commands_t cpu_commands = {
+        .n_commands = sizeof(cpu_command_list) / sizeof(sys_command_t),
+        .commands = cpu_command_list
+    };
+
+    acc.mark = DWT->CYCCNT;
+    acc.window_ms = hal.get_elapsed_ticks();
+    acc.load.idle = acc.load.idle_min = 1000;
+    cpu_load_reset();
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = cpu_execute_realtime;
+
+    system_register_commands(&cpu_commands);
+}
+
+#endif // CPU_LOAD_ENABLE
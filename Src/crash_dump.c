@@ -0,0 +1,296 @@
+/*
+  crash_dump.c - fault and watchdog reset records in backup SRAM
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The HardFault, MemManage, BusFault and UsageFault handlers store a crash record in the 4K backup
+  SRAM (D3_BKPSRAM_BASE), which is kept over resets, and then reset the controller unless
+  CRASH_DUMP_RESET is 0. The record holds the stacked registers, the fault status registers,
+  CRASH_STACK_WORDS of the stack above the exception frame, the last CRASH_TRACE_EVENTS trace
+  events (TRACE_ENABLE) and the newest CRASH_LOG_ENTRIES EDM log entries (EDM_ENABLE).
+  Only plain memory accesses are made, no HAL calls.
+
+  A watchdog reset cannot be intercepted, it is recorded at the next boot from the RCC reset
+  flags with the reset cause only. The reset flags are cleared once read.
+
+  A new record is only written when the previous one has been cleared, so the first failure of a
+  sequence is kept. A warning is output at startup while a record is present.
+
+  $CRASH[=C] - report the record, =C clears it:
+
+    [CRASH|<reason>,pc=,lr=,psr=,sp=,cfsr=,hfsr=,mmfar=,bfar=,rsr=,uptime_ms=]
+    [CRASHREG|r0=,r1=,r2=,r3=,r12=]
+    [CRASHSTACK|<address>:<8 words>]
+    [CRASHTRACE|<cycles>,<id>,<payload>]
+    [CRASHLOG|<t_us>,<flags>,<r_open>,<r_short>,<r_pulse>,<n_pulse>]
+*/
+
+#include "driver.h"
+
+#if CRASH_DUMP_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/protocol.h"
+#include "grbl/report.h"
+
+#include "crash_dump.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef CRASH_DUMP_RESET
+#define CRASH_DUMP_RESET 1
+#endif
+#ifndef CRASH_STACK_WORDS
+#define CRASH_STACK_WORDS 128
+#endif
+#ifndef CRASH_LOG_ENTRIES
+#define CRASH_LOG_ENTRIES 128
+#endif
+
+#if !EDM_ENABLE
+#undef CRASH_LOG_ENTRIES
+#define CRASH_LOG_ENTRIES 0
+#define EDM_LOG_ENTRY_SIZE 1
+#endif
+
+#if CRASH_TRACE_EVENTS & (CRASH_TRACE_EVENTS - 1)
+#error "CRASH_TRACE_EVENTS must be a power of 2!"
+#endif
+
+#define CRASH_MAGIC 0x48535243  // "CRSH"
+
+typedef enum {
+    Crash_HardFault = 0,
+    Crash_MemManage,
+    Crash_BusFault,
+    Crash_UsageFault,
+    Crash_IWDG,
+    Crash_WWDG
+} crash_reason_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t reason;
+    uint32_t r0, r1, r2, r3, r12, lr, pc, psr;
+    uint32_t sp;                // at the time of the fault
+    uint32_t exc_return;
+    uint32_t cfsr, hfsr, mmfar, bfar;
+    uint32_t rsr;               // RCC reset flags, watchdog records only
+    uint32_t uptime_ms;
+    uint32_t n_stack;
+    uint32_t stack[CRASH_STACK_WORDS];
+    uint32_t n_trace;
+    crash_trace_t trace[CRASH_TRACE_EVENTS];
+    uint32_t n_log;
+    uint8_t log[CRASH_LOG_ENTRIES * EDM_LOG_ENTRY_SIZE];
+} crash_record_t;
+
+#if POWER_LOSS_ENABLE
+_Static_assert(sizeof(crash_record_t) <= 4096 - POWER_LOSS_RECORD_SIZE, "crash record overlaps the power loss record");
+#else
+_Static_assert(sizeof(crash_record_t) <= 4096, "crash record does not fit in the backup SRAM");
+#endif
+
+#define record ((crash_record_t *)D3_BKPSRAM_BASE)
+
+crash_trace_t crash_trace[CRASH_TRACE_EVENTS];
+uint32_t crash_trace_head = 0;
+
+extern uint8_t _estack;
+
+static inline void backup_sram_enable (void)
+{
+    RCC->AHB4ENR |= RCC_AHB4ENR_BKPRAMEN;
+    PWR->CR1 |= PWR_CR1_DBP;
+    __DSB();
+}
+
+void __attribute__((noreturn, used)) crash_dump_fault (uint32_t *frame, uint32_t exc_return, uint32_t reason)
+{
+    uint32_t idx, *sp, *stack_end = (uint32_t *)&_estack;
+
+    __disable_irq();
+
+    backup_sram_enable();
+
+    if(record->magic != CRASH_MAGIC) {
+
+        record->reason = reason;
+        record->r0 = frame[0];
+        record->r1 = frame[1];
+        record->r2 = frame[2];
+        record->r3 = frame[3];
+        record->r12 = frame[4];
+        record->lr = frame[5];
+        record->pc = frame[6];
+        record->psr = frame[7];
+        record->exc_return = exc_return;
+        record->cfsr = SCB->CFSR;
+        record->hfsr = SCB->HFSR;
+        record->mmfar = SCB->MMFAR;
+        record->bfar = SCB->BFAR;
+        record->rsr = 0;
+        record->uptime_ms = hal.get_elapsed_ticks ? hal.get_elapsed_ticks() : 0;
+
+        // Stack pointer before the exception: basic or extended (FPU) frame plus alignment padding.
+        sp = frame + ((exc_return & 0x10) ? 8 : 26) + ((frame[7] & (1 << 9)) ? 1 : 0);
+        record->sp = (uint32_t)sp;
+
+        for(idx = 0; idx < CRASH_STACK_WORDS && sp < stack_end; idx++)
+            record->stack[idx] = *sp++;
+        record->n_stack = idx;
+
+        for(idx = 0; idx < CRASH_TRACE_EVENTS; idx++)
+            record->trace[idx] = crash_trace[(crash_trace_head + idx) & (CRASH_TRACE_EVENTS - 1)];
+        record->n_trace = crash_trace_head < CRASH_TRACE_EVENTS ? crash_trace_head : CRASH_TRACE_EVENTS;
+
+#if EDM_ENABLE
+        record->n_log = edm_log_tail(record->log, CRASH_LOG_ENTRIES);
+#else
+        record->n_log = 0;
+#endif
+        record->magic = CRASH_MAGIC;
+
+        SCB_CleanDCache();
+    }
+
+#if CRASH_DUMP_RESET
+    NVIC_SystemReset();
+#endif
+
+    while(true);
+}
+
+// Passes the exception frame (from MSP or PSP as selected by EXC_RETURN) and the reason on.
+#define CRASH_HANDLER(handler, reason) \
+void __attribute__((naked)) handler (void) \
+{ \
+    __asm volatile ( \
+        "tst lr, #4           \n" \
+        "ite eq               \n" \
+        "mrseq r0, msp        \n" \
+        "mrsne r0, psp        \n" \
+        "mov r1, lr           \n" \
+        "mov r2, %0           \n" \
+        "b crash_dump_fault   \n" : : "i" (reason)); \
+}
+
+CRASH_HANDLER(HardFault_Handler, Crash_HardFault)
+CRASH_HANDLER(MemManage_Handler, Crash_MemManage)
+CRASH_HANDLER(BusFault_Handler, Crash_BusFault)
+CRASH_HANDLER(UsageFault_Handler, Crash_UsageFault)
+
+static const char *reason_name (uint32_t reason)
+{
+    static const char *const names[] = { "HardFault", "MemManage", "BusFault", "UsageFault", "IWDG", "WWDG" };
+
+    return reason < sizeof(names) / sizeof(char *) ? names[reason] : "?";
+}
+
+static status_code_t crash_report (sys_state_t state, char *args)
+{
+    char buf[160];
+    uint32_t idx;
+
+    if(args) {
+        if(!(args[0] == 'C' && args[1] == '\0'))
+            return Status_InvalidStatement;
+        record->magic = 0;
+        return Status_OK;
+    }
+
+    if(record->magic != CRASH_MAGIC) {
+        hal.stream.write("[CRASH|none]" ASCII_EOL);
+        return Status_OK;
+    }
+
+    snprintf(buf, sizeof(buf), "[CRASH|%s,pc=0x%08lX,lr=0x%08lX,psr=0x%08lX,sp=0x%08lX,cfsr=0x%08lX,hfsr=0x%08lX,mmfar=0x%08lX,bfar=0x%08lX,rsr=0x%08lX,uptime_ms=%lu]" ASCII_EOL,
+              reason_name(record->reason), record->pc, record->lr, record->psr, record->sp, record->cfsr,
+               record->hfsr, record->mmfar, record->bfar, record->rsr, record->uptime_ms);
+    hal.stream.write(buf);
+
+    if(record->reason >= Crash_IWDG)
+        return Status_OK;
+
+    snprintf(buf, sizeof(buf), "[CRASHREG|r0=0x%08lX,r1=0x%08lX,r2=0x%08lX,r3=0x%08lX,r12=0x%08lX]" ASCII_EOL,
+              record->r0, record->r1, record->r2, record->r3, record->r12);
+    hal.stream.write(buf);
+
+    for(idx = 0; idx < record->n_stack && idx < CRASH_STACK_WORDS; idx += 8) {
+        uint32_t *w = &record->stack[idx];
+        snprintf(buf, sizeof(buf), "[CRASHSTACK|%08lX:%08lX %08lX %08lX %08lX %08lX %08lX %08lX %08lX]" ASCII_EOL,
+                  record->sp + idx * 4, w[0], w[1], w[2], w[3], w[4], w[5], w[6], w[7]);
+        hal.stream.write(buf);
+    }
+
+    for(idx = CRASH_TRACE_EVENTS - min(record->n_trace, CRASH_TRACE_EVENTS); idx < CRASH_TRACE_EVENTS; idx++) {
+        snprintf(buf, sizeof(buf), "[CRASHTRACE|%lu,%lu,0x%08lX]" ASCII_EOL,
+                  record->trace[idx].cycles, record->trace[idx].id, record->trace[idx].payload);
+        hal.stream.write(buf);
+    }
+
+#if EDM_ENABLE
+    for(idx = 0; idx < record->n_log && idx < CRASH_LOG_ENTRIES; idx++) {
+        const uint8_t *e = &record->log[idx * EDM_LOG_ENTRY_SIZE];
+        snprintf(buf, sizeof(buf), "[CRASHLOG|%lu,%u,%u,%u,%u,%u]" ASCII_EOL,
+                  (uint32_t)e[0] | ((uint32_t)e[1] << 8) | ((uint32_t)e[2] << 16) | ((uint32_t)e[3] << 24),
+                   e[4], e[5], e[6], e[7], e[8]);
+        hal.stream.write(buf);
+    }
+#endif
+
+    return Status_OK;
+}
+
+void crash_dump_init (void)
+{
+    static const sys_command_t crash_command_list[] = {
+        {"CRASH", crash_report, {}, { .str = "report the stored crash record, $CRASH=C to clear" } }
+    };
+
+    static sys_commands_t crash_commands = {
+        .n_commands = sizeof(crash_command_list) / sizeof(sys_command_t),
+        .commands = crash_command_list
+    };
+
+    uint32_t rsr = RCC->RSR;
+
+    RCC->RSR |= RCC_RSR_RMVF;
+
+    backup_sram_enable();
+
+    if(record->magic != CRASH_MAGIC && (rsr & (RCC_RSR_IWDG1RSTF|RCC_RSR_WWDG1RSTF))) {
+        memset(record, 0, sizeof(crash_record_t));
+        record->reason = (rsr & RCC_RSR_IWDG1RSTF) ? Crash_IWDG : Crash_WWDG;
+        record->rsr = rsr;
+        record->magic = CRASH_MAGIC;
+    }
+
+    if(record->magic == CRASH_MAGIC)
+        protocol_enqueue_foreground_task(report_warning, "Crash record stored, see $CRASH");
+
+    system_register_commands(&crash_commands);
+}
+
+#endif // CRASH_DUMP_ENABLE
@@ -0,0 +1,206 @@
+/*
+  crc32.c - CRC-32 on the hardware CRC unit with a table driven fallback
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  crc32_update() uses the CRC unit programmed for the reflected 0x04C11DB7 polynomial: input bit
+  reversal by word, so that the bytes of a word are taken in memory order LSB first (byte writes
+  are reversed by byte), and output bit reversal. A previous result is continued by loading its
+  complement, bit reversed, as the initial value. Data is fed a word at a time after up to three
+  leading bytes to align the pointer.
+
+  The unit is used from the foreground only, after crc32_init(). Calls from interrupt handlers,
+  which could interrupt a foreground calculation, use the slice-by-4 tables (4 KB, built on first
+  use) that process a word per loop with four table lookups. With CRC32_HARDWARE 0 the tables are
+  always used.
+
+  $CRC=<file>
+
+    CRC-32 of a file on the mounted filesystem:
+
+    [CRC|file=,bytes=,crc=,us=]
+*/
+
+#include "driver.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/vfs.h"
+
+#include "crc32.h"
+
+#ifndef CRC32_HARDWARE
+#define CRC32_HARDWARE 1
+#endif
+
+#define CRC32_POLY_REFLECTED 0xEDB88320
+
+static uint32_t table[4][256];
+static bool table_ok = false;
+
+#if CRC32_HARDWARE
+static bool hw_ok = false;
+#endif
+
+static void crc32_table_init (void)
+{
+    uint_fast16_t i;
+    uint_fast8_t bit;
+    uint32_t crc;
+
+    for(i = 0; i < 256; i++) {
+        crc = i;
+        for(bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (CRC32_POLY_REFLECTED & -(crc & 1));
+        table[0][i] = crc;
+    }
+
+    for(i = 0; i < 256; i++) {
+        table[1][i] = (table[0][i] >> 8) ^ table[0][table[0][i] & 0xFF];
+        table[2][i] = (table[1][i] >> 8) ^ table[0][table[1][i] & 0xFF];
+        table[3][i] = (table[2][i] >> 8) ^ table[0][table[2][i] & 0xFF];
+    }
+
+    table_ok = true;
+}
+
+static uint32_t crc32_table (uint32_t crc, const uint8_t *data, size_t len)
+{
+    uint32_t word;
+
+    if(!table_ok)
+        crc32_table_init();
+
+    crc = ~crc;
+
+    while(len && ((uint32_t)data & 0x03)) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+        len--;
+    }
+
+    while(len >= 4) {
+        word = crc ^ *(const uint32_t *)data;
+        crc = table[3][word & 0xFF] ^ table[2][(word >> 8) & 0xFF] ^ table[1][(word >> 16) & 0xFF] ^ table[0][word >> 24];
+        data += 4;
+        len -= 4;
+    }
+
+    while(len--)
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+
+    return ~crc;
+}
+
+#if CRC32_HARDWARE
+
+static uint32_t crc32_hw (uint32_t crc, const uint8_t *data, size_t len)
+{
+    CRC->INIT = __RBIT(~crc);
+    CRC->CR = CRC_CR_REV_IN_0|CRC_CR_REV_IN_1|CRC_CR_REV_OUT|CRC_CR_RESET;
+
+    while(len && ((uint32_t)data & 0x03)) {
+        *(__IO uint8_t *)&CRC->DR = *data++;
+        len--;
+    }
+
+    while(len >= 4) {
+        CRC->DR = *(const uint32_t *)data;
+        data += 4;
+        len -= 4;
+    }
+
+    while(len--)
+        *(__IO uint8_t *)&CRC->DR = *data++;
+
+    return ~CRC->DR;
+}
+
+#endif
+
+uint32_t crc32_update (uint32_t crc, const void *data, size_t len)
+{
+#if CRC32_HARDWARE
+    if(hw_ok && __get_IPSR() == 0)
+        return crc32_hw(crc, (const uint8_t *)data, len);
+#endif
+
+    return crc32_table(crc, (const uint8_t *)data, len);
+}
+
+#if LITTLEFS_ENABLE || SDCARD_ENABLE
+
+static status_code_t crc32_file (sys_state_t state, char *args)
+{
+    static uint8_t buffer[1024] __ALIGNED(4);
+
+    char msg[100];
+    size_t n;
+    uint32_t crc = 0, bytes = 0, t;
+    vfs_file_t *file;
+
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    if((file = vfs_open(args, "r")) == NULL)
+        return Status_SDReadError;
+
+    t = hal.get_micros();
+
+    while((n = vfs_read(buffer, 1, sizeof(buffer), file)) > 0) {
+        crc = crc32_update(crc, buffer, n);
+        bytes += n;
+    }
+
+    t = hal.get_micros() - t;
+
+    vfs_close(file);
+
+    snprintf(msg, sizeof(msg), "[CRC|file=%s,bytes=%lu,crc=%08lX,us=%lu]" ASCII_EOL, args, bytes, crc, t);
+    hal.stream.write(msg);
+
+    return Status_OK;
+}
+
+#endif
+
+void crc32_init (void)
+{
+#if CRC32_HARDWARE
+    __HAL_RCC_CRC_CLK_ENABLE();
+    hw_ok = true;
+#endif
+
+    if(!table_ok)
+        crc32_table_init();
+
+#if LITTLEFS_ENABLE || SDCARD_ENABLE
+    static const sys_command_t crc32_command_list[] = {
+        {"CRC", crc32_file, {}, { .str = "report the CRC-32 of $CRC=<file>" } }
+    };
+
+    static sys_commands_t crc32_commands = {
+        .n_commands = sizeof(crc32_command_list) / sizeof(sys_command_t),
+        .commands = crc32_command_list
+    };
+
+    system_register_commands(&crc32_commands);
+#endif
+}
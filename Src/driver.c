@@ -23,13 +23,20 @@
 */
 
 #include <math.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <malloc.h>
 
 #include "main.h"
 #include "driver.h"
 #include "serial.h"
+#include "cache.h"
+#include "crc32.h"
+#include "mempool.h"
+#include "gpio_gather.h"
 
 #define AUX_DEVICES // until all drivers are converted?
 #ifndef AUX_CONTROLS
@@ -46,11 +53,22 @@
 #include "i2c.h"
 #endif
 
+#if TMC_MRES_SWITCH_ENABLE
+#include "tmc_mres.h"
+#endif
+
 #if SDCARD_ENABLE
 #include "sdcard/sdcard.h"
 #include "ff.h"
 #include "diskio.h"
 #include "sdmmc.h"
+#include "sd_stream.h"
+#include "power_loss.h"
+#include "job_queue.h"
+#include "sd_log.h"
+#include "macro_cache.h"
+#include "sdmmc_perf.h"
+#include "sd_cache.h"
 #endif
 
 #if SPIFLASH_ENABLE
@@ -62,11 +80,19 @@
 #include "sdcard/fs_littlefs.h"
 #endif
 
+#if UPLOAD_ENABLE
+#include "upload.h"
+#include "fw_update.h"
+#endif
+
 #if USB_SERIAL_CDC
 #include "usb_serial.h"
+#include "usb_bulk.h"
 #endif
 
-#if EEPROM_ENABLE
+#if EEPROM_ASYNC_ENABLE
+#include "eeprom_async.h"
+#elif EEPROM_ENABLE
 #include "eeprom/eeprom.h"
 #endif
 
@@ -74,12 +100,21 @@
 #include "odometer/odometer.h"
 #endif
 
-#if FLASH_ENABLE
+#if FLASH_ENABLE || FLASH_JOURNAL
 #include "flash.h"
 #endif
 
 #if ETHERNET_ENABLE
 #include "enet.h"
+#include "tcp_stream.h"
+#include "udp_telemetry.h"
+#include "ws_telemetry.h"
+#include "http_upload.h"
+#include "ptp.h"
+#include "mqtt_metrics.h"
+#include "mdns_services.h"
+#include "eth_stats.h"
+#include "w5x00_spi.h"
 #endif
 
 #if OPENPNP_ENABLE
@@ -92,7 +127,17 @@
 #error Interrupt enabled input pins must have unique pin numbers!
 #endif
 
+// Step timer prescaler, the step timer (TIM5) is 32-bit so with 1 it runs at the full timer
+// clock and the full counter range is used for the longest step periods.
+#ifndef STEPPER_TIMER_DIV
 #define STEPPER_TIMER_DIV 4
+#endif
+
+#if STEPPER_TIMER_DIV == 1
+#define STEPPER_TIMER_MAX_TICKS 0xFFFFFFFFUL
+#else
+#define STEPPER_TIMER_MAX_TICKS 0x000FFFFFUL
+#endif
 
 #if SPINDLE_ENCODER_ENABLE
 
@@ -108,14 +153,78 @@ static spindle_encoder_t spindle_encoder = {
 };
 static on_spindle_programmed_ptr on_spindle_programmed = NULL;
 
+// Sequence count for lock-free reads of spindle_encoder, odd while an update is in progress.
+// The writers, the RPM counter and index interrupts, run at the same top preemption priority:
+// they never nest and are never preempted by a reader. A reader (foreground or stepper
+// interrupt) thus only has to retry its copy when the count changed meanwhile and the retry
+// always completes, interrupts are never disabled for it.
+static volatile uint32_t encoder_seq = 0;
+
+#if SPINDLE_SYNC_PID_Q16
+
+// Spindle sync PID in Q16.16 fixed point, positions in mm relative to the block start.
+typedef struct {
+    int32_t kp;                 // Q16.16
+    int32_t ki;                 // Q16.16
+    int32_t kd;                 // Q16.16
+    int64_t i_max;              // Q16.16 mm * s, 0 for no limit
+    int64_t i_error;            // Q16.16 mm * s
+    int32_t prev_error;         // Q16.16 mm
+    bool first;                 // no derivative on the first sample
+    uint32_t tick_s_q48;        // step timer tick in 2^-48 s
+    int32_t rate_q16;           // programmed_rate, mm per revolution
+    int32_t steps_per_mm_q16;
+    int64_t block_start_q16;    // spindle revolutions at block start
+} spindle_sync_pid_t;
+
+static spindle_sync_pid_t sync_pid = {0};
+
+#endif
+
+static inline __attribute__((always_inline)) void encoder_write_begin (void)
+{
+    encoder_seq++;
+    __DMB();
+}
+
+static inline __attribute__((always_inline)) void encoder_write_end (void)
+{
+    __DMB();
+    encoder_seq++;
+}
+
 #endif // SPINDLE_ENCODER_ENABLE
 
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#include "isr_profile.h"
+#include "boot_profile.h"
+#include "trace.h"
+#include "clocks.h"
+#include "idle_sleep.h"
+#include "quadrature.h"
+#include "status_bin.h"
+#include "gcode_prescan.h"
+#include "rt_sched.h"
+#include "crash_dump.h"
+#include "watchdog.h"
+#include "modbus_dma.h"
+#include "flush_ctrl.h"
+#include "pendant.h"
+#include "perf_dash.h"
+#include "cpu_load.h"
+
 #if SPINDLE_SYNC_ENABLE
 //static spindle_ptrs_t *sync_spindle;
 static void stepperPulseStartSynchronized (stepper_t *stepper);
 #endif
 
 static periph_signal_t *periph_pins = NULL;
+#if WATCHDOG_ENABLE
+static watchdog_id_t wdt_stepper;
+#endif
 
 static input_signal_t inputpin[] = {
 #if ESTOP_ENABLE
@@ -413,13 +522,21 @@ static output_signal_t outputpin[] = {
 
 extern volatile uint32_t _bootflag __attribute__((section(".dtcmdata")));
 
+// EXTI line dispatch, the handler is selected by gpio_irq_map() from the group and debounce mode.
+typedef void (*pin_irq_handler_ptr)(input_signal_t *input);
+
+typedef struct {
+    input_signal_t *input;
+    pin_irq_handler_ptr handler;
+} pin_irq_t;
+
 extern __IO uint32_t uwTick, cycle_count;
 static uint32_t systick_safe_read = 0, cycles2us_factor = 0;
 static uint32_t aux_irq = 0;
 static bool IOInitDone = false;
 static pin_group_pins_t limit_inputs = {0};
 static delay_t delay = { .ms = 1, .callback = NULL }; // NOTE: initial ms set to 1 for "resetting" systick timer on startup
-static input_signal_t *pin_irq[16] = {0};
+static pin_irq_t pin_irq[16] = {0};
 static struct {
     uint32_t length;
     uint32_t delay;
@@ -430,9 +547,13 @@ static struct {
         axes_signals_t claimed;
         volatile axes_signals_t axes;
         volatile axes_signals_t out;
+#if STEP_INJECT_BURST
+        volatile axes_signals_t dir;    // direction of the normal motion
+        volatile uint32_t lost;         // normal steps masked by an injected step on a shared axis
+#endif
     } inject;
 #endif
-} step_pulse = {0};
+} step_pulse DTCM_DATA = {0};
 
 #if AUX_CONTROLS_ENABLED
 #ifdef SAFETY_DOOR_PIN
@@ -441,6 +562,14 @@ static pin_debounce_t debounce;
 static void aux_irq_handler (uint8_t port, bool state);
 #endif
 
+#if PIN_EVENT_QUEUE
+static void pin_events_init (void);
+#endif
+
+#if PIN_FILTER_ENABLE
+static void pin_filter_init (void);
+#endif
+
 #ifdef PROBE_PIN
 static uint8_t probe_port;
 static probe_state_t probe = {
@@ -490,7 +619,486 @@ static bool irq_claim (irq_type_t irq, uint_fast8_t id, irq_callback_ptr handler
 #include "grbl/stepdir_map.h"
 
 #ifdef SQUARING_ENABLED
+
 static axes_signals_t motors_1 = {AXES_BITMASK}, motors_2 = {AXES_BITMASK};
+
+#if !STEPDIR_BSRR_TABLE
+
+// Set/reset words for the secondary step pins indexed by the axis step bit, rebuilt when the squaring
+// mode or the step invert setting changes. A motor disabled for squaring is held inactive for both.
+typedef struct {
+    uint32_t x2[2];
+    uint32_t y2[2];
+    uint32_t z2[2];
+} squaring_out_t;
+
+static squaring_out_t squaring_out DTCM_BSS;
+
+#define SQUARING_BSRR(bit, on) ((on) ? (bit) : ((bit) << 16))
+
+static void squaring_out_build (axes_signals_t invert)
+{
+#ifdef X2_STEP_PIN
+    squaring_out.x2[0] = SQUARING_BSRR(X2_STEP_BIT, invert.x);
+    squaring_out.x2[1] = SQUARING_BSRR(X2_STEP_BIT, motors_2.x ^ invert.x);
+#endif
+#ifdef Y2_STEP_PIN
+    squaring_out.y2[0] = SQUARING_BSRR(Y2_STEP_BIT, invert.y);
+    squaring_out.y2[1] = SQUARING_BSRR(Y2_STEP_BIT, motors_2.y ^ invert.y);
+#endif
+#ifdef Z2_STEP_PIN
+    squaring_out.z2[0] = SQUARING_BSRR(Z2_STEP_BIT, invert.z);
+    squaring_out.z2[1] = SQUARING_BSRR(Z2_STEP_BIT, motors_2.z ^ invert.z);
+#endif
+}
+
+#endif // !STEPDIR_BSRR_TABLE
+
+#endif // SQUARING_ENABLED
+
+#if STEPDIR_BSRR_TABLE
+
+#include "pin_masks.h"
+
+#define BSRR_PORTS_MAX 6
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint32_t bit;
+    uint8_t axis;
+    bool secondary; // ganged/squared motor
+} stepdir_pin_t;
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint32_t bsrr[1 << N_AXIS]; // indexed by axes bitmask
+} bsrr_port_t;
+
+typedef struct {
+    uint_fast8_t n_ports;
+    bsrr_port_t port[BSRR_PORTS_MAX];
+} bsrr_map_t;
+
+static const stepdir_pin_t step_pins[] = {
+    { .port = X_STEP_PORT, .bit = X_STEP_BIT, .axis = X_AXIS },
+#ifdef X2_STEP_PIN
+    { .port = X2_STEP_PORT, .bit = X2_STEP_BIT, .axis = X_AXIS, .secondary = true },
+#endif
+    { .port = Y_STEP_PORT, .bit = Y_STEP_BIT, .axis = Y_AXIS },
+#ifdef Y2_STEP_PIN
+    { .port = Y2_STEP_PORT, .bit = Y2_STEP_BIT, .axis = Y_AXIS, .secondary = true },
+#endif
+    { .port = Z_STEP_PORT, .bit = Z_STEP_BIT, .axis = Z_AXIS },
+#ifdef Z2_STEP_PIN
+    { .port = Z2_STEP_PORT, .bit = Z2_STEP_BIT, .axis = Z_AXIS, .secondary = true },
+#endif
+#ifdef A_AXIS
+    { .port = A_STEP_PORT, .bit = A_STEP_BIT, .axis = A_AXIS },
+#endif
+#ifdef B_AXIS
+    { .port = B_STEP_PORT, .bit = B_STEP_BIT, .axis = B_AXIS },
+#endif
+#ifdef C_AXIS
+    { .port = C_STEP_PORT, .bit = C_STEP_BIT, .axis = C_AXIS },
+#endif
+#ifdef U_AXIS
+    { .port = U_STEP_PORT, .bit = U_STEP_BIT, .axis = U_AXIS },
+#endif
+#ifdef V_AXIS
+    { .port = V_STEP_PORT, .bit = V_STEP_BIT, .axis = V_AXIS },
+#endif
+};
+
+static const stepdir_pin_t dir_pins[] = {
+    { .port = X_DIRECTION_PORT, .bit = X_DIRECTION_BIT, .axis = X_AXIS },
+#ifdef X2_DIRECTION_PIN
+    { .port = X2_DIRECTION_PORT, .bit = X2_DIRECTION_BIT, .axis = X_AXIS, .secondary = true },
+#endif
+    { .port = Y_DIRECTION_PORT, .bit = Y_DIRECTION_BIT, .axis = Y_AXIS },
+#ifdef Y2_DIRECTION_PIN
+    { .port = Y2_DIRECTION_PORT, .bit = Y2_DIRECTION_BIT, .axis = Y_AXIS, .secondary = true },
+#endif
+    { .port = Z_DIRECTION_PORT, .bit = Z_DIRECTION_BIT, .axis = Z_AXIS },
+#ifdef Z2_DIRECTION_PIN
+    { .port = Z2_DIRECTION_PORT, .bit = Z2_DIRECTION_BIT, .axis = Z_AXIS, .secondary = true },
+#endif
+#ifdef A_AXIS
+    { .port = A_DIRECTION_PORT, .bit = A_DIRECTION_BIT, .axis = A_AXIS },
+#endif
+#ifdef B_AXIS
+    { .port = B_DIRECTION_PORT, .bit = B_DIRECTION_BIT, .axis = B_AXIS },
+#endif
+#ifdef C_AXIS
+    { .port = C_DIRECTION_PORT, .bit = C_DIRECTION_BIT, .axis = C_AXIS },
+#endif
+#ifdef U_AXIS
+    { .port = U_DIRECTION_PORT, .bit = U_DIRECTION_BIT, .axis = U_AXIS },
+#endif
+#ifdef V_AXIS
+    { .port = V_DIRECTION_PORT, .bit = V_DIRECTION_BIT, .axis = V_AXIS },
+#endif
+};
+
+// In address order, matches the slots assigned by pin_masks.h.
+static GPIO_TypeDef *const gpio_ports[] = {
+    GPIOA, GPIOB, GPIOC, GPIOD, GPIOE, GPIOF, GPIOG, GPIOH,
+#ifdef GPIOI
+    GPIOI,
+#endif
+#ifdef GPIOJ
+    GPIOJ,
+#endif
+#ifdef GPIOK
+    GPIOK,
+#endif
+};
+
+static bsrr_map_t step_bsrr DTCM_BSS, dir_bsrr DTCM_BSS;
+
+// (Re)builds the set/reset words for every axes bitmask, can be called while stepping as
+// each entry is updated by a single store. enable masks select the motors that are output,
+// disabled motors are held at their inactive level.
+static void bsrr_map_build (bsrr_map_t *map, const stepdir_pin_t *pins, uint_fast8_t n_pins,
+                             axes_signals_t invert1, axes_signals_t invert2,
+                             axes_signals_t enable1, axes_signals_t enable2)
+{
+    uint_fast8_t idx, pin, n_ports = 0;
+    uint_fast16_t mask;
+
+    for(idx = 0; idx < sizeof(gpio_ports) / sizeof(GPIO_TypeDef *) && n_ports < BSRR_PORTS_MAX; idx++) {
+        for(pin = 0; pin < n_pins && pins[pin].port != gpio_ports[idx]; pin++);
+        if(pin < n_pins)
+            map->port[n_ports++].port = gpio_ports[idx];
+    }
+
+    for(mask = 0; mask < (1 << N_AXIS); mask++) {
+        for(idx = 0; idx < n_ports; idx++) {
+            uint32_t bsrr = 0;
+            for(pin = 0; pin < n_pins; pin++) {
+                if(pins[pin].port == map->port[idx].port) {
+                    uint32_t axis = 1 << pins[pin].axis;
+                    bool on = pins[pin].secondary
+                               ? !!(((mask & enable2.bits) ^ invert2.bits) & axis)
+                               : !!(((mask & enable1.bits) ^ invert1.bits) & axis);
+                    bsrr |= on ? pins[pin].bit : (pins[pin].bit << 16);
+                }
+            }
+            map->port[idx].bsrr[mask] = bsrr;
+        }
+    }
+
+    map->n_ports = n_ports;
+}
+
+// The ports with step or direction pins are known at compile time, the writes below are
+// unrolled to one store per used port with a constant table slot and register address.
+
+#define BSRR_PORT_OUT(map, type, l, mask) \
+    if(type##_PORT_PINS(GPIO##l) && type##_PORT_SLOT(l) < BSRR_PORTS_MAX) \
+        GPIO##l->BSRR = (map)->port[type##_PORT_SLOT(l)].bsrr[mask];
+
+#ifdef GPIOI
+#define BSRR_PORT_I(out) out(I)
+#else
+#define BSRR_PORT_I(out)
+#endif
+#ifdef GPIOJ
+#define BSRR_PORT_J(out) out(J)
+#else
+#define BSRR_PORT_J(out)
+#endif
+#ifdef GPIOK
+#define BSRR_PORT_K(out) out(K)
+#else
+#define BSRR_PORT_K(out)
+#endif
+
+#define BSRR_FOR_EACH_PORT(out) out(A) out(B) out(C) out(D) out(E) out(F) out(G) out(H) \
+                                BSRR_PORT_I(out) BSRR_PORT_J(out) BSRR_PORT_K(out)
+
+#define STEP_BSRR_OUT(l) BSRR_PORT_OUT(&step_bsrr, STEP, l, mask)
+#define DIR_BSRR_OUT(l)  BSRR_PORT_OUT(&dir_bsrr, DIR, l, mask)
+
+static inline __attribute__((always_inline)) void step_bsrr_out (uint_fast16_t mask)
+{
+    mask &= AXES_BITMASK;
+
+    BSRR_FOR_EACH_PORT(STEP_BSRR_OUT)
+}
+
+static inline __attribute__((always_inline)) void dir_bsrr_out (uint_fast16_t mask)
+{
+    mask &= AXES_BITMASK;
+
+    BSRR_FOR_EACH_PORT(DIR_BSRR_OUT)
+}
+
+#endif // STEPDIR_BSRR_TABLE
+
+#if STEP_PULSE_DMA
+
+// The pulse timer update and channel 1-3 compare events all occur at the end of the step pulse,
+// each triggers a circular single word DMA transfer of the idle (all steps off) BSRR word to one
+// step port. DMA1 streams 5 & 6 are used by SPI, DMA2 streams 0 & 1 by the serial port.
+#define STEP_DMA_MAX 4
+
+static uint32_t step_dma_idle[__SCB_DCACHE_LINE_SIZE / sizeof(uint32_t)] DMA_BUFFER;
+
+static DMA_HandleTypeDef step_dma[STEP_DMA_MAX] = {
+    { .Instance = DMA1_Stream0, .Init.Request = timerDMAREQ(PULSE_TIMER_N, UP) },
+    { .Instance = DMA1_Stream1, .Init.Request = timerDMAREQ(PULSE_TIMER_N, CH1) },
+    { .Instance = DMA1_Stream2, .Init.Request = timerDMAREQ(PULSE_TIMER_N, CH2) },
+    { .Instance = DMA1_Stream3, .Init.Request = timerDMAREQ(PULSE_TIMER_N, CH3) }
+};
+
+static const uint32_t step_dma_dier[STEP_DMA_MAX] = {
+    TIM_DIER_UDE, TIM_DIER_CC1DE, TIM_DIER_CC2DE, TIM_DIER_CC3DE
+};
+
+static void stepperDMAInit (void)
+{
+    uint_fast8_t idx;
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    for(idx = 0; idx < STEP_DMA_MAX; idx++) {
+        step_dma[idx].Init.FIFOMode            = DMA_FIFOMODE_DISABLE;
+        step_dma[idx].Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL;
+        step_dma[idx].Init.MemBurst            = DMA_MBURST_SINGLE;
+        step_dma[idx].Init.PeriphBurst         = DMA_PBURST_SINGLE;
+        step_dma[idx].Init.Direction           = DMA_MEMORY_TO_PERIPH;
+        step_dma[idx].Init.PeriphInc           = DMA_PINC_DISABLE;
+        step_dma[idx].Init.MemInc              = DMA_MINC_DISABLE;
+        step_dma[idx].Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+        step_dma[idx].Init.MemDataAlignment    = DMA_MDATAALIGN_WORD;
+        step_dma[idx].Init.Mode                = DMA_CIRCULAR;
+        step_dma[idx].Init.Priority            = DMA_PRIORITY_VERY_HIGH;
+        HAL_DMA_Init(&step_dma[idx]);
+    }
+}
+
+// Arms one DMA stream per step port, returns the pulse timer DIER value to use
+// or 0 if there are more step ports than DMA requests available.
+static uint32_t stepperDMAConfigure (void)
+{
+    uint_fast8_t idx;
+    uint32_t dier = 0;
+
+    for(idx = 0; idx < STEP_DMA_MAX; idx++)
+        HAL_DMA_Abort(&step_dma[idx]);
+
+    if(step_bsrr.n_ports > STEP_DMA_MAX)
+        return 0;
+
+    for(idx = 0; idx < step_bsrr.n_ports; idx++)
+        step_dma_idle[idx] = step_bsrr.port[idx].bsrr[0];
+
+    dma_buffer_clean(step_dma_idle, sizeof(step_dma_idle));
+
+    for(idx = 0; idx < step_bsrr.n_ports; idx++) {
+        HAL_DMA_Start(&step_dma[idx], (uint32_t)&step_dma_idle[idx], (uint32_t)&step_bsrr.port[idx].port->BSRR, 1);
+        dier |= step_dma_dier[idx];
+    }
+
+    // Downcounting, compare match at 0 is the last tick before the update event
+    PULSE_TIMER->CCR1 = PULSE_TIMER->CCR2 = PULSE_TIMER->CCR3 = 0;
+
+    return dier;
+}
+
+#endif // STEP_PULSE_DMA
+
+#if EDM_ENABLE && EDM_RETRACT_HISTORY
+
+#if EDM_RETRACT_HISTORY & (EDM_RETRACT_HISTORY - 1)
+#error "EDM_RETRACT_HISTORY must be a power of 2!"
+#endif
+
+// Ring of the most recent steps output, entries behind head are history (steps that can be
+// retracted), entries from head on are the steps retracted (to be replayed when going forward).
+typedef struct {
+    axes_signals_t step;
+    axes_signals_t dir;     // forward direction
+} edm_path_step_t;
+
+typedef struct {
+    uint_fast16_t head;
+    uint_fast16_t n_hist;
+    uint_fast16_t n_redo;
+    edm_path_step_t entry[EDM_RETRACT_HISTORY];
+} edm_path_t;
+
+static edm_path_t edm_path DTCM_BSS;
+
+#endif
+
+#if EDM_ENABLE && EDM_RETRACT_PROFILE
+
+// Step rate ramp after a reversal, see edm_retract_profile_t. While active the step timer
+// period is set per step from the ramp velocity instead of the segment rate.
+typedef struct {
+    bool active;
+    bool retracting;
+    uint_fast8_t amass_level;
+    float v;                // steps/s
+    uint32_t core_cycles;   // segment period, scaled by the gap servo
+#if STEP_PERIOD_DMA
+    bool dma;               // periods loaded from step_period_table
+#endif
+} edm_ramp_t;
+
+static edm_ramp_t edm_ramp DTCM_BSS;
+
+#if STEP_PERIOD_DMA
+
+// The first STEP_PERIOD_DMA_STEPS ramp steps are precomputed per AMASS level when the profile
+// changes, each period repeated for the 2^level ticks of a step, and written to the step timer ARR
+// by DMA on the update event. The write then lands a few bus cycles after the update whatever the
+// interrupt latency, and the interrupt does no ramp math until the table ends. The ramp then
+// continues per step from the same velocity.
+#define STEP_PERIOD_DMA_LEVELS 4    // AMASS levels 0-3, hal.driver_cap.amass_level
+
+typedef struct {
+    volatile bool valid;
+    uint_fast16_t retract_steps;    // steps before the retract rate is reached
+    uint32_t ticks;                 // transfer length of the running ramp
+    DMA_HandleTypeDef dma;
+} step_period_t;
+
+static step_period_t step_period = {0};
+static DMA_BUFFER uint32_t step_period_table[STEP_PERIOD_DMA_STEPS * ((1 << STEP_PERIOD_DMA_LEVELS) - 1)];
+
+#define STEP_PERIOD_TICKS(level) (&step_period_table[STEP_PERIOD_DMA_STEPS * ((1 << (level)) - 1)])
+
+static void stepperRampDMAInit (void)
+{
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    step_period.dma.Instance                 = STEP_PERIOD_DMA_STREAM;
+    step_period.dma.Init.Request             = timerDMAREQ(STEPPER_TIMER_N, UP);
+    step_period.dma.Init.Direction           = DMA_MEMORY_TO_PERIPH;
+    step_period.dma.Init.PeriphInc           = DMA_PINC_DISABLE;
+    step_period.dma.Init.MemInc              = DMA_MINC_ENABLE;
+    step_period.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    step_period.dma.Init.MemDataAlignment    = DMA_MDATAALIGN_WORD;
+    step_period.dma.Init.Mode                = DMA_NORMAL;
+    step_period.dma.Init.Priority            = DMA_PRIORITY_VERY_HIGH;
+    step_period.dma.Init.FIFOMode            = DMA_FIFOMODE_DISABLE;
+    HAL_DMA_Init(&step_period.dma);
+
+    STEP_PERIOD_DMA_STREAM->PAR = (uint32_t)&STEPPER_TIMER->ARR;
+}
+
+// Rebuilds the tables, called by the plugin while the profile is disabled.
+void edm_retract_profile_changed (void)
+{
+    uint_fast16_t step, tick;
+    uint_fast8_t level;
+    uint32_t cycles, *ticks;
+    float v, v2 = edm_retract_profile.v_start * edm_retract_profile.v_start;
+
+    step_period.valid = false;
+    step_period.retract_steps = 0;
+
+    for(step = 0; step < STEP_PERIOD_DMA_STEPS; step++) {
+        v2 += edm_retract_profile.accel2;
+        v = sqrtf(v2);
+        if(v < edm_retract_profile.v_retract)
+            step_period.retract_steps = step + 1;
+        cycles = (uint32_t)((float)hal.f_step_timer / v);
+        for(level = 0; level < STEP_PERIOD_DMA_LEVELS; level++) {
+            ticks = STEP_PERIOD_TICKS(level) + (step << level);
+            for(tick = 0; tick < (1 << level); tick++)
+                ticks[tick] = (cycles >> level) < STEPPER_TIMER_MAX_TICKS ? cycles >> level : STEPPER_TIMER_MAX_TICKS;
+        }
+    }
+
+    dma_buffer_clean(step_period_table, sizeof(step_period_table));
+
+    step_period.valid = true;
+}
+
+inline static __attribute__((always_inline)) void stepperRampDMAAbort (void)
+{
+    STEPPER_TIMER->DIER &= ~TIM_DIER_UDE;
+    __HAL_DMA_DISABLE(&step_period.dma);
+    while(STEP_PERIOD_DMA_STREAM->CR & DMA_SxCR_EN);
+    edm_ramp.dma = false;
+}
+
+// Ends the table part of the ramp, the velocity is set to that of the last period loaded
+// for the ramp to continue per step.
+ITCM_CODE static void stepperRampDMAStop (void)
+{
+    stepperRampDMAAbort();
+
+    uint32_t step = ((step_period.ticks - STEP_PERIOD_DMA_STREAM->NDTR) >> edm_ramp.amass_level) + 1;
+    float v = sqrtf(edm_retract_profile.v_start * edm_retract_profile.v_start + (float)step * edm_retract_profile.accel2);
+
+    edm_ramp.v = edm_ramp.retracting && v > edm_retract_profile.v_retract ? edm_retract_profile.v_retract : v;
+}
+
+// Starts the ramp from the table, it is run per step if the table does not cover the AMASS level.
+// Re-advance stops at the first step no slower than the segment rate.
+ITCM_CODE static void stepperRampDMAStart (stepper_t *stepper)
+{
+    uint_fast8_t level = stepper->exec_segment ? stepper->exec_segment->amass_level : edm_ramp.amass_level;
+    uint_fast16_t steps, mid, hi = STEP_PERIOD_DMA_STEPS;
+    const uint32_t *ticks;
+
+    if(!step_period.valid || level >= STEP_PERIOD_DMA_LEVELS)
+        return;
+
+    if(edm_ramp.retracting)
+        steps = step_period.retract_steps;
+    else {
+        ticks = STEP_PERIOD_TICKS(0);
+        steps = 0;
+        while(steps < hi) {
+            mid = (steps + hi) >> 1;
+            if((ticks[mid] >> level) > edm_ramp.core_cycles)
+                steps = mid + 1;
+            else
+                hi = mid;
+        }
+    }
+
+    if(steps < 2)
+        return;
+
+    ticks = STEP_PERIOD_TICKS(level);
+    edm_ramp.amass_level = level;
+    edm_ramp.dma = true;
+    step_period.ticks = (steps << level) - 1;
+
+    // The first period is loaded now, the rest on the update events.
+    STEPPER_TIMER->ARR = ticks[0];
+    __HAL_DMA_CLEAR_FLAG(&step_period.dma, __HAL_DMA_GET_TC_FLAG_INDEX(&step_period.dma)|__HAL_DMA_GET_HT_FLAG_INDEX(&step_period.dma)|
+                                            __HAL_DMA_GET_TE_FLAG_INDEX(&step_period.dma)|__HAL_DMA_GET_FE_FLAG_INDEX(&step_period.dma));
+    STEP_PERIOD_DMA_STREAM->M0AR = (uint32_t)&ticks[1];
+    STEP_PERIOD_DMA_STREAM->NDTR = step_period.ticks;
+    __HAL_DMA_ENABLE(&step_period.dma);
+    STEPPER_TIMER->DIER |= TIM_DIER_UDE;
+}
+
+#endif // STEP_PERIOD_DMA
+
+#endif
+
+#if EDM_ENABLE && EDM_RETRACT_VECTOR
+
+// Retract along edm_retract_vector, see stepperSetDirOutputsEDM().
+typedef struct {
+    axes_signals_t offset;      // axes with a nonzero edm_retract_excursion
+    axes_signals_t dir_last;    // direction outputs
+    uint32_t acc[N_AXIS];       // DDA accumulators, Q16
+} edm_vec_t;
+
+static edm_vec_t edm_vec DTCM_BSS;
+
+volatile int32_t edm_retract_excursion[N_AXIS] = {0};
+
 #endif
 
 static void driver_delay (uint32_t ms, delay_callback_ptr callback)
@@ -551,12 +1159,27 @@ static void stepperEnable (axes_signals_t enable, bool hold)
 // Starts stepper driver ISR timer and forces a stepper driver interrupt callback
 static void stepperWakeUp (void)
 {
+#if EDM_ENABLE && EDM_RETRACT_HISTORY
+    edm_path.n_hist = edm_path.n_redo = 0;
+#endif
+#if EDM_ENABLE && EDM_RETRACT_PROFILE
+    edm_ramp.active = false;
+ #if STEP_PERIOD_DMA
+    if(edm_ramp.dma)
+        stepperRampDMAAbort();
+ #endif
+#endif
+
     hal.stepper.enable((axes_signals_t){AXES_BITMASK}, false);
 
     STEPPER_TIMER->ARR = hal.f_step_timer / 500; // ~2ms delay to allow drivers time to wake up
     STEPPER_TIMER->EGR = TIM_EGR_UG;
     STEPPER_TIMER->SR = ~TIM_SR_UIF;
     STEPPER_TIMER->CR1 |= TIM_CR1_CEN;
+
+#if WATCHDOG_ENABLE
+    watchdog_arm(wdt_stepper, true);
+#endif
 }
 
 // Disables stepper driver interrupts
@@ -564,26 +1187,53 @@ static void stepperGoIdle (bool clear_signals)
 {
     STEPPER_TIMER->CR1 &= ~TIM_CR1_CEN;
     STEPPER_TIMER->CNT = 0;
+
+#if EDM_ENABLE && STEP_PERIOD_DMA
+    if(edm_ramp.dma)
+        stepperRampDMAAbort();
+#endif
+
+#if WATCHDOG_ENABLE
+    watchdog_arm(wdt_stepper, false);
+#endif
 }
 
 // Sets up stepper driver interrupt timeout, "Normal" version
-static void stepperCyclesPerTick (uint32_t cycles_per_tick)
+ITCM_CODE static void stepperCyclesPerTick (uint32_t cycles_per_tick)
 {
-    STEPPER_TIMER->ARR = cycles_per_tick < (1UL << 20) ? cycles_per_tick : 0x000FFFFFUL;
+#if EDM_ENABLE
+    cycles_per_tick = edm_servo_cycles(cycles_per_tick);
+ #if EDM_RETRACT_PROFILE
+    edm_ramp.core_cycles = cycles_per_tick;
+    // While ramping the period is updated per step by stepperRampEDM(), re-advance ends the
+    // ramp when the segment is slower than the ramp
+    if(edm_ramp.active) {
+        if(edm_ramp.retracting || STEPPER_TIMER->ARR > cycles_per_tick)
+            return;
+        edm_ramp.active = false;
+  #if STEP_PERIOD_DMA
+        if(edm_ramp.dma)
+            stepperRampDMAAbort();
+  #endif
+    }
+ #endif
+#endif
+    TRACE(TraceEvent_Segment, cycles_per_tick);
+    STEPPER_TIMER->ARR = cycles_per_tick < STEPPER_TIMER_MAX_TICKS ? cycles_per_tick : STEPPER_TIMER_MAX_TICKS;
 }
 
 #ifdef SQUARING_ENABLED
 
 inline static __attribute__((always_inline)) void stepperSetStepOutputs (axes_signals_t step_out1)
 {
-    axes_signals_t step_out2;
-
 #if STEP_INJECT_ENABLE
 
     axes_signals_t axes = { .bits = step_pulse.inject.axes.bits };
 
     if(axes.bits) {
 
+        axes_signals_t step_out2;
+
         step_out2.bits = step_out1.bits & motors_2.bits;
         step_out1.bits = step_out1.bits & motors_1.bits;
 
@@ -656,13 +1306,30 @@ inline static __attribute__((always_inline)) void stepperSetStepOutputs (axes_si
 #endif
                 }
             }
+#if STEP_INJECT_BURST
+            else if((step1.bits & mask) && !(step_pulse.inject.claimed.bits & mask))
+                step_pulse.inject.lost++;
+#endif
             mask <<= 1;
         }
     } else {
 
 #endif // STEP_INJECT_ENABLE
 
-    step_out2.bits = (step_out1.bits & motors_2.bits) ^ settings.steppers.step_invert.bits;
+#if STEPDIR_BSRR_TABLE
+    step_bsrr_out(step_out1.bits); // motors_1/motors_2 and invert are baked into the table
+#else
+
+    // motors_2 and invert are baked into squaring_out, one indexed store per secondary motor.
+#ifdef X2_STEP_PIN
+    X2_STEP_PORT->BSRR = squaring_out.x2[step_out1.x];
+#endif
+#ifdef Y2_STEP_PIN
+    Y2_STEP_PORT->BSRR = squaring_out.y2[step_out1.y];
+#endif
+#ifdef Z2_STEP_PIN
+    Z2_STEP_PORT->BSRR = squaring_out.z2[step_out1.z];
+#endif
 
 #if STEP_OUTMODE == GPIO_SINGLE
     step_out1.bits = (step_out1.bits & motors_1.bits) ^ settings.steppers.step_invert.bits;
@@ -690,16 +1357,7 @@ inline static __attribute__((always_inline)) void stepperSetStepOutputs (axes_si
 #else
     STEP_PORT->ODR = (STEP_PORT->ODR & ~STEP_MASK) | (((step_out1.bits & motors_1.bits) ^ settings.steppers.step_invert.bits) << STEP_OUTMODE);
 #endif
-
-#ifdef X2_STEP_PIN
-    DIGITAL_OUT(X2_STEP_PORT, X2_STEP_BIT, step_out2.x);
-#endif
-#ifdef Y2_STEP_PIN
-    DIGITAL_OUT(Y2_STEP_PORT, Y2_STEP_BIT, step_out2.y);
-#endif
-#ifdef Z2_STEP_PIN
-    DIGITAL_OUT(Z2_STEP_PORT, Z2_STEP_BIT, step_out2.z);
-#endif
+#endif // STEPDIR_BSRR_TABLE
 #if STEP_INJECT_ENABLE
     }
 #endif
@@ -710,6 +1368,12 @@ static void StepperDisableMotors (axes_signals_t axes, squaring_mode_t mode)
 {
     motors_1.mask = (mode == SquaringMode_A || mode == SquaringMode_Both ? axes.mask : 0) ^ AXES_BITMASK;
     motors_2.mask = (mode == SquaringMode_B || mode == SquaringMode_Both ? axes.mask : 0) ^ AXES_BITMASK;
+#if STEPDIR_BSRR_TABLE
+    bsrr_map_build(&step_bsrr, step_pins, sizeof(step_pins) / sizeof(stepdir_pin_t),
+                    settings.steppers.step_invert, settings.steppers.step_invert, motors_1, motors_2);
+#else
+    squaring_out_build(settings.steppers.step_invert);
+#endif
 }
 
 #else // SQUARING DISABLED
@@ -775,7 +1439,9 @@ inline static __attribute__((always_inline)) void stepperSetStepOutputs (axes_si
 
 #endif // STEP_INJECT_ENABLE
 
-#if STEP_OUTMODE == GPIO_SINGLE
+#if STEPDIR_BSRR_TABLE
+    step_bsrr_out(step_out.bits);
+#elif STEP_OUTMODE == GPIO_SINGLE
     step_out.bits ^= settings.steppers.step_invert.bits;
     DIGITAL_OUT(X_STEP_PORT, X_STEP_BIT, step_out.x);
   #ifdef X2_STEP_PIN
@@ -876,6 +1542,10 @@ inline static __attribute__((always_inline)) void stepperSetDirOutputs (axes_sig
 
     axes_signals_t axes = { .bits = step_pulse.inject.axes.bits };
 
+#if STEP_INJECT_BURST
+    step_pulse.inject.dir = dir_out;
+#endif
+
     if(axes.bits) {
 
         uint_fast8_t idx, mask = 1;
@@ -938,7 +1608,9 @@ inline static __attribute__((always_inline)) void stepperSetDirOutputs (axes_sig
 
 #endif // STEP_INJECT_ENABLE
 
-#if DIRECTION_OUTMODE == GPIO_SINGLE
+#if STEPDIR_BSRR_TABLE
+    dir_bsrr_out(dir_out.bits);
+#elif DIRECTION_OUTMODE == GPIO_SINGLE
     dir_out.mask ^= settings.steppers.dir_invert.mask;
     DIGITAL_OUT(X_DIRECTION_PORT, X_DIRECTION_BIT, dir_out.x);
     DIGITAL_OUT(Y_DIRECTION_PORT, Y_DIRECTION_BIT, dir_out.y);
@@ -1006,39 +1678,268 @@ inline static __attribute__((always_inline)) void stepperSetDirOutputs (axes_sig
 #endif
 }
 
-// Sets stepper direction and pulse pins and starts a step pulse.
-static void stepperPulseStart (stepper_t *stepper)
+#if EDM_ENABLE
+
+#if EDM_RETRACT_PROFILE
+
+// Accelerates the ramp by one step, v^2 += 2a, and sets the step timer period from it.
+// The period is per step of the dominant axis, divided down by the segment AMASS level.
+inline static __attribute__((always_inline)) void stepperRampEDM (stepper_t *stepper)
 {
-#if SPINDLE_SYNC_ENABLE
-    if(stepper->new_block && stepper->exec_segment->spindle_sync) {
-        spindle_tracker.stepper_pulse_start_normal = hal.stepper.pulse_start;
-        hal.stepper.pulse_start = stepperPulseStartSynchronized;
-        hal.stepper.pulse_start(stepper);
-        return;
+#if STEP_PERIOD_DMA
+    // Loaded by DMA until the table ends or the segment AMASS level changes.
+    if(edm_ramp.dma) {
+        if((STEP_PERIOD_DMA_STREAM->CR & DMA_SxCR_EN) &&
+            (stepper->exec_segment == NULL || stepper->exec_segment->amass_level == edm_ramp.amass_level))
+            return;
+        stepperRampDMAStop();
     }
 #endif
 
-#if EDM_ENABLE
-    // Always emit dir to simplify the logic.
-    axes_signals_t dir_out = stepper->dir_out;
-    if (stepper->retracting) {
-        dir_out.value = ~dir_out.value;
+    if(stepper->exec_segment)
+        edm_ramp.amass_level = stepper->exec_segment->amass_level;
+
+    float v = sqrtf(edm_ramp.v * edm_ramp.v + edm_retract_profile.accel2);
+
+    if(edm_ramp.retracting && v > edm_retract_profile.v_retract)
+        v = edm_retract_profile.v_retract;
+    edm_ramp.v = v;
+
+    uint32_t cycles = (uint32_t)((float)hal.f_step_timer / v) >> edm_ramp.amass_level;
+
+    if(!edm_ramp.retracting && cycles <= edm_ramp.core_cycles) {
+        edm_ramp.active = false;
+        cycles = edm_ramp.core_cycles;
+    }
+
+    STEPPER_TIMER->ARR = cycles < STEPPER_TIMER_MAX_TICKS ? cycles : STEPPER_TIMER_MAX_TICKS;
+}
+
+#endif // EDM_RETRACT_PROFILE
+
+// Notifies the EDM plugin of block and retract transitions and outputs the direction, inverted
+// while retracting. The forward and retract masks are cached when the core flags a direction
+// change and the outputs are only rewritten then or on a retract transition.
+// With EDM_RETRACT_HISTORY steps output while retracting are taken from the recorded path
+// instead, so the retract backtracks along the actual path across block boundaries. The steps
+// retracted are then replayed when going forward again before new steps are output. The net
+// motion per axis is the same as the core's, only the path taken in between differs.
+// With EDM_RETRACT_VECTOR each step tick of a retract outputs a step along the configured vector
+// instead, and the difference to the core's position is kept per axis (edm_retract_excursion).
+// Once going forward again every tick outputs, per axis, the core's step, no step or a step the
+// other way, whichever brings that difference closer to zero, so the electrode returns toward the
+// path while the core retraces it. Only the path taken differs here as well.
+// Returns true if the direction outputs changed, step_out is set to the steps to output.
+inline static __attribute__((always_inline)) bool stepperSetDirOutputsEDM (stepper_t *stepper, axes_signals_t *step_out)
+{
+    static bool was_retracting = false;
+    static axes_signals_t dir_fwd = {0}, dir_rev = {AXES_BITMASK};
+
+    bool changed = false;
+
+    if (stepper->new_block)
+        edm_block_started();
+
+    if (stepper->dir_changed.value) {
+        dir_fwd = stepper->dir_out;
+        dir_rev.value = ~dir_fwd.value;
+        changed = true;
+    }
+
+    if (stepper->retracting != was_retracting) {
+        if ((was_retracting = stepper->retracting))
+            edm_retract_started();
+        else
+            edm_retract_ended();
+        changed = true;
+#if EDM_RETRACT_PROFILE
+        // Both directions start over from the start rate
+#if STEP_PERIOD_DMA
+        if(edm_ramp.dma)
+            stepperRampDMAAbort();
+#endif
+        if((edm_ramp.active = edm_retract_profile.enabled)) {
+            edm_ramp.retracting = was_retracting;
+            edm_ramp.v = edm_retract_profile.v_start;
+#if STEP_PERIOD_DMA
+            stepperRampDMAStart(stepper);
+#endif
+        }
+#endif
+#if EDM_RETRACT_VECTOR
+        if (was_retracting) {
+            uint_fast8_t idx = N_AXIS;
+            do {
+                edm_vec.acc[--idx] = 32768; // round to nearest
+            } while (idx);
+        }
+#endif
+    }
+
+    *step_out = stepper->step_out;
+
+#if EDM_RETRACT_PROFILE
+    if(edm_ramp.active && step_out->value)
+        stepperRampEDM(stepper);
+#endif
+
+#if EDM_RETRACT_HISTORY
+
+    static axes_signals_t dir_last = {0};
+
+    if (!step_out->value)
+        return false;
+
+    axes_signals_t dir_out;
+    edm_path_step_t step = { .step = *step_out, .dir = dir_fwd };
+
+    if (was_retracting) {
+        if (edm_path.n_hist) {
+            edm_path.head = (edm_path.head - 1) & (EDM_RETRACT_HISTORY - 1);
+            step = edm_path.entry[edm_path.head];
+            edm_path.n_hist--;
+            edm_path.n_redo++;
+        } else if (edm_path.n_redo < EDM_RETRACT_HISTORY) {
+            // Retracting beyond the recorded path, the core's steps are recorded for replay
+            edm_path.head = (edm_path.head - 1) & (EDM_RETRACT_HISTORY - 1);
+            edm_path.entry[edm_path.head] = step;
+            edm_path.n_redo++;
+        }
+        dir_out.value = ~step.dir.value;
+    } else {
+        if (edm_path.n_redo) {
+            step = edm_path.entry[edm_path.head];
+            edm_path.n_redo--;
+            edm_path.n_hist++;
+        } else {
+            edm_path.entry[edm_path.head] = step;
+            if (edm_path.n_hist < EDM_RETRACT_HISTORY)
+                edm_path.n_hist++;
+        }
+        edm_path.head = (edm_path.head + 1) & (EDM_RETRACT_HISTORY - 1);
+        dir_out = step.dir;
+    }
+
+    *step_out = step.step;
+
+    if ((changed = (dir_out.value & AXES_BITMASK) != (dir_last.value & AXES_BITMASK))) {
+        dir_last = dir_out;
+        stepperSetDirOutputs(dir_out);
+    }
+
+#elif EDM_RETRACT_VECTOR
+
+    bool vector = was_retracting && edm_retract_vector.enabled;
+    axes_signals_t dir_core = was_retracting ? dir_rev : dir_fwd;
+
+    if (!vector && !edm_vec.offset.value) {
+        // On the path, as without EDM_RETRACT_VECTOR. Outputs left by vector steps are restored.
+        if (changed || (dir_core.value & AXES_BITMASK) != (edm_vec.dir_last.value & AXES_BITMASK)) {
+            edm_vec.dir_last = dir_core;
+            stepperSetDirOutputs(dir_core);
+            changed = true;
+        }
+        return changed;
+    }
+
+    if (!step_out->value)
+        return false;
+
+    axes_signals_t out_step = {0}, out_dir = edm_vec.dir_last;
+    uint_fast8_t idx = N_AXIS;
+
+    do {
+        idx--;
+        uint32_t bit = 1 << idx;
+        int32_t d_core = (step_out->value & bit) ? ((dir_core.value & bit) ? -1 : 1) : 0, d_out = 0;
+
+        if (vector) {
+            if (idx <= Z_AXIS && (edm_vec.acc[idx] += edm_retract_vector.rate_q16[idx]) >= 65536) {
+                edm_vec.acc[idx] -= 65536;
+                d_out = (edm_retract_vector.dir & bit) ? -1 : 1;
+            }
+        } else {
+            int32_t e = edm_retract_excursion[idx] - d_core;
+            d_out = e > 0 ? -1 : (e < 0 ? 1 : 0);
+        }
+
+        if ((edm_retract_excursion[idx] += d_out - d_core))
+            edm_vec.offset.value |= bit;
+        else
+            edm_vec.offset.value &= ~bit;
+
+        if (d_out) {
+            out_step.value |= bit;
+            if (d_out < 0)
+                out_dir.value |= bit;
+            else
+                out_dir.value &= ~bit;
+        }
+    } while (idx);
+
+    *step_out = out_step;
+
+    if ((changed = (out_dir.value & AXES_BITMASK) != (edm_vec.dir_last.value & AXES_BITMASK))) {
+        edm_vec.dir_last = out_dir;
+        stepperSetDirOutputs(out_dir);
+    }
+
+#else
+
+    if (changed)
+        stepperSetDirOutputs(was_retracting ? dir_rev : dir_fwd);
+
+#endif // EDM_RETRACT_HISTORY
+
+    return changed;
+}
+
+#endif // EDM_ENABLE
+
+// Sets stepper direction and pulse pins and starts a step pulse.
+ITCM_CODE static void stepperPulseStart (stepper_t *stepper)
+{
+#if SPINDLE_SYNC_ENABLE
+    if(stepper->new_block && stepper->exec_segment->spindle_sync) {
+        spindle_tracker.stepper_pulse_start_normal = hal.stepper.pulse_start;
+        hal.stepper.pulse_start = stepperPulseStartSynchronized;
+        hal.stepper.pulse_start(stepper);
+        return;
+    }
+#endif
+
+#if TMC_MRES_SWITCH_ENABLE
+    tmc_mres_step_filter(stepper);
+#endif
+
+#if AUX_OUT_SYNC_ENABLE
+    if(stepper->new_block)
+        ioports_block_started();
+#endif
+
+#if EDM_ENABLE
+    axes_signals_t step_out;
+
+    stepperSetDirOutputsEDM(stepper, &step_out);
+
+    if(step_out.value) {
+        stepperSetStepOutputs(step_out);
+        PULSE_TIMER->CR1 |= TIM_CR1_CEN;
     }
-    stepperSetDirOutputs(dir_out);
 #else
     if(stepper->dir_changed.value)
         stepperSetDirOutputs(stepper->dir_out);
-#endif
 
     if(stepper->step_out.value) {
         stepperSetStepOutputs(stepper->step_out);
         PULSE_TIMER->CR1 |= TIM_CR1_CEN;
     }
+#endif
 }
 
 // Start a stepper pulse, delay version.
 // Note: delay is only added when there is a direction change and a pulse to be output.
-static void stepperPulseStartDelayed (stepper_t *stepper)
+ITCM_CODE static void stepperPulseStartDelayed (stepper_t *stepper)
 {
 #if SPINDLE_SYNC_ENABLE
     if(stepper->new_block && stepper->exec_segment->spindle_sync) {
@@ -1049,17 +1950,31 @@ static void stepperPulseStartDelayed (stepper_t *stepper)
     }
 #endif
 
-#if EDM_ENABLE
-    // DELAYED VERSION NOT SUPPORTED!!!!
-    system_raise_alarm(Alarm_MotorFault);
+#if TMC_MRES_SWITCH_ENABLE
+    tmc_mres_step_filter(stepper);
+#endif
+
+#if AUX_OUT_SYNC_ENABLE
+    if(stepper->new_block)
+        ioports_block_started();
 #endif
 
+#if EDM_ENABLE
+    axes_signals_t step_out;
+
+    if(stepperSetDirOutputsEDM(stepper, &step_out)) {
+#else
+    axes_signals_t step_out = stepper->step_out;
+
     if(stepper->dir_changed.value) {
 
         stepperSetDirOutputs(stepper->dir_out);
+#endif
 
-        if(stepper->step_out.value) {
-            step_pulse.out = stepper->step_out;
+        if(step_out.value) {
+            step_pulse.out = step_out;
+            // The counter is reloaded with the pulse length only after a delayed pulse, set it explicitly
+            PULSE_TIMER->CNT = step_pulse.length + step_pulse.delay;
             PULSE_TIMER->DIER = TIM_DIER_CC1IE;
             PULSE_TIMER->CR1 |= TIM_CR1_CEN;
         }
@@ -1067,22 +1982,151 @@ static void stepperPulseStartDelayed (stepper_t *stepper)
         return;
     }
 
-    if(stepper->step_out.value) {
-        stepperSetStepOutputs(stepper->step_out);
+    if(step_out.value) {
+        stepperSetStepOutputs(step_out);
+        PULSE_TIMER->CNT = step_pulse.length;
         PULSE_TIMER->DIER = TIM_DIER_UIE;
         PULSE_TIMER->CR1 |= TIM_CR1_CEN;
     }
 }
 
+#if STEP_PULSE_OPM
+
+// The step pins are channels of STEP_OPM_TIMER, run in one-pulse mode. A pulse start sets the
+// channels of the axes to step to PWM mode 2 and the others to forced inactive, then starts the
+// counter: the outputs go active at CCRx (the pulse delay, at least one tick) and inactive again
+// at the update event that ends the shot. The pulse width is timed by the timer and no interrupt
+// is taken at the end of the pulse. The pulse delay, if configured, applies to every pulse.
+
+#define STEP_OPM_TIMER      timer(STEP_OPM_TIMER_N)
+
+#define OPM_OCM_PWM2        (TIM_CCMR1_OC1M_0|TIM_CCMR1_OC1M_1|TIM_CCMR1_OC1M_2)
+#define OPM_OCM_INACTIVE    TIM_CCMR1_OC1M_2
+
+static const uint8_t step_opm_ch[N_AXIS] = {
+    X_STEP_OPM_CH, Y_STEP_OPM_CH, Z_STEP_OPM_CH
+#if N_AXIS > 3
+  , A_STEP_OPM_CH
+#endif
+};
+
+// CCMR1 and CCMR2 values per step output mask.
+static uint32_t step_opm_ccmr[1 << N_AXIS][2];
+
+static void stepperOPMInit (void)
+{
+    uint32_t i;
+    GPIO_InitTypeDef GPIO_Init = {
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Mode = GPIO_MODE_AF_PP,
+        .Alternate = STEP_OPM_AF
+    };
+
+    timer_claim(STEP_OPM_TIMER);
+
+    STEP_OPM_TIMER->CR1 = 0;
+    STEP_OPM_TIMER->PSC = timer_clk_enable(STEP_OPM_TIMER) / 10000000UL - 1; // 100 ns per tick
+    STEP_OPM_TIMER->DIER = 0;
+    STEP_OPM_TIMER->CNT = 0;
+    STEP_OPM_TIMER->EGR = TIM_EGR_UG;
+    STEP_OPM_TIMER->SR = 0;
+
+    for(i = 0 ; i < sizeof(outputpin) / sizeof(output_signal_t); i++) {
+        if(outputpin[i].group == PinGroup_StepperStep) {
+            GPIO_Init.Pin = 1 << outputpin[i].pin;
+            HAL_GPIO_Init(outputpin[i].port, &GPIO_Init);
+        }
+    }
+}
+
+ITCM_CODE static void stepperPulseStartOPM (stepper_t *stepper)
+{
+#if TMC_MRES_SWITCH_ENABLE
+    tmc_mres_step_filter(stepper);
+#endif
+
+#if AUX_OUT_SYNC_ENABLE
+    if(stepper->new_block)
+        ioports_block_started();
+#endif
+
+#if EDM_ENABLE
+    axes_signals_t step_out;
+
+    stepperSetDirOutputsEDM(stepper, &step_out);
+#else
+    axes_signals_t step_out = stepper->step_out;
+
+    if(stepper->dir_changed.value)
+        stepperSetDirOutputs(stepper->dir_out);
+#endif
+
+    if(step_out.value) {
+        STEP_OPM_TIMER->CCMR1 = step_opm_ccmr[step_out.value & AXES_BITMASK][0];
+        STEP_OPM_TIMER->CCMR2 = step_opm_ccmr[step_out.value & AXES_BITMASK][1];
+        STEP_OPM_TIMER->CR1 |= TIM_CR1_CEN;
+    }
+}
+
+static void stepperOPMConfigure (settings_t *settings)
+{
+    uint_fast8_t idx, mask, ch;
+    uint32_t ccer = 0, delay = step_pulse.delay ? step_pulse.delay + 1 : 1;
+
+    STEP_OPM_TIMER->CR1 = TIM_CR1_OPM;
+    STEP_OPM_TIMER->ARR = delay + (uint32_t)(10.0f * settings->steppers.pulse_microseconds);
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        ch = step_opm_ch[idx] - 1;
+        (&STEP_OPM_TIMER->CCR1)[ch] = delay;
+        ccer |= (TIM_CCER_CC1E | (settings->steppers.step_invert.bits & bit(idx) ? TIM_CCER_CC1P : 0)) << (ch * 4);
+    }
+
+    for(mask = 0; mask < (1 << N_AXIS); mask++) {
+        step_opm_ccmr[mask][0] = step_opm_ccmr[mask][1] = 0;
+        for(idx = 0; idx < N_AXIS; idx++) {
+            ch = step_opm_ch[idx] - 1;
+            step_opm_ccmr[mask][ch >> 1] |= (mask & bit(idx) ? OPM_OCM_PWM2 : OPM_OCM_INACTIVE) << ((ch & 1) * 8);
+        }
+    }
+
+    STEP_OPM_TIMER->CCMR1 = step_opm_ccmr[0][0];
+    STEP_OPM_TIMER->CCMR2 = step_opm_ccmr[0][1];
+    STEP_OPM_TIMER->CCER = ccer;
+    if(IS_TIM_BREAK_INSTANCE(STEP_OPM_TIMER))
+        STEP_OPM_TIMER->BDTR |= TIM_BDTR_MOE;
+
+    hal.stepper.pulse_start = stepperPulseStartOPM;
+}
+
+#endif // STEP_PULSE_OPM
+
 #if SPINDLE_SYNC_ENABLE
 
 // Spindle sync version: sets stepper direction and pulse pins and starts a step pulse.
 // Switches back to "normal" version if spindle synchronized motion is finished.
 // TODO: add delayed pulse handling...
+#if SPINDLE_SYNC_PID_Q16
+
+static int64_t spindleGetRevolutionsQ16 (void);
+static spindle_data_t *spindleGetData (spindle_data_request_t request);
+
+// Spindle revolutions in Q16.16, without float math when the spindle uses the driver encoder.
+static inline __attribute__((always_inline)) int64_t spindleRevolutionsQ16 (spindle_ptrs_t *spindle)
+{
+    return spindle->get_data == spindleGetData
+            ? spindleGetRevolutionsQ16()
+            : (int64_t)(spindle->get_data(SpindleData_AngularPosition)->angular_position * 65536.0f);
+}
+
+#endif
+
 static void stepperPulseStartSynchronized (stepper_t *stepper)
 {
+#if !SPINDLE_SYNC_PID_Q16
     static bool sync = false;
     static float block_start;
+#endif
 
     if(stepper->new_block) {
         if(!stepper->exec_segment->spindle_sync) {
@@ -1091,15 +2135,29 @@ static void stepperPulseStartSynchronized (stepper_t *stepper)
             hal.stepper.pulse_start(stepper);
             return;
         }
+#if AUX_OUT_SYNC_ENABLE
+        ioports_block_started();
+#endif
+#if !SPINDLE_SYNC_PID_Q16
         sync = true;
+#endif
         PULSE_TIMER->ARR = step_pulse.length; // dir delay not supported
         stepperSetDirOutputs(stepper->dir_outbits);
         spindle_tracker.programmed_rate = stepper->exec_block->programmed_rate;
         spindle_tracker.steps_per_mm = stepper->exec_block->steps_per_mm;
         spindle_tracker.segment_id = 0;
         spindle_tracker.prev_pos = 0.0f;
+#if SPINDLE_SYNC_PID_Q16
+        // Per block conversions, the segments then run on integer arithmetic only.
+        sync_pid.rate_q16 = (int32_t)(spindle_tracker.programmed_rate * 65536.0f);
+        sync_pid.steps_per_mm_q16 = (int32_t)(spindle_tracker.steps_per_mm * 65536.0f);
+        sync_pid.block_start_q16 = spindleRevolutionsQ16(stepper->exec_block->spindle);
+        sync_pid.i_error = 0;
+        sync_pid.first = true;
+#else
         block_start = stepper->exec_block->spindle->get_data(SpindleData_AngularPosition)->angular_position * spindle_tracker.programmed_rate;
         pidf_reset(&spindle_tracker.pid);
+#endif
 #ifdef PID_LOG
         sys.pid_log.idx = 0;
         sys.pid_log.setpoint = 100.0f;
@@ -1120,6 +2178,41 @@ static void stepperPulseStartSynchronized (stepper_t *stepper)
 
             float actual_pos;
 
+#if SPINDLE_SYNC_PID_Q16
+            if(stepper->exec_segment->cruising) {
+
+                uint64_t segment_ticks = (uint64_t)stepper->exec_segment->cycles_per_tick * stepper->exec_segment->n_step;
+                int32_t period_q16 = (int32_t)((segment_ticks * sync_pid.tick_s_q48) >> 32);
+                int32_t actual_q16 = (int32_t)(((spindleRevolutionsQ16(stepper->exec_block->spindle) - sync_pid.block_start_q16) * sync_pid.rate_q16) >> 16);
+                int32_t error_q16 = (int32_t)(spindle_tracker.prev_pos * 65536.0f) - actual_q16;
+                int64_t out_q16 = ((int64_t)sync_pid.kp * error_q16) >> 16;
+
+                sync_pid.i_error += ((int64_t)error_q16 * period_q16) >> 16;
+                if(sync_pid.i_max) {
+                    if(sync_pid.i_error > sync_pid.i_max)
+                        sync_pid.i_error = sync_pid.i_max;
+                    else if(sync_pid.i_error < -sync_pid.i_max)
+                        sync_pid.i_error = -sync_pid.i_max;
+                }
+                out_q16 += (sync_pid.ki * sync_pid.i_error) >> 16;
+
+                // d/dt by the segment rate in Hz, a hardware 32-bit divide.
+                if(!sync_pid.first && segment_ticks < hal.f_step_timer)
+                    out_q16 += (((int64_t)sync_pid.kd * (error_q16 - sync_pid.prev_error)) >> 16) * (int32_t)(hal.f_step_timer / (uint32_t)segment_ticks);
+                sync_pid.prev_error = error_q16;
+                sync_pid.first = false;
+
+                int32_t step_delta = (int32_t)((out_q16 * sync_pid.steps_per_mm_q16) >> 32);
+                int32_t ticks = (((int32_t)stepper->step_count + step_delta) * (int32_t)stepper->exec_segment->cycles_per_tick) / (int32_t)stepper->step_count;
+
+                stepper->exec_segment->cycles_per_tick = (uint32_t)max(ticks, spindle_tracker.min_cycles_per_tick >> stepper->exec_segment->amass_level);
+
+                stepperCyclesPerTick(stepper->exec_segment->cycles_per_tick);
+
+                actual_pos = (float)actual_q16 / 65536.0f;
+           } else
+                actual_pos = spindle_tracker.prev_pos;
+#else
             if(stepper->exec_segment->cruising) {
 
                 float dt = (float)hal.f_step_timer / (float)(stepper->exec_segment->cycles_per_tick * stepper->exec_segment->n_step);
@@ -1141,6 +2234,7 @@ static void stepperPulseStartSynchronized (stepper_t *stepper)
                 stepperCyclesPerTick(stepper->exec_segment->cycles_per_tick);
            } else
                 actual_pos = spindle_tracker.prev_pos;
+#endif
 
 #ifdef PID_LOG
             if(sys.pid_log.idx < PID_LOG) {
@@ -1168,6 +2262,30 @@ static void stepperPulseStartSynchronized (stepper_t *stepper)
 
 #if STEP_INJECT_ENABLE
 
+#if STEPDIR_BSRR_TABLE
+
+// Only the step pins of the given axes are written: the pins that differ between the idle entry
+// and the entry for the axes, with the levels from the entry for step_out. Invert is in the table.
+#define INJECT_BSRR_OUT(l) \
+    if(STEP_PORT_PINS(GPIO##l) && STEP_PORT_SLOT(l) < BSRR_PORTS_MAX) { \
+        const bsrr_port_t *port = &step_bsrr.port[STEP_PORT_SLOT(l)]; \
+        uint32_t pins = port->bsrr[axes.bits] ^ port->bsrr[0]; \
+        if((pins = (pins | (pins >> 16)) & 0xFFFF)) \
+            GPIO##l->BSRR = port->bsrr[step_out.bits & axes.bits] & (pins | (pins << 16)); \
+    }
+
+static inline __attribute__((always_inline)) void inject_step (axes_signals_t step_out, axes_signals_t axes)
+{
+    if(!step_out.bits)
+        step_pulse.inject.axes.bits = step_pulse.inject.claimed.bits;
+
+    axes.bits &= AXES_BITMASK;
+
+    BSRR_FOR_EACH_PORT(INJECT_BSRR_OUT)
+}
+
+#else
+
 static inline __attribute__((always_inline)) void inject_step (axes_signals_t step_out, axes_signals_t axes)
 {
     uint_fast8_t idx = N_AXIS - 1;
@@ -1234,6 +2352,8 @@ static inline __attribute__((always_inline)) void inject_step (axes_signals_t st
     } while(axes.bits & AXES_BITMASK);
 }
 
+#endif // STEPDIR_BSRR_TABLE
+
 static void stepperClaimMotor (uint_fast8_t axis_id, bool claim)
 {
     if(claim)
@@ -1331,10 +2451,157 @@ void step_inject_off (void *context)
     step_pulse.inject.axes.bits = step_pulse.inject.claimed.bits;
 
     inject_step((axes_signals_t){0}, axes);
+
+#if STEP_INJECT_BURST
+    // Shared axes: reapply a normal motion direction change masked during the pulse.
+    if(axes.bits & ~step_pulse.inject.claimed.bits)
+        stepperSetDirOutputs(step_pulse.inject.dir);
+#endif
+}
+
+#if STEP_INJECT_BURST
+
+#if (STEP_INJECT_BURST_QUEUE & (STEP_INJECT_BURST_QUEUE - 1)) != 0
+#error "STEP_INJECT_BURST_QUEUE must be a power of 2!"
+#endif
+
+#define STEP_BURST_TIMEBASE 1000 // ns, burst timer tick
+#define STEP_BURST_PERIOD_MAX 65535
+
+typedef struct {
+    axes_signals_t step;
+    axes_signals_t dir;
+    uint32_t steps;
+    uint32_t period;    // timer ticks
+} step_burst_t;
+
+static struct {
+    hal_timer_t timer;
+    volatile bool running;
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    uint32_t remaining;         // steps left of the burst at tail
+    step_burst_t queue[STEP_INJECT_BURST_QUEUE];
+} step_burst = {0};
+
+// Burst timer update, outputs one step and moves on to the next burst when done.
+// A burst on an unclaimed (shared) axis only steps while the normal motion runs in the same
+// direction, normal steps that coincide with an injected step are lost and added to the burst.
+static void step_burst_tick (void *context)
+{
+    step_burst_t *burst = &step_burst.queue[step_burst.tail];
+    axes_signals_t shared;
+
+    if(step_pulse.inject.lost) {
+        step_burst.remaining += step_pulse.inject.lost;
+        step_pulse.inject.lost = 0;
+    }
+
+    // The tick after the last step of a burst is idle, a lost step during that pulse is still caught.
+    if(step_burst.remaining == 0) {
+        step_burst.tail = (step_burst.tail + 1) & (STEP_INJECT_BURST_QUEUE - 1);
+        if(step_burst.tail == step_burst.head) {
+            hal.timer.stop(step_burst.timer);
+            step_burst.running = false;
+            return;
+        }
+        burst = &step_burst.queue[step_burst.tail];
+        step_burst.remaining = burst->steps;
+        hal.timer.start(step_burst.timer, burst->period); // applied from the next update on
+    }
+
+    shared.bits = burst->step.bits & ~step_pulse.inject.claimed.bits;
+    if(shared.bits && ((step_pulse.inject.dir.bits ^ burst->dir.bits) & shared.bits))
+        return;
+
+    // A step of a stepperInjectStep() generator is in progress, retried on the next tick.
+    if(step_pulse.inject.out.bits)
+        return;
+
+    stepperOutputStep(burst->step, burst->dir);
+    step_burst.remaining--;
+}
+
+bool stepperInjectBurst (axes_signals_t step, axes_signals_t dir, uint32_t steps, float rate)
+{
+    uint_fast8_t next = (step_burst.head + 1) & (STEP_INJECT_BURST_QUEUE - 1);
+    // The step pulse (and delay) must end before the next one starts, in 100 ns units.
+    uint32_t period, period_min = (step_pulse.length + step_pulse.delay + 20) / 10 + 1;
+    axes_signals_t shared;
+
+    step.bits &= AXES_BITMASK;
+    shared.bits = step.bits & ~step_pulse.inject.claimed.bits;
+
+    // A shared axis has to be the only one of its burst for the lost step accounting.
+    if(step_burst.timer == NULL || steps == 0 || rate <= 0.0f || next == step_burst.tail ||
+        step.bits == 0 || (shared.bits && shared.bits != step.bits) || (shared.bits & (shared.bits - 1)))
+        return false;
+
+    period = (uint32_t)(1000000000.0f / (rate * (float)STEP_BURST_TIMEBASE));
+    period = period < period_min ? period_min : (period > STEP_BURST_PERIOD_MAX ? STEP_BURST_PERIOD_MAX : period);
+
+    step_burst.queue[step_burst.head].step = step;
+    step_burst.queue[step_burst.head].dir = dir;
+    step_burst.queue[step_burst.head].steps = steps;
+    step_burst.queue[step_burst.head].period = period;
+    step_burst.head = next;
+
+    // The timer is stopped when not running, the tick cannot interfere.
+    if(!step_burst.running) {
+        step_burst.running = true;
+        step_burst.remaining = steps;
+        step_pulse.inject.lost = 0;
+        hal.timer.start(step_burst.timer, period);
+    }
+
+    return true;
+}
+
+bool stepperInjectStep (axes_signals_t step, axes_signals_t dir)
+{
+    step.bits &= step_pulse.inject.claimed.bits;
+
+    if(step.bits == 0 || step_pulse.inject.out.bits)
+        return false;
+
+    stepperOutputStep(step, dir);
+
+    return true;
+}
+
+bool stepperInjectBusy (void)
+{
+    return step_burst.running;
 }
 
+void stepperInjectAbort (void)
+{
+    __disable_irq();
+    if(step_burst.running) {
+        hal.timer.stop(step_burst.timer);
+        step_burst.running = false;
+    }
+    step_burst.tail = step_burst.head;
+    __enable_irq();
+}
+
+#endif // STEP_INJECT_BURST
+
 #endif // STEP_INJECT_ENABLE
 
+#if TMC_DIAG_HOMING
+
+/*
+  The limit inputs of the homed axes are TMC2209 DIAG outputs. A StallGuard stall may only pulse DIAG
+  briefly, too short to be seen by the homing cycle polling the limit state. While homing the pin
+  interrupts of the homed axes are kept enabled and latch the stall instead of being reported as a
+  hard limit, the latched axes are added to the limit state once by the next hal.limits.get_state call.
+*/
+
+static volatile uint8_t diag_armed = 0, diag_latch = 0;
+
+#endif
+
 // Enable/disable limit pins interrupt
 static void limitsEnable (bool on, axes_signals_t homing_cycle)
 {
@@ -1350,26 +2617,129 @@ static void limitsEnable (bool on, axes_signals_t homing_cycle)
             pin = xbar_fn_to_axismask(limit->id);
             disable = limit->group == PinGroup_Limit ? (pin.mask & homing_source.min.mask) : (pin.mask & homing_source.max.mask);
         }
+#if TMC_DIAG_HOMING
+        if(on && disable && limit->group == PinGroup_Limit) {
+            disable = false;    // homed axis, the interrupt latches stalls
+        }
+#endif
         gpio_irq_enable(limit, disable ? IRQ_Mode_None : limit->mode.irq_mode);
     } while(idx);
+
+#if TMC_DIAG_HOMING
+    diag_latch = 0;
+    diag_armed = on && homing_cycle.mask ? homing_source.min.mask : 0;
+#endif
 }
 
-// Returns limit state as an axes_signals_t variable.
-// Each bitfield bit indicates an axis limit, where triggered is 1 and not triggered is 0.
-inline static limit_signals_t limitsGetState()
-{
-    limit_signals_t signals = {0};
+#if INPUT_GATHER
 
-    signals.min.mask = settings.limits.invert.mask;
-#ifdef DUAL_LIMIT_SWITCHES
-    signals.min2.mask = settings.limits.invert.mask;
-#endif
-#ifdef MAX_LIMIT_SWITCHES
-    signals.max.mask = settings.limits.invert.mask;
-#endif
+_Static_assert(sizeof(limit_signals_t) <= sizeof(uint32_t), "limit_signals_t does not fit the limit gather plan!");
 
-#if LIMIT_INMODE == GPIO_SINGLE
-    signals.min.x = DIGITAL_IN(X_LIMIT_PORT, X_LIMIT_BIT);
+static gpio_gather_t limit_gather, control_gather;
+static uint32_t limit_invert;
+
+// Builds the limit and control input gather plans from the pin map, called by settings_changed().
+// Limit bits are placed at the offsets of the min, min2 and max fields in limit_signals_t.
+static void input_gather_map (void)
+{
+    uint_fast8_t idx;
+    uint32_t shift;
+    input_signal_t *input;
+    control_signals_t signal;
+
+    gpio_gather_clear(&limit_gather);
+    gpio_gather_clear(&control_gather);
+
+    for(idx = 0; idx < limit_inputs.n_pins; idx++) {
+        input = &limit_inputs.pins.inputs[idx];
+        if(input->group == PinGroup_LimitMax)
+            shift = offsetof(limit_signals_t, max) * 8;
+        else if(input->id == Input_LimitX_2 || input->id == Input_LimitY_2 || input->id == Input_LimitZ_2)
+            shift = offsetof(limit_signals_t, min2) * 8;
+        else
+            shift = offsetof(limit_signals_t, min) * 8;
+        gpio_gather_add(&limit_gather, input->port, input->pin, (uint32_t)xbar_fn_to_axismask(input->id).mask << shift);
+    }
+
+    limit_invert = (uint32_t)settings.limits.invert.mask * 0x01010101;
+
+    for(idx = 0; idx < sizeof(inputpin) / sizeof(input_signal_t); idx++) {
+        input = &inputpin[idx];
+        if(input->group == PinGroup_Control) {
+            signal.value = 0;
+            switch(input->id) {
+                case Input_EStop:
+                    signal.e_stop = On;
+                    break;
+                case Input_Reset:
+                    signal.reset = On;
+                    break;
+                case Input_FeedHold:
+                    signal.feed_hold = On;
+                    break;
+                case Input_CycleStart:
+                    signal.cycle_start = On;
+                    break;
+                default:
+                    break;
+            }
+            if(signal.value)
+                gpio_gather_add(&control_gather, input->port, input->pin, signal.value);
+        }
+    }
+
+#if AUX_CONTROLS_ENABLED
+  #ifdef SAFETY_DOOR_PIN
+    signal.value = 0;
+    signal.safety_door_ajar = On;
+    gpio_gather_add(&control_gather, SAFETY_DOOR_PORT, SAFETY_DOOR_PIN, signal.value);
+  #endif
+  #ifdef MOTOR_FAULT_PIN
+    signal.value = 0;
+    signal.motor_fault = On;
+    gpio_gather_add(&control_gather, MOTOR_FAULT_PORT, MOTOR_FAULT_PIN, signal.value);
+  #endif
+  #ifdef MOTOR_WARNING_PIN
+    signal.value = 0;
+    signal.motor_warning = On;
+    gpio_gather_add(&control_gather, MOTOR_WARNING_PORT, MOTOR_WARNING_PIN, signal.value);
+  #endif
+#endif
+}
+
+#endif // INPUT_GATHER
+
+// Returns limit state as an axes_signals_t variable.
+// Each bitfield bit indicates an axis limit, where triggered is 1 and not triggered is 0.
+#if TMC_DIAG_HOMING
+inline static limit_signals_t limitsGetPinState (void)
+#else
+inline static limit_signals_t limitsGetState()
+#endif
+{
+#if INPUT_GATHER
+
+    limit_signals_t signals;
+    uint32_t bits = (gpio_gather_read(&limit_gather) ^ limit_invert) & limit_gather.present;
+
+    memcpy(&signals, &bits, sizeof(signals));
+
+    return signals;
+
+#else
+
+    limit_signals_t signals = {0};
+
+    signals.min.mask = settings.limits.invert.mask;
+#ifdef DUAL_LIMIT_SWITCHES
+    signals.min2.mask = settings.limits.invert.mask;
+#endif
+#ifdef MAX_LIMIT_SWITCHES
+    signals.max.mask = settings.limits.invert.mask;
+#endif
+
+#if LIMIT_INMODE == GPIO_SINGLE
+    signals.min.x = DIGITAL_IN(X_LIMIT_PORT, X_LIMIT_BIT);
     signals.min.y = DIGITAL_IN(Y_LIMIT_PORT, Y_LIMIT_BIT);
     signals.min.z = DIGITAL_IN(Z_LIMIT_PORT, Z_LIMIT_BIT);
   #ifdef A_LIMIT_PIN
@@ -1456,13 +2826,53 @@ inline static limit_signals_t limitsGetState()
 #endif
     }
 
+    return signals;
+
+#endif // INPUT_GATHER
+}
+
+#if TMC_DIAG_HOMING
+
+// Adds the stalls latched while homing to the pin state, each is reported once.
+static limit_signals_t limitsGetState (void)
+{
+    limit_signals_t signals = limitsGetPinState();
+
+    if(diag_latch) {
+        __disable_irq();
+        signals.min.mask |= diag_latch;
+        diag_latch = 0;
+        __enable_irq();
+    }
+
     return signals;
 }
 
+#endif
+
 // Returns system state as a control_signals_t variable.
 // Each bitfield bit indicates a control signal, where triggered is 1 and not triggered is 0.
 static control_signals_t systemGetState (void)
 {
+#if INPUT_GATHER
+
+    // Pins without an input read as not inverted, i.e. not triggered.
+    control_signals_t signals = { (settings.control_invert.mask & ~control_gather.present) | gpio_gather_read(&control_gather) };
+
+  #if AUX_CONTROLS_ENABLED && defined(SAFETY_DOOR_PIN)
+    if(debounce.safety_door)
+        signals.safety_door_ajar = !settings.control_invert.safety_door_ajar;
+  #endif
+
+    if(settings.control_invert.mask)
+        signals.value ^= settings.control_invert.mask;
+
+  #if AUX_CONTROLS_ENABLED && AUX_CONTROLS_SCAN
+    signals = aux_ctrl_scan_status(signals);
+  #endif
+
+#else
+
     control_signals_t signals = { settings.control_invert.mask };
 
 #if CONTROL_INMODE == GPIO_SINGLE
@@ -1519,6 +2929,8 @@ static control_signals_t systemGetState (void)
 
 #endif // AUX_CONTROLS_ENABLED
 
+#endif // INPUT_GATHER
+
     return signals;
 }
 
@@ -1655,22 +3067,49 @@ static bool aux_claim_explicit (aux_ctrl_t *aux_ctrl)
 
 #if SPINDLE_ENCODER_ENABLE
 
-static spindle_data_t *spindleGetData (spindle_data_request_t request)
+// Consistent copy of the encoder counters, returns the pulse length in RPM timer ticks.
+static inline __attribute__((always_inline)) uint32_t spindleEncoderSnapshot (spindle_encoder_counter_t *encoder, uint32_t *rpm_timer_delta)
 {
-    bool stopped;
-    uint32_t pulse_length, rpm_timer_delta;
+    uint32_t seq, pulse_length;
+
+    do {
+        seq = encoder_seq;
+        __DMB();
+        memcpy(encoder, &spindle_encoder.counter, sizeof(spindle_encoder_counter_t));
+        pulse_length = spindle_encoder.timer.pulse_length;
+        *rpm_timer_delta = RPM_TIMER->CNT - spindle_encoder.timer.last_pulse;
+        __DMB();
+    } while((seq & 1) || seq != encoder_seq);
+
+    return pulse_length / spindle_encoder.tics_per_irq;
+}
+
+#if SPINDLE_SYNC_PID_Q16
+
+// SpindleData_AngularPosition as Q16.16 revolutions from integer arithmetic only.
+static int64_t spindleGetRevolutionsQ16 (void)
+{
+    uint32_t pulse_length, rpm_timer_delta, frac_q16 = 0;
     spindle_encoder_counter_t encoder;
 
-//    while(spindle_encoder.spin_lock);
+    pulse_length = spindleEncoderSnapshot(&encoder, &rpm_timer_delta);
 
-    __disable_irq();
+    if(pulse_length && rpm_timer_delta <= spindle_encoder.maximum_tt)
+        frac_q16 = rpm_timer_delta >= pulse_length ? 0x10000 : (rpm_timer_delta << 16) / pulse_length;
 
-    memcpy(&encoder, &spindle_encoder.counter, sizeof(spindle_encoder_counter_t));
+    return ((int64_t)encoder.index_count << 16) +
+            (((uint32_t)(uint16_t)((uint16_t)encoder.last_count - (uint16_t)encoder.last_index) << 16) + frac_q16) / spindle_encoder.ppr;
+}
 
-    pulse_length = spindle_encoder.timer.pulse_length / spindle_encoder.tics_per_irq;
-    rpm_timer_delta = RPM_TIMER->CNT - spindle_encoder.timer.last_pulse;
+#endif
 
-    __enable_irq();
+static spindle_data_t *spindleGetData (spindle_data_request_t request)
+{
+    bool stopped;
+    uint32_t pulse_length, rpm_timer_delta;
+    spindle_encoder_counter_t encoder;
+
+    pulse_length = spindleEncoderSnapshot(&encoder, &rpm_timer_delta);
 
     // If no spindle pulses during last 250 ms assume RPM is 0
     if((stopped = ((pulse_length == 0) || (rpm_timer_delta > spindle_encoder.maximum_tt)))) {
@@ -1711,8 +3150,6 @@ static spindle_data_t *spindleGetData (spindle_data_request_t request)
 
 static void spindleDataReset (void)
 {
-    while(spindle_encoder.spin_lock);
-
     uint32_t timeout = uwTick + 1000; // 1 second
 
     uint32_t index_count = spindle_encoder.counter.index_count + 2;
@@ -1727,6 +3164,13 @@ static void spindleDataReset (void)
     RPM_TIMER->EGR |= TIM_EGR_UG; // Reload RPM timer
     RPM_COUNTER->CR1 &= ~TIM_CR1_CEN;
 
+    // The writers are held off while the counters are cleared so that the sequence stays valid.
+    NVIC_DisableIRQ(RPM_COUNTER_IRQn);
+#ifdef SPINDLE_INDEX_BIT
+    EXTI->IMR1 &= ~SPINDLE_INDEX_BIT;
+#endif
+    encoder_write_begin();
+
     spindle_encoder.timer.last_index =
     spindle_encoder.timer.last_index = RPM_TIMER->CNT;
 
@@ -1737,6 +3181,12 @@ static void spindleDataReset (void)
     spindle_encoder.counter.index_count =
     spindle_encoder.error_count = 0;
 
+    encoder_write_end();
+#ifdef SPINDLE_INDEX_BIT
+    EXTI->IMR1 |= SPINDLE_INDEX_BIT;
+#endif
+    NVIC_EnableIRQ(RPM_COUNTER_IRQn);
+
     RPM_COUNTER->EGR |= TIM_EGR_UG;
     RPM_COUNTER->CCR1 = spindle_encoder.tics_per_irq;
     RPM_COUNTER->CR1 |= TIM_CR1_CEN;
@@ -1856,313 +3306,448 @@ void gpio_irq_enable (const input_signal_t *input, pin_irq_mode_t irq_mode)
 }
 
 // Configures peripherals when settings are initialized or changed
-void settings_changed (settings_t *settings, settings_changed_flags_t changed)
-{
+// The core only flags spindle changes, the driver keeps a copy of the settings the I/O was last
+// configured from and redoes only the parts that depend on settings that differ. A $ setting
+// write unrelated to the driver then does not touch the step/dir outputs or the input interrupts.
 
-#if USE_STEPDIR_MAP
-    stepdirmap_init(settings);
-#endif
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t stepdir :1,
+                pulse   :1,
+                inputs  :1,
+                limits  :1,
+                unused  :4;
+    };
+} driver_changed_t;
 
-    if(IOInitDone) {
+static struct {
+    bool valid;
+    float pulse_microseconds;
+    float pulse_delay_microseconds;
+    axes_signals_t step_invert;
+    axes_signals_t dir_invert;
+    axes_signals_t ganged_dir_invert;
+    control_signals_t control_invert;
+    control_signals_t control_disable_pullup;
+    axes_signals_t limits_invert;
+    axes_signals_t limits_disable_pullup;
+    bool hard_enabled;
+    uint32_t aux_irq;
+} io_settings;
+
+static driver_changed_t io_settings_diff (settings_t *settings)
+{
+    driver_changed_t changed = {0};
 
-        GPIO_InitTypeDef GPIO_Init = {
-            .Speed = GPIO_SPEED_FREQ_HIGH
-        };
+    if(!io_settings.valid)
+        changed.value = 0x0F;
+    else {
+        changed.stepdir = io_settings.step_invert.mask != settings->steppers.step_invert.mask ||
+                           io_settings.dir_invert.mask != settings->steppers.dir_invert.mask ||
+                            io_settings.ganged_dir_invert.mask != settings->steppers.ganged_dir_invert.mask;
+        changed.pulse = changed.stepdir ||
+                         io_settings.pulse_microseconds != settings->steppers.pulse_microseconds ||
+                          io_settings.pulse_delay_microseconds != settings->steppers.pulse_delay_microseconds;
+        changed.inputs = io_settings.control_invert.mask != settings->control_invert.mask ||
+                          io_settings.control_disable_pullup.mask != settings->control_disable_pullup.mask ||
+                           io_settings.limits_invert.mask != settings->limits.invert.mask ||
+                            io_settings.limits_disable_pullup.mask != settings->limits.disable_pullup.mask ||
+                             io_settings.aux_irq != aux_irq;
+        changed.limits = changed.inputs || io_settings.hard_enabled != settings->limits.flags.hard_enabled;
+    }
 
-        stepperSetStepOutputs((axes_signals_t){0});
-        stepperSetDirOutputs((axes_signals_t){0});
+    io_settings.pulse_microseconds = settings->steppers.pulse_microseconds;
+    io_settings.pulse_delay_microseconds = settings->steppers.pulse_delay_microseconds;
+    io_settings.step_invert = settings->steppers.step_invert;
+    io_settings.dir_invert = settings->steppers.dir_invert;
+    io_settings.ganged_dir_invert = settings->steppers.ganged_dir_invert;
+    io_settings.control_invert = settings->control_invert;
+    io_settings.control_disable_pullup = settings->control_disable_pullup;
+    io_settings.limits_invert = settings->limits.invert;
+    io_settings.limits_disable_pullup = settings->limits.disable_pullup;
+    io_settings.hard_enabled = settings->limits.flags.hard_enabled;
+    io_settings.aux_irq = aux_irq;
+
+    return changed;
+}
 
-#ifdef SQUARING_ENABLED
-        hal.stepper.disable_motors((axes_signals_t){0}, SquaringMode_Both);
+// Step and direction output tables and idle levels.
+static void stepdir_settings_changed (settings_t *settings)
+{
+#if USE_STEPDIR_MAP
+    stepdirmap_init(settings);
 #endif
 
-#if SPINDLE_ENCODER_ENABLE
-
-        static const spindle_data_ptrs_t encoder_data = {
-            .get = spindleGetData,
-            .reset = spindleDataReset
-        };
-
-        static bool event_claimed = false;
-
-        spindle_tracker.min_cycles_per_tick = hal.f_step_timer / (uint32_t)(settings->axis[Z_AXIS].max_rate * settings->axis[Z_AXIS].steps_per_mm / 60.0f);
-
-        if((hal.spindle_data.get = settings->spindle.ppr > 0 ? spindleGetData : NULL) &&
-             (spindle_encoder.ppr != settings->spindle.ppr || pidf_config_changed(&spindle_tracker.pid, &settings->position.pid))) {
-
-            spindle_ptrs_t *spindle;
-
-            hal.spindle_data.reset = spindleDataReset;
-            if((spindle = spindle_get(0)))
-                spindle->set_state(spindle, (spindle_state_t){0}, 0.0f);
-
-            pidf_init(&spindle_tracker.pid, &settings->position.pid);
-
-            if(!event_claimed) {
-                event_claimed = true;
-                on_spindle_programmed = grbl.on_spindle_programmed;
-                grbl.on_spindle_programmed = onSpindleProgrammed;
-            }
-
-            spindle_encoder.ppr = settings->spindle.ppr;
-            spindle_encoder.tics_per_irq = max(1, spindle_encoder.ppr / 32);
-            spindle_encoder.pulse_distance = 1.0f / spindle_encoder.ppr;
-            spindle_encoder.maximum_tt = 250000UL / RPM_TIMER_RESOLUTION; // 250ms
-            spindle_encoder.rpm_factor = (60.0f * 1000000.0f / RPM_TIMER_RESOLUTION) / (float)spindle_encoder.ppr;
-            spindleDataReset();
-        } else {
-            spindle_encoder.ppr = 0;
-            hal.spindle_data.reset = NULL;
-        }
+#if STEPDIR_BSRR_TABLE
+  #ifdef SQUARING_ENABLED
+    bsrr_map_build(&step_bsrr, step_pins, sizeof(step_pins) / sizeof(stepdir_pin_t),
+                    settings->steppers.step_invert, settings->steppers.step_invert, motors_1, motors_2);
+  #else
+    bsrr_map_build(&step_bsrr, step_pins, sizeof(step_pins) / sizeof(stepdir_pin_t),
+                    settings->steppers.step_invert, settings->steppers.step_invert,
+                     (axes_signals_t){AXES_BITMASK}, (axes_signals_t){AXES_BITMASK});
+  #endif
+    bsrr_map_build(&dir_bsrr, dir_pins, sizeof(dir_pins) / sizeof(stepdir_pin_t),
+                    settings->steppers.dir_invert, (axes_signals_t){settings->steppers.dir_invert.bits ^ settings->steppers.ganged_dir_invert.bits},
+                     (axes_signals_t){AXES_BITMASK}, (axes_signals_t){AXES_BITMASK});
+#elif defined(SQUARING_ENABLED)
+    squaring_out_build(settings->steppers.step_invert);
+#endif
+}
 
-        spindle_bind_encoder(spindle_encoder.ppr ? &encoder_data : NULL);
+// Step pulse length and delay, redone after stepdir_settings_changed() as the DMA and OPM
+// step outputs are configured from the tables and invert mask.
+static void pulse_settings_changed (settings_t *settings)
+{
+    step_pulse.length = (uint32_t)(10.0f * (settings->steppers.pulse_microseconds - STEP_PULSE_LATENCY)) - 1;
 
-#endif // SPINDLE_ENCODER_ENABLE
+    if(hal.driver_cap.step_pulse_delay && settings->steppers.pulse_delay_microseconds > 0.0f) {
+        step_pulse.delay = (uint32_t)(10.0f * settings->steppers.pulse_delay_microseconds) - 1;
+        if(step_pulse.delay > (uint32_t)(10.0f * STEP_PULSE_LATENCY))
+            step_pulse.delay = max(10, step_pulse.delay - (uint32_t)(10.0f * STEP_PULSE_LATENCY));
+        hal.stepper.pulse_start = stepperPulseStartDelayed;
+    } else {
+        step_pulse.delay = 0;
+        hal.stepper.pulse_start = stepperPulseStart;
+    }
 
-        step_pulse.length = (uint32_t)(10.0f * (settings->steppers.pulse_microseconds - STEP_PULSE_LATENCY)) - 1;
+    PULSE_TIMER->DIER = TIM_DIER_UIE;
+    PULSE_TIMER->CCR1 = step_pulse.delay ? step_pulse.length : 0;
+    PULSE_TIMER->ARR = step_pulse.length + step_pulse.delay;
 
-        if(hal.driver_cap.step_pulse_delay && settings->steppers.pulse_delay_microseconds > 0.0f) {
-            step_pulse.delay = (uint32_t)(10.0f * settings->steppers.pulse_delay_microseconds) - 1;
-            if(step_pulse.delay > (uint32_t)(10.0f * STEP_PULSE_LATENCY))
-                step_pulse.delay = max(10, step_pulse.delay - (uint32_t)(10.0f * STEP_PULSE_LATENCY));
-            hal.stepper.pulse_start = stepperPulseStartDelayed;
-        } else {
-            step_pulse.delay = 0;
-            hal.stepper.pulse_start = stepperPulseStart;
-        }
+#if STEP_PULSE_DMA
+    if(!step_pulse.delay) {
+        uint32_t dier;
+        if((dier = stepperDMAConfigure()))
+            PULSE_TIMER->DIER = dier; // pulses are ended by DMA, no interrupt
+    }
+#endif
 
-        PULSE_TIMER->DIER = TIM_DIER_UIE;
-        PULSE_TIMER->CCR1 = step_pulse.delay ? step_pulse.length : 0;
-        PULSE_TIMER->ARR = step_pulse.length + step_pulse.delay;
+#if STEP_PULSE_OPM
+    stepperOPMConfigure(settings);
+#endif
 
 #if STEP_INJECT_ENABLE
 
-        timer_cfg_t step_inject_cfg = {
-            .single_shot = On,
-            .timeout_callback = step_inject_off
-        };
+    timer_cfg_t step_inject_cfg = {
+        .single_shot = On,
+        .timeout_callback = step_inject_off
+    };
 
-        step_inject_cfg.irq0_callback = step_pulse.delay ? step_inject_on : NULL;
-        step_inject_cfg.irq0 = step_pulse.delay;
+    step_inject_cfg.irq0_callback = step_pulse.delay ? step_inject_on : NULL;
+    step_inject_cfg.irq0 = step_pulse.delay;
 
-        hal.timer.configure(step_pulse.inject.timer, &step_inject_cfg);
+    hal.timer.configure(step_pulse.inject.timer, &step_inject_cfg);
 
 #endif
+}
 
-        /*************************
-         *  Control pins config  *
-         *************************/
+// Control and limit input pull-ups, interrupt edges and EXTI enables.
+static void input_settings_changed (settings_t *settings)
+{
+    GPIO_InitTypeDef GPIO_Init = {
+        .Speed = GPIO_SPEED_FREQ_HIGH
+    };
+
+    /*************************
+     *  Control pins config  *
+     *************************/
 
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & (1<<0)
-        HAL_NVIC_DisableIRQ(EXTI0_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI0_IRQn);
 #endif
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & (1<<1)
-        HAL_NVIC_DisableIRQ(EXTI1_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI1_IRQn);
 #endif
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & (1<<2)
-        HAL_NVIC_DisableIRQ(EXTI2_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI2_IRQn);
 #endif
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & (1<<3)
-        HAL_NVIC_DisableIRQ(EXTI3_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI3_IRQn);
 #endif
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & (1<<4)
-        HAL_NVIC_DisableIRQ(EXTI4_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI4_IRQn);
 #endif
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & 0x03E0
-        HAL_NVIC_DisableIRQ(EXTI9_5_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI9_5_IRQn);
 #endif
 #if (DRIVER_IRQMASK|AUXINPUT_MASK) & 0xFC00
-        HAL_NVIC_DisableIRQ(EXTI15_10_IRQn);
+    HAL_NVIC_DisableIRQ(EXTI15_10_IRQn);
 #endif
 
-        uint32_t i = sizeof(inputpin) / sizeof(input_signal_t);
-        input_signal_t *input;
+    uint32_t i = sizeof(inputpin) / sizeof(input_signal_t);
+    input_signal_t *input;
 
-        control_signals_t control_fei;
-        control_fei.mask = settings->control_disable_pullup.mask ^ settings->control_invert.mask;
+    control_signals_t control_fei;
+    control_fei.mask = settings->control_disable_pullup.mask ^ settings->control_invert.mask;
 
-        axes_signals_t limit_fei;
-        limit_fei.mask = settings->limits.disable_pullup.mask ^ settings->limits.invert.mask;
+    axes_signals_t limit_fei;
+    limit_fei.mask = settings->limits.disable_pullup.mask ^ settings->limits.invert.mask;
 
-        do {
+    do {
 
-            input = &inputpin[--i];
+        input = &inputpin[--i];
 
-            if(input->group == PinGroup_AuxInputAnalog)
-                continue;
+        if(input->group == PinGroup_AuxInputAnalog)
+            continue;
 
-            if(!(input->group == PinGroup_AuxInput || input->group == PinGroup_MPG))
-                input->mode.irq_mode = IRQ_Mode_None;
+        if(!(input->group == PinGroup_AuxInput || input->group == PinGroup_MPG))
+            input->mode.irq_mode = IRQ_Mode_None;
 
-            switch(input->id) {
+        switch(input->id) {
 
-                case Input_EStop:
-                    input->mode.pull_mode = settings->control_disable_pullup.e_stop ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = control_fei.e_stop ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_EStop:
+                input->mode.pull_mode = settings->control_disable_pullup.e_stop ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = control_fei.e_stop ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_Reset:
-                    input->mode.pull_mode = settings->control_disable_pullup.reset ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = control_fei.reset ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_Reset:
+                input->mode.pull_mode = settings->control_disable_pullup.reset ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = control_fei.reset ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_FeedHold:
-                    input->mode.pull_mode = settings->control_disable_pullup.feed_hold ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = control_fei.feed_hold ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_FeedHold:
+                input->mode.pull_mode = settings->control_disable_pullup.feed_hold ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = control_fei.feed_hold ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_CycleStart:
-                    input->mode.pull_mode = settings->control_disable_pullup.cycle_start ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = control_fei.cycle_start ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_CycleStart:
+                input->mode.pull_mode = settings->control_disable_pullup.cycle_start ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = control_fei.cycle_start ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_SafetyDoor:
-                    input->mode.pull_mode = settings->control_disable_pullup.safety_door_ajar ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = control_fei.safety_door_ajar ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_SafetyDoor:
+                input->mode.pull_mode = settings->control_disable_pullup.safety_door_ajar ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = control_fei.safety_door_ajar ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitX:
-                case Input_LimitX_2:
-                case Input_LimitX_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.x ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.x ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitX:
+            case Input_LimitX_2:
+            case Input_LimitX_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.x ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.x ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitY:
-                case Input_LimitY_2:
-                case Input_LimitY_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.y ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.y ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitY:
+            case Input_LimitY_2:
+            case Input_LimitY_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.y ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.y ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitZ:
-                case Input_LimitZ_2:
-                case Input_LimitZ_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.z ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.z ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitZ:
+            case Input_LimitZ_2:
+            case Input_LimitZ_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.z ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.z ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitA:
-                case Input_LimitA_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.a ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.a ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitA:
+            case Input_LimitA_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.a ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.a ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitB:
-                case Input_LimitB_Max:
-                    input->mode.pull_mode = !settings->limits.disable_pullup.b ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.b ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitB:
+            case Input_LimitB_Max:
+                input->mode.pull_mode = !settings->limits.disable_pullup.b ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.b ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitC:
-                case Input_LimitC_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.c ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.c ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitC:
+            case Input_LimitC_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.c ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.c ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitU:
-                case Input_LimitU_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.u ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.u ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitU:
+            case Input_LimitU_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.u ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.u ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_LimitV:
-                case Input_LimitV_Max:
-                    input->mode.pull_mode = settings->limits.disable_pullup.v ? PullMode_None : PullMode_Up;
-                    input->mode.irq_mode = limit_fei.v ? IRQ_Mode_Falling : IRQ_Mode_Rising;
-                    break;
+            case Input_LimitV:
+            case Input_LimitV_Max:
+                input->mode.pull_mode = settings->limits.disable_pullup.v ? PullMode_None : PullMode_Up;
+                input->mode.irq_mode = limit_fei.v ? IRQ_Mode_Falling : IRQ_Mode_Rising;
+                break;
 
-                case Input_SPIIRQ:
-                    input->mode.pull_mode = true;
-                    input->mode.irq_mode = IRQ_Mode_Falling;
-                    break;
+            case Input_SPIIRQ:
+                input->mode.pull_mode = true;
+                input->mode.irq_mode = IRQ_Mode_Falling;
+                break;
 
-                case Input_SpindleIndex:
-                    input->mode.pull_mode = PullMode_Up;
-                    input->mode.irq_mode = IRQ_Mode_Falling;
-                    break;
+            case Input_SpindleIndex:
+                input->mode.pull_mode = PullMode_Up;
+                input->mode.irq_mode = IRQ_Mode_Falling;
+                break;
 
 #if SDCARD_ENABLE && defined(SD_DETECT_PIN)
-                case Input_SdCardDetect:
-                    input->mode.pull_mode = PullMode_Up;
-                    input->mode.irq_mode = IRQ_Mode_Change;
-                    input->mode.debounce = On;
-                    break;
+            case Input_SdCardDetect:
+                input->mode.pull_mode = PullMode_Up;
+                input->mode.irq_mode = IRQ_Mode_Change;
+                input->mode.debounce = On;
+                break;
 #endif
 
-                default:
-                    break;
-            }
+            default:
+                break;
+        }
 
-            if(input->group == PinGroup_AuxInput) {
-                if(input->cap.irq_mode != IRQ_Mode_None) {
-                    // Map interrupt to pin
-                    uint32_t extireg = SYSCFG->EXTICR[input->pin >> 2] & ~(0b1111 << ((input->pin & 0b11) << 2));
-                    extireg |= ((uint32_t)(GPIO_GET_INDEX(input->port)) << ((input->pin & 0b11) << 2));
-                    SYSCFG->EXTICR[input->pin >> 2] = extireg;
-                }
+        if(input->group == PinGroup_AuxInput) {
+            if(input->cap.irq_mode != IRQ_Mode_None) {
+                // Map interrupt to pin
+                uint32_t extireg = SYSCFG->EXTICR[input->pin >> 2] & ~(0b1111 << ((input->pin & 0b11) << 2));
+                extireg |= ((uint32_t)(GPIO_GET_INDEX(input->port)) << ((input->pin & 0b11) << 2));
+                SYSCFG->EXTICR[input->pin >> 2] = extireg;
             }
+        }
 
-            GPIO_Init.Pin = input->bit;
-            GPIO_Init.Pull = input->mode.pull_mode == PullMode_Up ? GPIO_PULLUP : GPIO_NOPULL;
+        GPIO_Init.Pin = input->bit;
+        GPIO_Init.Pull = input->mode.pull_mode == PullMode_Up ? GPIO_PULLUP : GPIO_NOPULL;
 
-            switch(input->mode.irq_mode) {
-                case IRQ_Mode_Rising:
-                    GPIO_Init.Mode = GPIO_MODE_IT_RISING;
-                    break;
-                case IRQ_Mode_Falling:
-                    GPIO_Init.Mode = GPIO_MODE_IT_FALLING;
-                    break;
-                case IRQ_Mode_Change:
-                    GPIO_Init.Mode = GPIO_MODE_IT_RISING_FALLING;
-                    break;
-                default:
-                    GPIO_Init.Mode = GPIO_MODE_INPUT;
-                    break;
-            }
-            HAL_GPIO_Init(input->port, &GPIO_Init);
+        switch(input->mode.irq_mode) {
+            case IRQ_Mode_Rising:
+                GPIO_Init.Mode = GPIO_MODE_IT_RISING;
+                break;
+            case IRQ_Mode_Falling:
+                GPIO_Init.Mode = GPIO_MODE_IT_FALLING;
+                break;
+            case IRQ_Mode_Change:
+                GPIO_Init.Mode = GPIO_MODE_IT_RISING_FALLING;
+                break;
+            default:
+                GPIO_Init.Mode = GPIO_MODE_INPUT;
+                break;
+        }
+        HAL_GPIO_Init(input->port, &GPIO_Init);
 
-        } while(i);
+    } while(i);
 
-        uint32_t irq_mask = DRIVER_IRQMASK|aux_irq;
+    gpio_irq_map();
+#if INPUT_GATHER
+    input_gather_map();
+#endif
 
-        __HAL_GPIO_EXTI_CLEAR_IT(irq_mask);
+    uint32_t irq_mask = DRIVER_IRQMASK|aux_irq;
 
-        if(irq_mask & (1<<0)) {
-            HAL_NVIC_SetPriority(EXTI0_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI0_IRQn);
-        }
-        if(irq_mask & (1<<1)) {
-            HAL_NVIC_SetPriority(EXTI1_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI1_IRQn);
-        }
-        if(irq_mask & (1<<2)) {
-            HAL_NVIC_SetPriority(EXTI2_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI2_IRQn);
-        }
-        if(irq_mask & (1<<3)) {
-            HAL_NVIC_SetPriority(EXTI3_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI3_IRQn);
-        }
-        if(irq_mask & (1<<4)) {
-            HAL_NVIC_SetPriority(EXTI4_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI4_IRQn);
-        }
-        if(irq_mask & 0x03E0) {
-            HAL_NVIC_SetPriority(EXTI9_5_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+    __HAL_GPIO_EXTI_CLEAR_IT(irq_mask);
+
+    if(irq_mask & (1<<0)) {
+        HAL_NVIC_SetPriority(EXTI0_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI0_IRQn);
+    }
+    if(irq_mask & (1<<1)) {
+        HAL_NVIC_SetPriority(EXTI1_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI1_IRQn);
+    }
+    if(irq_mask & (1<<2)) {
+        HAL_NVIC_SetPriority(EXTI2_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI2_IRQn);
+    }
+    if(irq_mask & (1<<3)) {
+        HAL_NVIC_SetPriority(EXTI3_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI3_IRQn);
+    }
+    if(irq_mask & (1<<4)) {
+        HAL_NVIC_SetPriority(EXTI4_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI4_IRQn);
+    }
+    if(irq_mask & 0x03E0) {
+        HAL_NVIC_SetPriority(EXTI9_5_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+    }
+    if(irq_mask & 0xFC00) {
+        HAL_NVIC_SetPriority(EXTI15_10_IRQn, IRQ_PRIO_INPUT, 0);
+        HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
+    }
+}
+
+void settings_changed (settings_t *settings, settings_changed_flags_t changed)
+{
+    driver_changed_t io_changed = io_settings_diff(settings);
+
+    if(io_changed.stepdir)
+        stepdir_settings_changed(settings);
+
+    if(IOInitDone) {
+
+        if(io_changed.stepdir) {
+            stepperSetStepOutputs((axes_signals_t){0});
+            stepperSetDirOutputs((axes_signals_t){0});
+
+#ifdef SQUARING_ENABLED
+            hal.stepper.disable_motors((axes_signals_t){0}, SquaringMode_Both);
+#endif
         }
-        if(irq_mask & 0xFC00) {
-            HAL_NVIC_SetPriority(EXTI15_10_IRQn, 0, 2);
-            HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
+
+#if SPINDLE_ENCODER_ENABLE
+
+        static const spindle_data_ptrs_t encoder_data = {
+            .get = spindleGetData,
+            .reset = spindleDataReset
+        };
+
+        static bool event_claimed = false;
+
+        spindle_tracker.min_cycles_per_tick = hal.f_step_timer / (uint32_t)(settings->axis[Z_AXIS].max_rate * settings->axis[Z_AXIS].steps_per_mm / 60.0f);
+
+        if((hal.spindle_data.get = settings->spindle.ppr > 0 ? spindleGetData : NULL) &&
+             (spindle_encoder.ppr != settings->spindle.ppr || pidf_config_changed(&spindle_tracker.pid, &settings->position.pid))) {
+
+            spindle_ptrs_t *spindle;
+
+            hal.spindle_data.reset = spindleDataReset;
+            if((spindle = spindle_get(0)))
+                spindle->set_state(spindle, (spindle_state_t){0}, 0.0f);
+
+            pidf_init(&spindle_tracker.pid, &settings->position.pid);
+#if SPINDLE_SYNC_PID_Q16
+            sync_pid.kp = (int32_t)(settings->position.pid.p_gain * 65536.0f);
+            sync_pid.ki = (int32_t)(settings->position.pid.i_gain * 65536.0f);
+            sync_pid.kd = (int32_t)(settings->position.pid.d_gain * 65536.0f);
+            sync_pid.i_max = (int64_t)(settings->position.pid.i_max_error * 65536.0f);
+            sync_pid.tick_s_q48 = (uint32_t)((1ULL << 48) / hal.f_step_timer);
+#endif
+
+            if(!event_claimed) {
+                event_claimed = true;
+                on_spindle_programmed = grbl.on_spindle_programmed;
+                grbl.on_spindle_programmed = onSpindleProgrammed;
+            }
+
+            spindle_encoder.ppr = settings->spindle.ppr;
+            spindle_encoder.tics_per_irq = max(1, spindle_encoder.ppr / 32);
+            spindle_encoder.pulse_distance = 1.0f / spindle_encoder.ppr;
+            spindle_encoder.maximum_tt = 250000UL / RPM_TIMER_RESOLUTION; // 250ms
+            spindle_encoder.rpm_factor = (60.0f * 1000000.0f / RPM_TIMER_RESOLUTION) / (float)spindle_encoder.ppr;
+            spindleDataReset();
+        } else {
+            spindle_encoder.ppr = 0;
+            hal.spindle_data.reset = NULL;
         }
 
-        hal.limits.enable(settings->limits.flags.hard_enabled, (axes_signals_t){0});
+        spindle_bind_encoder(spindle_encoder.ppr ? &encoder_data : NULL);
+
+#endif // SPINDLE_ENCODER_ENABLE
+
+        if(io_changed.pulse)
+            pulse_settings_changed(settings);
+
+        if(io_changed.inputs)
+            input_settings_changed(settings);
+
+        if(io_changed.limits)
+            hal.limits.enable(settings->limits.flags.hard_enabled, (axes_signals_t){0});
 
 #if AUX_CONTROLS_ENABLED
-        aux_ctrl_irq_enable(settings, aux_irq_handler);
+        if(io_changed.inputs)
+            aux_ctrl_irq_enable(settings, aux_irq_handler);
 #endif
     }
+
+    io_settings.valid = IOInitDone;
 }
 
 static char *port2char (GPIO_TypeDef *port)
@@ -2223,7 +3808,7 @@ static void enumeratePins (bool low_level, pin_info_ptr pin_info, void *data)
 
 void registerPeriphPin (const periph_pin_t *pin)
 {
-    periph_signal_t *add_pin = malloc(sizeof(periph_signal_t));
+    periph_signal_t *add_pin = mem_boot_alloc(sizeof(periph_signal_t));
 
     if(!add_pin)
         return;
@@ -2257,23 +3842,6 @@ void setPeriphPinDescription (const pin_function_t function, const pin_group_t g
 
 #if ETHERNET_ENABLE
 
-uint32_t crc32_bitwise(const void* data, size_t length)
-{
-  const uint32_t polynomial = 0xEDB88320;
-  uint32_t crc = 0xFFFFFFFF;
-  unsigned char* current = (unsigned char*) data;
-  while (length--)
-  {
-    crc ^= *current++;
-    for (unsigned int j = 0; j < 8; j++)
-      if (crc & 1)
-        crc = (crc >> 1) ^ polynomial;
-      else
-        crc =  crc >> 1;
-  }
-  return ~crc;
-}
-
 bool bmac_eth_get (uint8_t mac[6])
 {
 #if defined(_WIZCHIP_)
@@ -2298,7 +3866,7 @@ bool bmac_eth_get (uint8_t mac[6])
     uid[2] = HAL_GetUIDw2();
 
     // Generate 32bit CRC from 96 bit UID
-    uint32_t crc = crc32_bitwise(uid, 12);
+    uint32_t crc = crc32_calc(uid, 12);
 
     // Copy first 24bits of the CRC into the MAC address
     memcpy(&mac[3], &crc, 3);
@@ -2309,8 +3877,30 @@ bool bmac_eth_get (uint8_t mac[6])
 #endif // ETHERNET_ENABLE
 
 // Initializes MCU peripherals for Grbl use
+#if LITTLEFS_ENABLE
+
+static void littlefs_mount (void *data)
+{
+    fs_littlefs_mount("/littlefs", stm32_littlefs_hal());
+    BOOT_MARK("littlefs");
+}
+
+#endif
+
+#if SDCARD_ENABLE && defined(SD_DETECT_PIN)
+
+static void sdcard_mount (void *data)
+{
+    sdcard_detect(true);
+    BOOT_MARK("sdcard_mount");
+}
+
+#endif
+
 static bool driver_setup (settings_t *settings)
 {
+    BOOT_MARK("settings_load");
+
     // Interrupt_disableSleepOnIsrExit();
 
     GPIO_InitTypeDef GPIO_Init = {
@@ -2335,6 +3925,7 @@ static bool driver_setup (settings_t *settings)
     }
 
     hal.delay_ms(100, NULL);
+    BOOT_MARK("stepper_power");
 
     for(i = 0 ; i < sizeof(outputpin) / sizeof(output_signal_t); i++) {
         if(!(outputpin[i].group == PinGroup_StepperPower ||
@@ -2367,7 +3958,7 @@ static bool driver_setup (settings_t *settings)
     STEPPER_TIMER->CR1 |= TIM_CR1_DIR;
     STEPPER_TIMER->DIER |= TIM_DIER_UIE;
 
-    NVIC_SetPriority(STEPPER_TIMER_IRQn, 1);
+    HAL_NVIC_SetPriority(STEPPER_TIMER_IRQn, IRQ_PRIO_STEPPER, 0);
     NVIC_EnableIRQ(STEPPER_TIMER_IRQn);
 
  // Single-shot 100 ns per tick
@@ -2378,27 +3969,77 @@ static bool driver_setup (settings_t *settings)
     PULSE_TIMER->SR &= ~(TIM_SR_UIF|TIM_SR_CC1IF);
     PULSE_TIMER->CNT = 0;
 
-    NVIC_SetPriority(PULSE_TIMER_IRQn, 0);
+    HAL_NVIC_SetPriority(PULSE_TIMER_IRQn, IRQ_PRIO_PULSE, 0);
     NVIC_EnableIRQ(PULSE_TIMER_IRQn);
 
+#if STEP_PULSE_DMA
+    stepperDMAInit();
+#endif
+
+#if EDM_ENABLE && STEP_PERIOD_DMA
+    stepperRampDMAInit();
+#endif
+
+#if STEP_PULSE_OPM
+    stepperOPMInit();
+#endif
+
  // Limit pins init
 
     if (settings->limits.flags.hard_enabled)
-        HAL_NVIC_SetPriority(EXTI15_10_IRQn, 0x02, 0x02);
+        HAL_NVIC_SetPriority(EXTI15_10_IRQn, IRQ_PRIO_INPUT, 0);
+
+    BOOT_MARK("outputs_timers");
 
 #if SDCARD_ENABLE
 
     sdmmc_init();
     sdcard_init();
+#if SDMMC_HIGH_SPEED || SD_BENCH_ENABLE
+    sdmmc_perf_init();
+#endif
+#if SD_CACHE_ENABLE
+    sd_cache_init();
+#endif
+#if SD_STREAM_ENABLE
+    sd_stream_init();
+#endif
+#if POWER_LOSS_ENABLE
+    power_loss_init();
+#endif
+#if JOB_QUEUE_ENABLE
+    job_queue_init();
+#endif
+#if SD_LOG_ENABLE
+    sd_log_init();
+#endif
+    BOOT_MARK("sdcard");
 
 #endif
 
 #if SPIFLASH_ENABLE
     spiflash_init();
+    BOOT_MARK("spiflash");
 #endif
 
 #if LITTLEFS_ENABLE
-    fs_littlefs_mount("/littlefs", stm32_littlefs_hal());
+#if BOOT_DEFER_INIT
+    protocol_enqueue_foreground_task(littlefs_mount, NULL);
+#else
+    littlefs_mount(NULL);
+#endif
+#endif
+
+#if MACRO_CACHE_ENABLE
+    macro_cache_init();
+#endif
+
+#if UPLOAD_ENABLE
+    upload_init();
+#endif
+
+#if FW_UPDATE_ENABLE
+    fw_update_init();
 #endif
 
 #if SPINDLE_ENCODER_ENABLE
@@ -2423,6 +4064,7 @@ static bool driver_setup (settings_t *settings)
     RPM_COUNTER->ARR = 65535;
     RPM_COUNTER->DIER = TIM_DIER_CC1IE;
 
+    HAL_NVIC_SetPriority(RPM_COUNTER_IRQn, IRQ_PRIO_INPUT, 0); // same preemption priority as the index interrupt, see encoder_seq
     HAL_NVIC_EnableIRQ(RPM_COUNTER_IRQn);
 
     GPIO_Init.Mode = GPIO_MODE_AF_PP;
@@ -2432,21 +4074,67 @@ static bool driver_setup (settings_t *settings)
     GPIO_Init.Alternate = GPIO_AF2_TIM3;
     HAL_GPIO_Init(SPINDLE_PULSE_PORT, &GPIO_Init);
 
-#endif // SPINDLE_ENCODER_ENABLE
+#endif // SPINDLE_ENCODER_ENABLE
+
+    IOInitDone = settings->version.id == 23;
+
+    hal.settings_changed(settings, (settings_changed_flags_t){0});
+    BOOT_MARK("settings");
+
+#if ETHERNET_ENABLE
+    enet_start();
+#endif
+
+#if TCP_STREAM_ENABLE
+    tcp_stream_init();
+#endif
+
+#if UDP_TELEMETRY_ENABLE
+    udp_telemetry_init();
+#endif
+
+#if WS_TELEMETRY_ENABLE
+    ws_telemetry_init();
+#endif
+
+#if HTTP_UPLOAD_ENABLE
+    http_upload_init();
+#endif
+
+#if PTP_ENABLE
+    ptp_init();
+#endif
+
+#if MQTT_METRICS_ENABLE
+    mqtt_metrics_init();
+#endif
 
-    IOInitDone = settings->version.id == 23;
+#if MDNS_SERVICES_ENABLE
+    mdns_services_init();
+#endif
 
-    hal.settings_changed(settings, (settings_changed_flags_t){0});
+#if ETH_STATS_ENABLE
+    eth_stats_init();
+#endif
 
-#if ETHERNET_ENABLE
-    enet_start();
+#if W5X00_SPI_BURST
+    w5x00_spi_init();
 #endif
 
+    BOOT_MARK("network");
+
 #if SDCARD_ENABLE && defined(SD_DETECT_PIN)
-    if(!DIGITAL_IN(SD_DETECT_PORT, SD_DETECT_PIN))
-        sdcard_detect(true);
+    if(!DIGITAL_IN(SD_DETECT_PORT, SD_DETECT_PIN)) {
+#if BOOT_DEFER_INIT
+        protocol_enqueue_foreground_task(sdcard_mount, NULL);
+#else
+        sdcard_mount(NULL);
+#endif
+    }
 #endif
 
+    BOOT_MARK("driver_setup");
+
     return IOInitDone;
 }
 
@@ -2484,7 +4172,8 @@ static bool set_rtc_time (struct tm *time)
     return hal.driver_cap.rtc_set;
 }
 
-static bool get_rtc_time (struct tm *time)
+// Also returns the sub-second part (in SynchPrediv + 1 steps) and hal.get_micros() read right after the time.
+static bool read_rtc_time (struct tm *time, uint32_t *us, uint32_t *t_us)
 {
     bool ok = false;
 
@@ -2493,23 +4182,85 @@ static bool get_rtc_time (struct tm *time)
         RTC_TimeTypeDef sTime = {0};
         RTC_DateTypeDef sDate = {0};
 
-        if((ok = HAL_RTC_GetTime(&hrtc, &sTime, RTC_FORMAT_BIN) == HAL_OK &&
-                  HAL_RTC_GetDate(&hrtc, &sDate, RTC_FORMAT_BIN) == HAL_OK)) {
+        if((ok = HAL_RTC_GetTime(&hrtc, &sTime, RTC_FORMAT_BIN) == HAL_OK)) {
 
-            time->tm_hour = sTime.Hours;
-            time->tm_min = sTime.Minutes;
-            time->tm_sec = sTime.Seconds;
-            time->tm_mon = sDate.Month - 1;
-            time->tm_mday = sDate.Date;
-            time->tm_year = sDate.Year + 100;
+            *t_us = hal.get_micros();
+
+            if((ok = HAL_RTC_GetDate(&hrtc, &sDate, RTC_FORMAT_BIN) == HAL_OK)) {
+                time->tm_hour = sTime.Hours;
+                time->tm_min = sTime.Minutes;
+                time->tm_sec = sTime.Seconds;
+                time->tm_mon = sDate.Month - 1;
+                time->tm_mday = sDate.Date;
+                time->tm_year = sDate.Year + 100;
+                *us = (sTime.SecondFraction - sTime.SubSeconds) * 1000000UL / (sTime.SecondFraction + 1);
+            }
         }
     }
 
     return ok;
 }
 
+static bool get_rtc_time (struct tm *time)
+{
+    uint32_t us, t_us;
+
+    return read_rtc_time(time, &us, &t_us);
+}
+
+#endif
+
+bool rtc_stamp_get (rtc_stamp_t *stamp)
+{
+#if PTP_ENABLE
+    if(ptp_stamp_get(stamp))
+        return true;
+#endif
+
+#if RTC_ENABLE
+    struct tm time;
+
+    if(read_rtc_time(&time, &stamp->us, &stamp->t_us)) {
+        time.tm_isdst = 0;
+        stamp->epoch = (uint32_t)mktime(&time);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+int rtc_stamp_print (char *buf, size_t size)
+{
+#if PTP_ENABLE
+    rtc_stamp_t stamp;
+
+    if(ptp_stamp_get(&stamp)) {
+        struct tm utc;
+        time_t epoch = (time_t)stamp.epoch;
+
+        gmtime_r(&epoch, &utc);
+
+        return snprintf(buf, size, ",rtc=%04d-%02d-%02dT%02d:%02d:%02d.%06lu,rtc_us=%lu,rtc_src=ptp", utc.tm_year + 1900, utc.tm_mon + 1,
+                         utc.tm_mday, utc.tm_hour, utc.tm_min, utc.tm_sec, stamp.us, stamp.t_us);
+    }
+#endif
+
+#if RTC_ENABLE
+    struct tm time;
+    uint32_t us, t_us;
+
+    if(read_rtc_time(&time, &us, &t_us))
+        return snprintf(buf, size, ",rtc=%04d-%02d-%02dT%02d:%02d:%02d.%06lu,rtc_us=%lu", time.tm_year + 1900, time.tm_mon + 1,
+                         time.tm_mday, time.tm_hour, time.tm_min, time.tm_sec, us, t_us);
 #endif
 
+    if(size)
+        *buf = '\0';
+
+    return 0;
+}
+
 #if USB_SERIAL_CDC
 
 static status_code_t enter_dfu (sys_state_t state, char *args)
@@ -2555,7 +4306,7 @@ uint32_t get_free_mem (void)
     extern uint32_t _Min_Stack_Size; /* Symbol defined in the linker script */
     const uint32_t stack_limit = (uint32_t)&_estack - (uint32_t)&_Min_Stack_Size;
 
-    return stack_limit - (uint32_t)&_end - mallinfo().uordblks;
+    return stack_limit - (uint32_t)&_end - mallinfo().uordblks + mem_pool_get_free();
 }
 
 // Initialize HAL pointers, setup serial comms and enable EEPROM
@@ -2563,6 +4314,10 @@ uint32_t get_free_mem (void)
 
 bool driver_init (void)
 {
+    BOOT_MARK("grbl_enter");
+
+    crc32_init();
+
     __HAL_RCC_GPIOA_CLK_ENABLE();
     __HAL_RCC_GPIOB_CLK_ENABLE();
     __HAL_RCC_GPIOC_CLK_ENABLE();
@@ -2693,10 +4448,14 @@ bool driver_init (void)
 
 #if USB_SERIAL_CDC
     stream_connect(usbInit());
+#if USB_BULK_ENABLE
+    usb_bulk_init();
+#endif
 #else
     if(!stream_connect_instance(SERIAL_STREAM, BAUD_RATE))
         while(true); // Cannot boot if no communication channel is available!
 #endif
+    BOOT_MARK("streams");
 
 /*
 #if EEPROM_ENABLE
@@ -2707,7 +4466,16 @@ bool driver_init (void)
     hal.nvs.memcpy_to_flash = memcpy_to_flash;
 #else
 */
+#if FLASH_JOURNAL
+    hal.nvs.type = NVS_Flash;
+    hal.nvs.memcpy_from_flash = memcpy_from_flash;
+    hal.nvs.memcpy_to_flash = memcpy_to_flash;
+    flash_journal_init();
+#elif EEPROM_ASYNC_ENABLE
+    eeprom_async_init();
+#else
     hal.nvs.type = NVS_None;
+#endif
 //#endif
 
 // driver capabilities
@@ -2750,7 +4518,7 @@ bool driver_init (void)
             input->cap.pull_mode = PullMode_UpDown;
             if((input->cap.irq_mode = ((DRIVER_IRQMASK|aux_irq) & input->bit) ? IRQ_Mode_None : IRQ_Mode_Edges) != IRQ_Mode_None) {
                 aux_irq |= input->bit;
-                pin_irq[__builtin_ffs(input->bit) - 1] = input;
+                pin_irq[input->pin].input = input;
             }
             input->cap.debounce = !!input->cap.irq_mode;
 #if AUX_CONTROLS_ENABLED
@@ -2770,11 +4538,11 @@ bool driver_init (void)
             if(limit_inputs.pins.inputs == NULL)
                 limit_inputs.pins.inputs = input;
             if(LIMIT_MASK & input->bit)
-                pin_irq[__builtin_ffs(input->bit) - 1] = input;
+                pin_irq[input->pin].input = input;
             limit_inputs.n_pins++;
         } else if(input->group & PinGroup_SdCard) {
             if(input->bit & DEVICES_IRQ_MASK)
-                pin_irq[__builtin_ffs(input->bit) - 1] = input;
+                pin_irq[input->pin].input = input;
         }
     }
 
@@ -2822,6 +4590,15 @@ bool driver_init (void)
     if((step_pulse.inject.timer = hal.timer.claim((timer_cap_t){ .periodic = Off }, 100))) {
         hal.stepper.output_step = stepperOutputStep;
         hal.stepper.claim_motor = stepperClaimMotor;
+#if STEP_INJECT_BURST
+        if((step_burst.timer = hal.timer.claim((timer_cap_t){ .periodic = On }, STEP_BURST_TIMEBASE))) {
+            timer_cfg_t step_burst_cfg = {
+                .single_shot = Off,
+                .timeout_callback = step_burst_tick
+            };
+            hal.timer.configure(step_burst.timer, &step_burst_cfg);
+        }
+#endif
     }
 #endif
 
@@ -2848,6 +4625,7 @@ bool driver_init (void)
 #ifdef HAS_BOARD_INIT
     board_init();
 #endif
+    BOOT_MARK("ioports");
 
 #if TRINAMIC_SPI_ENABLE
   extern void if_init (uint8_t motors, axes_signals_t enabled);
@@ -2857,6 +4635,7 @@ bool driver_init (void)
     extern void tmc_uart_init (void);
     tmc_uart_init();
 #endif
+    BOOT_MARK("trinamic");
 
 #ifdef NEOPIXEL_SPI
     extern void neopixel_init (void);
@@ -2874,7 +4653,7 @@ bool driver_init (void)
 
         // Reduce USB IRQ priority to lower than the UART port!
         HAL_NVIC_DisableIRQ(OTG_HS_IRQn);
-        HAL_NVIC_SetPriority(OTG_HS_IRQn, 1, 0);
+        HAL_NVIC_SetPriority(OTG_HS_IRQn, IRQ_PRIO_USB, 0);
         HAL_NVIC_EnableIRQ(OTG_HS_IRQn);
     }
 
@@ -2882,11 +4661,108 @@ bool driver_init (void)
 
 #endif
 
+#if RT_SCHED_ENABLE
+    rt_sched_init();
+#endif
+
 #include "grbl/plugins_init.h"
+    BOOT_MARK("plugins");
 
 #if EDM_ENABLE
     extern void edm_init (void);
     edm_init();
+    BOOT_MARK("edm");
+#endif
+
+#if STREAM_BENCH_ENABLE
+    extern void stream_bench_init (void);
+    stream_bench_init();
+#endif
+
+#if STEP_BENCH_ENABLE
+    extern void step_bench_init (void);
+    step_bench_init();
+#endif
+
+#if ISR_PROFILE_ENABLE
+    isr_profile_init();
+#endif
+
+#if BOOT_PROFILE_ENABLE
+    boot_profile_init();
+#endif
+
+#if TRACE_ENABLE
+    trace_init();
+#endif
+
+    clocks_init();
+
+#if IDLE_SLEEP_ENABLE
+    idle_sleep_init();
+#endif
+
+#if MEMMAP_ENABLE
+    extern void memmap_init (void);
+    memmap_init();
+#endif
+
+#if PIN_EVENT_QUEUE
+    pin_events_init();
+#endif
+
+#if PIN_FILTER_ENABLE
+    pin_filter_init();
+#endif
+
+#if QUADRATURE_ENABLE
+    quadrature_init();
+#endif
+
+#if TMC_TELEMETRY_ENABLE
+    extern void tmc_telemetry_init (void);
+    tmc_telemetry_init();
+#endif
+
+#if TMC_MRES_SWITCH_ENABLE
+    tmc_mres_init();
+#endif
+
+#if STATUS_BINARY_ENABLE
+    status_bin_init();
+#endif
+
+#if MODBUS_DMA_ENABLE
+    modbus_dma_init();
+#endif
+
+#if FLUSH_CTRL_ENABLE
+    flush_ctrl_init();
+#endif
+
+#if PENDANT_ENABLE
+    pendant_init();
+#endif
+
+#if WATCHDOG_ENABLE
+    watchdog_init();
+    wdt_stepper = watchdog_register("STEP", WATCHDOG_STEP_DEADLINE_MS, false);
+#endif
+
+#if CRASH_DUMP_ENABLE
+    crash_dump_init();
+#endif
+
+#if PERF_DASH_ENABLE
+    perf_dash_init();
+#endif
+
+#if CPU_LOAD_ENABLE
+    cpu_load_init();
+#endif
+
+#if GCODE_PRESCAN_ENABLE
+    gcode_prescan_init();
 #endif
 
 #if MPG_ENABLE == 1
@@ -2899,6 +4775,8 @@ bool driver_init (void)
         hal.driver_cap.mpg_mode = stream_mpg_register(stream_open_instance(MPG_STREAM, 115200, NULL, NULL), false, stream_mpg_check_enable);
 #endif
 
+    BOOT_MARK("driver_init");
+
     // No need to move version check before init.
     // Compiler will fail any signature mismatch for existing entries.
     return hal.version == 10;
@@ -2907,12 +4785,20 @@ bool driver_init (void)
 /* interrupt handlers */
 
 // Main stepper driver
-void STEPPER_TIMER_IRQHandler (void)
+ITCM_CODE void STEPPER_TIMER_IRQHandler (void)
 {
+    ISR_PROFILE_ENTER();
+    ISR_LATENCY_STEPPER(STEPPER_TIMER);
+
     if((STEPPER_TIMER->SR & TIM_SR_UIF)) {  // check interrupt source
         STEPPER_TIMER->SR = ~TIM_SR_UIF;    // clear UIF flag
+#if WATCHDOG_ENABLE
+        watchdog_alive(wdt_stepper);
+#endif
         hal.stepper.interrupt_callback();
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_Stepper);
 }
 
 /* The Stepper Port Reset Interrupt: This interrupt handles the falling edge of the step
@@ -2933,8 +4819,10 @@ void STEPPER_TIMER_IRQHandler (void)
 // This interrupt is enabled when Grbl sets the motor port bits to execute
 // a step. This ISR resets the motor port after a short period (settings.pulse_microseconds)
 // completing one step cycle.
-void PULSE_TIMER_IRQHandler (void)
+ITCM_CODE void PULSE_TIMER_IRQHandler (void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t irq = PULSE_TIMER->SR & PULSE_TIMER->DIER;
 
     PULSE_TIMER->SR &= ~(TIM_SR_UIF|TIM_SR_CC1IF);  // Clear IRQ flags
@@ -2946,14 +4834,14 @@ void PULSE_TIMER_IRQHandler (void)
         PULSE_TIMER->CR1 |= TIM_CR1_CEN;
     } else
         stepperSetStepOutputs((axes_signals_t){0}); // else end step pulse
+
+    ISR_PROFILE_EXIT(IsrProfile_Pulse);
 }
 
 #if SPINDLE_ENCODER_ENABLE
 
 void RPM_COUNTER_IRQHandler (void)
 {
-    spindle_encoder.spin_lock = true;
-
     __disable_irq();
     uint32_t tval = RPM_TIMER->CNT;
     uint16_t cval = RPM_COUNTER->CNT;
@@ -2962,16 +4850,121 @@ void RPM_COUNTER_IRQHandler (void)
     RPM_COUNTER->SR = ~TIM_SR_CC1IF;
     RPM_COUNTER->CCR1 = (uint16_t)(RPM_COUNTER->CCR1 + spindle_encoder.tics_per_irq);
 
+    encoder_write_begin();
+
     spindle_encoder.counter.pulse_count += (uint16_t)(cval - (uint16_t)spindle_encoder.counter.last_count);
     spindle_encoder.counter.last_count = cval;
     spindle_encoder.timer.pulse_length = tval - spindle_encoder.timer.last_pulse;
     spindle_encoder.timer.last_pulse = tval;
 
-    spindle_encoder.spin_lock = false;
+    encoder_write_end();
 }
 
 #endif // SPINDLE_ENCODER_ENABLE
 
+void core_pin_debounce (void *pin);
+void aux_pin_debounce (void *pin);
+
+#define PIN_DEBOUNCE_MS 40
+
+#if PIN_EVENT_QUEUE
+
+#if PIN_EVENT_QUEUE_SIZE & (PIN_EVENT_QUEUE_SIZE - 1)
+#error "PIN_EVENT_QUEUE_SIZE must be a power of 2!"
+#endif
+
+// Debounced pin events are queued from the EXTI handlers and processed in batches from the
+// foreground once the debounce time has elapsed, replacing one delayed task per edge.
+// Lock-free: the EXTI handlers may preempt each other, so a producer claims a slot with a
+// compare-and-swap of head and publishes it by writing the slot sequence number. The
+// foreground is the only consumer and the only writer of tail.
+
+typedef struct {
+    volatile uint32_t seq;
+    input_signal_t *input;
+    uint32_t t_ms;
+} pin_event_t;
+
+static struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    volatile uint32_t dropped;
+    pin_event_t event[PIN_EVENT_QUEUE_SIZE];
+} pin_events = {0};
+
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+
+static bool pin_event_add (input_signal_t *input)
+{
+    uint32_t head;
+    pin_event_t *event;
+
+    do {
+        head = pin_events.head;
+        if(head - pin_events.tail >= PIN_EVENT_QUEUE_SIZE) {
+            pin_events.dropped++;
+            return false;
+        }
+    } while(!__atomic_compare_exchange_n(&pin_events.head, &head, head + 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    event = &pin_events.event[head & (PIN_EVENT_QUEUE_SIZE - 1)];
+    event->input = input;
+    event->t_ms = hal.get_elapsed_ticks();
+    __DMB();
+    event->seq = head + 1;
+
+    return true;
+}
+
+static void pin_events_process (void)
+{
+    uint32_t tail = pin_events.tail, now = hal.get_elapsed_ticks();
+    pin_event_t *event;
+    input_signal_t *input;
+
+    while((event = &pin_events.event[tail & (PIN_EVENT_QUEUE_SIZE - 1)])->seq == tail + 1 && now - event->t_ms >= PIN_DEBOUNCE_MS) {
+        input = event->input;
+        __DMB();
+        pin_events.tail = ++tail; // release the slot before handling the event
+
+        if(input->group == PinGroup_AuxInput)
+            aux_pin_debounce(input);
+        else
+            core_pin_debounce(input);
+    }
+}
+
+static void pin_events_execute_realtime (uint_fast16_t state)
+{
+    pin_events_process();
+
+    on_execute_realtime(state);
+}
+
+static void pin_events_execute_delay (uint_fast16_t state)
+{
+    pin_events_process();
+
+    on_execute_delay(state);
+}
+
+static void pin_events_init (void)
+{
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = pin_events_execute_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = pin_events_execute_delay;
+}
+
+#define pin_debounce_add(fn, input) pin_event_add(input)
+
+#else
+
+#define pin_debounce_add(fn, input) task_add_delayed(fn, input, PIN_DEBOUNCE_MS)
+
+#endif // PIN_EVENT_QUEUE
+
 void core_pin_debounce (void *pin)
 {
     input_signal_t *input = (input_signal_t *)pin;
@@ -2996,18 +4989,36 @@ void core_pin_debounce (void *pin)
     EXTI->IMR1 |= input->bit; // Reenable pin interrupt
 }
 
-static inline void core_pin_irq (uint32_t bit)
+static void core_pin_irq_debounced (input_signal_t *input)
 {
-    input_signal_t *input;
+    if(pin_debounce_add(core_pin_debounce, input))
+        EXTI->IMR1 &= ~input->bit; // Disable pin interrupt
+    else
+        core_pin_debounce(input);
+}
 
-    if((input = pin_irq[__builtin_ffs(bit) - 1])) {
-        if(input->mode.debounce && task_add_delayed(core_pin_debounce, input, 40)) {
-            EXTI->IMR1 &= ~input->bit; // Disable pin interrupt
-        } else
-            core_pin_debounce(input);
-    }
+static void core_pin_irq (input_signal_t *input)
+{
+    core_pin_debounce(input);
 }
 
+#if TMC_DIAG_HOMING
+
+// Limit input handler, latches stalls of the axes being homed.
+static void diag_pin_irq (input_signal_t *input)
+{
+    uint8_t axis = xbar_fn_to_axismask(input->id).mask;
+
+    if(input->group == PinGroup_Limit && (axis & diag_armed))
+        diag_latch |= axis;
+    else if(input->mode.debounce)
+        core_pin_irq_debounced(input);
+    else
+        core_pin_irq(input);
+}
+
+#endif
+
 void aux_pin_debounce (void *pin)
 {
     input_signal_t *input = (input_signal_t *)pin;
@@ -3024,19 +5035,203 @@ void aux_pin_debounce (void *pin)
     EXTI->IMR1 |= input->bit; // Reenable pin interrupt
 }
 
-static inline void aux_pin_irq (uint32_t bit)
+static void aux_pin_irq_debounced (input_signal_t *input)
+{
+    if(pin_debounce_add(aux_pin_debounce, input)) {
+        EXTI->IMR1 &= ~input->bit; // Disable pin interrupt
+#if SAFETY_DOOR_ENABLE
+        if(input->id == Input_SafetyDoor)
+            debounce.safety_door = On;
+#endif
+    } else
+        ioports_event(input);
+}
+
+#if PIN_FILTER_ENABLE
+
+// Debounced aux inputs are filtered by sampling instead of by a delayed level check. An edge
+// masks the EXTI line and starts a periodic PIN_FILTER_PERIOD_US timer that samples all lines
+// being filtered. Each GPIO port is read once per sample, and the EXTI line number equals the
+// pin number, so the reads are merged into one word with a bit per line. A per-line integrator
+// counts up while the pin reads high and down while it reads low. The filtered level changes
+// when the integrator reaches PIN_FILTER_SAMPLES or 0, which from a stable state takes
+// PIN_FILTER_SAMPLES consecutive samples at the new level. The event is raised from the timer
+// interrupt, like those of aux inputs without debounce. The line is unmasked once its integrator
+// rests at the filtered level, and the timer stops when no line is left. The timer and EXTI
+// interrupts have the same preemption priority and do not interrupt each other.
+
+static struct {
+    hal_timer_t timer;
+    volatile uint32_t active;       // lines being sampled
+    uint32_t level;                 // filtered levels
+    uint_fast8_t n_banks;
+    struct {
+        GPIO_TypeDef *port;
+        uint32_t lines;
+    } bank[11];                     // GPIOA..GPIOK
+    uint8_t count[16];
+} pin_filter = {0};
+
+static void pin_filter_event (input_signal_t *input, bool level)
+{
+#if SAFETY_DOOR_ENABLE
+    if(input->id == Input_SafetyDoor)
+        debounce.safety_door = Off;
+#endif
+
+    if(input->mode.irq_mode == IRQ_Mode_Change || level == (input->mode.irq_mode != IRQ_Mode_Falling))
+        ioports_event(input);
+}
+
+static void pin_filter_sample (void *context)
 {
+    uint_fast8_t i, line;
+    uint32_t bit, raw = 0, lines = pin_filter.active;
     input_signal_t *input;
 
-    if((input = pin_irq[__builtin_ffs(bit) - 1]) && input->group == PinGroup_AuxInput) {
-        if(input->mode.debounce && task_add_delayed(aux_pin_debounce, input, 40)) {
-            EXTI->IMR1 &= ~input->bit; // Disable pin interrupt
+    for(i = 0; i < pin_filter.n_banks; i++) {
+        if(lines & pin_filter.bank[i].lines)
+            raw |= pin_filter.bank[i].port->IDR & pin_filter.bank[i].lines;
+    }
+
+    while(lines) {
+        line = __builtin_ctz(lines);
+        bit = 1 << line;
+        lines &= lines - 1;
+        input = pin_irq[line].input;
+
+        if(raw & bit) {
+            if(pin_filter.count[line] < PIN_FILTER_SAMPLES && ++pin_filter.count[line] == PIN_FILTER_SAMPLES && !(pin_filter.level & bit)) {
+                pin_filter.level |= bit;
+                pin_filter_event(input, true);
+            }
+        } else if(pin_filter.count[line] && --pin_filter.count[line] == 0 && (pin_filter.level & bit)) {
+            pin_filter.level &= ~bit;
+            pin_filter_event(input, false);
+        }
+
+        if(pin_filter.count[line] == (pin_filter.level & bit ? PIN_FILTER_SAMPLES : 0)) {
+            // Settled, edges latched while masked are stale. Unmask unless the pin has moved since.
+            EXTI->PR1 = bit;
+            EXTI->IMR1 |= bit;
+            if(!(input->port->IDR & bit) == !(pin_filter.level & bit)) {
+                pin_filter.active &= ~bit;
+#if SAFETY_DOOR_ENABLE
+                if(input->id == Input_SafetyDoor)
+                    debounce.safety_door = Off;
+#endif
+            } else
+                EXTI->IMR1 &= ~bit;
+        }
+    }
+
+    if(pin_filter.active == 0)
+        hal.timer.stop(pin_filter.timer);
+}
+
+static void aux_pin_irq_filtered (input_signal_t *input)
+{
+    EXTI->IMR1 &= ~input->bit; // Disable pin interrupt, sampled until settled
+
+    if(!(pin_filter.active & input->bit)) {
+        pin_filter.count[input->pin] = pin_filter.level & input->bit ? PIN_FILTER_SAMPLES : 0;
 #if SAFETY_DOOR_ENABLE
-            if(input->id == Input_SafetyDoor)
-                debounce.safety_door = input->mode.debounce;
+        if(input->id == Input_SafetyDoor)
+            debounce.safety_door = On;
 #endif
+        if(pin_filter.active == 0) {
+            pin_filter.active = input->bit;
+            hal.timer.start(pin_filter.timer, PIN_FILTER_PERIOD_US - 2);
         } else
-            ioports_event(input);
+            pin_filter.active |= input->bit;
+    }
+}
+
+// Groups the filtered lines by port and takes their current levels as the filtered levels.
+static void pin_filter_map (void)
+{
+    uint_fast8_t line, i;
+    input_signal_t *input;
+
+    __disable_irq();
+
+    pin_filter.n_banks = 0;
+    pin_filter.level = 0;
+
+    for(line = 0; line < 16; line++) {
+        if(pin_irq[line].handler == aux_pin_irq_filtered) {
+            input = pin_irq[line].input;
+            for(i = 0; i < pin_filter.n_banks && pin_filter.bank[i].port != input->port; i++);
+            if(i == pin_filter.n_banks) {
+                pin_filter.bank[i].port = input->port;
+                pin_filter.bank[i].lines = 0;
+                pin_filter.n_banks++;
+            }
+            pin_filter.bank[i].lines |= input->bit;
+            pin_filter.level |= input->port->IDR & input->bit;
+        } else if(pin_filter.active & (1 << line)) {
+            pin_filter.active &= ~(1 << line);
+            EXTI->IMR1 |= 1 << line;
+        }
+    }
+
+    __enable_irq();
+}
+
+static void pin_filter_init (void)
+{
+    timer_cfg_t cfg = {
+        .single_shot = Off,
+        .timeout_callback = pin_filter_sample
+    };
+
+    if((pin_filter.timer = hal.timer.claim((timer_cap_t){ .periodic = On }, 1000)) && !hal.timer.configure(pin_filter.timer, &cfg))
+        pin_filter.timer = NULL; // debounced by delayed level check as before
+}
+
+#endif // PIN_FILTER_ENABLE
+
+// Selects the handler of each EXTI line with a limit, SD card detect or aux input, called when
+// the inputs are (re)configured so that the handlers do not have to look up group and mode.
+void gpio_irq_map (void)
+{
+    uint_fast8_t line;
+    input_signal_t *input;
+
+    for(line = 0; line < 16; line++) {
+        if((input = pin_irq[line].input) == NULL)
+            pin_irq[line].handler = NULL;
+        else if(input->group == PinGroup_AuxInput)
+#if PIN_FILTER_ENABLE
+            pin_irq[line].handler = input->mode.debounce ? (pin_filter.timer ? aux_pin_irq_filtered : aux_pin_irq_debounced) : ioports_event;
+#else
+            pin_irq[line].handler = input->mode.debounce ? aux_pin_irq_debounced : ioports_event;
+#endif
+#if TMC_DIAG_HOMING
+        else if(input->group == PinGroup_Limit)
+            pin_irq[line].handler = diag_pin_irq;
+#endif
+        else
+            pin_irq[line].handler = input->mode.debounce ? core_pin_irq_debounced : core_pin_irq;
+    }
+
+#if PIN_FILTER_ENABLE
+    pin_filter_map();
+#endif
+}
+
+static inline void pin_irq_line (uint_fast8_t line)
+{
+    if(pin_irq[line].handler)
+        pin_irq[line].handler(pin_irq[line].input);
+}
+
+// Handles all pins flagged in bits, more than one may be pending in the shared EXTI handlers.
+static inline void pin_irq_lines (uint32_t bits)
+{
+    while(bits) {
+        pin_irq_line(__builtin_ctz(bits));
+        bits &= bits - 1;
     }
 }
 
@@ -3044,6 +5239,8 @@ static inline void aux_pin_irq (uint32_t bit)
 
 void EXTI0_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(1<<0);
 
     if(ifg) {
@@ -3051,14 +5248,15 @@ void EXTI0_IRQHandler(void)
 #if CONTROL_MASK & (1<<0)
         hal.control.interrupt_callback(systemGetState());
 #elif (LIMIT_MASK|SD_DETECT_BIT) & (1<<0)
-        core_pin_irq(ifg);
+        pin_irq_line(0);
 #elif SPI_IRQ_BIT & (1<<0)
         if(spi_irq.callback)
             spi_irq.callback(0, DIGITAL_IN(SPI_IRQ_PORT, SPI_IRQ_BIT) == 0);
 #elif AUXINPUT_MASK & (1<<0)
-        aux_pin_irq(ifg);
+        pin_irq_line(0);
 #elif SPINDLE_INDEX_BIT & (1<<0)
         uint32_t rpm_count = RPM_COUNTER->CNT;
+        encoder_write_begin();
         spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
         if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3066,8 +5264,11 @@ void EXTI0_IRQHandler(void)
 
         spindle_encoder.counter.last_index = rpm_count;
         spindle_encoder.counter.index_count++;
+        encoder_write_end();
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI0);
 }
 
 #endif
@@ -3076,6 +5277,8 @@ void EXTI0_IRQHandler(void)
 
 void EXTI1_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(1<<1);
 
     if(ifg) {
@@ -3083,14 +5286,15 @@ void EXTI1_IRQHandler(void)
 #if CONTROL_MASK & (1<<1)
         hal.control.interrupt_callback(systemGetState());
 #elif (LIMIT_MASK|SD_DETECT_BIT) & (1<<1)
-        core_pin_irq(ifg);
+        pin_irq_line(1);
 #elif SPI_IRQ_BIT & (1<<1)
         if(spi_irq.callback)
             spi_irq.callback(0, DIGITAL_IN(SPI_IRQ_PORT, SPI_IRQ_BIT) == 0);
 #elif AUXINPUT_MASK & (1<<1)
-        aux_pin_irq(ifg);
+        pin_irq_line(1);
 #elif SPINDLE_INDEX_BIT & (1<<1)
         uint32_t rpm_count = RPM_COUNTER->CNT;
+        encoder_write_begin();
         spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
         if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3098,8 +5302,11 @@ void EXTI1_IRQHandler(void)
 
         spindle_encoder.counter.last_index = rpm_count;
         spindle_encoder.counter.index_count++;
+        encoder_write_end();
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI1);
 }
 
 #endif
@@ -3108,6 +5315,8 @@ void EXTI1_IRQHandler(void)
 
 void EXTI2_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(1<<2);
 
     if(ifg) {
@@ -3115,14 +5324,15 @@ void EXTI2_IRQHandler(void)
 #if CONTROL_MASK & (1<<2)
         hal.control.interrupt_callback(systemGetState());
 #elif (LIMIT_MASK|SD_DETECT_BIT) & (1<<2)
-        core_pin_irq(ifg);
+        pin_irq_line(2);
 #elif SPI_IRQ_BIT & (1<<2)
         if(spi_irq.callback)
             spi_irq.callback(0, DIGITAL_IN(SPI_IRQ_PORT, SPI_IRQ_BIT) == 0);
 #elif AUXINPUT_MASK & (1<<2)
-        aux_pin_irq(ifg);
+        pin_irq_line(2);
 #elif SPINDLE_INDEX_BIT & (1<<2)
         uint32_t rpm_count = RPM_COUNTER->CNT;
+        encoder_write_begin();
         spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
         if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3130,8 +5340,11 @@ void EXTI2_IRQHandler(void)
 
         spindle_encoder.counter.last_index = rpm_count;
         spindle_encoder.counter.index_count++;
+        encoder_write_end();
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI2);
 }
 
 #endif
@@ -3140,6 +5353,8 @@ void EXTI2_IRQHandler(void)
 
 void EXTI3_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(1<<3);
 
     if(ifg) {
@@ -3147,14 +5362,15 @@ void EXTI3_IRQHandler(void)
 #if CONTROL_MASK & (1<<3)
         hal.control.interrupt_callback(systemGetState());
 #elif (LIMIT_MASK|SD_DETECT_BIT) & (1<<3)
-        core_pin_irq(ifg);
+        pin_irq_line(3);
 #elif SPI_IRQ_BIT & (1<<3)
         if(spi_irq.callback)
             spi_irq.callback(0, DIGITAL_IN(SPI_IRQ_PORT, SPI_IRQ_BIT) == 0);
 #elif AUXINPUT_MASK & (1<<3)
-        aux_pin_irq(ifg);
+        pin_irq_line(3);
 #elif SPINDLE_INDEX_BIT & (1<<3)
         uint32_t rpm_count = RPM_COUNTER->CNT;
+        encoder_write_begin();
         spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
         if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3162,8 +5378,11 @@ void EXTI3_IRQHandler(void)
 
         spindle_encoder.counter.last_index = rpm_count;
         spindle_encoder.counter.index_count++;
+        encoder_write_end();
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI3);
 }
 
 #endif
@@ -3172,6 +5391,8 @@ void EXTI3_IRQHandler(void)
 
 void EXTI4_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(1<<4);
 
     if(ifg) {
@@ -3179,14 +5400,15 @@ void EXTI4_IRQHandler(void)
 #if CONTROL_MASK & (1<<4)
         hal.control.interrupt_callback(systemGetState());
 #elif (LIMIT_MASK|SD_DETECT_BIT) & (1<<4)
-        core_pin_irq(ifg);
+        pin_irq_line(4);
 #elif SPI_IRQ_BIT & (1<<4)
         if(spi_irq.callback)
             spi_irq.callback(0, DIGITAL_IN(SPI_IRQ_PORT, SPI_IRQ_BIT) == 0);
 #elif AUXINPUT_MASK & (1<<4)
-        aux_pin_irq(ifg);
+        pin_irq_line(4);
 #elif SPINDLE_INDEX_BIT & (1<<4)
         uint32_t rpm_count = RPM_COUNTER->CNT;
+        encoder_write_begin();
         spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
         if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3194,8 +5416,11 @@ void EXTI4_IRQHandler(void)
 
         spindle_encoder.counter.last_index = rpm_count;
         spindle_encoder.counter.index_count++;
+        encoder_write_end();
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI4);
 }
 
 #endif
@@ -3204,6 +5429,8 @@ void EXTI4_IRQHandler(void)
 
 void EXTI9_5_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(0x03E0);
 
     if(ifg) {
@@ -3216,6 +5443,7 @@ void EXTI9_5_IRQHandler(void)
 #if SPINDLE_INDEX_BIT & 0x03E0
         if(ifg & SPINDLE_INDEX_BIT) {
             uint32_t rpm_count = RPM_COUNTER->CNT;
+            encoder_write_begin();
             spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
             if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3223,21 +5451,20 @@ void EXTI9_5_IRQHandler(void)
 
             spindle_encoder.counter.last_index = rpm_count;
             spindle_encoder.counter.index_count++;
+            encoder_write_end();
         }
 #endif
 #if CONTROL_MASK & 0x03E0
         if(ifg & CONTROL_MASK)
             hal.control.interrupt_callback(systemGetState());
 #endif
-#if (LIMIT_MASK|SD_DETECT_BIT) & 0x03E0
-        if(ifg & (LIMIT_MASK|SD_DETECT_BIT))
-            core_pin_irq(ifg);
-#endif
-#if AUXINPUT_MASK & 0x03E0
-        if(ifg & aux_irq)
-            aux_pin_irq(ifg & aux_irq);
+#if (LIMIT_MASK|SD_DETECT_BIT|AUXINPUT_MASK) & 0x03E0
+        if(ifg & (LIMIT_MASK|SD_DETECT_BIT|aux_irq))
+            pin_irq_lines(ifg & (LIMIT_MASK|SD_DETECT_BIT|aux_irq));
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI9_5);
 }
 
 #endif
@@ -3246,6 +5473,8 @@ void EXTI9_5_IRQHandler(void)
 
 void EXTI15_10_IRQHandler(void)
 {
+    ISR_PROFILE_ENTER();
+
     uint32_t ifg = __HAL_GPIO_EXTI_GET_IT(0xFC00);
 
     if(ifg) {
@@ -3258,6 +5487,7 @@ void EXTI15_10_IRQHandler(void)
 #if SPINDLE_INDEX_BIT & 0xFC00
         if(ifg & SPINDLE_INDEX_BIT) {
             uint32_t rpm_count = RPM_COUNTER->CNT;
+            encoder_write_begin();
             spindle_encoder.timer.last_index = RPM_TIMER_COUNT;
 
             if(spindle_encoder.counter.index_count && (uint16_t)(rpm_count - (uint16_t)spindle_encoder.counter.last_index) != spindle_encoder.ppr)
@@ -3265,6 +5495,7 @@ void EXTI15_10_IRQHandler(void)
 
             spindle_encoder.counter.last_index = rpm_count;
             spindle_encoder.counter.index_count++;
+            encoder_write_end();
         }
 #endif
 #if QEI_ENABLE && ((QEI_A_BIT|QEI_B_BIT) & 0xFC00)
@@ -3275,15 +5506,13 @@ void EXTI15_10_IRQHandler(void)
         if(ifg & CONTROL_MASK)
             hal.control.interrupt_callback(systemGetState());
 #endif
-#if (LIMIT_MASK|SD_DETECT_BIT) & 0xFC00
-        if(ifg & (LIMIT_MASK|SD_DETECT_BIT))
-            core_pin_irq(ifg);
-#endif
-#if AUXINPUT_MASK & 0xFC00
-        if(ifg & aux_irq)
-            aux_pin_irq(ifg & aux_irq);
+#if (LIMIT_MASK|SD_DETECT_BIT|AUXINPUT_MASK) & 0xFC00
+        if(ifg & (LIMIT_MASK|SD_DETECT_BIT|aux_irq))
+            pin_irq_lines(ifg & (LIMIT_MASK|SD_DETECT_BIT|aux_irq));
 #endif
     }
+
+    ISR_PROFILE_EXIT(IsrProfile_EXTI15_10);
 }
 
 #endif
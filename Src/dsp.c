@@ -0,0 +1,140 @@
+/*
+  dsp.c - CMSIS-DSP based filters, statistics and spectra
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Thin layer over the prebuilt CMSIS-DSP library (arm_cortexM7lfdp_math): filter design at init
+  time and block statistics/spectra for the gap ADC channel and the EDM log. The per-sample work
+  is done by the library (SIMD and dual issue on the M7), this file only sets it up.
+
+  The spectrum is computed by a real FFT of up to DSP_FFT_MAX samples with a Hann window,
+  amplitudes are scaled so that a sine of amplitude A shows as A at its frequency bin.
+*/
+
+#include "driver.h"
+
+#if DSP_ENABLE
+
+#include <string.h>
+
+#include "dsp.h"
+
+float dsp_fft_in[DSP_FFT_MAX];
+static float fft_out[DSP_FFT_MAX];
+
+void dsp_stats (const float *x, uint32_t n, dsp_stats_t *stats)
+{
+    uint32_t idx;
+
+    if(n == 0) {
+        memset(stats, 0, sizeof(dsp_stats_t));
+        return;
+    }
+
+    arm_mean_f32((float *)x, n, &stats->mean);
+    arm_rms_f32((float *)x, n, &stats->rms);
+    arm_min_f32((float *)x, n, &stats->min, &idx);
+    arm_max_f32((float *)x, n, &stats->max, &idx);
+    if(n > 1)
+        arm_std_f32((float *)x, n, &stats->std);
+    else
+        stats->std = 0.0f;
+}
+
+void dsp_fir_decimator (float *coeffs, uint16_t taps, uint16_t factor)
+{
+    uint_fast16_t idx;
+    float t, fc = 0.4f / (float)factor, sum = 0.0f;    // cutoff at 80% of the output Nyquist frequency
+
+    for(idx = 0; idx < taps; idx++) {
+        t = (float)idx - (float)(taps - 1) / 2.0f;
+        coeffs[idx] = (t == 0.0f ? 2.0f * fc : arm_sin_f32(2.0f * PI * fc * t) / (PI * t)) *
+                       (0.54f - 0.46f * arm_cos_f32(2.0f * PI * (float)idx / (float)(taps - 1)));
+        sum += coeffs[idx];
+    }
+
+    arm_scale_f32(coeffs, 1.0f / sum, coeffs, taps);
+}
+
+void dsp_biquad_lowpass (float coeffs[5], float fs, float fc)
+{
+    float w0 = 2.0f * PI * fc / fs, cw = arm_cos_f32(w0), alpha = arm_sin_f32(w0) / (2.0f * 0.70710678f),
+          a0 = 1.0f + alpha;
+
+    coeffs[0] = (1.0f - cw) / (2.0f * a0);  // b0
+    coeffs[1] = (1.0f - cw) / a0;           // b1
+    coeffs[2] = coeffs[0];                  // b2
+    coeffs[3] = 2.0f * cw / a0;             // -a1, CMSIS adds the feedback terms
+    coeffs[4] = -(1.0f - alpha) / a0;       // -a2
+}
+
+uint_fast8_t dsp_spectrum (uint32_t n, float fs, dsp_stats_t *stats, dsp_peak_t *peaks, uint_fast8_t max_peaks)
+{
+    static arm_rfft_fast_instance_f32 rfft;
+    static uint32_t rfft_n = 0;
+
+    float mean, *mag = dsp_fft_in, bin_hz = fs / (float)n;
+    uint_fast8_t found = 0, pos;
+    uint32_t idx;
+
+    if(n < 32 || n > DSP_FFT_MAX || (n & (n - 1)))
+        return 0;
+
+    if(rfft_n != n) {
+        if(arm_rfft_fast_init_f32(&rfft, n) != ARM_MATH_SUCCESS)
+            return 0;
+        rfft_n = n;
+    }
+
+    if(stats)
+        dsp_stats(dsp_fft_in, n, stats);
+
+    arm_mean_f32(dsp_fft_in, n, &mean);
+    arm_offset_f32(dsp_fft_in, -mean, dsp_fft_in, n);
+
+    for(idx = 0; idx < n; idx++)
+        dsp_fft_in[idx] *= 0.5f - 0.5f * arm_cos_f32(2.0f * PI * (float)idx / (float)(n - 1));
+
+    arm_rfft_fast_f32(&rfft, dsp_fft_in, fft_out, 0);
+
+    // fft_out[0] and [1] hold the real DC and Nyquist terms, complex bins 1..n/2-1 follow.
+    mag[0] = 0.0f;
+    arm_cmplx_mag_f32(&fft_out[2], &mag[1], n / 2 - 1);
+    // Hann coherent gain is 0.5, single sided: 2 * 2 / n.
+    arm_scale_f32(&mag[1], 4.0f / (float)n, &mag[1], n / 2 - 1);
+    mag[n / 2] = 0.0f;
+
+    for(idx = 1; idx < n / 2; idx++) {
+        if(mag[idx] > mag[idx - 1] && mag[idx] >= mag[idx + 1]) {
+            pos = found < max_peaks ? found++ : max_peaks;
+            while(pos && peaks[pos - 1].amplitude < mag[idx]) {
+                if(pos < max_peaks)
+                    peaks[pos] = peaks[pos - 1];
+                pos--;
+            }
+            if(pos < max_peaks) {
+                peaks[pos].hz = (float)idx * bin_hz;
+                peaks[pos].amplitude = mag[idx];
+            }
+        }
+    }
+
+    return found;
+}
+
+#endif // DSP_ENABLE
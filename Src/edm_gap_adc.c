@@ -0,0 +1,562 @@
+/*
+  edm_gap_adc.c - timer triggered ADC sampling of the EDM gap voltage
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The gap voltage divider output on EDM_GAP_ADC_PORT/PIN is converted at EDM_GAP_ADC_RATE by its
+  ADC, triggered by TIM6 TRGO. Circular DMA keeps the last EDM_GAP_ADC_BUFFER conversions in memory
+  for reporting, the CPU is only involved on gap state changes:
+
+  Analog watchdog 1 watches the channel with a window that depends on the current state, so it
+  interrupts once per transition instead of once per conversion:
+
+    open      - [open - hysteresis, full scale]
+    discharge - [short, open]
+    short     - [0, short + hysteresis]
+
+  A short is confirmed by counting TIM6 updates while the gap stays at short level, so that dips
+  shorter than EDM_GAP_ADC_SHORT_SAMPLES conversions are not reported.
+
+  With DSP_ENABLE the DMA half and full transfer interrupts (IRQ_PRIO_DSP) hand each half of the
+  buffer (EDM_GAP_DSP_BLOCK conversions) to CMSIS-DSP: the block is scaled to volts, its statistics
+  accumulated and it is decimated by EDM_GAP_DSP_DECIMATION with a FIR low-pass. The decimated
+  stream is smoothed by a Butterworth low-pass at EDM_GAP_DSP_LP_HZ, which is then what
+  edm_gap_adc_voltage() returns, and kept in a DSP_FFT_MAX sample history for spectra.
+
+  $GAPDSP - report and restart the statistics, and report the spectrum peaks of the history:
+
+    [GAPDSP|fs=<decimated Hz>,lp=<Hz>,v=<filtered>,mean=,rms=,std=,min=,max=,n=<conversions>,cyc=<last>/<max>,late=<blocks>]
+    [GAPFFT|n=<samples>,res=<Hz per bin>,<Hz>:<V>,...]
+
+  cyc is the CPU time per block in core clock cycles, late counts blocks that were overwritten by
+  the DMA before they were processed.
+*/
+
+#include "driver.h"
+
+#if EDM_GAP_ADC_ENABLE
+
+#include <string.h>
+
+#include "cache.h"
+#include "edm_gap_adc.h"
+
+#if DSP_ENABLE
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "dsp.h"
+#endif
+
+#ifndef EDM_GAP_ADC_RATE
+#define EDM_GAP_ADC_RATE 200000         // Hz
+#endif
+#ifndef EDM_GAP_ADC_SAMPLETIME
+#define EDM_GAP_ADC_SAMPLETIME ADC_SAMPLETIME_8CYCLES_5
+#endif
+#ifndef EDM_GAP_ADC_VREF
+#define EDM_GAP_ADC_VREF 3.3f           // V
+#endif
+#ifndef EDM_GAP_ADC_DIVIDER
+#define EDM_GAP_ADC_DIVIDER 33.0f       // gap voltage / pin voltage
+#endif
+#ifndef EDM_GAP_ADC_SHORT_V
+#define EDM_GAP_ADC_SHORT_V 8.0f        // gap voltage below which the gap is shorted
+#endif
+#ifndef EDM_GAP_ADC_OPEN_V
+#define EDM_GAP_ADC_OPEN_V 60.0f        // gap voltage above which the gap is open (no discharge)
+#endif
+#ifndef EDM_GAP_ADC_HYSTERESIS_V
+#define EDM_GAP_ADC_HYSTERESIS_V 2.0f
+#endif
+// Must span the pulse off-time, where the gap voltage also drops to short level.
+#ifndef EDM_GAP_ADC_SHORT_SAMPLES
+#define EDM_GAP_ADC_SHORT_SAMPLES 4
+#endif
+#if DSP_ENABLE
+#ifndef EDM_GAP_DSP_BLOCK
+#define EDM_GAP_DSP_BLOCK 256           // conversions per DMA half transfer, 1.28ms at 200kHz
+#endif
+#ifndef EDM_GAP_DSP_DECIMATION
+#define EDM_GAP_DSP_DECIMATION 8
+#endif
+#ifndef EDM_GAP_DSP_TAPS
+#define EDM_GAP_DSP_TAPS 32
+#endif
+#ifndef EDM_GAP_DSP_LP_HZ
+#define EDM_GAP_DSP_LP_HZ 500.0f
+#endif
+#ifndef EDM_GAP_DSP_PEAKS
+#define EDM_GAP_DSP_PEAKS 5
+#endif
+#if EDM_GAP_DSP_BLOCK % EDM_GAP_DSP_DECIMATION
+#error "EDM_GAP_DSP_BLOCK must be a multiple of EDM_GAP_DSP_DECIMATION!"
+#endif
+#undef EDM_GAP_ADC_BUFFER
+#define EDM_GAP_ADC_BUFFER (EDM_GAP_DSP_BLOCK * 2)
+#define GAP_DSP_OUT (EDM_GAP_DSP_BLOCK / EDM_GAP_DSP_DECIMATION)
+#endif
+
+#ifndef EDM_GAP_ADC_BUFFER
+#define EDM_GAP_ADC_BUFFER 64           // power of 2
+#endif
+
+#if (EDM_GAP_ADC_BUFFER & (EDM_GAP_ADC_BUFFER - 1)) != 0
+#error "EDM_GAP_ADC_BUFFER must be a power of 2!"
+#endif
+
+#define GAP_FULL_SCALE 4095
+#define GAP_COUNTS(v) ((uint32_t)((v) * (float)GAP_FULL_SCALE / (EDM_GAP_ADC_DIVIDER * EDM_GAP_ADC_VREF)))
+
+typedef struct {
+    ADC_HandleTypeDef adc;
+    DMA_HandleTypeDef dma;
+    bool running;
+    volatile edm_gap_state_t state;
+    volatile uint_fast8_t short_countdown;
+    uint32_t short_th;
+    uint32_t open_th;
+    uint32_t hysteresis;
+    edm_gap_event_ptr on_event;
+    edm_gap_stats_t stats;
+} edm_gap_t;
+
+static edm_gap_t gap = {0};
+static DMA_BUFFER uint16_t gap_samples[EDM_GAP_ADC_BUFFER];
+
+#if DSP_ENABLE
+
+typedef struct {
+    arm_fir_decimate_instance_f32 fir;
+    arm_biquad_cascf_df2T_instance_f32 lp;
+    float fir_coeffs[EDM_GAP_DSP_TAPS];
+    float fir_state[EDM_GAP_DSP_TAPS + EDM_GAP_DSP_BLOCK - 1];
+    float lp_coeffs[5];
+    float lp_state[2];
+    float scale;                        // q15 to gap volts
+    volatile float filtered;
+    float history[DSP_FFT_MAX];         // decimated samples
+    uint32_t head;
+    // accumulated since the last report
+    uint32_t n;
+    double sum;
+    double sum_sq;
+    float min;
+    float max;
+    uint32_t cycles;
+    uint32_t cycles_max;
+    uint32_t late;
+} gap_dsp_t;
+
+static gap_dsp_t gap_dsp;
+
+static void gap_dsp_block (const uint16_t *samples)
+{
+    uint32_t idx, t0 = DWT->CYCCNT;
+    float x[EDM_GAP_DSP_BLOCK], y[GAP_DSP_OUT], z[GAP_DSP_OUT], v;
+
+    dma_buffer_invalidate(samples, EDM_GAP_DSP_BLOCK * sizeof(uint16_t));
+
+    // 12 bit right aligned conversions are valid positive q15 values.
+    arm_q15_to_float((q15_t *)samples, x, EDM_GAP_DSP_BLOCK);
+    arm_scale_f32(x, gap_dsp.scale, x, EDM_GAP_DSP_BLOCK);
+
+    arm_mean_f32(x, EDM_GAP_DSP_BLOCK, &v);
+    gap_dsp.sum += (double)v * EDM_GAP_DSP_BLOCK;
+    arm_power_f32(x, EDM_GAP_DSP_BLOCK, &v);
+    gap_dsp.sum_sq += (double)v;
+    arm_min_f32(x, EDM_GAP_DSP_BLOCK, &v, &idx);
+    if(gap_dsp.n == 0 || v < gap_dsp.min)
+        gap_dsp.min = v;
+    arm_max_f32(x, EDM_GAP_DSP_BLOCK, &v, &idx);
+    if(gap_dsp.n == 0 || v > gap_dsp.max)
+        gap_dsp.max = v;
+    gap_dsp.n += EDM_GAP_DSP_BLOCK;
+
+    arm_fir_decimate_f32(&gap_dsp.fir, x, y, EDM_GAP_DSP_BLOCK);
+    arm_biquad_cascade_df2T_f32(&gap_dsp.lp, y, z, GAP_DSP_OUT);
+    gap_dsp.filtered = z[GAP_DSP_OUT - 1];
+
+    for(idx = 0; idx < GAP_DSP_OUT; idx++) {
+        gap_dsp.history[gap_dsp.head] = y[idx];
+        gap_dsp.head = (gap_dsp.head + 1) & (DSP_FFT_MAX - 1);
+    }
+
+    gap_dsp.cycles = DWT->CYCCNT - t0;
+    if(gap_dsp.cycles > gap_dsp.cycles_max)
+        gap_dsp.cycles_max = gap_dsp.cycles;
+}
+
+// Half and full transfer, the half just completed is processed while the DMA fills the other.
+void DMA2_Stream5_IRQHandler (void)
+{
+    uint32_t flags = DMA2->HISR & (DMA_HISR_HTIF5|DMA_HISR_TCIF5);
+
+    DMA2->HIFCR = DMA_HIFCR_CHTIF5|DMA_HIFCR_CTCIF5|DMA_HIFCR_CTEIF5|DMA_HIFCR_CDMEIF5|DMA_HIFCR_CFEIF5;
+
+    if(flags == (DMA_HISR_HTIF5|DMA_HISR_TCIF5))
+        gap_dsp.late++;
+
+    if(flags)
+        gap_dsp_block(flags & DMA_HISR_TCIF5 ? &gap_samples[EDM_GAP_DSP_BLOCK] : gap_samples);
+}
+
+static status_code_t gap_dsp_report (sys_state_t state, char *args)
+{
+    char buf[160];
+    uint32_t idx, n, tail;
+    double sum, sum_sq, mean;
+    float min, max, fs = (float)EDM_GAP_ADC_RATE / (float)EDM_GAP_DSP_DECIMATION;
+    dsp_peak_t peaks[EDM_GAP_DSP_PEAKS];
+    uint_fast8_t n_peaks, len;
+
+    if(!gap.running)
+        return Status_InvalidStatement;
+
+    NVIC_DisableIRQ(DMA2_Stream5_IRQn);
+    n = gap_dsp.n;
+    sum = gap_dsp.sum;
+    sum_sq = gap_dsp.sum_sq;
+    min = gap_dsp.min;
+    max = gap_dsp.max;
+    gap_dsp.n = 0;
+    gap_dsp.sum = gap_dsp.sum_sq = 0.0;
+    // Oldest sample first.
+    tail = gap_dsp.head;
+    memcpy(dsp_fft_in, &gap_dsp.history[tail], (DSP_FFT_MAX - tail) * sizeof(float));
+    memcpy(&dsp_fft_in[DSP_FFT_MAX - tail], gap_dsp.history, tail * sizeof(float));
+    NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+
+    mean = n ? sum / (double)n : 0.0;
+
+    snprintf(buf, sizeof(buf), "[GAPDSP|fs=%lu,lp=%luHz,v=%.2f,mean=%.2f,rms=%.2f,std=%.2f,min=%.1f,max=%.1f,n=%lu,cyc=%lu/%lu,late=%lu]" ASCII_EOL,
+              (uint32_t)fs, (uint32_t)EDM_GAP_DSP_LP_HZ, gap_dsp.filtered, mean, n ? sqrt(sum_sq / (double)n) : 0.0,
+               n ? sqrt(fmax(sum_sq / (double)n - mean * mean, 0.0)) : 0.0, n ? min : 0.0f, n ? max : 0.0f,
+                n, gap_dsp.cycles, gap_dsp.cycles_max, gap_dsp.late);
+    hal.stream.write(buf);
+
+    n_peaks = dsp_spectrum(DSP_FFT_MAX, fs, NULL, peaks, EDM_GAP_DSP_PEAKS);
+
+    len = snprintf(buf, sizeof(buf), "[GAPFFT|n=%u,res=%.1fHz", DSP_FFT_MAX, fs / (float)DSP_FFT_MAX);
+    for(idx = 0; idx < n_peaks; idx++)
+        len += snprintf(buf + len, sizeof(buf) - len, ",%.0f:%.3f", peaks[idx].hz, peaks[idx].amplitude);
+    snprintf(buf + len, sizeof(buf) - len, "]" ASCII_EOL);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+static bool gap_dsp_init (void)
+{
+    static const sys_command_t gap_dsp_command_list[] = {
+        {"GAPDSP", gap_dsp_report, { .noargs = On }, { .str = "report gap voltage statistics and spectrum" } }
+    };
+
+    static sys_commands_t gap_dsp_commands = {
+        .n_commands = sizeof(gap_dsp_command_list) / sizeof(sys_command_t),
+        .commands = gap_dsp_command_list
+    };
+
+    float fs = (float)EDM_GAP_ADC_RATE / (float)EDM_GAP_DSP_DECIMATION;
+
+    gap_dsp.scale = 32768.0f * EDM_GAP_ADC_DIVIDER * EDM_GAP_ADC_VREF / (float)GAP_FULL_SCALE;
+
+    dsp_fir_decimator(gap_dsp.fir_coeffs, EDM_GAP_DSP_TAPS, EDM_GAP_DSP_DECIMATION);
+    dsp_biquad_lowpass(gap_dsp.lp_coeffs, fs, EDM_GAP_DSP_LP_HZ);
+
+    if(arm_fir_decimate_init_f32(&gap_dsp.fir, EDM_GAP_DSP_TAPS, EDM_GAP_DSP_DECIMATION,
+                                  gap_dsp.fir_coeffs, gap_dsp.fir_state, EDM_GAP_DSP_BLOCK) != ARM_MATH_SUCCESS)
+        return false;
+
+    arm_biquad_cascade_df2T_init_f32(&gap_dsp.lp, 1, gap_dsp.lp_coeffs, gap_dsp.lp_state);
+
+    system_register_commands(&gap_dsp_commands);
+
+    return true;
+}
+
+#endif // DSP_ENABLE
+
+static void awd_set_window (uint32_t low, uint32_t high)
+{
+#if defined(ADC_VER_V5_V90)
+    gap.adc.Instance->LTR1_TR1 = ADC_AWD1THRESHOLD_SHIFT_RESOLUTION(&gap.adc, low);
+    gap.adc.Instance->HTR1_TR2 = ADC_AWD1THRESHOLD_SHIFT_RESOLUTION(&gap.adc, high);
+#else
+    gap.adc.Instance->LTR1 = ADC_AWD1THRESHOLD_SHIFT_RESOLUTION(&gap.adc, low);
+    gap.adc.Instance->HTR1 = ADC_AWD1THRESHOLD_SHIFT_RESOLUTION(&gap.adc, high);
+#endif
+}
+
+static void awd_arm (edm_gap_state_t state)
+{
+    switch(state) {
+
+        case EdmGap_Open:
+            awd_set_window(gap.open_th - gap.hysteresis, GAP_FULL_SCALE);
+            break;
+
+        case EdmGap_Discharge:
+            awd_set_window(gap.short_th, gap.open_th);
+            break;
+
+        case EdmGap_Short:
+            awd_set_window(0, gap.short_th + gap.hysteresis);
+            break;
+    }
+}
+
+static void gap_report (edm_gap_state_t state)
+{
+    if(gap.on_event)
+        gap.on_event(state);
+}
+
+static void short_confirmed (void)
+{
+    EDM_GAP_ADC_TIMER->DIER &= ~TIM_DIER_UIE;
+    gap.stats.shorts++;
+    gap_report(EdmGap_Short);
+}
+
+// Analog watchdog, the last conversion is outside the window of the current state.
+void ADC_IRQHandler (void)
+{
+    uint32_t value;
+    edm_gap_state_t state;
+
+    if(gap.adc.Instance->ISR & ADC_ISR_AWD1) {
+
+        gap.adc.Instance->ISR = ADC_ISR_AWD1;
+
+        value = gap.adc.Instance->DR;
+        state = value < gap.short_th ? EdmGap_Short : (value > gap.open_th ? EdmGap_Open : EdmGap_Discharge);
+
+        awd_arm(state);
+
+        if(state != gap.state) {
+
+            if(gap.state == EdmGap_Short && gap.short_countdown) {
+                EDM_GAP_ADC_TIMER->DIER &= ~TIM_DIER_UIE;
+                gap.short_countdown = 0;
+                gap.stats.dips++;
+            }
+
+            gap.state = state;
+
+            switch(state) {
+
+                case EdmGap_Open:
+                    gap.stats.opens++;
+                    gap_report(state);
+                    break;
+
+                case EdmGap_Discharge:
+                    gap.stats.discharges++;
+                    gap_report(state);
+                    break;
+
+                case EdmGap_Short:
+#if EDM_GAP_ADC_SHORT_SAMPLES
+                    gap.short_countdown = EDM_GAP_ADC_SHORT_SAMPLES;
+                    EDM_GAP_ADC_TIMER->SR = ~TIM_SR_UIF;
+                    EDM_GAP_ADC_TIMER->DIER |= TIM_DIER_UIE;
+#else
+                    short_confirmed();
+#endif
+                    break;
+            }
+        }
+    }
+}
+
+// Sample clock, update interrupt only enabled while a short is being confirmed.
+void TIM6_DAC_IRQHandler (void)
+{
+    EDM_GAP_ADC_TIMER->SR = ~TIM_SR_UIF;
+
+    if(gap.short_countdown && --gap.short_countdown == 0)
+        short_confirmed();
+}
+
+bool edm_gap_adc_running (void)
+{
+    return gap.running;
+}
+
+edm_gap_state_t edm_gap_adc_state (void)
+{
+    return gap.state;
+}
+
+float edm_gap_adc_voltage (void)
+{
+#if DSP_ENABLE
+    return gap.running ? gap_dsp.filtered : 0.0f;
+#else
+    uint_fast16_t idx;
+    uint32_t sum = 0;
+
+    if(!gap.running)
+        return 0.0f;
+
+    dma_buffer_invalidate(gap_samples, sizeof(gap_samples));
+
+    for(idx = 0; idx < EDM_GAP_ADC_BUFFER; idx++)
+        sum += gap_samples[idx];
+
+    return (float)sum * EDM_GAP_ADC_DIVIDER * EDM_GAP_ADC_VREF / ((float)GAP_FULL_SCALE * (float)EDM_GAP_ADC_BUFFER);
+#endif
+}
+
+void edm_gap_adc_get_stats (edm_gap_stats_t *stats, bool reset)
+{
+    __disable_irq();
+    memcpy(stats, &gap.stats, sizeof(edm_gap_stats_t));
+    if(reset)
+        memset(&gap.stats, 0, sizeof(edm_gap_stats_t));
+    __enable_irq();
+}
+
+bool edm_gap_adc_init (edm_gap_event_ptr on_event)
+{
+    uint32_t channel;
+    ADC_TypeDef *adc;
+
+    // ADC3 has its own interrupt vector and packs the watchdog thresholds differently, not supported.
+    if(gap.running || !adc_get_channel(EDM_GAP_ADC_PORT, EDM_GAP_ADC_PIN, &adc, &channel) || adc == ADC3)
+        return false;
+
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << EDM_GAP_ADC_PIN,
+        .Mode = GPIO_MODE_ANALOG,
+        .Pull = GPIO_NOPULL
+    };
+
+    ADC_ChannelConfTypeDef adc_config = {
+        .Channel = channel,
+        .Rank = ADC_REGULAR_RANK_1,
+        .SamplingTime = EDM_GAP_ADC_SAMPLETIME,
+        .SingleDiff = ADC_SINGLE_ENDED,
+        .OffsetNumber = ADC_OFFSET_NONE
+    };
+
+    gap.on_event = on_event;
+    gap.short_th = GAP_COUNTS(EDM_GAP_ADC_SHORT_V);
+    gap.open_th = GAP_COUNTS(EDM_GAP_ADC_OPEN_V);
+    gap.hysteresis = GAP_COUNTS(EDM_GAP_ADC_HYSTERESIS_V);
+    gap.state = EdmGap_Open;
+
+    if(gap.open_th > GAP_FULL_SCALE || gap.short_th + gap.hysteresis >= gap.open_th || gap.hysteresis > gap.open_th)
+        return false;
+
+#if DSP_ENABLE
+    if(!gap_dsp_init())
+        return false;
+#endif
+
+    ADC_AnalogWDGConfTypeDef awd_config = {
+        .WatchdogNumber = ADC_ANALOGWATCHDOG_1,
+        .WatchdogMode = ADC_ANALOGWATCHDOG_SINGLE_REG,
+        .Channel = channel,
+        .ITMode = ENABLE,
+        .HighThreshold = GAP_FULL_SCALE,
+        .LowThreshold = gap.open_th - gap.hysteresis
+    };
+
+    __HAL_RCC_ADC12_CLK_ENABLE();
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    HAL_GPIO_Init(EDM_GAP_ADC_PORT, &gpio_init);
+
+    gap.dma.Instance = DMA2_Stream5;
+    gap.dma.Init.Request = adc == ADC1 ? DMA_REQUEST_ADC1 : DMA_REQUEST_ADC2;
+    gap.dma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    gap.dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    gap.dma.Init.MemInc = DMA_MINC_ENABLE;
+    gap.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_HALFWORD;
+    gap.dma.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    gap.dma.Init.Mode = DMA_CIRCULAR;
+    gap.dma.Init.Priority = DMA_PRIORITY_HIGH;
+    gap.dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&gap.dma) != HAL_OK)
+        return false;
+
+    __HAL_LINKDMA(&gap.adc, DMA_Handle, gap.dma);
+
+    gap.adc.Instance = adc;
+    gap.adc.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;
+    gap.adc.Init.Resolution = ADC_RESOLUTION_12B;
+    gap.adc.Init.ScanConvMode = ADC_SCAN_DISABLE;
+    gap.adc.Init.ContinuousConvMode = DISABLE;
+    gap.adc.Init.DiscontinuousConvMode = DISABLE;
+    gap.adc.Init.ExternalTrigConv = ADC_EXTERNALTRIG_T6_TRGO;
+    gap.adc.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_RISING;
+    gap.adc.Init.NbrOfConversion = 1;
+    gap.adc.Init.EOCSelection = ADC_EOC_SINGLE_CONV;
+    gap.adc.Init.Overrun = ADC_OVR_DATA_OVERWRITTEN;
+    gap.adc.Init.ConversionDataManagement = ADC_CONVERSIONDATA_DMA_CIRCULAR;
+    gap.adc.Init.LeftBitShift = ADC_LEFTBITSHIFT_NONE;
+    gap.adc.Init.OversamplingMode = DISABLE;
+
+    if(HAL_ADC_Init(&gap.adc) != HAL_OK ||
+        HAL_ADC_ConfigChannel(&gap.adc, &adc_config) != HAL_OK ||
+         HAL_ADC_AnalogWDGConfig(&gap.adc, &awd_config) != HAL_OK)
+        return false;
+
+    HAL_ADCEx_Calibration_Start(&gap.adc, ADC_CALIB_OFFSET, ADC_SINGLE_ENDED);
+
+    // Sample clock, the update event is output on TRGO.
+    EDM_GAP_ADC_TIMER_CLKEN();
+    EDM_GAP_ADC_TIMER->CR1 = TIM_CR1_ARPE;
+    timer_trgo_cfg(EDM_GAP_ADC_TIMER, TimerTrgo_Update);
+    EDM_GAP_ADC_TIMER->PSC = 0;
+    EDM_GAP_ADC_TIMER->ARR = (HAL_RCC_GetPCLK1Freq() * 2) / EDM_GAP_ADC_RATE - 1;
+    EDM_GAP_ADC_TIMER->EGR = TIM_EGR_UG;
+    EDM_GAP_ADC_TIMER->SR = ~TIM_SR_UIF;
+    EDM_GAP_ADC_TIMER->DIER = 0;
+
+    HAL_NVIC_SetPriority(ADC_IRQn, IRQ_PRIO_EDM, 0);
+    HAL_NVIC_SetPriority(TIM6_DAC_IRQn, IRQ_PRIO_EDM, 0);
+    NVIC_EnableIRQ(TIM6_DAC_IRQn);
+
+    if(HAL_ADC_Start_DMA(&gap.adc, (uint32_t *)gap_samples, EDM_GAP_ADC_BUFFER) != HAL_OK)
+        return false;
+
+    __HAL_ADC_DISABLE_IT(&gap.adc, ADC_IT_OVR);
+#if DSP_ENABLE
+    // Half and full transfer interrupts feed the filters.
+    __HAL_DMA_DISABLE_IT(&gap.dma, DMA_IT_TE);
+    HAL_NVIC_SetPriority(DMA2_Stream5_IRQn, IRQ_PRIO_DSP, 0);
+    NVIC_EnableIRQ(DMA2_Stream5_IRQn);
+#else
+    // Only the watchdog interrupt is used, the circular transfer needs no servicing.
+    __HAL_DMA_DISABLE_IT(&gap.dma, DMA_IT_TC|DMA_IT_HT|DMA_IT_TE);
+#endif
+
+    NVIC_EnableIRQ(ADC_IRQn);
+
+    EDM_GAP_ADC_TIMER->CR1 |= TIM_CR1_CEN;
+
+    return (gap.running = true);
+}
+
+#endif // EDM_GAP_ADC_ENABLE
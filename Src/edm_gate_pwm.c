@@ -0,0 +1,325 @@
+/*
+  edm_gate_pwm.c - timer generated EDM pulses on the PULSER gate output
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The gate pin is driven by its PWM timer channel (claimed via pwm_claim()), one timer period per
+  pulse. On every update event DMA writes the on-time of the next pulse to CCR from a circular
+  train of EDM_GATE_PWM_TRAIN entries, so the CPU only touches the train when the energy changes.
+
+  The train is filled with the scaled on-time dithered over its entries, giving an average on-time
+  resolution of 1/EDM_GATE_PWM_TRAIN timer ticks.
+
+  When off the pin is switched back to a GPIO output driven low, independent of the timer state.
+
+  With EDM_GATE_BREAK_ENABLE and the gate on an advanced timer (TIM1/TIM8) its break input
+  EDM_GATE_BREAK_PORT/PIN, wired to a short/fault comparator and the e-stop chain, clears MOE in
+  hardware: the output goes to its idle (low) level within the input filter delay, independent of
+  any interrupt or firmware latency. The break interrupt only reports it. The outputs stay off until
+  edm_gate_pwm_rearm(), which fails while the input is still active.
+*/
+
+#include "driver.h"
+
+#if EDM_GATE_PWM_ENABLE
+
+#include "cache.h"
+#include "pwm.h"
+#include "edm_gate_pwm.h"
+
+#ifndef EDM_GATE_PWM_CLOCK
+#define EDM_GATE_PWM_CLOCK 10000000     // Hz, on/off-time resolution
+#endif
+#ifndef EDM_GATE_PWM_TRAIN
+#define EDM_GATE_PWM_TRAIN 16           // power of 2
+#endif
+
+#if (EDM_GATE_PWM_TRAIN & (EDM_GATE_PWM_TRAIN - 1)) != 0
+#error "EDM_GATE_PWM_TRAIN must be a power of 2!"
+#endif
+
+#define GATE_TRAIN_SHIFT (31 - __builtin_clz(EDM_GATE_PWM_TRAIN))
+#define GATE_MODER_MASK (GPIO_MODER_MODE0 << (PULSER_GATE_PIN * 2))
+#define GATE_MODER_AF   (GPIO_MODER_MODE0_1 << (PULSER_GATE_PIN * 2))
+#define GATE_MODER_OUT  (GPIO_MODER_MODE0_0 << (PULSER_GATE_PIN * 2))
+
+typedef struct {
+    const pwm_signal_t *pwm;
+    DMA_HandleTypeDef dma;
+    uint32_t on_ticks;      // nominal on-time
+    uint32_t period;
+    volatile bool on;
+#if EDM_GATE_BREAK_ENABLE
+    edm_gate_break_ptr on_break;
+    volatile bool tripped;
+#endif
+} edm_gate_t;
+
+static edm_gate_t gate = {0};
+static DMA_BUFFER uint32_t gate_train[EDM_GATE_PWM_TRAIN];
+
+static void gate_train_fill (float scale)
+{
+    uint_fast8_t idx;
+    uint32_t prev = 0, next;
+    uint64_t on;
+
+    // On-time in 1/EDM_GATE_PWM_TRAIN ticks, each entry gets the whole ticks added to the running sum.
+    on = (uint64_t)((float)gate.on_ticks * (float)EDM_GATE_PWM_TRAIN * scale + 0.5f);
+
+    for(idx = 0; idx < EDM_GATE_PWM_TRAIN; idx++) {
+        next = (uint32_t)((on * (idx + 1)) >> GATE_TRAIN_SHIFT);
+        gate_train[idx] = next - prev;
+        prev = next;
+    }
+
+    dma_buffer_clean(gate_train, sizeof(gate_train));
+}
+
+void edm_gate_pwm_scale (float scale)
+{
+    if(gate.pwm)
+        gate_train_fill(scale < 0.0f ? 0.0f : (scale > 1.0f ? 1.0f : scale));
+}
+
+void edm_gate_pwm_enable (bool on)
+{
+    if(gate.pwm == NULL || gate.on == on)
+        return;
+
+    if((gate.on = on)) {
+        gate.pwm->timer->EGR = TIM_EGR_UG;  // restart the period, loads the first on-time
+        PULSER_GATE_PORT->MODER = (PULSER_GATE_PORT->MODER & ~GATE_MODER_MASK) | GATE_MODER_AF;
+    } else
+        PULSER_GATE_PORT->MODER = (PULSER_GATE_PORT->MODER & ~GATE_MODER_MASK) | GATE_MODER_OUT;
+}
+
+bool edm_gate_pwm_configure (float on_us, float duty_pct)
+{
+    float tick_hz, period_ticks;
+    uint32_t prescaler;
+
+    if(gate.pwm == NULL || gate.on || duty_pct < 1.0f || duty_pct > 100.0f)
+        return false;
+
+    if((prescaler = pwm_get_clock_hz(gate.pwm) / EDM_GATE_PWM_CLOCK) == 0)
+        prescaler = 1;
+    tick_hz = (float)(pwm_get_clock_hz(gate.pwm) / prescaler);
+    period_ticks = on_us * tick_hz / 1000000.0f * 100.0f / duty_pct + 0.5f;
+
+    if(period_ticks > (IS_TIM_32B_COUNTER_INSTANCE(gate.pwm->timer) ? 4294967295.0f : 65536.0f))
+        return false;
+
+    if((gate.on_ticks = (uint32_t)(on_us * tick_hz / 1000000.0f + 0.5f)) == 0)
+        return false;
+
+    gate.period = (uint32_t)period_ticks;
+    gate_train_fill(1.0f);
+
+    gate.pwm->timer->DIER &= ~TIM_DIER_UDE;
+    pwm_config(gate.pwm, prescaler, gate.period, false);
+    gate.pwm->timer->DIER |= TIM_DIER_UDE;
+
+    // Advanced timers only drive their outputs with MOE set, after a break only edm_gate_pwm_rearm() may set it.
+#if EDM_GATE_BREAK_ENABLE
+    if(IS_TIM_BREAK_INSTANCE(gate.pwm->timer) && !gate.tripped)
+#else
+    if(IS_TIM_BREAK_INSTANCE(gate.pwm->timer))
+#endif
+        gate.pwm->timer->BDTR |= TIM_BDTR_MOE;
+
+    return true;
+}
+
+bool edm_gate_pwm_init (void)
+{
+    uint32_t request;
+
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << PULSER_GATE_PIN,
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Mode = GPIO_MODE_OUTPUT_PP,
+        .Pull = GPIO_NOPULL
+    };
+
+    if(gate.pwm || (gate.pwm = pwm_claim(PULSER_GATE_PORT, PULSER_GATE_PIN)) == NULL)
+        return false;
+
+    if((request = timer_dma_request(gate.pwm->timer, TimerEvent_Update)) == 0) {
+        gate.pwm = NULL;
+        return false;
+    }
+
+    // pwm_enable() selects the alternate function, the pin is then parked as a low output
+    // (the AF selection is kept) until the gate is switched on.
+    pwm_enable(gate.pwm);
+    PULSER_GATE_PORT->BSRR = (1 << PULSER_GATE_PIN) << 16;
+    HAL_GPIO_Init(PULSER_GATE_PORT, &gpio_init);
+
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    gate.dma.Instance = DMA2_Stream6;
+    gate.dma.Init.Request = request;
+    gate.dma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    gate.dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    gate.dma.Init.MemInc = DMA_MINC_ENABLE;
+    gate.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    gate.dma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    gate.dma.Init.Mode = DMA_CIRCULAR;
+    gate.dma.Init.Priority = DMA_PRIORITY_VERY_HIGH;
+    gate.dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&gate.dma) != HAL_OK ||
+        HAL_DMA_Start(&gate.dma, (uint32_t)gate_train, (uint32_t)gate.pwm->ccr, EDM_GATE_PWM_TRAIN) != HAL_OK) {
+        gate.pwm = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+#if EDM_GATE_BREAK_ENABLE
+
+#ifndef EDM_GATE_BREAK_ACTIVE_HIGH
+#define EDM_GATE_BREAK_ACTIVE_HIGH 0    // 0: active low with pull-up, an open wire kills the gate
+#endif
+#ifndef EDM_GATE_BREAK_FILTER
+#define EDM_GATE_BREAK_FILTER 0         // BDTR.BKF, 0: no filter (fastest), 1-15: glitch filter
+#endif
+
+#if EDM_GATE_BREAK_FILTER < 0 || EDM_GATE_BREAK_FILTER > 15
+#error "EDM_GATE_BREAK_FILTER must be within 0..15!"
+#endif
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint8_t pin;
+    TIM_TypeDef *timer;
+    uint8_t af;
+} gate_break_pin_t;
+
+static const gate_break_pin_t break_pin[] = {
+    { .port = GPIOA, .pin = 6, .timer = TIM1, .af = GPIO_AF1_TIM1 },
+    { .port = GPIOB, .pin = 12, .timer = TIM1, .af = GPIO_AF1_TIM1 },
+    { .port = GPIOE, .pin = 15, .timer = TIM1, .af = GPIO_AF1_TIM1 },
+    { .port = GPIOA, .pin = 6, .timer = TIM8, .af = GPIO_AF3_TIM8 },
+    { .port = GPIOG, .pin = 2, .timer = TIM8, .af = GPIO_AF3_TIM8 }
+};
+
+static void gate_break_irq (TIM_TypeDef *timer)
+{
+    if(gate.pwm == NULL || gate.pwm->timer != timer || !(timer->SR & TIM_SR_BIF))
+        return;
+
+    // The break is level sensitive, the interrupt is enabled again when rearmed.
+    timer->DIER &= ~TIM_DIER_BIE;
+    timer->SR = ~TIM_SR_BIF;
+    gate.tripped = true;
+
+    if(gate.on_break)
+        gate.on_break();
+}
+
+void TIM1_BRK_IRQHandler (void)
+{
+    gate_break_irq(TIM1);
+}
+
+void TIM8_BRK_TIM12_IRQHandler (void)
+{
+    gate_break_irq(TIM8);
+}
+
+bool edm_gate_pwm_tripped (void)
+{
+    return gate.tripped;
+}
+
+bool edm_gate_pwm_rearm (void)
+{
+    TIM_TypeDef *timer;
+
+    if(gate.pwm == NULL || !gate.tripped)
+        return gate.pwm != NULL;
+
+    timer = gate.pwm->timer;
+    timer->SR = ~TIM_SR_BIF;
+    timer->BDTR |= TIM_BDTR_MOE;
+
+    // MOE does not stick while the break input is active.
+    if(!(timer->BDTR & TIM_BDTR_MOE))
+        return false;
+
+    gate.tripped = false;
+    timer->SR = ~TIM_SR_BIF;
+    timer->DIER |= TIM_DIER_BIE;
+
+    return true;
+}
+
+bool edm_gate_pwm_break_init (edm_gate_break_ptr on_break)
+{
+    TIM_TypeDef *timer;
+    const gate_break_pin_t *brk = NULL;
+    uint_fast8_t idx = sizeof(break_pin) / sizeof(gate_break_pin_t);
+
+    if(gate.pwm == NULL || !IS_TIM_BREAK_INSTANCE((timer = gate.pwm->timer)))
+        return false;
+
+    do {
+        idx--;
+        if(break_pin[idx].timer == timer && break_pin[idx].port == EDM_GATE_BREAK_PORT && break_pin[idx].pin == EDM_GATE_BREAK_PIN)
+            brk = &break_pin[idx];
+    } while(idx && brk == NULL);
+
+    if(brk == NULL)
+        return false;
+
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << brk->pin,
+        .Mode = GPIO_MODE_AF_PP,
+        .Pull = EDM_GATE_BREAK_ACTIVE_HIGH ? GPIO_PULLDOWN : GPIO_PULLUP,
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Alternate = brk->af
+    };
+
+    HAL_GPIO_Init(brk->port, &gpio_init);
+
+    gate.on_break = on_break;
+
+    // No automatic output enable: after a break the gate stays off until rearmed.
+    timer->BDTR = (timer->BDTR & ~(TIM_BDTR_BKF|TIM_BDTR_BKP|TIM_BDTR_AOE)) |
+                   TIM_BDTR_BKE|TIM_BDTR_OSSR|TIM_BDTR_OSSI|
+                   (EDM_GATE_BREAK_ACTIVE_HIGH ? TIM_BDTR_BKP : 0) |
+                   (EDM_GATE_BREAK_FILTER << TIM_BDTR_BKF_Pos);
+    timer->AF1 = (timer->AF1 & ~TIM1_AF1_BKINP) | TIM1_AF1_BKINE;
+
+    gate.tripped = true;    // MOE is set by the rearm, unless the input is active already
+
+    IRQn_Type irq = timer == TIM1 ? TIM1_BRK_IRQn : TIM8_BRK_TIM12_IRQn;
+    HAL_NVIC_SetPriority(irq, IRQ_PRIO_EDM, 0);
+    NVIC_EnableIRQ(irq);
+
+    edm_gate_pwm_rearm();
+
+    return true;
+}
+
+#endif // EDM_GATE_BREAK_ENABLE
+
+#endif // EDM_GATE_PWM_ENABLE
@@ -0,0 +1,239 @@
+/*
+  edm_pulse_capture.c - timer input capture of EDM discharge pulses
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A discharge signal (e.g. the PULSER pulse output or a current comparator, high while current
+  flows) on EDM_PULSE_CAPTURE_PORT/PIN is fed to channel 1 of its timer, which is free running.
+  TI1 is captured on both edges: CC2 (indirect) latches the rising edge, CC1 the falling edge.
+
+  On every CC1 capture a DMA burst (DCR/DMAR) copies CCR1 and CCR2 to a circular buffer of
+  EDM_PULSE_CAPTURE_BUFFER entries, so each discharge costs no CPU time. The DMA transfer complete
+  interrupt counts buffer laps, the pulse count is derived from laps and NDTR and is exact even
+  when the reader falls behind; only the widths of overwritten entries are lost.
+*/
+
+#include "driver.h"
+
+#if EDM_PULSE_CAPTURE_ENABLE
+
+#include <string.h>
+
+#include "cache.h"
+#include "edm_pulse_capture.h"
+
+#ifndef EDM_PULSE_CAPTURE_CLOCK
+#define EDM_PULSE_CAPTURE_CLOCK 10000000    // Hz, width resolution
+#endif
+#ifndef EDM_PULSE_CAPTURE_FILTER
+#define EDM_PULSE_CAPTURE_FILTER 3          // IC1F/IC2F, 3: 8 timer kernel clocks
+#endif
+#ifndef EDM_PULSE_CAPTURE_BUFFER
+#define EDM_PULSE_CAPTURE_BUFFER 256        // discharges, power of 2
+#endif
+
+#if (EDM_PULSE_CAPTURE_BUFFER & (EDM_PULSE_CAPTURE_BUFFER - 1)) != 0
+#error "EDM_PULSE_CAPTURE_BUFFER must be a power of 2!"
+#endif
+
+#define CAPTURE_DMA_STREAM      dmaStream(2, EDM_PULSE_CAPTURE_DMA_STREAM)
+#define CAPTURE_DMA_IRQ         dmaINT(2, EDM_PULSE_CAPTURE_DMA_STREAM)
+#define CAPTURE_DMA_IRQHandler  dmaHANDLER(2, EDM_PULSE_CAPTURE_DMA_STREAM)
+#define CAPTURE_DMA_ISR         dmaISR(2, EDM_PULSE_CAPTURE_DMA_STREAM)
+#define CAPTURE_DMA_IFCR        dmaIFCR(2, EDM_PULSE_CAPTURE_DMA_STREAM)
+#define CAPTURE_DMA_TCIF        dmaTCIF(EDM_PULSE_CAPTURE_DMA_STREAM)
+#define CAPTURE_WORDS       (EDM_PULSE_CAPTURE_BUFFER * 2)
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint8_t pin;
+    uint8_t af;
+    TIM_TypeDef *timer;
+} capture_pin_t;
+
+static const capture_pin_t capture_pins[] = {
+    { .port = GPIOA, .pin = 5,  .af = GPIO_AF1_TIM2,  .timer = TIM2 },
+    { .port = GPIOA, .pin = 6,  .af = GPIO_AF2_TIM3,  .timer = TIM3 },
+    { .port = GPIOA, .pin = 8,  .af = GPIO_AF1_TIM1,  .timer = TIM1 },
+    { .port = GPIOA, .pin = 15, .af = GPIO_AF1_TIM2,  .timer = TIM2 },
+    { .port = GPIOB, .pin = 4,  .af = GPIO_AF2_TIM3,  .timer = TIM3 },
+    { .port = GPIOC, .pin = 6,  .af = GPIO_AF2_TIM3,  .timer = TIM3 },
+    { .port = GPIOE, .pin = 5,  .af = GPIO_AF4_TIM15, .timer = TIM15 },
+    { .port = GPIOE, .pin = 9,  .af = GPIO_AF1_TIM1,  .timer = TIM1 }
+};
+
+typedef struct {
+    TIM_TypeDef *timer;
+    DMA_HandleTypeDef dma;
+    uint32_t counter_mask;
+    uint32_t ns_per_tick_q16;
+    volatile uint32_t laps;     // DMA buffer laps
+    uint32_t read_pos;          // pulse count at the previous read
+} edm_capture_t;
+
+static edm_capture_t capture = {0};
+// Pairs of CCR1 (falling edge), CCR2 (rising edge) as written by the DMA burst.
+static DMA_BUFFER uint32_t capture_buffer[EDM_PULSE_CAPTURE_BUFFER][2];
+
+void CAPTURE_DMA_IRQHandler (void)
+{
+    if(CAPTURE_DMA_ISR & CAPTURE_DMA_TCIF) {
+        CAPTURE_DMA_IFCR = CAPTURE_DMA_TCIF;
+        capture.laps++;
+    }
+}
+
+// Number of discharges captured since init, call with interrupts disabled.
+static uint32_t capture_pos (void)
+{
+    uint32_t laps = capture.laps, ndtr = CAPTURE_DMA_STREAM->NDTR;
+
+    // A pending transfer complete flag means the buffer wrapped and the lap is not yet counted,
+    // NDTR is re-read as the wrap may have happened after the first read.
+    if(CAPTURE_DMA_ISR & CAPTURE_DMA_TCIF) {
+        ndtr = CAPTURE_DMA_STREAM->NDTR;
+        laps++;
+    }
+
+    // NDTR counts down from CAPTURE_WORDS, each discharge is two words.
+    return laps * EDM_PULSE_CAPTURE_BUFFER + (CAPTURE_WORDS - ndtr) / 2;
+}
+
+bool edm_pulse_capture_running (void)
+{
+    return !!capture.timer;
+}
+
+void edm_pulse_capture_read (edm_pulse_capture_t *result)
+{
+    uint32_t pos, idx, width, sum = 0;
+
+    memset(result, 0, sizeof(edm_pulse_capture_t));
+
+    if(capture.timer == NULL)
+        return;
+
+    __disable_irq();
+    pos = capture_pos();
+    __enable_irq();
+
+    result->pulses = pos - capture.read_pos;
+    result->measured = result->pulses > EDM_PULSE_CAPTURE_BUFFER - 1 ? EDM_PULSE_CAPTURE_BUFFER - 1 : result->pulses;
+
+    // The oldest entry of a full buffer may already be overwritten by the next burst, it is skipped.
+    dma_buffer_invalidate(capture_buffer, sizeof(capture_buffer));
+
+    for(idx = pos - result->measured; idx != pos; idx++) {
+        width = (capture_buffer[idx & (EDM_PULSE_CAPTURE_BUFFER - 1)][0] -
+                  capture_buffer[idx & (EDM_PULSE_CAPTURE_BUFFER - 1)][1]) & capture.counter_mask;
+        sum += width;
+    }
+
+    result->width_ns = (uint32_t)(((uint64_t)sum * capture.ns_per_tick_q16) >> 16);
+    capture.read_pos = pos;
+}
+
+bool edm_pulse_capture_init (void)
+{
+    uint_fast8_t idx;
+    uint32_t clock_hz, prescaler, request;
+    const capture_pin_t *pin = NULL;
+    const timer_capture_t falling_edge = {
+        .edge = TimerCapture_Falling,
+        .filter = EDM_PULSE_CAPTURE_FILTER
+    }, rising_edge = {
+        .indirect = true,
+        .edge = TimerCapture_Rising,
+        .filter = EDM_PULSE_CAPTURE_FILTER
+    };
+
+    if(capture.timer)
+        return false;
+
+    for(idx = 0; idx < sizeof(capture_pins) / sizeof(capture_pin_t); idx++) {
+        if(capture_pins[idx].port == EDM_PULSE_CAPTURE_PORT && capture_pins[idx].pin == EDM_PULSE_CAPTURE_PIN) {
+            pin = &capture_pins[idx];
+            break;
+        }
+    }
+
+    if(pin == NULL || !timer_claim(pin->timer))
+        return false;
+
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << pin->pin,
+        .Mode = GPIO_MODE_AF_PP,
+        .Pull = GPIO_PULLDOWN,
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Alternate = pin->af
+    };
+
+    HAL_GPIO_Init(pin->port, &gpio_init);
+
+    clock_hz = timer_clk_enable(pin->timer);
+    if((prescaler = clock_hz / EDM_PULSE_CAPTURE_CLOCK) == 0)
+        prescaler = 1;
+
+    capture.counter_mask = IS_TIM_32B_COUNTER_INSTANCE(pin->timer) ? 0xFFFFFFFF : 0xFFFF;
+    capture.ns_per_tick_q16 = (uint32_t)((1000000000ULL * prescaler << 16) / clock_hz);
+
+    pin->timer->CR1 = 0;
+    pin->timer->DIER = 0;
+    pin->timer->SMCR = 0;
+    pin->timer->PSC = prescaler - 1;
+    pin->timer->ARR = capture.counter_mask;
+    pin->timer->EGR = TIM_EGR_UG;
+
+    // IC1 and IC2 both mapped on TI1, CC1 captures the falling and CC2 the rising edge.
+    // Each CC1 capture triggers a DMA burst of two transfers from CCR1 on.
+    if((request = timer_dma_request(pin->timer, TimerEvent_CC1)) == 0 ||
+        !timer_capture_cfg(pin->timer, 1, &falling_edge) ||
+         !timer_capture_cfg(pin->timer, 2, &rising_edge) ||
+          !timer_dma_burst(pin->timer, &pin->timer->CCR1, 2))
+        return false;
+
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    capture.dma.Instance = CAPTURE_DMA_STREAM;
+    capture.dma.Init.Request = request;
+    capture.dma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    capture.dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    capture.dma.Init.MemInc = DMA_MINC_ENABLE;
+    capture.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    capture.dma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    capture.dma.Init.Mode = DMA_CIRCULAR;
+    capture.dma.Init.Priority = DMA_PRIORITY_HIGH;
+    capture.dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&capture.dma) != HAL_OK ||
+        HAL_DMA_Start(&capture.dma, (uint32_t)&pin->timer->DMAR, (uint32_t)capture_buffer, CAPTURE_WORDS) != HAL_OK)
+        return false;
+
+    CAPTURE_DMA_STREAM->CR |= DMA_SxCR_TCIE;
+    HAL_NVIC_SetPriority(CAPTURE_DMA_IRQ, IRQ_PRIO_EDM, 0);
+    NVIC_EnableIRQ(CAPTURE_DMA_IRQ);
+
+    capture.timer = pin->timer;
+    capture.timer->SR = 0;
+    timer_dma_enable(capture.timer, TimerEvent_CC1, true);
+    capture.timer->CR1 = TIM_CR1_CEN;
+
+    return true;
+}
+
+#endif // EDM_PULSE_CAPTURE_ENABLE
@@ -0,0 +1,123 @@
+/*
+  edm_servo_ref.c - analog gap servo reference output for external servo drives
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Bipolar velocity reference for an analog servo Z head, written by the gap servo for every sample.
+  Mid-scale is zero velocity, full scale full feed toward the work and zero full retract speed; the
+  drive side scales and offsets it to its +-10V input.
+
+  On PA4 or PA5 the DAC1 channel drives the pin directly (12 bits, output buffer on, no trigger, so
+  a write to DHR12R takes effect at once). Any other pin is driven by its PWM timer channel at
+  EDM_SERVO_REF_PWM_HZ to be RC filtered externally; resolution is then the timer clock divided by
+  that rate, e.g. ~10 bits at 200 kHz from a 275 MHz timer clock. Either way an update is a single
+  register write, cheap enough for the PULSER poll interrupt at kHz rates.
+*/
+
+#include "driver.h"
+
+#if EDM_SERVO_REF_ENABLE
+
+#include "pwm.h"
+#include "edm_servo_ref.h"
+
+#ifndef EDM_SERVO_REF_PWM_HZ
+#define EDM_SERVO_REF_PWM_HZ 200000
+#endif
+
+static struct {
+    __IO uint32_t *reg;         // DHR12Rx or CCR
+    uint32_t full;              // register value at full scale
+    const pwm_signal_t *pwm;
+} ref = {0};
+
+void edm_servo_ref_set (float ref_in)
+{
+    if(ref.reg) {
+        float v = ref_in < -1.0f ? -1.0f : (ref_in > 1.0f ? 1.0f : ref_in);
+        *ref.reg = (uint32_t)((v + 1.0f) * 0.5f * (float)ref.full + 0.5f);
+    }
+}
+
+bool edm_servo_ref_is_dac (void)
+{
+    return ref.reg && ref.pwm == NULL;
+}
+
+static bool dac_init (void)
+{
+    uint32_t channel;
+
+    if(EDM_SERVO_REF_PORT != GPIOA || (EDM_SERVO_REF_PIN != 4 && EDM_SERVO_REF_PIN != 5))
+        return false;
+
+    channel = EDM_SERVO_REF_PIN - 4;
+
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << EDM_SERVO_REF_PIN,
+        .Mode = GPIO_MODE_ANALOG,
+        .Pull = GPIO_NOPULL
+    };
+
+    __HAL_RCC_GPIOA_CLK_ENABLE();
+    HAL_GPIO_Init(GPIOA, &gpio_init);
+
+    __HAL_RCC_DAC12_CLK_ENABLE();
+
+    // MODEx = 000: normal mode, buffer enabled, connected to the pin
+    DAC1->MCR &= ~(DAC_MCR_MODE1 << (channel * 16));
+    DAC1->CR = (DAC1->CR & ~((DAC_CR_TEN1|DAC_CR_WAVE1|DAC_CR_DMAEN1) << (channel * 16))) | (DAC_CR_EN1 << (channel * 16));
+
+    ref.reg = channel ? &DAC1->DHR12R2 : &DAC1->DHR12R1;
+    ref.full = 4095;
+
+    return true;
+}
+
+static bool pwm_init (void)
+{
+    uint32_t period;
+
+    if((ref.pwm = pwm_claim(EDM_SERVO_REF_PORT, EDM_SERVO_REF_PIN)) == NULL)
+        return false;
+
+    if((period = pwm_get_clock_hz(ref.pwm) / EDM_SERVO_REF_PWM_HZ) < 64) {
+        ref.pwm = NULL;
+        return false;
+    }
+
+    pwm_config(ref.pwm, 1, period, false);
+    pwm_enable(ref.pwm);
+
+    ref.reg = ref.pwm->ccr;
+    ref.full = period;
+
+    return true;
+}
+
+bool edm_servo_ref_init (void)
+{
+    if(ref.reg == NULL && !dac_init() && !pwm_init())
+        return false;
+
+    edm_servo_ref_set(0.0f);
+
+    return true;
+}
+
+#endif // EDM_SERVO_REF_ENABLE
@@ -0,0 +1,341 @@
+/*
+  eeprom_async.c - I2C EEPROM/FRAM settings storage with a RAM mirror and background page writes
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Replaces the eeprom library backend (i2c_eeprom_init()), which writes a few bytes per blocking
+  transfer and waits out the write cycle of each. The whole EEPROM (EEPROM_ENABLE kbit) is read
+  into a RAM mirror at init. hal.nvs reads are served from the mirror and never touch the bus.
+  Writes update the mirror and mark the pages whose content changed, and return at once.
+
+  Changed pages are written back from the realtime loop, one full page (EEPROM_PAGE_SIZE) per
+  low priority transaction of the I2C queue, so PULSER polls on the same bus keep their high
+  priority slots. After each page the end of the write cycle is found by ACK polling: a one byte
+  read is queued on every pass until the device acknowledges it, at most EEPROM_WRITE_TIMEOUT_MS.
+  These polls show up as nack in $I2CSTATS. FRAM (EEPROM_IS_FRAM) has no write cycle and is not
+  polled. A failed page is marked changed again and retried.
+
+  Devices up to 2 KB (24LC16B) take the upper address bits in the device address, larger ones a
+  two byte word address.
+
+  $EEPROM - report: [EEPROM|size=,page=,pending=,writes=,polls=,errors=,maxcycle_us=]
+*/
+
+#include "driver.h"
+
+#if EEPROM_ASYNC_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/nvs_buffer.h"
+
+#include "i2c.h"
+#include "eeprom_async.h"
+
+#ifndef EEPROM_IS_FRAM
+#define EEPROM_IS_FRAM 0
+#endif
+#ifndef EEPROM_I2C_ADDRESS
+#define EEPROM_I2C_ADDRESS 0x50
+#endif
+
+#define EEPROM_SIZE (EEPROM_ENABLE * 1024 / 8)
+
+#ifndef EEPROM_PAGE_SIZE
+#if EEPROM_SIZE <= 2048
+#define EEPROM_PAGE_SIZE 16
+#elif EEPROM_SIZE <= 8192
+#define EEPROM_PAGE_SIZE 32
+#else
+#define EEPROM_PAGE_SIZE 64
+#endif
+#endif
+
+#ifndef EEPROM_WRITE_TIMEOUT_MS
+#define EEPROM_WRITE_TIMEOUT_MS 20
+#endif
+
+#define EEPROM_PAGES (EEPROM_SIZE / EEPROM_PAGE_SIZE)
+#define EEPROM_WORD_ADDR_BYTES (EEPROM_SIZE <= 2048 ? 1 : 2)
+
+typedef enum {
+    Flush_Idle = 0,
+    Flush_Write,        // page write queued
+    Flush_Written,
+    Flush_WriteFailed,
+    Flush_Poll,         // ACK poll queued
+    Flush_PollAck,
+    Flush_PollNack
+} flush_state_t;
+
+typedef struct {
+    uint8_t mirror[EEPROM_SIZE];
+    uint32_t dirty[(EEPROM_PAGES + 31) / 32];
+    uint8_t page[EEPROM_PAGE_SIZE];     // being written, the mirror may change meanwhile
+    uint8_t poll;
+    i2c_transaction_t t;
+    volatile flush_state_t state;
+    uint_fast16_t cur;                  // page being written
+    uint32_t cycle_start_us;
+    uint32_t writes;
+    uint32_t polls;
+    uint32_t errors;
+    uint32_t max_cycle_us;
+} eeprom_t;
+
+static eeprom_t ee = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static inline void page_mark (uint_fast16_t page)
+{
+    ee.dirty[page >> 5] |= 1UL << (page & 31);
+}
+
+// Copies to the mirror, only pages with changed content are marked for writing.
+static void mirror_write (uint32_t addr, const uint8_t *data, uint32_t size)
+{
+    uint32_t n;
+
+    while(size) {
+        n = EEPROM_PAGE_SIZE - addr % EEPROM_PAGE_SIZE;
+        if(n > size)
+            n = size;
+        if(memcmp(&ee.mirror[addr], data, n)) {
+            memcpy(&ee.mirror[addr], data, n);
+            page_mark(addr / EEPROM_PAGE_SIZE);
+        }
+        addr += n;
+        data += n;
+        size -= n;
+    }
+}
+
+static uint32_t pages_pending (void)
+{
+    uint32_t n = 0;
+    uint_fast16_t idx;
+
+    for(idx = 0; idx < EEPROM_PAGES; idx++)
+        n += (ee.dirty[idx >> 5] >> (idx & 31)) & 1;
+
+    return n;
+}
+
+// Called from interrupt context.
+static void flush_complete (bool ok, void *context)
+{
+    if(ee.state == Flush_Write)
+        ee.state = ok ? Flush_Written : Flush_WriteFailed;
+    else if(ee.state == Flush_Poll)
+        ee.state = ok ? Flush_PollAck : Flush_PollNack;
+}
+
+static void flush_queue (i2c_op_t op, uint32_t addr, uint8_t *data, uint16_t count, flush_state_t state)
+{
+    ee.t.op = op;
+    ee.t.priority = I2C_PriorityLow;
+    ee.t.address = EEPROM_I2C_ADDRESS | (EEPROM_WORD_ADDR_BYTES == 1 ? (addr >> 8) & 0x07 : 0);
+    ee.t.word_addr = EEPROM_WORD_ADDR_BYTES == 1 ? addr & 0xFF : addr;
+    ee.t.word_addr_bytes = EEPROM_WORD_ADDR_BYTES;
+    ee.t.data = data;
+    ee.t.count = count;
+    ee.t.callback = flush_complete;
+    ee.t.context = NULL;
+
+    ee.state = state;
+    if(!i2c_queue_transaction(&ee.t))
+        ee.state = state == Flush_Write ? Flush_WriteFailed : Flush_PollNack;
+}
+
+static bool flush_next (void)
+{
+    uint_fast16_t idx, page;
+
+    for(idx = 1; idx <= EEPROM_PAGES; idx++) {
+        page = (ee.cur + idx) % EEPROM_PAGES;
+        if(ee.dirty[page >> 5] & (1UL << (page & 31))) {
+            ee.dirty[page >> 5] &= ~(1UL << (page & 31));
+            ee.cur = page;
+            memcpy(ee.page, &ee.mirror[page * EEPROM_PAGE_SIZE], EEPROM_PAGE_SIZE);
+            flush_queue(I2C_OpMemWrite, page * EEPROM_PAGE_SIZE, ee.page, EEPROM_PAGE_SIZE, Flush_Write);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void eeprom_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    switch(ee.state) {
+
+        case Flush_Idle:
+            flush_next();
+            break;
+
+        case Flush_Written:
+#if EEPROM_IS_FRAM
+            ee.writes++;
+            ee.state = Flush_Idle;
+#else
+            ee.cycle_start_us = hal.get_micros();
+            ee.polls++;
+            flush_queue(I2C_OpReceive, 0, &ee.poll, 1, Flush_Poll);
+#endif
+            break;
+
+        case Flush_WriteFailed:
+            ee.errors++;
+            page_mark(ee.cur);
+            ee.state = Flush_Idle;
+            break;
+
+        case Flush_PollAck:
+            {
+                uint32_t us = hal.get_micros() - ee.cycle_start_us;
+                if(us > ee.max_cycle_us)
+                    ee.max_cycle_us = us;
+            }
+            ee.writes++;
+            ee.state = Flush_Idle;
+            break;
+
+        case Flush_PollNack:
+            if(hal.get_micros() - ee.cycle_start_us > EEPROM_WRITE_TIMEOUT_MS * 1000) {
+                ee.errors++;
+                page_mark(ee.cur);
+                ee.state = Flush_Idle;
+            } else {
+                ee.polls++;
+                flush_queue(I2C_OpReceive, 0, &ee.poll, 1, Flush_Poll);
+            }
+            break;
+
+        default: // transfer in progress
+            break;
+    }
+}
+
+static uint8_t eeprom_get_byte (uint32_t addr)
+{
+    return addr < EEPROM_SIZE ? ee.mirror[addr] : 0xFF;
+}
+
+static void eeprom_put_byte (uint32_t addr, uint8_t new_value)
+{
+    if(addr < EEPROM_SIZE && ee.mirror[addr] != new_value) {
+        ee.mirror[addr] = new_value;
+        page_mark(addr / EEPROM_PAGE_SIZE);
+    }
+}
+
+static nvs_transfer_result_t eeprom_memcpy_to_nvs (uint32_t destination, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    uint32_t len = size + (with_checksum ? NVS_CRC_BYTES : 0);
+
+    if(size == 0 || destination + len > EEPROM_SIZE)
+        return NVS_TransferResult_Failed;
+
+    mirror_write(destination, source, size);
+
+    if(with_checksum) {
+        nvs_crc_t crc = calc_checksum(source, size);
+        mirror_write(destination + size, (uint8_t *)&crc, NVS_CRC_BYTES);
+    }
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t eeprom_memcpy_from_nvs (uint8_t *destination, uint32_t source, uint32_t size, bool with_checksum)
+{
+    nvs_crc_t crc = 0;
+
+    if(source + size + (with_checksum ? NVS_CRC_BYTES : 0) > EEPROM_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(destination, &ee.mirror[source], size);
+
+    if(!with_checksum)
+        return NVS_TransferResult_OK;
+
+    memcpy(&crc, &ee.mirror[source + size], NVS_CRC_BYTES);
+
+    return crc == calc_checksum(destination, size) ? NVS_TransferResult_OK : NVS_TransferResult_Failed;
+}
+
+static status_code_t eeprom_command (sys_state_t state, char *args)
+{
+    char buf[120];
+
+    snprintf(buf, sizeof(buf), "[EEPROM|size=%u,page=%u,pending=%lu,writes=%lu,polls=%lu,errors=%lu,maxcycle_us=%lu]" ASCII_EOL,
+              (unsigned int)EEPROM_SIZE, (unsigned int)EEPROM_PAGE_SIZE, pages_pending(),
+               ee.writes, ee.polls, ee.errors, ee.max_cycle_us);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void eeprom_async_init (void)
+{
+    static const sys_command_t eeprom_command_list[] = {
+        {"EEPROM", eeprom_command, {}, { .str = "report EEPROM pages pending and write counters" } }
+    };
+
+    static sys_commands_t eeprom_commands = {
+        .n_commands = sizeof(eeprom_command_list) / sizeof(sys_command_t),
+        .commands = eeprom_command_list
+    };
+
+    uint32_t addr;
+    i2c_transfer_t i2c = {
+        .word_addr_bytes = EEPROM_WORD_ADDR_BYTES,
+        .count = 256
+    };
+
+    if(!i2c_start().started)
+        return;
+
+    for(addr = 0; addr < EEPROM_SIZE; addr += i2c.count) {
+        i2c.address = EEPROM_I2C_ADDRESS | (EEPROM_WORD_ADDR_BYTES == 1 ? (addr >> 8) & 0x07 : 0);
+        i2c.word_addr = EEPROM_WORD_ADDR_BYTES == 1 ? addr & 0xFF : addr;
+        i2c.data = &ee.mirror[addr];
+        if(!i2c_transfer(&i2c, true))
+            return; // no device, settings are not stored
+    }
+
+    ee.cur = EEPROM_PAGES - 1;
+
+    hal.nvs.type = EEPROM_IS_FRAM ? NVS_FRAM : NVS_EEPROM;
+    hal.nvs.size = EEPROM_SIZE;
+    hal.nvs.get_byte = eeprom_get_byte;
+    hal.nvs.put_byte = eeprom_put_byte;
+    hal.nvs.memcpy_to_nvs = eeprom_memcpy_to_nvs;
+    hal.nvs.memcpy_from_nvs = eeprom_memcpy_from_nvs;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = eeprom_execute_realtime;
+
+    system_register_commands(&eeprom_commands);
+}
+
+#endif // EEPROM_ASYNC_ENABLE
@@ -0,0 +1,166 @@
+/*
+  eth_stats.c - Ethernet MAC/DMA receive drop counters
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  $ETHSTAT[=R]
+
+    Reports receive counters of the ETH peripheral since boot or the last $ETHSTAT=R:
+
+    [ETHSTAT|rx=,nodesc=,fifo=,mtlmiss=,crc=,align=,ovf=,rxdesc=,txdesc=,buf=D1|D2]
+
+    rx       good unicast frames (MMC)
+    nodesc   frames dropped by the DMA for lack of a free Rx descriptor/buffer (DMACMFCR)
+    fifo     frames dropped on Rx FIFO overflow (MTLRQMPOCR)
+    mtlmiss  frames dropped by the MTL because the DMA was not ready (MTLRQMPOCR)
+    crc      frames with CRC errors (MMC)
+    align    frames with alignment errors (MMC)
+    ovf      times a hardware counter overflowed between two samples, counts are then low
+
+  rxdesc/txdesc are the configured descriptor ring sizes, buf where the Rx pool and descriptors are.
+
+  The DMA and MTL drop counters are only 11 bits and clear on read, they are accumulated from the
+  realtime loop every ETH_STATS_PERIOD_MS. The MMC counters are free running and kept as offsets.
+*/
+
+#include "driver.h"
+
+#if ETH_STATS_ENABLE
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "eth_stats.h"
+#include "rt_sched.h"
+
+#ifndef ETH_STATS_PERIOD_MS
+#define ETH_STATS_PERIOD_MS 100
+#endif
+
+typedef struct {
+    uint32_t nodesc;
+    uint32_t fifo;
+    uint32_t mtlmiss;
+    uint32_t ovf;
+    uint32_t rx_base;       // MMC counters at reset
+    uint32_t crc_base;
+    uint32_t align_base;
+    uint32_t sample_ms;
+} eth_stats_t;
+
+static eth_stats_t stats = {0};
+#if !RT_SCHED_ENABLE
+static on_execute_realtime_ptr on_execute_realtime;
+#endif
+
+static void stats_sample (void)
+{
+    uint32_t mfc = ETH->DMACMFCR, mpo = ETH->MTLRQMPOCR;   // cleared by the reads
+
+    stats.nodesc += (mfc & ETH_DMACMFCR_MFC_Msk) >> ETH_DMACMFCR_MFC_Pos;
+    stats.fifo += (mpo & ETH_MTLRQMPOCR_OVFPKTCNT_Msk) >> ETH_MTLRQMPOCR_OVFPKTCNT_Pos;
+    stats.mtlmiss += (mpo & ETH_MTLRQMPOCR_MISPKTCNT_Msk) >> ETH_MTLRQMPOCR_MISPKTCNT_Pos;
+
+    if((mfc & ETH_DMACMFCR_MFCO) || (mpo & (ETH_MTLRQMPOCR_OVFCNTOVF|ETH_MTLRQMPOCR_MISCNTOVF)))
+        stats.ovf++;
+}
+
+static void stats_reset (void)
+{
+    stats_sample();
+
+    stats.nodesc = stats.fifo = stats.mtlmiss = stats.ovf = 0;
+    stats.rx_base = ETH->MMCRUPGR;
+    stats.crc_base = ETH->MMCRCRCEPR;
+    stats.align_base = ETH->MMCRAEPR;
+}
+
+#if RT_SCHED_ENABLE
+
+static void stats_sample_task (void *context)
+{
+    stats_sample();
+}
+
+#else
+
+static void stats_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(hal.get_elapsed_ticks() - stats.sample_ms >= ETH_STATS_PERIOD_MS) {
+        stats.sample_ms = hal.get_elapsed_ticks();
+        stats_sample();
+    }
+}
+
+#endif
+
+static status_code_t stats_command (sys_state_t state, char *args)
+{
+    char buf[140];
+
+    stats_sample();
+
+    snprintf(buf, sizeof(buf), "[ETHSTAT|rx=%lu,nodesc=%lu,fifo=%lu,mtlmiss=%lu,crc=%lu,align=%lu,ovf=%lu,rxdesc=%d,txdesc=%d,buf=%s]" ASCII_EOL,
+              ETH->MMCRUPGR - stats.rx_base, stats.nodesc, stats.fifo, stats.mtlmiss,
+               ETH->MMCRCRCEPR - stats.crc_base, ETH->MMCRAEPR - stats.align_base, stats.ovf,
+                ETH_RX_DESC_CNT, ETH_TX_DESC_CNT, ETH_BUFFERS_D2 ? "D2" : "D1");
+    hal.stream.write(buf);
+
+    if(args)
+        stats_reset();
+
+    return Status_OK;
+}
+
+void eth_stats_init (void)
+{
+    static const sys_command_t stats_command_list[] = {
+        {"ETHSTAT", stats_command, {}, { .str = "report Ethernet receive drop counters, $ETHSTAT=R to clear" } }
+    };
+
+    static sys_commands_t stats_commands = {
+        .n_commands = sizeof(stats_command_list) / sizeof(sys_command_t),
+        .commands = stats_command_list
+    };
+
+    stats_reset();
+    stats.sample_ms = hal.get_elapsed_ticks();
+
+#if RT_SCHED_ENABLE
+    static rt_task_t sample_task = {
+        .name = "ethstat",
+        .fn = stats_sample_task,
+        .period_us = ETH_STATS_PERIOD_MS * 1000,
+        .budget_us = 10,
+        .priority = 200
+    };
+
+    rt_task_register(&sample_task);
+#else
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = stats_execute_realtime;
+#endif
+
+    system_register_commands(&stats_commands);
+}
+
+#endif // ETH_STATS_ENABLE
@@ -25,46 +25,35 @@
 
 #include "driver.h"
 #include "flash.h"
+#include "watchdog.h"
 
-#if FLASH_ENABLE
+#if FLASH_ENABLE || EDM_ENABLE || FLASH_JOURNAL || FW_UPDATE_ENABLE
 
 #include <string.h>
 
 extern void *_EEPROM_Emul_Start;
-extern uint8_t _EEPROM_Emul_Sector;
 
-bool memcpy_from_flash (uint8_t *dest)
+void *flash_emul_base (void)
 {
-    memcpy(dest, &_EEPROM_Emul_Start, hal.nvs.size);
-
-    return true;
+    return &_EEPROM_Emul_Start;
 }
 
-bool memcpy_to_flash (uint8_t *source)
+// Erases the 128KB sector holding address, in either bank.
+// NOTE: blocks (and stalls code fetch from the same flash bank) for up to a few seconds.
+bool flash_sector_erase (uint32_t address)
 {
-    // The STM32H7xx HAL_FLASH_Program implementation differs to other STM32 families.
-    //
-    // Writes are either 16 or 32 bytes long (dependent on processor model), instead of the byte,
-    // halfword, word or double word writes in other processor families. Erase operations are
-    // performed on 128-Kbyte sectors.
-    //
-    // Rather than using two sectors for boot & eeprom emulation, have chosen to store the NVS data
-    // at the end of the user accessible flash (in the last 128KB sector).
-	//
-	// Note that devices may have either one or two banks of flash memory, depending on flash size.
-
-    if (!memcmp(source, &_EEPROM_Emul_Start, hal.nvs.size))
-        return true;
-
     HAL_StatusTypeDef status;
 
+    address &= ~(FLASH_SECTOR_SIZE - 1);
+
     if((status = HAL_FLASH_Unlock()) == HAL_OK) {
 
-        static FLASH_EraseInitTypeDef erase = {
-            .Sector = FLASH_SECTOR_TOTAL - 1,
+        FLASH_EraseInitTypeDef erase = {
 #ifdef FLASH_BANK_2
-            .Banks = FLASH_BANK_2,
+            .Sector = (address - (address >= FLASH_BANK2_BASE ? FLASH_BANK2_BASE : FLASH_BANK1_BASE)) / FLASH_SECTOR_SIZE,
+            .Banks = address >= FLASH_BANK2_BASE ? FLASH_BANK_2 : FLASH_BANK_1,
 #else
+            .Sector = (address - FLASH_BANK1_BASE) / FLASH_SECTOR_SIZE,
             .Banks = FLASH_BANK_1,
 #endif
             .TypeErase = FLASH_TYPEERASE_SECTORS,
@@ -73,15 +62,43 @@ bool memcpy_to_flash (uint8_t *source)
         };
 
         uint32_t error;
+#if WATCHDOG_ENABLE
+        watchdog_extend(5000);
+#endif
         status = HAL_FLASHEx_Erase(&erase, &error);
 
+        HAL_FLASH_Lock();
+
+        SCB_InvalidateDCache_by_Addr((uint32_t *)address, FLASH_SECTOR_SIZE);
+    }
+
+    return status == HAL_OK;
+}
+
+// Erases the 128KB sector holding the EEPROM emulation region.
+bool flash_emul_erase (void)
+{
+    return flash_sector_erase((uint32_t)&_EEPROM_Emul_Start);
+}
+
+// Programs size bytes at address (must be a multiple of FLASH_WRITE_SIZE) into erased flash,
+// zero padding the last flash word.
+bool flash_program (uint32_t address, const void *source, uint32_t size)
+{
+    HAL_StatusTypeDef status;
+
+    if(address % FLASH_WRITE_SIZE)
+        return false;
+
+    if((status = HAL_FLASH_Unlock()) == HAL_OK) {
+
         uint8_t buffer[FLASH_WRITE_SIZE];
-        uint8_t *data = source;
-        uint32_t address = (uint32_t)&_EEPROM_Emul_Start, remaining = (uint32_t)hal.nvs.size;
+        const uint8_t *data = source;
+        uint32_t start = address, remaining = size;
 
         while(remaining && status == HAL_OK) {
 
-            //copy a buffers worth of nvs data, zero padded if less than the minimum flash write size...
+            //copy a buffers worth of data, zero padded if less than the minimum flash write size...
             memset(&buffer, 0, FLASH_WRITE_SIZE);
             memcpy(&buffer, data, min(remaining, FLASH_WRITE_SIZE));
 
@@ -92,10 +109,330 @@ bool memcpy_to_flash (uint8_t *source)
         }
 
         HAL_FLASH_Lock();
+
+        SCB_InvalidateDCache_by_Addr((uint32_t *)start, ((size + FLASH_WRITE_SIZE - 1) / FLASH_WRITE_SIZE) * FLASH_WRITE_SIZE);
     }
 
     return status == HAL_OK;
 }
 
+// Programs size bytes at offset (must be a multiple of FLASH_WRITE_SIZE) into the (erased)
+// EEPROM emulation region, zero padding the last flash word.
+bool flash_emul_program (uint32_t offset, const void *source, uint32_t size)
+{
+    return flash_program((uint32_t)&_EEPROM_Emul_Start + offset, source, size);
+}
+
+#endif
+
+#if FLASH_JOURNAL
+
+/*
+  Journaled settings store.
+
+  Instead of erasing the sector and rewriting the whole settings image on every save the image
+  is kept as a journal of records in the EEPROM emulation sector: memcpy_to_flash() compares the
+  new image with a RAM copy and only appends the changed FLASH_WRITE_SIZE chunks, a few flash
+  word writes taking well below a millisecond. memcpy_from_flash() replays the journal.
+
+  Besides the settings image (FLASH_KV_NVS) small values can be stored under their own keys with
+  flash_kv_write(), see flash.h. The last value per key is kept in RAM.
+
+  When the sector is full it is compacted: erased and rewritten with the current image and the
+  last value of each key, so it is erased once per ~(sector size / record size) saves instead of
+  on every save. Compaction is started ahead from the realtime loop when the journal is more than
+  FLASH_JOURNAL_COMPACT_PCT % full and the machine is idle, since the erase stalls code fetch for
+  up to a few seconds. A save that finds the sector full compacts in line.
+
+  A record is a FLASH_WRITE_SIZE header followed by the data, zero padded to FLASH_WRITE_SIZE. A
+  record with a bad checksum (a write interrupted by power loss) ends the replay, the sector is
+  then compacted on the next save.
+*/
+
+#include "grbl/hal.h"
+#include "grbl/state_machine.h"
+
+#include "cache.h"
+#include "crc32.h"
+
+#ifndef FLASH_JOURNAL_IMAGE_SIZE
+#define FLASH_JOURNAL_IMAGE_SIZE 4096   // max settings image (hal.nvs.size)
+#endif
+#ifndef FLASH_JOURNAL_COMPACT_PCT
+#define FLASH_JOURNAL_COMPACT_PCT 75
+#endif
+#ifndef FLASH_JOURNAL_IDLE_MS
+#define FLASH_JOURNAL_IDLE_MS 2000      // since the last save before compacting from the realtime loop
+#endif
+
+#define JOURNAL_MAGIC 0x314E524A        // "JRN1"
+#define JOURNAL_SIZE  FLASH_SECTOR_SIZE
+#define JOURNAL_IMAGE 0x0001
+
+typedef struct {
+    uint32_t magic;
+    uint16_t key;
+    uint16_t offset;                    // in the settings image, FLASH_KV_NVS only
+    uint16_t len;                       // data bytes following the header
+    uint16_t flags;                     // JOURNAL_IMAGE: the complete settings image
+    uint32_t crc;                       // of the header with crc = 0 and the data
+    uint32_t pad[4];
+} journal_hdr_t;
+
+_Static_assert(sizeof(journal_hdr_t) == FLASH_WRITE_SIZE, "journal_hdr_t must be one flash word");
+
+typedef struct {
+    bool valid;
+    uint16_t len;
+    uint8_t data[FLASH_KV_SIZE];
+} journal_kv_t;
+
+typedef struct {
+    bool scanned;
+    bool image_valid;
+    uint16_t image_size;
+    uint32_t end;                       // offset of the first free flash word
+    uint32_t last_save_ms;
+    journal_kv_t kv[FLASH_KV_KEYS];
+    uint8_t image[FLASH_JOURNAL_IMAGE_SIZE];
+} journal_t;
+
+static journal_t journal = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static uint32_t journal_record_crc (const journal_hdr_t *hdr, const void *data)
+{
+    journal_hdr_t h = *hdr;
+
+    h.crc = 0;
+
+    return crc32_update(crc32_calc(&h, sizeof(h)), data, hdr->len);
+}
+
+static void journal_scan (void)
+{
+    const uint8_t *base = flash_emul_base();
+
+    journal.scanned = true;
+    journal.end = 0;
+
+    while(journal.end + sizeof(journal_hdr_t) <= JOURNAL_SIZE) {
+
+        const journal_hdr_t *hdr = (const journal_hdr_t *)(base + journal.end);
+        const uint8_t *data = (const uint8_t *)(hdr + 1);
+
+        if(hdr->magic == 0xFFFFFFFF)
+            return; // erased, end of journal
+
+        if(hdr->magic != JOURNAL_MAGIC || journal.end + sizeof(journal_hdr_t) + hdr->len > JOURNAL_SIZE ||
+            hdr->crc != journal_record_crc(hdr, data))
+            break;
+
+        if(hdr->key == FLASH_KV_NVS) {
+            if(hdr->offset + hdr->len <= FLASH_JOURNAL_IMAGE_SIZE) {
+                memcpy(&journal.image[hdr->offset], data, hdr->len);
+                if(hdr->flags & JOURNAL_IMAGE) {
+                    journal.image_size = hdr->len;  // starts every compacted journal
+                    journal.image_valid = true;
+                }
+            }
+        } else if(hdr->key < FLASH_KV_KEYS && hdr->len <= FLASH_KV_SIZE) {
+            journal.kv[hdr->key].valid = true;
+            journal.kv[hdr->key].len = hdr->len;
+            memcpy(journal.kv[hdr->key].data, data, hdr->len);
+        }
+
+        journal.end += sizeof(journal_hdr_t) + align_up(hdr->len, FLASH_WRITE_SIZE);
+    }
+
+    journal.end = JOURNAL_SIZE; // not erased or corrupt, compact on next save
+}
+
+static bool journal_write (uint16_t key, uint16_t offset, const void *data, uint16_t len, uint16_t flags)
+{
+    journal_hdr_t hdr = {
+        .magic = JOURNAL_MAGIC,
+        .key = key,
+        .offset = offset,
+        .len = len,
+        .flags = flags
+    };
+
+    hdr.crc = journal_record_crc(&hdr, data);
+
+    if(!(flash_emul_program(journal.end, &hdr, sizeof(hdr)) &&
+          flash_emul_program(journal.end + sizeof(hdr), data, len))) {
+        journal.end = JOURNAL_SIZE;
+        return false;
+    }
+
+    journal.end += sizeof(hdr) + align_up(len, FLASH_WRITE_SIZE);
+
+    return true;
+}
+
+static inline bool journal_fits (uint16_t len)
+{
+    return journal.end + sizeof(journal_hdr_t) + align_up(len, FLASH_WRITE_SIZE) <= JOURNAL_SIZE;
+}
+
+// Rewrites the sector with the current image and key values.
+static bool journal_compact (void)
+{
+    bool ok;
+
+    journal.end = JOURNAL_SIZE;
+
+    if((ok = flash_emul_erase())) {
+        journal.end = 0;
+        if(journal.image_valid)
+            ok = journal_write(FLASH_KV_NVS, 0, journal.image, journal.image_size, JOURNAL_IMAGE);
+        for(uint_fast16_t key = FLASH_KV_NVS + 1; ok && key < FLASH_KV_KEYS; key++) {
+            if(journal.kv[key].valid)
+                ok = journal_write(key, 0, journal.kv[key].data, journal.kv[key].len, 0);
+        }
+    }
+
+    return ok;
+}
+
+static void journal_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(journal.end > JOURNAL_SIZE / 100 * FLASH_JOURNAL_COMPACT_PCT && state == STATE_IDLE &&
+        hal.get_elapsed_ticks() - journal.last_save_ms >= FLASH_JOURNAL_IDLE_MS) {
+        journal.last_save_ms = hal.get_elapsed_ticks();
+        journal_compact();
+    }
+}
+
+bool memcpy_from_flash (uint8_t *dest)
+{
+    if(!journal.scanned)
+        journal_scan();
+
+    if(!journal.image_valid || journal.image_size != hal.nvs.size)
+        return false;
+
+    memcpy(dest, journal.image, hal.nvs.size);
+
+    return true;
+}
+
+static inline bool chunk_changed (const uint8_t *source, uint32_t chunk, uint32_t size)
+{
+    return chunk < size && memcmp(&journal.image[chunk], &source[chunk], min(FLASH_WRITE_SIZE, size - chunk));
+}
+
+bool memcpy_to_flash (uint8_t *source)
+{
+    uint32_t size = hal.nvs.size, chunk, run;
+    bool ok = true;
+
+    if(size > FLASH_JOURNAL_IMAGE_SIZE)
+        return false;
+
+    if(!journal.scanned)
+        journal_scan();
+
+    journal.last_save_ms = hal.get_elapsed_ticks();
+
+    if(!journal.image_valid || journal.image_size != size) {
+        memcpy(journal.image, source, size);
+        journal.image_size = size;
+        journal.image_valid = true;
+        return journal_compact();
+    }
+
+    // Append runs of changed chunks, an unchanged chunk between two changed ones is included
+    // as a separate record would cost a header chunk anyway.
+    for(chunk = 0; ok && chunk < size; chunk += FLASH_WRITE_SIZE) {
+
+        if(!chunk_changed(source, chunk, size))
+            continue;
+
+        run = chunk;
+        while((chunk += FLASH_WRITE_SIZE) < size) {
+            if(!chunk_changed(source, chunk, size) && !chunk_changed(source, chunk + FLASH_WRITE_SIZE, size))
+                break;
+        }
+        chunk = min(chunk, size);
+
+        memcpy(&journal.image[run], &source[run], chunk - run);
+
+        if(!journal_fits(chunk - run)) {
+            memcpy(journal.image, source, size);    // compaction writes the whole image
+            return journal_compact();
+        }
+
+        ok = journal_write(FLASH_KV_NVS, run, &journal.image[run], chunk - run, 0);
+    }
+
+    return ok;
+}
+
+bool flash_kv_read (uint16_t key, void *data, uint16_t len)
+{
+    if(!journal.scanned)
+        journal_scan();
+
+    if(key == FLASH_KV_NVS || key >= FLASH_KV_KEYS || !journal.kv[key].valid || journal.kv[key].len != len)
+        return false;
+
+    memcpy(data, journal.kv[key].data, len);
+
+    return true;
+}
+
+bool flash_kv_write (uint16_t key, const void *data, uint16_t len)
+{
+    if(key == FLASH_KV_NVS || key >= FLASH_KV_KEYS || len > FLASH_KV_SIZE)
+        return false;
+
+    if(!journal.scanned)
+        journal_scan();
+
+    journal.kv[key].valid = true;
+    journal.kv[key].len = len;
+    memcpy(journal.kv[key].data, data, len);
+
+    return journal_fits(len) ? journal_write(key, 0, data, len, 0) : journal_compact();
+}
+
+void flash_journal_init (void)
+{
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = journal_execute_realtime;
+}
+
+#elif FLASH_ENABLE
+
+bool memcpy_from_flash (uint8_t *dest)
+{
+    memcpy(dest, &_EEPROM_Emul_Start, hal.nvs.size);
+
+    return true;
+}
+
+bool memcpy_to_flash (uint8_t *source)
+{
+    // The STM32H7xx HAL_FLASH_Program implementation differs to other STM32 families.
+    //
+    // Writes are either 16 or 32 bytes long (dependent on processor model), instead of the byte,
+    // halfword, word or double word writes in other processor families. Erase operations are
+    // performed on 128-Kbyte sectors.
+    //
+    // Rather than using two sectors for boot & eeprom emulation, have chosen to store the NVS data
+    // at the end of the user accessible flash (in the last 128KB sector).
+	//
+	// Note that devices may have either one or two banks of flash memory, depending on flash size.
+
+    if (!memcmp(source, &_EEPROM_Emul_Start, hal.nvs.size))
+        return true;
+
+    return flash_emul_erase() && flash_emul_program(0, source, (uint32_t)hal.nvs.size);
+}
+
 #endif
 
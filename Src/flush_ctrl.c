@@ -0,0 +1,392 @@
+/*
+  flush_ctrl.c - closed-loop dielectric flush pressure control
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  PI loop holding the flushing pressure at a setpoint. The pressure sensor is read from the
+  continuous ADC scan (aux analog input FLUSH_CTRL_SENSOR_PORT, no conversion wait) and low-pass
+  filtered, the pump is driven in percent through the analog aux output FLUSH_CTRL_PWM_PORT or by
+  writing the speed reference register of a Modbus drive. The loop runs every FLUSH_CTRL_PERIOD_MS
+  as a scheduled realtime task (or from the realtime loop without RT_SCHED_ENABLE).
+
+  The integrator starts at the minimum output and is held while the output is saturated. On a
+  sensor fault (reading outside the sensor range, e.g. a broken 4-20 mA loop) the last output is
+  held. A warning is issued when the pressure stays FLUSH_CTRL_LOW_BAR below the setpoint for
+  FLUSH_CTRL_LOW_MS, e.g. on a blocked or leaking nozzle. A reset stops the pump.
+
+  M571 P<bar>             - pressure setpoint, P0 stops the pump. In program order.
+  $FLUSH                  - report: [FLUSH|set=,p=,out=,kp=,ki=,fault=0|1,low=0|1]
+  $FLUSH=<kp>[,<ki>]      - set the gains, kp in %/bar, ki in %/(bar*s)
+*/
+
+#include "driver.h"
+
+#if FLUSH_CTRL_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+#include "grbl/system.h"
+#include "grbl/ioports.h"
+
+#include "flush_ctrl.h"
+#include "rt_sched.h"
+#ifdef FLUSH_CTRL_MODBUS_ADDRESS
+#include "modbus_dma.h"
+#endif
+
+#ifndef FLUSH_CTRL_PERIOD_MS
+#define FLUSH_CTRL_PERIOD_MS    20
+#endif
+// Sensor scaling in 12 bit ADC counts, defaults for a 4-20 mA transmitter over 150 ohm (0.6 - 3.0 V).
+#ifndef FLUSH_CTRL_RAW_ZERO
+#define FLUSH_CTRL_RAW_ZERO     745
+#endif
+#ifndef FLUSH_CTRL_RAW_FULL
+#define FLUSH_CTRL_RAW_FULL     3723
+#endif
+#ifndef FLUSH_CTRL_FULL_SCALE
+#define FLUSH_CTRL_FULL_SCALE   6.0f    // bar at FLUSH_CTRL_RAW_FULL
+#endif
+#ifndef FLUSH_CTRL_FILTER_MS
+#define FLUSH_CTRL_FILTER_MS    100     // pressure low-pass time constant
+#endif
+#ifndef FLUSH_CTRL_KP
+#define FLUSH_CTRL_KP           10.0f   // %/bar
+#endif
+#ifndef FLUSH_CTRL_KI
+#define FLUSH_CTRL_KI           20.0f   // %/(bar*s)
+#endif
+#ifndef FLUSH_CTRL_OUT_MIN
+#define FLUSH_CTRL_OUT_MIN      20.0f   // %, while running
+#endif
+#ifndef FLUSH_CTRL_OUT_MAX
+#define FLUSH_CTRL_OUT_MAX      100.0f
+#endif
+#ifndef FLUSH_CTRL_LOW_BAR
+#define FLUSH_CTRL_LOW_BAR      0.3f
+#endif
+#ifndef FLUSH_CTRL_LOW_MS
+#define FLUSH_CTRL_LOW_MS       3000
+#endif
+#ifndef FLUSH_CTRL_MCODE
+#define FLUSH_CTRL_MCODE        571
+#endif
+#ifdef FLUSH_CTRL_MODBUS_ADDRESS
+#ifndef FLUSH_CTRL_MODBUS_REG
+#define FLUSH_CTRL_MODBUS_REG   1       // speed reference
+#endif
+#ifndef FLUSH_CTRL_MODBUS_FULL
+#define FLUSH_CTRL_MODBUS_FULL  5000    // register value at 100%, e.g. 50.00 Hz
+#endif
+#endif
+
+// Readings this far outside the zero - full range are sensor faults.
+#define RAW_MARGIN ((FLUSH_CTRL_RAW_FULL - FLUSH_CTRL_RAW_ZERO) / 16)
+
+typedef struct {
+    volatile float setpoint;
+    float pressure;
+    float integrator;
+    float out;
+    float kp;
+    float ki;
+    bool running;
+    bool fault;
+    bool low;
+    uint32_t low_ms;
+    uint32_t sample_us;
+#ifdef FLUSH_CTRL_MODBUS_ADDRESS
+    int32_t written;            // last register value queued, -1: none
+#endif
+} flush_ctrl_t;
+
+static flush_ctrl_t ctrl = {
+    .kp = FLUSH_CTRL_KP,
+    .ki = FLUSH_CTRL_KI,
+    .pressure = -1.0f
+};
+static uint8_t sensor_port = FLUSH_CTRL_SENSOR_PORT;
+#ifdef FLUSH_CTRL_PWM_PORT
+static uint8_t pwm_port = FLUSH_CTRL_PWM_PORT;
+#endif
+static on_reset_ptr on_reset;
+static user_mcode_ptrs_t other_mcode_ptrs;
+#if !RT_SCHED_ENABLE
+static on_execute_realtime_ptr on_execute_realtime;
+static uint32_t run_ms;
+#endif
+
+#ifdef FLUSH_CTRL_MODBUS_ADDRESS
+
+static void pump_written (const modbus_dma_result_t *result, void *context)
+{
+    if(result->status != ModbusDMA_OK)
+        ctrl.written = -1;      // resend
+}
+
+#endif
+
+static void pump_out (float pct)
+{
+#ifdef FLUSH_CTRL_PWM_PORT
+    if(pct != ctrl.out)
+        hal.port.analog_out(pwm_port, pct);
+#else
+    int32_t value = lroundf(pct * (float)FLUSH_CTRL_MODBUS_FULL / 100.0f);
+
+    // Only one write in flight, the loop runs faster than the bus.
+    if(value != ctrl.written && !modbus_dma_pending() &&
+        modbus_dma_write(FLUSH_CTRL_MODBUS_ADDRESS, FLUSH_CTRL_MODBUS_REG, (uint16_t)value, pump_written, NULL))
+        ctrl.written = value;
+#endif
+
+    ctrl.out = pct;
+}
+
+static void flush_ctrl_run (void)
+{
+    uint32_t now_us = hal.get_micros();
+    float dt = (float)(now_us - ctrl.sample_us) * 1e-6f, setpoint = ctrl.setpoint, error, out, integrator;
+    int32_t raw = hal.port.wait_on_input(Port_Analog, sensor_port, WaitMode_Immediate, 0.0f);
+
+    ctrl.sample_us = now_us;
+
+    if(dt > FLUSH_CTRL_PERIOD_MS * 5e-3f)
+        dt = FLUSH_CTRL_PERIOD_MS * 1e-3f;
+
+    if(raw < FLUSH_CTRL_RAW_ZERO - RAW_MARGIN || raw > FLUSH_CTRL_RAW_FULL + RAW_MARGIN) {
+        if(!ctrl.fault) {
+            ctrl.fault = true;
+            ctrl.pressure = -1.0f;
+            if(setpoint > 0.0f)
+                report_message("Flush: pressure sensor fault, pump output held", Message_Warning);
+        }
+    } else {
+        float p = (float)(raw - FLUSH_CTRL_RAW_ZERO) * FLUSH_CTRL_FULL_SCALE / (float)(FLUSH_CTRL_RAW_FULL - FLUSH_CTRL_RAW_ZERO);
+        if(ctrl.fault || ctrl.pressure < 0.0f)
+            ctrl.pressure = p;
+        else
+            ctrl.pressure += (p - ctrl.pressure) * dt / ((float)FLUSH_CTRL_FILTER_MS * 1e-3f + dt);
+        ctrl.fault = false;
+    }
+
+    if(setpoint <= 0.0f) {
+        ctrl.running = ctrl.low = false;
+        pump_out(0.0f);
+        return;
+    }
+
+    if(!ctrl.running) {
+        ctrl.running = true;
+        ctrl.integrator = FLUSH_CTRL_OUT_MIN;
+        ctrl.low = false;
+        ctrl.low_ms = hal.get_elapsed_ticks();
+    }
+
+    if(ctrl.fault) {
+        pump_out(ctrl.out < FLUSH_CTRL_OUT_MIN ? FLUSH_CTRL_OUT_MIN : ctrl.out);
+        return;
+    }
+
+    error = setpoint - ctrl.pressure;
+    integrator = ctrl.integrator + ctrl.ki * error * dt;
+    out = ctrl.kp * error + integrator;
+
+    // Conditional integration: the integrator is not wound further into a saturated output.
+    if(out > FLUSH_CTRL_OUT_MAX) {
+        out = FLUSH_CTRL_OUT_MAX;
+        if(error < 0.0f)
+            ctrl.integrator = integrator;
+    } else if(out < FLUSH_CTRL_OUT_MIN) {
+        out = FLUSH_CTRL_OUT_MIN;
+        if(error > 0.0f)
+            ctrl.integrator = integrator;
+    } else
+        ctrl.integrator = integrator;
+
+    pump_out(out);
+
+    if(error < FLUSH_CTRL_LOW_BAR)
+        ctrl.low_ms = hal.get_elapsed_ticks();
+    else if(!ctrl.low && hal.get_elapsed_ticks() - ctrl.low_ms >= FLUSH_CTRL_LOW_MS) {
+        ctrl.low = true;
+        report_message("Flush: pressure below setpoint", Message_Warning);
+    }
+}
+
+#if RT_SCHED_ENABLE
+
+static void flush_ctrl_task (void *context)
+{
+    flush_ctrl_run();
+}
+
+#else
+
+static void flush_ctrl_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(hal.get_elapsed_ticks() - run_ms >= FLUSH_CTRL_PERIOD_MS) {
+        run_ms = hal.get_elapsed_ticks();
+        flush_ctrl_run();
+    }
+}
+
+#endif
+
+void flush_ctrl_set (float setpoint)
+{
+    ctrl.setpoint = setpoint < 0.0f ? 0.0f : (setpoint > FLUSH_CTRL_FULL_SCALE ? FLUSH_CTRL_FULL_SCALE : setpoint);
+}
+
+float flush_ctrl_pressure (void)
+{
+    return ctrl.fault ? -1.0f : ctrl.pressure;
+}
+
+// May be called from interrupt context, the pump is stopped by the next loop run.
+static void flush_ctrl_reset (void)
+{
+    ctrl.setpoint = 0.0f;
+
+    if(on_reset)
+        on_reset();
+}
+
+static user_mcode_type_t mcode_check (user_mcode_t mcode)
+{
+    return mcode == FLUSH_CTRL_MCODE
+            ? UserMCode_Normal
+            : (other_mcode_ptrs.check ? other_mcode_ptrs.check(mcode) : UserMCode_Unsupported);
+}
+
+static status_code_t mcode_validate (parser_block_t *gc_block)
+{
+    if(gc_block->user_mcode != FLUSH_CTRL_MCODE)
+        return other_mcode_ptrs.validate ? other_mcode_ptrs.validate(gc_block) : Status_Unhandled;
+
+    if(!gc_block->words.p)
+        return Status_GcodeValueWordMissing;
+
+    if(gc_block->values.p < 0.0f || gc_block->values.p > FLUSH_CTRL_FULL_SCALE)
+        return Status_GcodeValueOutOfRange;
+
+    gc_block->words.p = Off;
+    gc_block->user_mcode_sync = true;
+
+    return Status_OK;
+}
+
+static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
+{
+    if(gc_block->user_mcode != FLUSH_CTRL_MCODE) {
+        if(other_mcode_ptrs.execute)
+            other_mcode_ptrs.execute(state, gc_block);
+        return;
+    }
+
+    if(state != STATE_CHECK_MODE)
+        flush_ctrl_set(gc_block->values.p);
+}
+
+static status_code_t flush_command (sys_state_t state, char *args)
+{
+    char buf[100], *end;
+
+    if(args) {
+        float kp = strtof(args, &end), ki = ctrl.ki;
+
+        if(end == args || kp < 0.0f)
+            return Status_BadNumberFormat;
+        if(*end == ',') {
+            args = end + 1;
+            ki = strtof(args, &end);
+            if(end == args || ki < 0.0f)
+                return Status_BadNumberFormat;
+        }
+        if(*end != '\0')
+            return Status_InvalidStatement;
+
+        ctrl.kp = kp;
+        ctrl.ki = ki;
+    }
+
+    snprintf(buf, sizeof(buf), "[FLUSH|set=%.2f,p=%.2f,out=%.1f,kp=%.2f,ki=%.2f,fault=%d,low=%d]" ASCII_EOL,
+              ctrl.setpoint, flush_ctrl_pressure(), ctrl.out, ctrl.kp, ctrl.ki, ctrl.fault, ctrl.low);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void flush_ctrl_init (void)
+{
+    static const sys_command_t flush_command_list[] = {
+        {"FLUSH", flush_command, {}, { .str = "report flush pressure control, $FLUSH=<kp>[,<ki>] to set the gains" } }
+    };
+
+    static sys_commands_t flush_commands = {
+        .n_commands = sizeof(flush_command_list) / sizeof(sys_command_t),
+        .commands = flush_command_list
+    };
+
+    if(!ioport_claim(Port_Analog, Port_Input, &sensor_port, "Flush pressure"))
+        return;
+
+#ifdef FLUSH_CTRL_PWM_PORT
+    if(!ioport_claim(Port_Analog, Port_Output, &pwm_port, "Flush pump"))
+        return;
+    hal.port.analog_out(pwm_port, 0.0f);
+#else
+    ctrl.written = -1;
+#endif
+
+    ctrl.sample_us = hal.get_micros();
+
+#if RT_SCHED_ENABLE
+    static rt_task_t flush_task = {
+        .name = "flush",
+        .fn = flush_ctrl_task,
+        .period_us = FLUSH_CTRL_PERIOD_MS * 1000,
+        .budget_us = 20,
+        .priority = 50
+    };
+
+    rt_task_register(&flush_task);
+#else
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = flush_ctrl_execute_realtime;
+#endif
+
+    on_reset = grbl.on_reset;
+    grbl.on_reset = flush_ctrl_reset;
+
+    memcpy(&other_mcode_ptrs, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+    grbl.user_mcode.check = mcode_check;
+    grbl.user_mcode.validate = mcode_validate;
+    grbl.user_mcode.execute = mcode_execute;
+
+    system_register_commands(&flush_commands);
+}
+
+#endif // FLUSH_CTRL_ENABLE
@@ -0,0 +1,151 @@
+/*
+  fs_index.c - line index with modal state checkpoints for resuming file runs
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  While a file runs every FS_INDEX_LINES lines the file offset of the next line and the parser
+  modal state at that point are stored. The line is captured when its first character is read,
+  the parser has then executed all lines before it. When the FS_INDEX_SIZE checkpoints are used
+  up every other one is dropped and the interval doubled, so any file length is covered with
+  the resolution decreasing as needed.
+
+  A resume seeks to the last checkpoint before the requested line and first feeds a block that
+  restores plane, units, distance mode, feed rate mode, work coordinate system, G0/G1 motion
+  mode and feed rate. Spindle, coolant, tool and EDM pulser state are not restored, nor is the
+  tool moved: the first move of the resumed section starts from where the machine is.
+
+  The index is kept in RAM for the last indexed file, identified by name and size, and is
+  extended by resumed runs.
+*/
+
+#include "driver.h"
+
+#if FS_INDEX_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/gcode.h"
+
+#include "fs_index.h"
+
+#ifndef FS_INDEX_LINES
+#define FS_INDEX_LINES 1000     // initial checkpoint interval
+#endif
+#ifndef FS_INDEX_SIZE
+#define FS_INDEX_SIZE 256
+#endif
+
+typedef struct {
+    char name[32];
+    uint32_t size;
+    uint32_t every;
+    uint_fast16_t n;
+    fs_checkpoint_t cp[FS_INDEX_SIZE];
+} fs_index_t;
+
+static fs_index_t idx = { .every = FS_INDEX_LINES };
+
+// Keeps the checkpoints on multiples of the doubled interval.
+static void index_decimate (void)
+{
+    uint_fast16_t i, n = 0;
+
+    idx.every *= 2;
+
+    for(i = 0; i < idx.n; i++) {
+        if(idx.cp[i].line % idx.every == 0)
+            memcpy(&idx.cp[n++], &idx.cp[i], sizeof(fs_checkpoint_t));
+    }
+
+    idx.n = n;
+}
+
+void fs_index_start (const char *name, uint32_t size)
+{
+    if(strncmp(idx.name, name, sizeof(idx.name) - 1) || idx.size != size) {
+        strncpy(idx.name, name, sizeof(idx.name) - 1);
+        idx.name[sizeof(idx.name) - 1] = '\0';
+        idx.size = size;
+        idx.every = FS_INDEX_LINES;
+        idx.n = 0;
+    }
+}
+
+void fs_index_line (uint32_t line, uint32_t offset)
+{
+    fs_checkpoint_t *cp;
+
+    if(line == 0 || line % idx.every || (idx.n && idx.cp[idx.n - 1].line >= line))
+        return;
+
+    if(idx.n == FS_INDEX_SIZE) {
+        index_decimate();
+        if(line % idx.every)
+            return;
+    }
+
+    cp = &idx.cp[idx.n++];
+    cp->line = line;
+    cp->offset = offset;
+    cp->feed_rate = gc_state.feed_rate;
+    cp->motion = gc_state.modal.motion == MotionMode_Seek ? 0 : (gc_state.modal.motion == MotionMode_Linear ? 1 : 80);
+    cp->plane = gc_state.modal.plane_select;
+    cp->coord = gc_state.modal.coord_system.id;
+    cp->feed_mode = gc_state.modal.feed_mode;
+    cp->imperial = gc_state.modal.units_imperial;
+    cp->incremental = gc_state.modal.distance_incremental;
+}
+
+const fs_checkpoint_t *fs_index_find (const char *name, uint32_t line)
+{
+    uint_fast16_t i = idx.n;
+
+    if(strncmp(idx.name, name, sizeof(idx.name) - 1))
+        return NULL;
+
+    while(i && idx.cp[i - 1].line >= line)
+        i--;
+
+    return i ? &idx.cp[i - 1] : NULL;
+}
+
+void fs_index_preamble (const fs_checkpoint_t *cp, char *buf, size_t size)
+{
+    static const char *const coord[] = { "54", "55", "56", "57", "58", "59", "59.1", "59.2", "59.3" };
+
+    int len = snprintf(buf, size, "G%d G%d G%d G%d G%s",
+                        17 + cp->plane, cp->imperial ? 20 : 21, cp->incremental ? 91 : 90,
+                         cp->feed_mode == FeedMode_InverseTime ? 93 : (cp->feed_mode == FeedMode_UnitsPerRev ? 95 : 94),
+                          cp->coord < sizeof(coord) / sizeof(coord[0]) ? coord[cp->coord] : coord[0]);
+
+    if(len > 0 && (size_t)len < size && cp->feed_mode != FeedMode_InverseTime)
+        len += snprintf(buf + len, size - len, " F%.4f", cp->imperial ? cp->feed_rate / MM_PER_INCH : cp->feed_rate);
+
+    if(len > 0 && (size_t)len < size)
+        snprintf(buf + len, size - len, " G%d\n", cp->motion);
+}
+
+uint_fast16_t fs_index_count (uint32_t *every)
+{
+    *every = idx.every;
+
+    return idx.n;
+}
+
+#endif // FS_INDEX_ENABLE
@@ -0,0 +1,237 @@
+/*
+  fw_update.c - A/B firmware update into the inactive flash bank
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The STM32H743 maps the bank it boots from at FLASH_BANK1_BASE and the other one at
+  FLASH_BANK2_BASE, the SWAP_BANK option bit selects the boot bank. Both banks hold the same
+  layout, as linked with STM32H743ZITX_FLASH_AB.ld: up to 896K firmware followed by the 128K
+  EEPROM emulation sector.
+
+  $FWUPDATE=<size>,<crc> receives an image (the .bin file) with the $UPLOAD block protocol over
+  the stream the command came from, USB, UART or Telnet, and programs it into the inactive bank,
+  erasing each sector as it is reached. The flash contents are then read back and checked
+  against <crc> (CRC-32 of the image, as zlib) and the vector table is checked for a plausible
+  stack pointer and reset address. The running firmware is not affected until the swap.
+
+  $FW - report: [FW|bank=<boot bank 1|2>,staged=<0|1>,other=<valid 0|1>,max=<image size limit>]
+  $FW=S - copy the settings (EEPROM emulation sector) to the inactive bank, toggle SWAP_BANK
+          and reset into the other image. Also used to roll back to the previous image, which
+          is kept in the inactive bank after an update.
+
+  Erasing the inactive bank does not stall code fetch from the active one.
+*/
+
+#include "driver.h"
+
+#if FW_UPDATE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+#include "grbl/state_machine.h"
+
+#include "crc32.h"
+#include "flash.h"
+#include "fw_update.h"
+
+#define FW_IMAGE_MAX    (FLASH_BANK_SIZE - FLASH_SECTOR_SIZE)
+#define FW_INACTIVE     FLASH_BANK2_BASE
+
+typedef struct {
+    bool active;
+    bool staged;
+    uint32_t size;
+    uint32_t address;               // next flash word to program
+    uint32_t erased;                // end of the erased area
+    uint16_t pending;               // bytes in word
+    uint8_t word[FLASH_WRITE_SIZE] __ALIGNED(4);
+} fw_update_t;
+
+static fw_update_t fw = {0};
+
+static bool layout_ok (void)
+{
+    return (uint32_t)flash_emul_base() == FLASH_BANK1_BASE + FW_IMAGE_MAX;
+}
+
+static bool boot_bank2 (void)
+{
+    return !!(FLASH->OPTSR_CUR & FLASH_OPTSR_SWAP_BANK_OPT);
+}
+
+// Initial stack pointer in RAM, reset handler in the image area as mapped after the swap.
+static bool image_valid (void)
+{
+    const uint32_t *vectors = (const uint32_t *)FW_INACTIVE;
+
+    return vectors[0] >= D1_DTCMRAM_BASE && vectors[0] <= D1_AXISRAM_BASE + 0x80000 &&
+            vectors[1] > FLASH_BANK1_BASE && vectors[1] < FLASH_BANK1_BASE + FW_IMAGE_MAX;
+}
+
+static bool program_word (void)
+{
+    bool ok = true;
+
+    if(fw.address >= fw.erased) {
+        ok = flash_sector_erase(fw.erased);
+        fw.erased += FLASH_SECTOR_SIZE;
+    }
+
+    if(ok && (ok = flash_program(fw.address, fw.word, fw.pending)))
+        fw.address += FLASH_WRITE_SIZE;
+
+    fw.pending = 0;
+
+    return ok;
+}
+
+bool fw_update_begin (uint32_t size)
+{
+    if(fw.active || size < 8 || size > FW_IMAGE_MAX || !layout_ok())
+        return false;
+
+    fw.active = true;
+    fw.staged = false;
+    fw.size = size;
+    fw.address = fw.erased = FW_INACTIVE;
+    fw.pending = 0;
+
+    return true;
+}
+
+bool fw_update_write (const void *data, uint32_t len)
+{
+    const uint8_t *src = data;
+    uint32_t n;
+
+    while(len) {
+        n = min(len, FLASH_WRITE_SIZE - fw.pending);
+        memcpy(&fw.word[fw.pending], src, n);
+        fw.pending += n;
+        src += n;
+        len -= n;
+        if(fw.pending == FLASH_WRITE_SIZE && !program_word()) {
+            fw.active = false;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+const char *fw_update_end (bool ok, uint32_t crc)
+{
+    if(!fw.active)
+        return "FW: not active";
+
+    fw.active = false;
+
+    if(!ok)
+        return NULL;
+
+    if(fw.pending && !program_word())
+        return "FW: flash write failed";
+
+    if(crc32_calc((const void *)FW_INACTIVE, fw.size) != crc)
+        return "FW: verify failed";
+
+    if(!image_valid())
+        return "FW: not a firmware image";
+
+    fw.staged = true;
+
+    return NULL;
+}
+
+static bool swap_banks (void)
+{
+    bool ok;
+    FLASH_OBProgramInitTypeDef ob = {
+        .OptionType = OPTIONBYTE_USER,
+        .USERType = OB_USER_SWAP_BANK,
+        .USERConfig = boot_bank2() ? OB_SWAP_BANK_DISABLE : OB_SWAP_BANK_ENABLE
+    };
+
+    // The other image is started with the current settings.
+    if(!(flash_sector_erase((uint32_t)flash_emul_base() + FLASH_BANK_SIZE) &&
+          flash_program((uint32_t)flash_emul_base() + FLASH_BANK_SIZE, flash_emul_base(), FLASH_SECTOR_SIZE)))
+        return false;
+
+    HAL_FLASH_Unlock();
+    HAL_FLASH_OB_Unlock();
+
+    ok = HAL_FLASHEx_OBProgram(&ob) == HAL_OK && HAL_FLASH_OB_Launch() == HAL_OK;
+
+    HAL_FLASH_OB_Lock();
+    HAL_FLASH_Lock();
+
+    return ok;
+}
+
+static status_code_t fw_command (sys_state_t state, char *args)
+{
+    char buf[64];
+
+    if(args == NULL) {
+        snprintf(buf, sizeof(buf), "[FW|bank=%u,staged=%u,other=%u,max=%lu]" ASCII_EOL,
+                  boot_bank2() ? 2 : 1, fw.staged, layout_ok() && image_valid(), (uint32_t)FW_IMAGE_MAX);
+        hal.stream.write(buf);
+        return Status_OK;
+    }
+
+    if(strcmp(args, "S"))
+        return Status_InvalidStatement;
+
+    if(state_get() != STATE_IDLE)
+        return Status_IdleError;
+
+    if(fw.active || !layout_ok() || !image_valid())
+        return Status_InvalidStatement;
+
+    if(!swap_banks()) {
+        report_message("FW: settings copy or option byte programming failed", Message_Warning);
+        return Status_InvalidStatement;
+    }
+
+    report_message("Starting firmware from the other bank", Message_Warning);
+    hal.delay_ms(100, NULL);
+
+    NVIC_SystemReset();
+
+    return Status_OK;
+}
+
+void fw_update_init (void)
+{
+    static const sys_command_t fw_command_list[] = {
+        {"FW", fw_command, { .allow_blocking = On }, { .str = "report firmware banks, $FW=S to swap and restart" } }
+    };
+
+    static sys_commands_t fw_commands = {
+        .n_commands = sizeof(fw_command_list) / sizeof(sys_command_t),
+        .commands = fw_command_list
+    };
+
+    system_register_commands(&fw_commands);
+}
+
+#endif // FW_UPDATE_ENABLE
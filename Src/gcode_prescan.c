@@ -0,0 +1,275 @@
+/*
+  gcode_prescan.c - input line pre-scan ahead of the parser
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The read function of a serial or Telnet input stream is wrapped. Characters are moved from the
+  stream input buffer into a GCODE_PRESCAN_SIZE ring from the realtime loop, which the core also
+  runs while it waits for planner space, and from read() when the ring has no complete line.
+  G-code lines are compacted on the way: whitespace and ; comments are removed, ( ) comments are
+  kept as the core handles messages in them. $ and [ lines are passed unchanged. Line ends are
+  passed one for one, hosts counting ok responses are not affected.
+
+  read() only returns complete lines so the parser gets a line in one pass of short reads without
+  waiting on the stream. A line longer than the ring is passed on as it is scanned.
+
+  The core parses text blocks, so numeric words are left for it to convert; the gain is the
+  scanning done while the core is otherwise waiting and the shorter lines it then reads.
+
+  Input suspended by the core (tool change) is read directly from the stream, the ring is
+  served again once input is resumed as its content precedes what is left in the stream.
+
+  $PRESCAN - report counters:
+
+    [PRESCAN|lines=,stripped=,size=,used=]
+*/
+
+#include "driver.h"
+
+#if GCODE_PRESCAN_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "gcode_prescan.h"
+
+#ifndef GCODE_PRESCAN_SIZE
+#define GCODE_PRESCAN_SIZE 1024
+#endif
+
+#if GCODE_PRESCAN_SIZE & (GCODE_PRESCAN_SIZE - 1)
+#error "GCODE_PRESCAN_SIZE must be a power of 2!"
+#endif
+
+#define PRESCAN_NEXT(i) (((i) + 1) & (GCODE_PRESCAN_SIZE - 1))
+
+typedef enum {
+    Scan_LineStart = 0,
+    Scan_GCode,
+    Scan_Comment,       // ( ), kept
+    Scan_EolComment,    // ;, removed
+    Scan_Verbatim       // $ and [ lines
+} scan_mode_t;
+
+typedef struct {
+    char data[GCODE_PRESCAN_SIZE];
+    uint16_t head;
+    uint16_t tail;
+    uint16_t released;  // end of the last complete line, read() serves up to here
+    scan_mode_t mode;
+    bool hooked;
+    bool held;          // input suspended, reads bypass the ring
+    uint32_t lines;
+    uint32_t stripped;
+} prescan_t;
+
+static prescan_t scan = {0};
+static stream_read_ptr stream_read;
+static stream_reset_read_buffer_ptr stream_reset_read;
+static stream_cancel_read_buffer_ptr stream_cancel_read;
+static stream_suspend_read_ptr stream_suspend_read;
+static on_stream_changed_ptr on_stream_changed;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static inline void prescan_put (char c)
+{
+    scan.data[scan.head] = c;
+    scan.head = PRESCAN_NEXT(scan.head);
+}
+
+static void prescan_fill (void)
+{
+    int16_t c;
+
+    while(PRESCAN_NEXT(scan.head) != scan.tail && (c = stream_read()) != SERIAL_NO_DATA) {
+
+        if(c == '\n' || c == '\r') {
+            prescan_put((char)c);
+            scan.released = scan.head;
+            scan.mode = Scan_LineStart;
+            scan.lines++;
+            continue;
+        }
+
+        switch(scan.mode) {
+
+            case Scan_LineStart:
+                if(c == ' ' || c == '\t') {
+                    scan.stripped++;
+                    break;
+                }
+                if(c == '$' || c == '[') {
+                    scan.mode = Scan_Verbatim;
+                    prescan_put((char)c);
+                    break;
+                }
+                scan.mode = Scan_GCode;
+                // fall through
+
+            case Scan_GCode:
+                if(c == ' ' || c == '\t')
+                    scan.stripped++;
+                else if(c == ';') {
+                    scan.stripped++;
+                    scan.mode = Scan_EolComment;
+                } else {
+                    if(c == '(')
+                        scan.mode = Scan_Comment;
+                    prescan_put((char)c);
+                }
+                break;
+
+            case Scan_Comment:
+                if(c == ')')
+                    scan.mode = Scan_GCode;
+                prescan_put((char)c);
+                break;
+
+            case Scan_EolComment:
+                scan.stripped++;
+                break;
+
+            case Scan_Verbatim:
+                prescan_put((char)c);
+                break;
+        }
+    }
+
+    // Ring full without a complete line, pass the partial line on.
+    if(PRESCAN_NEXT(scan.head) == scan.tail && scan.released == scan.tail)
+        scan.released = scan.head;
+}
+
+static void prescan_flush (void)
+{
+    scan.head = scan.tail = scan.released = 0;
+    scan.mode = Scan_LineStart;
+}
+
+static int16_t prescan_read (void)
+{
+    char c;
+
+    if(scan.held)
+        return stream_read();
+
+    if(scan.tail == scan.released)
+        prescan_fill();
+
+    if(scan.tail == scan.released)
+        return SERIAL_NO_DATA;
+
+    c = scan.data[scan.tail];
+    scan.tail = PRESCAN_NEXT(scan.tail);
+
+    return (int16_t)(uint8_t)c;
+}
+
+static void prescan_reset_read (void)
+{
+    prescan_flush();
+    scan.held = false;
+    stream_reset_read();
+}
+
+static void prescan_cancel_read (void)
+{
+    prescan_flush();
+    stream_cancel_read();
+}
+
+static bool prescan_suspend_read (bool suspend)
+{
+    return (scan.held = stream_suspend_read(suspend));
+}
+
+static void prescan_hook (stream_type_t type)
+{
+    prescan_flush();
+    scan.held = false;
+
+    if((scan.hooked = (type == StreamType_Serial || type == StreamType_Telnet) && hal.stream.read &&
+                        hal.stream.reset_read_buffer && hal.stream.cancel_read_buffer && hal.stream.suspend_read)) {
+
+        stream_read = hal.stream.read;
+        hal.stream.read = prescan_read;
+
+        stream_reset_read = hal.stream.reset_read_buffer;
+        hal.stream.reset_read_buffer = prescan_reset_read;
+
+        stream_cancel_read = hal.stream.cancel_read_buffer;
+        hal.stream.cancel_read_buffer = prescan_cancel_read;
+
+        stream_suspend_read = hal.stream.suspend_read;
+        hal.stream.suspend_read = prescan_suspend_read;
+    }
+}
+
+static void prescan_stream_changed (stream_type_t type)
+{
+    if(on_stream_changed)
+        on_stream_changed(type);
+
+    prescan_hook(type);
+}
+
+static void prescan_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(scan.hooked && !scan.held)
+        prescan_fill();
+}
+
+static status_code_t prescan_report (sys_state_t state, char *args)
+{
+    char buf[80];
+
+    snprintf(buf, sizeof(buf), "[PRESCAN|lines=%lu,stripped=%lu,size=%u,used=%u]" ASCII_EOL,
+              scan.lines, scan.stripped, GCODE_PRESCAN_SIZE, (scan.head - scan.tail) & (GCODE_PRESCAN_SIZE - 1));
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void gcode_prescan_init (void)
+{
+    static const sys_command_t prescan_command_list[] = {
+        {"PRESCAN", prescan_report, { .noargs = On }, { .str = "report input line pre-scan counters" } }
+    };
+
+    static sys_commands_t prescan_commands = {
+        .n_commands = sizeof(prescan_command_list) / sizeof(sys_command_t),
+        .commands = prescan_command_list
+    };
+
+    on_stream_changed = grbl.on_stream_changed;
+    grbl.on_stream_changed = prescan_stream_changed;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = prescan_execute_realtime;
+
+    system_register_commands(&prescan_commands);
+
+    prescan_hook(hal.stream.type);
+}
+
+#endif // GCODE_PRESCAN_ENABLE
@@ -0,0 +1,72 @@
+/*
+  gpio_gather.c - batched GPIO input reads mapped to signal bits by lookup tables
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Signal states spread over several ports are read by taking one IDR snapshot per port and
+  mapping each nibble that has pins through a 16 entry table of output bits, instead of a
+  conditional single bit read and shift per pin. Plans are built when the pins are configured,
+  the read is branch free apart from the loops.
+*/
+
+#include "driver.h"
+
+#if INPUT_GATHER
+
+#include <string.h>
+
+#include "gpio_gather.h"
+
+void gpio_gather_clear (gpio_gather_t *plan)
+{
+    plan->n_ports = plan->n_luts = 0;
+    plan->present = 0;
+}
+
+bool gpio_gather_add (gpio_gather_t *plan, GPIO_TypeDef *port, uint8_t pin, uint32_t bits)
+{
+    uint_fast8_t p, l, value;
+    gpio_gather_lut_t *lut;
+
+    for(p = 0; p < plan->n_ports && plan->port[p] != port; p++);
+
+    for(l = 0; l < plan->n_luts && !(plan->lut[l].port == p && plan->lut[l].shift == (pin & ~0x3)); l++);
+
+    if(l == plan->n_luts) {
+        if(l == GPIO_GATHER_PINS)
+            return false;
+        if(p == plan->n_ports)
+            plan->port[plan->n_ports++] = port;
+        lut = &plan->lut[plan->n_luts++];
+        lut->port = p;
+        lut->shift = pin & ~0x3;
+        memset(lut->bits, 0, sizeof(lut->bits));
+    } else
+        lut = &plan->lut[l];
+
+    for(value = 0; value < 16; value++) {
+        if(value & (1 << (pin & 0x3)))
+            lut->bits[value] |= bits;
+    }
+
+    plan->present |= bits;
+
+    return true;
+}
+
+#endif // INPUT_GATHER
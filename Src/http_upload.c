@@ -0,0 +1,488 @@
+/*
+  http_upload.c - streaming HTTP file upload to the SD card or littlefs
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  POST (or PUT) /upload/<path> on HTTP_UPLOAD_PORT, one request at a time, the body being the raw
+  file content (no multipart), e.g.
+
+    curl -T prog.nc -H "X-CRC32: 1c291ca3" http://<host>:8082/upload/prog.nc
+    fetch("http://<host>:8082/upload/littlefs/prog.nc", { method: "POST", body: file })
+
+  Content-Length is required, X-CRC32 (hex) is optional and checked against the CRC-32 of the
+  received file. Expect: 100-continue is answered.
+
+  Received pbufs are held as they arrive and drained from the realtime loop, one
+  HTTP_UPLOAD_CHUNK sized write per pass (a multiple of the SD sector and SPI flash page size, so
+  littlefs programs whole pages, with SPIFLASH_ASYNC through the queued flash writes). The CRC is
+  updated as the data is copied. The receive window is only reopened for written bytes, so the
+  sender is paced by the filesystem and the memory used is the chunk buffer plus at most one
+  TCP window of pbufs, whatever the file size.
+
+  The response is 200 with {"file":"<path>","bytes":<n>,"crc":"<hex>","us":<t>}, or an error
+  status with a text message. A failed upload deletes the file. Uploads are accepted in Idle only.
+
+  lwIP runs in the foreground (NO_SYS), all callbacks here are called from the main loop.
+*/
+
+#include "driver.h"
+
+#if HTTP_UPLOAD_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/tcp.h"
+
+#include "grbl/hal.h"
+#include "grbl/vfs.h"
+#include "grbl/state_machine.h"
+
+#include "crc32.h"
+#include "http_upload.h"
+#include "macro_cache.h"
+
+#ifndef HTTP_UPLOAD_CHUNK
+#define HTTP_UPLOAD_CHUNK 2048
+#endif
+#ifndef HTTP_UPLOAD_TIMEOUT_MS
+#define HTTP_UPLOAD_TIMEOUT_MS 5000
+#endif
+
+#define HTTP_UPLOAD_PATH "/upload"
+#define HTTP_HDR_MAX 1024
+
+#if HTTP_UPLOAD_CHUNK % 512
+#error "HTTP_UPLOAD_CHUNK must be a multiple of 512!"
+#endif
+
+typedef enum {
+    Http_Idle = 0,
+    Http_Header,
+    Http_Body,
+    Http_Closing
+} http_state_t;
+
+typedef struct {
+    struct tcp_pcb *listen;
+    struct tcp_pcb *pcb;
+    http_state_t state;
+    struct pbuf *head;          // received, not yet consumed
+    struct pbuf *tail;
+    uint16_t offset;            // in head
+    uint32_t consumed;          // bytes not yet passed to tcp_recved()
+    uint16_t hdr_len;
+    vfs_file_t *file;
+    char name[64];
+    uint32_t size;
+    uint32_t bytes;             // written
+    uint32_t crc;
+    bool check_crc;
+    uint32_t file_crc;
+    uint32_t t_start;
+    uint32_t rx_ms;
+    uint16_t chunk_len;
+} http_upload_t;
+
+static http_upload_t http = {0};
+static char hdr_buf[HTTP_HDR_MAX];
+static uint8_t chunk[HTTP_UPLOAD_CHUNK] __ALIGNED(4);
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void http_recved (bool force)
+{
+    if(http.pcb && http.consumed && (force || http.consumed >= TCP_MSS)) {
+        tcp_recved(http.pcb, http.consumed);
+        http.consumed = 0;
+    }
+}
+
+// Frees the head pbuf only, the rest of the chain becomes the new head.
+static struct pbuf *rx_free_head (struct pbuf *q)
+{
+    struct pbuf *next = q->next;
+
+    q->next = NULL;
+    pbuf_free(q);
+
+    return next;
+}
+
+static void rx_free_all (void)
+{
+    while(http.head)
+        http.head = rx_free_head(http.head);
+
+    http.tail = NULL;
+    http.offset = 0;
+}
+
+// Copies up to len bytes of held input to dst, frees consumed pbufs. Returns the byte count.
+static uint32_t rx_take (uint8_t *dst, uint32_t len)
+{
+    uint32_t n, taken = 0;
+
+    while(http.head && taken < len) {
+
+        if((n = http.head->len - http.offset) > len - taken)
+            n = len - taken;
+
+        memcpy(dst + taken, (uint8_t *)http.head->payload + http.offset, n);
+        taken += n;
+        http.offset += n;
+
+        if(http.offset == http.head->len) {
+            if((http.head = rx_free_head(http.head)) == NULL)
+                http.tail = NULL;
+            http.offset = 0;
+        }
+    }
+
+    http.consumed += taken;
+
+    return taken;
+}
+
+static void http_respond (const char *status, const char *type, const char *body)
+{
+    char buf[160];
+    size_t len = strlen(body);
+
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+              status, type, (unsigned int)len);
+
+    if(http.pcb && tcp_write(http.pcb, buf, strlen(buf), TCP_WRITE_FLAG_COPY|TCP_WRITE_FLAG_MORE) == ERR_OK)
+        tcp_write(http.pcb, body, len, TCP_WRITE_FLAG_COPY);
+}
+
+static void http_closed (void)
+{
+    rx_free_all();
+
+    if(http.file) {
+        vfs_close(http.file);
+        vfs_unlink(http.name);
+        http.file = NULL;
+    }
+
+    http.pcb = NULL;
+    http.state = Http_Idle;
+    http.consumed = 0;
+}
+
+// Returns ERR_ABRT if the pcb had to be aborted, as to be returned from the recv callback.
+static err_t http_close (struct tcp_pcb *pcb)
+{
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_err(pcb, NULL);
+
+    http_closed();
+
+    if(tcp_close(pcb) == ERR_OK)
+        return ERR_OK;
+
+    tcp_abort(pcb);
+
+    return ERR_ABRT;
+}
+
+static void http_err (void *arg, err_t err)
+{
+    // pcb already freed by lwIP
+    http_closed();
+}
+
+// Sends the response and closes the connection from the realtime loop, once it is queued.
+static void http_finish (const char *status, const char *message, bool ok)
+{
+    char body[80 + sizeof(http.name)];
+
+    if(http.file) {
+        vfs_close(http.file);
+        if(!ok)
+            vfs_unlink(http.name);
+#if MACRO_CACHE_ENABLE
+        macro_cache_invalidate(http.name);
+#endif
+        http.file = NULL;
+    }
+
+    if(ok) {
+        snprintf(body, sizeof(body), "{\"file\":\"%s\",\"bytes\":%lu,\"crc\":\"%08lx\",\"us\":%lu}",
+                  http.name, http.bytes, http.file_crc, hal.get_micros() - http.t_start);
+        http_respond(status, "application/json", body);
+    } else {
+        snprintf(body, sizeof(body), "%s\r\n", message);
+        http_respond(status, "text/plain", body);
+    }
+
+    rx_free_all();
+    http.state = Http_Closing;
+}
+
+static bool header_match (const char *line, const char *name)
+{
+    while(*name) {
+        char c = *line++;
+        if((c >= 'A' && c <= 'Z' ? c + 32 : c) != *name++)
+            return false;
+    }
+
+    return true;
+}
+
+static int hex_digit (char c)
+{
+    return c >= '0' && c <= '9' ? c - '0' : (c >= 'a' && c <= 'f' ? c - 'a' + 10 : (c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1));
+}
+
+// Copies the URL path to name with %XX decoded, returns false if it does not fit.
+static bool url_decode (const char *url, const char *end, char *name, size_t size)
+{
+    int hi, lo;
+
+    while(url < end && size > 1) {
+        if(*url == '%' && end - url >= 3 && (hi = hex_digit(url[1])) >= 0 && (lo = hex_digit(url[2])) >= 0) {
+            *name++ = (char)(hi << 4 | lo);
+            url += 3;
+        } else
+            *name++ = *url++;
+        size--;
+    }
+
+    *name = '\0';
+
+    return url == end;
+}
+
+static void http_request (void)
+{
+    char *line, *path, *end;
+    bool has_length = false, expect = false;
+
+    hdr_buf[http.hdr_len] = '\0';
+
+    if(strncmp(hdr_buf, "POST ", 5) == 0)
+        path = hdr_buf + 5;
+    else if(strncmp(hdr_buf, "PUT ", 4) == 0)
+        path = hdr_buf + 4;
+    else {
+        http_finish("405 Method Not Allowed", "POST or PUT only", false);
+        return;
+    }
+
+    if(strncmp(path, HTTP_UPLOAD_PATH "/", sizeof(HTTP_UPLOAD_PATH)) ||
+        (end = strchr(path, ' ')) == NULL ||
+         !url_decode(path + sizeof(HTTP_UPLOAD_PATH) - 1, end, http.name, sizeof(http.name)) || http.name[1] == '\0') {
+        http_finish("404 Not Found", "POST to " HTTP_UPLOAD_PATH "/<path>", false);
+        return;
+    }
+
+    http.check_crc = false;
+
+    for(line = strstr(hdr_buf, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if(header_match(line, "content-length:")) {
+            http.size = strtoul(line + 15, NULL, 10);
+            has_length = true;
+        } else if(header_match(line, "x-crc32:")) {
+            http.crc = strtoul(line + 8, NULL, 16);
+            http.check_crc = true;
+        } else if(header_match(line, "expect:"))
+            expect = true;
+    }
+
+    if(!has_length) {
+        http_finish("411 Length Required", "Content-Length required", false);
+        return;
+    }
+
+    if(state_get() != STATE_IDLE) {
+        http_finish("409 Conflict", "Machine not idle", false);
+        return;
+    }
+
+    if((http.file = vfs_open(http.name, "w")) == NULL) {
+        http_finish("500 Internal Server Error", "Cannot create file", false);
+        return;
+    }
+
+    if(expect)
+        tcp_write(http.pcb, "HTTP/1.1 100 Continue\r\n\r\n", 25, 0);
+
+    http.bytes = http.file_crc = 0;
+    http.chunk_len = 0;
+    http.t_start = hal.get_micros();
+    http.state = Http_Body;
+}
+
+// Reads header lines from the held input, stops at the end of the header.
+static void http_header (void)
+{
+    uint8_t c;
+
+    while(http.state == Http_Header && rx_take(&c, 1)) {
+
+        if(http.hdr_len == HTTP_HDR_MAX - 1) {
+            http_finish("431 Request Header Fields Too Large", "Header too large", false);
+            return;
+        }
+
+        hdr_buf[http.hdr_len++] = (char)c;
+
+        if(http.hdr_len >= 4 && memcmp(&hdr_buf[http.hdr_len - 4], "\r\n\r\n", 4) == 0)
+            http_request();
+    }
+}
+
+// Fills the chunk buffer from the held input and writes it when full or at the end of the file.
+static void http_body (void)
+{
+    uint32_t n, want = http.size - http.bytes - http.chunk_len;
+
+    if(want > HTTP_UPLOAD_CHUNK - http.chunk_len)
+        want = HTTP_UPLOAD_CHUNK - http.chunk_len;
+
+    if((n = rx_take(&chunk[http.chunk_len], want))) {
+        http.file_crc = crc32_update(http.file_crc, &chunk[http.chunk_len], n);
+        http.chunk_len += n;
+        http.rx_ms = hal.get_elapsed_ticks();
+    }
+
+    if(http.chunk_len == HTTP_UPLOAD_CHUNK || (http.chunk_len && http.bytes + http.chunk_len == http.size)) {
+        if(vfs_write(chunk, 1, http.chunk_len, http.file) != http.chunk_len) {
+            http_finish("500 Internal Server Error", "Write error", false);
+            return;
+        }
+        http.bytes += http.chunk_len;
+        http.chunk_len = 0;
+    }
+
+    if(http.bytes == http.size) {
+        if(http.check_crc && http.file_crc != http.crc)
+            http_finish("422 Unprocessable Entity", "CRC mismatch", false);
+        else
+            http_finish("200 OK", NULL, true);
+    }
+}
+
+static err_t http_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    if(p == NULL)                   // remote closed
+        return http_close(pcb);
+
+    if(err != ERR_OK) {
+        pbuf_free(p);
+        return err;
+    }
+
+    if(http.state == Http_Closing) {    // data after the request
+        tcp_recved(pcb, p->tot_len);
+        pbuf_free(p);
+        return ERR_OK;
+    }
+
+    // Linked up manually so that consumed pbufs can be freed one by one.
+    if(http.tail)
+        http.tail->next = p;
+    else {
+        http.head = p;
+        http.offset = 0;
+    }
+    for(http.tail = p; http.tail->next; http.tail = http.tail->next);
+
+    http.rx_ms = hal.get_elapsed_ticks();
+
+    if(http.state == Http_Header)
+        http_header();
+
+    http_recved(http.head == NULL);
+
+    return ERR_OK;
+}
+
+static err_t http_accept (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    if(err != ERR_OK || pcb == NULL)
+        return ERR_VAL;
+
+    if(http.pcb) {                  // one upload at a time
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    http.pcb = pcb;
+    http.state = Http_Header;
+    http.hdr_len = 0;
+    http.rx_ms = hal.get_elapsed_ticks();
+    tcp_recv(pcb, http_recv);
+    tcp_err(pcb, http_err);
+
+    return ERR_OK;
+}
+
+static void http_poll (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(http.pcb == NULL)
+        return;
+
+    switch(http.state) {
+
+        case Http_Body:
+            http_body();
+            http_recved(http.head == NULL);
+            break;
+
+        case Http_Closing:
+            tcp_output(http.pcb);
+            http_close(http.pcb);
+            return;
+
+        default:
+            break;
+    }
+
+    if(http.pcb && http.state != Http_Closing && hal.get_elapsed_ticks() - http.rx_ms >= HTTP_UPLOAD_TIMEOUT_MS)
+        http_finish("408 Request Timeout", "Timeout", false);
+}
+
+bool http_upload_init (void)
+{
+    struct tcp_pcb *pcb;
+
+    if(http.listen || (pcb = tcp_new()) == NULL)
+        return false;
+
+    if(tcp_bind(pcb, IP_ADDR_ANY, HTTP_UPLOAD_PORT) != ERR_OK || (http.listen = tcp_listen(pcb)) == NULL) {
+        tcp_close(pcb);
+        return false;
+    }
+
+    tcp_accept(http.listen, http_accept);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = http_poll;
+
+    return true;
+}
+
+#endif // HTTP_UPLOAD_ENABLE
@@ -19,10 +19,14 @@
   along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <string.h>
+
 #include <main.h>
 
 #include "i2c.h"
 #include "grbl/hal.h"
+#include "grbl/system.h"
 
 #ifdef I2C_PORT
 
@@ -32,215 +36,1226 @@
 
 #define I2Cport(p) I2CportI(p)
 #define I2CportI(p) I2C ## p
-#define I2CportCLK(p) I2CportCLKI(p)
-#define I2CportCLKI(p) __HAL_RCC_I2C ## p ## _CLK_ENABLE
+#define I2CportFMP(p) I2CportFMPI(p)
+#define I2CportFMPI(p) I2C_FASTMODEPLUS_I2C ## p
 #define I2CportAF(p) I2CportAFI(p)
 #define I2CportAFI(p) GPIO_AF4_I2C ## p
 #define I2CportEvt(p, e) I2CportEvtI(p, e)
 #define I2CportEvtI(p, e) I2C ## p ## _ ## e ## _IRQn
 #define I2CportHandler(p, e) I2CportHandlerI(p, e)
 #define I2CportHandlerI(p, e) I2C ## p ## _ ## e ## _IRQHandler
-
-#define I2CPORT I2Cport(I2C_PORT)
-#define I2C_IRQEVT I2CportEvt(I2C_PORT, EV)
-#define I2C_IRQERR I2CportEvt(I2C_PORT, ER)
-#define I2C_IRQEVT_Handler I2CportHandler(I2C_PORT, EV)
-#define I2C_IRQERR_Handler I2CportHandler(I2C_PORT, ER)
-#define I2C_CLKENA I2CportCLK(I2C_PORT)
-#define I2C_GPIO_AF I2CportAF(I2C_PORT)
+#define I2CportGPIO(p) I2CportGPIOI(p)
+#define I2CportGPIOI(p) I2C ## p ## _GPIO
+#define I2CportSCL(p) I2CportSCLI(p)
+#define I2CportSCLI(p) I2C ## p ## _SCL_PIN
+#define I2CportSDA(p) I2CportSDAI(p)
+#define I2CportSDAI(p) I2C ## p ## _SDA_PIN
 
 #define I2C_EV_IRQHandler HAL_I2C_EV_IRQHandler
 #define I2C_ER_IRQHandler HAL_I2C_ER_IRQHandler
 
-#if I2C_PORT == 1
-
 #ifdef I2C1_ALT_PINMAP
-  #define I2C_SCL_PIN 6
-  #define I2C_SDA_PIN 7
+#define I2C1_SCL_PIN 6
+#define I2C1_SDA_PIN 7
 #else
-  #define I2C_SCL_PIN 8
-  #define I2C_SDA_PIN 9
+#define I2C1_SCL_PIN 8
+#define I2C1_SDA_PIN 9
 #endif
-#define I2C_GPIO GPIOB
+#define I2C1_GPIO GPIOB
 
-#elif I2C_PORT == 2
+#define I2C2_SCL_PIN 10
+#define I2C2_SDA_PIN 11
+#define I2C2_GPIO GPIOB
 
-#define I2C_SCL_PIN 10
-#define I2C_SDA_PIN 11
-#define I2C_GPIO GPIOB
+#define I2C3_SCL_PIN 7
+#define I2C3_SDA_PIN 8
+#define I2C3_GPIO GPIOH
 
-#elif I2C_PORT == 3
+#define I2C4_SCL_PIN 12
+#define I2C4_SDA_PIN 13
+#define I2C4_GPIO GPIOD
 
-#define I2C_SCL_PIN 7
-#define I2C_SDA_PIN 8
-#define I2C_GPIO GPIOH
-
-#elif I2C_PORT == 4
-
-#define I2C_SCL_PIN 12
-#define I2C_SDA_PIN 13
-#define I2C_GPIO GPIOD
+/*
+ * Each bus has its own peripheral handle, interrupts, transaction queue and counters. I2C_PORT is
+ * the bus of the grblHAL core API (EEPROM, keypad, Trinamic), EDM_PULSER_I2C_PORT optionally gives
+ * the PULSER a bus of its own so that its polls are not delayed by transfers to other devices.
+ * The HAL handle is the first member, the HAL callbacks cast it back to the bus.
+ */
+
+typedef struct {
+    i2c_transaction_t *head[I2C_PriorityN];
+    i2c_transaction_t *tail[I2C_PriorityN];
+    i2c_transaction_t *volatile active;
+    uint_fast8_t high_burst;
+    volatile bool starting;         // transfer being set up, holds off the watchdog
+    volatile bool recover;          // bus held for i2c_recover() from the foreground, see i2c_poll()
+    bool addr_frame;                // memory transfer is sending the register address
+    uint8_t word_addr[2];           // register address of the memory transfer, MSB first
+    uint32_t start_us;
+    uint32_t timeout_us;
+} i2c_queue_t;
+
+typedef struct {
+    I2C_HandleTypeDef port;
+    uint8_t id;                     // peripheral number
+    GPIO_TypeDef *gpio;
+    uint8_t scl_pin;
+    uint8_t sda_pin;
+    uint8_t af;
+    uint32_t fmp;
+    IRQn_Type irq_evt;
+    IRQn_Type irq_err;
+    uint32_t rate;                  // actual SCL frequency in Hz
+    i2c_stats_t stats;              // used for debugging info only, see i2c_get_stats()
+    i2c_queue_t queue;
+    i2c_transaction_t bus_claim;    // marks the bus as in use by a polled HAL call
+} i2c_bus_t;
+
+#define I2C_BUS(p) { \
+    .port = { \
+        .Instance = I2Cport(p), \
+        .Init.OwnAddress1 = 0, \
+        .Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT, \
+        .Init.DualAddressMode = I2C_DUALADDRESS_DISABLE, \
+        .Init.OwnAddress2 = 0, \
+        .Init.GeneralCallMode = I2C_GENERALCALL_DISABLE, \
+        .Init.NoStretchMode = I2C_NOSTRETCH_DISABLE \
+    }, \
+    .id = p, \
+    .gpio = I2CportGPIO(p), \
+    .scl_pin = I2CportSCL(p), \
+    .sda_pin = I2CportSDA(p), \
+    .af = I2CportAF(p), \
+    .fmp = I2CportFMP(p), \
+    .irq_evt = I2CportEvt(p, EV), \
+    .irq_err = I2CportEvt(p, ER) \
+}
 
+static i2c_bus_t i2c_bus[I2C_BusN] = {
+    I2C_BUS(I2C_PORT),
+#if EDM_PULSER_I2C_PORT
+    I2C_BUS(EDM_PULSER_I2C_PORT)
 #endif
+};
+
+static void i2c_abort (i2c_bus_t *bus, bool expired);
+static status_code_t i2c_report_stats (sys_state_t state, char *args);
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
 
 static uint8_t keycode = 0;
 static keycode_callback_ptr keypad_callback = NULL;
-static I2C_HandleTypeDef i2c_port = {
-    .Instance = I2CPORT,
-#if I2C_KHZ == 100
-    .Init.Timing = 0x307075B1,
-#elif I2C_KHZ == 400
-    .Init.Timing = 0x00B03FDB,
-#elif I2C_KHZ == 1000
-    .Init.Timing = 0x0050174F,
-#else
-    #error "I2C speed not defined"
+static struct {
+    i2c_complete_ptr callback;
+    void *context;
+    i2c_transaction_t transaction;
+} mem_rx = {0};
+
+// I2C_BusPulser is the main bus when the PULSER has no bus of its own.
+static inline i2c_bus_t *i2c_get_bus (i2c_bus_id_t id)
+{
+    return &i2c_bus[id < I2C_BusN ? id : I2C_BusMain];
+}
+
+/*
+ * TIMINGR is computed at runtime from the I2C kernel clock and the I2C-bus specification
+ * (UM10204) limits for the mode. The rise and fall times are board dependent, the defaults
+ * match short traces with on-board pull-ups and are clamped to the mode maximum.
+ */
+
+#ifndef I2C_RISE_TIME_NS
+#define I2C_RISE_TIME_NS 100
+#endif
+#ifndef I2C_FALL_TIME_NS
+#define I2C_FALL_TIME_NS 10
+#endif
+
+// Longest time SCL may be held low, by a slave stretching the clock or by the master waiting
+// for the interrupt handler, before the transfer is aborted and the bus recovered.
+#ifndef I2C_TIMEOUT_US
+#define I2C_TIMEOUT_US 100
 #endif
-    .Init.OwnAddress1 = 0,
-    .Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT,
-    .Init.DualAddressMode = I2C_DUALADDRESS_DISABLE,
-    .Init.OwnAddress2 = 0,
-    .Init.GeneralCallMode = I2C_GENERALCALL_DISABLE,
-    .Init.NoStretchMode = I2C_NOSTRETCH_DISABLE
+
+#define I2C_AF_MIN_PS 50000     // analog filter delay
+#define I2C_AF_MAX_PS 260000
+
+typedef struct {
+    uint16_t khz;
+    uint16_t l_min;             // SCL low period, ns
+    uint16_t h_min;             // SCL high period, ns
+    uint16_t sudat_min;         // data setup time, ns
+    uint16_t vddat_max;         // data valid time, ns
+    uint16_t rise_max;
+    uint16_t fall_max;
+} i2c_spec_t;
+
+// Mode limits, fastest first. The maximum rates also form the fallback ladder of i2c_negotiate().
+static const i2c_spec_t i2c_spec[] = {
+    { .khz = 1000, .l_min = 500,  .h_min = 260,  .sudat_min = 50,  .vddat_max = 450,  .rise_max = 120,  .fall_max = 120 },
+    { .khz = 400,  .l_min = 1300, .h_min = 600,  .sudat_min = 100, .vddat_max = 900,  .rise_max = 300,  .fall_max = 300 },
+    { .khz = 100,  .l_min = 4700, .h_min = 4000, .sudat_min = 250, .vddat_max = 3450, .rise_max = 1000, .fall_max = 300 }
 };
 
-i2c_cap_t i2c_start (void)
+static uint32_t i2c_kernel_clock (i2c_bus_t *bus)
 {
-    static i2c_cap_t cap = {};
+    PLL3_ClocksTypeDef pll3;
 
-    if(cap.started)
-        return cap;
+    if(bus->id == 4) switch(__HAL_RCC_GET_I2C4_SOURCE()) {
+
+        case RCC_I2C4CLKSOURCE_D3PCLK1:
+            return HAL_RCCEx_GetD3PCLK1Freq();
+
+        case RCC_I2C4CLKSOURCE_PLL3:
+            HAL_RCCEx_GetPLL3ClockFreq(&pll3);
+            return pll3.PLL3_R_Frequency;
+
+        case RCC_I2C4CLKSOURCE_HSI:
+            return HSI_VALUE >> (__HAL_RCC_GET_HSI_DIVIDER() >> RCC_CR_HSIDIV_Pos);
+
+        default:
+            return CSI_VALUE;
+
+    } else switch(__HAL_RCC_GET_I2C123_SOURCE()) {
+
+        case RCC_I2C123CLKSOURCE_D2PCLK1:
+            return HAL_RCC_GetPCLK1Freq();
+
+        case RCC_I2C123CLKSOURCE_PLL3:
+            HAL_RCCEx_GetPLL3ClockFreq(&pll3);
+            return pll3.PLL3_R_Frequency;
+
+        case RCC_I2C123CLKSOURCE_HSI:
+            return HSI_VALUE >> (__HAL_RCC_GET_HSI_DIVIDER() >> RCC_CR_HSIDIV_Pos);
+
+        default:
+            return CSI_VALUE;
+    }
+}
+
+static void i2c_clock_enable (i2c_bus_t *bus)
+{
+    switch(bus->id) {
+
+        case 1:
+            __HAL_RCC_I2C1_CLK_ENABLE();
+            break;
+
+        case 2:
+            __HAL_RCC_I2C2_CLK_ENABLE();
+            break;
+
+        case 3:
+            __HAL_RCC_I2C3_CLK_ENABLE();
+            break;
+
+        case 4:
+            __HAL_RCC_I2C4_CLK_ENABLE();
+            break;
+    }
+}
+
+static inline uint32_t div_ceil (uint32_t n, uint32_t d)
+{
+    return (n + d - 1) / d;
+}
+
+// Finds the prescaler and SCL low/high counts giving the highest SCL frequency not above the
+// requested one, with the hold and setup delays satisfying the data timing limits.
+// Timing is in picoseconds to keep resolution at high kernel clocks.
+static bool i2c_compute_timing (uint32_t f_ker, uint32_t khz, const i2c_spec_t *spec, uint32_t *timingr, uint32_t *rate)
+{
+    uint32_t t_ker = (uint32_t)(1000000000000ULL / f_ker);
+    uint32_t t_rise = (I2C_RISE_TIME_NS < spec->rise_max ? I2C_RISE_TIME_NS : spec->rise_max) * 1000;
+    uint32_t t_fall = (I2C_FALL_TIME_NS < spec->fall_max ? I2C_FALL_TIME_NS : spec->fall_max) * 1000;
+    uint32_t t_target = 1000000000UL / khz, t_sync = I2C_AF_MIN_PS + 2 * t_ker, best_scl = UINT32_MAX;
+    int32_t sdadel_min = (int32_t)t_fall - I2C_AF_MIN_PS - 3 * (int32_t)t_ker;
+    int32_t sdadel_max = (int32_t)spec->vddat_max * 1000 - (int32_t)t_rise - I2C_AF_MAX_PS - 4 * (int32_t)t_ker;
+    uint32_t scldel_min = t_rise + spec->sudat_min * 1000;
+    uint_fast16_t presc, scldel, sdadel, scll, sclh;
+
+    for(presc = 0; presc < 16; presc++) {
 
+        uint32_t t_presc = (presc + 1) * t_ker;
+
+        // SCLDEL: (SCLDEL + 1) * tPRESC >= tr + tSU;DAT, SDADEL: SDADEL * tPRESC in [min, max]
+        if((scldel = div_ceil(scldel_min, t_presc) - 1) > 15)
+            continue;
+
+        sdadel = sdadel_min > 0 ? div_ceil(sdadel_min, t_presc) : 0;
+        if(sdadel > 15 || (int32_t)(sdadel * t_presc) > sdadel_max)
+            continue;
+
+        for(scll = 0; scll < 256; scll++) {
+
+            uint32_t t_low = (scll + 1) * t_presc + t_sync, t_high_min, t_high, t_scl;
+
+            if(t_low < spec->l_min * 1000)
+                continue;
+
+            if(t_low + t_sync + t_rise + t_fall >= best_scl)
+                break;
+
+            t_high_min = t_target > t_low + t_rise + t_fall ? t_target - t_low - t_rise - t_fall : 0;
+            if(t_high_min < spec->h_min * 1000)
+                t_high_min = spec->h_min * 1000;
+
+            sclh = t_high_min > t_sync + t_presc ? div_ceil(t_high_min - t_sync, t_presc) - 1 : 0;
+            if(sclh > 255)
+                continue;
+
+            t_high = (sclh + 1) * t_presc + t_sync;
+            t_scl = t_low + t_high + t_rise + t_fall;
+
+            if(t_scl < best_scl) {
+                best_scl = t_scl;
+                *timingr = (presc << I2C_TIMINGR_PRESC_Pos) | (scldel << I2C_TIMINGR_SCLDEL_Pos) |
+                            (sdadel << I2C_TIMINGR_SDADEL_Pos) | (sclh << I2C_TIMINGR_SCLH_Pos) | scll;
+            }
+        }
+
+        if(best_scl <= t_target + t_target / 100)
+            break; // within 1%, prefer the lowest prescaler
+    }
+
+    if(best_scl != UINT32_MAX)
+        *rate = (uint32_t)(1000000000000ULL / best_scl);
+
+    return best_scl != UINT32_MAX;
+}
+
+// Enables the SCL low timeout, (TIMEOUTA + 1) * 2048 kernel clock cycles.
+static void i2c_set_timeout (i2c_bus_t *bus)
+{
+    uint32_t timeouta = div_ceil((uint32_t)(((uint64_t)I2C_TIMEOUT_US * i2c_kernel_clock(bus)) / 1000000ULL), 2048);
+
+    if(timeouta)
+        timeouta--;
+
+    bus->port.Instance->TIMEOUTR = 0;
+    bus->port.Instance->TIMEOUTR = timeouta > 0xFFF ? 0xFFF : timeouta;
+    bus->port.Instance->TIMEOUTR |= I2C_TIMEOUTR_TIMOUTEN;
+}
+
+// Reconfigures the peripheral for an SCL frequency as close as possible to but not above khz,
+// using the limits of the slowest mode that supports it. The bus must be idle.
+static bool i2c_apply_speed (i2c_bus_t *bus, uint32_t khz)
+{
+    uint32_t timingr, rate;
+    uint_fast8_t idx = sizeof(i2c_spec) / sizeof(i2c_spec_t);
+
+    while(--idx && i2c_spec[idx].khz < khz);
+
+    if(khz > i2c_spec[idx].khz)
+        khz = i2c_spec[idx].khz;
+
+    if(khz == 0 || !i2c_compute_timing(i2c_kernel_clock(bus), khz, &i2c_spec[idx], &timingr, &rate))
+        return false;
+
+    if(khz > 400)
+        HAL_I2CEx_EnableFastModePlus(bus->fmp);
+    else
+        HAL_I2CEx_DisableFastModePlus(bus->fmp);
+
+    bus->port.Init.Timing = timingr;
+    HAL_I2C_Init(&bus->port);
+    i2c_set_timeout(bus);
+    bus->rate = rate;
+
+    return true;
+}
+
+static inline void i2c_delay (uint32_t cycles)
+{
+    uint32_t start = DWT->CYCCNT;
+
+    while(DWT->CYCCNT - start < cycles);
+}
+
+// Clocks SCL until a slave holding SDA low has released it, max 9 clocks at 100 kHz, then generates
+// a STOP and re-initialises the peripheral. Any transfer in progress is abandoned.
+static void i2c_recover (i2c_bus_t *bus)
+{
+    uint_fast8_t clocks = 9;
+    uint32_t half = SystemCoreClock / 200000, scl = 1 << bus->scl_pin, sda = 1 << bus->sda_pin;
     GPIO_InitTypeDef GPIO_InitStruct = {
-        .Pin = (1 << I2C_SCL_PIN)|(1 << I2C_SDA_PIN),
+        .Pin = scl|sda,
+        .Mode = GPIO_MODE_OUTPUT_OD,
+        .Pull = GPIO_PULLUP,
+        .Speed = GPIO_SPEED_FREQ_VERY_HIGH
+    };
+
+    HAL_NVIC_DisableIRQ(bus->irq_evt);
+    HAL_NVIC_DisableIRQ(bus->irq_err);
+
+    __HAL_I2C_DISABLE(&bus->port);
+
+    DIGITAL_OUT(bus->gpio, scl|sda, 1);
+    HAL_GPIO_Init(bus->gpio, &GPIO_InitStruct);
+    i2c_delay(half);
+
+    while(clocks-- && !DIGITAL_IN(bus->gpio, sda)) {
+        DIGITAL_OUT(bus->gpio, scl, 0);
+        i2c_delay(half);
+        DIGITAL_OUT(bus->gpio, scl, 1);
+        i2c_delay(half);
+    }
+
+    // STOP: SDA rising while SCL is high
+    DIGITAL_OUT(bus->gpio, scl, 0);
+    i2c_delay(half);
+    DIGITAL_OUT(bus->gpio, sda, 0);
+    i2c_delay(half);
+    DIGITAL_OUT(bus->gpio, scl, 1);
+    i2c_delay(half);
+    DIGITAL_OUT(bus->gpio, sda, 1);
+    i2c_delay(half);
+
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_OD;
+    GPIO_InitStruct.Alternate = bus->af;
+    HAL_GPIO_Init(bus->gpio, &GPIO_InitStruct);
+
+    HAL_I2C_Init(&bus->port);
+    i2c_set_timeout(bus);
+
+    HAL_NVIC_ClearPendingIRQ(bus->irq_evt);
+    HAL_NVIC_ClearPendingIRQ(bus->irq_err);
+    HAL_NVIC_EnableIRQ(bus->irq_evt);
+    HAL_NVIC_EnableIRQ(bus->irq_err);
+
+    bus->stats.recoveries++;
+}
+
+// Returns true if the bus is not free, e.g. a slave is holding SDA low after a brown-out.
+static inline bool i2c_bus_stuck (i2c_bus_t *bus)
+{
+    uint32_t pins = (1 << bus->scl_pin)|(1 << bus->sda_pin);
+
+    return __HAL_I2C_GET_FLAG(&bus->port, I2C_FLAG_BUSY) || (bus->gpio->IDR & pins) != pins;
+}
+
+static void i2c_queue_run (i2c_bus_t *bus);
+
+// Transfer watchdog and bus recovery, foreground only. The interrupt handlers do not recover a bus
+// themselves since that takes up to 9 SCL clocks of busy waiting, they fail the transfer and hold
+// the bus until it is recovered here.
+static void i2c_poll (i2c_bus_t *bus)
+{
+    i2c_abort(bus, true);
+
+    if(bus->queue.recover) {
+        i2c_recover(bus);
+        bus->queue.recover = false;
+        bus->queue.active = NULL;
+        i2c_queue_run(bus);
+    }
+}
+
+static void i2c_poll_all (void)
+{
+    uint_fast8_t idx = I2C_BusN;
+
+    do {
+        i2c_poll(&i2c_bus[--idx]);
+    } while(idx);
+}
+
+static void i2c_execute_realtime (sys_state_t state)
+{
+    i2c_poll_all();
+
+    on_execute_realtime(state);
+}
+
+static void i2c_execute_delay (sys_state_t state)
+{
+    i2c_poll_all();
+
+    on_execute_delay(state);
+}
+
+static bool i2c_bus_start (i2c_bus_t *bus)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {
+        .Pin = (1 << bus->scl_pin)|(1 << bus->sda_pin),
         .Mode = GPIO_MODE_AF_OD,
         .Pull = GPIO_PULLUP,
         .Speed = GPIO_SPEED_FREQ_VERY_HIGH,
-        .Alternate = I2C_GPIO_AF
+        .Alternate = bus->af
     };
-    HAL_GPIO_Init(I2C_GPIO, &GPIO_InitStruct);
+    HAL_GPIO_Init(bus->gpio, &GPIO_InitStruct);
 
-    I2C_CLKENA();
+    i2c_clock_enable(bus);
 
-#ifdef I2C_FASTMODE
-    HAL_FMPI2C_Init(&i2c_port);
-    HAL_FMPI2CEx_ConfigAnalogFilter(&i2c_port, FMPI2C_ANALOGFILTER_ENABLE);
-#else
-    HAL_I2C_Init(&i2c_port);
-#endif
+    if(!i2c_apply_speed(bus, I2C_KHZ))
+        return false;
+
+    HAL_NVIC_SetPriority(bus->irq_evt, IRQ_PRIO_I2C, 0);
+    HAL_NVIC_SetPriority(bus->irq_err, IRQ_PRIO_I2C, 0);
+    HAL_NVIC_EnableIRQ(bus->irq_evt);
+    HAL_NVIC_EnableIRQ(bus->irq_err);
+
+    return true;
+}
 
-    HAL_NVIC_EnableIRQ(I2C_IRQEVT);
-    HAL_NVIC_EnableIRQ(I2C_IRQERR);
+i2c_cap_t i2c_start (void)
+{
+    static i2c_cap_t cap = {};
+
+    if(cap.started)
+        return cap;
+
+    __HAL_RCC_SYSCFG_CLK_ENABLE();
+
+    if(!i2c_bus_start(&i2c_bus[I2C_BusMain]))
+        return cap;
 
     static const periph_pin_t scl = {
         .function = Output_SCK,
         .group = PinGroup_I2C,
-        .port = I2C_GPIO,
-        .pin = I2C_SCL_PIN,
+        .port = I2CportGPIO(I2C_PORT),
+        .pin = I2CportSCL(I2C_PORT),
         .mode = { .mask = PINMODE_OD }
     };
 
     static const periph_pin_t sda = {
         .function = Bidirectional_SDA,
         .group = PinGroup_I2C,
-        .port = I2C_GPIO,
-        .pin = I2C_SDA_PIN,
+        .port = I2CportGPIO(I2C_PORT),
+        .pin = I2CportSDA(I2C_PORT),
         .mode = { .mask = PINMODE_OD }
     };
 
     hal.periph_port.register_pin(&scl);
     hal.periph_port.register_pin(&sda);
 
+#if EDM_PULSER_I2C_PORT
+    if(i2c_bus_start(&i2c_bus[I2C_BusPulser])) {
+
+        static const periph_pin_t pulser_scl = {
+            .function = Output_SCK,
+            .group = PinGroup_I2C,
+            .port = I2CportGPIO(EDM_PULSER_I2C_PORT),
+            .pin = I2CportSCL(EDM_PULSER_I2C_PORT),
+            .mode = { .mask = PINMODE_OD },
+            .description = "PULSER"
+        };
+
+        static const periph_pin_t pulser_sda = {
+            .function = Bidirectional_SDA,
+            .group = PinGroup_I2C,
+            .port = I2CportGPIO(EDM_PULSER_I2C_PORT),
+            .pin = I2CportSDA(EDM_PULSER_I2C_PORT),
+            .mode = { .mask = PINMODE_OD },
+            .description = "PULSER"
+        };
+
+        hal.periph_port.register_pin(&pulser_scl);
+        hal.periph_port.register_pin(&pulser_sda);
+    }
+#endif
+
+    static const sys_command_t i2c_command_list[] = {
+        {"I2CSTATS", i2c_report_stats, {}, { .str = "report I2C transfer and error counters, $I2CSTATS=R to reset" } }
+    };
+
+    static sys_commands_t i2c_commands = {
+        .n_commands = sizeof(i2c_command_list) / sizeof(sys_command_t),
+        .commands = i2c_command_list
+    };
+
+    system_register_commands(&i2c_commands);
+
+    // Watchdog for transfers that do not complete and bus recovery
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = i2c_execute_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = i2c_execute_delay;
+
     cap.started = cap.tx_non_blocking = On;
 
     return cap;
 }
 
-void I2C_IRQEVT_Handler (void)
+static void i2c_irq_error (i2c_bus_t *bus)
+{
+    // SCL low timeout is not handled by the HAL I2C driver
+    if(__HAL_I2C_GET_FLAG(&bus->port, I2C_FLAG_TIMEOUT)) {
+        __HAL_I2C_CLEAR_FLAG(&bus->port, I2C_FLAG_TIMEOUT);
+        i2c_abort(bus, false);
+    } else
+        I2C_ER_IRQHandler(&bus->port);
+}
+
+void I2CportHandler(I2C_PORT, EV) (void)
+{
+    I2C_EV_IRQHandler(&i2c_bus[I2C_BusMain].port);
+}
+
+void I2CportHandler(I2C_PORT, ER) (void)
+{
+    i2c_irq_error(&i2c_bus[I2C_BusMain]);
+}
+
+#if EDM_PULSER_I2C_PORT
+
+void I2CportHandler(EDM_PULSER_I2C_PORT, EV) (void)
 {
-    I2C_EV_IRQHandler(&i2c_port);
+    I2C_EV_IRQHandler(&i2c_bus[I2C_BusPulser].port);
 }
 
-void I2C_IRQERR_Handler (void)
+void I2CportHandler(EDM_PULSER_I2C_PORT, ER) (void)
 {
-    I2C_ER_IRQHandler(&i2c_port);
+    i2c_irq_error(&i2c_bus[I2C_BusPulser]);
 }
 
 #endif
 
-static inline __attribute__((always_inline)) bool wait_ready (void)
+#endif
+
+/*
+ * Transactions are queued per priority as linked lists of caller owned descriptors and run back
+ * to back from the HAL completion callbacks, high priority first. After I2C_HIGH_BURST consecutive
+ * high priority transactions a pending low priority one is let through so that blocking callers
+ * cannot be starved by a poll running at bus capacity.
+ * Memory transfers are sent as two sequential frames, the register address and then the data after
+ * a repeated START (reads) or in the same write, instead of by HAL_I2C_Mem_Read_IT() and
+ * HAL_I2C_Mem_Write_IT() which poll for the address phase. Nothing is waited for when a transfer is
+ * started from the completion interrupt of the previous one.
+ */
+
+#ifndef I2C_HIGH_BURST
+#define I2C_HIGH_BURST 8
+#endif
+
+static bool i2c_queue_start (i2c_bus_t *bus, i2c_transaction_t *t)
 {
-    while(i2c_port.State != HAL_I2C_STATE_READY) {
-        if(!hal.stream_blocking_callback())
-            return false;
+    HAL_StatusTypeDef ret = HAL_ERROR;
+    uint32_t bits = (t->count + 1 + (t->op == I2C_OpMemRead ? 1 : 0) + (t->op <= I2C_OpMemWrite ? t->word_addr_bytes : 0)) * 9;
+
+    // Watchdog limit is twice the nominal transfer time plus the SCL low timeout
+    bus->queue.timeout_us = (uint32_t)(2000000ULL * bits / (bus->rate ? bus->rate : 100000)) + I2C_TIMEOUT_US;
+    bus->queue.start_us = (uint32_t)hal.get_micros();
+    bus->queue.starting = true;
+
+    switch(t->op) {
+
+        case I2C_OpMemRead:
+        case I2C_OpMemWrite:
+            // The data frame is started by i2c_queue_data_frame() when the address is sent.
+            bus->queue.addr_frame = true;
+            bus->queue.word_addr[0] = (uint8_t)(t->word_addr_bytes == 2 ? t->word_addr >> 8 : t->word_addr);
+            bus->queue.word_addr[1] = (uint8_t)t->word_addr;
+            ret = HAL_I2C_Master_Seq_Transmit_IT(&bus->port, t->address << 1, bus->queue.word_addr,
+                                                  t->word_addr_bytes == 2 ? 2 : 1, I2C_FIRST_FRAME);
+            break;
+
+        case I2C_OpReceive:
+            ret = HAL_I2C_Master_Receive_IT(&bus->port, t->address << 1, t->data, t->count);
+            break;
+
+        case I2C_OpSend:
+            ret = HAL_I2C_Master_Transmit_IT(&bus->port, t->address << 1, t->data, t->count);
+            break;
+    }
+
+    bus->queue.starting = false;
+
+    return ret == HAL_OK;
+}
+
+// Starts the data frame of the running memory transfer once its register address is sent.
+static bool i2c_queue_data_frame (i2c_bus_t *bus)
+{
+    i2c_transaction_t *t = bus->queue.active;
+
+    bus->queue.addr_frame = false;
+
+    if(t->op == I2C_OpMemRead)
+        return HAL_I2C_Master_Seq_Receive_IT(&bus->port, t->address << 1, t->data, t->count, I2C_LAST_FRAME) == HAL_OK;
+
+    return HAL_I2C_Master_Seq_Transmit_IT(&bus->port, t->address << 1, t->data, t->count, I2C_LAST_FRAME) == HAL_OK;
+}
+
+// Unlinks and returns the next transaction to run, must be called with interrupts disabled.
+static i2c_transaction_t *i2c_queue_remove (i2c_bus_t *bus)
+{
+    i2c_priority_t prio = I2C_PriorityHigh;
+    i2c_transaction_t *t;
+
+    if(bus->queue.head[I2C_PriorityLow] && (bus->queue.head[I2C_PriorityHigh] == NULL || bus->queue.high_burst >= I2C_HIGH_BURST))
+        prio = I2C_PriorityLow;
+
+    if((t = bus->queue.head[prio])) {
+        if((bus->queue.head[prio] = t->next) == NULL)
+            bus->queue.tail[prio] = NULL;
+        bus->queue.high_burst = prio == I2C_PriorityHigh ? bus->queue.high_burst + 1 : 0;
+    }
+
+    return t;
+}
+
+static void i2c_count_error (i2c_bus_t *bus, uint32_t error)
+{
+    bus->stats.errors++;
+
+    if(error & HAL_I2C_ERROR_AF)
+        bus->stats.nack++;
+    if(error & (HAL_I2C_ERROR_BERR|HAL_I2C_ERROR_ARLO))
+        bus->stats.bus_error++;
+    if(error & HAL_I2C_ERROR_TIMEOUT)
+        bus->stats.timeout++;
+}
+
+// Holds the bus for recovery from the foreground, the running transaction (if any) is failed by the caller.
+// Interrupts of the bus stay off until then, i2c_recover() enables them again.
+static inline void i2c_hold (i2c_bus_t *bus)
+{
+    HAL_NVIC_DisableIRQ(bus->irq_evt);
+    HAL_NVIC_DisableIRQ(bus->irq_err);
+
+    bus->queue.addr_frame = false;
+    bus->queue.recover = true;
+    bus->queue.active = &bus->bus_claim;
+}
+
+// Runs queued transactions until one is started, failed ones are completed with ok = false.
+static void i2c_queue_run (i2c_bus_t *bus)
+{
+    i2c_transaction_t *t;
+
+    while(true) {
+
+        __disable_irq();
+        if(bus->queue.active == NULL && (t = i2c_queue_remove(bus)))
+            bus->queue.active = t;
+        else
+            t = NULL;
+        __enable_irq();
+
+        if(t == NULL)
+            break;
+
+        // Bus not free, e.g. a slave holding SDA low after a brown-out: the transaction goes back
+        // to the head of its queue and is started after recovery.
+        if(i2c_bus_stuck(bus)) {
+            bus->stats.busy++;
+            __disable_irq();
+            if((t->next = bus->queue.head[t->priority]) == NULL)
+                bus->queue.tail[t->priority] = t;
+            bus->queue.head[t->priority] = t;
+            i2c_hold(bus);
+            __enable_irq();
+            break;
+        }
+
+        if(i2c_queue_start(bus, t))
+            break;
+
+        i2c_count_error(bus, bus->port.ErrorCode);
+        bus->queue.addr_frame = false;
+        bus->queue.active = NULL;
+        if(t->callback)
+            t->callback(false, t->context);
+    }
+}
+
+static void i2c_queue_complete (i2c_bus_t *bus, bool ok)
+{
+    bool recover = false;
+    i2c_transaction_t *t;
+
+    if((t = bus->queue.active) == NULL || t == &bus->bus_claim)
+        return;
+
+    if(ok)
+        bus->stats.transfers++;
+    else {
+        i2c_count_error(bus, bus->port.ErrorCode);
+        // misplaced START/STOP or arbitration lost, the bus may be left in an undefined state
+        recover = (bus->port.ErrorCode & (HAL_I2C_ERROR_BERR|HAL_I2C_ERROR_ARLO)) != 0;
+    }
+
+    if(recover)
+        i2c_hold(bus);
+    else {
+        bus->queue.addr_frame = false;
+        bus->queue.active = NULL;
+    }
+
+    if(t->callback)
+        t->callback(ok, t->context);
+
+    if(!recover)
+        i2c_queue_run(bus);
+}
+
+// Fails the running transfer and holds the bus for recovery by i2c_poll(), called on SCL low timeout
+// or with expired = true to check the watchdog. A late completion interrupt is ignored since the bus
+// is claimed meanwhile.
+static void i2c_abort (i2c_bus_t *bus, bool expired)
+{
+    i2c_transaction_t *t;
+
+    __disable_irq();
+    if((t = bus->queue.active) && t != &bus->bus_claim && !bus->queue.starting &&
+         (!expired || (uint32_t)hal.get_micros() - bus->queue.start_us > bus->queue.timeout_us))
+        i2c_hold(bus);
+    else
+        t = NULL;
+    __enable_irq();
+
+    if(t == NULL)
+        return;
+
+    bus->stats.errors++;
+    bus->stats.timeout++;
+
+    if(t->callback)
+        t->callback(false, t->context);
+}
+
+// Removes a transaction that has not been started yet, returns false if not found.
+static bool i2c_queue_cancel (i2c_transaction_t *transaction)
+{
+    bool ok = false;
+    i2c_transaction_t *t, *prev = NULL;
+    i2c_priority_t prio = transaction->priority;
+    i2c_bus_t *bus = i2c_get_bus(transaction->bus);
+
+    __disable_irq();
+
+    for(t = bus->queue.head[prio]; t && !ok; t = t->next) {
+        if((ok = t == transaction)) {
+            if(prev)
+                prev->next = t->next;
+            else
+                bus->queue.head[prio] = t->next;
+            if(bus->queue.tail[prio] == t)
+                bus->queue.tail[prio] = prev;
+        } else
+            prev = t;
+    }
+
+    __enable_irq();
+
+    return ok;
+}
+
+// Queues a transfer and returns immediately, the transaction must stay valid until the callback is called.
+// Returns false if the transaction is invalid, callback is only called when true is returned.
+bool i2c_queue_transaction (i2c_transaction_t *transaction)
+{
+    i2c_bus_t *bus = i2c_get_bus(transaction->bus);
+
+    if(transaction->count == 0 || transaction->data == NULL || transaction->priority >= I2C_PriorityN)
+        return false;
+
+    transaction->next = NULL;
+
+    __disable_irq();
+
+    if(bus->queue.tail[transaction->priority])
+        bus->queue.tail[transaction->priority]->next = transaction;
+    else
+        bus->queue.head[transaction->priority] = transaction;
+    bus->queue.tail[transaction->priority] = transaction;
+
+    __enable_irq();
+
+    i2c_queue_run(bus);
+
+    return true;
+}
+
+// $I2CSTATS - report transfer and error counters, $I2CSTATS=R to reset
+static status_code_t i2c_report_stats (sys_state_t state, char *args)
+{
+    char buf[150];
+    i2c_stats_t i2c_stats;
+    i2c_bus_id_t id = I2C_BusMain;
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    do {
+        i2c_bus_get_stats(id, &i2c_stats, args != NULL);
+
+        snprintf(buf, sizeof(buf), "[I2C%s|rate=%lu,ok=%lu,err=%lu,nack=%lu,berr=%lu,timeout=%lu,busy=%lu,recover=%lu]" ASCII_EOL,
+                  id == I2C_BusMain ? "" : "PULSER", i2c_bus[id].rate, i2c_stats.transfers, i2c_stats.errors, i2c_stats.nack,
+                   i2c_stats.bus_error, i2c_stats.timeout, i2c_stats.busy, i2c_stats.recoveries);
+        hal.stream.write(buf);
+    } while(++id < I2C_BusN);
+
+    return Status_OK;
+}
+
+void i2c_bus_get_stats (i2c_bus_id_t id, i2c_stats_t *i2c_stats, bool reset)
+{
+    i2c_bus_t *bus = i2c_get_bus(id);
+
+    __disable_irq();
+    memcpy(i2c_stats, &bus->stats, sizeof(i2c_stats_t));
+    if(reset)
+        memset(&bus->stats, 0, sizeof(i2c_stats_t));
+    __enable_irq();
+}
+
+void i2c_get_stats (i2c_stats_t *i2c_stats, bool reset)
+{
+    i2c_bus_get_stats(I2C_BusMain, i2c_stats, reset);
+}
+
+bool i2c_bus_busy (i2c_bus_id_t id)
+{
+    i2c_bus_t *bus = i2c_get_bus(id);
+
+    return bus->queue.active || bus->queue.head[I2C_PriorityHigh] || bus->queue.head[I2C_PriorityLow];
+}
+
+bool i2c_busy (void)
+{
+    return i2c_bus_busy(I2C_BusMain);
+}
+
+typedef struct {
+    volatile bool done;
+    bool ok;
+} i2c_wait_t;
+
+static void i2c_wait_complete (bool ok, void *context)
+{
+    ((i2c_wait_t *)context)->ok = ok;
+    ((i2c_wait_t *)context)->done = true;
+}
+
+// Queues a low priority transaction and waits for it to complete.
+// If the wait is aborted a pending transaction is removed, a started one is always waited for
+// since the descriptor and the data buffer are owned by the caller.
+static bool i2c_queue_wait (i2c_transaction_t *t)
+{
+    i2c_wait_t wait = {0};
+    i2c_bus_t *bus = i2c_get_bus(t->bus);
+
+    t->priority = I2C_PriorityLow;
+    t->callback = i2c_wait_complete;
+    t->context = &wait;
+
+    if(!i2c_queue_transaction(t))
+        return false;
+
+    while(!wait.done) {
+        i2c_poll(bus);
+        if(!hal.stream_blocking_callback()) {
+            if(i2c_queue_cancel(t))
+                return false;
+            while(!wait.done)
+                i2c_poll(bus);
+        }
+    }
+
+    return wait.ok;
+}
+
+// Waits for the running transaction to complete and claims the bus for a polled HAL call.
+static bool i2c_claim (i2c_bus_t *bus)
+{
+    bool claimed = false;
+
+    while(!claimed) {
+        __disable_irq();
+        if((claimed = bus->queue.active == NULL))
+            bus->queue.active = &bus->bus_claim;
+        __enable_irq();
+        if(!claimed) {
+            i2c_poll(bus);
+            if(!hal.stream_blocking_callback())
+                return false;
+        }
     }
 
     return true;
 }
 
+static void i2c_release (i2c_bus_t *bus)
+{
+    bus->queue.active = NULL;
+
+    i2c_queue_run(bus);
+}
+
 bool i2c_probe (i2c_address_t i2cAddr)
 {
-    return wait_ready() && HAL_I2C_IsDeviceReady(&i2c_port, i2cAddr << 1, 4, 10) == HAL_OK;
+    bool ok;
+    i2c_bus_t *bus = &i2c_bus[I2C_BusMain];
+
+    if((ok = i2c_claim(bus))) {
+        ok = HAL_I2C_IsDeviceReady(&bus->port, i2cAddr << 1, 4, 10) == HAL_OK;
+        i2c_release(bus);
     }
 
-bool i2c_send (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block)
+    return ok;
+}
+
+// Sets the bus to the fastest supported rate not above khz once the running transfer has completed.
+bool i2c_set_speed (uint32_t khz)
+{
+    bool ok;
+    i2c_bus_t *bus = &i2c_bus[I2C_BusMain];
+
+    if((ok = i2c_claim(bus))) {
+        ok = i2c_apply_speed(bus, khz);
+        i2c_release(bus);
+    }
+
+    return ok;
+}
+
+// Returns the actual SCL frequency in Hz.
+uint32_t i2c_bus_get_speed (i2c_bus_id_t id)
 {
-    if(!wait_ready())
+    return i2c_get_bus(id)->rate;
+}
+
+uint32_t i2c_get_speed (void)
+{
+    return i2c_bus_get_speed(I2C_BusMain);
+}
+
+// Tries I2C_KHZ, then the maximum rate of each slower mode, until the device acknowledges its address.
+// Returns false and restores I2C_KHZ if the device does not respond at any rate.
+bool i2c_bus_negotiate (i2c_bus_id_t id, i2c_address_t i2cAddr)
+{
+    bool ok = false;
+    uint32_t khz = I2C_KHZ;
+    uint_fast8_t idx = 0;
+    i2c_bus_t *bus = i2c_get_bus(id);
+
+    if(!i2c_claim(bus))
         return false;
 
-    bool ok = HAL_I2C_Master_Transmit_IT(&i2c_port, i2cAddr << 1, buf, size) == HAL_OK;
+    while(khz) {
+
+        if(i2c_apply_speed(bus, khz) && (ok = HAL_I2C_IsDeviceReady(&bus->port, i2cAddr << 1, 4, 10) == HAL_OK))
+            break;
+
+        while(idx < sizeof(i2c_spec) / sizeof(i2c_spec_t) && i2c_spec[idx].khz >= khz)
+            idx++;
 
-    return ok && (!block || wait_ready());
+        khz = idx < sizeof(i2c_spec) / sizeof(i2c_spec_t) ? i2c_spec[idx].khz : 0;
     }
 
-bool i2c_receive (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block)
+    if(!ok)
+        i2c_apply_speed(bus, I2C_KHZ);
+
+    i2c_release(bus);
+
+    return ok;
+}
+
+bool i2c_negotiate (i2c_address_t i2cAddr)
+{
+    return i2c_bus_negotiate(I2C_BusMain, i2cAddr);
+}
+
+// Non-blocking send and receive keep the caller's buffer, one of each may be in flight.
+static i2c_transaction_t send_async = {0}, receive_async = {0};
+static volatile bool send_pending = false, receive_pending = false;
+
+static void send_async_complete (bool ok, void *context)
+{
+    send_pending = false;
+}
+
+static void receive_async_complete (bool ok, void *context)
 {
-    if(!wait_ready())
+    receive_pending = false;
+}
+
+bool i2c_send (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block)
+{
+    i2c_transaction_t t = {
+        .op = I2C_OpSend,
+        .address = i2cAddr,
+        .data = buf,
+        .count = size
+    };
+
+    if(block)
+        return i2c_queue_wait(&t);
+
+    while(send_pending) {
+        if(!hal.stream_blocking_callback())
             return false;
+    }
+
+    t.priority = I2C_PriorityLow;
+    t.callback = send_async_complete;
+    memcpy(&send_async, &t, sizeof(i2c_transaction_t));
+
+    send_pending = true;
+    if(!i2c_queue_transaction(&send_async))
+        send_pending = false;
 
-    bool ok = HAL_I2C_Master_Receive_IT(&i2c_port, i2cAddr << 1, buf, size) == HAL_OK;
+    return send_pending;
+}
 
-    return ok && (!block || wait_ready());
+bool i2c_receive (i2c_address_t i2cAddr, uint8_t *buf, size_t size, bool block)
+{
+    i2c_transaction_t t = {
+        .op = I2C_OpReceive,
+        .address = i2cAddr,
+        .data = buf,
+        .count = size
+    };
+
+    if(block)
+        return i2c_queue_wait(&t);
+
+    while(receive_pending) {
+        if(!hal.stream_blocking_callback())
+            return false;
     }
 
-bool i2c_transfer (i2c_transfer_t *i2c, bool read)
+    t.priority = I2C_PriorityLow;
+    t.callback = receive_async_complete;
+    memcpy(&receive_async, &t, sizeof(i2c_transaction_t));
+
+    receive_pending = true;
+    if(!i2c_queue_transaction(&receive_async))
+        receive_pending = false;
+
+    return receive_pending;
+}
+
+bool i2c_bus_transfer (i2c_bus_id_t id, i2c_transfer_t *i2c, bool read)
 {
-    if(!wait_ready())
-        return false;
+    i2c_transaction_t t = {
+        .bus = id,
+        .op = read ? I2C_OpMemRead : I2C_OpMemWrite,
+        .address = i2c->address,
+        .word_addr = i2c->word_addr,
+        .word_addr_bytes = i2c->word_addr_bytes,
+        .data = i2c->data,
+        .count = i2c->count
+    };
 
-    HAL_StatusTypeDef ret;
+    return i2c_queue_wait(&t);
+}
 
-    if(read)
-        ret = HAL_I2C_Mem_Read(&i2c_port, i2c->address << 1, i2c->word_addr, i2c->word_addr_bytes == 2 ? I2C_MEMADD_SIZE_16BIT : I2C_MEMADD_SIZE_8BIT, i2c->data, i2c->count, 100);
-    else
-        ret = HAL_I2C_Mem_Write(&i2c_port, i2c->address << 1, i2c->word_addr, i2c->word_addr_bytes == 2 ? I2C_MEMADD_SIZE_16BIT : I2C_MEMADD_SIZE_8BIT, i2c->data, i2c->count, 100);
+bool i2c_transfer (i2c_transfer_t *i2c, bool read)
+{
+    return i2c_bus_transfer(I2C_BusMain, i2c, read);
+}
 
-    return ret == HAL_OK;
+static void mem_rx_complete (bool ok, void *context)
+{
+    i2c_complete_ptr callback;
+
+    if((callback = mem_rx.callback)) {
+        mem_rx.callback = NULL;
+        callback(ok, mem_rx.context);
+    }
 }
 
-bool i2c_get_keycode (i2c_address_t i2cAddr, keycode_callback_ptr callback)
+// Queues a high priority register read and returns immediately, the data buffer must stay valid until
+// the callback is called. Only one read may be in flight, returns false if the previous one has not
+// completed or the transfer is invalid. Callback is only called when true is returned.
+bool i2c_transfer_async (i2c_transfer_t *i2c, i2c_complete_ptr callback, void *context)
 {
     bool ok;
 
-    if((ok = wait_ready() && HAL_I2C_Master_Receive_IT(&i2c_port, i2cAddr << 1, &keycode, 1) == HAL_OK)) {
-    keycode = 0;
-    keypad_callback = callback;
-    }
+    __disable_irq();
+    if((ok = mem_rx.callback == NULL))
+        mem_rx.callback = callback;
+    __enable_irq();
+
+    if(!ok)
+        return false;
+
+    mem_rx.context = context;
+    mem_rx.transaction.op = I2C_OpMemRead;
+    mem_rx.transaction.priority = I2C_PriorityHigh;
+    mem_rx.transaction.address = i2c->address;
+    mem_rx.transaction.word_addr = i2c->word_addr;
+    mem_rx.transaction.word_addr_bytes = i2c->word_addr_bytes;
+    mem_rx.transaction.data = i2c->data;
+    mem_rx.transaction.count = i2c->count;
+    mem_rx.transaction.callback = mem_rx_complete;
+
+    if(!(ok = i2c_queue_transaction(&mem_rx.transaction)))
+        mem_rx.callback = NULL;
 
     return ok;
 }
 
-void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
+void HAL_I2C_MasterRxCpltCallback (I2C_HandleTypeDef *hi2c)
 {
-    if(keypad_callback && keycode != 0) {
-        keypad_callback(keycode);
+    i2c_queue_complete((i2c_bus_t *)hi2c, true);
+}
+
+void HAL_I2C_MasterTxCpltCallback (I2C_HandleTypeDef *hi2c)
+{
+    i2c_bus_t *bus = (i2c_bus_t *)hi2c;
+
+    if(!bus->queue.addr_frame)
+        i2c_queue_complete(bus, true);
+    else if(!i2c_queue_data_frame(bus))
+        i2c_queue_complete(bus, false);
+}
+
+void HAL_I2C_ErrorCallback (I2C_HandleTypeDef *hi2c)
+{
+    i2c_queue_complete((i2c_bus_t *)hi2c, false);
+}
+
+static void keycode_complete (bool ok, void *context)
+{
+    keycode_callback_ptr callback = keypad_callback;
+
+    keypad_callback = NULL;
+
+    if(ok && callback && keycode != 0)
+        callback(keycode);
+}
+
+bool i2c_get_keycode (i2c_address_t i2cAddr, keycode_callback_ptr callback)
+{
+    static i2c_transaction_t t = {
+        .op = I2C_OpReceive,
+        .priority = I2C_PriorityLow,
+        .data = &keycode,
+        .count = 1,
+        .callback = keycode_complete
+    };
+
+    if(keypad_callback)
+        return false;
+
+    keycode = 0;
+    keypad_callback = callback;
+    t.address = i2cAddr;
+
+    if(!i2c_queue_transaction(&t))
         keypad_callback = NULL;
-    }
+
+    return keypad_callback != NULL;
 }
 
 #if TRINAMIC_ENABLE && TRINAMIC_I2C
 
-static const uint8_t tmc_addr = I2C_ADR_I2CBRIDGE << 1;
+static bool tmc_transfer (uint8_t tmc_reg, uint8_t *buffer, uint16_t count, bool read)
+{
+    i2c_transaction_t t = {
+        .op = read ? I2C_OpMemRead : I2C_OpMemWrite,
+        .address = I2C_ADR_I2CBRIDGE,
+        .word_addr = tmc_reg,
+        .word_addr_bytes = 1,
+        .data = buffer,
+        .count = count
+    };
+
+    return i2c_queue_wait(&t);
+}
 
 static TMC2130_status_t TMC_I2C_ReadRegister (TMC2130_t *driver, TMC2130_datagram_t *reg)
 {
@@ -251,7 +1266,7 @@ static TMC2130_status_t TMC_I2C_ReadRegister (TMC2130_t *driver, TMC2130_datagra
         return status; // unsupported register
     }
 
-    HAL_I2C_Mem_Read(&i2c_port, tmc_addr, tmc_reg, I2C_MEMADD_SIZE_8BIT, buffer, 5, 100);
+    tmc_transfer(tmc_reg, buffer, 5, true);
 
     status.value = buffer[0];
     reg->payload.value = buffer[4];
@@ -278,7 +1293,7 @@ static TMC2130_status_t TMC_I2C_WriteRegister (TMC2130_t *driver, TMC2130_datagr
         buffer[2] = (reg->payload.value >> 8) & 0xFF;
         buffer[3] = reg->payload.value & 0xFF;
 
-        HAL_I2C_Mem_Write(&i2c_port, tmc_addr, tmc_reg, I2C_MEMADD_SIZE_8BIT, buffer, 4, 100);
+        tmc_transfer(tmc_reg, buffer, 4, false);
     }
 
     return status;
@@ -0,0 +1,165 @@
+/*
+  idle_sleep.c - WFI sleep in the main loop while the machine is idle
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Once the machine has been in Idle state for IDLE_SLEEP_DELAY ms with no input pending, no
+  planned motion, no realtime command and no EDM activity (see edm_active()), each pass of the
+  realtime loop ends in WFI until the next interrupt. Everything the controller reacts to is
+  interrupt driven (USB/UART/network input, limit and control inputs, timers) and SysTick wakes
+  the core every ms, so the loop still runs at least at 1kHz and resumes at full speed within
+  the interrupt latency. Any activity restarts the IDLE_SLEEP_DELAY period.
+
+  The checks are repeated with interrupts masked before WFI: an interrupt that arrives after
+  them stays pending, ends WFI at once and is taken after the timekeeping below is fixed up.
+
+  Peripheral clocks keep running in Sleep mode, so step, PWM and poll timers, SysTick and
+  hal.get_elapsed_ticks() are not affected. The core clock is stopped though and with it the
+  DWT cycle counter that hal.get_micros() interpolates with between SysTick interrupts: on wake
+  up the cycle count at the last tick is moved back to match the SysTick counter, which counts
+  core clock cycles as well but keeps running.
+
+  The core clock itself is not lowered: step timer, UART, SPI, I2C and CAN timing are derived
+  from clocks that would change with it.
+
+  $IDLE[=R]
+
+    [IDLE|delay_ms=,sleeps=,asleep_ms=,awake_ms=]
+*/
+
+#include "driver.h"
+
+#if IDLE_SLEEP_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
+
+#include "idle_sleep.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef IDLE_SLEEP_DELAY
+#define IDLE_SLEEP_DELAY 1000   // ms in Idle state without activity before sleeping
+#endif
+
+typedef struct {
+    uint32_t sleeps;
+    uint64_t asleep_us;
+    uint64_t since_us;          // start of the statistics period
+} idle_sleep_stats_t;
+
+extern __IO uint32_t cycle_count;
+
+static uint32_t active_ms = 0;  // last seen activity
+static idle_sleep_stats_t stats = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static inline bool idle_sleep_busy (sys_state_t state)
+{
+    return state != STATE_IDLE ||
+            sys.rt_exec_state ||
+             hal.stream.get_rx_buffer_count() ||
+              plan_get_current_block() != NULL
+#if EDM_ENABLE
+               || edm_active()
+#endif
+            ;
+}
+
+// Sets the cycle count at the last SysTick as if DWT->CYCCNT had counted through the sleep.
+static inline void idle_sleep_resync (void)
+{
+    if(!(SCB->ICSR & SCB_ICSR_PENDSTSET_Msk))   // else the SysTick handler sets it
+        cycle_count = DWT->CYCCNT - (SysTick->LOAD - SysTick->VAL);
+}
+
+static void idle_sleep_execute_realtime (sys_state_t state)
+{
+    uint64_t t;
+
+    on_execute_realtime(state);
+
+    if(idle_sleep_busy(state)) {
+        active_ms = hal.get_elapsed_ticks();
+        return;
+    }
+
+    if(hal.get_elapsed_ticks() - active_ms < IDLE_SLEEP_DELAY)
+        return;
+
+    __disable_irq();
+
+    if(!idle_sleep_busy(state)) {
+        t = hal.get_micros();
+        __DSB();
+        __WFI();
+        idle_sleep_resync();
+        stats.sleeps++;
+        stats.asleep_us += hal.get_micros() - t;
+    }
+
+    __enable_irq();
+    __ISB();
+}
+
+static status_code_t idle_sleep_command (sys_state_t state, char *args)
+{
+    char buf[100];
+    uint64_t now = hal.get_micros();
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    snprintf(buf, sizeof(buf), "[IDLE|delay_ms=%d,sleeps=%lu,asleep_ms=%lu,awake_ms=%lu]" ASCII_EOL,
+              IDLE_SLEEP_DELAY, stats.sleeps, (uint32_t)(stats.asleep_us / 1000),
+               (uint32_t)((now - stats.since_us - stats.asleep_us) / 1000));
+    hal.stream.write(buf);
+
+    if(args) {
+        memset(&stats, 0, sizeof(stats));
+        stats.since_us = now;
+    }
+
+    return Status_OK;
+}
+
+void idle_sleep_init (void)
+{
+    static const sys_command_t idle_sleep_command_list[] = {
+        {"IDLE", idle_sleep_command, {}, { .str = "report time spent in idle sleep, $IDLE=R to clear" } }
+    };
+
+    static sys_commands_t idle_sleep_commands = {
+        .n_commands = sizeof(idle_sleep_command_list) / sizeof(sys_command_t),
+        .commands = idle_sleep_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = idle_sleep_execute_realtime;
+
+    system_register_commands(&idle_sleep_commands);
+}
+
+#endif // IDLE_SLEEP_ENABLE
@@ -22,16 +22,94 @@
 #include "driver.h"
 
 #include <math.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "main.h"
+#include "mempool.h"
 #include "grbl/protocol.h"
+#include "grbl/state_machine.h"
+#if PWM_PROFILE_ENABLE
+#include "grbl/system.h"
+#endif
+#if AUX_OUT_SYNC_ENABLE
+#include "grbl/planner.h"
+#endif
+
+/*
+  M560 P<mask> Q<values>
+
+    Sets the aux outputs flagged in the P bitmask, bit n is output n as numbered for M62-M65,
+    to the states of the corresponding Q bits. Outputs on the same GPIO port switch in the same
+    instant by a single BSRR write. Not synchronized with motion, like M64/M65.
+
+  M561 P<mask> Q<values>
+
+    As M560 but synchronized with motion without a buffer sync, with AUX_OUT_SYNC_ENABLE: the
+    change is tagged with the block that will start after all blocks now in the planner and
+    applied by the stepper interrupt as that block starts, i.e. at the segment boundary where the
+    motion programmed after M561 begins. If motion stops before that block (e.g. M561 at the end
+    of a program) it is applied when Idle with the planner empty. A reset discards queued
+    changes. When the AUX_OUT_SYNC_QUEUE_SIZE - 1 entries are in use M561 waits for the buffer
+    to empty and is then applied like M62/M63.
+    The tag is an approximation as for the EDM power queue: a block that is executing and still
+    in the planner, or one fully prepared but not yet started, shifts the change by one block.
+
+  $PWMPROF=<port>,<ms>,<v0>,<v1>[,<v2>...]
+  $PWMLOOP=<port>,<ms>,<v0>,<v1>[,<v2>...]
+
+    With PWM_PROFILE_ENABLE: runs the aux PWM output <port> (the Aux out number, configured for
+    PWM) through the piecewise linear profile v0..vn, up to PWM_PROFILE_POINTS values in the
+    units of the output's min/max settings, spread evenly over <ms> milliseconds. The duty is
+    written by DMA on each timer update, $PWMPROF holds vn when done, $PWMLOOP repeats the
+    profile. E.g. $PWMPROF=0,2000,0,100 soft-starts a pump over 2 seconds.
+    $PWMPROF=<port> ends the profile and keeps the current duty, setting the output by M67 ends
+    it too. $PWMPROF reports the profile running:
+
+    [PWMPROF|port=,entries=,hold=,loop=]
+
+    hold is the number of PWM periods per entry, > 1 only on timers with a repetition counter.
+*/
+
+#define AUX_OUT_MCODE       560
+#define AUX_OUT_SYNC_MCODE  561
+#define AUX_OUT_MCODE_BITS  24      // exact in the float P and Q words
+
+#ifndef AUX_OUT_SYNC_QUEUE_SIZE
+#define AUX_OUT_SYNC_QUEUE_SIZE 16  // power of 2
+#endif
+
+#ifndef PWM_PROFILE_POINTS
+#define PWM_PROFILE_POINTS 8
+#endif
+
+#if AUX_OUT_SYNC_ENABLE
+
+typedef struct {
+    uint32_t block_tag;         // apply once blocks_started reaches this
+    uint32_t mask;
+    uint32_t values;
+} aux_out_change_t;
+
+typedef struct {
+    volatile uint32_t blocks_started;
+    volatile uint_fast8_t head; // written by the stepper interrupt only
+    volatile uint_fast8_t tail; // written by the foreground only
+    aux_out_change_t change[AUX_OUT_SYNC_QUEUE_SIZE];
+} aux_out_queue_t;
+
+static aux_out_queue_t out_queue = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+static on_reset_ptr on_reset;
+
+#endif
 
 static io_ports_data_t digital;
 static input_signal_t *aux_in;
 static output_signal_t *aux_out;
 static volatile uint32_t event_bits;
+static user_mcode_ptrs_t other_mcode_ptrs;
 
 static void digital_out_pwm (struct xbar *output, float value)
 {
@@ -40,6 +118,10 @@ static void digital_out_pwm (struct xbar *output, float value)
         uint_fast16_t pwm_value = ioports_compute_pwm_value(&aux_out[output->id].pwm->data, value);
         const pwm_signal_t *pwm = aux_out[output->id].pwm->port;
 
+#if PWM_PROFILE_ENABLE
+        pwm_profile_stop(pwm);
+#endif
+
         aux_out[output->id].pwm->value = value;
 
         if(pwm_value == aux_out[output->id].pwm->data.off_value) {
@@ -106,12 +188,12 @@ static bool digital_out_cfg (xbar_t *output, gpio_out_config_t *config, bool per
 
             pwm_out_t *pwm;
 
-            if((pwm = calloc(sizeof(pwm_out_t), 1))) {
+            if((pwm = mem_pool_alloc(sizeof(pwm_out_t)))) {
                 if((pwm->port = pwm_claim((GPIO_TypeDef *)output->port, output->pin))) {
                     pwm_enable(pwm->port);
                     aux_out[output->id].pwm = pwm;
                 } else
-                    free(pwm);
+                    mem_pool_free(pwm);
             }
 
             if(aux_out[output->id].pwm == NULL)
@@ -145,6 +227,37 @@ static void digital_out (uint8_t port, bool on)
     }
 }
 
+void ioports_digital_out_mask (uint32_t mask, uint32_t values)
+{
+    bool on;
+    uint_fast8_t port, i, n_gpio = 0;
+    uint32_t bsrr[11];              // GPIOA..GPIOK
+    GPIO_TypeDef *gpio[11];
+    output_signal_t *output;
+
+    while(mask) {
+        port = __builtin_ctz(mask);
+        on = !!(values & (1 << port));
+        mask &= mask - 1;
+
+        if(port >= digital.out.n_ports)
+            break;
+
+        output = &aux_out[ioports_map(digital.out, port)];
+
+        for(i = 0; i < n_gpio && gpio[i] != output->port; i++);
+        if(i == n_gpio) {
+            gpio[n_gpio] = output->port;
+            bsrr[n_gpio++] = 0;
+        }
+
+        bsrr[i] |= (on ^ output->mode.inverted) ? output->bit : (output->bit << 16);
+    }
+
+    for(i = 0; i < n_gpio; i++)
+        gpio[i]->BSRR = bsrr[i];
+}
+
 static float digital_out_state (xbar_t *output)
 {
     float value = -1.0f;
@@ -164,6 +277,7 @@ static bool digital_in_cfg (xbar_t *input, gpio_in_config_t *config, bool persis
         aux_in[input->id].mode.pull_mode = config->pull_mode;
         aux_in[input->id].port->PUPDR &= ~(GPIO_PUPDR_PUPD0 << (input->pin << 1));
         aux_in[input->id].port->PUPDR |= (config->pull_mode << (input->pin << 1));
+        gpio_irq_map();
 
         if(persistent)
             ioport_save_input_settings(input, config);
@@ -182,55 +296,48 @@ static float digital_in_state (xbar_t *input)
     return value;
 }
 
+// Waits are event driven: the edge interrupt of the pin latches the edge in event_bits (see
+// ioports_event()) and the wait loop runs the realtime loop between checks, so a wait ends
+// within a loop pass of the edge instead of at the next 50ms poll and the foreground stays
+// responsive meanwhile. Level waits use the edge towards the level when the pin has interrupt
+// capability so that short pulses are not missed, else the level is checked each pass.
 inline static __attribute__((always_inline)) int32_t get_input (const input_signal_t *input, wait_mode_t wait_mode, float timeout)
 {
     if(wait_mode == WaitMode_Immediate)
         return DIGITAL_IN(input->port, input->bit) ^ input->mode.inverted;
 
     int32_t value = -1;
-    uint_fast16_t delay = (uint_fast16_t)ceilf((1000.0f / 50.0f) * timeout) + 1;
+    bool irq, edge = wait_mode == WaitMode_Rise || wait_mode == WaitMode_Fall, wait_for = wait_mode != WaitMode_Low;
+    uint32_t ms = (uint32_t)ceilf(1000.0f * timeout), start = hal.get_elapsed_ticks();
+    pin_irq_mode_t irq_mode;
 
-    if(wait_mode == WaitMode_Rise || wait_mode == WaitMode_Fall) {
+    if(edge)
+        irq_mode = wait_mode == WaitMode_Rise ? IRQ_Mode_Rising : IRQ_Mode_Falling;
+    else
+        irq_mode = (wait_for ^ input->mode.inverted) ? IRQ_Mode_Rising : IRQ_Mode_Falling;
 
-        pin_irq_mode_t irq_mode = wait_mode == WaitMode_Rise ? IRQ_Mode_Rising : IRQ_Mode_Falling;
-
-        if(input->cap.irq_mode & irq_mode) {
-
-            event_bits &= ~input->bit;
-            gpio_irq_enable(input, irq_mode);
+    if(!(irq = !!(input->cap.irq_mode & irq_mode)) && edge)
+        return value;
 
-            do {
-                if(event_bits & input->bit) {
-                    value = DIGITAL_IN(input->port, input->bit) ^ input->mode.inverted;
-                    break;
-                }
-                if(delay) {
-                    protocol_execute_realtime();
-                    hal.delay_ms(50, NULL);
-                } else
-                    break;
-            } while(--delay && !sys.abort);
+    if(irq) {
+        event_bits &= ~input->bit;
+        gpio_irq_enable(input, irq_mode);
+    }
 
-            gpio_irq_enable(input, input->mode.irq_mode);    // Restore pin interrupt status
+    do {
+        if(irq && (event_bits & input->bit)) {
+            value = edge ? DIGITAL_IN(input->port, input->bit) ^ input->mode.inverted : wait_for;
+            break;
         }
+        if(!edge && (DIGITAL_IN(input->port, input->bit) ^ input->mode.inverted) == wait_for) {
+            value = wait_for;
+            break;
+        }
+        protocol_execute_realtime();
+    } while(hal.get_elapsed_ticks() - start < ms && !sys.abort);
 
-    } else {
-
-        bool wait_for = wait_mode != WaitMode_Low;
-
-        do {
-            if((DIGITAL_IN(input->port, input->bit) ^ input->mode.inverted) == wait_for) {
-                value = DIGITAL_IN(input->port, input->bit) ^ input->mode.inverted;
-                break;
-            }
-            if(delay) {
-                protocol_execute_realtime();
-                hal.delay_ms(50, NULL);
-            } else
-                break;
-        } while(--delay && !sys.abort);
-
-    }
+    if(irq)
+        gpio_irq_enable(input, input->mode.irq_mode);    // Restore pin interrupt status
 
     return value;
 }
@@ -284,6 +391,224 @@ static bool register_interrupt_handler (uint8_t port, pin_irq_mode_t irq_mode, i
     return ok;
 }
 
+#if AUX_OUT_SYNC_ENABLE
+
+inline static bool out_queue_full (void)
+{
+    return ((out_queue.tail + 1) & (AUX_OUT_SYNC_QUEUE_SIZE - 1)) == out_queue.head;
+}
+
+static void out_queue_add (uint32_t mask, uint32_t values)
+{
+    aux_out_change_t *change = &out_queue.change[out_queue.tail];
+
+    change->block_tag = out_queue.blocks_started + plan_get_block_buffer_count() + 1;
+    change->mask = mask;
+    change->values = values;
+
+    out_queue.tail = (out_queue.tail + 1) & (AUX_OUT_SYNC_QUEUE_SIZE - 1);
+}
+
+// Applies all due changes with one write per GPIO port, later ones win.
+// Interrupt context or IRQs off.
+static void out_queue_consume (bool force)
+{
+    uint32_t mask = 0, values = 0;
+    aux_out_change_t *change;
+
+    while(out_queue.head != out_queue.tail) {
+        change = &out_queue.change[out_queue.head];
+        if(!force && (int32_t)(out_queue.blocks_started - change->block_tag) < 0)
+            break;
+        mask |= change->mask;
+        values = (values & ~change->mask) | (change->values & change->mask);
+        out_queue.head = (out_queue.head + 1) & (AUX_OUT_SYNC_QUEUE_SIZE - 1);
+    }
+
+    if(mask)
+        ioports_digital_out_mask(mask, values);
+}
+
+ITCM_CODE void ioports_block_started (void)
+{
+    out_queue.blocks_started++;
+    out_queue_consume(false);
+}
+
+static void out_queue_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    // Motion stopped before the tagged block was reached, apply now.
+    if(out_queue.head != out_queue.tail && state == STATE_IDLE && plan_get_block_buffer_count() == 0) {
+        __disable_irq();
+        out_queue_consume(true);
+        __enable_irq();
+    }
+}
+
+static void out_queue_reset (void)
+{
+    out_queue.head = out_queue.tail;
+
+    if(on_reset)
+        on_reset();
+}
+
+#endif // AUX_OUT_SYNC_ENABLE
+
+#if PWM_PROFILE_ENABLE
+
+static status_code_t pwm_profile_run (char *args, bool loop)
+{
+    char *end;
+    uint_fast8_t n_points = 0;
+    uint32_t port, ms, points[PWM_PROFILE_POINTS];
+    float value = 0.0f;
+    pwm_out_t *pwm;
+
+    port = strtoul(args, &end, 10);
+    if(end == args || (*end != ',' && *end != '\0'))
+        return Status_BadNumberFormat;
+
+    if(port >= digital.out.n_ports || (pwm = aux_out[port].pwm) == NULL || !aux_out[port].mode.pwm)
+        return Status_InvalidStatement;
+
+    if(*end == '\0') {
+        pwm_profile_stop(pwm->port);
+        return Status_OK;
+    }
+
+    ms = strtoul(args = end + 1, &end, 10);
+    if(end == args || *end != ',' || ms == 0)
+        return Status_BadNumberFormat;
+
+    while(*end == ',') {
+        if(n_points == PWM_PROFILE_POINTS)
+            return Status_GcodeValueOutOfRange;
+        value = strtof(args = end + 1, &end);
+        if(end == args)
+            return Status_BadNumberFormat;
+        points[n_points] = ioports_compute_pwm_value(&pwm->data, value);
+        if(points[n_points] == pwm->data.off_value)
+            points[n_points] = 0;
+        n_points++;
+    }
+
+    if(*end != '\0')
+        return Status_BadNumberFormat;
+
+    if(n_points < 2 || !pwm_profile_start(pwm->port, points, n_points, ms, loop))
+        return Status_GcodeValueOutOfRange;
+
+    pwm->value = value;
+
+    return Status_OK;
+}
+
+static status_code_t pwm_profile_command (sys_state_t state, char *args)
+{
+    bool loop;
+    char buf[64];
+    int32_t port = -1;
+    uint32_t hold;
+    uint_fast16_t entries, idx = digital.out.n_ports;
+
+    if(args)
+        return pwm_profile_run(args, false);
+
+    if(pwm_profile_active(NULL)) do {
+        idx--;
+        if(aux_out[idx].pwm && pwm_profile_active(aux_out[idx].pwm->port))
+            port = (int32_t)idx;
+    } while(idx && port < 0);
+
+    entries = port < 0 ? 0 : pwm_profile_info(&hold, &loop);
+
+    snprintf(buf, sizeof(buf), "[PWMPROF|port=%ld,entries=%u,hold=%lu,loop=%d]" ASCII_EOL,
+              port, (unsigned int)entries, entries ? hold : 0, entries && loop);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+static status_code_t pwm_loop_command (sys_state_t state, char *args)
+{
+    return args ? pwm_profile_run(args, true) : Status_InvalidStatement;
+}
+
+#endif // PWM_PROFILE_ENABLE
+
+static user_mcode_type_t mcode_check (user_mcode_t mcode)
+{
+    return mcode == AUX_OUT_MCODE
+#if AUX_OUT_SYNC_ENABLE
+            || mcode == AUX_OUT_SYNC_MCODE
+#endif
+            ? UserMCode_Normal
+            : (other_mcode_ptrs.check ? other_mcode_ptrs.check(mcode) : UserMCode_Unsupported);
+}
+
+static status_code_t mcode_validate (parser_block_t *gc_block)
+{
+    float limit;
+
+    if(!(gc_block->user_mcode == AUX_OUT_MCODE
+#if AUX_OUT_SYNC_ENABLE
+          || gc_block->user_mcode == AUX_OUT_SYNC_MCODE
+#endif
+        ))
+        return other_mcode_ptrs.validate ? other_mcode_ptrs.validate(gc_block) : Status_Unhandled;
+
+    if(!(gc_block->words.p && gc_block->words.q))
+        return Status_GcodeValueWordMissing;
+
+    limit = (float)((1UL << min(hal.port.num_digital_out, AUX_OUT_MCODE_BITS)) - 1);
+
+    if(gc_block->values.p != truncf(gc_block->values.p) || gc_block->values.p < 1.0f || gc_block->values.p > limit ||
+        gc_block->values.q != truncf(gc_block->values.q) || gc_block->values.q < 0.0f || gc_block->values.q > limit)
+        return Status_GcodeValueOutOfRange;
+
+    gc_block->words.p = gc_block->words.q = Off;
+
+#if AUX_OUT_SYNC_ENABLE
+    if(gc_block->user_mcode == AUX_OUT_SYNC_MCODE) {
+        // L flags a queued change, a full queue falls back to a buffer sync.
+        gc_block->values.l = !out_queue_full();
+        gc_block->user_mcode_sync = !gc_block->values.l;
+    }
+#endif
+
+    return Status_OK;
+}
+
+static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
+{
+    switch(gc_block->user_mcode) {
+
+        case AUX_OUT_MCODE:
+            if(state != STATE_CHECK_MODE)
+                ioports_digital_out_mask((uint32_t)gc_block->values.p, (uint32_t)gc_block->values.q);
+            break;
+
+#if AUX_OUT_SYNC_ENABLE
+        case AUX_OUT_SYNC_MCODE:
+            if(state == STATE_CHECK_MODE)
+                break;
+            if(gc_block->values.l && !out_queue_full())
+                out_queue_add((uint32_t)gc_block->values.p, (uint32_t)gc_block->values.q);
+            else
+                ioports_digital_out_mask((uint32_t)gc_block->values.p, (uint32_t)gc_block->values.q);
+            break;
+#endif
+
+        default:
+            if(other_mcode_ptrs.execute)
+                other_mcode_ptrs.execute(state, gc_block);
+            break;
+    }
+}
+
 static xbar_t *get_pin_info (io_port_type_t type, io_port_direction_t dir, uint8_t port)
 {
     static xbar_t pin;
@@ -420,9 +745,40 @@ void ioports_init (pin_group_pins_t *aux_inputs, pin_group_pins_t *aux_outputs)
             hal.port.register_interrupt_handler = register_interrupt_handler;
         }
 
-        if(digital.out.n_ports)
+        if(digital.out.n_ports) {
             hal.port.digital_out = digital_out;
 
+            memcpy(&other_mcode_ptrs, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+            grbl.user_mcode.check = mcode_check;
+            grbl.user_mcode.validate = mcode_validate;
+            grbl.user_mcode.execute = mcode_execute;
+
+#if AUX_OUT_SYNC_ENABLE
+            on_execute_realtime = grbl.on_execute_realtime;
+            grbl.on_execute_realtime = out_queue_execute_realtime;
+
+            on_reset = grbl.on_reset;
+            grbl.on_reset = out_queue_reset;
+#endif
+        }
+
+#if PWM_PROFILE_ENABLE
+        if(digital.out.n_ports) {
+
+            static const sys_command_t pwm_profile_command_list[] = {
+                {"PWMPROF", pwm_profile_command, {}, { .str = "run an aux PWM output through a duty profile, $PWMPROF=<port>,<ms>,<v0>,<v1>..." } },
+                {"PWMLOOP", pwm_loop_command, {}, { .str = "repeat an aux PWM output duty profile, $PWMLOOP=<port>,<ms>,<v0>,<v1>..." } }
+            };
+
+            static sys_commands_t pwm_profile_commands = {
+                .n_commands = sizeof(pwm_profile_command_list) / sizeof(sys_command_t),
+                .commands = pwm_profile_command_list
+            };
+
+            system_register_commands(&pwm_profile_commands);
+        }
+#endif
+
         hal.port.claim = claim;
         hal.port.swap_pins = swap_pins;
         hal.port.get_pin_info = get_pin_info;
@@ -21,23 +21,7 @@
 
 #include "driver.h"
 
-#if AUX_ANALOG
-
-#ifdef AUXOUTPUT0_PWM_PORT
-#define PWM_OUT0 1
-#else
-#define PWM_OUT0 0
-#endif
-
-#ifdef AUXOUTPUT1_PWM_PORT
-#define PWM_OUT1 1
-#else
-#define PWM_OUT1 0
-#endif
-
-#define AUX_ANALOG_OUT (PWM_OUT0 + PWM_OUT1)
-
-#include "grbl/ioports.h"
+#if AUX_ANALOG || EDM_GAP_ADC_ENABLE
 
 typedef struct {
     GPIO_TypeDef *port;
@@ -79,6 +63,191 @@ static const adc_map_t adc_map[] = {
     { GPIOF, 14,   2, ADC2, ADC_CHANNEL_6 }
 };
 
+bool adc_get_channel (GPIO_TypeDef *port, uint8_t pin, ADC_TypeDef **adc, uint32_t *channel)
+{
+    uint_fast8_t idx = sizeof(adc_map) / sizeof(adc_map_t);
+
+    do {
+        idx--;
+        if(adc_map[idx].port == port && adc_map[idx].pin == pin) {
+            *adc = adc_map[idx].adc;
+            *channel = adc_map[idx].ch;
+            return true;
+        }
+    } while(idx);
+
+    return false;
+}
+
+#endif // AUX_ANALOG || EDM_GAP_ADC_ENABLE
+
+#if AUX_ANALOG
+
+#ifdef AUXOUTPUT0_PWM_PORT
+#define PWM_OUT0 1
+#else
+#define PWM_OUT0 0
+#endif
+
+#ifdef AUXOUTPUT1_PWM_PORT
+#define PWM_OUT1 1
+#else
+#define PWM_OUT1 0
+#endif
+
+#define AUX_ANALOG_OUT (PWM_OUT0 + PWM_OUT1)
+
+#include "grbl/ioports.h"
+
+#include "mempool.h"
+
+#if AUX_ANALOG_SCAN
+
+/*
+ * Each ADC with claimed inputs scans its channels continuously, hardware oversampling averages
+ * ADC_SCAN_OVERSAMPLING conversions per channel and circular DMA keeps the latest result of
+ * every channel in memory. Results are kept at 12 bits, the same scale as single conversions.
+ */
+
+#include "cache.h"
+
+#ifndef ADC_SCAN_OVERSAMPLING
+#define ADC_SCAN_OVERSAMPLING 64 // power of 2, max 1024 (256 for ADC3 on H72x/H73x)
+#endif
+#ifndef ADC_SCAN_SAMPLETIME
+#define ADC_SCAN_SAMPLETIME ADC_SAMPLETIME_64CYCLES_5
+#endif
+
+#if (ADC_SCAN_OVERSAMPLING & (ADC_SCAN_OVERSAMPLING - 1)) != 0 || ADC_SCAN_OVERSAMPLING < 2 || ADC_SCAN_OVERSAMPLING > 1024
+#error "ADC_SCAN_OVERSAMPLING must be a power of 2 in the range 2 - 1024!"
+#endif
+
+#define ADC_SCAN_CHANNELS 16
+#define ADC_SCAN_SHIFT (31 - __builtin_clz(ADC_SCAN_OVERSAMPLING))
+
+typedef struct {
+    ADC_HandleTypeDef adc;
+    DMA_HandleTypeDef dma;
+    uint_fast8_t n_channels;
+    uint32_t channel[ADC_SCAN_CHANNELS];
+} adc_scan_t;
+
+static const uint32_t scan_rank[ADC_SCAN_CHANNELS] = {
+    ADC_REGULAR_RANK_1, ADC_REGULAR_RANK_2, ADC_REGULAR_RANK_3, ADC_REGULAR_RANK_4,
+    ADC_REGULAR_RANK_5, ADC_REGULAR_RANK_6, ADC_REGULAR_RANK_7, ADC_REGULAR_RANK_8,
+    ADC_REGULAR_RANK_9, ADC_REGULAR_RANK_10, ADC_REGULAR_RANK_11, ADC_REGULAR_RANK_12,
+    ADC_REGULAR_RANK_13, ADC_REGULAR_RANK_14, ADC_REGULAR_RANK_15, ADC_REGULAR_RANK_16
+};
+
+static adc_scan_t *adc_scan[3] = {0};
+static DMA_BUFFER uint32_t scan_result[3][ADC_SCAN_CHANNELS];
+
+static inline uint_fast8_t scan_idx (ADC_TypeDef *adc)
+{
+    return adc == ADC1 ? 0 : (adc == ADC2 ? 1 : 2);
+}
+
+static inline float scan_value (input_signal_t *input)
+{
+    dma_buffer_invalidate(input->adc_value, sizeof(uint32_t));
+
+    return (float)*input->adc_value;
+}
+
+// Adds the channel to the scan sequence of its ADC, returns the result slot or NULL if the sequence is full.
+static volatile uint32_t *scan_add (const adc_map_t *map)
+{
+    adc_scan_t *scan;
+    uint_fast8_t idx = scan_idx(map->adc);
+
+    if((scan = adc_scan[idx]) == NULL && (scan = adc_scan[idx] = mem_boot_alloc(sizeof(adc_scan_t))))
+        scan->adc.Instance = map->adc;
+
+    if(scan == NULL || scan->n_channels == ADC_SCAN_CHANNELS)
+        return NULL;
+
+    scan->channel[scan->n_channels] = map->ch;
+
+    return &scan_result[idx][scan->n_channels++];
+}
+
+static bool scan_start (uint_fast8_t idx)
+{
+    static DMA_Stream_TypeDef *const stream[3] = { DMA2_Stream2, DMA2_Stream3, DMA2_Stream4 };
+    static const uint32_t request[3] = { DMA_REQUEST_ADC1, DMA_REQUEST_ADC2, DMA_REQUEST_ADC3 };
+
+    uint_fast8_t i;
+    adc_scan_t *scan = adc_scan[idx];
+    ADC_ChannelConfTypeDef adc_config = {
+        .SamplingTime = ADC_SCAN_SAMPLETIME,
+        .SingleDiff = ADC_SINGLE_ENDED,
+        .OffsetNumber = ADC_OFFSET_NONE
+    };
+
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    scan->dma.Instance = stream[idx];
+    scan->dma.Init.Request = request[idx];
+    scan->dma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    scan->dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    scan->dma.Init.MemInc = DMA_MINC_ENABLE;
+    scan->dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    scan->dma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    scan->dma.Init.Mode = DMA_CIRCULAR;
+    scan->dma.Init.Priority = DMA_PRIORITY_LOW;
+    scan->dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&scan->dma) != HAL_OK)
+        return false;
+
+    __HAL_LINKDMA(&scan->adc, DMA_Handle, scan->dma);
+
+    scan->adc.Init.ClockPrescaler = ADC_CLOCK_SYNC_PCLK_DIV4;
+    scan->adc.Init.Resolution = ADC_RESOLUTION_12B;
+    scan->adc.Init.ScanConvMode = ADC_SCAN_ENABLE;
+    scan->adc.Init.ContinuousConvMode = ENABLE;
+    scan->adc.Init.DiscontinuousConvMode = DISABLE;
+    scan->adc.Init.ExternalTrigConvEdge = ADC_EXTERNALTRIGCONVEDGE_NONE;
+    scan->adc.Init.ExternalTrigConv = ADC_SOFTWARE_START;
+    scan->adc.Init.NbrOfConversion = scan->n_channels;
+    scan->adc.Init.EOCSelection = ADC_EOC_SEQ_CONV;
+    scan->adc.Init.Overrun = ADC_OVR_DATA_OVERWRITTEN;
+    scan->adc.Init.ConversionDataManagement = ADC_CONVERSIONDATA_DMA_CIRCULAR;
+    scan->adc.Init.OversamplingMode = ENABLE;
+    scan->adc.Init.Oversampling.Ratio = ADC_SCAN_OVERSAMPLING;
+    scan->adc.Init.Oversampling.RightBitShift = ADC_SCAN_SHIFT << ADC_CFGR2_OVSS_Pos;
+    scan->adc.Init.Oversampling.TriggeredMode = ADC_TRIGGEREDMODE_SINGLE_TRIGGER;
+    scan->adc.Init.Oversampling.OversamplingStopReset = ADC_REGOVERSAMPLING_CONTINUED_MODE;
+#if defined(ADC_VER_V5_V90)
+    if(scan->adc.Instance == ADC3) {
+  #if ADC_SCAN_OVERSAMPLING > 256
+        scan->adc.Init.Oversampling.Ratio = ADC3_OVERSAMPLING_RATIO_256;
+        scan->adc.Init.Oversampling.RightBitShift = ADC_RIGHTBITSHIFT_8;
+  #else
+        scan->adc.Init.Oversampling.Ratio = (ADC_SCAN_SHIFT - 1) << ADC3_CFGR2_OVSR_Pos;
+  #endif
+        scan->adc.Init.DataAlign = ADC3_DATAALIGN_RIGHT;
+        scan->adc.Init.DMAContinuousRequests = ENABLE;
+    }
+#endif
+
+    if(HAL_ADC_Init(&scan->adc) != HAL_OK)
+        return false;
+
+    for(i = 0; i < scan->n_channels; i++) {
+        adc_config.Channel = scan->channel[i];
+        adc_config.Rank = scan_rank[i];
+        if(HAL_ADC_ConfigChannel(&scan->adc, &adc_config) != HAL_OK)
+            return false;
+    }
+
+    HAL_ADCEx_Calibration_Start(&scan->adc, ADC_CALIB_OFFSET, ADC_SINGLE_ENDED);
+
+    return HAL_ADC_Start_DMA(&scan->adc, (uint32_t *)scan_result[idx], scan->n_channels) == HAL_OK;
+}
+
+#endif // AUX_ANALOG_SCAN
+
 static io_ports_data_t analog;
 static input_signal_t *aux_in_analog;
 static output_signal_t *aux_out_analog;
@@ -161,12 +330,12 @@ static bool init_pwm (xbar_t *output, pwm_config_t *config, bool persistent)
 
         pwm_out_t *pwm;
 
-        if((pwm = calloc(sizeof(pwm_out_t), 1))) {
+        if((pwm = mem_pool_alloc(sizeof(pwm_out_t)))) {
             if((pwm->port = pwm_claim((GPIO_TypeDef *)output->port, output->pin))) {
                 pwm_enable(pwm->port);
                 aux_out_analog[output->id].pwm = pwm;
             } else
-                free(pwm);
+                mem_pool_free(pwm);
         }
     }
 
@@ -207,9 +376,14 @@ static float analog_in_state (xbar_t *input)
 #else
     if(input->id < analog.in.n_ports) {
 #endif
+#if AUX_ANALOG_SCAN
+        if(aux_in_analog[input->id].adc_value)
+            value = scan_value(&aux_in_analog[input->id]);
+#else
         HAL_ADC_Start(aux_in_analog[input->id].adc);
         if(HAL_ADC_PollForConversion(aux_in_analog[input->id].adc, 2) == HAL_OK)
             value = HAL_ADC_GetValue(aux_in_analog[input->id].adc);
+#endif
     }
 
     return value;
@@ -234,11 +408,16 @@ static int32_t wait_on_input (io_port_type_t type, uint8_t port, wait_mode_t wai
         value = (int32_t)MCP3221_read();
     else
 #endif
+#if AUX_ANALOG_SCAN
+    if(port < analog.in.n_ports && aux_in_analog[port].adc_value)
+        value = (int32_t)scan_value(&aux_in_analog[port]);
+#else
     if(port < analog.in.n_ports && aux_in_analog[port].adc) {
         HAL_ADC_Start(aux_in_analog[port].adc);
         if(HAL_ADC_PollForConversion(aux_in_analog[port].adc, 2) == HAL_OK)
             value = HAL_ADC_GetValue(aux_in_analog[port].adc);
     }
+#endif
 
     return value;
 }
@@ -452,6 +631,13 @@ void ioports_init_analog (pin_group_pins_t *aux_inputs, pin_group_pins_t *aux_ou
             };
 
             uint_fast8_t i;
+#if EDM_GAP_ADC_ENABLE
+            uint32_t gap_channel;
+            ADC_TypeDef *gap_adc = NULL;
+
+            // The gap voltage ADC is triggered by its own timer, inputs on it are not available.
+            adc_get_channel(EDM_GAP_ADC_PORT, EDM_GAP_ADC_PIN, &gap_adc, &gap_channel);
+#endif
 
             for(i = 0; i < p_pins; i++) {
 
@@ -461,9 +647,29 @@ void ioports_init_analog (pin_group_pins_t *aux_inputs, pin_group_pins_t *aux_ou
                     j--;
                     if(adc_map[j].port == aux_inputs->pins.inputs[i].port && adc_map[j].pin == aux_inputs->pins.inputs[i].pin) {
 
+#if EDM_GAP_ADC_ENABLE
+                        if(adc_map[j].adc == gap_adc) {
+                            analog.in.n_ports--;
+                            break;
+                        }
+#endif
+#if AUX_ANALOG_SCAN
+                        if(adc_map[j].alt == 3)
+                            __HAL_RCC_ADC3_CLK_ENABLE();
+                        else
+                            __HAL_RCC_ADC12_CLK_ENABLE();
+
+                        gpio_init.Pin = aux_inputs->pins.inputs[i].bit;
+                        HAL_GPIO_Init(aux_inputs->pins.inputs[i].port, &gpio_init);
+
+                        if((aux_inputs->pins.inputs[i].adc_value = scan_add(&adc_map[j])))
+                            aux_inputs->pins.inputs[i].adc = &adc_scan[scan_idx(adc_map[j].adc)]->adc;
+                        else
+                            analog.in.n_ports--;
+#else
                         ADC_HandleTypeDef *adc;
 
-                        if((adc = calloc(sizeof(ADC_HandleTypeDef), 1))) {
+                        if((adc = mem_boot_alloc(sizeof(ADC_HandleTypeDef)))) {
 
                             if(adc_map[j].alt == 3)
                                 __HAL_RCC_ADC3_CLK_ENABLE();
@@ -492,10 +698,26 @@ void ioports_init_analog (pin_group_pins_t *aux_inputs, pin_group_pins_t *aux_ou
                             else
                                 analog.in.n_ports--;
                         }
+#endif
                         break;
                     }
                 } while(j);
             }
+
+#if AUX_ANALOG_SCAN
+            for(i = 0; i < sizeof(adc_scan) / sizeof(adc_scan_t *); i++) {
+                if(adc_scan[i] && !scan_start(i)) {
+                    uint_fast8_t k;
+                    for(k = 0; k < p_pins; k++) {
+                        if(aux_inputs->pins.inputs[k].adc == &adc_scan[i]->adc) {
+                            aux_inputs->pins.inputs[k].adc = NULL;
+                            aux_inputs->pins.inputs[k].adc_value = NULL;
+                            analog.in.n_ports--;
+                        }
+                    }
+                }
+            }
+#endif
         }
 
         if(analog.in.n_ports) {
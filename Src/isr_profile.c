@@ -0,0 +1,126 @@
+/*
+
+  isr_profile.c - DWT cycle counter based interrupt handler profiling
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  $ISRPROF   - report per handler invocation count and min/avg/max execution time:
+               [ISR|<name>,n=<count>,min=<cycles>,avg=<cycles>,max=<cycles>,max_us=<us>]
+               [ISRLAT|stepper,n=<count>,max=<timer ticks>,max_ns=<ns>]
+               worst-case stepper timer interrupt entry latency, measured from the timer counter
+  $ISRPROF=R - report, then reset all counters
+*/
+
+#include "driver.h"
+#include "isr_profile.h"
+
+#if ISR_PROFILE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+isr_profile_t isr_profile[IsrProfile_N];
+isr_latency_t isr_latency_stepper;
+
+static const char *const isr_name[IsrProfile_N] = {
+    [IsrProfile_Stepper]   = "stepper",
+    [IsrProfile_Pulse]     = "pulse",
+    [IsrProfile_EXTI0]     = "exti0",
+    [IsrProfile_EXTI1]     = "exti1",
+    [IsrProfile_EXTI2]     = "exti2",
+    [IsrProfile_EXTI3]     = "exti3",
+    [IsrProfile_EXTI4]     = "exti4",
+    [IsrProfile_EXTI9_5]   = "exti9_5",
+    [IsrProfile_EXTI15_10] = "exti15_10",
+    [IsrProfile_UART0]     = "uart0"
+};
+
+static void isr_profile_reset (void)
+{
+    uint_fast8_t idx;
+
+    __disable_irq();
+    for(idx = 0; idx < IsrProfile_N; idx++) {
+        memset(&isr_profile[idx], 0, sizeof(isr_profile_t));
+        isr_profile[idx].min = UINT32_MAX;
+    }
+    isr_latency_stepper.count = isr_latency_stepper.max = 0;
+    __enable_irq();
+}
+
+static status_code_t isr_profile_report (sys_state_t state, char *args)
+{
+    char buf[100];
+    uint_fast8_t idx;
+    isr_profile_t p;
+    isr_latency_t l;
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < IsrProfile_N; idx++) {
+
+        __disable_irq();
+        memcpy(&p, &isr_profile[idx], sizeof(isr_profile_t));
+        __enable_irq();
+
+        if(p.count == 0)
+            continue;
+
+        snprintf(buf, sizeof(buf), "[ISR|%s,n=%lu,min=%lu,avg=%lu,max=%lu,max_us=%lu]" ASCII_EOL,
+                  isr_name[idx], p.count, p.min, (uint32_t)(p.total / p.count), p.max, p.max / hal.f_mcu);
+        hal.stream.write(buf);
+    }
+
+    __disable_irq();
+    l = isr_latency_stepper;
+    __enable_irq();
+
+    if(l.count) {
+        snprintf(buf, sizeof(buf), "[ISRLAT|stepper,n=%lu,max=%lu,max_ns=%lu]" ASCII_EOL,
+                  l.count, l.max, (uint32_t)((uint64_t)l.max * 1000000000ULL / hal.f_step_timer));
+        hal.stream.write(buf);
+    }
+
+    if(args)
+        isr_profile_reset();
+
+    return Status_OK;
+}
+
+void isr_profile_init (void)
+{
+    static const sys_command_t isr_command_list[] = {
+        {"ISRPROF", isr_profile_report, {}, { .str = "report ISR execution times, $ISRPROF=R to reset" } }
+    };
+
+    static sys_commands_t isr_commands = {
+        .n_commands = sizeof(isr_command_list) / sizeof(sys_command_t),
+        .commands = isr_command_list
+    };
+
+    isr_profile_reset();
+
+    system_register_commands(&isr_commands);
+}
+
+#endif // ISR_PROFILE_ENABLE
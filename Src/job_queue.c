@@ -0,0 +1,315 @@
+/*
+  job_queue.c - stored programs run back to back from the SD card
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Up to JOB_QUEUE_SIZE programs are queued with an optional setup block each, e.g. the EDM recipe
+  to run (M567 S1) or M503/M504 parameters. Once started the queue runs the jobs in order
+  through sd_stream_run(), without the host: each job is fed to the parser as its setup block,
+  then the JOB_QUEUE_TOUCHOFF block (M572 by default with EDM_TOUCHOFF_ENABLE), then the file.
+  The next job starts from the realtime loop when the previous file has been read completely and
+  the machine is idle with the planner empty.
+
+  A job ended by a reset, an alarm or a read error stops the queue, the remaining jobs stay
+  queued for $JOBQ=S after the cause has been dealt with. A job that cannot be started (missing
+  file) is marked failed and the queue continues with the next.
+
+  Each finished job is reported and appended to JOB_QUEUE_LOG on the card:
+
+    <uptime s>,<file>,<done|aborted|failed>,<run time s>
+
+  $JOBQ                       - report: [JOBQ|running=,paused=,jobs=]
+                                        [JOB|<n>,<file>,<queued|running|done|aborted|failed>,<run s>,<setup>]
+  $JOBQ=+<file>[|<setup>]     - queue a job, the setup block is a single G-code line
+  $JOBQ=S                     - start, or continue after a stop or pause
+  $JOBQ=P                     - pause: the running job completes, the next is not started
+  $JOBQ=C                     - remove finished and queued jobs, not while running
+*/
+
+#include "driver.h"
+
+#if JOB_QUEUE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ff.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
+
+#include "job_queue.h"
+#include "sd_stream.h"
+
+#ifndef JOB_QUEUE_SIZE
+#define JOB_QUEUE_SIZE 16
+#endif
+#ifndef JOB_QUEUE_TOUCHOFF
+#if EDM_TOUCHOFF_ENABLE
+#define JOB_QUEUE_TOUCHOFF "M572"
+#else
+#define JOB_QUEUE_TOUCHOFF ""
+#endif
+#endif
+#ifndef JOB_QUEUE_LOG
+#define JOB_QUEUE_LOG "/jobq.log"
+#endif
+
+typedef enum {
+    Job_Queued = 0,
+    Job_Running,
+    Job_Done,
+    Job_Aborted,
+    Job_Failed
+} job_state_t;
+
+typedef struct {
+    char file[32];
+    char setup[48];
+    job_state_t state;
+    uint32_t start_ms;
+    uint32_t run_ms;
+} job_t;
+
+static struct {
+    job_t job[JOB_QUEUE_SIZE];
+    uint_fast8_t n;
+    uint_fast8_t cur;           // running job
+    bool running;
+    bool paused;
+    volatile bool ended;        // file of the running job read or aborted
+    volatile bool completed;
+    char preamble[sizeof(((job_t *)0)->setup) + sizeof(JOB_QUEUE_TOUCHOFF) + 2];
+} jq = {0};
+
+static on_execute_realtime_ptr on_execute_realtime;
+
+static const char *state_name (job_state_t state)
+{
+    static const char *const names[] = { "queued", "running", "done", "aborted", "failed" };
+
+    return names[state];
+}
+
+static void job_log (job_t *job)
+{
+    FIL file;
+    UINT bw;
+    char buf[100];
+    int len = snprintf(buf, sizeof(buf), "%lu,%s,%s,%lu\n", hal.get_elapsed_ticks() / 1000,
+                        job->file, state_name(job->state), job->run_ms / 1000);
+
+    if(len > 0 && f_open(&file, JOB_QUEUE_LOG, FA_WRITE|FA_OPEN_APPEND) == FR_OK) {
+        f_write(&file, buf, (UINT)len, &bw);
+        f_close(&file);
+    }
+
+    snprintf(buf, sizeof(buf), "JOBQ: %s %s", job->file, state_name(job->state));
+    report_message(buf, job->state == Job_Done ? Message_Plain : Message_Warning);
+}
+
+static void job_finish (job_t *job, job_state_t state)
+{
+    job->state = state;
+    job->run_ms = hal.get_elapsed_ticks() - job->start_ms;
+    job_log(job);
+}
+
+static void job_ended (bool completed)
+{
+    jq.completed = completed;
+    jq.ended = true;
+}
+
+static void job_start_next (void)
+{
+    job_t *job;
+
+    while(jq.cur < jq.n) {
+
+        job = &jq.job[jq.cur];
+
+        if(job->state != Job_Queued) {
+            jq.cur++;
+            continue;
+        }
+
+        if(jq.paused) {
+            jq.running = false;
+            report_message("JOBQ: paused", Message_Plain);
+            return;
+        }
+
+        snprintf(jq.preamble, sizeof(jq.preamble), "%s%s%s%s", job->setup, *job->setup ? "\n" : "",
+                  JOB_QUEUE_TOUCHOFF, *JOB_QUEUE_TOUCHOFF ? "\n" : "");
+
+        jq.ended = jq.completed = false;
+        job->start_ms = hal.get_elapsed_ticks();
+
+        if(sd_stream_run(job->file, jq.preamble, job_ended) == Status_OK) {
+            job->state = Job_Running;
+            return;
+        }
+
+        job_finish(job, Job_Failed);
+        jq.cur++;
+    }
+
+    jq.running = false;
+    report_message("JOBQ: done", Message_Plain);
+}
+
+static void job_queue_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(!jq.running)
+        return;
+
+    if(jq.cur < jq.n && jq.job[jq.cur].state == Job_Running) {
+
+        job_t *job = &jq.job[jq.cur];
+
+        if(!jq.ended && !(state & STATE_ALARM))
+            return;
+
+        if(!jq.completed || (state & STATE_ALARM)) {
+            job_finish(job, Job_Aborted);
+            jq.cur++;
+            jq.running = false;
+            return;
+        }
+
+        if(state != STATE_IDLE || plan_get_block_buffer_count())
+            return;
+
+        job_finish(job, Job_Done);
+        jq.cur++;
+    }
+
+    if(state == STATE_IDLE)
+        job_start_next();
+}
+
+static status_code_t job_queue_command (sys_state_t state, char *args)
+{
+    char buf[140];
+    uint_fast8_t idx;
+
+    if(args == NULL) {
+
+        snprintf(buf, sizeof(buf), "[JOBQ|running=%d,paused=%d,jobs=%u]" ASCII_EOL, jq.running, jq.paused, (unsigned int)jq.n);
+        hal.stream.write(buf);
+
+        for(idx = 0; idx < jq.n; idx++) {
+            job_t *job = &jq.job[idx];
+            snprintf(buf, sizeof(buf), "[JOB|%u,%s,%s,%lu,%s]" ASCII_EOL, (unsigned int)idx + 1, job->file, state_name(job->state),
+                      (job->state == Job_Running ? hal.get_elapsed_ticks() - job->start_ms : job->run_ms) / 1000, job->setup);
+            hal.stream.write(buf);
+        }
+
+        return Status_OK;
+    }
+
+    if(args[0] == '+') {
+
+        char *setup = strchr(++args, '|');
+        job_t *job;
+
+        if(setup)
+            *setup++ = '\0';
+
+        if(*args == '\0' || strlen(args) >= sizeof(job->file) || (setup && strlen(setup) >= sizeof(job->setup)))
+            return Status_InvalidStatement;
+
+        if(jq.n == JOB_QUEUE_SIZE) {
+            // Make room by dropping finished jobs, if any
+            uint_fast8_t keep = 0;
+            for(idx = 0; idx < jq.n; idx++) {
+                if(jq.job[idx].state == Job_Queued || jq.job[idx].state == Job_Running)
+                    jq.job[keep++] = jq.job[idx];
+                else if(idx < jq.cur)
+                    jq.cur--;
+            }
+            if((jq.n = keep) == JOB_QUEUE_SIZE)
+                return Status_InvalidStatement;
+        }
+
+        job = &jq.job[jq.n];
+        memset(job, 0, sizeof(job_t));
+        strcpy(job->file, args);
+        if(setup)
+            strcpy(job->setup, setup);
+        jq.n++;
+
+        return Status_OK;
+    }
+
+    if(args[1] != '\0')
+        return Status_InvalidStatement;
+
+    switch(args[0]) {
+
+        case 'S':
+            if(!jq.running) {
+                if(state != STATE_IDLE)
+                    return Status_IdleError;
+                jq.paused = false;
+                jq.running = true;
+                jq.cur = 0;
+            }
+            break;
+
+        case 'P':
+            jq.paused = true;
+            break;
+
+        case 'C':
+            if(jq.running)
+                return Status_IdleError;
+            jq.n = jq.cur = 0;
+            break;
+
+        default:
+            return Status_InvalidStatement;
+    }
+
+    return Status_OK;
+}
+
+void job_queue_init (void)
+{
+    static const sys_command_t job_queue_command_list[] = {
+        {"JOBQ", job_queue_command, {}, { .str = "job queue, $JOBQ=+<file>[|<setup>] adds, =S starts, =P pauses, =C clears" } }
+    };
+
+    static sys_commands_t job_queue_commands = {
+        .n_commands = sizeof(job_queue_command_list) / sizeof(sys_command_t),
+        .commands = job_queue_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = job_queue_execute_realtime;
+
+    system_register_commands(&job_queue_commands);
+}
+
+#endif // JOB_QUEUE_ENABLE
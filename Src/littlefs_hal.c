@@ -0,0 +1,111 @@
+/* Copyright (C) 1883 Thomas Edison - All Rights Reserved
+ * You may use, distribute and modify this code under the
+ * terms of the BSD 3 clause license, which unfortunately
+ * won't be written for another century.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ *
+ */
+
+//
+// littlefs block device on the QSPI/OSPI NOR flash.
+//
+// With SPIFLASH_MEMORY_MAPPED (default) the flash stays in memory mapped mode and reads are
+// plain copies from the window at SPIFLASH_BASE_ADDRESS, which the MPU maps cacheable: repeated
+// reads of metadata and of programs and macros run from the filesystem are served from the
+// D-cache. spiflash.c leaves memory mapped mode only for program and erase and invalidates the
+// cached lines of the changed range afterwards.
+//
+// With SPIFLASH_ASYNC erase and program are queued and done from the realtime loop, a read or
+// sync waits for the queue to drain first. Errors of queued jobs are returned by the next read
+// or sync.
+//
+// As reads have no alignment requirement read_size is 1, littlefs then does not read whole
+// cache blocks for small metadata reads.
+//
+
+#include "driver.h"
+
+#if LITTLEFS_ENABLE
+
+#include "spiflash.h"
+#include "littlefs_hal.h"
+
+#if SPIFLASH_XIP
+#define LFS_OFFSET          SPIFLASH_XIP_SIZE   // code executed in place
+#else
+#define LFS_OFFSET          0
+#endif
+#define LFS_BLOCK_SIZE      SPIFLASH_SECTOR_SIZE
+#define LFS_BLOCK_COUNT     ((SPIFLASH_SIZE * 1024 * 1024 / 8 - LFS_OFFSET) / LFS_BLOCK_SIZE)
+#define LFS_CACHE_SIZE      SPIFLASH_PAGE_SIZE
+#define LFS_LOOKAHEAD_SIZE  16
+
+static uint8_t read_buffer[LFS_CACHE_SIZE] __ALIGNED(4);
+static uint8_t prog_buffer[LFS_CACHE_SIZE] __ALIGNED(4);
+static uint8_t lookahead_buffer[LFS_LOOKAHEAD_SIZE] __ALIGNED(4);
+
+static int lfs_hal_read (const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    // A copy from the memory mapped window with SPIFLASH_MEMORY_MAPPED.
+    return spiflash_read(LFS_OFFSET + block * c->block_size + off, buffer, size) == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int lfs_hal_prog (const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+#if SPIFLASH_ASYNC
+    if (spiflash_program_async(LFS_OFFSET + block * c->block_size + off, buffer, size)) {
+        return LFS_ERR_OK;
+    }
+#endif
+
+    return spiflash_program(LFS_OFFSET + block * c->block_size + off, buffer, size) == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int lfs_hal_erase (const struct lfs_config *c, lfs_block_t block)
+{
+#if SPIFLASH_ASYNC
+    if (spiflash_sector_erase_async(LFS_OFFSET + block * c->block_size)) {
+        return LFS_ERR_OK;
+    }
+#endif
+
+    return spiflash_sector_erase(LFS_OFFSET + block * c->block_size) == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int lfs_hal_sync (const struct lfs_config *c)
+{
+#if SPIFLASH_ASYNC
+    return spiflash_flush() == SPIFLASH_OK ? LFS_ERR_OK : LFS_ERR_IO;
+#else
+    return LFS_ERR_OK;
+#endif
+}
+
+struct lfs_config *stm32_littlefs_hal (void)
+{
+    static struct lfs_config cfg = {
+        .read = lfs_hal_read,
+        .prog = lfs_hal_prog,
+        .erase = lfs_hal_erase,
+        .sync = lfs_hal_sync,
+#if SPIFLASH_MEMORY_MAPPED
+        .read_size = 1,
+#else
+        .read_size = 16,
+#endif
+        .prog_size = SPIFLASH_PAGE_SIZE,
+        .block_size = LFS_BLOCK_SIZE,
+        .block_count = LFS_BLOCK_COUNT,
+        .block_cycles = 500,
+        .cache_size = LFS_CACHE_SIZE,
+        .lookahead_size = LFS_LOOKAHEAD_SIZE,
+        .read_buffer = read_buffer,
+        .prog_buffer = prog_buffer,
+        .lookahead_buffer = lookahead_buffer
+    };
+
+    return &cfg;
+}
+
+#endif // LITTLEFS_ENABLE
@@ -0,0 +1,428 @@
+/*
+  macro_cache.c - RAM cache of compacted macro and subprogram files
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A read-only file system is mounted at MACRO_CACHE_PATH that mirrors MACRO_CACHE_SOURCE:
+  /mcache/macros/P100.macro opens /littlefs/macros/P100.macro. Macros and subprograms called
+  through the mirror, e.g. flush cycles and touch-off routines called hundreds of times per job,
+  are read from RAM after the first call.
+
+  A file is read once into one of MACRO_CACHE_FILES slots, compacted as gcode_prescan.c does:
+  whitespace and ; comments are removed, ( ) comments are kept as the core handles messages in
+  them, $ and [ lines are kept unchanged and line ends are kept one for one. The core parses
+  text blocks, so the cache holds compacted source, not parsed blocks. Offsets (tell/seek) are
+  offsets in the compacted text.
+
+  Each open checks the size and modification time of the source file, a changed file is read
+  again. File systems without modification times (littlefs) only show a change of size, files
+  replaced by $UPLOAD or HTTP upload are dropped from the cache by the writer. When all slots are
+  taken the least recently opened slot not open for reading is reused. A file that does not fit
+  in a slot, or opened while all slots are in use, is read through from the source.
+
+  $MCACHE     - report: [MCACHE|files=,slot=,hits=,misses=,bypass=,stripped=]
+                        [MCFILE|<source>,<bytes>,<source bytes>,<open>]
+  $MCACHE=C   - drop all cached files not open
+*/
+
+#include "driver.h"
+
+#if MACRO_CACHE_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "grbl/hal.h"
+#include "grbl/vfs.h"
+#include "grbl/system.h"
+
+#include "macro_cache.h"
+
+#ifndef MACRO_CACHE_PATH
+#define MACRO_CACHE_PATH "/mcache"
+#endif
+#ifndef MACRO_CACHE_SOURCE
+#define MACRO_CACHE_SOURCE "/littlefs"
+#endif
+#ifndef MACRO_CACHE_FILES
+#define MACRO_CACHE_FILES 8
+#endif
+#ifndef MACRO_CACHE_SLOT_SIZE
+#define MACRO_CACHE_SLOT_SIZE 1024
+#endif
+#ifndef MACRO_CACHE_PATH_MAX
+#define MACRO_CACHE_PATH_MAX 48
+#endif
+
+typedef enum {
+    Compact_LineStart = 0,
+    Compact_GCode,
+    Compact_Comment,
+    Compact_EolComment,
+    Compact_Verbatim
+} compact_mode_t;
+
+typedef struct {
+    char path[MACRO_CACHE_PATH_MAX];    // source, "" if free
+    bool stale;                         // dropped while open, reused once closed
+    uint8_t refs;                       // open for reading
+    size_t src_size;
+    time_t src_mtime;
+    uint32_t len;
+    uint32_t used;                      // LRU stamp
+    char data[MACRO_CACHE_SLOT_SIZE];
+} mc_slot_t;
+
+// Handle following vfs_file_t, the source file is used when slot is NULL.
+typedef struct {
+    mc_slot_t *slot;
+    vfs_file_t *src;
+    uint32_t pos;
+} mc_handle_t;
+
+static struct {
+    mc_slot_t slot[MACRO_CACHE_FILES];
+    uint32_t clock;
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t bypass;
+    uint32_t stripped;
+} mc = {0};
+
+static bool mc_source (char *buf, const char *filename)
+{
+    return snprintf(buf, MACRO_CACHE_PATH_MAX, "%s%s", MACRO_CACHE_SOURCE, filename) < MACRO_CACHE_PATH_MAX;
+}
+
+static bool mc_fill (mc_slot_t *slot, const char *path)
+{
+    char chunk[128];
+    size_t n, idx;
+    uint32_t len = 0, stripped = 0;
+    compact_mode_t mode = Compact_LineStart;
+    vfs_file_t *file;
+
+    if((file = vfs_open(path, "r")) == NULL)
+        return false;
+
+    while((n = vfs_read(chunk, 1, sizeof(chunk), file)) > 0) {
+
+        for(idx = 0; idx < n; idx++) {
+
+            char c = chunk[idx];
+            bool keep = true;
+
+            if(c == '\n' || c == '\r')
+                mode = Compact_LineStart;
+
+            else switch(mode) {
+
+                case Compact_LineStart:
+                    if(c == ' ' || c == '\t') {
+                        keep = false;
+                        break;
+                    }
+                    if(c == '$' || c == '[') {
+                        mode = Compact_Verbatim;
+                        break;
+                    }
+                    mode = Compact_GCode;
+                    // fall through
+
+                case Compact_GCode:
+                    if(c == ' ' || c == '\t')
+                        keep = false;
+                    else if(c == ';') {
+                        keep = false;
+                        mode = Compact_EolComment;
+                    } else if(c == '(')
+                        mode = Compact_Comment;
+                    break;
+
+                case Compact_Comment:
+                    if(c == ')')
+                        mode = Compact_GCode;
+                    break;
+
+                case Compact_EolComment:
+                    keep = false;
+                    break;
+
+                case Compact_Verbatim:
+                    break;
+            }
+
+            if(!keep)
+                stripped++;
+            else if(len < MACRO_CACHE_SLOT_SIZE)
+                slot->data[len++] = c;
+            else {
+                vfs_close(file);
+                return false;
+            }
+        }
+    }
+
+    vfs_close(file);
+
+    slot->len = len;
+    mc.stripped += stripped;
+
+    return true;
+}
+
+// Returns a slot holding the current content of the source file, NULL if it is to be read through.
+static mc_slot_t *mc_get (const char *path)
+{
+    vfs_stat_t st;
+    mc_slot_t *slot = NULL;
+    uint_fast8_t idx;
+
+    if(vfs_stat(path, &st) != 0)
+        return NULL;
+
+    for(idx = 0; idx < MACRO_CACHE_FILES; idx++) {
+        if(!mc.slot[idx].stale && !strcmp(mc.slot[idx].path, path)) {
+            slot = &mc.slot[idx];
+            if(slot->src_size == st.st_size && slot->src_mtime == st.st_mtime) {
+                mc.hits++;
+                slot->used = ++mc.clock;
+                return slot;
+            }
+            if(slot->refs) {
+                slot->stale = true;
+                slot = NULL;
+            }
+            break;
+        }
+    }
+
+    mc.misses++;
+
+    // Free slot, else the least recently used one not open.
+    for(idx = 0; slot == NULL && idx < MACRO_CACHE_FILES; idx++) {
+        if(mc.slot[idx].refs == 0 && *mc.slot[idx].path == '\0')
+            slot = &mc.slot[idx];
+    }
+
+    for(idx = 0; slot == NULL || *slot->path; idx++) {
+        if(idx == MACRO_CACHE_FILES)
+            break;
+        if(mc.slot[idx].refs == 0 && (slot == NULL || mc.slot[idx].used < slot->used))
+            slot = &mc.slot[idx];
+    }
+
+    if(slot == NULL)
+        return NULL;
+
+    *slot->path = '\0';
+    slot->stale = false;
+
+    if(!mc_fill(slot, path))
+        return NULL;
+
+    strcpy(slot->path, path);
+    slot->src_size = st.st_size;
+    slot->src_mtime = st.st_mtime;
+    slot->used = ++mc.clock;
+
+    return slot;
+}
+
+static vfs_file_t *mc_open (const char *filename, const char *mode)
+{
+    char path[MACRO_CACHE_PATH_MAX];
+    vfs_file_t *file;
+    mc_handle_t *handle;
+
+    if(*mode != 'r' || strchr(mode, '+') || !mc_source(path, filename))
+        return NULL;
+
+    if((file = malloc(sizeof(vfs_file_t) + sizeof(mc_handle_t))) == NULL)
+        return NULL;
+
+    handle = (mc_handle_t *)&file->handle;
+    handle->pos = 0;
+    handle->src = NULL;
+
+    if((handle->slot = mc_get(path))) {
+        handle->slot->refs++;
+        file->size = handle->slot->len;
+    } else if((handle->src = vfs_open(path, mode))) {
+        mc.bypass++;
+        file->size = handle->src->size;
+    } else {
+        free(file);
+        file = NULL;
+    }
+
+    return file;
+}
+
+static void mc_close (vfs_file_t *file)
+{
+    mc_handle_t *handle = (mc_handle_t *)&file->handle;
+
+    if(handle->slot) {
+        if(--handle->slot->refs == 0 && handle->slot->stale) {
+            *handle->slot->path = '\0';
+            handle->slot->stale = false;
+        }
+    } else
+        vfs_close(handle->src);
+
+    free(file);
+}
+
+static size_t mc_read (void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    mc_handle_t *handle = (mc_handle_t *)&file->handle;
+
+    if(handle->slot == NULL)
+        return vfs_read(buffer, size, count, handle->src);
+
+    if(size == 0)
+        return 0;
+
+    if(count > (handle->slot->len - handle->pos) / size)
+        count = (handle->slot->len - handle->pos) / size;
+
+    memcpy(buffer, handle->slot->data + handle->pos, size * count);
+    handle->pos += size * count;
+
+    return count;
+}
+
+static size_t mc_tell (vfs_file_t *file)
+{
+    mc_handle_t *handle = (mc_handle_t *)&file->handle;
+
+    return handle->slot ? handle->pos : vfs_tell(handle->src);
+}
+
+static int mc_seek (vfs_file_t *file, size_t offset)
+{
+    mc_handle_t *handle = (mc_handle_t *)&file->handle;
+
+    if(handle->slot == NULL)
+        return vfs_seek(handle->src, offset);
+
+    if(offset > handle->slot->len)
+        return -1;
+
+    handle->pos = offset;
+
+    return 0;
+}
+
+static bool mc_eof (vfs_file_t *file)
+{
+    mc_handle_t *handle = (mc_handle_t *)&file->handle;
+
+    return handle->slot ? handle->pos >= handle->slot->len : vfs_eof(handle->src);
+}
+
+static int mc_stat (const char *filename, vfs_stat_t *st)
+{
+    char path[MACRO_CACHE_PATH_MAX];
+
+    return mc_source(path, filename) ? vfs_stat(path, st) : -1;
+}
+
+void macro_cache_invalidate (const char *path)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < MACRO_CACHE_FILES; idx++) {
+        if(!strcmp(mc.slot[idx].path, path)) {
+            if(mc.slot[idx].refs)
+                mc.slot[idx].stale = true;
+            else
+                *mc.slot[idx].path = '\0';
+        }
+    }
+}
+
+static status_code_t macro_cache_command (sys_state_t state, char *args)
+{
+    char buf[120];
+    uint_fast8_t idx, files = 0;
+
+    if(args) {
+
+        if(!(args[0] == 'C' && args[1] == '\0'))
+            return Status_InvalidStatement;
+
+        for(idx = 0; idx < MACRO_CACHE_FILES; idx++)
+            macro_cache_invalidate(mc.slot[idx].path);
+
+        return Status_OK;
+    }
+
+    for(idx = 0; idx < MACRO_CACHE_FILES; idx++) {
+        if(*mc.slot[idx].path && !mc.slot[idx].stale)
+            files++;
+    }
+
+    snprintf(buf, sizeof(buf), "[MCACHE|files=%u/%u,slot=%u,hits=%lu,misses=%lu,bypass=%lu,stripped=%lu]" ASCII_EOL,
+              (unsigned int)files, (unsigned int)MACRO_CACHE_FILES, (unsigned int)MACRO_CACHE_SLOT_SIZE,
+               mc.hits, mc.misses, mc.bypass, mc.stripped);
+    hal.stream.write(buf);
+
+    for(idx = 0; idx < MACRO_CACHE_FILES; idx++) {
+        mc_slot_t *slot = &mc.slot[idx];
+        if(*slot->path && !slot->stale) {
+            snprintf(buf, sizeof(buf), "[MCFILE|%s,%lu,%u,%u]" ASCII_EOL, slot->path, slot->len,
+                      (unsigned int)slot->src_size, (unsigned int)slot->refs);
+            hal.stream.write(buf);
+        }
+    }
+
+    return Status_OK;
+}
+
+void macro_cache_init (void)
+{
+    static const vfs_t fs = {
+        .fs_name = "macro cache",
+        .fopen = mc_open,
+        .fclose = mc_close,
+        .fread = mc_read,
+        .ftell = mc_tell,
+        .fseek = mc_seek,
+        .feof = mc_eof,
+        .fstat = mc_stat
+    };
+
+    static const sys_command_t macro_cache_command_list[] = {
+        {"MCACHE", macro_cache_command, {}, { .str = "report the macro cache, $MCACHE=C drops cached files" } }
+    };
+
+    static sys_commands_t macro_cache_commands = {
+        .n_commands = sizeof(macro_cache_command_list) / sizeof(sys_command_t),
+        .commands = macro_cache_command_list
+    };
+
+    vfs_mount(MACRO_CACHE_PATH, &fs, (vfs_st_mode_t){ .read_only = true });
+
+    system_register_commands(&macro_cache_commands);
+}
+
+#endif // MACRO_CACHE_ENABLE
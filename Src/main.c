@@ -27,11 +27,31 @@
 
 #include "grbl/grbllib.h"
 
+#include "boot_profile.h"
+
+#if SPIFLASH_XIP
+#include "spiflash.h"
+#endif
+
 void SystemClock_Config(void);
 void MPU_Config(void);
 
 int main(void)
 {
+    /* Cycle counter first, the boot profile counts from here */
+    if(!(CoreDebug->DEMCR & CoreDebug_DEMCR_TRCENA_Msk)) {
+        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+        DWT->LAR = 0xC5ACCE55;
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+        DWT->LAR = 0;
+    }
+
+#if ETH_BUFFERS_D2
+    /* D2 SRAMs hold the LwIP Rx pool and ETH DMA descriptors */
+    __HAL_RCC_D2SRAM1_CLK_ENABLE();
+    __HAL_RCC_D2SRAM2_CLK_ENABLE();
+#endif
 
     /* Configure the MPU attributes as Device memory for ETH DMA descriptors */
     MPU_Config();
@@ -44,20 +64,32 @@ int main(void)
     SCB_EnableDCache();
 #endif
 
+    BOOT_MARK("mpu_cache");
+
     HAL_Init();
+    BOOT_MARK("hal_init");
+
     SystemClock_Config();
+    BOOT_MARK("clock");
 
-    if(!(CoreDebug->DEMCR & CoreDebug_DEMCR_TRCENA_Msk)) {
-        CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
-        DWT->LAR = 0xC5ACCE55;
-        DWT->CYCCNT = 0;
-        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
-        DWT->LAR = 0;
-    }
+#if SPIFLASH_XIP
+    /* Memory mapped mode has to be up before any code placed in the SPI flash runs */
+    spiflash_xip_init();
+    BOOT_MARK("xip");
+#endif
 
     grbl_enter();
 }
 
+// LwIP buffer regions, must match the .dma_buffers/.eth_d2 sections of the linker script
+#if ETH_BUFFERS_D2
+#define ETH_RX_POOL_BASE 0x30000000 // D2 SRAM1
+#define ETH_DESC_BASE    0x30004000 // D2 SRAM2
+#else
+#define ETH_RX_POOL_BASE 0x24000000
+#define ETH_DESC_BASE    0x2400C000
+#endif
+
 void MPU_Config(void)
 {
   MPU_Region_InitTypeDef MPU_InitStruct;
@@ -83,7 +115,7 @@ void MPU_Config(void)
   /* Configure the MPU attributes as Device not cacheable
      for ETH DMA descriptors */
   MPU_InitStruct.Enable = MPU_REGION_ENABLE;
-  MPU_InitStruct.BaseAddress = 0x2400C000;
+  MPU_InitStruct.BaseAddress = ETH_DESC_BASE;
   MPU_InitStruct.Size = MPU_REGION_SIZE_1KB;
   MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
   MPU_InitStruct.IsBufferable = MPU_ACCESS_BUFFERABLE;
@@ -99,7 +131,7 @@ void MPU_Config(void)
   /* Configure the MPU attributes as Normal Write through
      for LwIP Rx pool */
   MPU_InitStruct.Enable = MPU_REGION_ENABLE;
-  MPU_InitStruct.BaseAddress = 0x24000000;
+  MPU_InitStruct.BaseAddress = ETH_RX_POOL_BASE;
   MPU_InitStruct.Size = MPU_REGION_SIZE_16KB;
   MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
   MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
@@ -128,6 +160,25 @@ void MPU_Config(void)
 
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
+#if DMA_ARENA_ENABLE
+  /* Configure the MPU attributes as Normal Non Cacheable
+     for the DMA arena, 16KB region with the first 2KB subregion
+     (ETH DMA descriptors) disabled */
+  MPU_InitStruct.Enable = MPU_REGION_ENABLE;
+  MPU_InitStruct.BaseAddress = 0x2400C000;
+  MPU_InitStruct.Size = MPU_REGION_SIZE_16KB;
+  MPU_InitStruct.AccessPermission = MPU_REGION_FULL_ACCESS;
+  MPU_InitStruct.IsBufferable = MPU_ACCESS_NOT_BUFFERABLE;
+  MPU_InitStruct.IsCacheable = MPU_ACCESS_NOT_CACHEABLE;
+  MPU_InitStruct.IsShareable = MPU_ACCESS_SHAREABLE;
+  MPU_InitStruct.Number = MPU_REGION_NUMBER5;
+  MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL1;
+  MPU_InitStruct.SubRegionDisable = 0x01;
+  MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+
+  HAL_MPU_ConfigRegion(&MPU_InitStruct);
+#endif
+
   /* Configure the MPU QSPI flash */
   MPU_InitStruct.Enable = MPU_REGION_ENABLE;
   MPU_InitStruct.BaseAddress = 0x90000000;
@@ -139,7 +190,11 @@ void MPU_Config(void)
   MPU_InitStruct.Number = MPU_REGION_NUMBER4;
   MPU_InitStruct.TypeExtField = MPU_TEX_LEVEL1;
   MPU_InitStruct.SubRegionDisable = 0x0;
+#if SPIFLASH_XIP
+  MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_ENABLE;
+#else
   MPU_InitStruct.DisableExec = MPU_INSTRUCTION_ACCESS_DISABLE;
+#endif
 
   HAL_MPU_ConfigRegion(&MPU_InitStruct);
 
@@ -151,7 +206,7 @@ void SystemClock_Config(void)
 {
     // Clock configuration
     //
-    // - 480MHZ system clock
+    // - 480MHZ system clock, 550MHz on H723 with CPU_FREQ_550MHZ (see below)
     // - 48MHz clock from PLL1Q - USB, SDMMC1, SPI1/SPI2/SPI3, QUADSPI/OCTOSPI
     // - 48MHz clock from PLL2Q - SPI4/SPI5
     // - 12MHz clock from PLL2R - optional SDMMC1 clock source with NUCLEO_SLOW_SDMMC_CLOCK
@@ -304,6 +359,28 @@ void SystemClock_Config(void)
     PeriphClkInitStruct.PLL2.PLL2VCOSEL = RCC_PLL1VCOWIDE;
     PeriphClkInitStruct.PLL2.PLL2FRACN = 0;
 
+#if CPU_FREQ_550MHZ
+    // 550MHz when the CPU frequency boost option bit is set ($CLOCKS=BOOST), else 480MHz as above.
+    // PLL1Q is then 50MHz for SDMMC1 and OCTOSPI, the 48MHz clocks come from PLL2Q (FDCAN),
+    // PLL3P (SPI1/SPI2/SPI3) and HSI48 trimmed to the USB SOF by the CRS (USB).
+    if(FLASH->OPTSR2_CUR & FLASH_OPTSR2_CPUFREQ_BOOST) {
+        RCC_OscInitStruct.PLL.PLLN = 110;
+        RCC_OscInitStruct.PLL.PLLQ = 11;
+    }
+
+    RCC_OscInitStruct.OscillatorType |= RCC_OSCILLATORTYPE_HSI48;
+    RCC_OscInitStruct.HSI48State = RCC_HSI48_ON;
+
+    PeriphClkInitStruct.PLL3.PLL3M = 5;
+    PeriphClkInitStruct.PLL3.PLL3N = 96;
+    PeriphClkInitStruct.PLL3.PLL3P = 10;
+    PeriphClkInitStruct.PLL3.PLL3Q = 10;
+    PeriphClkInitStruct.PLL3.PLL3R = 10;
+    PeriphClkInitStruct.PLL3.PLL3RGE = RCC_PLL3VCIRANGE_2;
+    PeriphClkInitStruct.PLL3.PLL3VCOSEL = RCC_PLL3VCOWIDE;
+    PeriphClkInitStruct.PLL3.PLL3FRACN = 0;
+#endif
+
 #endif // STM32H723xx other boards
 #endif // STM32H723xx
 
@@ -335,7 +412,11 @@ void SystemClock_Config(void)
 
     PeriphClkInitStruct.PeriphClockSelection  = RCC_PERIPHCLK_SPI123 | RCC_PERIPHCLK_SPI45 | RCC_PERIPHCLK_I2C123 |
                                                 RCC_PERIPHCLK_USART16 | RCC_PERIPHCLK_USART234578;
+#if CPU_FREQ_550MHZ
+    PeriphClkInitStruct.Spi123ClockSelection  = RCC_SPI123CLKSOURCE_PLL3;
+#else
     PeriphClkInitStruct.Spi123ClockSelection  = RCC_SPI123CLKSOURCE_PLL;
+#endif
     PeriphClkInitStruct.Spi45ClockSelection   = RCC_SPI45CLKSOURCE_PLL2;
     PeriphClkInitStruct.I2c1235ClockSelection = RCC_I2C123CLKSOURCE_D2PCLK1;
     PeriphClkInitStruct.Usart16ClockSelection = RCC_USART16CLKSOURCE_PCLK2;
@@ -359,7 +440,11 @@ void SystemClock_Config(void)
 
 #ifdef CAN_PORT
     PeriphClkInitStruct.PeriphClockSelection = PeriphClkInitStruct.PeriphClockSelection | RCC_PERIPHCLK_FDCAN;
+#if CPU_FREQ_550MHZ
+    PeriphClkInitStruct.FdcanClockSelection = RCC_FDCANCLKSOURCE_PLL2;
+#else
     PeriphClkInitStruct.FdcanClockSelection = RCC_FDCANCLKSOURCE_PLL;
+#endif
 #endif //CAN_PORT
 
 #if SDCARD_ENABLE
@@ -0,0 +1,220 @@
+/*
+  mdns_services.c - mDNS advertisement of the Spark network services and capabilities
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Adds DNS-SD services to the mDNS responder started by the networking code, so that host software
+  finds controllers and their ports with a single browse for _spark._tcp:
+
+    _spark._tcp         Telnet port, TXT records with the board and its capabilities
+    _spark-stream._tcp  raw TCP G-code stream (TCP_STREAM_ENABLE)
+    _spark-tlm._udp     UDP telemetry broadcast port (UDP_TELEMETRY_ENABLE)
+
+  TXT records of _spark._tcp:
+
+    board=<BOARD_NAME> build=<GRBL_BUILD> axes=<N_AXIS> telnet= ws= stream= tlm= edm=0|1
+    feat=<comma separated EDM options>
+
+  Ports of disabled services are reported as 0.
+
+  The responder is attached to the interface by the networking code once the link is up, services
+  are added from the realtime loop as soon as that has happened (mdns_resp_add_service() fails
+  before). They are added once: if the networking code later removes the responder from the
+  interface they are gone until restart. Needs MDNS_MAX_SERVICES for these on top of the services
+  of the networking code.
+*/
+
+#include "driver.h"
+
+#if MDNS_SERVICES_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lwip/netif.h"
+#include "lwip/apps/mdns.h"
+
+#include "grbl/hal.h"
+#include "grbl/grbl.h"
+
+#include "mdns_services.h"
+#include "tcp_stream.h"
+#include "udp_telemetry.h"
+#include "ws_telemetry.h"
+#include "rt_sched.h"
+
+#ifndef MDNS_SERVICES_TTL
+#define MDNS_SERVICES_TTL 3600
+#endif
+#ifndef MDNS_SERVICES_RETRY_MS
+#define MDNS_SERVICES_RETRY_MS 1000
+#endif
+
+#ifdef NETWORK_TELNET_PORT
+#define MDNS_TELNET_PORT NETWORK_TELNET_PORT
+#else
+#define MDNS_TELNET_PORT 23
+#endif
+#ifdef NETWORK_WEBSOCKET_PORT
+#define MDNS_WEBSOCKET_PORT NETWORK_WEBSOCKET_PORT
+#else
+#define MDNS_WEBSOCKET_PORT 80
+#endif
+#if TCP_STREAM_ENABLE
+#define MDNS_STREAM_PORT TCP_STREAM_PORT
+#else
+#define MDNS_STREAM_PORT 0
+#endif
+#if UDP_TELEMETRY_ENABLE
+#define MDNS_TLM_PORT UDP_TELEMETRY_PORT
+#else
+#define MDNS_TLM_PORT 0
+#endif
+#if WS_TELEMETRY_ENABLE
+#define MDNS_WSTLM_PORT WS_TELEMETRY_PORT
+#else
+#define MDNS_WSTLM_PORT 0
+#endif
+
+#define STR(x) #x
+#define XSTR(x) STR(x)
+
+static bool added = false;
+#if RT_SCHED_ENABLE
+static void mdns_services_task (void *context);
+static rt_task_t retry_task = {
+    .name = "mdns",
+    .fn = mdns_services_task,
+    .period_us = MDNS_SERVICES_RETRY_MS * 1000,
+    .budget_us = 100,
+    .priority = 250
+};
+#else
+static uint32_t retry_ms;
+static on_execute_realtime_ptr on_execute_realtime;
+#endif
+
+static void txt_add (struct mdns_service *service, const char *txt)
+{
+    size_t len = strlen(txt);
+
+    mdns_resp_add_service_txtitem(service, txt, (u8_t)(len > 63 ? 63 : len));
+}
+
+// Called when a reply is generated.
+static void spark_txt (struct mdns_service *service, void *userdata)
+{
+    txt_add(service, "board=" BOARD_NAME);
+    txt_add(service, "build=" XSTR(GRBL_BUILD));
+    txt_add(service, "axes=" XSTR(N_AXIS));
+    txt_add(service, "telnet=" XSTR(MDNS_TELNET_PORT));
+    txt_add(service, "ws=" XSTR(MDNS_WEBSOCKET_PORT));
+    txt_add(service, "stream=" XSTR(MDNS_STREAM_PORT));
+    txt_add(service, "tlm=" XSTR(MDNS_TLM_PORT));
+    txt_add(service, "wstlm=" XSTR(MDNS_WSTLM_PORT));
+#if EDM_ENABLE
+    txt_add(service, "edm=1");
+    txt_add(service, "feat="
+#if EDM_GAP_ADC_ENABLE
+                     "gapadc,"
+#endif
+#if EDM_GATE_PWM_ENABLE
+                     "gatepwm,"
+#endif
+#if EDM_PULSE_CAPTURE_ENABLE
+                     "pcap,"
+#endif
+#if EDM_WEAR_COMP_ENABLE
+                     "wcomp,"
+#endif
+#if EDM_FLUSH_ENABLE
+                     "flush,"
+#endif
+#if EDM_RETRACT_HISTORY
+                     "rhist,"
+#endif
+                     "pulser");
+#else
+    txt_add(service, "edm=0");
+#endif
+}
+
+static bool services_add (struct netif *netif)
+{
+#if LWIP_NETIF_HOSTNAME
+    const char *name = netif->hostname ? netif->hostname : "spark";
+#else
+    const char *name = "spark";
+#endif
+
+    if(mdns_resp_add_service(netif, name, "_spark", DNSSD_PROTO_TCP, MDNS_TELNET_PORT, MDNS_SERVICES_TTL, spark_txt, NULL) < 0)
+        return false;   // responder not attached yet
+
+#if TCP_STREAM_ENABLE
+    mdns_resp_add_service(netif, name, "_spark-stream", DNSSD_PROTO_TCP, MDNS_STREAM_PORT, MDNS_SERVICES_TTL, NULL, NULL);
+#endif
+#if UDP_TELEMETRY_ENABLE
+    mdns_resp_add_service(netif, name, "_spark-tlm", DNSSD_PROTO_UDP, MDNS_TLM_PORT, MDNS_SERVICES_TTL, NULL, NULL);
+#endif
+    mdns_resp_announce(netif);
+
+    return true;
+}
+
+static void mdns_services_retry (void)
+{
+    if(netif_default && netif_is_up(netif_default) && netif_is_link_up(netif_default))
+        added = services_add(netif_default);
+}
+
+#if RT_SCHED_ENABLE
+
+static void mdns_services_task (void *context)
+{
+    mdns_services_retry();
+
+    retry_task.suspended = added;
+}
+
+#else
+
+static void mdns_services_poll (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(!added && hal.get_elapsed_ticks() - retry_ms >= MDNS_SERVICES_RETRY_MS) {
+        retry_ms = hal.get_elapsed_ticks();
+        mdns_services_retry();
+    }
+}
+
+#endif
+
+void mdns_services_init (void)
+{
+#if RT_SCHED_ENABLE
+    rt_task_register(&retry_task);
+#else
+    retry_ms = hal.get_elapsed_ticks();
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = mdns_services_poll;
+#endif
+}
+
+#endif // MDNS_SERVICES_ENABLE
@@ -0,0 +1,166 @@
+/*
+
+  memmap.c - per memory region usage report
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  $MEMMAP - report memory usage per linker region, sizes in bytes:
+
+    [MEM|DTCM,used=<static>,size=<region>]
+    [MEM|ITCM,used=<code>,size=<region>]
+    [MEM|RAM_D1,static=<data+bss>,heap=<sbrk>,inuse=<malloc>,free=<free chunks>,top=<unclaimed>,stack=<high-water>/<reserved>,size=<region>]
+    [MEM|RAM_D1_DMA,used=<end of last buffer>,arena=<used>/<size>,size=<region>]
+    [MEM|RAM_D2,used=0,size=<region>]
+    [MEM|RAM_D3,used=0,size=<region>]
+
+  and with MEMPOOL_ENABLE:
+
+    [MEM|POOL<block size>,used=,max=,blocks=,fallback=]
+    [MEM|BOOT,used=,size=,fallback=]
+
+  and with PLANNER_DTCM_ENABLE:
+
+    [MEM|PLANNER,used=,size=,fallback=]
+
+  top is the space between the heap and the reserved stack that has never been claimed from
+  sbrk(), this is the largest block that can be allocated without relying on freed chunks.
+  The stack high-water mark is found from the fill pattern painted at boot.
+*/
+
+#include "driver.h"
+
+#if MEMMAP_ENABLE
+
+#include <stdio.h>
+#include <malloc.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "cache.h"
+#include "mempool.h"
+#include "planner_dtcm.h"
+
+#define STACK_PAINT 0xA5A5A5A5
+
+extern uint8_t _memmap_dtcm_start, _memmap_dtcm_size, _memmap_itcm_start, _memmap_itcm_size;
+extern uint8_t _memmap_d1_start, _memmap_d1_size, _memmap_d1_dma_start, _memmap_d1_dma_size;
+extern uint8_t _memmap_d2_start, _memmap_d2_size, _memmap_d3_start, _memmap_d3_size;
+extern uint8_t _edtcm_bss, _eitcm, _end, _estack, _Min_Stack_Size, _sdma_arena, _edma_arena;
+extern void *_sbrk (ptrdiff_t incr);
+
+static inline uint32_t stack_limit (void)
+{
+    return (uint32_t)&_estack - (uint32_t)&_Min_Stack_Size;
+}
+
+// Fills the unused part of the reserved stack, keeps a margin below the current stack pointer.
+static void stack_paint (void)
+{
+    uint32_t *p = (uint32_t *)stack_limit(), *sp = (uint32_t *)(__get_MSP() - 64);
+
+    while(p < sp)
+        *p++ = STACK_PAINT;
+}
+
+static uint32_t stack_high_water (void)
+{
+    uint32_t *p = (uint32_t *)stack_limit(), *end = (uint32_t *)&_estack;
+
+    while(p < end && *p == STACK_PAINT)
+        p++;
+
+    return (uint32_t)end - (uint32_t)p;
+}
+
+static void report_region (const char *name, uint32_t used, uint8_t *size)
+{
+    char buf[60];
+
+    snprintf(buf, sizeof(buf), "[MEM|%s,used=%lu,size=%lu]" ASCII_EOL, name, used, (uint32_t)size);
+    hal.stream.write(buf);
+}
+
+static status_code_t memmap_report (sys_state_t state, char *args)
+{
+    char buf[160];
+    uint32_t heap_end = (uint32_t)_sbrk(0);
+    struct mallinfo mi = mallinfo();
+
+    report_region("DTCM", (uint32_t)&_edtcm_bss - (uint32_t)&_memmap_dtcm_start, &_memmap_dtcm_size);
+    report_region("ITCM", (uint32_t)&_eitcm - (uint32_t)&_memmap_itcm_start, &_memmap_itcm_size);
+
+    snprintf(buf, sizeof(buf), "[MEM|RAM_D1,static=%lu,heap=%lu,inuse=%lu,free=%lu,top=%lu,stack=%lu/%lu,size=%lu]" ASCII_EOL,
+              (uint32_t)&_end - (uint32_t)&_memmap_d1_start, heap_end - (uint32_t)&_end,
+               (uint32_t)mi.uordblks, (uint32_t)mi.fordblks, stack_limit() - heap_end,
+                stack_high_water(), (uint32_t)&_Min_Stack_Size, (uint32_t)&_memmap_d1_size);
+    hal.stream.write(buf);
+
+    snprintf(buf, sizeof(buf), "[MEM|RAM_D1_DMA,used=%lu,arena=%lu/%lu,size=%lu]" ASCII_EOL,
+              (uint32_t)&_edma_arena - (uint32_t)&_memmap_d1_dma_start,
+               (uint32_t)&_edma_arena - (uint32_t)&_sdma_arena, (uint32_t)DMA_ARENA_SIZE, (uint32_t)&_memmap_d1_dma_size);
+    hal.stream.write(buf);
+
+    report_region("RAM_D2", 0, &_memmap_d2_size);
+    report_region("RAM_D3", 0, &_memmap_d3_size);
+
+#if MEMPOOL_ENABLE
+    uint_fast8_t idx = 0;
+    uint32_t used, size, fallback;
+    mem_pool_stats_t pool;
+
+    while(mem_pool_get_stats(idx++, &pool)) {
+        snprintf(buf, sizeof(buf), "[MEM|POOL%u,used=%u,max=%u,blocks=%u,fallback=%lu]" ASCII_EOL,
+                  pool.size, pool.used, pool.max_used, pool.blocks, pool.fallback);
+        hal.stream.write(buf);
+    }
+
+    mem_boot_get_stats(&used, &size, &fallback);
+    snprintf(buf, sizeof(buf), "[MEM|BOOT,used=%lu,size=%lu,fallback=%lu]" ASCII_EOL, used, size, fallback);
+    hal.stream.write(buf);
+#endif
+
+#if PLANNER_DTCM_ENABLE
+    uint32_t arena_used, arena_size, arena_fallback;
+
+    planner_dtcm_get_stats(&arena_used, &arena_size, &arena_fallback);
+    snprintf(buf, sizeof(buf), "[MEM|PLANNER,used=%lu,size=%lu,fallback=%lu]" ASCII_EOL, arena_used, arena_size, arena_fallback);
+    hal.stream.write(buf);
+#endif
+
+    return Status_OK;
+}
+
+void memmap_init (void)
+{
+    static const sys_command_t memmap_command_list[] = {
+        {"MEMMAP", memmap_report, { .noargs = On }, { .str = "report memory usage per region" } }
+    };
+
+    static sys_commands_t memmap_commands = {
+        .n_commands = sizeof(memmap_command_list) / sizeof(sys_command_t),
+        .commands = memmap_command_list
+    };
+
+    stack_paint();
+
+    system_register_commands(&memmap_commands);
+}
+
+#endif // MEMMAP_ENABLE
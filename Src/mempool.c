@@ -0,0 +1,216 @@
+/*
+
+  mempool.c - fixed size class pools and boot time bump allocator
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Long lived driver and plugin objects are taken from static pools of fixed size blocks instead
+  of the newlib heap, so that allocation and release are O(1) and the heap does not fragment
+  over long uptimes. Free blocks are kept in a singly linked list threaded through the blocks.
+
+  Objects that are never freed, typically allocated during boot, can be taken from a bump
+  allocated arena with no per allocation overhead.
+*/
+
+#include <string.h>
+
+#include "mempool.h"
+
+#if MEMPOOL_ENABLE
+
+#define BOOT_ALIGN 8
+
+typedef struct mem_block {
+    struct mem_block *next;
+} mem_block_t;
+
+typedef struct {
+    uint8_t *base;
+    mem_block_t *free;
+    mem_pool_stats_t stats;
+} mem_class_t;
+
+static uint64_t pool_16[MEMPOOL_BLOCKS_16 * 16 / sizeof(uint64_t)];
+static uint64_t pool_32[MEMPOOL_BLOCKS_32 * 32 / sizeof(uint64_t)];
+static uint64_t pool_64[MEMPOOL_BLOCKS_64 * 64 / sizeof(uint64_t)];
+static uint64_t pool_128[MEMPOOL_BLOCKS_128 * 128 / sizeof(uint64_t)];
+static uint64_t pool_256[MEMPOOL_BLOCKS_256 * 256 / sizeof(uint64_t)];
+
+static mem_class_t pool[MEMPOOL_N_CLASSES] = {
+    { .base = (uint8_t *)pool_16,  .stats.size = 16,  .stats.blocks = MEMPOOL_BLOCKS_16 },
+    { .base = (uint8_t *)pool_32,  .stats.size = 32,  .stats.blocks = MEMPOOL_BLOCKS_32 },
+    { .base = (uint8_t *)pool_64,  .stats.size = 64,  .stats.blocks = MEMPOOL_BLOCKS_64 },
+    { .base = (uint8_t *)pool_128, .stats.size = 128, .stats.blocks = MEMPOOL_BLOCKS_128 },
+    { .base = (uint8_t *)pool_256, .stats.size = 256, .stats.blocks = MEMPOOL_BLOCKS_256 }
+};
+
+static struct {
+    uint64_t arena[MEMPOOL_BOOT_SIZE / sizeof(uint64_t)];
+    uint32_t used;
+    uint32_t fallback;
+} boot = {0};
+
+static bool init_ok = false;
+
+static void mem_pool_init (void)
+{
+    uint_fast8_t idx;
+    uint_fast16_t block;
+
+    for(idx = 0; idx < MEMPOOL_N_CLASSES; idx++) {
+        mem_class_t *class = &pool[idx];
+        class->free = NULL;
+        block = class->stats.blocks;
+        while(block) {
+            mem_block_t *blk = (mem_block_t *)(class->base + --block * class->stats.size);
+            blk->next = class->free;
+            class->free = blk;
+        }
+    }
+
+    init_ok = true;
+}
+
+static inline mem_class_t *class_for_size (size_t size)
+{
+    uint_fast8_t idx = 0;
+
+    if(size > 256)
+        return NULL;
+
+    while(pool[idx].stats.size < size)
+        idx++;
+
+    return &pool[idx];
+}
+
+static inline mem_class_t *class_for_ptr (void *ptr)
+{
+    uint_fast8_t idx = MEMPOOL_N_CLASSES;
+
+    do {
+        mem_class_t *class = &pool[--idx];
+        if((uint8_t *)ptr >= class->base && (uint8_t *)ptr < class->base + class->stats.blocks * class->stats.size)
+            return class;
+    } while(idx);
+
+    return NULL;
+}
+
+void *mem_pool_alloc (size_t size)
+{
+    mem_class_t *class;
+    mem_block_t *block = NULL;
+
+    if(size == 0)
+        return NULL;
+
+    if(!init_ok)
+        mem_pool_init();
+
+    if((class = class_for_size(size))) {
+
+        __disable_irq();
+
+        if((block = class->free)) {
+            class->free = block->next;
+            if(++class->stats.used > class->stats.max_used)
+                class->stats.max_used = class->stats.used;
+        } else
+            class->stats.fallback++;
+
+        __enable_irq();
+
+        if(block)
+            memset(block, 0, class->stats.size);
+    }
+
+    return block ? (void *)block : calloc(1, size);
+}
+
+void mem_pool_free (void *ptr)
+{
+    mem_class_t *class;
+
+    if(ptr == NULL)
+        return;
+
+    if((class = class_for_ptr(ptr))) {
+        __disable_irq();
+        ((mem_block_t *)ptr)->next = class->free;
+        class->free = (mem_block_t *)ptr;
+        class->stats.used--;
+        __enable_irq();
+    } else
+        free(ptr);
+}
+
+// Memory from here can not be freed.
+void *mem_boot_alloc (size_t size)
+{
+    void *ptr = NULL;
+
+    size = (size + BOOT_ALIGN - 1) & ~(BOOT_ALIGN - 1);
+
+    __disable_irq();
+
+    if(size && boot.used + size <= sizeof(boot.arena)) {
+        ptr = (uint8_t *)boot.arena + boot.used;
+        boot.used += size;
+    } else if(size)
+        boot.fallback++;
+
+    __enable_irq();
+
+    // arena is zero initialized .bss
+    return ptr || size == 0 ? ptr : calloc(1, size);
+}
+
+// Returns the number of bytes never used, the complement of the high-water marks.
+uint32_t mem_pool_get_free (void)
+{
+    uint_fast8_t idx;
+    uint32_t unused = sizeof(boot.arena) - boot.used;
+
+    for(idx = 0; idx < MEMPOOL_N_CLASSES; idx++)
+        unused += (pool[idx].stats.blocks - pool[idx].stats.max_used) * pool[idx].stats.size;
+
+    return unused;
+}
+
+bool mem_pool_get_stats (uint_fast8_t idx, mem_pool_stats_t *stats)
+{
+    if(idx >= MEMPOOL_N_CLASSES)
+        return false;
+
+    __disable_irq();
+    memcpy(stats, &pool[idx].stats, sizeof(mem_pool_stats_t));
+    __enable_irq();
+
+    return true;
+}
+
+void mem_boot_get_stats (uint32_t *used, uint32_t *size, uint32_t *fallback)
+{
+    *used = boot.used;
+    *size = sizeof(boot.arena);
+    *fallback = boot.fallback;
+}
+
+#endif // MEMPOOL_ENABLE
@@ -0,0 +1,649 @@
+/*
+  modbus_dma.c - Modbus RTU master with DMA transfers and a request queue
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Master for slow peripherals such as a flushing pump VFD or a dielectric chiller, on the UART of
+  serial stream instance MODBUS_DMA_STREAM which is then no longer available as a stream.
+
+  Requests are queued from the foreground and sent one at a time by the realtime loop, which never
+  waits on the bus: the request ADU is sent by DMA, the UART transmission complete interrupt turns
+  the line around (MODBUS_DMA_DE_PORT/PIN driven low, if defined) and starts DMA reception, and the
+  receiver timeout (3.5 character times, 1.75 ms above 19200 baud) ends the response frame. The
+  realtime loop then checks the response and calls the completion callback of the request.
+  Unanswered or corrupted requests are repeated MODBUS_DMA_RETRIES times.
+
+  $MB                      - report bus statistics: [MB|baud=,queued=,tx=,ok=,timeout=,crc=,exception=,retry=]
+  $MBR=<addr>,<reg>[,<n>]  - read n holding registers, reported as [MB|<addr>,<function>,<reg>:<value>,...]
+  $MBI=<addr>,<reg>[,<n>]  - read n input registers
+  $MBW=<addr>,<reg>,<val>  - write a single register, reported as [MB|<addr>,6,<reg>:ok]
+  Failures are reported as [MB|<addr>,<function>,<reg>:err=<timeout|crc|exc<code>|aborted>].
+
+  M570 P<addr> Q<reg> [S<value>] - from G-code, write the register when S is given, else read and
+  report it as $MBR. Waits for motion to finish, but not for the response.
+*/
+
+#include "driver.h"
+
+#if MODBUS_DMA_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+#include "grbl/system.h"
+
+#include "cache.h"
+#include "modbus_dma.h"
+#include "serial.h"
+
+#ifndef MODBUS_DMA_BAUD
+#define MODBUS_DMA_BAUD         19200
+#endif
+#ifndef MODBUS_DMA_EVEN_PARITY
+#define MODBUS_DMA_EVEN_PARITY  1       // 8E1 as the standard requires, 0 for 8N1
+#endif
+#ifndef MODBUS_DMA_TIMEOUT_MS
+#define MODBUS_DMA_TIMEOUT_MS   100
+#endif
+#ifndef MODBUS_DMA_RETRIES
+#define MODBUS_DMA_RETRIES      2
+#endif
+#ifndef MODBUS_DMA_QUEUE
+#define MODBUS_DMA_QUEUE        8       // power of 2
+#endif
+#ifndef MODBUS_DMA_MCODE
+#define MODBUS_DMA_MCODE        570
+#endif
+
+#if (MODBUS_DMA_QUEUE & (MODBUS_DMA_QUEUE - 1)) != 0
+#error "MODBUS_DMA_QUEUE must be a power of 2!"
+#endif
+
+#ifndef MODBUS_DMA_RX_STREAM
+#if STEP_PULSE_DMA
+#error "DMA1_Stream0/1 are used by STEP_PULSE_DMA, set MODBUS_DMA_RX_STREAM/MODBUS_DMA_TX_STREAM to free streams!"
+#endif
+#define MODBUS_DMA_RX_STREAM    DMA1_Stream0
+#define MODBUS_DMA_TX_STREAM    DMA1_Stream1
+#endif
+
+#define ADU_MAX 256
+#define FUNC_READ_HOLDING   3
+#define FUNC_READ_INPUT     4
+#define FUNC_WRITE_SINGLE   6
+
+typedef enum {
+    Bus_Idle = 0,
+    Bus_Sending,
+    Bus_Waiting,        // for the response
+    Bus_Received,
+    Bus_Sent            // broadcast, no response
+} bus_state_t;
+
+typedef struct {
+    uint8_t address;
+    uint8_t function;
+    uint16_t reg;
+    uint16_t value;     // register count for reads
+    modbus_dma_done_ptr done;
+    void *context;
+} request_t;
+
+typedef struct {
+    uint32_t requests;
+    uint32_t ok;
+    uint32_t timeouts;
+    uint32_t crc;
+    uint32_t exceptions;
+    uint32_t retries;
+} bus_stats_t;
+
+typedef struct {
+    bool ok;
+    serial_raw_port_t port;
+    DMA_HandleTypeDef dma_rx;
+    DMA_HandleTypeDef dma_tx;
+    volatile bus_state_t state;
+    volatile uint16_t rx_len;
+    uint32_t sent_ms;
+    uint32_t silence_us;    // inter-frame gap
+    uint32_t ready_us;      // bus free for the next request
+    uint_fast8_t retries;
+    uint_fast8_t head;
+    uint_fast8_t tail;
+    request_t queue[MODBUS_DMA_QUEUE];
+    bus_stats_t stats;
+} modbus_t;
+
+static modbus_t mb = {0};
+static DMA_BUFFER uint8_t tx_adu[ADU_MAX];
+static DMA_BUFFER uint8_t rx_adu[ADU_MAX];
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+static user_mcode_ptrs_t other_mcode_ptrs;
+
+static uint16_t crc16 (const uint8_t *buf, uint_fast16_t len)
+{
+    uint16_t crc = 0xFFFF;
+    uint_fast8_t bit;
+
+    while(len--) {
+        crc ^= *buf++;
+        for(bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+
+    return crc;
+}
+
+static inline void de_set (bool on)
+{
+#ifdef MODBUS_DMA_DE_PIN
+    DIGITAL_OUT(MODBUS_DMA_DE_PORT, 1 << MODBUS_DMA_DE_PIN, on);
+#endif
+}
+
+static void bus_stop (void)
+{
+    USART_TypeDef *uart = mb.port.uart;
+
+    __disable_irq();
+    uart->CR1 &= ~(USART_CR1_TCIE|USART_CR1_RTOIE|USART_CR1_RE);
+    MODBUS_DMA_TX_STREAM->CR &= ~DMA_SxCR_EN;
+    MODBUS_DMA_RX_STREAM->CR &= ~DMA_SxCR_EN;
+    mb.state = Bus_Idle;
+    __enable_irq();
+
+    de_set(false);
+}
+
+static void bus_transmit (const request_t *req)
+{
+    uint16_t crc;
+    uint_fast16_t len = 0;
+    USART_TypeDef *uart = mb.port.uart;
+
+    tx_adu[len++] = req->address;
+    tx_adu[len++] = req->function;
+    tx_adu[len++] = req->reg >> 8;
+    tx_adu[len++] = req->reg & 0xFF;
+    tx_adu[len++] = req->value >> 8;
+    tx_adu[len++] = req->value & 0xFF;
+    crc = crc16(tx_adu, len);
+    tx_adu[len++] = crc & 0xFF;
+    tx_adu[len++] = crc >> 8;
+
+    dma_buffer_clean(tx_adu, sizeof(tx_adu));
+
+    while(MODBUS_DMA_TX_STREAM->CR & DMA_SxCR_EN);
+
+    de_set(true);
+
+    mb.state = Bus_Sending;
+    mb.sent_ms = hal.get_elapsed_ticks();
+    mb.stats.requests++;
+
+    __HAL_DMA_CLEAR_FLAG(&mb.dma_tx, __HAL_DMA_GET_TC_FLAG_INDEX(&mb.dma_tx)|__HAL_DMA_GET_TE_FLAG_INDEX(&mb.dma_tx)|__HAL_DMA_GET_FE_FLAG_INDEX(&mb.dma_tx));
+    MODBUS_DMA_TX_STREAM->M0AR = (uint32_t)tx_adu;
+    MODBUS_DMA_TX_STREAM->NDTR = len;
+    MODBUS_DMA_TX_STREAM->CR |= DMA_SxCR_EN;
+
+    // The receiver stays off while sending, a half duplex transceiver may echo the request.
+    uart->ICR = USART_ICR_TCCF;
+    uart->CR1 |= USART_CR1_TCIE;
+}
+
+void modbus_dma_irq_handler (void)
+{
+    USART_TypeDef *uart = mb.port.uart;
+    uint32_t isr = uart->ISR;
+
+    if((isr & USART_ISR_TC) && (uart->CR1 & USART_CR1_TCIE)) {
+
+        uart->CR1 &= ~USART_CR1_TCIE;
+        uart->ICR = USART_ICR_TCCF;
+        de_set(false);
+
+        if(tx_adu[0] == 0)
+            mb.state = Bus_Sent;
+        else {
+            __HAL_DMA_CLEAR_FLAG(&mb.dma_rx, __HAL_DMA_GET_TC_FLAG_INDEX(&mb.dma_rx)|__HAL_DMA_GET_TE_FLAG_INDEX(&mb.dma_rx)|__HAL_DMA_GET_FE_FLAG_INDEX(&mb.dma_rx));
+            MODBUS_DMA_RX_STREAM->M0AR = (uint32_t)rx_adu;
+            MODBUS_DMA_RX_STREAM->NDTR = ADU_MAX;
+            MODBUS_DMA_RX_STREAM->CR |= DMA_SxCR_EN;
+            uart->RQR = USART_RQR_RXFRQ;
+            uart->ICR = USART_ICR_RTOCF|USART_ICR_ORECF|USART_ICR_FECF|USART_ICR_PECF|USART_ICR_NECF;
+            uart->CR1 |= USART_CR1_RE|USART_CR1_RTOIE;
+            mb.state = Bus_Waiting;
+        }
+    }
+
+    // Receiver timeout, only runs once a character has been received.
+    if((isr & USART_ISR_RTOF) && (uart->CR1 & USART_CR1_RTOIE)) {
+        uart->ICR = USART_ICR_RTOCF;
+        uart->CR1 &= ~(USART_CR1_RTOIE|USART_CR1_RE);
+        MODBUS_DMA_RX_STREAM->CR &= ~DMA_SxCR_EN;
+        mb.rx_len = ADU_MAX - MODBUS_DMA_RX_STREAM->NDTR;
+        mb.state = Bus_Received;
+    }
+}
+
+static void request_complete (modbus_dma_status_t status, const uint8_t *response)
+{
+    request_t *req = &mb.queue[mb.tail];
+    modbus_dma_result_t result = {
+        .status = status,
+        .address = req->address,
+        .function = req->function,
+        .reg = req->reg
+    };
+    uint_fast8_t idx;
+
+    if(status == ModbusDMA_Exception)
+        result.exception = response[2];
+    else if(status == ModbusDMA_OK && req->function != FUNC_WRITE_SINGLE) {
+        result.n_regs = req->value;
+        for(idx = 0; idx < result.n_regs; idx++)
+            result.regs[idx] = (response[3 + idx * 2] << 8) | response[4 + idx * 2];
+    }
+
+    mb.tail = (mb.tail + 1) & (MODBUS_DMA_QUEUE - 1);
+    mb.retries = 0;
+    mb.ready_us = hal.get_micros() + mb.silence_us;
+
+    if(req->done)
+        req->done(&result, req->context);
+}
+
+static modbus_dma_status_t response_check (const request_t *req, const uint8_t *r, uint_fast16_t n)
+{
+    if(n < 5 || crc16(r, n - 2) != (r[n - 2] | (r[n - 1] << 8)) || r[0] != req->address || (r[1] & 0x7F) != req->function)
+        return ModbusDMA_CRC;
+
+    if(r[1] & 0x80)
+        return ModbusDMA_Exception;
+
+    if(req->function == FUNC_WRITE_SINGLE)
+        return n == 8 ? ModbusDMA_OK : ModbusDMA_CRC;
+
+    return r[2] == req->value * 2 && n == 5U + r[2] ? ModbusDMA_OK : ModbusDMA_CRC;
+}
+
+static void modbus_poll (void)
+{
+    request_t *req;
+    modbus_dma_status_t status;
+
+    if(mb.head == mb.tail)
+        return;
+
+    req = &mb.queue[mb.tail];
+
+    switch(mb.state) {
+
+        case Bus_Idle:
+            if((int32_t)(hal.get_micros() - mb.ready_us) >= 0)
+                bus_transmit(req);
+            break;
+
+        case Bus_Sending:
+        case Bus_Waiting:
+            if(hal.get_elapsed_ticks() - mb.sent_ms >= MODBUS_DMA_TIMEOUT_MS) {
+                bus_stop();
+                if(mb.retries < MODBUS_DMA_RETRIES) {
+                    mb.retries++;
+                    mb.stats.retries++;
+                    bus_transmit(req);
+                } else {
+                    mb.stats.timeouts++;
+                    request_complete(ModbusDMA_Timeout, NULL);
+                }
+            }
+            break;
+
+        case Bus_Received:
+            mb.state = Bus_Idle;
+            dma_buffer_invalidate(rx_adu, sizeof(rx_adu));
+            status = response_check(req, rx_adu, mb.rx_len);
+            if(status == ModbusDMA_CRC && mb.retries < MODBUS_DMA_RETRIES) {
+                mb.retries++;
+                mb.stats.retries++;
+                mb.ready_us = hal.get_micros() + mb.silence_us;
+                break;
+            }
+            if(status == ModbusDMA_OK)
+                mb.stats.ok++;
+            else if(status == ModbusDMA_Exception)
+                mb.stats.exceptions++;
+            else
+                mb.stats.crc++;
+            request_complete(status, rx_adu);
+            break;
+
+        case Bus_Sent:
+            mb.state = Bus_Idle;
+            mb.stats.ok++;
+            request_complete(ModbusDMA_OK, NULL);
+            break;
+    }
+}
+
+static void modbus_execute_realtime (sys_state_t state)
+{
+    modbus_poll();
+
+    on_execute_realtime(state);
+}
+
+static void modbus_execute_delay (sys_state_t state)
+{
+    modbus_poll();
+
+    on_execute_delay(state);
+}
+
+static bool enqueue (const request_t *req)
+{
+    uint_fast8_t next = (mb.head + 1) & (MODBUS_DMA_QUEUE - 1);
+
+    if(!mb.ok || next == mb.tail)
+        return false;
+
+    memcpy(&mb.queue[mb.head], req, sizeof(request_t));
+    mb.head = next;
+
+    return true;
+}
+
+bool modbus_dma_read (uint8_t address, uint8_t function, uint16_t reg, uint8_t count, modbus_dma_done_ptr done, void *context)
+{
+    request_t req = {
+        .address = address,
+        .function = function,
+        .reg = reg,
+        .value = count,
+        .done = done,
+        .context = context
+    };
+
+    if(address == 0 || address > 247 || count == 0 || count > MODBUS_DMA_MAX_REGS ||
+        !(function == FUNC_READ_HOLDING || function == FUNC_READ_INPUT))
+        return false;
+
+    return enqueue(&req);
+}
+
+bool modbus_dma_write (uint8_t address, uint16_t reg, uint16_t value, modbus_dma_done_ptr done, void *context)
+{
+    request_t req = {
+        .address = address,
+        .function = FUNC_WRITE_SINGLE,
+        .reg = reg,
+        .value = value,
+        .done = done,
+        .context = context
+    };
+
+    return address <= 247 && enqueue(&req);
+}
+
+uint_fast8_t modbus_dma_pending (void)
+{
+    return (mb.head - mb.tail) & (MODBUS_DMA_QUEUE - 1);
+}
+
+void modbus_dma_flush (void)
+{
+    if(!mb.ok)
+        return;
+
+    bus_stop();
+
+    while(mb.head != mb.tail)
+        request_complete(ModbusDMA_Aborted, NULL);
+}
+
+static void report_result (const modbus_dma_result_t *result, void *context)
+{
+    static const char *const error[] = { "", "timeout", "crc", "exc", "aborted" };
+
+    char buf[32 + MODBUS_DMA_MAX_REGS * 6];
+    uint_fast8_t idx;
+    int len = snprintf(buf, sizeof(buf), "[MB|%u,%u,%u:", result->address, result->function, result->reg);
+
+    if(result->status != ModbusDMA_OK)
+        len += snprintf(buf + len, sizeof(buf) - len, "err=%s", error[result->status]);
+    if(result->status == ModbusDMA_Exception)
+        len += snprintf(buf + len, sizeof(buf) - len, "%u", result->exception);
+    if(result->status == ModbusDMA_OK && result->n_regs == 0)
+        len += snprintf(buf + len, sizeof(buf) - len, "ok");
+
+    for(idx = 0; idx < result->n_regs; idx++)
+        len += snprintf(buf + len, sizeof(buf) - len, idx ? ",%u" : "%u", result->regs[idx]);
+
+    snprintf(buf + len, sizeof(buf) - len, "]" ASCII_EOL);
+    hal.stream.write(buf);
+}
+
+// Parses up to n comma separated unsigned values, returns the number parsed or -1 on a format error.
+static int parse_args (char *args, uint32_t *values, int n)
+{
+    int i = 0;
+    char *end;
+
+    do {
+        values[i] = strtoul(args, &end, 10);
+        if(end == args || (*end != ',' && *end != '\0'))
+            return -1;
+        args = end + 1;
+    } while(++i < n && *end == ',');
+
+    return *end == '\0' ? i : -1;
+}
+
+static status_code_t mb_read (char *args, uint8_t function)
+{
+    uint32_t v[3] = { 0, 0, 1 };
+    int n;
+
+    if(!args || (n = parse_args(args, v, 3)) < 2)
+        return Status_BadNumberFormat;
+
+    if(v[0] > 255 || v[1] > 0xFFFF || v[2] > 255)
+        return Status_GcodeValueOutOfRange;
+
+    return modbus_dma_read(v[0], function, v[1], v[2], report_result, NULL) ? Status_OK : Status_InvalidStatement;
+}
+
+static status_code_t mb_read_holding (sys_state_t state, char *args)
+{
+    return mb_read(args, FUNC_READ_HOLDING);
+}
+
+static status_code_t mb_read_input (sys_state_t state, char *args)
+{
+    return mb_read(args, FUNC_READ_INPUT);
+}
+
+static status_code_t mb_write (sys_state_t state, char *args)
+{
+    uint32_t v[3];
+
+    if(!args || parse_args(args, v, 3) != 3)
+        return Status_BadNumberFormat;
+
+    if(v[0] > 255 || v[1] > 0xFFFF || v[2] > 0xFFFF)
+        return Status_GcodeValueOutOfRange;
+
+    return modbus_dma_write(v[0], v[1], v[2], report_result, NULL) ? Status_OK : Status_InvalidStatement;
+}
+
+static status_code_t mb_report (sys_state_t state, char *args)
+{
+    char buf[128];
+
+    snprintf(buf, sizeof(buf), "[MB|baud=%u,queued=%u,tx=%lu,ok=%lu,timeout=%lu,crc=%lu,exception=%lu,retry=%lu]" ASCII_EOL,
+              MODBUS_DMA_BAUD, (unsigned int)modbus_dma_pending(), mb.stats.requests, mb.stats.ok, mb.stats.timeouts,
+               mb.stats.crc, mb.stats.exceptions, mb.stats.retries);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+static user_mcode_type_t mcode_check (user_mcode_t mcode)
+{
+    return mcode == MODBUS_DMA_MCODE
+            ? UserMCode_Normal
+            : (other_mcode_ptrs.check ? other_mcode_ptrs.check(mcode) : UserMCode_Unsupported);
+}
+
+static status_code_t mcode_validate (parser_block_t *gc_block)
+{
+    if(gc_block->user_mcode != MODBUS_DMA_MCODE)
+        return other_mcode_ptrs.validate ? other_mcode_ptrs.validate(gc_block) : Status_Unhandled;
+
+    if(!(gc_block->words.p && gc_block->words.q))
+        return Status_GcodeValueWordMissing;
+
+    if(gc_block->values.p != truncf(gc_block->values.p) || gc_block->values.p < (gc_block->words.s ? 0.0f : 1.0f) || gc_block->values.p > 247.0f ||
+        gc_block->values.q != truncf(gc_block->values.q) || gc_block->values.q < 0.0f || gc_block->values.q > 65535.0f)
+        return Status_GcodeValueOutOfRange;
+
+    if(gc_block->words.s && (gc_block->values.s != truncf(gc_block->values.s) || gc_block->values.s < 0.0f || gc_block->values.s > 65535.0f))
+        return Status_GcodeValueOutOfRange;
+
+    gc_block->values.l = gc_block->words.s;
+    gc_block->words.p = gc_block->words.q = gc_block->words.s = Off;
+    gc_block->user_mcode_sync = true;
+
+    return Status_OK;
+}
+
+static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
+{
+    bool ok;
+
+    if(gc_block->user_mcode != MODBUS_DMA_MCODE) {
+        if(other_mcode_ptrs.execute)
+            other_mcode_ptrs.execute(state, gc_block);
+        return;
+    }
+
+    if(state == STATE_CHECK_MODE)
+        return;
+
+    if(gc_block->values.l)
+        ok = modbus_dma_write((uint8_t)gc_block->values.p, (uint16_t)gc_block->values.q, (uint16_t)gc_block->values.s, NULL, NULL);
+    else
+        ok = modbus_dma_read((uint8_t)gc_block->values.p, FUNC_READ_HOLDING, (uint16_t)gc_block->values.q, 1, report_result, NULL);
+
+    if(!ok)
+        report_message("Modbus: request queue full", Message_Warning);
+}
+
+void modbus_dma_init (void)
+{
+    static const sys_command_t mb_command_list[] = {
+        {"MB", mb_report, { .noargs = On }, { .str = "report Modbus RTU master statistics" } },
+        {"MBR", mb_read_holding, {}, { .str = "read holding registers, $MBR=<addr>,<reg>[,<n>]" } },
+        {"MBI", mb_read_input, {}, { .str = "read input registers, $MBI=<addr>,<reg>[,<n>]" } },
+        {"MBW", mb_write, {}, { .str = "write register, $MBW=<addr>,<reg>,<value>" } }
+    };
+
+    static sys_commands_t mb_commands = {
+        .n_commands = sizeof(mb_command_list) / sizeof(sys_command_t),
+        .commands = mb_command_list
+    };
+
+    USART_TypeDef *uart;
+    uint32_t rto_bits;
+
+    if(!serialClaimRaw(MODBUS_DMA_STREAM, &mb.port))
+        return;
+
+    uart = mb.port.uart;
+
+#ifdef MODBUS_DMA_DE_PIN
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << MODBUS_DMA_DE_PIN,
+        .Mode = GPIO_MODE_OUTPUT_PP,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_FREQ_LOW
+    };
+    de_set(false);
+    HAL_GPIO_Init(MODBUS_DMA_DE_PORT, &gpio_init);
+#endif
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    mb.dma_rx.Instance = MODBUS_DMA_RX_STREAM;
+    mb.dma_rx.Init.Request = mb.port.dma_rx_request;
+    mb.dma_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    mb.dma_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    mb.dma_rx.Init.MemInc = DMA_MINC_ENABLE;
+    mb.dma_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    mb.dma_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    mb.dma_rx.Init.Mode = DMA_NORMAL;
+    mb.dma_rx.Init.Priority = DMA_PRIORITY_LOW;
+    mb.dma_rx.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    mb.dma_tx.Instance = MODBUS_DMA_TX_STREAM;
+    mb.dma_tx.Init = mb.dma_rx.Init;
+    mb.dma_tx.Init.Request = mb.port.dma_tx_request;
+    mb.dma_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+
+    if(HAL_DMA_Init(&mb.dma_rx) != HAL_OK || HAL_DMA_Init(&mb.dma_tx) != HAL_OK)
+        return;
+
+    MODBUS_DMA_RX_STREAM->PAR = (uint32_t)&uart->RDR;
+    MODBUS_DMA_TX_STREAM->PAR = (uint32_t)&uart->TDR;
+
+    // 3.5 characters of 11 bits, fixed 1.75 ms above 19200 baud.
+    rto_bits = MODBUS_DMA_BAUD > 19200 ? (MODBUS_DMA_BAUD * 7) / 4000 : 39;
+    mb.silence_us = (rto_bits * 1000000UL) / MODBUS_DMA_BAUD;
+
+    uart->CR1 = MODBUS_DMA_EVEN_PARITY ? (USART_CR1_M0|USART_CR1_PCE) : 0;
+    uart->CR2 = USART_CR2_RTOEN;
+    uart->CR3 = USART_CR3_OVRDIS|USART_CR3_DMAR|USART_CR3_DMAT;
+    uart->RTOR = rto_bits;
+    uart->BRR = UART_DIV_SAMPLING16(mb.port.clock, MODBUS_DMA_BAUD, UART_PRESCALER_DIV1);
+    uart->CR1 |= USART_CR1_TE|USART_CR1_UE;
+
+    HAL_NVIC_SetPriority(mb.port.irq, IRQ_PRIO_SERIAL, 0);
+    HAL_NVIC_EnableIRQ(mb.port.irq);
+
+    mb.ok = true;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = modbus_execute_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = modbus_execute_delay;
+
+    memcpy(&other_mcode_ptrs, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+    grbl.user_mcode.check = mcode_check;
+    grbl.user_mcode.validate = mcode_validate;
+    grbl.user_mcode.execute = mcode_execute;
+
+    system_register_commands(&mb_commands);
+}
+
+#endif // MODBUS_DMA_ENABLE
@@ -0,0 +1,281 @@
+/*
+  mqtt_metrics.c - job metrics published to an MQTT broker
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A job runs from the first cycle start out of idle until the machine is idle again, or in alarm.
+  Holds and tool changes are part of the job. Per job, the metrics are accumulated from the
+  counters at job start and published as one JSON message to MQTT_METRICS_TOPIC:
+
+    {"job":,"done":,"dur_ms":,"cut_ms":,"pulses":,"shorts":,"retracts":,"energy_j":,"alarms":}
+
+  While a job runs a progress message (done 0) is published every MQTT_METRICS_PERIOD_S at QoS 0,
+  skipped if not connected. The summary (done 1) is published at QoS 1 and kept until sent, only
+  the latest is kept. EDM fields are zero without EDM_ENABLE.
+
+  Everything runs from the realtime loop, the broker is only connected when there is something to
+  publish and the traffic is a few messages per job, so the network never competes with motion.
+
+  $MQTTM=<broker IP>
+
+    Sets the broker, $MQTTM reports the state:
+
+    [MQTTM|broker=,connected=,jobs=,published=,dropped=]
+*/
+
+#include "driver.h"
+
+#if MQTT_METRICS_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lwip/ip_addr.h"
+#include "lwip/apps/mqtt.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "mqtt_metrics.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef MQTT_METRICS_BROKER
+#define MQTT_METRICS_BROKER "192.168.0.10"
+#endif
+#ifndef MQTT_METRICS_PORT
+#define MQTT_METRICS_PORT MQTT_PORT
+#endif
+#ifndef MQTT_METRICS_TOPIC
+#define MQTT_METRICS_TOPIC "spark/metrics"
+#endif
+#ifndef MQTT_METRICS_PERIOD_S
+#define MQTT_METRICS_PERIOD_S 10    // progress message interval while a job runs
+#endif
+#ifndef MQTT_METRICS_RETRY_MS
+#define MQTT_METRICS_RETRY_MS 5000  // between connection attempts
+#endif
+#ifndef MQTT_METRICS_KEEP_ALIVE_S
+#define MQTT_METRICS_KEEP_ALIVE_S 60
+#endif
+
+// Counters the job metrics are taken from.
+typedef struct {
+    uint32_t t_ms;
+    uint32_t cut_ms;
+    uint32_t pulses;
+    uint32_t shorts;
+    uint32_t retracts;
+    float energy_j;
+    uint32_t alarms;
+} job_counters_t;
+
+typedef struct {
+    mqtt_client_t *client;
+    ip_addr_t broker;
+    char client_id[16];
+    bool connecting;
+    uint32_t connect_ms;        // last connection attempt
+    uint32_t job;               // current or last job number
+    bool active;
+    uint32_t progress_ms;       // last progress message
+    job_counters_t base;        // at job start
+    job_counters_t end;         // at job end
+    bool end_pending;           // summary not sent yet
+    uint32_t alarms;            // since boot
+    uint32_t published;
+    uint32_t dropped;
+} mqtt_metrics_t;
+
+static mqtt_metrics_t metrics = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+static on_state_change_ptr on_state_change;
+
+static void counters_get (job_counters_t *c)
+{
+    memset(c, 0, sizeof(job_counters_t));
+
+    c->t_ms = hal.get_elapsed_ticks();
+    c->alarms = metrics.alarms;
+
+#if EDM_ENABLE
+    edm_telemetry_t edm;
+
+    edm_get_telemetry(&edm);
+    c->cut_ms = edm.cut_ms;
+    c->pulses = edm.pulses;
+    c->shorts = edm.shorts;
+    c->retracts = edm.retracts;
+    c->energy_j = edm.energy_j;
+#endif
+}
+
+static void metrics_published (void *arg, err_t result)
+{
+    if(result == ERR_OK)
+        metrics.published++;
+    else
+        metrics.dropped++;
+}
+
+// Publishes the difference of now and the job start counters.
+static bool metrics_publish (const job_counters_t *now, bool done)
+{
+    char msg[200];
+    int len;
+
+    len = snprintf(msg, sizeof(msg),
+                    "{\"job\":%lu,\"done\":%d,\"dur_ms\":%lu,\"cut_ms\":%lu,\"pulses\":%lu,\"shorts\":%lu,"
+                     "\"retracts\":%lu,\"energy_j\":%.1f,\"alarms\":%lu}",
+                      metrics.job, done, now->t_ms - metrics.base.t_ms, now->cut_ms - metrics.base.cut_ms,
+                       now->pulses - metrics.base.pulses, now->shorts - metrics.base.shorts,
+                        now->retracts - metrics.base.retracts, now->energy_j - metrics.base.energy_j,
+                         now->alarms - metrics.base.alarms);
+
+    return mqtt_publish(metrics.client, MQTT_METRICS_TOPIC, msg, (u16_t)len, done ? 1 : 0, 0, metrics_published, NULL) == ERR_OK;
+}
+
+static void metrics_connected (mqtt_client_t *client, void *arg, mqtt_connection_status_t status)
+{
+    metrics.connecting = false;
+}
+
+static void metrics_connect (uint32_t now_ms)
+{
+    static const struct mqtt_connect_client_info_t client_info = {
+        .client_id = metrics.client_id,
+        .keep_alive = MQTT_METRICS_KEEP_ALIVE_S
+    };
+
+    if(metrics.connecting || now_ms - metrics.connect_ms < MQTT_METRICS_RETRY_MS)
+        return;
+
+    metrics.connect_ms = now_ms;
+    metrics.connecting = mqtt_client_connect(metrics.client, &metrics.broker, MQTT_METRICS_PORT,
+                                              metrics_connected, NULL, &client_info) == ERR_OK;
+}
+
+static void metrics_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    uint32_t now_ms = hal.get_elapsed_ticks();
+    bool progress = metrics.active && now_ms - metrics.progress_ms >= MQTT_METRICS_PERIOD_S * 1000;
+
+    if(!(progress || metrics.end_pending))
+        return;
+
+    if(!mqtt_client_is_connected(metrics.client)) {
+        metrics_connect(now_ms);
+        if(progress)
+            metrics.progress_ms = now_ms;   // skipped, next one on schedule
+        return;
+    }
+
+    if(metrics.end_pending) {
+        if(metrics_publish(&metrics.end, true))
+            metrics.end_pending = false;
+    } else {
+        job_counters_t now;
+
+        counters_get(&now);
+        metrics.progress_ms = now_ms;
+        if(!metrics_publish(&now, false))
+            metrics.dropped++;
+    }
+}
+
+static void metrics_state_change (sys_state_t state)
+{
+    if(state == STATE_ALARM || state == STATE_ESTOP)
+        metrics.alarms++;
+
+    if(!metrics.active && state == STATE_CYCLE) {
+        metrics.active = true;
+        metrics.end_pending = false;    // superseded
+        metrics.job++;
+        counters_get(&metrics.base);
+        metrics.progress_ms = metrics.base.t_ms;
+    } else if(metrics.active && (state == STATE_IDLE || state == STATE_ALARM || state == STATE_ESTOP)) {
+        metrics.active = false;
+        counters_get(&metrics.end);
+        metrics.end_pending = true;
+    }
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+static status_code_t metrics_command (sys_state_t state, char *args)
+{
+    char buf[96];
+
+    if(args) {
+        ip_addr_t addr;
+
+        if(!ipaddr_aton(args, &addr))
+            return Status_InvalidStatement;
+
+        if(mqtt_client_is_connected(metrics.client))
+            mqtt_disconnect(metrics.client);
+        metrics.broker = addr;
+        metrics.connecting = false;
+        metrics.connect_ms = hal.get_elapsed_ticks() - MQTT_METRICS_RETRY_MS;
+    }
+
+    snprintf(buf, sizeof(buf), "[MQTTM|broker=%s,connected=%d,jobs=%lu,published=%lu,dropped=%lu]" ASCII_EOL,
+              ipaddr_ntoa(&metrics.broker), mqtt_client_is_connected(metrics.client), metrics.job,
+               metrics.published, metrics.dropped);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+bool mqtt_metrics_init (void)
+{
+    static const sys_command_t metrics_command_list[] = {
+        {"MQTTM", metrics_command, {}, { .str = "MQTT job metrics state, $MQTTM=<broker IP> to set the broker" } }
+    };
+
+    static sys_commands_t metrics_commands = {
+        .n_commands = sizeof(metrics_command_list) / sizeof(sys_command_t),
+        .commands = metrics_command_list
+    };
+
+    if(metrics.client || (metrics.client = mqtt_client_new()) == NULL)
+        return false;
+
+    ipaddr_aton(MQTT_METRICS_BROKER, &metrics.broker);
+    snprintf(metrics.client_id, sizeof(metrics.client_id), "spark-%08lx", HAL_GetUIDw0() ^ HAL_GetUIDw1() ^ HAL_GetUIDw2());
+    metrics.connect_ms = hal.get_elapsed_ticks() - MQTT_METRICS_RETRY_MS;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = metrics_execute_realtime;
+
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = metrics_state_change;
+
+    system_register_commands(&metrics_commands);
+
+    return true;
+}
+
+#endif // MQTT_METRICS_ENABLE
@@ -0,0 +1,317 @@
+/*
+  neopixel_spi.c - WS2812 addressable LED strip on SPI MOSI, sent by DMA
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Each LED bit is sent as three SPI bits at ~2.4 MHz, 110 for a 1 and 100 for a 0, GRB order,
+  i.e. 9 bytes per LED followed by 24 zero bytes (> 80 us) for the latch.
+
+  hal.rgb0.out() encodes the colour into the frame in RAM right away and marks it changed if the
+  encoding differs, hal.rgb0.write() (or out() for a single LED) sends it. Sending copies the
+  frame to a DMA_BUFFER and starts a TX only transfer without waiting for it, the end of the
+  transfer is polled from the realtime loop. A write while a frame is still being sent is
+  deferred until it is done, a write without changes does nothing. Neither call blocks.
+
+  The strip length is taken from the $536 setting (RGB_LED_ENABLE), capped at NEOPIXEL_MAX_LEDS.
+*/
+
+#include "driver.h"
+
+#ifdef NEOPIXEL_SPI
+
+#include <string.h>
+
+#include "cache.h"
+
+#include "grbl/hal.h"
+#include "grbl/settings.h"
+
+#if NEOPIXEL_SPI != 1
+#error "NEOPIXEL_SPI is only supported on SPI1 (MOSI on PA7)!"
+#endif
+
+#if TRINAMIC_SPI_ENABLE && SPI_PORT == 1
+#error "NEOPIXEL_SPI and SPI_PORT cannot use the same SPI peripheral!"
+#endif
+
+#ifndef NEOPIXEL_MAX_LEDS
+#define NEOPIXEL_MAX_LEDS 32
+#endif
+
+#ifndef NEOPIXEL_DMA_STREAM
+#if STEP_PULSE_DMA
+#error "DMA1_Stream3 is used by STEP_PULSE_DMA, set NEOPIXEL_DMA_STREAM to a free stream!"
+#endif
+#define NEOPIXEL_DMA_STREAM DMA1_Stream3
+#endif
+
+#define NEOPIXEL_BIT_HZ     2400000
+#define NEOPIXEL_LED_BYTES  9
+#define NEOPIXEL_LATCH      24
+#define NEOPIXEL_FRAME_SIZE (NEOPIXEL_MAX_LEDS * NEOPIXEL_LED_BYTES + NEOPIXEL_LATCH)
+
+typedef struct {
+    uint_fast16_t num_leds;
+    uint8_t intensity;
+    bool changed;               // frame differs from the one last sent
+    bool pending;               // write requested while sending
+    volatile bool sending;
+    rgb_color_t color[NEOPIXEL_MAX_LEDS];
+    uint8_t frame[NEOPIXEL_FRAME_SIZE];
+    DMA_HandleTypeDef dma;
+} neopixel_t;
+
+static neopixel_t neopixel = { .intensity = 255 };
+static DMA_BUFFER uint8_t tx_frame[NEOPIXEL_FRAME_SIZE];
+static on_execute_realtime_ptr on_execute_realtime;
+static settings_changed_ptr settings_changed;
+
+// Expands a byte to 24 SPI bits, MSB first.
+static inline void encode_byte (uint8_t *out, uint8_t value)
+{
+    uint32_t bits = 0;
+    uint_fast8_t bit = 8;
+
+    do {
+        bit--;
+        bits = (bits << 3) | ((value & (1 << bit)) ? 0b110 : 0b100);
+    } while(bit);
+
+    out[0] = (uint8_t)(bits >> 16);
+    out[1] = (uint8_t)(bits >> 8);
+    out[2] = (uint8_t)bits;
+}
+
+static void encode_led (uint_fast16_t device)
+{
+    uint8_t led[NEOPIXEL_LED_BYTES], *out = &neopixel.frame[device * NEOPIXEL_LED_BYTES];
+    rgb_color_t color = neopixel.color[device];
+
+    encode_byte(&led[0], (uint8_t)(((uint32_t)color.G * neopixel.intensity) / 255));
+    encode_byte(&led[3], (uint8_t)(((uint32_t)color.R * neopixel.intensity) / 255));
+    encode_byte(&led[6], (uint8_t)(((uint32_t)color.B * neopixel.intensity) / 255));
+
+    if(memcmp(out, led, NEOPIXEL_LED_BYTES)) {
+        memcpy(out, led, NEOPIXEL_LED_BYTES);
+        neopixel.changed = true;
+    }
+}
+
+static void frame_send (void)
+{
+    uint32_t size = neopixel.num_leds * NEOPIXEL_LED_BYTES + NEOPIXEL_LATCH;
+
+    memcpy(tx_frame, neopixel.frame, size);
+    dma_buffer_clean(tx_frame, size);
+
+    neopixel.changed = neopixel.pending = false;
+    neopixel.sending = true;
+
+    // TSIZE may only be changed with the SPI disabled, the previous transfer has ended here.
+    SPI1->CR1 &= ~SPI_CR1_SPE;
+    SPI1->IFCR = SPI_IFCR_EOTC|SPI_IFCR_TXTFC;
+
+    __HAL_DMA_DISABLE(&neopixel.dma);
+    __HAL_DMA_CLEAR_FLAG(&neopixel.dma, __HAL_DMA_GET_TC_FLAG_INDEX(&neopixel.dma)|__HAL_DMA_GET_HT_FLAG_INDEX(&neopixel.dma)|
+                                         __HAL_DMA_GET_TE_FLAG_INDEX(&neopixel.dma)|__HAL_DMA_GET_FE_FLAG_INDEX(&neopixel.dma));
+    ((DMA_Stream_TypeDef *)neopixel.dma.Instance)->M0AR = (uint32_t)tx_frame;
+    ((DMA_Stream_TypeDef *)neopixel.dma.Instance)->NDTR = size;
+    __HAL_DMA_ENABLE(&neopixel.dma);
+
+    SPI1->CR2 = size;
+    SPI1->CFG1 |= SPI_CFG1_TXDMAEN;
+    SPI1->CR1 |= SPI_CR1_SPE;
+    SPI1->CR1 |= SPI_CR1_CSTART;
+}
+
+static void neopixels_write (void)
+{
+    if(neopixel.num_leds == 0 || !neopixel.changed)
+        return;
+
+    if(neopixel.sending)
+        neopixel.pending = true;
+    else
+        frame_send();
+}
+
+static void neopixel_out_masked (uint16_t device, rgb_color_t color, rgb_color_mask_t mask)
+{
+    if(device < neopixel.num_leds) {
+
+        if(mask.R)
+            neopixel.color[device].R = color.R;
+        if(mask.G)
+            neopixel.color[device].G = color.G;
+        if(mask.B)
+            neopixel.color[device].B = color.B;
+
+        encode_led(device);
+
+        if(neopixel.num_leds == 1)
+            neopixels_write();
+    }
+}
+
+static void neopixel_out (uint16_t device, rgb_color_t color)
+{
+    neopixel_out_masked(device, color, (rgb_color_mask_t){ .mask = 0xFF });
+}
+
+static uint8_t neopixels_set_intensity (uint8_t intensity)
+{
+    uint8_t prev = neopixel.intensity;
+    uint_fast16_t device = neopixel.num_leds;
+
+    if(neopixel.intensity != intensity) {
+
+        neopixel.intensity = intensity;
+
+        if(device) do {
+            encode_led(--device);
+        } while(device);
+
+        if(neopixel.num_leds == 1)
+            neopixels_write();
+    }
+
+    return prev;
+}
+
+static void neopixel_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(neopixel.sending && (SPI1->SR & SPI_SR_EOT)) {
+        SPI1->IFCR = SPI_IFCR_EOTC|SPI_IFCR_TXTFC;
+        SPI1->CFG1 &= ~SPI_CFG1_TXDMAEN;
+        neopixel.sending = false;
+        if(neopixel.pending)
+            neopixels_write();
+    }
+}
+
+static void neopixel_settings_changed (settings_t *settings, settings_changed_flags_t changed)
+{
+    if(settings->rgb_strip.length0 == 0)
+        settings->rgb_strip.length0 = hal.rgb0.num_devices;
+
+    if(neopixel.num_leds != min(settings->rgb_strip.length0, NEOPIXEL_MAX_LEDS)) {
+
+        neopixel.num_leds = hal.rgb0.num_devices = min(settings->rgb_strip.length0, NEOPIXEL_MAX_LEDS);
+
+        // All LEDs off, the latch bytes after the last LED are zero.
+        memset(neopixel.color, 0, sizeof(neopixel.color));
+        memset(neopixel.frame, 0, sizeof(neopixel.frame));
+        for(uint_fast16_t device = 0; device < neopixel.num_leds; device++)
+            encode_led(device);
+        neopixel.changed = true;
+        neopixels_write();
+    }
+
+    if(settings_changed)
+        settings_changed(settings, changed);
+}
+
+void neopixel_init (void)
+{
+    static SPI_HandleTypeDef spi = {
+        .Instance               = SPI1,
+        .Init.Mode              = SPI_MODE_MASTER,
+        .Init.Direction         = SPI_DIRECTION_2LINES_TXONLY,
+        .Init.CLKPhase          = SPI_PHASE_1EDGE,
+        .Init.CLKPolarity       = SPI_POLARITY_LOW,
+        .Init.DataSize          = SPI_DATASIZE_8BIT,
+        .Init.FirstBit          = SPI_FIRSTBIT_MSB,
+        .Init.TIMode            = SPI_TIMODE_DISABLE,
+        .Init.CRCCalculation    = SPI_CRCCALCULATION_DISABLE,
+        .Init.NSS               = SPI_NSS_SOFT,
+        .Init.NSSPMode          = SPI_NSS_PULSE_DISABLE,
+        .Init.FifoThreshold     = SPI_FIFO_THRESHOLD_01DATA,
+        .Init.MasterKeepIOState = SPI_MASTER_KEEP_IO_STATE_ENABLE,  // MOSI stays low between frames
+    };
+
+    static const periph_pin_t mosi = {
+        .function = Output_MOSI,
+        .group = PinGroup_SPI,
+        .port = GPIOA,
+        .pin = 7,
+        .mode = { .mask = PINMODE_NONE },
+        .description = "Neopixels"
+    };
+
+    uint32_t clock_hz, prescaler = 0;
+
+    GPIO_InitTypeDef GPIO_InitStruct = {
+        .Pin = GPIO_PIN_7,
+        .Mode = GPIO_MODE_AF_PP,
+        .Pull = GPIO_NOPULL,
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Alternate = GPIO_AF5_SPI1
+    };
+
+    __HAL_RCC_SPI1_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    // Prescaler 2^(n+1) giving the bit clock closest to NEOPIXEL_BIT_HZ.
+    clock_hz = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SPI123);
+    while(prescaler < 7 && (clock_hz >> (prescaler + 1)) > NEOPIXEL_BIT_HZ &&
+           (clock_hz >> (prescaler + 1)) - NEOPIXEL_BIT_HZ > NEOPIXEL_BIT_HZ - (clock_hz >> (prescaler + 2)))
+        prescaler++;
+    spi.Init.BaudRatePrescaler = prescaler << SPI_CFG1_MBR_Pos;
+
+    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+    if(HAL_SPI_Init(&spi) != HAL_OK)
+        return;
+
+    neopixel.dma.Instance = NEOPIXEL_DMA_STREAM;
+    neopixel.dma.Init.Request = DMA_REQUEST_SPI1_TX;
+    neopixel.dma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    neopixel.dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    neopixel.dma.Init.MemInc = DMA_MINC_ENABLE;
+    neopixel.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    neopixel.dma.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    neopixel.dma.Init.Mode = DMA_NORMAL;
+    neopixel.dma.Init.Priority = DMA_PRIORITY_LOW;
+    neopixel.dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&neopixel.dma) != HAL_OK)
+        return;
+
+    ((DMA_Stream_TypeDef *)neopixel.dma.Instance)->PAR = (uint32_t)&SPI1->TXDR;
+
+    hal.periph_port.register_pin(&mosi);
+
+    hal.rgb0.out = neopixel_out;
+    hal.rgb0.out_masked = neopixel_out_masked;
+    hal.rgb0.write = neopixels_write;
+    hal.rgb0.set_intensity = neopixels_set_intensity;
+    hal.rgb0.flags = (rgb_properties_t){ .is_strip = On };
+    hal.rgb0.cap = (rgb_color_t){ .R = 255, .G = 255, .B = 255 };
+    if(hal.rgb0.num_devices == 0)
+        hal.rgb0.num_devices = 1;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = neopixel_execute_realtime;
+
+    settings_changed = hal.settings_changed;
+    hal.settings_changed = neopixel_settings_changed;
+}
+
+#endif // NEOPIXEL_SPI
@@ -0,0 +1,318 @@
+/*
+  pendant.c - I2C pendant/keypad read on the strobe interrupt with continuous jogging
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Replaces the keypad plugin for pendants using its protocol: the pendant pulls the strobe line low
+  while a key is held and returns the keycode on a one byte read at PENDANT_I2C_ADDRESS.
+
+  The strobe edge queues the read as a high priority transaction on the I2C queue, so it goes out
+  ahead of EEPROM and other low priority traffic and completes in interrupt context, no polled
+  receive. The key is acted on in the next pass of the realtime loop.
+
+  While a jog key is held, jog moves of PENDANT_JOG_SEGMENT_MS worth of travel are generated here
+  and fed to the parser, keeping no more than PENDANT_JOG_BLOCKS of them in the planner. Motion
+  starts with the first segment and the distance queued ahead is short, the release of the strobe
+  sends a jog cancel which stops the motion with the planned deceleration. In step mode each press
+  is a single move of PENDANT_JOG_STEP.
+
+  Keycodes, as the keypad plugin:
+
+    R L F B U D       - X+ X- Y+ Y- Z+ Z-
+    r q s t           - X+Y+ X+Y- X-Y+ X-Y-
+    0 1 2             - jog mode fast, slow, step
+    h                 - next jog mode
+    other             - passed on as realtime command, e.g. ! ~ and the override codes
+
+  $PENDANT            - report: [PENDANT|mode=,fast=,slow=,step=,keys=,jogs=,errors=,latency_us=,maxlatency_us=]
+                        latency is from the strobe edge to the first jog move accepted by the parser
+  $PENDANT=<fast>,<slow>,<step> - jog feed rates in mm/min and step distance in mm, until reset
+*/
+
+#include "driver.h"
+
+#if PENDANT_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+#include "grbl/planner.h"
+#include "grbl/protocol.h"
+#include "grbl/state_machine.h"
+
+#include "i2c.h"
+#include "pendant.h"
+
+#ifndef PENDANT_I2C_ADDRESS
+#define PENDANT_I2C_ADDRESS 0x49        // keypad plugin default
+#endif
+#ifndef PENDANT_JOG_FAST
+#define PENDANT_JOG_FAST 1000.0f        // mm/min
+#endif
+#ifndef PENDANT_JOG_SLOW
+#define PENDANT_JOG_SLOW 100.0f         // mm/min
+#endif
+#ifndef PENDANT_JOG_STEP
+#define PENDANT_JOG_STEP 0.01f          // mm
+#endif
+#ifndef PENDANT_JOG_SEGMENT_MS
+#define PENDANT_JOG_SEGMENT_MS 25
+#endif
+#ifndef PENDANT_JOG_BLOCKS
+#define PENDANT_JOG_BLOCKS 3
+#endif
+
+typedef enum {
+    Jog_Fast = 0,
+    Jog_Slow,
+    Jog_Step,
+    Jog_N
+} jog_mode_t;
+
+typedef struct {
+    char key;
+    int8_t x, y, z;
+} jog_key_t;
+
+static const jog_key_t jog_keys[] = {
+    { 'R',  1,  0,  0 },
+    { 'L', -1,  0,  0 },
+    { 'F',  0,  1,  0 },
+    { 'B',  0, -1,  0 },
+    { 'U',  0,  0,  1 },
+    { 'D',  0,  0, -1 },
+    { 'r',  1,  1,  0 },
+    { 'q',  1, -1,  0 },
+    { 's', -1,  1,  0 },
+    { 't', -1, -1,  0 }
+};
+
+static struct {
+    uint8_t keycode;                // read buffer
+    volatile bool reading;
+    volatile bool key_ready;
+    volatile bool held;             // strobe asserted
+    volatile uint32_t strobe_us;
+    const jog_key_t *jog;           // jog key held, NULL if none
+    bool jogging;                   // jog moves sent since the key was pressed
+    bool latency_pending;
+    jog_mode_t mode;
+    float feed[2];
+    float step;
+    char cmd[64];
+    uint32_t keys;
+    uint32_t jogs;
+    uint32_t errors;
+    uint32_t latency_us;
+    uint32_t max_latency_us;
+} pd = {
+    .feed = { PENDANT_JOG_FAST, PENDANT_JOG_SLOW },
+    .step = PENDANT_JOG_STEP
+};
+
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void keycode_complete (bool ok, void *context)
+{
+    if(ok && pd.keycode != 0)
+        pd.key_ready = true;
+    else
+        pd.errors++;
+
+    pd.reading = false;
+}
+
+static void pendant_strobe (uint_fast8_t id, bool level)
+{
+    static i2c_transaction_t t = {
+        .op = I2C_OpReceive,
+        .priority = I2C_PriorityHigh,
+        .address = PENDANT_I2C_ADDRESS,
+        .data = &pd.keycode,
+        .count = 1,
+        .callback = keycode_complete
+    };
+
+    pd.held = level;
+
+    if(level && !pd.reading) {
+        pd.strobe_us = hal.get_micros();
+        pd.keycode = 0;
+        pd.reading = true;
+        if(!i2c_queue_transaction(&t)) {
+            pd.reading = false;
+            pd.errors++;
+        }
+    }
+}
+
+// Builds a relative jog move of distance mm along the key direction, false if rejected by the parser.
+static bool jog_send (const jog_key_t *jog, float distance, float feed)
+{
+    int len = sprintf(pd.cmd, "$J=G91G21");
+
+    if(jog->x)
+        len += sprintf(pd.cmd + len, "X%.4f", jog->x * distance);
+    if(jog->y)
+        len += sprintf(pd.cmd + len, "Y%.4f", jog->y * distance);
+    if(jog->z)
+        len += sprintf(pd.cmd + len, "Z%.4f", jog->z * distance);
+    sprintf(pd.cmd + len, "F%.1f", feed);
+
+    if(!grbl.enqueue_gcode(pd.cmd))
+        return false;
+
+    pd.jogs++;
+    if(pd.latency_pending) {
+        pd.latency_pending = false;
+        if((pd.latency_us = hal.get_micros() - pd.strobe_us) > pd.max_latency_us)
+            pd.max_latency_us = pd.latency_us;
+    }
+
+    return true;
+}
+
+static void pendant_key (char key)
+{
+    uint_fast8_t idx = sizeof(jog_keys) / sizeof(jog_key_t);
+
+    pd.keys++;
+
+    do {
+        if(jog_keys[--idx].key == key) {
+            pd.jog = &jog_keys[idx];
+            pd.latency_pending = true;
+            return;
+        }
+    } while(idx);
+
+    switch(key) {
+
+        case '0':
+        case '1':
+        case '2':
+            pd.mode = (jog_mode_t)(key - '0');
+            break;
+
+        case 'h':
+            pd.mode = (jog_mode_t)((pd.mode + 1) % Jog_N);
+            break;
+
+        default:
+            grbl.enqueue_realtime_command(key);
+            break;
+    }
+}
+
+static void pendant_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(pd.key_ready) {
+        pd.key_ready = false;
+        pendant_key((char)pd.keycode);
+    }
+
+    if(pd.jog == NULL)
+        return;
+
+    if(!(state == STATE_IDLE || state == STATE_JOG)) {
+        pd.jog = NULL;
+        pd.jogging = false;
+        return;
+    }
+
+    if(pd.mode == Jog_Step) {
+        if(jog_send(pd.jog, pd.step, pd.feed[Jog_Slow]))
+            pd.jog = NULL;
+        return;
+    }
+
+    if(!pd.held) {
+        // Released, possibly before the first move went out.
+        if(pd.jogging)
+            grbl.enqueue_realtime_command(CMD_JOG_CANCEL);
+        pd.jog = NULL;
+        pd.jogging = false;
+        return;
+    }
+
+    if(plan_get_block_buffer_count() < PENDANT_JOG_BLOCKS) {
+        float feed = pd.feed[pd.mode];
+        if(jog_send(pd.jog, feed * (float)PENDANT_JOG_SEGMENT_MS / 60000.0f, feed))
+            pd.jogging = true;
+    }
+}
+
+static status_code_t pendant_command (sys_state_t state, char *args)
+{
+    char buf[140];
+
+    if(args) {
+        char *end;
+        float fast = strtof(args, &end), slow, step;
+        if(*end != ',')
+            return Status_BadNumberFormat;
+        slow = strtof(end + 1, &end);
+        if(*end != ',')
+            return Status_BadNumberFormat;
+        step = strtof(end + 1, &end);
+        if(*end != '\0')
+            return Status_BadNumberFormat;
+        if(fast <= 0.0f || slow <= 0.0f || step <= 0.0f)
+            return Status_InvalidStatement;
+        pd.feed[Jog_Fast] = fast;
+        pd.feed[Jog_Slow] = slow;
+        pd.step = step;
+        return Status_OK;
+    }
+
+    snprintf(buf, sizeof(buf), "[PENDANT|mode=%d,fast=%g,slow=%g,step=%g,keys=%lu,jogs=%lu,errors=%lu,latency_us=%lu,maxlatency_us=%lu]" ASCII_EOL,
+              pd.mode, pd.feed[Jog_Fast], pd.feed[Jog_Slow], pd.step, pd.keys, pd.jogs, pd.errors, pd.latency_us, pd.max_latency_us);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void pendant_init (void)
+{
+    static const sys_command_t pendant_command_list[] = {
+        {"PENDANT", pendant_command, {}, { .str = "pendant jog report, $PENDANT=<fast>,<slow>,<step> sets the jog feeds and step" } }
+    };
+
+    static sys_commands_t pendant_commands = {
+        .n_commands = sizeof(pendant_command_list) / sizeof(sys_command_t),
+        .commands = pendant_command_list
+    };
+
+    if(hal.irq_claim == NULL || !hal.irq_claim(IRQ_I2C_Strobe, 0, pendant_strobe)) {
+        protocol_enqueue_foreground_task(report_warning, "Pendant: I2C strobe not available!");
+        return;
+    }
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = pendant_execute_realtime;
+
+    system_register_commands(&pendant_commands);
+}
+
+#endif // PENDANT_ENABLE
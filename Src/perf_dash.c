@@ -0,0 +1,313 @@
+/*
+  perf_dash.c - consolidated performance report
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Collects the figures that tell whether a board keeps up with its EDM load in one report, cheap
+  enough to be left enabled: a DWT read and a few compares per pass of the realtime loop, a counter
+  per stream read and a strlen() per stream write. Rates are taken over PERF_DASH_WINDOW_MS windows
+  from counters the other modules keep anyway, minimums, maximums and counts run since the last reset.
+
+  CPU idle is taken from cpu_load.c with CPU_LOAD_ENABLE, else estimated by idle loop counting: the
+  shortest realtime loop pass seen is taken as the cost of a pass with nothing to do, idle is
+  passes * that cost over the window. Time in WFI with IDLE_SLEEP_ENABLE is not counted as the cycle
+  counter stops.
+
+  I2C latency is the PULSER poll from start to completion, percentiles are the upper bounds of the
+  power of two microsecond bins the EDM plugin counts them in.
+
+  $PERF   - report, fields with no source in the build are left out:
+
+    [PERF|LOOP,hz=,idle=,pass_min_cyc=]
+    [PERF|EDM,poll_hz=,target_hz=,min_hz=,skips=,errs=,i2c_p50_us=,i2c_p99_us=,i2c_max_us=,rlat_us=,rlat_max_us=,rlat_n=]
+    [PERF|STEP,isr_max_cyc=,isr_max_us=,lat_max_ticks=]
+    [PERF|STREAM,rx_bps=,tx_bps=,rx_free_min=,planner_max=]
+
+    poll_hz is achieved, target_hz the rate in use and min_hz the lowest window. The STEP line needs
+    ISR_PROFILE_ENABLE, its maximums are reset by $ISRPROF=R. The retract latency maximum runs since boot.
+
+  $PERF=R - reset, then report
+*/
+
+#include "driver.h"
+
+#if PERF_DASH_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/planner.h"
+
+#include "perf_dash.h"
+#include "isr_profile.h"
+#include "cpu_load.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef PERF_DASH_WINDOW_MS
+#define PERF_DASH_WINDOW_MS 1000
+#endif
+
+typedef struct {
+    // realtime loop
+    uint32_t pass_cyc;          // DWT->CYCCNT at the last pass
+    uint32_t pass_min;
+    uint32_t passes;            // in the current window
+    uint64_t window_cyc;
+    uint32_t loop_hz;
+    uint32_t idle_pct;
+    // stream
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    uint32_t rx_window;         // at window start
+    uint32_t tx_window;
+    uint32_t rx_bps;
+    uint32_t tx_bps;
+    uint16_t rx_free_min;
+    uint8_t planner_max;
+#if EDM_ENABLE
+    edm_perf_t edm_base;        // at reset
+    uint32_t polls_window;      // at window start
+    uint32_t poll_hz;
+    uint32_t poll_hz_min;
+    bool poll_hz_valid;         // a complete window since reset
+#endif
+    uint32_t window_ms;         // window start
+} perf_dash_t;
+
+static perf_dash_t perf = {0};
+static stream_read_ptr stream_read;
+static stream_write_ptr stream_write;
+static on_stream_changed_ptr on_stream_changed;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static int16_t perf_read (void)
+{
+    int16_t c = stream_read();
+
+    if(c != SERIAL_NO_DATA)
+        perf.rx_bytes++;
+
+    return c;
+}
+
+static void perf_write (const char *s)
+{
+    perf.tx_bytes += strlen(s);
+    stream_write(s);
+}
+
+static void perf_hook (stream_type_t type)
+{
+    if(hal.stream.read && hal.stream.read != perf_read) {
+        stream_read = hal.stream.read;
+        hal.stream.read = perf_read;
+    }
+
+    if(hal.stream.write && hal.stream.write != perf_write) {
+        stream_write = hal.stream.write;
+        hal.stream.write = perf_write;
+    }
+}
+
+static void perf_stream_changed (stream_type_t type)
+{
+    if(on_stream_changed)
+        on_stream_changed(type);
+
+    perf_hook(type);
+}
+
+static void perf_reset (void)
+{
+    perf.pass_min = UINT32_MAX;
+    perf.rx_free_min = UINT16_MAX;
+    perf.planner_max = 0;
+#if EDM_ENABLE
+    edm_get_perf(&perf.edm_base);
+    perf.poll_hz_valid = false;
+#endif
+}
+
+static void perf_window (uint32_t now_ms)
+{
+    uint32_t dt_ms = now_ms - perf.window_ms;
+
+    perf.window_ms = now_ms;
+
+    perf.loop_hz = (uint32_t)((uint64_t)perf.passes * 1000 / dt_ms);
+    perf.idle_pct = perf.window_cyc ? (uint32_t)((uint64_t)perf.passes * perf.pass_min * 100 / perf.window_cyc) : 0;
+    if(perf.idle_pct > 100)
+        perf.idle_pct = 100;
+    perf.passes = 0;
+    perf.window_cyc = 0;
+
+    perf.rx_bps = (uint32_t)((uint64_t)(perf.rx_bytes - perf.rx_window) * 1000 / dt_ms);
+    perf.tx_bps = (uint32_t)((uint64_t)(perf.tx_bytes - perf.tx_window) * 1000 / dt_ms);
+    perf.rx_window = perf.rx_bytes;
+    perf.tx_window = perf.tx_bytes;
+
+#if EDM_ENABLE
+    edm_perf_t edm;
+
+    edm_get_perf(&edm);
+    perf.poll_hz = (uint32_t)((uint64_t)(edm.polls - perf.polls_window) * 1000 / dt_ms);
+    perf.polls_window = edm.polls;
+    if(!perf.poll_hz_valid || perf.poll_hz < perf.poll_hz_min)
+        perf.poll_hz_min = perf.poll_hz;
+    perf.poll_hz_valid = true;
+#endif
+}
+
+static void perf_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    uint32_t now = DWT->CYCCNT, cyc = now - perf.pass_cyc;
+
+    perf.pass_cyc = now;
+    perf.passes++;
+    perf.window_cyc += cyc;
+    if(cyc < perf.pass_min)
+        perf.pass_min = cyc;
+
+    uint8_t blocks = plan_get_block_buffer_count();
+    if(blocks > perf.planner_max)
+        perf.planner_max = blocks;
+
+    if(hal.stream.get_rx_buffer_free) {
+        uint16_t rx_free = hal.stream.get_rx_buffer_free();
+        if(rx_free < perf.rx_free_min)
+            perf.rx_free_min = rx_free;
+    }
+
+    uint32_t now_ms = hal.get_elapsed_ticks();
+    if(now_ms - perf.window_ms >= PERF_DASH_WINDOW_MS)
+        perf_window(now_ms);
+}
+
+#if EDM_ENABLE
+
+// Upper bound in us of the bin holding the given fraction (per mille) of the samples.
+static uint32_t lat_percentile (const uint32_t *hist, uint32_t n, uint32_t per_mille)
+{
+    uint32_t bin, sum = 0, target = (uint32_t)(((uint64_t)n * per_mille + 999) / 1000);
+
+    for(bin = 0; bin < EDM_PERF_LAT_BINS - 1; bin++) {
+        if((sum += hist[bin]) >= target)
+            break;
+    }
+
+    return (1UL << bin) - 1;
+}
+
+static void edm_line (char *buf, size_t size)
+{
+    edm_perf_t edm;
+    uint32_t bin, n = 0, max = 0, hist[EDM_PERF_LAT_BINS];
+
+    edm_get_perf(&edm);
+
+    for(bin = 0; bin < EDM_PERF_LAT_BINS; bin++) {
+        if((hist[bin] = edm.lat_hist[bin] - perf.edm_base.lat_hist[bin])) {
+            n += hist[bin];
+            max = (1UL << bin) - 1;
+        }
+    }
+
+    snprintf(buf, size, "[PERF|EDM,poll_hz=%lu,target_hz=%lu,min_hz=%lu,skips=%lu,errs=%lu,i2c_p50_us=%lu,i2c_p99_us=%lu,i2c_max_us=%lu,"
+                         "rlat_us=%lu,rlat_max_us=%lu,rlat_n=%lu]" ASCII_EOL,
+              perf.poll_hz, edm.poll_hz, perf.poll_hz_valid ? perf.poll_hz_min : 0,
+               edm.poll_skips - perf.edm_base.poll_skips, edm.poll_errs - perf.edm_base.poll_errs,
+                n ? lat_percentile(hist, n, 500) : 0, n ? lat_percentile(hist, n, 990) : 0, max,
+                 edm.rlat_last_us, edm.rlat_max_us, edm.rlat_count - perf.edm_base.rlat_count);
+}
+
+#endif // EDM_ENABLE
+
+static status_code_t perf_command (sys_state_t state, char *args)
+{
+    char buf[220];
+
+    if(args) {
+        if(!(args[0] == 'R' && args[1] == '\0'))
+            return Status_InvalidStatement;
+        perf_reset();
+    }
+
+#if CPU_LOAD_ENABLE
+    cpu_load_t load;
+
+    cpu_load_get(&load);
+    perf.idle_pct = load.idle / 10;
+#endif
+
+    snprintf(buf, sizeof(buf), "[PERF|LOOP,hz=%lu,idle=%lu,pass_min_cyc=%lu]" ASCII_EOL,
+              perf.loop_hz, perf.idle_pct, perf.pass_min == UINT32_MAX ? 0 : perf.pass_min);
+    hal.stream.write(buf);
+
+#if EDM_ENABLE
+    edm_line(buf, sizeof(buf));
+    hal.stream.write(buf);
+#endif
+
+#if ISR_PROFILE_ENABLE
+    uint32_t isr_max = isr_profile[IsrProfile_Stepper].max;
+    snprintf(buf, sizeof(buf), "[PERF|STEP,isr_max_cyc=%lu,isr_max_us=%lu,lat_max_ticks=%lu]" ASCII_EOL,
+              isr_max, isr_max / hal.f_mcu, isr_latency_stepper.max);
+    hal.stream.write(buf);
+#endif
+
+    snprintf(buf, sizeof(buf), "[PERF|STREAM,rx_bps=%lu,tx_bps=%lu,rx_free_min=%u,planner_max=%u]" ASCII_EOL,
+              perf.rx_bps, perf.tx_bps, perf.rx_free_min == UINT16_MAX ? 0 : perf.rx_free_min, perf.planner_max);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void perf_dash_init (void)
+{
+    static const sys_command_t perf_command_list[] = {
+        {"PERF", perf_command, {}, { .str = "performance report, $PERF=R resets it" } }
+    };
+
+    static sys_commands_t perf_commands = {
+        .n_commands = sizeof(perf_command_list) / sizeof(sys_command_t),
+        .commands = perf_command_list
+    };
+
+    perf.pass_cyc = DWT->CYCCNT;
+    perf.window_ms = hal.get_elapsed_ticks();
+    perf_reset();
+
+    on_stream_changed = grbl.on_stream_changed;
+    grbl.on_stream_changed = perf_stream_changed;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = perf_execute_realtime;
+
+    system_register_commands(&perf_commands);
+
+    perf_hook(hal.stream.type);
+}
+
+#endif // PERF_DASH_ENABLE
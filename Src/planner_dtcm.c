@@ -0,0 +1,160 @@
+/*
+  planner_dtcm.c - planner block buffer allocated in DTCM
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The core allocates the planner block buffer ($398 blocks) with malloc() from plan_reset(), so it
+  ends up in the heap in RAM_D1 behind the AXI bus and the L1 cache. The segment buffer and stepper
+  state are already placed in DTCM by the linker scripts.
+
+  The link wraps plan_reset(), malloc(), realloc() and free() (flags below). While the core is
+  inside plan_reset() allocations are served from an arena in DTCM, everywhere else the wrappers
+  pass straight through. All four must be wrapped: an arena block handed to the C library's
+  realloc() would corrupt the heap. A request that does not fit the arena goes to the heap and is counted as
+  fallback in $MEMMAP, the planner then runs from RAM_D1 as before.
+
+  The arena is the DTCM left after the linker placed sections (_edtcm_bss up to the end of DTCM),
+  optionally capped by PLANNER_DTCM_SIZE. It shares the 128K with the EDM log (EDM_LOG_SIZE * 9
+  bytes) and the stepper buffers, a larger log leaves fewer planner blocks in DTCM.
+
+  Build flags: -Wl,--wrap=plan_reset -Wl,--wrap=malloc -Wl,--wrap=realloc -Wl,--wrap=free
+
+  With a deeper planner ($398) the segment buffer can be made deeper as well with
+  SEGMENT_BUFFER_SIZE, it is a core compile time option.
+*/
+
+#include "driver.h"
+
+#if PLANNER_DTCM_ENABLE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "planner_dtcm.h"
+
+extern bool __real_plan_reset (void);
+extern void *__real_malloc (size_t size);
+extern void *__real_realloc (void *ptr, size_t size);
+extern void __real_free (void *ptr);
+
+extern uint8_t _edtcm_bss, _memmap_dtcm_start, _memmap_dtcm_size; // from the linker script
+
+static uint8_t *arena = NULL;
+static uint32_t arena_size = 0, arena_used = 0, fallback = 0;
+static volatile bool in_plan_reset = false;
+
+// Free DTCM after the placed sections, 8 byte aligned.
+static void arena_init (void)
+{
+    uintptr_t start = ((uintptr_t)&_edtcm_bss + 7) & ~(uintptr_t)7,
+              end = (uintptr_t)&_memmap_dtcm_start + (uintptr_t)&_memmap_dtcm_size;
+
+    arena = (uint8_t *)start;
+    arena_size = end > start ? end - start : 0;
+#ifdef PLANNER_DTCM_SIZE
+    if(arena_size > PLANNER_DTCM_SIZE)
+        arena_size = PLANNER_DTCM_SIZE;
+#endif
+}
+
+bool __wrap_plan_reset (void)
+{
+    bool ok;
+
+    if(arena == NULL)
+        arena_init();
+
+    in_plan_reset = true;
+    ok = __real_plan_reset();
+    in_plan_reset = false;
+
+    return ok;
+}
+
+void *__wrap_malloc (size_t size)
+{
+    if(in_plan_reset) {
+        size = (size + 7) & ~7;
+        if(size <= arena_size - arena_used) {
+            void *ptr = &arena[arena_used];
+            arena_used += size;
+            return ptr;
+        }
+        fallback++;
+    }
+
+    return __real_malloc(size);
+}
+
+static inline bool in_arena (void *ptr)
+{
+    return arena && (uint8_t *)ptr >= arena && (uint8_t *)ptr < arena + arena_size;
+}
+
+// The planner buffer is only freed to be reallocated, the arena is reused from the start then.
+void __wrap_free (void *ptr)
+{
+    if(in_arena(ptr)) {
+        if(ptr == arena)
+            arena_used = 0;
+    } else
+        __real_free(ptr);
+}
+
+// The arena holds the planner buffer only, at its start. It is resized in place inside
+// plan_reset() if it fits, otherwise moved to the heap.
+void *__wrap_realloc (void *ptr, size_t size)
+{
+    if(ptr == NULL)
+        return __wrap_malloc(size);
+
+    if(!in_arena(ptr))
+        return __real_realloc(ptr, size);
+
+    uint32_t old_size = arena_used - ((uint8_t *)ptr - arena);
+
+    if(in_plan_reset && ptr == arena) {
+        size_t new_size = (size + 7) & ~7;
+        if(new_size <= arena_size) {
+            arena_used = new_size;
+            return ptr;
+        }
+        fallback++;
+    }
+
+    void *new_ptr = __real_malloc(size);
+
+    if(new_ptr) {
+        memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+        __wrap_free(ptr);
+    }
+
+    return new_ptr;
+}
+
+void planner_dtcm_get_stats (uint32_t *used, uint32_t *size, uint32_t *fb)
+{
+    if(arena == NULL)
+        arena_init();
+
+    *used = arena_used;
+    *size = arena_size;
+    *fb = fallback;
+}
+
+#endif // PLANNER_DTCM_ENABLE
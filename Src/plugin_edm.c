@@ -4,28 +4,275 @@
  *
  * ## Supported M-codes
  *
- * M503 P[pulse_time_us] Q[pulse_current_a] R[max_duty]
+ * M503 P[pulse_time_us] Q[pulse_current_a] R[max_duty] L[queued]
  * Energize, tool negative voltage
  *
- * M504 P[pulse_time_us] Q[pulse_current_a] R[max_duty]
+ * M504 P[pulse_time_us] Q[pulse_current_a] R[max_duty] L[queued]
  * Energize, tool positive voltage
  *
- * M505
+ * M505 L[queued]
  * De-energize
  *
+ * By default M503~M505 wait for motion to finish (buffer sync).
+ * With L1, the change is queued instead and applied when the next motion
+ * block starts executing, so the motion stream keeps going. If the queue is
+ * full, falls back to buffer sync.
+ *
  * M550 S[output_log<optional>]]
  * Print EDM plugin status.
- * If S is omitted, prints general status.abort
- * If S is specified, print log.
+ * If S is omitted (or 0), prints general status.
+ * S1: also print log as [EDML|...] text lines (ratios quantized to 0~9).
+ * S2: also dump log in binary form; see print_log_binary() for format.
+ * S3 (DSP_ENABLE): also print statistics and spectrum peaks of the latest
+ * log entries; see print_log_spectrum() for format.
+ * With several PULSER units (EDM_PULSER_COUNT), each also gets an
+ * [EDMU|...] line.
+ * Does not touch the bus: the temperature is sampled in the background and
+ * reported with its age, e.g. "temp=41(230ms)".
  * For log printing to work, log must be disabled state (default or M551 S0).
+ * Always followed by job statistics ([EDMT|...] and [EDMH|...] lines),
+ * accumulated since boot or the last M551 S1/S2.
+ * Log dumps, captures and [EDMT|...] carry rtc=<wall time>,rtc_us=<t_us>
+ * when the RTC is set: an entry t_us is at wall time rtc + (t_us - rtc_us).
  *
  * M551 S[log_enable<required>]
  * Control log status.
- * - log_enable: required. Must be 0 or 1.
- * Whenever M551 S1 is called, all previous log entries are cleared.
+ * - log_enable: required. Must be 0, 1 or 2.
+ * Whenever M551 S1 or S2 is called, all previous log entries are cleared.
+ * The number of entries kept is setting $450 (EDM_SETTING_LOG_DEPTH),
+ * 1000~EDM_LOG_SIZE (default), applied by the next M551 S1 or S2.
+ * S2 additionally streams entries live as [EDMS|...] lines while logging,
+ * drained from the realtime loop; see edm_stream_drain() for format.
+ * M551 S1/S2 P1 (EDM_LOG_PERSIST) also appends the entries to EDM_LOG_FILE
+ * in full pages written from the realtime loop; see edm_persist_drain() for
+ * format. M551 S0 writes the last (partial) page and closes the file.
+ *
+ * M552 S[servo_enable] P[kp] Q[ki] R[target_pct]
+ * Configure gap servo. All words are optional; omitted ones are unchanged.
+ * - servo_enable: 0 or 1.
+ * - kp: proportional gain (feed factor per unit gap error), 0~20.
+ * - ki: integral gain (feed factor per unit gap error per second), 0~1000.
+ * - target_pct: target (open - short) ratio in %, -100~100.
+ *
+ * M553 P[n_required] Q[window] R[threshold] S[burst_hz]
+ * Configure G38 contact filter. All words are optional; omitted ones are
+ * unchanged. Contact is reported when n_required of the last window samples
+ * have r_pulse + r_short >= threshold.
+ * - n_required: 1~window.
+ * - window: 1~32.
+ * - threshold: 1~510.
+ * - burst_hz: poll rate while probing, 0 (same as normal) or 1000~5000.
+ * The reported probe position is the machine position latched when the poll
+ * of the first contact sample started, not where the filter triggered.
+ *
+ * M554
+ * Reset persistent discharge / wear counters (e.g. after electrode change).
+ *
+ * M555 S[enable] P[area_mm2]
+ * Configure electrode wear compensation (EDM_WEAR_COMP_ENABLE). All words are
+ * optional; omitted ones are unchanged. Enabling starts from zero wear.
+ * - enable: 0 or 1.
+ * - area_mm2: electrode frontal area, wear volume / area = Z depth lost,
+ *   0.01~10000.
+ *
+ * M556 S[enable] P[interval_s] Q[short_pct] R[lift_mm]
+ * Configure flushing cycles (EDM_FLUSH_ENABLE). All words are optional;
+ * omitted ones are unchanged. While cutting, motion is held, Z lifted and
+ * returned to the same position, and the program resumed, when the mean
+ * short ratio over a window (EDM_FLUSH_WINDOW_MS) exceeds short_pct, or
+ * interval_s of cutting passed since the last lift.
+ * - enable: 0 or 1.
+ * - interval_s: periodic lift interval, 0 (off) or up to 3600.
+ * - short_pct: short ratio trigger in %, 1~100.
+ * - lift_mm: lift distance, 0.01~50.
+ *
+ * M558 S[enable] P[duty_min] Q[duty_max] R[short_pct]
+ * Configure adaptive pulse duty (EDM_ADAPT_ENABLE). All words are optional;
+ * omitted ones are unchanged. While cutting, the mean short and open ratios
+ * are evaluated every EDM_ADAPT_WINDOW_MS: the PULSER max duty is lowered (the
+ * off-time lengthened) while the short ratio exceeds short_pct, and raised
+ * again while it is below a quarter of it with the gap not mostly open. It
+ * starts from the duty of M503/M504 R and is written to PULSER at most every
+ * EDM_ADAPT_MIN_WRITE_MS, intermediate changes are coalesced.
+ * - enable: 0 or 1.
+ * - duty_min, duty_max: bounds in %, 1~100, duty_min <= duty_max.
+ * - short_pct: short ratio in % above which duty is lowered, 1~100.
+ *
+ * M559 S[enable] P[n_samples] Q[open_pct]
+ * Configure arc detection (EDM_ARC_ENABLE). All words are optional; omitted
+ * ones are unchanged. A sample is arcing when the gap discharged through most
+ * of it with at most open_pct open time (no ignition delay) and without a
+ * short; pulse capture and gap ADC, when running, must also show no ignition
+ * delay and a low gap voltage. n_samples in a row make an arc, answered by
+ * a longer off-time, then retract while it lasts, then a flushing cycle if
+ * arcs keep recurring; see arc_update().
+ * - enable: 0 or 1.
+ * - n_samples: 1~100.
+ * - open_pct: 0~100.
+ *
+ * M563 S[trigger_mask] P[n_post] R[action]
+ * Configure and read gap event captures (EDM_CAPTURE_ENABLE). All words are
+ * optional; omitted ones are unchanged. The last EDM_CAPTURE_PRE samples are
+ * kept at all times; a trigger freezes them with the n_post samples after it
+ * into one of EDM_CAPTURE_SLOTS slots, whether or not the log is active.
+ * - trigger_mask: 0~15, sum of 1 (short), 2 (arc), 4 (alarm), 8 (probe
+ *   contact).
+ * - n_post: 0~EDM_CAPTURE_POST.
+ * - action: 1 prints the captures as [EDMC|...] lines, see print_captures();
+ *   2 clears them.
+ *
+ * M564 S[enable] P[derate_c] Q[full_c] R[min_pct]
+ * Configure thermal derating (EDM_THERMAL_ENABLE). All words are optional;
+ * omitted ones are unchanged. Above derate_c (hottest PULSER unit) the pulse
+ * current is lowered gradually, linearly down to min_pct of the programmed
+ * one at full_c, and raised back as PULSER cools; see thermal_update().
+ * Enabled by default.
+ * - enable: 0 or 1.
+ * - derate_c, full_c: 0~150 (C); full_c is kept above derate_c.
+ * - min_pct: 10~100.
+ *
+ * M562 P[gap_um] Q[seed]
+ * Restart the PULSER simulator (EDM_PULSER_SIM): places the work surface
+ * gap_um (default EDM_SIM_GAP0_UM) from the electrode, clears removal and
+ * debris, and restarts the random sequence from seed (default EDM_SIM_SEED).
+ * - gap_um: 0~10000.
+ * - seed: 0~65535.
+ *
+ * M557 S[shape] P[radius_mm] Q[period_s]
+ * Configure orbit (EDM_ORBIT_ENABLE). All words are optional; omitted ones
+ * are unchanged. Waits for motion to finish, then the electrode orbits in XY
+ * around its position by injected steps while the program feeds Z, spiralling
+ * out to the radius over the first EDM_ORBIT_RAMP_REVS revolutions. X and Y
+ * are claimed while orbiting: program moves of X and Y are not output.
+ * S0 spirals back to the center and waits for it before releasing X and Y.
+ * - shape: 0 (off), 1 (circle) or 2 (square, radius is half the side).
+ * - radius_mm: 0.001~5.
+ * - period_s: time per revolution, 0.05~60. Lengthened if the step rate
+ *   would exceed one step per axis every other EDM_ORBIT_TICK_US.
+ *
+ * M565 L[step] S[polarity] P[pulse_time_us] Q[pulse_current_a] R[max_duty]
+ * Define a pulse recipe step (EDM_RECIPE_ENABLE), P, Q and R as M503/M504
+ * with the same defaults. Recipes are kept in the flash journal
+ * (FLASH_JOURNAL), saved while idle and de-energized.
+ * - step: 1~EDM_RECIPE_STEPS; steps must be defined in order.
+ * - polarity: 1 (tool negative, M503), 2 (tool positive, M504) or 0 to
+ *   delete the step and all after it.
+ *
+ * M566 L[step] P[end] Q[limit]
+ * Set when a recipe step ends and the next one is applied.
+ * - end: 0 (never), 1 (energized time, limit in s), 2 (depth, Z descent
+ *   since the step started, limit in mm) or 3 (pulses, limit in thousands).
+ *
+ * M567 S[run] Q[passes] L[queued]
+ * Run the recipe (S1) from step 1, or stop switching steps (S0, the
+ * parameters in use stay until M503~M505). After the last step the recipe
+ * starts over until passes runs are done, 0 for endless (e.g. alternating
+ * polarity); then the last step stays. S1 applies step 1 like M503/M504,
+ * with L1 queued. Without S, prints the steps as [EDMR|...] lines.
+ * Step changes are applied from the realtime loop through the same path as
+ * queued M503/M504, while energized only; M503~M505 stop the recipe.
+ * - passes: 0~255, default 1.
+ *
+ * M568 S[enable] P[retract_mm_min] Q[accel_mm_s2] R[start_mm_min]
+ * Configure the retract profile (EDM_RETRACT_PROFILE). All words are
+ * optional; omitted ones are unchanged. Disabled by default. After each
+ * reversal the step generator starts at start_mm_min and accelerates by
+ * accel_mm_s2: up to retract_mm_min while retracting, which may exceed the
+ * programmed feed, and up to the servo feed when advancing again. Rates are
+ * converted by the Z steps/mm in effect when M568 is given, and apply to the
+ * dominant axis of the segment.
+ * - enable: 0 or 1.
+ * - retract_mm_min: 1~6000.
+ * - accel_mm_s2: 1~10000.
+ * - start_mm_min: 1~6000, kept at or below retract_mm_min.
+ *
+ * M569 S[start] P[relay_pct] Q[cycles] L[step]
+ * Auto-tune the gap servo gains (EDM_AUTOTUNE_ENABLE). S1 arms a relay
+ * feedback run that starts with the next energized feed: instead of the PI
+ * output the feed steps relay_pct above and below the feed it had settled
+ * to, switching as the gap error crosses +-EDM_AUTOTUNE_HYST. After
+ * EDM_AUTOTUNE_SKIP cycles settling, period and error amplitude are averaged
+ * over cycles oscillations and M552 P and Q are set by Ziegler-Nichols PI
+ * rules; the result is printed as [EDMT|...]. S0 cancels. Without S, prints
+ * the last result. With EDM_RECIPE_ENABLE, L stores the gains with recipe
+ * step L (M565), applied whenever the recipe switches to it.
+ * - relay_pct: 2~45, default 20.
+ * - cycles: 2~20, default 4.
+ * - step: 0 (not stored, default) or 1~EDM_RECIPE_STEPS.
+ *
+ * M572 P[fast_mm_min] Q[slow_mm_min] R[backoff_mm] D[travel_mm] S[dir]
+ * Two-speed touch-off on Z by current sensing (EDM_TOUCHOFF_ENABLE), with
+ * the parameters of the last M503/M504. Probes at fast_mm_min for up to
+ * travel_mm, backs off backoff_mm de-energized, then probes again at
+ * slow_mm_min for up to twice backoff_mm through the M553 contact filter.
+ * Each probe de-energizes on completion as G38.2 does. Not finding contact
+ * raises the G38.2 alarm. Prints [EDMTO|...] with the fast and refined
+ * contact Z (machine, latched at first contact, see M553), where Z stopped,
+ * the overtravel and the filter latency; the refined contact is also the G38
+ * probe result (#5061~). All words are optional.
+ * - fast_mm_min: 1~1000, default EDM_TOUCHOFF_FAST.
+ * - slow_mm_min: 0.1~100, default EDM_TOUCHOFF_SLOW.
+ * - backoff_mm: 0.01~5, default EDM_TOUCHOFF_BACKOFF.
+ * - travel_mm: 0.1~100, default EDM_TOUCHOFF_TRAVEL.
+ * - dir: -1 (toward -Z, default) or 1.
+ *
+ * M573 S[mode] P[x_mm] Q[y_mm] R[spacing_mm] D[travel_mm]
+ * Surface map and Z height compensation (EDM_SURFACE_MAP_ENABLE).
+ * S1 probes a grid from the current XY over x_mm by y_mm, spacing_mm apart
+ * (at most EDM_SURFACE_MAP_N points per axis), with the M572 touch-off cycle
+ * at its default speeds, each point starting from the current Z and probing
+ * down at most travel_mm; moves between points are at that Z, de-energized.
+ * Returns to the start, then enables compensation. While enabled, the
+ * surface height at the current XY relative to the first point, bilinearly
+ * interpolated and held at the edges, is fed as Z steps by queued step
+ * injection on the shared Z axis; machine position is not updated. S0
+ * disables compensation and steps the offset back out, S2 enables it again
+ * with the map in RAM. Without S, prints the map as [EDMSM|...] lines.
+ * - x_mm, y_mm: 0~500, 0 for a single row or column.
+ * - spacing_mm: 0.5~100.
+ * - travel_mm: 0.1~100, default EDM_TOUCHOFF_TRAVEL.
+ *
+ * M574 S[enable] P[x] Q[y] R[z]
+ * Configure the retract vector (EDM_RETRACT_VECTOR). All words are optional;
+ * omitted ones are unchanged. Disabled by default, then retract reverses the
+ * active segment. When enabled, retract moves along the machine direction
+ * (x, y, z), e.g. the axis of a tilted electrode, at the step rate of the
+ * segment (or the M568 profile) on the dominant axis of the vector. Going
+ * forward again first returns to the path while the core retraces it, so
+ * the distance off the path never exceeds the retract distance. Components
+ * are scaled by the steps/mm in effect when M574 is given; other axes hold
+ * during retract. M550 reports the vector and the steps off the path.
+ * - enable: 0 or 1, a zero vector keeps it disabled.
+ * - x, y, z: -1~1, default 0, 0, 1 (straight up Z).
+ *
+ * M575 L[tool] P[area_mm2] Q[wear_factor] R[step] S[keep]
+ * Define an electrode of the library (EDM_ELECTRODE_ENABLE), kept in the
+ * flash journal and saved while idle and de-energized. Words other than L are
+ * optional; omitted ones are unchanged, or default for a new electrode. On M6
+ * the electrode of the new tool number is applied: P as the M555 area (wear
+ * compensation restarts from zero wear), Q scaling the wear per charge, R as
+ * the step M567 S1 starts from, and the touch-off offset. M572 with an
+ * electrode in use stores the contact Z with it; while both it and the
+ * reference electrode (tool EDM_ELECTRODE_REF) have one, the difference is
+ * applied as dynamic tool length offset (as G43.1 Z). S0 deletes the
+ * electrode. Without L, prints the library as [EDME|...] lines.
+ * - tool: 1~255.
+ * - area_mm2: 0.01~10000, default 1.
+ * - wear_factor: 0~100, default 1.
+ * - step: 0 (step 1, default) or 1~EDM_RECIPE_STEPS.
+ *
+ * M576 P[retract_mm] Q[approach_mm] S[enable]
+ * Configure the EDM feed hold (EDM_GAP_HOLD_ENABLE). All words are optional;
+ * omitted ones are unchanged. Enabled by default. A feed hold while cutting
+ * turns the gate off at once, backs Z off by retract_mm once stopped, and on
+ * resume re-energizes and returns Z, the last approach_mm slowly under the
+ * gap servo. M550 reports the holds and the longest hold to resume time.
+ * - retract_mm: 0~1, 0 holds without backing off.
+ * - approach_mm: 0~1.
  *
  * ## Supported G-codes
- * G1: Enabled feed rate control & retract.
+ * G1: Enabled feed rate control & retract. While energized, feed is scaled
+ * continuously by the gap servo; hard shorts still trigger retract.
  * G38.2, G38.3: Probe using current sensing. De-energize (same as M505) on
  * contact or not-found completion. Need M503 or M504 before G38 to activate
  * current for probing.
@@ -33,19 +280,74 @@
 #if EDM_ENABLE
 
 #include "driver.h"
+#include "boot_profile.h"
+#include "can_fd.h"
+#include "dsp.h"
+#include "edm_gap_adc.h"
+#include "edm_gate_pwm.h"
+#include "edm_pulse_capture.h"
+#include "edm_servo_ref.h"
+#include "flash.h"
 #include "grbl/core_handlers.h"
 #include "grbl/grbl.h"
+#if EDM_TOUCHOFF_ENABLE
+#include "grbl/motion_control.h"
+#endif
+#include "grbl/nvs_buffer.h"
+#include "grbl/planner.h"
+#include "grbl/protocol.h"
+#include "grbl/settings.h"
+#include "grbl/state_machine.h"
 #include "i2c.h"
 #include "platform.h"
+#include "plugin_edm.h"
+#include "tmc_uart.h"
+#include "trace.h"
+#include "watchdog.h"
+#if EDM_LOG_PERSIST
+#include "grbl/vfs.h"
+#endif
+#if EDM_ELECTRODE_ENABLE
+#include "crc32.h"
+#endif
 
+#include <inttypes.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <string.h>
 
 #define EDM_MCODE_START_TNEG 503
 #define EDM_MCODE_START_TPOS 504
 #define EDM_MCODE_STOP 505
 #define EDM_MCODE_READ 550
 #define EDM_MCODE_LOG 551
+#define EDM_MCODE_SERVO 552
+#define EDM_MCODE_PROBE_FILTER 553
+#define EDM_MCODE_WEAR_RESET 554
+#define EDM_MCODE_WEAR_COMP 555
+#define EDM_MCODE_FLUSH 556
+#define EDM_MCODE_ORBIT 557
+#define EDM_MCODE_ADAPT 558
+#define EDM_MCODE_ARC 559
+#define EDM_MCODE_CAPTURE 563
+#define EDM_MCODE_THERMAL 564
+#define EDM_MCODE_SIM 562
+#define EDM_MCODE_RECIPE_STEP 565
+#define EDM_MCODE_RECIPE_END 566
+#define EDM_MCODE_RECIPE_RUN 567
+#define EDM_MCODE_RETRACT 568
+#define EDM_MCODE_AUTOTUNE 569
+#define EDM_MCODE_TOUCHOFF 572
+#define EDM_MCODE_SURFACE_MAP 573
+#define EDM_MCODE_RETRACT_VECTOR 574
+#define EDM_MCODE_ELECTRODE 575
+#define EDM_MCODE_GAP_HOLD 576
+
+#define EDM_SETTING_LOG_DEPTH Setting_UserDefined_0
+
+#define EDM_STR_(x) #x
+#define EDM_STR(x) EDM_STR_(x)
 
 // You can change this if you somehow want to use Aux8 for different purposes.
 // If you change this, you also need to updard board configuration header.
@@ -55,6 +357,39 @@
 // register map
 #define PULSER_ADDR 0x3b
 
+// Number of PULSER units, each at its own I2C address (EDM_PULSER_ADDRS) and
+// with its own gate output (PULSER_GATE_PORT/PIN for the first,
+// EDM_PULSER<n>_GATE_PORT/PIN for the others). All units get the same pulse
+// settings and are energized together. Their telemetry is read back to back
+// and merged, since they share the feed axis: see process_units().
+#ifndef EDM_PULSER_COUNT
+#define EDM_PULSER_COUNT 1
+#endif
+#ifndef EDM_PULSER_ADDRS
+#define EDM_PULSER_ADDRS \
+  {PULSER_ADDR, PULSER_ADDR + 1, PULSER_ADDR + 2, PULSER_ADDR + 3}
+#endif
+
+#if EDM_PULSER_COUNT < 1 || EDM_PULSER_COUNT > 4
+#error "EDM_PULSER_COUNT must be within 1..4."
+#endif
+#if EDM_PULSER_COUNT > 1 && EDM_PULSER_CAN
+#error "EDM_PULSER_CAN supports a single PULSER only."
+#endif
+#if EDM_PULSER_COUNT > 1 && EDM_PULSER_SIM
+#error "EDM_PULSER_SIM simulates a single PULSER only."
+#endif
+#if (EDM_PULSER_COUNT > 1 && !defined(EDM_PULSER1_GATE_PORT)) || \
+    (EDM_PULSER_COUNT > 2 && !defined(EDM_PULSER2_GATE_PORT)) || \
+    (EDM_PULSER_COUNT > 3 && !defined(EDM_PULSER3_GATE_PORT))
+#error "Each additional PULSER needs EDM_PULSER<n>_GATE_PORT/PIN."
+#endif
+
+static const uint8_t pulser_addr[] = EDM_PULSER_ADDRS;
+
+_Static_assert(sizeof(pulser_addr) >= EDM_PULSER_COUNT,
+               "EDM_PULSER_ADDRS needs an address per PULSER");
+
 static const uint8_t REG_POLARITY = 0x01;
 static const uint8_t REG_PULSE_CURRENT = 0x02;
 static const uint8_t REG_TEMPERATURE = 0x03;
@@ -70,16 +405,473 @@ static const uint8_t REG_CKP_N_PULSE = 0x10;
 static volatile uint8_t edm_init_status = 255;
 
 static volatile uint32_t edm_poll_cnt = 0;
+static volatile uint32_t edm_poll_err_cnt = 0;
+static volatile uint32_t edm_poll_skip_cnt = 0;
 static volatile bool edm_has_current = false;
 static volatile uint64_t last_poll_tick_us;  // hal.get_micros() time
 
 static volatile bool edm_removal_active = false;
 
-#define EDM_LOG_SIZE 10000  // 10 sec
+// PULSER telemetry sampling rate.
+// Sampling is paced by a claimed hal.timer, or by the realtime loop if no
+// timer is available.
+// NOTE: 6-byte read takes ~250us at 400kHz; set I2C_KHZ=1000 above ~3kHz.
+// The bus rate is negotiated down at init if PULSER does not respond.
+#ifndef EDM_POLL_RATE_HZ
+#define EDM_POLL_RATE_HZ 1000
+#endif
 
-const uint8_t ST_MOTION = 0x01;  // corresponds to execute_sys_motion
+#if EDM_POLL_RATE_HZ < 1000 || EDM_POLL_RATE_HZ > 10000
+#error "EDM_POLL_RATE_HZ must be within 1000..10000."
+#endif
+
+#define EDM_POLL_PERIOD_US (1000000 / EDM_POLL_RATE_HZ)
+
+#if WATCHDOG_ENABLE
+// While energized PULSER samples must keep arriving, a hung bus or poll timer
+// stops the watchdog reloads.
+#ifndef EDM_WATCHDOG_DEADLINE_MS
+#define EDM_WATCHDOG_DEADLINE_MS 100
+#endif
+static watchdog_id_t wdt_edm = WATCHDOG_CLIENTS;  // sink until registered
+#endif
+
+#if EDM_PULSER_CAN
+// PULSER telemetry over CAN-FD, PULSER sends on the ID, commands go to ID + 1.
+#ifndef EDM_PULSER_CAN_ID
+#define EDM_PULSER_CAN_ID 0x100
+#endif
+#ifndef EDM_PULSER_CAN_BAUD
+#define EDM_PULSER_CAN_BAUD 1000000  // nominal (arbitration) rate
+#endif
+#ifndef EDM_PULSER_CAN_RATE_HZ
+#define EDM_PULSER_CAN_RATE_HZ 10000
+#endif
+// I2C polling resumes when no frame has arrived for this long.
+#ifndef EDM_PULSER_CAN_TIMEOUT_US
+#define EDM_PULSER_CAN_TIMEOUT_US 10000
+#endif
+#endif
+
+static hal_timer_t poll_timer = NULL;
+
+static bool gap_adc_ok = false;
+
+// Optional: aux input wired to PULSER short-detect output.
+// When defined, shorts are signalled from the pin interrupt instead of
+// waiting for the next telemetry poll.
+// #define EDM_SHORT_AUX_INPUT 3
+
+// Detect-to-retract latency, measured from short detection (poll completion,
+// pin or gap ADC interrupt) to the first step pulse emitted in retract direction.
+typedef struct {
+  uint32_t count;
+  uint32_t last_us;
+  uint32_t max_us;
+} retract_latency_t;
+
+static volatile bool short_pending = false;
+static volatile uint32_t short_detect_cycles;  // DWT->CYCCNT at detection
+static volatile retract_latency_t retract_latency = {0};
+
+// Running statistics, updated per sample in O(1) regardless of logging.
+// Written from I2C & stepper interrupts. Readers may see torn 64-bit values
+// while running; that's acceptable for reporting.
+#define EDM_HIST_BINS 16  // 8-bit ratio >> 4
+
+typedef struct {
+  uint32_t n_samples;
+  uint32_t hist_pulse[EDM_HIST_BINS];
+  uint32_t hist_short[EDM_HIST_BINS];
+  uint32_t hist_open[EDM_HIST_BINS];
+  uint64_t total_pulses;
+
+  // short events (r_short > 127 for consecutive samples)
+  bool in_short;
+  uint32_t short_start_us;
+  uint32_t short_cnt;
+  uint64_t short_total_us;
+  uint32_t short_max_us;
+
+  // retract motion (from step generator)
+  bool in_retract;
+  uint32_t retract_start_cycles;
+  uint32_t retract_cnt;
+  uint64_t retract_total_us;
+
+  // discharges timed by pulse capture
+  uint64_t cap_measured;
+  uint64_t cap_width_ns;
+  uint64_t cap_delay_ns;
+} edm_stats_t;
+
+static volatile edm_stats_t edm_stats;
+
+static void reset_stats() {
+  __disable_irq();
+  memset((void*)&edm_stats, 0, sizeof(edm_stats));
+  __enable_irq();
+}
+
+static void update_stats(uint32_t t_us,
+                         uint8_t r_pulse,
+                         uint8_t r_short,
+                         uint8_t r_open,
+                         uint32_t n_pulse) {
+  edm_stats.n_samples++;
+  edm_stats.hist_pulse[r_pulse >> 4]++;
+  edm_stats.hist_short[r_short >> 4]++;
+  edm_stats.hist_open[r_open >> 4]++;
+  edm_stats.total_pulses += n_pulse;
+
+  bool is_short = r_short > 127;
+  if (is_short && !edm_stats.in_short) {
+    edm_stats.short_start_us = t_us;
+    edm_stats.short_cnt++;
+  } else if (!is_short && edm_stats.in_short) {
+    uint32_t dur = t_us - edm_stats.short_start_us;
+    edm_stats.short_total_us += dur;
+    if (dur > edm_stats.short_max_us) {
+      edm_stats.short_max_us = dur;
+    }
+  }
+  edm_stats.in_short = is_short;
+}
+
+#if EDM_PULSE_CAPTURE_ENABLE
+static bool pulse_capture_ok = false;
+
+// Nominal on-time of current M503/M504. Discharges end with the on-time, so
+// the ignition delay is the on-time minus the captured discharge width.
+static uint32_t pulse_on_ns = 0;
+
+// Mean ignition delay of the discharges of the latest sample, UINT32_MAX if
+// none was measured.
+static uint32_t pulse_delay_ns = UINT32_MAX;
+
+// Called from edm_poll_complete(). Returns discharges since the last call.
+static uint32_t update_capture_stats() {
+  edm_pulse_capture_t cap;
+  edm_pulse_capture_read(&cap);
+
+  uint64_t on_ns = (uint64_t)cap.measured * pulse_on_ns;
+  uint64_t delay_ns = on_ns > cap.width_ns ? on_ns - cap.width_ns : 0;
+  edm_stats.cap_measured += cap.measured;
+  edm_stats.cap_width_ns += cap.width_ns;
+  edm_stats.cap_delay_ns += delay_ns;
+  pulse_delay_ns =
+      cap.measured ? (uint32_t)(delay_ns / cap.measured) : UINT32_MAX;
+  return cap.pulses;
+}
+#endif
+
+// Cumulative discharge charge per polarity, persisted in the flash EEPROM
+// emulation sector (unused by grblHAL settings as NVS is disabled).
+// Records are appended one flash word at a time; the sector is only erased
+// when full, and writes only happen while de-energized and idle.
+#ifndef EDM_GAP_VOLTAGE
+#define EDM_GAP_VOLTAGE 25.0f  // V, for charge -> energy
+#endif
+
+// Electrode wear per discharge charge (mm^3/C). Calibrate per
+// electrode/workpiece material pair; 0 disables wear estimate.
+#ifndef EDM_WEAR_TNEG_MM3_PER_C
+#define EDM_WEAR_TNEG_MM3_PER_C 0.0f
+#endif
+#ifndef EDM_WEAR_TPOS_MM3_PER_C
+#define EDM_WEAR_TPOS_MM3_PER_C 0.0f
+#endif
+
+// Wear factor of the electrode in use (M575 Q), 1 without one.
+static float wear_scale = 1.0f;
+
+// Minimum interval between counter saves.
+#ifndef EDM_PERSIST_INTERVAL_MS
+#define EDM_PERSIST_INTERVAL_MS 60000
+#endif
+
+#define WEAR_MAGIC 0x5745444d  // "MDEW"
+#define WEAR_SECTOR_SIZE (128 * 1024)
+#define WEAR_NUM_SLOTS (WEAR_SECTOR_SIZE / sizeof(wear_record_t))
+
+#define POL_TNEG 0
+#define POL_TPOS 1
 
 typedef struct {
+  uint32_t magic;
+  uint32_t checksum;
+  uint64_t charge_uc[2];  // [POL_*], 1uC = 100mA * 10us
+  uint32_t pulses[2];     // [POL_*], wraps around
+} wear_record_t;
+
+_Static_assert(sizeof(wear_record_t) == FLASH_WRITE_SIZE,
+               "wear_record_t must be one flash word");
+
+typedef struct {
+  uint64_t charge_uc[2];
+  uint32_t pulses[2];
+  uint8_t polarity;    // POL_* of current M503/M504
+  uint32_t pulse_uc;   // charge per pulse of current M503/M504
+} wear_t;
+
+static volatile wear_t wear;
+
+static bool wear_persist_ok = false;
+#if !FLASH_JOURNAL
+static uint32_t wear_slot = 0;  // next free record slot
+#endif
+static uint32_t wear_saves = 0;
+static uint32_t wear_last_save_ms = 0;
+static uint64_t wear_saved_total_uc = 0;
+
+static uint32_t wear_checksum(const wear_record_t* rec) {
+  const uint32_t* w = (const uint32_t*)rec;
+  uint32_t sum = 0x12345678;
+  for (size_t i = 2; i < sizeof(wear_record_t) / 4; i++) {
+    sum = (sum << 1 | sum >> 31) ^ w[i];
+  }
+  return sum;
+}
+
+// Called from edm_poll_complete().
+static void update_wear(uint32_t n_pulse) {
+  if (!edm_removal_active) {
+    return;
+  }
+  wear.charge_uc[wear.polarity] += (uint64_t)n_pulse * wear.pulse_uc;
+  wear.pulses[wear.polarity] += n_pulse;
+}
+
+static void load_wear() {
+#if FLASH_JOURNAL
+  // Settings share the sector, counters are a key of the journal.
+  wear_record_t rec;
+  if (flash_kv_read(FLASH_KV_EDM_WEAR, &rec, sizeof(rec)) &&
+      rec.magic == WEAR_MAGIC && rec.checksum == wear_checksum(&rec)) {
+    for (int i = 0; i < 2; i++) {
+      wear.charge_uc[i] = rec.charge_uc[i];
+      wear.pulses[i] = rec.pulses[i];
+    }
+  }
+  wear_saved_total_uc = wear.charge_uc[0] + wear.charge_uc[1];
+  wear_persist_ok = true;
+#else
+  // Flash write to the sector would clobber grblHAL settings.
+  if (hal.nvs.type == NVS_Flash) {
+    return;
+  }
+  const wear_record_t* recs = flash_emul_base();
+  uint32_t slot = 0;
+  for (; slot < WEAR_NUM_SLOTS; slot++) {
+    const wear_record_t* rec = &recs[slot];
+    if (rec->magic == 0xffffffff) {
+      break;  // erased
+    }
+    if (rec->magic == WEAR_MAGIC && rec->checksum == wear_checksum(rec)) {
+      for (int i = 0; i < 2; i++) {
+        wear.charge_uc[i] = rec->charge_uc[i];
+        wear.pulses[i] = rec->pulses[i];
+      }
+    }
+  }
+  wear_slot = slot;
+  wear_saved_total_uc = wear.charge_uc[0] + wear.charge_uc[1];
+  wear_persist_ok = true;
+#endif
+}
+
+static bool save_wear() {
+  wear_record_t rec = {.magic = WEAR_MAGIC};
+  for (int i = 0; i < 2; i++) {
+    rec.charge_uc[i] = wear.charge_uc[i];
+    rec.pulses[i] = wear.pulses[i];
+  }
+  rec.checksum = wear_checksum(&rec);
+
+#if FLASH_JOURNAL
+  if (!flash_kv_write(FLASH_KV_EDM_WEAR, &rec, sizeof(rec))) {
+    return false;
+  }
+#else
+  if (wear_slot >= WEAR_NUM_SLOTS) {
+    if (!flash_emul_erase()) {
+      return false;
+    }
+    wear_slot = 0;
+  }
+  if (!flash_emul_program(wear_slot * sizeof(wear_record_t), &rec,
+                          sizeof(rec))) {
+    return false;
+  }
+  wear_slot++;
+#endif
+  wear_saves++;
+  wear_last_save_ms = hal.get_elapsed_ticks();
+  wear_saved_total_uc = rec.charge_uc[0] + rec.charge_uc[1];
+  return true;
+}
+
+// Called from realtime loop. Flash programming stalls code fetch, so only
+// save while de-energized and idle.
+static void persist_wear() {
+  if (!wear_persist_ok || edm_removal_active || state_get() != STATE_IDLE) {
+    return;
+  }
+  if (wear.charge_uc[0] + wear.charge_uc[1] == wear_saved_total_uc) {
+    return;
+  }
+  if (wear_saves > 0 &&
+      hal.get_elapsed_ticks() - wear_last_save_ms < EDM_PERSIST_INTERVAL_MS) {
+    return;
+  }
+  if (!save_wear()) {
+    wear_persist_ok = false;  // don't retry blocking writes every loop
+  }
+}
+
+static void exec_mcode_wear_reset() {
+  for (int i = 0; i < 2; i++) {
+    wear.charge_uc[i] = 0;
+    wear.pulses[i] = 0;
+  }
+#if FLASH_JOURNAL
+  wear_persist_ok = save_wear();
+#else
+  if (hal.nvs.type == NVS_Flash) {
+    return;
+  }
+  wear_persist_ok = flash_emul_erase();
+  wear_slot = 0;
+  wear_saved_total_uc = 0;
+#endif
+}
+
+#if EDM_FLUSH_ENABLE
+// Flushing cycle scheduler, see flush_update().
+static bool flush_busy();
+static int flush_report(char* buf, size_t len);
+#endif
+#if EDM_GAP_HOLD_ENABLE
+static int gap_hold_report(char* buf, size_t len);
+#endif
+
+#if EDM_WEAR_COMP_ENABLE
+// Electrode wear compensation. The Z depth lost to wear, estimated from the
+// wear charge counters, is fed as extra Z steps by queued step injection on
+// the shared Z axis while Z feeds toward the work. Machine position is not
+// updated, so the program keeps its coordinates.
+#ifndef EDM_WEAR_COMP_AREA_MM2
+#define EDM_WEAR_COMP_AREA_MM2 1.0f  // electrode frontal area
+#endif
+#ifndef EDM_WEAR_COMP_RATE
+#define EDM_WEAR_COMP_RATE 200.0f  // steps/s
+#endif
+#ifndef EDM_WEAR_COMP_MAX_STEPS
+#define EDM_WEAR_COMP_MAX_STEPS 32  // per burst
+#endif
+#ifndef EDM_WEAR_COMP_DIR_NEG
+#define EDM_WEAR_COMP_DIR_NEG 1  // 1: work is toward Z-
+#endif
+
+typedef struct {
+  bool enabled;
+  float area_mm2;
+  uint64_t base_uc[2];  // wear.charge_uc when enabled
+  uint32_t steps;       // queued since enabled
+} wear_comp_t;
+
+static wear_comp_t wear_comp = {.area_mm2 = EDM_WEAR_COMP_AREA_MM2};
+
+static void wear_comp_charge(uint64_t charge_uc[2]) {
+  __disable_irq();
+  charge_uc[POL_TNEG] = wear.charge_uc[POL_TNEG];
+  charge_uc[POL_TPOS] = wear.charge_uc[POL_TPOS];
+  __enable_irq();
+}
+
+static void wear_comp_reset() {
+  stepperInjectAbort();
+  wear_comp_charge(wear_comp.base_uc);
+  wear_comp.steps = 0;
+}
+
+// Compensated Z depth since enabled.
+static float wear_comp_mm() {
+  uint64_t q[2];
+  wear_comp_charge(q);
+  float q_tneg = (q[POL_TNEG] - wear_comp.base_uc[POL_TNEG]) * 1e-6f;
+  float q_tpos = (q[POL_TPOS] - wear_comp.base_uc[POL_TPOS]) * 1e-6f;
+  return (q_tneg * EDM_WEAR_TNEG_MM3_PER_C +
+          q_tpos * EDM_WEAR_TPOS_MM3_PER_C) *
+         wear_scale / wear_comp.area_mm2;
+}
+
+// Called from realtime loop. Queues the steps the wear estimate is ahead of
+// as one burst at a time.
+static void wear_comp_update() {
+  if (!wear_comp.enabled || stepperInjectBusy()) {
+    return;
+  }
+#if EDM_FLUSH_ENABLE
+  if (flush_busy()) {
+    return;  // Z is claimed by the lift
+  }
+#endif
+  uint64_t q[2];
+  wear_comp_charge(q);
+  if (q[POL_TNEG] < wear_comp.base_uc[POL_TNEG] ||
+      q[POL_TPOS] < wear_comp.base_uc[POL_TPOS]) {
+    wear_comp_reset();  // counters cleared by M554
+    return;
+  }
+  int32_t n = (int32_t)(wear_comp_mm() * settings.axis[Z_AXIS].steps_per_mm) -
+              (int32_t)wear_comp.steps;
+  if (n <= 0) {
+    return;
+  }
+  if (n > EDM_WEAR_COMP_MAX_STEPS) {
+    n = EDM_WEAR_COMP_MAX_STEPS;
+  }
+  axes_signals_t step = {.z = On};
+  axes_signals_t dir = {.z = EDM_WEAR_COMP_DIR_NEG};
+  if (stepperInjectBurst(step, dir, n, EDM_WEAR_COMP_RATE)) {
+    wear_comp.steps += n;
+  }
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_wear_comp(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    wear_comp.area_mm2 = block->values.p;
+  }
+  if (!isnan(block->values.s)) {
+    bool enable = block->values.s > 0;
+    if (enable != wear_comp.enabled) {
+      wear_comp_reset();
+    }
+    wear_comp.enabled = enable;
+  }
+}
+
+#endif
+
+// Log capacity in entries. Default is 10 sec at 1kHz.
+// Entries have their own output section in DTCM (.edm_log, placed after the
+// boot flag) to keep them out of main RAM_D1, which allows up to ~14000
+// entries; what is left of DTCM goes to the planner with PLANNER_DTCM_ENABLE.
+// Setting $450 sets the depth in use up to this. Use M551 S2 streaming for
+// longer history.
+#ifndef EDM_LOG_SIZE
+#define EDM_LOG_SIZE 10000
+#endif
+
+const uint8_t ST_MOTION = 0x01;  // corresponds to execute_sys_motion
+// Bits 1~4: PULSER unit 0~3 shorted (EDM_PULSER_COUNT > 1), the entry itself
+// holds the merged telemetry of all units.
+#define ST_UNIT_SHORT_SHIFT 1
+
+typedef struct __attribute__((packed)) {
+  uint32_t t_us;  // sample time, lower 32 bits of hal.get_micros()
   uint8_t status_flags;
   uint8_t r_open;
   uint8_t r_short;
@@ -87,11 +879,85 @@ typedef struct {
   uint8_t n_pulse;
 } log_entry_t;
 
+_Static_assert(sizeof(log_entry_t) == EDM_LOG_ENTRY_SIZE,
+               "log_entry_t size mismatch");
+_Static_assert(EDM_LOG_SIZE * sizeof(log_entry_t) <= 120 * 1024,
+               "EDM_LOG_SIZE too large for DTCM");
+#if PLANNER_DTCM_ENABLE
+_Static_assert(EDM_LOG_SIZE * sizeof(log_entry_t) +
+                       PLANNER_DTCM_MIN_BLOCKS * sizeof(plan_block_t) <=
+                   120 * 1024,
+               "EDM_LOG_SIZE leaves DTCM for < PLANNER_DTCM_MIN_BLOCKS");
+#endif
+
+// Not zero-initialized (NOLOAD); only entries below num_valid are read.
+static volatile log_entry_t log_entries[EDM_LOG_SIZE]
+    __attribute__((section(".edm_log")));
+
+// Depth in use, set from edm_settings.log_depth together with init_log()
+// only.
+static uint32_t log_depth = EDM_LOG_SIZE;
+
+typedef struct {
+  uint32_t log_depth;
+} edm_settings_t;
+
+static nvs_address_t edm_nvs_address;
+static edm_settings_t edm_settings = {.log_depth = EDM_LOG_SIZE};
+
+static const setting_detail_t edm_setting_detail[] = {
+    {EDM_SETTING_LOG_DEPTH, Group_UserSettings, "EDM log depth", "entries",
+     Format_Integer, "#####0", "1000", EDM_STR(EDM_LOG_SIZE), Setting_NonCore,
+     &edm_settings.log_depth, NULL, NULL},
+};
+
+static void edm_settings_save() {
+  hal.nvs.memcpy_to_nvs(edm_nvs_address, (uint8_t*)&edm_settings,
+                        sizeof(edm_settings_t), true);
+}
+
+static void edm_settings_restore() {
+  edm_settings.log_depth = EDM_LOG_SIZE;
+  edm_settings_save();
+}
+
+// An EDM_LOG_SIZE lowered since the setting was saved restores the default.
+static void edm_settings_load() {
+  if (hal.nvs.memcpy_from_nvs((uint8_t*)&edm_settings, edm_nvs_address,
+                              sizeof(edm_settings_t),
+                              true) != NVS_TransferResult_OK ||
+      edm_settings.log_depth < 1000 || edm_settings.log_depth > EDM_LOG_SIZE) {
+    edm_settings_restore();
+  }
+}
+
+static setting_details_t edm_setting_details = {
+    .settings = edm_setting_detail,
+    .n_settings = sizeof(edm_setting_detail) / sizeof(setting_detail_t),
+    .save = edm_settings_save,
+    .load = edm_settings_load,
+    .restore = edm_settings_restore,
+};
+
 typedef struct {
-  log_entry_t entries[EDM_LOG_SIZE];
   int ix_write;
   int num_valid;
   bool active;
+  // Live streaming state. num_written is only written by the producer
+  // (I2C interrupt) and num_streamed only by the consumer (realtime loop),
+  // so no locking is needed.
+  bool streaming;
+  uint32_t num_written;   // total entries added since init_log()
+  uint32_t num_streamed;  // total entries consumed (sent or dropped)
+  uint32_t stream_drop_cnt;
+  uint32_t last_flush_ms;
+#if EDM_LOG_PERSIST
+  // Persisting state, consumer is the realtime loop like streaming.
+  bool persisting;
+  uint32_t num_persisted;  // total entries consumed (written or dropped)
+  uint32_t persist_drop_cnt;
+  uint32_t persist_pages;
+#endif
 } edm_log_t;
 
 static volatile edm_log_t edm_log;
@@ -100,211 +966,5336 @@ static void init_log() {
   edm_log.ix_write = 0;
   edm_log.num_valid = 0;
   edm_log.active = false;
+  edm_log.streaming = false;
+  edm_log.num_written = 0;
+  edm_log.num_streamed = 0;
+  edm_log.stream_drop_cnt = 0;
+#if EDM_LOG_PERSIST
+  edm_log.persisting = false;
+  edm_log.num_persisted = 0;
+  edm_log.persist_drop_cnt = 0;
+  edm_log.persist_pages = 0;
+#endif
+}
+
+uint32_t edm_log_tail(uint8_t* buf, uint32_t n) {
+  uint32_t num_valid = edm_log.num_valid;
+  if (num_valid > log_depth) {  // not initialized yet
+    return 0;
+  }
+  if (n > num_valid) {
+    n = num_valid;
+  }
+  int ix_read = (edm_log.ix_write + log_depth - n) % log_depth;
+  for (uint32_t i = 0; i < n; i++) {
+    memcpy(buf, (const void*)&log_entries[ix_read], EDM_LOG_ENTRY_SIZE);
+    buf += EDM_LOG_ENTRY_SIZE;
+    ix_read = (ix_read + 1) % log_depth;
+  }
+  return n;
+}
+
+// num_written and ix_write of the same entry, for the ring index of an entry
+// counted back from num_written. The producer runs in the I2C interrupt.
+static uint32_t log_snapshot(int* ix_write) {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  uint32_t n_written = edm_log.num_written;
+  *ix_write = edm_log.ix_write;
+  __set_PRIMASK(primask);
+  return n_written;
+}
+
+uint32_t edm_log_since(uint32_t* seq, uint8_t* buf, uint32_t n) {
+  int ix_write;
+  uint32_t n_written = log_snapshot(&ix_write);
+  uint32_t n_pending = n_written - *seq;
+  // seq ahead of num_written: the log restarted. Compared as signed so that
+  // num_written wrapping around is not taken for a restart.
+  if (edm_log.num_valid > log_depth || (int32_t)n_pending < 0) {
+    *seq = n_written;  // not initialized yet, or log restarted
+    return 0;
+  }
+  // Lapped by producer; skip forward, with margin as in edm_stream_drain().
+  if (n_pending > log_depth - n) {
+    *seq = n_written - (log_depth - n);
+    n_pending = log_depth - n;
+  }
+  int ix_read = (ix_write + log_depth - n_pending) % log_depth;
+  if (n > n_pending) {
+    n = n_pending;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    memcpy(buf, (const void*)&log_entries[ix_read], EDM_LOG_ENTRY_SIZE);
+    buf += EDM_LOG_ENTRY_SIZE;
+    ix_read = (ix_read + 1) % log_depth;
+  }
+  *seq += n;
+  return n;
 }
 
 static void add_log(log_entry_t entry) {
-  edm_log.entries[edm_log.ix_write] = entry;
-  edm_log.ix_write = (edm_log.ix_write + 1) % EDM_LOG_SIZE;
-  if (edm_log.num_valid < EDM_LOG_SIZE) {
+  log_entries[edm_log.ix_write] = entry;
+  edm_log.ix_write = (edm_log.ix_write + 1) % log_depth;
+  if (edm_log.num_valid < log_depth) {
     edm_log.num_valid++;
   }
+  edm_log.num_written++;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// M-code handlers
+#if EDM_CAPTURE_ENABLE
+// Oscilloscope-style capture of gap events, independent of the log. The last
+// EDM_CAPTURE_PRE samples are always kept in a rolling window. On a trigger,
+// the window, the trigger sample and the n_post samples after it are frozen
+// into the next free of EDM_CAPTURE_SLOTS slots. Slots are kept until cleared
+// by M563 R2; triggers with all slots used are counted as missed. Triggers
+// while the post window of a capture is being filled belong to it.
+#ifndef EDM_CAPTURE_PRE
+#define EDM_CAPTURE_PRE 100
+#endif
+#ifndef EDM_CAPTURE_POST
+#define EDM_CAPTURE_POST 100
+#endif
+#ifndef EDM_CAPTURE_SLOTS
+#define EDM_CAPTURE_SLOTS 8
+#endif
 
-static on_probe_completed_ptr other_probe_completed;
-static user_mcode_ptrs_t other_mcode_ptrs;
+#define CAP_TRIG_SHORT 0x01
+#define CAP_TRIG_ARC 0x02
+#define CAP_TRIG_ALARM 0x04
+#define CAP_TRIG_PROBE 0x08
+#define CAP_TRIG_ALL 0x0f
 
-static void exec_mcode_read(bool print_log) {
-  bool succ;
-
-  uint8_t buf[1];
-  i2c_transfer_t tx;
-  tx.address = PULSER_ADDR;
-  tx.word_addr = REG_TEMPERATURE;
-  tx.word_addr_bytes = 1;
-  tx.count = 1;
-  tx.data = buf;
-  tx.no_block = false;
-  if (i2c_transfer(&tx, true)) {
-    succ = true;
-  } else {
-    succ = false;
-  }
-  uint8_t temp = buf[0];
+typedef struct {
+  uint8_t source;  // CAP_TRIG_* of the trigger(s)
+  uint16_t n_pre;  // entries before the trigger sample
+  uint16_t n;      // entries written
+  bool done;
+  log_entry_t entries[EDM_CAPTURE_PRE + 1 + EDM_CAPTURE_POST];
+} capture_slot_t;
 
-  char resp[100];
-  size_t ofs = 0;
-  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "[EDM|stat=%d,",
-                  edm_init_status);
-  if (succ) {
-    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "i2c=ok,temp=%d", temp);
-  } else {
-    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "i2c=fail");
-  }
-  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",polls=%ld,log=%d",
-                  edm_poll_cnt, edm_log.num_valid);
+typedef struct {
+  uint8_t mask;
+  uint16_t n_post;
+  volatile uint8_t pending;  // CAP_TRIG_* raised since the last sample
+  volatile int8_t active;    // slot being filled, -1: none
+  volatile uint8_t n_used;
+  volatile uint32_t missed;
+  uint16_t pre_ix;
+  uint16_t pre_n;
+  log_entry_t pre[EDM_CAPTURE_PRE];
+  capture_slot_t slot[EDM_CAPTURE_SLOTS];
+} capture_t;
 
-  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",F(step)=%ldHz",
-                  hal.f_step_timer);
+static capture_t capture = {
+    .mask = CAP_TRIG_SHORT | CAP_TRIG_ARC | CAP_TRIG_ALARM,
+    .n_post = EDM_CAPTURE_POST,
+    .active = -1,
+};
 
-  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
-  hal.stream.write(resp);
+// Any context; the capture starts with the next sample.
+static inline void capture_trigger(uint8_t source) {
+  __disable_irq();
+  capture.pending |= source & capture.mask;
+  __enable_irq();
+}
 
-  if (print_log && !edm_log.active) {
-    const int entry_per_line = 20;
-    int ix_read =
-        (edm_log.ix_write + EDM_LOG_SIZE - edm_log.num_valid) % EDM_LOG_SIZE;
-    int num_lines = (edm_log.num_valid + entry_per_line - 1) / entry_per_line;
-    for (int i = 0; i < num_lines; i++) {
-      ofs = 0;
-      ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "[EDML|");
-
-      int n_pulse = 0;
-      bool has_motion = false;
-      for (int j = 0; j < entry_per_line; j++) {
-        int ix_log = i * entry_per_line + j;
-        if (ix_log >= edm_log.num_valid) {
-          // no more log
-          ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "00,");
-        } else {
-          // has entry
-          log_entry_t entry = edm_log.entries[ix_read];
-          if (entry.status_flags > 0) {
-            has_motion = true;
-          }
-          n_pulse += entry.n_pulse;
+// Called from I2C interrupt for every sample, after the triggers of the
+// sample are raised.
+static void capture_add(log_entry_t entry) {
+  uint8_t pending = capture.pending;
+  capture.pending = 0;
 
-          int v_pulse = (entry.r_pulse * 10) / 255;
-          int v_short = (entry.r_short * 10) / 255;
-          ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "%d%d,", v_pulse,
-                          v_short);
-        }
-        ix_read = (ix_read + 1) % EDM_LOG_SIZE;
+  if (capture.active >= 0) {
+    capture_slot_t* c = &capture.slot[capture.active];
+    c->source |= pending;
+    c->entries[c->n++] = entry;
+    // >=: n_post may have been lowered meanwhile.
+    if (c->n >= c->n_pre + 1 + capture.n_post) {
+      c->done = true;
+      capture.active = -1;
+    }
+  } else if (pending) {
+    if (capture.n_used < EDM_CAPTURE_SLOTS) {
+      capture_slot_t* c = &capture.slot[capture.n_used];
+      int ix = (capture.pre_ix + EDM_CAPTURE_PRE - capture.pre_n) %
+               EDM_CAPTURE_PRE;
+      for (int i = 0; i < capture.pre_n; i++) {
+        c->entries[i] = capture.pre[ix];
+        ix = (ix + 1) % EDM_CAPTURE_PRE;
       }
-      ofs += snprintf(resp + ofs, sizeof(resp) - ofs, has_motion ? "M," : "-,");
-      ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "%d]" ASCII_EOL, n_pulse);
-      hal.stream.write(resp);
+      c->source = pending;
+      c->n_pre = capture.pre_n;
+      c->entries[c->n_pre] = entry;
+      c->n = c->n_pre + 1;
+      c->done = capture.n_post == 0;
+      capture.active = c->done ? -1 : capture.n_used;
+      capture.n_used++;
+    } else {
+      capture.missed++;
     }
   }
-}
 
-static void exec_mode_log(bool enable) {
-  if (enable) {
-    init_log();
+  capture.pre[capture.pre_ix] = entry;
+  capture.pre_ix = (capture.pre_ix + 1) % EDM_CAPTURE_PRE;
+  if (capture.pre_n < EDM_CAPTURE_PRE) {
+    capture.pre_n++;
   }
-  edm_log.active = enable;
 }
 
-// blocking I2C register write.
-// returns true if write was successful
-static bool write_reg(uint8_t reg_addr, uint8_t val) {
-  i2c_transfer_t tx;
-  tx.address = PULSER_ADDR;
-  tx.word_addr = reg_addr;
-  tx.word_addr_bytes = 1;
-  tx.count = 1;
-  tx.data = &val;
-  tx.no_block = false;
-  return i2c_transfer(&tx, false);
+static void capture_clear() {
+  __disable_irq();
+  capture.n_used = 0;
+  capture.active = -1;
+  capture.pending = 0;
+  capture.missed = 0;
+  __enable_irq();
 }
+#endif
 
-inline static void init_gate() {
-  GPIO_InitTypeDef init = {
-      .Pin = 1 << PULSER_GATE_PIN,
-      .Speed = GPIO_SPEED_FREQ_MEDIUM,
-      .Mode = GPIO_MODE_OUTPUT_PP,
-      .Pull = GPIO_NOPULL,
-  };
-  HAL_GPIO_Init(PULSER_GATE_PORT, &init);
-}
+////////////////////////////////////////////////////////////////////////////////
+// Gap servo
+//
+// PI controller turning PULSER gap telemetry into a continuous feed factor.
+// Gap error is (r_open - r_short) / 255 - target: positive when the gap is
+// too wide (advance faster), negative when too narrow (slow down).
+// Feed factor is applied to step timing by driver.c via
+// edm_servo_period_q16.
 
-inline static void set_gate(bool on) {
-  DIGITAL_OUT(PULSER_GATE_PORT, 1 << PULSER_GATE_PIN, on);
-}
+#ifndef EDM_SERVO_KP
+#define EDM_SERVO_KP 1.0f
+#endif
+#ifndef EDM_SERVO_KI
+#define EDM_SERVO_KI 5.0f
+#endif
+#ifndef EDM_SERVO_TARGET
+#define EDM_SERVO_TARGET 0.2f
+#endif
+#ifndef EDM_SERVO_MIN_FEED
+#define EDM_SERVO_MIN_FEED 0.05f
+#endif
+// With EDM_GATE_PWM_ENABLE, pulse on-time is scaled from this (at minimum feed)
+// to 1 (at full feed), so energy drops while the gap is loaded.
+#ifndef EDM_GATE_PWM_MIN_SCALE
+#define EDM_GATE_PWM_MIN_SCALE 0.5f
+#endif
 
-// must not be called when edm_init_status != 0
-static void exec_mcode_start(bool tool_neg,
-                             int pulse_dur_10us,
-                             int pulse_current_100ma,
-                             int pulse_duty_pct) {
-  bool all_ok = true;
-  all_ok &= write_reg(REG_PULSE_CURRENT, pulse_current_100ma);
-  all_ok &= write_reg(REG_PULSE_DUR, pulse_dur_10us);
-  all_ok &= write_reg(REG_MAX_DUTY, pulse_duty_pct);
-  all_ok &= write_reg(REG_POLARITY, tool_neg ? 2 : 1);  // 2: T- W+, 1: T+ W-
-  if (!all_ok) {
-    system_raise_alarm(Alarm_SelftestFailed);
-    return;
-  }
-  set_gate(true);
-}
+#define SERVO_PERIOD_ONE (1UL << 16)
 
-// must not be called when edm_init_status != 0
-static void exec_mcode_stop() {
-  set_gate(false);
+typedef struct {
+  bool enabled;
+  float kp;
+  float ki;
+  float target;
+  float integ;  // integrator state, doubles as steady-state feed factor
+  float feed;   // latest output, EDM_SERVO_MIN_FEED~1
+  uint32_t prev_t_us;
+} gap_servo_t;
 
-  bool ok = write_reg(REG_POLARITY, 0);  // OFF
-  if (!ok) {
-    system_raise_alarm(Alarm_SelftestFailed);
-    return;
-  }
-}
+static volatile gap_servo_t servo = {
+    .enabled = true,
+    .kp = EDM_SERVO_KP,
+    .ki = EDM_SERVO_KI,
+    .target = EDM_SERVO_TARGET,
+    .integ = 1.0f,
+    .feed = 1.0f,
+};
 
-static inline bool is_edm_mcode(user_mcode_t m) {
-  return (m == EDM_MCODE_READ || m == EDM_MCODE_START_TNEG ||
-          m == EDM_MCODE_START_TPOS || m == EDM_MCODE_STOP ||
-          m == EDM_MCODE_LOG);
-}
+volatile uint32_t edm_servo_period_q16 DTCM_DATA = SERVO_PERIOD_ONE;
 
-static user_mcode_type_t mcode_check(user_mcode_t m) {
-  if (!is_edm_mcode(m)) {
-    return other_mcode_ptrs.check ? other_mcode_ptrs.check(m)
-                                  : UserMCode_Unsupported;
-  }
+#if EDM_GATE_PWM_ENABLE
+static bool gate_pwm_ok = false;
+#endif
 
-  return UserMCode_Normal;
+#if EDM_SERVO_REF_ENABLE
+// Analog reference for an external servo Z head, see edm_servo_ref.c.
+#ifndef EDM_SERVO_REF_RETRACT
+#define EDM_SERVO_REF_RETRACT 1.0f  // retract speed on a short, of full scale
+#endif
+
+static bool servo_ref_ok = false;
+#endif
+
+#if EDM_GATE_BREAK_ENABLE
+// Gate cut in hardware by the timer break input, see edm_gate_break().
+#ifndef EDM_GATE_BREAK_REARM_MS
+#define EDM_GATE_BREAK_REARM_MS 20  // min time off before re-energizing
+#endif
+
+typedef struct {
+  bool ok;
+  volatile bool resume;  // re-energize once the input is released
+  volatile uint32_t trip_ms;
+  volatile uint32_t trips;
+  uint32_t rearms;
+} gate_break_t;
+
+static gate_break_t gate_break;
+#endif
+
+static inline float clampf(float v, float lo, float hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
 }
 
-static status_code_t mcode_validate(parser_block_t* block) {
-  user_mcode_t code = block->user_mcode;
+#if EDM_AUTOTUNE_ENABLE
+// Relay feedback experiment (Astrom-Hagglund) on the gap servo, see M569.
+// The relay of amplitude d sustains a limit cycle in the gap error; its
+// period Tu and amplitude a give the ultimate gain Ku = 4d / (pi a), and PI
+// gains by Ziegler-Nichols: kp = 0.45 Ku, ki = kp * 1.2 / Tu.
+#ifndef EDM_AUTOTUNE_HYST
+#define EDM_AUTOTUNE_HYST 0.02f  // gap error hysteresis of the relay
+#endif
+#ifndef EDM_AUTOTUNE_SKIP
+#define EDM_AUTOTUNE_SKIP 2  // cycles before measuring
+#endif
+#ifndef EDM_AUTOTUNE_TIMEOUT_S
+#define EDM_AUTOTUNE_TIMEOUT_S 60
+#endif
 
-  if (!is_edm_mcode(code)) {
-    return other_mcode_ptrs.validate ? other_mcode_ptrs.validate(block)
-                                     : Status_Unhandled;
-  }
+enum {
+  TUNE_IDLE = 0,
+  TUNE_ARMED,
+  TUNE_RUNNING,
+  TUNE_DONE,    // gains set, to be reported from the realtime loop
+  TUNE_FAILED,  // timed out or de-energized, to be reported
+};
 
-  switch ((int)code) {
-    case EDM_MCODE_READ:
+typedef struct {
+  volatile uint8_t state;
+  uint8_t cycles;      // cycles to measure
+  uint8_t n;           // rising switches seen
+  uint8_t store_step;  // recipe step to store the gains with, 0: none
+  bool high;           // relay output
+  float d;             // relay amplitude, feed factor
+  float base;          // feed the relay switches around
+  float e_max, e_min;  // gap error over the current cycle
+  float amp_sum;
+  uint32_t t_start_us;
+  uint32_t t_cycle_us;  // last rising switch
+  uint32_t period_sum_us;
+  // last result
+  bool valid;
+  float ku, tu, kp, ki;
+} autotune_t;
+
+static autotune_t tune = {.cycles = 4, .d = 0.2f};
+
+// Called from servo_update() for every sample while energized. Returns true
+// with the relay feed in *feed while a run is armed or running.
+static bool tune_relay(uint32_t t_us, float err, float* feed) {
+  if (tune.state == TUNE_ARMED) {
+    tune.base =
+        clampf(servo.integ, EDM_SERVO_MIN_FEED + tune.d, 1.0f - tune.d);
+    tune.high = true;
+    tune.n = 0;
+    tune.amp_sum = 0.0f;
+    tune.period_sum_us = 0;
+    tune.e_max = tune.e_min = err;
+    tune.t_start_us = tune.t_cycle_us = t_us;
+    tune.state = TUNE_RUNNING;
+  } else if (tune.state != TUNE_RUNNING) {
+    return false;
+  }
+
+  if (t_us - tune.t_start_us > EDM_AUTOTUNE_TIMEOUT_S * 1000000UL) {
+    tune.state = TUNE_FAILED;
+    return false;
+  }
+
+  tune.e_max = err > tune.e_max ? err : tune.e_max;
+  tune.e_min = err < tune.e_min ? err : tune.e_min;
+
+  if (tune.high && err < -EDM_AUTOTUNE_HYST) {
+    tune.high = false;
+  } else if (!tune.high && err > EDM_AUTOTUNE_HYST) {
+    tune.high = true;
+    if (++tune.n > EDM_AUTOTUNE_SKIP) {
+      tune.period_sum_us += t_us - tune.t_cycle_us;
+      tune.amp_sum += (tune.e_max - tune.e_min) * 0.5f;
+    }
+    tune.t_cycle_us = t_us;
+    tune.e_max = tune.e_min = err;
+
+    if (tune.n >= EDM_AUTOTUNE_SKIP + tune.cycles) {
+      float a = tune.amp_sum / tune.cycles;
+      tune.tu = tune.period_sum_us * 1e-6f / tune.cycles;
+      tune.ku = 4.0f * tune.d / (M_PI * (a > 1e-3f ? a : 1e-3f));
+      tune.kp = clampf(0.45f * tune.ku, 0.0f, 20.0f);
+      tune.ki = clampf(tune.kp * 1.2f / tune.tu, 0.0f, 1000.0f);
+      tune.valid = true;
+      tune.state = TUNE_DONE;
+      servo.kp = tune.kp;
+      servo.ki = tune.ki;
+      servo.integ = tune.base;  // PI resumes from the relay center
+      return false;
+    }
+  }
+
+  *feed = tune.base + (tune.high ? tune.d : -tune.d);
+  return true;
+}
+#endif
+
+static void servo_reset() {
+  servo.integ = 1.0f;
+  servo.feed = 1.0f;
+  edm_servo_period_q16 = SERVO_PERIOD_ONE;
+#if EDM_SERVO_REF_ENABLE
+  if (servo_ref_ok) {
+    edm_servo_ref_set(0.0f);  // hold still while not burning
+  }
+#endif
+#if EDM_GATE_PWM_ENABLE
+  if (gate_pwm_ok) {
+    edm_gate_pwm_scale(1.0f);
+  }
+#endif
+}
+
+// Called from I2C interrupt for every sample.
+static void servo_update(uint32_t t_us,
+                         uint8_t r_open,
+                         uint8_t r_short) {
+  float dt = (t_us - servo.prev_t_us) * 1e-6f;
+  servo.prev_t_us = t_us;
+
+  if (!servo.enabled || !edm_removal_active) {
+#if EDM_AUTOTUNE_ENABLE
+    if (tune.state == TUNE_RUNNING) {
+      tune.state = TUNE_FAILED;
+    }
+#endif
+    servo_reset();
+    return;
+  }
+
+  // Guard against gaps in sampling (e.g. after re-energizing).
+  dt = clampf(dt, 0.0f, 0.01f);
+
+  float err = ((float)r_open - (float)r_short) / 255.0f - servo.target;
+  float feed;
+#if EDM_AUTOTUNE_ENABLE
+  if (tune_relay(t_us, err, &feed)) {
+    servo.feed = feed;
+  } else
+#endif
+  {
+    servo.integ =
+        clampf(servo.integ + servo.ki * err * dt, EDM_SERVO_MIN_FEED, 1.0f);
+    feed = servo.kp * err + servo.integ;
+    servo.feed = clampf(feed, EDM_SERVO_MIN_FEED, 1.0f);
+  }
+
+  edm_servo_period_q16 = (uint32_t)(SERVO_PERIOD_ONE / servo.feed);
+
+#if EDM_SERVO_REF_ENABLE
+  // Same short criterion as the retract request of the step generator.
+  if (servo_ref_ok) {
+    edm_servo_ref_set(r_short > 127 ? -EDM_SERVO_REF_RETRACT : servo.feed);
+  }
+#endif
+
+#if EDM_GATE_PWM_ENABLE
+  if (gate_pwm_ok) {
+    edm_gate_pwm_scale(EDM_GATE_PWM_MIN_SCALE +
+                       (1.0f - EDM_GATE_PWM_MIN_SCALE) * servo.feed);
+  }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// M-code handlers
+
+// G38 contact filter, updated per sample from edm_poll_complete().
+#ifndef EDM_PROBE_N_REQUIRED
+#define EDM_PROBE_N_REQUIRED 1
+#endif
+#ifndef EDM_PROBE_WINDOW
+#define EDM_PROBE_WINDOW 1
+#endif
+#ifndef EDM_PROBE_THRESHOLD
+#define EDM_PROBE_THRESHOLD 1  // r_pulse + r_short, 0~510
+#endif
+#ifndef EDM_PROBE_BURST_HZ
+#define EDM_PROBE_BURST_HZ 0  // 0: keep EDM_POLL_RATE_HZ while probing
+#endif
+
+typedef struct {
+  uint8_t n_required;
+  uint8_t window;
+  uint16_t threshold;
+  uint16_t burst_hz;
+
+  bool probing;
+  bool invert;         // probing away from workpiece
+  uint32_t history;    // bit0: latest sample, 1 = contact
+  bool triggered;      // filtered contact state
+  uint32_t contact_us;  // t_us of first contact sample of current run
+  uint32_t trigger_us;  // t_us of sample that made the filter trigger
+  uint32_t latch_cnt;
+  // sys.position at the start of the first contact sample's poll
+  int32_t contact_position[N_AXIS];
+  bool contact_latched;
+} probe_filter_t;
+
+static volatile probe_filter_t probe_filter = {
+    .n_required = EDM_PROBE_N_REQUIRED,
+    .window = EDM_PROBE_WINDOW,
+    .threshold = EDM_PROBE_THRESHOLD,
+    .burst_hz = EDM_PROBE_BURST_HZ,
+};
+
+static void probe_filter_reset() {
+  probe_filter.history = 0;
+  probe_filter.triggered = false;
+  probe_filter.contact_latched = false;
+}
+
+static void probe_filter_update(uint32_t t_us, const int32_t* position,
+                                uint8_t r_pulse, uint8_t r_short) {
+  bool contact = (r_pulse + r_short) >= probe_filter.threshold;
+  uint32_t mask = probe_filter.window >= 32
+                      ? 0xffffffff
+                      : (1UL << probe_filter.window) - 1;
+
+  if (contact && (probe_filter.history & mask) == 0) {
+    probe_filter.contact_us = t_us;
+    if (probe_filter.probing && !probe_filter.triggered) {
+      memcpy((int32_t*)probe_filter.contact_position, position,
+             sizeof(probe_filter.contact_position));
+      probe_filter.contact_latched = true;
+    }
+  }
+  uint32_t history = ((probe_filter.history << 1) | contact) & mask;
+  probe_filter.history = history;
+
+  bool triggered = __builtin_popcount(history) >= probe_filter.n_required;
+  if (triggered && !probe_filter.triggered) {
+    probe_filter.trigger_us = t_us;
+    if (probe_filter.probing) {
+      probe_filter.latch_cnt++;
+#if EDM_CAPTURE_ENABLE
+      capture_trigger(CAP_TRIG_PROBE);
+#endif
+    }
+  }
+  probe_filter.triggered = triggered;
+}
+
+static on_probe_completed_ptr other_probe_completed;
+static user_mcode_ptrs_t other_mcode_ptrs;
+
+#define LOG_PRINT_NONE 0
+#define LOG_PRINT_TEXT 1
+#define LOG_PRINT_BINARY 2
+#if DSP_ENABLE
+#define LOG_PRINT_SPECTRUM 3
+#else
+#define LOG_PRINT_SPECTRUM -1  // not accepted
+#endif
+
+static void write_n(const char* data, size_t len) {
+  if (hal.stream.write_n) {
+    hal.stream.write_n((const uint8_t*)data, len);
+  } else {
+    hal.stream.write(data);  // data must be null-terminated
+  }
+}
+
+static void print_log_text() {
+  char resp[100];
+  size_t ofs = 0;
+  const int entry_per_line = 20;
+  int ix_read =
+      (edm_log.ix_write + log_depth - edm_log.num_valid) % log_depth;
+  int num_lines = (edm_log.num_valid + entry_per_line - 1) / entry_per_line;
+  for (int i = 0; i < num_lines; i++) {
+    ofs = 0;
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "[EDML|");
+
+    int n_pulse = 0;
+    bool has_motion = false;
+    for (int j = 0; j < entry_per_line; j++) {
+      int ix_log = i * entry_per_line + j;
+      if (ix_log >= edm_log.num_valid) {
+        // no more log
+        ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "00,");
+      } else {
+        // has entry
+        log_entry_t entry = log_entries[ix_read];
+        if (entry.status_flags > 0) {
+          has_motion = true;
+        }
+        n_pulse += entry.n_pulse;
+
+        int v_pulse = (entry.r_pulse * 10) / 255;
+        int v_short = (entry.r_short * 10) / 255;
+        ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "%d%d,", v_pulse,
+                        v_short);
+      }
+      ix_read = (ix_read + 1) % log_depth;
+    }
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, has_motion ? "M," : "-,");
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "%d]" ASCII_EOL, n_pulse);
+    hal.stream.write(resp);
+  }
+}
+
+static const char b64_chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Encodes len bytes (must be multiple of 3 except for the last chunk).
+// Returns number of chars written to out.
+static size_t b64_encode(const uint8_t* in, size_t len, char* out) {
+  char* p = out;
+  while (len >= 3) {
+    uint32_t v = (in[0] << 16) | (in[1] << 8) | in[2];
+    *p++ = b64_chars[(v >> 18) & 0x3f];
+    *p++ = b64_chars[(v >> 12) & 0x3f];
+    *p++ = b64_chars[(v >> 6) & 0x3f];
+    *p++ = b64_chars[v & 0x3f];
+    in += 3;
+    len -= 3;
+  }
+  if (len > 0) {
+    uint32_t v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+    *p++ = b64_chars[(v >> 18) & 0x3f];
+    *p++ = b64_chars[(v >> 12) & 0x3f];
+    *p++ = len > 1 ? b64_chars[(v >> 6) & 0x3f] : '=';
+    *p++ = '=';
+  }
+  return p - out;
+}
+
+#define LOG_BIN_ENTRY_SIZE 9
+#define LOG_BIN_ENTRIES_PER_LINE 20  // 180 bytes -> 240 chars
+
+// Serializes one entry (LOG_BIN_ENTRY_SIZE bytes). Returns next write pos.
+static uint8_t* pack_entry(uint8_t* p, log_entry_t entry) {
+  *p++ = entry.t_us;
+  *p++ = entry.t_us >> 8;
+  *p++ = entry.t_us >> 16;
+  *p++ = entry.t_us >> 24;
+  *p++ = entry.status_flags;
+  *p++ = entry.r_open;
+  *p++ = entry.r_short;
+  *p++ = entry.r_pulse;
+  *p++ = entry.n_pulse;
+  return p;
+}
+
+static uint8_t* pack_log_entry(uint8_t* p, int ix) {
+  return pack_entry(p, log_entries[ix]);
+}
+
+// Binary log dump.
+//
+// [EDMB|v=1,n=<entries>,esz=9[,rtc=<wall time>,rtc_us=<t_us at wall time>]]
+// <base64 line>  (repeated, up to 20 entries per line)
+// [EDMB|end]
+//
+// Each entry is 9 bytes, little-endian:
+// t_us(u32), status_flags(u8), r_open(u8), r_short(u8), r_pulse(u8),
+// n_pulse(u8)
+static void print_log_binary() {
+  static uint8_t bin[LOG_BIN_ENTRY_SIZE * LOG_BIN_ENTRIES_PER_LINE];
+  static char line[(sizeof(bin) / 3) * 4 + sizeof(ASCII_EOL)];
+  char resp[112];
+
+  int ofs = snprintf(resp, sizeof(resp), "[EDMB|v=1,n=%d,esz=%d",
+                     edm_log.num_valid, LOG_BIN_ENTRY_SIZE);
+  ofs += rtc_stamp_print(resp + ofs, sizeof(resp) - ofs);
+  snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+  hal.stream.write(resp);
+
+  int ix_read =
+      (edm_log.ix_write + log_depth - edm_log.num_valid) % log_depth;
+  int remaining = edm_log.num_valid;
+  while (remaining > 0) {
+    int n = remaining < LOG_BIN_ENTRIES_PER_LINE ? remaining
+                                                 : LOG_BIN_ENTRIES_PER_LINE;
+    uint8_t* p = bin;
+    for (int i = 0; i < n; i++) {
+      p = pack_log_entry(p, ix_read);
+      ix_read = (ix_read + 1) % log_depth;
+    }
+    size_t len = b64_encode(bin, p - bin, line);
+    memcpy(line + len, ASCII_EOL, sizeof(ASCII_EOL));
+    write_n(line, len + sizeof(ASCII_EOL) - 1);
+    remaining -= n;
+  }
+
+  hal.stream.write("[EDMB|end]" ASCII_EOL);
+}
+
+#if DSP_ENABLE
+#ifndef EDM_LOG_SPECTRUM_PEAKS
+#define EDM_LOG_SPECTRUM_PEAKS 5
+#endif
+
+// Statistics and spectrum peaks of the short and open ratios (0~1) over the
+// latest entries, the largest power of 2 up to DSP_FFT_MAX, one line each:
+// [EDMF|sig=<short|open>,n=<entries>,fs=<Hz>,mean=,std=,min=,max=,<Hz>:<amplitude>,...]
+// fs is measured from the entry time stamps, so that probing bursts and
+// skipped polls are accounted for.
+static void print_log_spectrum() {
+  static const char* const sig_name[] = {"short", "open"};
+  char resp[200];
+  dsp_stats_t stats;
+  dsp_peak_t peaks[EDM_LOG_SPECTRUM_PEAKS];
+
+  uint32_t n = DSP_FFT_MAX;
+  while (n > (uint32_t)edm_log.num_valid) {
+    n >>= 1;
+  }
+  if (n < 32) {
+    hal.stream.write("[EDMF|n=0]" ASCII_EOL);
+    return;
+  }
+
+  int ix_first = (edm_log.ix_write + log_depth - n) % log_depth;
+  int ix_last = (edm_log.ix_write + log_depth - 1) % log_depth;
+  uint32_t span_us = log_entries[ix_last].t_us - log_entries[ix_first].t_us;
+  float fs = span_us ? (float)(n - 1) * 1e6f / (float)span_us
+                     : (float)EDM_POLL_RATE_HZ;
+
+  for (int sig = 0; sig < 2; sig++) {
+    int ix_read = ix_first;
+    for (uint32_t i = 0; i < n; i++) {
+      uint8_t r = sig == 0 ? log_entries[ix_read].r_short
+                           : log_entries[ix_read].r_open;
+      dsp_fft_in[i] = (float)r / 255.0f;
+      ix_read = (ix_read + 1) % log_depth;
+    }
+    uint_fast8_t n_peaks =
+        dsp_spectrum(n, fs, &stats, peaks, EDM_LOG_SPECTRUM_PEAKS);
+
+    int ofs = snprintf(resp, sizeof(resp),
+                       "[EDMF|sig=%s,n=%lu,fs=%.1f,mean=%.3f,std=%.3f,"
+                       "min=%.3f,max=%.3f",
+                       sig_name[sig], n, fs, stats.mean, stats.std,
+                       stats.min, stats.max);
+    for (uint_fast8_t i = 0; i < n_peaks; i++) {
+      ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",%.1f:%.3f",
+                      peaks[i].hz, peaks[i].amplitude);
+    }
+    snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+    hal.stream.write(resp);
+  }
+}
+#endif
+
+// Max time an incomplete batch is held back before being streamed.
+#ifndef EDM_STREAM_FLUSH_MS
+#define EDM_STREAM_FLUSH_MS 50
+#endif
+
+// Don't stream while more than this many bytes wait in the TX buffer,
+// so that the realtime loop never blocks on a full stream.
+#ifndef EDM_STREAM_TX_HIGHWATER
+#define EDM_STREAM_TX_HIGHWATER 128
+#endif
+
+// Stream pending log entries. Called from the realtime loop.
+// Sends at most one line (LOG_BIN_ENTRIES_PER_LINE entries) per call.
+//
+// [EDMS|<seq>,<base64 entries>]
+// seq: serial number of the first entry since M551 S2. Entries the stream
+// could not keep up with are skipped (gap in seq) and counted.
+// Entry format is same as print_log_binary(). M551 S2 first sends
+// [EDMS|start[,rtc=<wall time>,rtc_us=<t_us at wall time>]].
+static void edm_stream_drain() {
+  static uint8_t bin[LOG_BIN_ENTRY_SIZE * LOG_BIN_ENTRIES_PER_LINE];
+  static char line[24 + (sizeof(bin) / 3) * 4 + sizeof(ASCII_EOL)];
+
+  int ix_write;
+  uint32_t n_written = log_snapshot(&ix_write);
+  uint32_t n_pending = n_written - edm_log.num_streamed;
+  if (n_pending == 0) {
+    return;
+  }
+
+  // Lapped by producer; skip forward, leaving margin for entries being
+  // overwritten while we read.
+  if (n_pending > log_depth - LOG_BIN_ENTRIES_PER_LINE) {
+    uint32_t n_skip = n_pending - (log_depth - LOG_BIN_ENTRIES_PER_LINE);
+    edm_log.stream_drop_cnt += n_skip;
+    edm_log.num_streamed += n_skip;
+    n_pending -= n_skip;
+  }
+
+  uint32_t now_ms = hal.get_elapsed_ticks();
+  if (n_pending < LOG_BIN_ENTRIES_PER_LINE &&
+      now_ms - edm_log.last_flush_ms < EDM_STREAM_FLUSH_MS) {
+    return;
+  }
+  if (hal.stream.get_tx_buffer_count &&
+      hal.stream.get_tx_buffer_count() > EDM_STREAM_TX_HIGHWATER) {
+    return;
+  }
+  edm_log.last_flush_ms = now_ms;
+
+  uint32_t n = n_pending < LOG_BIN_ENTRIES_PER_LINE ? n_pending
+                                                    : LOG_BIN_ENTRIES_PER_LINE;
+  uint32_t seq = edm_log.num_streamed;
+  int ix_read = (ix_write + log_depth - n_pending) % log_depth;
+  uint8_t* p = bin;
+  for (uint32_t i = 0; i < n; i++) {
+    p = pack_log_entry(p, ix_read);
+    ix_read = (ix_read + 1) % log_depth;
+  }
+  edm_log.num_streamed += n;
+
+  size_t len = snprintf(line, sizeof(line), "[EDMS|%" PRIu32 ",", seq);
+  len += b64_encode(bin, p - bin, line + len);
+  memcpy(line + len, "]" ASCII_EOL, sizeof("]" ASCII_EOL));
+  write_n(line, len + sizeof("]" ASCII_EOL) - 1);
+}
+
+#if EDM_CAPTURE_ENABLE
+// Dumps the completed captures.
+//
+// [EDMC|v=1,slot=<k>,trig=<CAP_TRIG_* mask>,pre=<n_pre>,n=<entries>,esz=9
+//   [,rtc=<wall time>,rtc_us=<t_us at wall time>]]
+// <base64 line>  (repeated, up to 20 entries per line)
+// ...
+// [EDMC|end,miss=<missed triggers>]
+//
+// Entry format is same as print_log_binary(); entry n_pre is the trigger
+// sample.
+static void print_captures() {
+  static uint8_t bin[LOG_BIN_ENTRY_SIZE * LOG_BIN_ENTRIES_PER_LINE];
+  static char line[(sizeof(bin) / 3) * 4 + sizeof(ASCII_EOL)];
+  char resp[144];
+
+  for (int k = 0; k < capture.n_used; k++) {
+    const capture_slot_t* c = &capture.slot[k];
+    if (!c->done) {
+      continue;  // still filling, written from I2C interrupt
+    }
+    int ofs = snprintf(resp, sizeof(resp),
+                       "[EDMC|v=1,slot=%d,trig=%d,pre=%d,n=%d,esz=%d", k,
+                       c->source, c->n_pre, c->n, LOG_BIN_ENTRY_SIZE);
+    ofs += rtc_stamp_print(resp + ofs, sizeof(resp) - ofs);
+    snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+    hal.stream.write(resp);
+    for (int i = 0; i < c->n; i += LOG_BIN_ENTRIES_PER_LINE) {
+      int n = c->n - i < LOG_BIN_ENTRIES_PER_LINE ? c->n - i
+                                                  : LOG_BIN_ENTRIES_PER_LINE;
+      uint8_t* p = bin;
+      for (int j = 0; j < n; j++) {
+        p = pack_entry(p, c->entries[i + j]);
+      }
+      size_t len = b64_encode(bin, p - bin, line);
+      memcpy(line + len, ASCII_EOL, sizeof(ASCII_EOL));
+      write_n(line, len + sizeof(ASCII_EOL) - 1);
+    }
+  }
+  snprintf(resp, sizeof(resp), "[EDMC|end,miss=%lu]" ASCII_EOL,
+           capture.missed);
+  hal.stream.write(resp);
+}
+
+static int capture_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",cap=%d(%d/%d,%d+%d,miss=%lu)", capture.mask,
+                  capture.n_used, EDM_CAPTURE_SLOTS, EDM_CAPTURE_PRE,
+                  capture.n_post, capture.missed);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_capture(parser_block_t* block) {
+  if (!isnan(block->values.s)) {
+    capture.mask = block->values.s;
+  }
+  if (!isnan(block->values.p)) {
+    capture.n_post = block->values.p;
+  }
+  if (block->values.r == 1) {
+    print_captures();
+  } else if (block->values.r == 2) {
+    capture_clear();
+  }
+}
+#endif
+
+#if EDM_LOG_PERSIST
+
+// Page size of the log file. Pages are always written whole, so a page
+// write maps to whole flash pages / SD sectors.
+#ifndef EDM_LOG_PAGE_SIZE
+#define EDM_LOG_PAGE_SIZE 512
+#endif
+
+#define PERSIST_HDR_SIZE 20
+#define PERSIST_REC_MAX 11  // header + 5 byte varint + 5 fields
+#define PERSIST_DT_PRESENT 0x20
+#define PERSIST_END 0xff     // page padding
+
+typedef struct {
+  vfs_file_t* file;
+  uint8_t page[EDM_LOG_PAGE_SIZE];
+  size_t len;  // used bytes of page, 0: no page started
+  bool first;  // next page is the first of this run
+  // Previous record in page, fields are stored only when changed.
+  uint32_t t_us;
+  uint32_t dt_us;
+  uint8_t field[5];
+} edm_persist_t;
+
+static edm_persist_t persist;
+
+static void persist_page_start(uint32_t seq, uint32_t t_us) {
+  // Wall time of t_us, which lies shortly before now. Stamped per page since
+  // t_us wraps every ~71 minutes.
+  rtc_stamp_t now;
+  uint32_t rtc_s = 0, rtc_us = 0;
+  if (rtc_stamp_get(&now)) {
+    uint64_t wall_us =
+        (uint64_t)now.epoch * 1000000 + now.us - (now.t_us - t_us);
+    rtc_s = wall_us / 1000000;
+    rtc_us = wall_us % 1000000;
+  }
+
+  uint8_t* p = persist.page;
+  *p++ = 'E';
+  *p++ = 'L';
+  *p++ = 2;  // version
+  *p++ = persist.first ? 1 : 0;
+  for (int i = 0; i < 4; i++) {
+    *p++ = seq >> (i * 8);
+  }
+  for (int i = 0; i < 4; i++) {
+    *p++ = t_us >> (i * 8);
+  }
+  for (int i = 0; i < 4; i++) {
+    *p++ = rtc_s >> (i * 8);
+  }
+  for (int i = 0; i < 4; i++) {
+    *p++ = rtc_us >> (i * 8);
+  }
+  persist.len = PERSIST_HDR_SIZE;
+  persist.first = false;
+  persist.t_us = t_us;
+  persist.dt_us = 0;
+  memset(persist.field, 0, sizeof(persist.field));
+}
+
+// Pads and writes the current page. Returns false on write error, which
+// stops persisting.
+static bool persist_page_write() {
+  if (persist.len == 0) {
+    return true;
+  }
+  memset(persist.page + persist.len, PERSIST_END,
+         EDM_LOG_PAGE_SIZE - persist.len);
+  persist.len = 0;
+  if (vfs_write(persist.page, 1, EDM_LOG_PAGE_SIZE, persist.file) !=
+      EDM_LOG_PAGE_SIZE) {
+    edm_log.persisting = false;
+    return false;
+  }
+  edm_log.persist_pages++;
+  return true;
+}
+
+static void persist_add(int ix) {
+  log_entry_t entry = log_entries[ix];
+  uint8_t field[5] = {entry.status_flags, entry.r_open, entry.r_short,
+                      entry.r_pulse, entry.n_pulse};
+  uint32_t dt = entry.t_us - persist.t_us;
+  uint8_t* p = persist.page + persist.len;
+  uint8_t* hdr = p++;
+
+  *hdr = 0;
+  if (dt != persist.dt_us) {
+    *hdr |= PERSIST_DT_PRESENT;
+    persist.dt_us = dt;
+    do {
+      *p++ = (dt & 0x7f) | (dt > 0x7f ? 0x80 : 0);
+      dt >>= 7;
+    } while (dt);
+  }
+  for (int i = 0; i < 5; i++) {
+    if (field[i] != persist.field[i]) {
+      *hdr |= 1 << i;
+      *p++ = field[i];
+      persist.field[i] = field[i];
+    }
+  }
+  persist.t_us = entry.t_us;
+  persist.len = p - persist.page;
+}
+
+// Append pending log entries to EDM_LOG_FILE. Called from the realtime loop.
+// Entries are packed into a page buffer, only a full page is written, at most
+// one per call.
+//
+// The file is a sequence of EDM_LOG_PAGE_SIZE byte pages, each decodable on its
+// own. Page header (20 bytes, little-endian):
+// 'E', 'L', version(u8) = 2, flags(u8, bit0: first page of a M551 run),
+// seq(u32, serial number of the first record since M551), t_us(u32),
+// rtc_s(u32, seconds since 1970-01-01 at t_us, 0 if the RTC is not set),
+// rtc_us(u32, microseconds within rtc_s).
+// Records follow up to a PERSIST_END (0xff) byte or the page end:
+// hdr(u8): bit0-4 set: status_flags, r_open, r_short, r_pulse, n_pulse
+//   follow in that order (u8 each), else unchanged from the previous record
+//   (0 at page start); bit5 set: the time delta to the previous record
+//   (to t_us of the header for the first) follows before the fields as
+//   LEB128 varint, else it equals the previous delta (0 at page start).
+// A seq that does not continue the previous page marks dropped entries.
+static void edm_persist_drain() {
+  int ix_write;
+  uint32_t n_written = log_snapshot(&ix_write);
+  uint32_t n_pending = n_written - edm_log.num_persisted;
+
+  // Lapped by producer; skip forward and start a new page so that the gap
+  // shows in seq.
+  if (n_pending > log_depth - LOG_BIN_ENTRIES_PER_LINE) {
+    uint32_t n_skip = n_pending - (log_depth - LOG_BIN_ENTRIES_PER_LINE);
+    edm_log.persist_drop_cnt += n_skip;
+    edm_log.num_persisted += n_skip;
+    n_pending -= n_skip;
+    if (persist.len && !persist_page_write()) {
+      return;
+    }
+  }
+
+  int ix_read = (ix_write + log_depth - n_pending) % log_depth;
+  while (n_pending > 0) {
+    if (persist.len == 0) {
+      persist_page_start(edm_log.num_persisted, log_entries[ix_read].t_us);
+    } else if (persist.len + PERSIST_REC_MAX > EDM_LOG_PAGE_SIZE) {
+      persist_page_write();
+      return;
+    }
+    persist_add(ix_read);
+    ix_read = (ix_read + 1) % log_depth;
+    edm_log.num_persisted++;
+    n_pending--;
+  }
+}
+
+static bool persist_open() {
+  persist.len = 0;
+  persist.first = true;
+  persist.file = vfs_open(EDM_LOG_FILE, "a");
+  return persist.file != NULL;
+}
+
+// Writes the remaining entries and closes the file, foreground only.
+static void persist_close() {
+  if (persist.file == NULL) {
+    return;
+  }
+  while (edm_log.persisting && edm_log.num_written != edm_log.num_persisted) {
+    edm_persist_drain();  // clears persisting on write error
+  }
+  if (edm_log.persisting) {
+    persist_page_write();
+  }
+  edm_log.persisting = false;
+  vfs_close(persist.file);
+  persist.file = NULL;
+}
+
+#endif
+
+static void print_hist(const char* name, volatile uint32_t* hist) {
+  char resp[256];
+  size_t ofs = 0;
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "[EDMH|%s", name);
+  for (int i = 0; i < EDM_HIST_BINS; i++) {
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",%" PRIu32, hist[i]);
+  }
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+  hal.stream.write(resp);
+}
+
+// newlib-nano printf has no %llu; split into two decimal parts.
+static size_t print_u64(char* buf, size_t size, uint64_t v) {
+  const uint32_t base = 1000000000;
+  if (v < base) {
+    return snprintf(buf, size, "%" PRIu32, (uint32_t)v);
+  }
+  return snprintf(buf, size, "%" PRIu32 "%09" PRIu32, (uint32_t)(v / base),
+                  (uint32_t)(v % base));
+}
+
+static void print_stats() {
+  char resp[256];
+  size_t ofs = 0;
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "[EDMT|n=%" PRIu32 ",pulses=",
+                  edm_stats.n_samples);
+  ofs += print_u64(resp + ofs, sizeof(resp) - ofs, edm_stats.total_pulses);
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",shorts=%" PRIu32 ",short_us=", edm_stats.short_cnt);
+  ofs += print_u64(resp + ofs, sizeof(resp) - ofs, edm_stats.short_total_us);
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  "/%" PRIu32 ",retracts=%" PRIu32 ",retract_us=",
+                  edm_stats.short_max_us, edm_stats.retract_cnt);
+  ofs += print_u64(resp + ofs, sizeof(resp) - ofs, edm_stats.retract_total_us);
+#if EDM_PULSE_CAPTURE_ENABLE
+  if (edm_stats.cap_measured) {
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                    ",width=%luns,delay=%luns",
+                    (uint32_t)(edm_stats.cap_width_ns / edm_stats.cap_measured),
+                    (uint32_t)(edm_stats.cap_delay_ns / edm_stats.cap_measured));
+  }
+#endif
+  ofs += rtc_stamp_print(resp + ofs, sizeof(resp) - ofs);
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+  hal.stream.write(resp);
+
+  print_hist("pulse", edm_stats.hist_pulse);
+  print_hist("short", edm_stats.hist_short);
+  print_hist("open", edm_stats.hist_open);
+
+  float q_tneg = wear.charge_uc[POL_TNEG] * 1e-6f;
+  float q_tpos = wear.charge_uc[POL_TPOS] * 1e-6f;
+  ofs = 0;
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  "[EDMW|q=%.3f/%.3fC,e=%.1fJ,pulses=%" PRIu32 "/%" PRIu32,
+                  q_tneg, q_tpos, (q_tneg + q_tpos) * EDM_GAP_VOLTAGE,
+                  wear.pulses[POL_TNEG], wear.pulses[POL_TPOS]);
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",wear=%.3fmm3,nvs=%s(saves=%" PRIu32 ")",
+                  (q_tneg * EDM_WEAR_TNEG_MM3_PER_C +
+                   q_tpos * EDM_WEAR_TPOS_MM3_PER_C) *
+                      wear_scale,
+                  wear_persist_ok ? "ok" : "off", wear_saves);
+#if EDM_WEAR_COMP_ENABLE
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",wcomp=%s(%.4fmm,%lu)",
+                  wear_comp.enabled ? "on" : "off",
+                  wear_comp.enabled ? wear_comp_mm() : 0.0f, wear_comp.steps);
+#endif
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+  hal.stream.write(resp);
+}
+
+#if EDM_PULSER_SIM
+// On-MCU stand-in for PULSER, for tuning the servo and retract on the bench
+// without a generator or electrodes. Register writes land in sim.reg and
+// polls are answered from a stochastic gap model instead of I2C, through the
+// same edm_poll_complete() path (run from the poll timer instead of the I2C
+// interrupt). The model is driven by the actual Z position:
+// - The work surface sits below the electrode (EDM_SIM_DIR_NEG), placed
+//   EDM_SIM_GAP0_UM away on the first energize or by M562.
+// - A pulse ignites with probability exp(-gap / EDM_SIM_GAP_UM); at or
+//   below zero gap the sample is a hard short.
+// - Ignited pulses remove EDM_SIM_UM_PER_PULSE per amp of current from the
+//   surface and add debris, which decays with EDM_SIM_DEBRIS_MS and causes
+//   random shorts in proportion.
+// The random sequence restarts from the M562 seed, so runs are repeatable
+// for a given program and settings.
+#ifndef EDM_SIM_DIR_NEG
+#define EDM_SIM_DIR_NEG 1  // 1: work is toward Z-
+#endif
+#ifndef EDM_SIM_GAP0_UM
+#define EDM_SIM_GAP0_UM 100.0f
+#endif
+#ifndef EDM_SIM_GAP_UM
+#define EDM_SIM_GAP_UM 15.0f
+#endif
+#ifndef EDM_SIM_UM_PER_PULSE
+#define EDM_SIM_UM_PER_PULSE 0.002f
+#endif
+#ifndef EDM_SIM_DEBRIS_PER_PULSE
+#define EDM_SIM_DEBRIS_PER_PULSE 0.002f
+#endif
+#ifndef EDM_SIM_DEBRIS_MS
+#define EDM_SIM_DEBRIS_MS 100.0f
+#endif
+#ifndef EDM_SIM_SEED
+#define EDM_SIM_SEED 1
+#endif
+
+typedef struct {
+  uint8_t reg[0x10];  // config registers as written (below REG_CKP_N_PULSE)
+  bool placed;        // surface placed
+  float surface_mm;   // machine Z of the work surface
+  float removed_mm;
+  float debris;       // 0~1
+  float temp_c;
+  uint32_t rng;
+  uint32_t last_us;
+  uint32_t pulses;
+  uint32_t shorts;
+} pulser_sim_t;
+
+static pulser_sim_t sim = {.temp_c = 25.0f, .rng = EDM_SIM_SEED};
+
+static float sim_z_mm() {
+  return sys.position[Z_AXIS] / settings.axis[Z_AXIS].steps_per_mm;
+}
+
+static float sim_gap_mm() {
+  float gap = sim_z_mm() - sim.surface_mm;
+  return EDM_SIM_DIR_NEG ? gap : -gap;
+}
+
+// xorshift32, uniform in [0, 1).
+static float sim_rand() {
+  uint32_t x = sim.rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim.rng = x;
+  return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+static void sim_place(float gap_um, uint32_t seed) {
+  float gap_mm = gap_um * 0.001f;
+  sim.surface_mm = sim_z_mm() + (EDM_SIM_DIR_NEG ? -gap_mm : gap_mm);
+  sim.placed = true;
+  sim.removed_mm = 0;
+  sim.debris = 0;
+  sim.pulses = sim.shorts = 0;
+  sim.rng = seed ? seed : 1;
+}
+
+static void sim_write(uint8_t reg_addr, const uint8_t* data, int n) {
+  for (int i = 0; i < n && reg_addr + i < sizeof(sim.reg); i++) {
+    sim.reg[reg_addr + i] = data[i];
+  }
+  if (sim.reg[REG_POLARITY] && !sim.placed) {
+    sim_place(EDM_SIM_GAP0_UM, EDM_SIM_SEED);
+  }
+}
+
+// Fills a REG_CKP_N_PULSE block. Called from the poll timer.
+static void sim_poll(uint8_t* regs) {
+  uint32_t now_us = (uint32_t)hal.get_micros();
+  float dt_us = sim.last_us ? (float)(now_us - sim.last_us) : 0.0f;
+  sim.last_us = now_us;
+  memset(regs, 0, 6);
+
+  float current_a = sim.reg[REG_PULSE_CURRENT] * 0.1f;
+  float heat = 0;
+  if (sim.reg[REG_POLARITY] && sim.placed && dt_us > 0) {
+    float gap_um = sim_gap_mm() * 1000.0f;
+    float duty = sim.reg[REG_MAX_DUTY] * 0.01f;
+    float period_us = sim.reg[REG_PULSE_DUR] * 10.0f / (duty > 0 ? duty : 1);
+    float slots = period_us > 0 ? dt_us / period_us : 0;
+
+    if (gap_um <= 0) {
+      regs[4] = 255;
+      sim.shorts++;
+    } else {
+      float p = expf(-gap_um / EDM_SIM_GAP_UM);
+      float fired = p * (0.75f + 0.5f * sim_rand());
+      fired = fired > 1 ? 1 : fired;
+      float shorted = 0;
+      if (sim_rand() < sim.debris * p) {
+        shorted = 0.5f + 0.5f * sim_rand();  // debris bridge
+        sim.shorts++;
+      }
+      fired *= 1 - shorted;
+      uint32_t n = lroundf(fired * slots);
+      regs[0] = n > 255 ? 255 : n;
+      regs[3] = fired * 255;
+      regs[4] = shorted * 255;
+      regs[5] = (1 - fired - shorted) * 255;
+      sim.pulses += n;
+
+      float removed = n * EDM_SIM_UM_PER_PULSE * 0.001f * current_a;
+      sim.surface_mm += EDM_SIM_DIR_NEG ? -removed : removed;
+      sim.removed_mm += removed;
+      sim.debris += n * EDM_SIM_DEBRIS_PER_PULSE;
+      heat = fired * current_a;
+    }
+  }
+  sim.debris -= sim.debris * dt_us * 0.001f / EDM_SIM_DEBRIS_MS;
+  sim.debris = sim.debris > 1 ? 1 : (sim.debris < 0 ? 0 : sim.debris);
+  // Heats toward 25C + 2C per mean amp, ~10s time constant.
+  sim.temp_c += (25.0f + 2.0f * heat - sim.temp_c) * dt_us * 1e-7f;
+}
+
+static int sim_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",sim=%s(gap=%.1fum,rm=%.3fmm,deb=%.2f,n=%lu/%lu)",
+                  sim.reg[REG_POLARITY] ? "on" : "off",
+                  sim.placed ? sim_gap_mm() * 1000.0f : 0.0f, sim.removed_mm,
+                  sim.debris, sim.pulses, sim.shorts);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_sim(parser_block_t* block) {
+  float gap_um = isnan(block->values.p) ? EDM_SIM_GAP0_UM : block->values.p;
+  uint32_t seed = isnan(block->values.q) ? EDM_SIM_SEED : block->values.q;
+  __disable_irq();
+  sim_place(gap_um, seed);
+  __enable_irq();
+}
+#endif
+
+// PULSER temperature, sampled in the background so that M550 answers from
+// cache without touching the bus. Every unit is read once per
+// EDM_TEMP_POLL_DIV polls (round robin), at low priority so that the read
+// never delays a telemetry poll.
+#ifndef EDM_TEMP_POLL_DIV
+#define EDM_TEMP_POLL_DIV EDM_POLL_RATE_HZ  // ~1s
+#endif
+
+typedef struct {
+  bool done;      // a read has completed
+  bool ok;        // the last read succeeded
+  bool valid;     // temp holds a value
+  uint8_t temp;   // of the last successful read
+  uint32_t t_us;  // hal.get_micros() time of the last successful read
+} temp_cache_t;
+
+static volatile temp_cache_t temp_cache[EDM_PULSER_COUNT];
+static uint8_t temp_buf;
+static i2c_transaction_t temp_tx;
+static volatile bool temp_busy = false;
+static uint32_t temp_tick = 0;
+static uint8_t temp_unit = 0;
+
+// Called from I2C interrupt.
+static void temp_read_complete(bool ok, void* context) {
+  volatile temp_cache_t* c = &temp_cache[(uintptr_t)context];
+  c->done = true;
+  c->ok = ok;
+  if (ok) {
+    c->temp = temp_buf;
+    c->t_us = (uint32_t)hal.get_micros();
+    c->valid = true;
+  }
+  temp_busy = false;
+}
+
+// Called on every poll tick.
+static void temp_sample_tick() {
+  if (++temp_tick < EDM_TEMP_POLL_DIV / EDM_PULSER_COUNT || temp_busy) {
+    return;
+  }
+  temp_tick = 0;
+  temp_busy = true;
+#if EDM_PULSER_SIM
+  temp_buf = sim.temp_c;
+  temp_read_complete(true, (void*)0);
+  return;
+#endif
+  temp_tx.bus = I2C_BusPulser;
+  temp_tx.op = I2C_OpMemRead;
+  temp_tx.priority = I2C_PriorityLow;
+  temp_tx.address = pulser_addr[temp_unit];
+  temp_tx.word_addr = REG_TEMPERATURE;
+  temp_tx.word_addr_bytes = 1;
+  temp_tx.count = 1;
+  temp_tx.data = &temp_buf;
+  temp_tx.callback = temp_read_complete;
+  temp_tx.context = (void*)(uintptr_t)temp_unit;
+  if (!i2c_queue_transaction(&temp_tx)) {
+    temp_busy = false;
+  }
+  temp_unit = (temp_unit + 1) % EDM_PULSER_COUNT;
+}
+
+// "i2c=ok,temp=<C>(<age>ms)" from the cache. The last known temperature is
+// kept after a failed read; "i2c=pend" until the first read completes.
+static int temp_report(int unit, char* buf, size_t len) {
+  __disable_irq();
+  temp_cache_t c = temp_cache[unit];
+  __enable_irq();
+
+  if (!c.done) {
+    return snprintf(buf, len, "i2c=pend");
+  }
+  int ofs = snprintf(buf, len, "i2c=%s", c.ok ? "ok" : "fail");
+  if (c.valid) {
+    ofs += snprintf(buf + ofs, len - ofs, ",temp=%d(%" PRIu32 "ms)", c.temp,
+                    ((uint32_t)hal.get_micros() - c.t_us) / 1000);
+  }
+  return ofs;
+}
+
+#if EDM_PULSER_COUNT > 1
+static void print_units();
+#endif
+// Status fragments of the features defined further down, see M550.
+#if EDM_ORBIT_ENABLE
+static int orbit_report(char* buf, size_t len);
+#endif
+#if EDM_ADAPT_ENABLE
+static int adapt_report(char* buf, size_t len);
+#endif
+#if EDM_ARC_ENABLE
+static int arc_report(char* buf, size_t len);
+#endif
+#if EDM_THERMAL_ENABLE
+static int thermal_report(char* buf, size_t len);
+#endif
+#if EDM_HOLD_CURRENT_ENABLE
+static int hold_report(char* buf, size_t len);
+#endif
+#if EDM_RECIPE_ENABLE
+static int recipe_report(char* buf, size_t len);
+#endif
+#if EDM_RETRACT_PROFILE
+static int retract_profile_report(char* buf, size_t len);
+#endif
+#if EDM_RETRACT_VECTOR
+static int retract_vector_report(char* buf, size_t len);
+#endif
+#if EDM_AUTOTUNE_ENABLE
+static int tune_report(char* buf, size_t len);
+#endif
+#if EDM_SURFACE_MAP_ENABLE
+static int surface_map_report(char* buf, size_t len);
+#endif
+#if EDM_ELECTRODE_ENABLE
+static int electrode_report(char* buf, size_t len);
+#endif
+
+static void exec_mcode_read(int log_mode) {
+  char resp[512];
+  size_t ofs = 0;
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "[EDM|stat=%d,",
+                  edm_init_status);
+  ofs += temp_report(0, resp + ofs, sizeof(resp) - ofs);
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",polls=%" PRIu32 ",perr=%" PRIu32 ",log=%d", edm_poll_cnt,
+                  edm_poll_err_cnt, edm_log.num_valid);
+
+  if (edm_log.streaming) {
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",sdrop=%" PRIu32,
+                    edm_log.stream_drop_cnt);
+  }
+#if EDM_LOG_PERSIST
+  if (persist.file) {
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                    ",pers=%" PRIu32 "/%" PRIu32 "%s", edm_log.persist_pages,
+                    edm_log.persist_drop_cnt,
+                    edm_log.persisting ? "" : "(err)");
+  }
+#endif
+
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",skip=%" PRIu32 ",F(poll)=%dHz%s", edm_poll_skip_cnt,
+                  EDM_POLL_RATE_HZ,
+                  poll_timer ? "" : "(rt)");
+#if EDM_PULSER_CAN
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",can=%ld%s", can_frame_cnt,
+                  can_telemetry ? "" : "(off)");
+#endif
+
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",F(step)=%" PRIu32 "Hz,F(i2c)=%" PRIu32 "kHz",
+                  hal.f_step_timer, i2c_bus_get_speed(I2C_BusPulser) / 1000);
+
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",servo=%s,feed=%d%%",
+                  servo.enabled ? "on" : "off", (int)(servo.feed * 100.0f));
+
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",probe=%d/%d@%d,plat=%" PRIu32 "us(n=%" PRIu32 ")",
+                  probe_filter.n_required, probe_filter.window,
+                  probe_filter.threshold,
+                  probe_filter.trigger_us - probe_filter.contact_us,
+                  probe_filter.latch_cnt);
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                  ",rlat=%" PRIu32 "/%" PRIu32 "us(n=%" PRIu32 ")",
+                  retract_latency.last_us, retract_latency.max_us,
+                  retract_latency.count);
+
+#if EDM_GAP_ADC_ENABLE
+  if (gap_adc_ok) {
+    edm_gap_stats_t gap_stats;
+    edm_gap_adc_get_stats(&gap_stats, false);
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs,
+                    ",gap=%.1fV,gsh=%lu/%lu", edm_gap_adc_voltage(),
+                    gap_stats.shorts, gap_stats.dips);
+  } else {
+    ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",gap=off");
+  }
+#endif
+#if EDM_GATE_BREAK_ENABLE
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",brk=%s(n=%lu/%lu)",
+                  !gate_break.ok ? "off"
+                  : edm_gate_pwm_tripped() ? "tripped" : "armed",
+                  gate_break.trips, gate_break.rearms);
+#endif
+#if EDM_PULSE_CAPTURE_ENABLE
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",pcap=%s",
+                  pulse_capture_ok ? "on" : "off");
+#endif
+#if EDM_SERVO_REF_ENABLE
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, ",sref=%s",
+                  servo_ref_ok ? (edm_servo_ref_is_dac() ? "dac" : "pwm")
+                               : "off");
+#endif
+#if EDM_FLUSH_ENABLE
+  ofs += flush_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_GAP_HOLD_ENABLE
+  ofs += gap_hold_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_ORBIT_ENABLE
+  ofs += orbit_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_ADAPT_ENABLE
+  ofs += adapt_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_ARC_ENABLE
+  ofs += arc_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_CAPTURE_ENABLE
+  ofs += capture_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_THERMAL_ENABLE
+  ofs += thermal_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_HOLD_CURRENT_ENABLE
+  ofs += hold_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_RECIPE_ENABLE
+  ofs += recipe_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_RETRACT_PROFILE
+  ofs += retract_profile_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_RETRACT_VECTOR
+  ofs += retract_vector_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_AUTOTUNE_ENABLE
+  ofs += tune_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_SURFACE_MAP_ENABLE
+  ofs += surface_map_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_ELECTRODE_ENABLE
+  ofs += electrode_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+#if EDM_PULSER_SIM
+  ofs += sim_report(resp + ofs, sizeof(resp) - ofs);
+#endif
+
+  ofs += snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+  hal.stream.write(resp);
+
+  print_stats();
+#if EDM_PULSER_COUNT > 1
+  print_units();
+#endif
+
+  if (!edm_log.active) {
+    if (log_mode == LOG_PRINT_TEXT) {
+      print_log_text();
+    } else if (log_mode == LOG_PRINT_BINARY) {
+      print_log_binary();
+#if DSP_ENABLE
+    } else if (log_mode == LOG_PRINT_SPECTRUM) {
+      print_log_spectrum();
+#endif
+    }
+  }
+}
+
+static void exec_mode_log(bool enable, bool stream, bool persist) {
+  // Entries are added from I2C interrupt, so stop logging before reset.
+  edm_log.active = false;
+  edm_log.streaming = false;
+#if EDM_LOG_PERSIST
+  persist_close();
+#endif
+  if (enable) {
+    log_depth = edm_settings.log_depth;
+    init_log();
+    reset_stats();
+    edm_log.last_flush_ms = hal.get_elapsed_ticks();
+    edm_log.streaming = stream;
+    if (stream) {
+      char resp[80];
+      int ofs = snprintf(resp, sizeof(resp), "[EDMS|start");
+      ofs += rtc_stamp_print(resp + ofs, sizeof(resp) - ofs);
+      snprintf(resp + ofs, sizeof(resp) - ofs, "]" ASCII_EOL);
+      hal.stream.write(resp);
+    }
+#if EDM_LOG_PERSIST
+    if (persist) {
+      if (persist_open()) {
+        edm_log.persisting = true;
+      } else {
+        report_message("EDM: log file open failed", Message_Warning);
+      }
+    }
+#endif
+  }
+  edm_log.active = enable;
+}
+
+// Shadow copy of last written PULSER config registers (REG_POLARITY ~
+// REG_MAX_DUTY), so that write_reg_seq() skips unchanged values.
+// Invalidated on any I2C error, since PULSER may have reset or missed writes.
+// One per PULSER unit.
+#define REG_SHADOW_SIZE 6  // covers register address 0x00 ~ REG_MAX_DUTY
+
+typedef struct {
+  uint8_t val[REG_SHADOW_SIZE];
+  bool valid[REG_SHADOW_SIZE];
+} reg_shadow_t;
+
+static volatile reg_shadow_t reg_shadow[EDM_PULSER_COUNT];
+
+static void invalidate_reg_shadow() {
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    for (int i = 0; i < REG_SHADOW_SIZE; i++) {
+      reg_shadow[u].valid[i] = false;
+    }
+  }
+}
+
+static void update_reg_shadow(int unit,
+                              uint8_t reg_addr,
+                              const uint8_t* vals,
+                              int n) {
+  for (int i = 0; i < n && reg_addr + i < REG_SHADOW_SIZE; i++) {
+    reg_shadow[unit].val[reg_addr + i] = vals[i];
+    reg_shadow[unit].valid[reg_addr + i] = true;
+  }
+}
+
+static bool reg_shadow_matches(int unit, uint8_t reg_addr, uint8_t val) {
+  return reg_addr < REG_SHADOW_SIZE && reg_shadow[unit].valid[reg_addr] &&
+         reg_shadow[unit].val[reg_addr] == val;
+}
+
+// All register writes go through here.
+static bool pulser_write(i2c_transfer_t* tx) {
+#if EDM_PULSER_SIM
+  sim_write(tx->word_addr, tx->data, tx->count);
+  return true;
+#else
+  return i2c_bus_transfer(I2C_BusPulser, tx, false);
+#endif
+}
+
+// blocking I2C register write.
+// returns true if write was successful
+// Writes all units; one failing does not keep the others from being written.
+static bool write_reg(uint8_t reg_addr, uint8_t val) {
+  bool ok = true;
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    uint8_t data = val;
+    i2c_transfer_t tx;
+    tx.address = pulser_addr[u];
+    tx.word_addr = reg_addr;
+    tx.word_addr_bytes = 1;
+    tx.count = 1;
+    tx.data = &data;
+    tx.no_block = false;
+    // Always goes to the bus (used for safety-critical OFF), but keeps shadow
+    // up to date.
+    if (!pulser_write(&tx)) {
+      invalidate_reg_shadow();
+      ok = false;
+      continue;
+    }
+    update_reg_shadow(u, reg_addr, &data, 1);
+  }
+  return ok;
+}
+
+typedef struct {
+  uint8_t reg_addr;
+  uint8_t val;
+} reg_write_t;
+
+#define REG_SEQ_MAX 8
+
+// Write registers in the given order, as one sequence.
+// Registers whose shadow value already matches are skipped.
+// Runs of consecutive addresses are merged into a single burst transaction
+// (PULSER auto-increments register address, same as telemetry reads).
+// Stops at the first failed transaction. Returns true if all writes succeed.
+static bool write_reg_seq_unit(int unit, const reg_write_t* all_seq, int all_n) {
+  reg_write_t seq[REG_SEQ_MAX];
+  int n = 0;
+  for (int k = 0; k < all_n && n < REG_SEQ_MAX; k++) {
+    if (!reg_shadow_matches(unit, all_seq[k].reg_addr, all_seq[k].val)) {
+      seq[n++] = all_seq[k];
+    }
+  }
+
+  uint8_t buf[REG_SEQ_MAX];
+  int i = 0;
+  while (i < n) {
+    int len = 1;
+    buf[0] = seq[i].val;
+    while (i + len < n && len < REG_SEQ_MAX &&
+           seq[i + len].reg_addr == seq[i].reg_addr + len) {
+      buf[len] = seq[i + len].val;
+      len++;
+    }
+
+    i2c_transfer_t tx;
+    tx.address = pulser_addr[unit];
+    tx.word_addr = seq[i].reg_addr;
+    tx.word_addr_bytes = 1;
+    tx.count = len;
+    tx.data = buf;
+    tx.no_block = false;
+    if (!pulser_write(&tx)) {
+      invalidate_reg_shadow();
+      return false;
+    }
+    update_reg_shadow(unit, seq[i].reg_addr, buf, len);
+    i += len;
+  }
+  return true;
+}
+
+// write_reg_seq_unit() on each unit in turn, stops at the first failure.
+static bool write_reg_seq(const reg_write_t* seq, int n) {
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    if (!write_reg_seq_unit(u, seq, n)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if EDM_PULSER_COUNT > 1
+// Gate outputs of the additional units, static enables.
+typedef struct {
+  GPIO_TypeDef* port;
+  uint8_t pin;
+} unit_gate_t;
+
+static const unit_gate_t unit_gate[EDM_PULSER_COUNT - 1] = {
+    {EDM_PULSER1_GATE_PORT, EDM_PULSER1_GATE_PIN},
+#if EDM_PULSER_COUNT > 2
+    {EDM_PULSER2_GATE_PORT, EDM_PULSER2_GATE_PIN},
+#endif
+#if EDM_PULSER_COUNT > 3
+    {EDM_PULSER3_GATE_PORT, EDM_PULSER3_GATE_PIN},
+#endif
+};
+#endif
+
+inline static void init_gate() {
+  GPIO_InitTypeDef init = {
+      .Pin = 1 << PULSER_GATE_PIN,
+      .Speed = GPIO_SPEED_FREQ_MEDIUM,
+      .Mode = GPIO_MODE_OUTPUT_PP,
+      .Pull = GPIO_NOPULL,
+  };
+#if EDM_PULSER_COUNT > 1
+  for (int i = 0; i < EDM_PULSER_COUNT - 1; i++) {
+    init.Pin = 1 << unit_gate[i].pin;
+    HAL_GPIO_Init(unit_gate[i].port, &init);
+  }
+  init.Pin = 1 << PULSER_GATE_PIN;
+#endif
+#if EDM_GATE_PWM_ENABLE
+  // Pulses generated on-MCU; fall back to a static enable without a timer.
+  if ((gate_pwm_ok = edm_gate_pwm_init())) {
+    return;
+  }
+#endif
+  HAL_GPIO_Init(PULSER_GATE_PORT, &init);
+}
+
+// Energized time since boot, for telemetry.
+static uint64_t energized_total_us = 0;
+static uint64_t energized_start_us;
+
+inline static void set_gate(bool on) {
+  if (on && !edm_removal_active) {
+    energized_start_us = hal.get_micros();
+#if WATCHDOG_ENABLE
+    watchdog_arm(wdt_edm, true);
+#endif
+  } else if (!on && edm_removal_active) {
+    energized_total_us += hal.get_micros() - energized_start_us;
+#if WATCHDOG_ENABLE
+    watchdog_arm(wdt_edm, false);
+#endif
+  }
+#if EDM_GATE_PWM_ENABLE
+  if (gate_pwm_ok) {
+    edm_gate_pwm_enable(on);
+  } else
+#endif
+  DIGITAL_OUT(PULSER_GATE_PORT, 1 << PULSER_GATE_PIN, on);
+#if EDM_PULSER_COUNT > 1
+  for (int i = 0; i < EDM_PULSER_COUNT - 1; i++) {
+    DIGITAL_OUT(unit_gate[i].port, 1 << unit_gate[i].pin, on);
+  }
+#endif
+  edm_removal_active = on;
+  if (!on) {
+    servo_reset();
+#if EDM_GATE_BREAK_ENABLE
+    gate_break.resume = false;
+#endif
+  }
+}
+
+// Set by edm_gate_force_off(), the realtime loop then turns the gate off
+// through set_gate() to bring the software state in line.
+static volatile bool gate_forced_off = false;
+
+void edm_gate_force_off(void) {
+#if EDM_GATE_PWM_ENABLE
+  if (gate_pwm_ok) {
+    edm_gate_pwm_enable(false);
+  }
+#endif
+  DIGITAL_OUT(PULSER_GATE_PORT, 1 << PULSER_GATE_PIN, false);
+#if EDM_PULSER_COUNT > 1
+  for (int i = 0; i < EDM_PULSER_COUNT - 1; i++) {
+    DIGITAL_OUT(unit_gate[i].port, 1 << unit_gate[i].pin, false);
+  }
+#endif
+  gate_forced_off = true;
+}
+
+#if EDM_GATE_BREAK_ENABLE
+static inline void signal_short(void);
+
+// Called from the break interrupt. The gate is already off in hardware; this
+// only brings the software state in line and retracts, as for a short.
+static void edm_gate_break() {
+  bool was_on = edm_removal_active;
+  set_gate(false);
+  gate_break.resume = was_on;
+  gate_break.trip_ms = hal.get_elapsed_ticks();
+  gate_break.trips++;
+  signal_short();
+}
+
+// Called from realtime loop. Re-energizes after a break once the input is
+// released, unless de-energized meanwhile or in alarm (e-stop).
+static void gate_break_update(sys_state_t state) {
+  if (!gate_break.resume) {
+    return;
+  }
+  if (state & (STATE_ALARM | STATE_ESTOP)) {
+    gate_break.resume = false;
+    return;
+  }
+  if (hal.get_elapsed_ticks() - gate_break.trip_ms < EDM_GATE_BREAK_REARM_MS ||
+      !edm_gate_pwm_rearm()) {
+    return;
+  }
+  gate_break.rearms++;
+  set_gate(true);
+}
+#endif
+
+#if EDM_FLUSH_ENABLE
+// Lift-and-return flushing cycles, scheduled from the realtime loop. While
+// cutting, a cycle starts when the mean short ratio over a window exceeds the
+// threshold (removal stalled by debris), or when the lift interval has
+// elapsed. Motion is feed held, Z is claimed and lifted by queued step
+// injection with the gate off, then returned by the same number of steps
+// (the last EDM_FLUSH_APPROACH_MM slowly, so the gap servo takes over from a
+// gentle approach) and the program is resumed.
+#ifndef EDM_FLUSH_INTERVAL_S
+#define EDM_FLUSH_INTERVAL_S 0.0f  // 0: no periodic lift
+#endif
+#ifndef EDM_FLUSH_SHORT_PCT
+#define EDM_FLUSH_SHORT_PCT 30.0f  // mean short ratio over a window
+#endif
+#ifndef EDM_FLUSH_LIFT_MM
+#define EDM_FLUSH_LIFT_MM 1.0f
+#endif
+#ifndef EDM_FLUSH_WINDOW_MS
+#define EDM_FLUSH_WINDOW_MS 500
+#endif
+#ifndef EDM_FLUSH_MIN_SPACING_MS
+#define EDM_FLUSH_MIN_SPACING_MS 2000  // between short ratio triggered lifts
+#endif
+#ifndef EDM_FLUSH_RATE
+#define EDM_FLUSH_RATE 2000.0f  // steps/s
+#endif
+#ifndef EDM_FLUSH_APPROACH_MM
+#define EDM_FLUSH_APPROACH_MM 0.05f
+#endif
+#ifndef EDM_FLUSH_APPROACH_RATE
+#define EDM_FLUSH_APPROACH_RATE 200.0f  // steps/s
+#endif
+#ifndef EDM_FLUSH_DIR_POS
+#define EDM_FLUSH_DIR_POS 1  // 1: lift toward Z+
+#endif
+
+#if STEP_INJECT_BURST_QUEUE < 4
+#error "EDM flushing requires STEP_INJECT_BURST_QUEUE >= 4!"
+#endif
+
+typedef enum {
+  FLUSH_IDLE = 0,
+  FLUSH_HOLDING,  // feed hold requested
+  FLUSH_LIFTING,  // lift & return bursts queued
+} flush_phase_t;
+
+typedef struct {
+  bool enabled;
+  float interval_s;
+  float short_pct;
+  float lift_mm;
+  flush_phase_t phase;
+  bool requested;  // by flush_request()
+  bool gate_was_on;
+  uint32_t last_lift_ms;  // or start of cutting
+  uint32_t window_ms;
+  uint32_t lifts;
+  // short ratio window, accumulated from I2C interrupt
+  volatile uint32_t win_samples;
+  volatile uint32_t win_short_sum;
+} flush_t;
+
+static flush_t flush = {
+    .interval_s = EDM_FLUSH_INTERVAL_S,
+    .short_pct = EDM_FLUSH_SHORT_PCT,
+    .lift_mm = EDM_FLUSH_LIFT_MM,
+};
+
+static bool flush_busy() {
+  return flush.phase != FLUSH_IDLE;
+}
+
+// Requests a cycle at the next chance while cutting, regardless of M556 S.
+// Returns false if one is already running.
+static bool flush_request() {
+  if (flush_busy()) {
+    return false;
+  }
+  flush.requested = true;
+  return true;
+}
+
+// Called from I2C interrupt on every poll sample.
+static inline void flush_sample(uint8_t r_short) {
+  flush.win_samples++;
+  flush.win_short_sum += r_short;
+}
+
+// Mean short ratio in % since the last call, starts a new window.
+static float flush_window_take(uint32_t now_ms) {
+  __disable_irq();
+  uint32_t n = flush.win_samples;
+  uint32_t sum = flush.win_short_sum;
+  flush.win_samples = 0;
+  flush.win_short_sum = 0;
+  __enable_irq();
+  flush.window_ms = now_ms;
+  return n > 0 ? sum * 100.0f / (n * 255.0f) : 0;
+}
+
+static bool flush_due(uint32_t now_ms) {
+  bool due = flush.interval_s > 0 && now_ms - flush.last_lift_ms >=
+                                         (uint32_t)(flush.interval_s * 1000);
+
+  if (now_ms - flush.window_ms >= EDM_FLUSH_WINDOW_MS &&
+      flush_window_take(now_ms) > flush.short_pct &&
+      now_ms - flush.last_lift_ms >= EDM_FLUSH_MIN_SPACING_MS) {
+    due = true;
+  }
+  return due;
+}
+
+// Queues lift and return as one sequence; the queue is empty at this point
+// and holds all three bursts, so the sequence is never left half queued.
+static bool flush_lift() {
+  float steps_per_mm = settings.axis[Z_AXIS].steps_per_mm;
+  uint32_t lift = lroundf(flush.lift_mm * steps_per_mm);
+  uint32_t approach = lroundf(EDM_FLUSH_APPROACH_MM * steps_per_mm);
+  if (lift == 0 || hal.stepper.claim_motor == NULL) {
+    return false;
+  }
+  if (approach > lift) {
+    approach = lift;
+  }
+
+  axes_signals_t step = {.z = On};
+  axes_signals_t up = {.z = !EDM_FLUSH_DIR_POS};
+  axes_signals_t down = {.z = EDM_FLUSH_DIR_POS};
+
+  flush.gate_was_on = edm_removal_active;
+  set_gate(false);
+  hal.stepper.claim_motor(Z_AXIS, true);
+  stepperInjectBurst(step, up, lift, EDM_FLUSH_RATE);
+  if (lift > approach) {
+    stepperInjectBurst(step, down, lift - approach, EDM_FLUSH_RATE);
+  }
+  if (approach > 0) {
+    stepperInjectBurst(step, down, approach, EDM_FLUSH_APPROACH_RATE);
+  }
+  return true;
+}
+
+static void flush_resume(uint32_t now_ms, bool cycle_start) {
+  if (hal.stepper.claim_motor) {
+    hal.stepper.claim_motor(Z_AXIS, false);
+  }
+  if (flush.gate_was_on) {
+    set_gate(true);
+  }
+  flush.gate_was_on = false;
+  flush.phase = FLUSH_IDLE;
+  flush.last_lift_ms = now_ms;
+  if (cycle_start) {
+    grbl.enqueue_realtime_command(CMD_CYCLE_START);
+  }
+}
+
+// Called from realtime loop.
+static void flush_update(sys_state_t state) {
+  uint32_t now_ms = hal.get_elapsed_ticks();
+
+  switch (flush.phase) {
+    case FLUSH_IDLE:
+      if ((!flush.enabled && !flush.requested) || state != STATE_CYCLE ||
+          !edm_removal_active) {
+        // Intervals and windows count cutting time only.
+        flush.requested = false;
+        flush.last_lift_ms = now_ms;
+        flush_window_take(now_ms);
+        return;
+      }
+      if (flush.requested || (flush.enabled && flush_due(now_ms))) {
+        flush.requested = false;
+        grbl.enqueue_realtime_command(CMD_FEED_HOLD);
+        flush.phase = FLUSH_HOLDING;
+      }
+      break;
+
+    case FLUSH_HOLDING:
+      if (state != STATE_CYCLE && state != STATE_HOLD) {
+        flush.phase = FLUSH_IDLE;  // aborted or stopped meanwhile
+      } else if (state == STATE_HOLD && sys.holding_state == Hold_Complete &&
+                 !stepperInjectBusy()) {
+        if (flush_lift()) {
+          flush.phase = FLUSH_LIFTING;
+        } else {
+          flush_resume(now_ms, true);
+        }
+      }
+      break;
+
+    case FLUSH_LIFTING:
+      if (!stepperInjectBusy()) {
+        flush.lifts++;
+        // Resume unless the hold was ended or aborted meanwhile.
+        flush_resume(now_ms, state == STATE_HOLD);
+      }
+      break;
+  }
+}
+
+static int flush_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",flush=%s(%.1fs,%.0f%%,%.2fmm,n=%lu)",
+                  flush.enabled ? "on" : "off", flush.interval_s,
+                  flush.short_pct, flush.lift_mm, flush.lifts);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_flush(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    flush.interval_s = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    flush.short_pct = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    flush.lift_mm = block->values.r;
+  }
+  if (!isnan(block->values.s)) {
+    flush.enabled = block->values.s > 0;
+  }
+}
+#endif
+
+#if EDM_GAP_HOLD_ENABLE
+// EDM aware feed hold. A hold entered while cutting (not one of the flushing
+// cycle) turns the gate off on the state change, in the same realtime pass
+// that starts the deceleration. Once the hold is complete Z is claimed and
+// backed off EDM_GAP_HOLD_RETRACT_MM by queued step injection so that debris
+// or a sagging head cannot bridge the gap while held. On resume the gate is
+// turned back on and Z returns by the same number of steps as injection on
+// the shared axis, fast and then the last approach distance slowly. Shared
+// steps only go out while the core moves Z toward the work, so the gap servo
+// probing the approach can stop the return by retracting. Machine position
+// is not updated, the net Z motion is zero.
+#ifndef EDM_GAP_HOLD_RETRACT_MM
+#define EDM_GAP_HOLD_RETRACT_MM 0.05f
+#endif
+#ifndef EDM_GAP_HOLD_APPROACH_MM
+#define EDM_GAP_HOLD_APPROACH_MM 0.02f
+#endif
+#ifndef EDM_GAP_HOLD_RATE
+#define EDM_GAP_HOLD_RATE 2000.0f  // steps/s
+#endif
+#ifndef EDM_GAP_HOLD_APPROACH_RATE
+#define EDM_GAP_HOLD_APPROACH_RATE 200.0f  // steps/s
+#endif
+#ifndef EDM_GAP_HOLD_DIR_POS
+#define EDM_GAP_HOLD_DIR_POS 1  // 1: back off toward Z+
+#endif
+
+typedef enum {
+  GAP_HOLD_IDLE = 0,
+  GAP_HOLD_STOPPING,    // gate off, waiting for the hold to complete
+  GAP_HOLD_RETRACTING,  // back off burst queued, Z claimed
+  GAP_HOLD_HELD,        // backed off, waiting for resume
+  GAP_HOLD_RETURNING,   // return bursts queued on the shared axis
+} gap_hold_phase_t;
+
+static struct {
+  bool enabled;
+  float retract_mm;
+  float approach_mm;
+  gap_hold_phase_t phase;
+  bool gate_was_on;
+  uint32_t steps;  // backed off
+  uint32_t start_ms;
+  uint32_t holds;
+  uint32_t max_ms;  // longest hold to resumed cutting
+} gap_hold = {
+    .enabled = true,
+    .retract_mm = EDM_GAP_HOLD_RETRACT_MM,
+    .approach_mm = EDM_GAP_HOLD_APPROACH_MM,
+};
+
+static on_state_change_ptr other_state_change;
+
+static void gap_hold_state_change(sys_state_t state) {
+  if (state == STATE_HOLD && gap_hold.enabled &&
+#if EDM_FLUSH_ENABLE
+      !flush_busy() &&
+#endif
+      (gap_hold.phase == GAP_HOLD_IDLE ||
+       gap_hold.phase == GAP_HOLD_RETURNING) &&
+      (edm_removal_active || gap_hold.phase == GAP_HOLD_RETURNING)) {
+    // Held again while returning: the remaining return is completed and
+    // backed off again once the hold is complete.
+    gap_hold.gate_was_on |= edm_removal_active;
+    set_gate(false);
+    if (gap_hold.phase == GAP_HOLD_IDLE) {
+      gap_hold.start_ms = hal.get_elapsed_ticks();
+    }
+    gap_hold.phase = GAP_HOLD_STOPPING;
+  }
+  if (other_state_change) {
+    other_state_change(state);
+  }
+}
+
+static bool gap_hold_return() {
+  uint32_t approach =
+      lroundf(gap_hold.approach_mm * settings.axis[Z_AXIS].steps_per_mm);
+  axes_signals_t step = {.z = On};
+  axes_signals_t down = {.z = EDM_GAP_HOLD_DIR_POS};
+
+  if (approach > gap_hold.steps) {
+    approach = gap_hold.steps;
+  }
+  if (gap_hold.steps > approach &&
+      !stepperInjectBurst(step, down, gap_hold.steps - approach,
+                          EDM_GAP_HOLD_RATE)) {
+    return false;
+  }
+  return approach == 0 ||
+         stepperInjectBurst(step, down, approach, EDM_GAP_HOLD_APPROACH_RATE);
+}
+
+// Called from realtime loop.
+static void gap_hold_update(sys_state_t state) {
+  switch (gap_hold.phase) {
+    case GAP_HOLD_IDLE:
+      break;
+
+    case GAP_HOLD_STOPPING:
+      if (state != STATE_HOLD) {
+        // Resumed before the hold completed, or stopped.
+        if (state == STATE_CYCLE && gap_hold.gate_was_on) {
+          set_gate(true);
+        }
+        gap_hold.gate_was_on = false;
+        gap_hold.phase = GAP_HOLD_IDLE;
+      } else if (sys.holding_state == Hold_Complete && !stepperInjectBusy()) {
+        axes_signals_t step = {.z = On};
+        axes_signals_t up = {.z = !EDM_GAP_HOLD_DIR_POS};
+        gap_hold.steps =
+            lroundf(gap_hold.retract_mm * settings.axis[Z_AXIS].steps_per_mm);
+        hal.stepper.claim_motor(Z_AXIS, true);
+        if (gap_hold.steps &&
+            stepperInjectBurst(step, up, gap_hold.steps, EDM_GAP_HOLD_RATE)) {
+          gap_hold.phase = GAP_HOLD_RETRACTING;
+        } else {
+          hal.stepper.claim_motor(Z_AXIS, false);
+          gap_hold.steps = 0;
+          gap_hold.phase = GAP_HOLD_HELD;
+        }
+      }
+      break;
+
+    case GAP_HOLD_RETRACTING:
+      if (!stepperInjectBusy()) {
+        hal.stepper.claim_motor(Z_AXIS, false);
+        gap_hold.phase = GAP_HOLD_HELD;
+      }
+      break;
+
+    case GAP_HOLD_HELD:
+      if (state == STATE_CYCLE) {
+        if (gap_hold.gate_was_on) {
+          set_gate(true);
+        }
+        gap_hold.gate_was_on = false;
+        if (gap_hold.steps && !gap_hold_return()) {
+          stepperInjectAbort();
+          report_message("EDM: gap hold return failed, Z off by the back off",
+                         Message_Warning);
+        }
+        gap_hold.phase = GAP_HOLD_RETURNING;
+      } else if (state != STATE_HOLD) {
+        // Stopped while backed off, the machine position does not know.
+        report_message("EDM: hold ended with Z backed off", Message_Warning);
+        gap_hold.gate_was_on = false;
+        gap_hold.phase = GAP_HOLD_IDLE;
+      }
+      break;
+
+    case GAP_HOLD_RETURNING:
+      if (!stepperInjectBusy()) {
+        uint32_t ms = hal.get_elapsed_ticks() - gap_hold.start_ms;
+        if (ms > gap_hold.max_ms) {
+          gap_hold.max_ms = ms;
+        }
+        gap_hold.holds++;
+        gap_hold.phase = GAP_HOLD_IDLE;
+      }
+      break;
+  }
+}
+
+static int gap_hold_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",ghold=%s(%.3fmm,%.3fmm,n=%lu,max=%lums)",
+                  gap_hold.enabled ? "on" : "off", gap_hold.retract_mm,
+                  gap_hold.approach_mm, gap_hold.holds, gap_hold.max_ms);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_gap_hold(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    gap_hold.retract_mm = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    gap_hold.approach_mm = block->values.q;
+  }
+  if (!isnan(block->values.s)) {
+    gap_hold.enabled = block->values.s > 0;
+  }
+}
+#endif
+
+#if EDM_ARC_ENABLE
+static bool arc_cut_active();
+#endif
+
+#if EDM_ADAPT_ENABLE
+// Adaptive pulse duty, an outer loop around the gap servo run from the
+// realtime loop. The servo keeps the gap by feed within tens of ms; this one
+// works on windows of hundreds of ms and trades duty (removal rate) for
+// stability: shorts piling up despite the servo mean debris or arcing, which
+// a longer off-time clears. PULSER has no off-time register, for the on-time
+// of M503/M504 P the max duty sets it: off = on * (100 / duty - 1).
+#ifndef EDM_ADAPT_WINDOW_MS
+#define EDM_ADAPT_WINDOW_MS 250
+#endif
+#ifndef EDM_ADAPT_SHORT_PCT
+#define EDM_ADAPT_SHORT_PCT 20.0f  // lower duty above this mean short ratio
+#endif
+#ifndef EDM_ADAPT_OPEN_PCT
+#define EDM_ADAPT_OPEN_PCT 80.0f  // no raise above this open ratio
+#endif
+#ifndef EDM_ADAPT_DUTY_MIN
+#define EDM_ADAPT_DUTY_MIN 5
+#endif
+#ifndef EDM_ADAPT_DUTY_MAX
+#define EDM_ADAPT_DUTY_MAX 50
+#endif
+#ifndef EDM_ADAPT_STEP_DOWN
+#define EDM_ADAPT_STEP_DOWN 3  // duty % per window
+#endif
+#ifndef EDM_ADAPT_STEP_UP
+#define EDM_ADAPT_STEP_UP 1
+#endif
+#ifndef EDM_ADAPT_MIN_WRITE_MS
+#define EDM_ADAPT_MIN_WRITE_MS 500
+#endif
+
+typedef struct {
+  bool enabled;
+  uint8_t duty_min;
+  uint8_t duty_max;
+  float short_pct;
+  bool active;          // started by M503/M504
+  uint8_t duty;         // target
+  uint8_t duty_written; // last written to PULSER
+  int pulse_dur_10us;
+  uint32_t window_ms;
+  uint32_t write_ms;
+  uint32_t downs;
+  uint32_t ups;
+  uint32_t writes;
+  uint32_t write_errs;
+  // ratio window, accumulated from I2C interrupt
+  volatile uint32_t win_samples;
+  volatile uint32_t win_open_sum;
+  volatile uint32_t win_short_sum;
+} adapt_t;
+
+static adapt_t adapt = {
+    .duty_min = EDM_ADAPT_DUTY_MIN,
+    .duty_max = EDM_ADAPT_DUTY_MAX,
+    .short_pct = EDM_ADAPT_SHORT_PCT,
+};
+
+// Called from I2C interrupt on every poll sample.
+static inline void adapt_sample(uint8_t r_open, uint8_t r_short) {
+  adapt.win_samples++;
+  adapt.win_open_sum += r_open;
+  adapt.win_short_sum += r_short;
+}
+
+// Mean open and short ratios in % since the last call, starts a new window.
+// Returns false if there were no samples.
+static bool adapt_window_take(uint32_t now_ms, float* open, float* shorts) {
+  __disable_irq();
+  uint32_t n = adapt.win_samples;
+  uint32_t open_sum = adapt.win_open_sum;
+  uint32_t short_sum = adapt.win_short_sum;
+  adapt.win_samples = 0;
+  adapt.win_open_sum = 0;
+  adapt.win_short_sum = 0;
+  __enable_irq();
+  adapt.window_ms = now_ms;
+  if (n == 0) {
+    return false;
+  }
+  *open = open_sum * 100.0f / (n * 255.0f);
+  *shorts = short_sum * 100.0f / (n * 255.0f);
+  return true;
+}
+
+// Called by exec_mcode_start() after the registers are written.
+static void adapt_start(int pulse_dur_10us, int pulse_duty_pct) {
+  adapt.active = true;
+  adapt.pulse_dur_10us = pulse_dur_10us;
+  adapt.duty = adapt.duty_written = pulse_duty_pct;
+  adapt.window_ms = adapt.write_ms = hal.get_elapsed_ticks();
+}
+
+// Called from realtime loop.
+static void adapt_update(sys_state_t state) {
+  uint32_t now_ms = hal.get_elapsed_ticks();
+  float open, shorts;
+
+  if (!adapt.enabled || !adapt.active || !edm_removal_active ||
+      state != STATE_CYCLE) {
+    // Windows count cutting time only.
+    adapt_window_take(now_ms, &open, &shorts);
+    return;
+  }
+
+  if (now_ms - adapt.window_ms >= EDM_ADAPT_WINDOW_MS &&
+      adapt_window_take(now_ms, &open, &shorts)) {
+    int duty = adapt.duty;
+    if (shorts > adapt.short_pct) {
+      duty -= EDM_ADAPT_STEP_DOWN;
+    } else if (shorts < adapt.short_pct * 0.25f && open < EDM_ADAPT_OPEN_PCT) {
+      duty += EDM_ADAPT_STEP_UP;
+    }
+    duty = duty < adapt.duty_min
+               ? adapt.duty_min
+               : (duty > adapt.duty_max ? adapt.duty_max : duty);
+    if (duty < adapt.duty) {
+      adapt.downs++;
+    } else if (duty > adapt.duty) {
+      adapt.ups++;
+    }
+    adapt.duty = duty;
+  }
+
+#if EDM_ARC_ENABLE
+  if (arc_cut_active()) {
+    return;  // restored by arc_update() to the latest target
+  }
+#endif
+  // Rate limited, the latest target is written.
+  if (adapt.duty != adapt.duty_written &&
+      now_ms - adapt.write_ms >= EDM_ADAPT_MIN_WRITE_MS) {
+    const reg_write_t seq[] = {{REG_MAX_DUTY, adapt.duty}};
+    adapt.write_ms = now_ms;
+    if (write_reg_seq(seq, 1)) {
+      adapt.duty_written = adapt.duty;
+      adapt.writes++;
+    } else {
+      adapt.write_errs++;  // retried after the interval
+    }
+  }
+}
+
+static int adapt_report(char* buf, size_t len) {
+  int duty = adapt.active ? adapt.duty_written : 0;
+  return snprintf(buf, len,
+                  ",adapt=%s(%d%%,off=%dus,%d~%d%%,%.0f%%,-%lu/+%lu,w=%lu/%lu)",
+                  adapt.enabled ? "on" : "off", duty,
+                  duty ? adapt.pulse_dur_10us * 10 * (100 - duty) / duty : 0,
+                  adapt.duty_min, adapt.duty_max, adapt.short_pct, adapt.downs,
+                  adapt.ups, adapt.writes, adapt.write_errs);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_adapt(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    adapt.duty_min = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    adapt.duty_max = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    adapt.short_pct = block->values.r;
+  }
+  if (!isnan(block->values.s)) {
+    adapt.enabled = block->values.s > 0;
+  }
+  // New bounds apply to the current target right away, written by the loop.
+  if (adapt.active) {
+    adapt.duty = adapt.duty < adapt.duty_min
+                     ? adapt.duty_min
+                     : (adapt.duty > adapt.duty_max ? adapt.duty_max
+                                                    : adapt.duty);
+  }
+}
+#endif
+
+#if EDM_ARC_ENABLE
+// Arc detection. An arc is a discharge that keeps burning at one spot: the
+// gap conducts at low voltage from the start of every pulse, without the
+// ignition delay of a normal discharge and without reaching the short level.
+// The telemetry shows it as a gap pulsing almost all the time and hardly ever
+// open; pulse capture (ignition delay) and the gap ADC (gap voltage) confirm
+// it when running. EDM_ARC_SAMPLES consecutive arcing samples make an arc.
+//
+// Responses are graduated by how persistent arcing is:
+// 1. On an arc the off-time is lengthened by cutting the max duty to
+//    EDM_ARC_DUTY_PCT of the programmed one, from the realtime loop. It is
+//    restored after EDM_ARC_HOLD_MS without arcing.
+// 2. While arcing goes on, retract is requested every EDM_ARC_RETRACT_SAMPLES
+//    samples from the sample interrupt, the same way as a short.
+// 3. If EDM_ARC_FLUSH_EVENTS arcs happen within EDM_ARC_FLUSH_WINDOW_MS, a
+//    flushing cycle is requested (EDM_FLUSH_ENABLE).
+#ifndef EDM_ARC_SAMPLES
+#define EDM_ARC_SAMPLES 3
+#endif
+#ifndef EDM_ARC_PULSE_PCT
+#define EDM_ARC_PULSE_PCT 60  // min r_pulse of an arcing sample
+#endif
+#ifndef EDM_ARC_OPEN_PCT
+#define EDM_ARC_OPEN_PCT 5  // max r_open of an arcing sample
+#endif
+#ifndef EDM_ARC_DELAY_NS
+#define EDM_ARC_DELAY_NS 2000  // max mean ignition delay (pulse capture)
+#endif
+#ifndef EDM_ARC_GAP_V
+#define EDM_ARC_GAP_V 18.0f  // max mean gap voltage (gap ADC)
+#endif
+#ifndef EDM_ARC_DUTY_PCT
+#define EDM_ARC_DUTY_PCT 50
+#endif
+#ifndef EDM_ARC_HOLD_MS
+#define EDM_ARC_HOLD_MS 200
+#endif
+#ifndef EDM_ARC_RETRACT_SAMPLES
+#define EDM_ARC_RETRACT_SAMPLES 20
+#endif
+#ifndef EDM_ARC_FLUSH_EVENTS
+#define EDM_ARC_FLUSH_EVENTS 5
+#endif
+#ifndef EDM_ARC_FLUSH_WINDOW_MS
+#define EDM_ARC_FLUSH_WINDOW_MS 2000
+#endif
+
+typedef struct {
+  bool enabled;
+  uint8_t samples;
+  uint8_t open_max;  // r_open
+  bool active;       // started by M503/M504
+  uint8_t duty;      // of M503/M504
+  bool cut;          // duty cut written
+  uint32_t events_seen;
+  uint32_t cuts;
+  uint32_t flushes;
+  uint32_t flush_window_ms;
+  uint32_t flush_window_events;
+  uint32_t write_errs;
+  // Classifier, written from I2C interrupt.
+  volatile uint32_t run;  // consecutive arcing samples
+  volatile uint32_t events;
+  volatile uint32_t retracts;
+  volatile uint32_t last_arc_ms;
+} arc_t;
+
+static arc_t arc = {
+    .samples = EDM_ARC_SAMPLES,
+    .open_max = EDM_ARC_OPEN_PCT * 255 / 100,
+};
+
+static inline void signal_short(void);
+
+static bool arc_cut_active() {
+  return arc.cut;
+}
+
+// Called from I2C interrupt on every poll sample.
+static inline void arc_sample(uint8_t r_pulse, uint8_t r_short, uint8_t r_open) {
+  bool arcing = arc.enabled && edm_removal_active && r_short <= 127 &&
+                r_pulse >= EDM_ARC_PULSE_PCT * 255 / 100 &&
+                r_open <= arc.open_max;
+#if EDM_PULSE_CAPTURE_ENABLE
+  if (arcing && pulse_capture_ok && pulse_delay_ns != UINT32_MAX) {
+    arcing = pulse_delay_ns < EDM_ARC_DELAY_NS;
+  }
+#endif
+#if EDM_GAP_ADC_ENABLE
+  if (arcing && gap_adc_ok) {
+    arcing = edm_gap_adc_voltage() < EDM_ARC_GAP_V;
+  }
+#endif
+  if (!arcing) {
+    arc.run = 0;
+    return;
+  }
+  arc.last_arc_ms = hal.get_elapsed_ticks();
+  uint32_t run = ++arc.run;
+  if (run == arc.samples) {
+    arc.events++;
+#if EDM_CAPTURE_ENABLE
+    capture_trigger(CAP_TRIG_ARC);
+#endif
+  } else if (run == arc.samples + EDM_ARC_RETRACT_SAMPLES) {
+    arc.retracts++;
+    arc.run = arc.samples;  // again if arcing goes on
+    signal_short();
+  }
+}
+
+// Duty to restore, the adaptive duty target while that runs.
+static uint8_t arc_base_duty() {
+#if EDM_ADAPT_ENABLE
+  if (adapt.enabled && adapt.active) {
+    return adapt.duty;
+  }
+#endif
+  return arc.duty;
+}
+
+static void arc_write_duty(uint8_t duty) {
+  const reg_write_t seq[] = {{REG_MAX_DUTY, duty}};
+  if (!write_reg_seq(seq, 1)) {
+    arc.write_errs++;
+  }
+}
+
+// Called by exec_mcode_start() after the registers are written.
+static void arc_start(int pulse_duty_pct) {
+  arc.active = true;
+  arc.duty = pulse_duty_pct;
+  arc.cut = false;
+  arc.run = 0;
+  arc.events_seen = arc.events;
+  arc.flush_window_events = 0;
+}
+
+// Called from realtime loop.
+static void arc_update(sys_state_t state) {
+  if (!arc.active || !edm_removal_active) {
+    return;
+  }
+  uint32_t now_ms = hal.get_elapsed_ticks();
+  uint32_t events = arc.events;
+
+  if (events != arc.events_seen) {
+    uint32_t n = events - arc.events_seen;
+    arc.events_seen = events;
+    if (!arc.cut) {
+      uint32_t duty = arc_base_duty() * EDM_ARC_DUTY_PCT / 100;
+      arc_write_duty(duty > 0 ? duty : 1);
+      arc.cut = true;
+      arc.cuts++;
+    }
+#if EDM_FLUSH_ENABLE
+    if (now_ms - arc.flush_window_ms > EDM_ARC_FLUSH_WINDOW_MS) {
+      arc.flush_window_ms = now_ms;
+      arc.flush_window_events = 0;
+    }
+    arc.flush_window_events += n;
+    if (arc.flush_window_events >= EDM_ARC_FLUSH_EVENTS &&
+        state == STATE_CYCLE && flush_request()) {
+      arc.flush_window_events = 0;
+      arc.flushes++;
+    }
+#else
+    (void)n;
+#endif
+  } else if (arc.cut && now_ms - arc.last_arc_ms >= EDM_ARC_HOLD_MS) {
+    uint8_t duty = arc_base_duty();
+    arc_write_duty(duty);
+    arc.cut = false;
+#if EDM_ADAPT_ENABLE
+    adapt.duty_written = duty;
+#endif
+  }
+}
+
+static int arc_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",arc=%s(%d@%d%%,n=%lu,cut=%lu,ret=%lu,fl=%lu%s)",
+                  arc.enabled ? "on" : "off", arc.samples,
+                  arc.open_max * 100 / 255, arc.events, arc.cuts,
+                  arc.retracts, arc.flushes, arc.write_errs ? ",werr" : "");
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_arc(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    arc.samples = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    arc.open_max = block->values.q * 255 / 100;
+  }
+  if (!isnan(block->values.s)) {
+    arc.enabled = block->values.s > 0;
+  }
+  arc.run = 0;
+}
+#endif
+
+#if EDM_THERMAL_ENABLE
+// Thermal derating from the background PULSER temperature (hottest unit).
+// Instead of cutting out at a limit, the pulse current is lowered linearly
+// from the programmed one at derate_c down to min_pct of it at full_c, one
+// step (100mA) per EDM_THERMAL_PERIOD_MS so the gap servo sees a gradual
+// change, and raised back the same way as PULSER cools down. Duty is left to
+// the adaptive and arc loops. An optional PWM fan output (EDM_FAN_AUX_OUTPUT,
+// analog aux port) ramps from EDM_THERMAL_FAN_MIN_PCT at EDM_THERMAL_FAN_C to
+// full speed at derate_c.
+#ifndef EDM_THERMAL_DERATE_C
+#define EDM_THERMAL_DERATE_C 60
+#endif
+#ifndef EDM_THERMAL_FULL_C
+#define EDM_THERMAL_FULL_C 75
+#endif
+#ifndef EDM_THERMAL_MIN_PCT
+#define EDM_THERMAL_MIN_PCT 40
+#endif
+#ifndef EDM_THERMAL_PERIOD_MS
+#define EDM_THERMAL_PERIOD_MS 500
+#endif
+#ifndef EDM_THERMAL_FAN_C
+#define EDM_THERMAL_FAN_C 40
+#endif
+#ifndef EDM_THERMAL_FAN_MIN_PCT
+#define EDM_THERMAL_FAN_MIN_PCT 30
+#endif
+
+// Optional: analog (PWM) aux output driving the PULSER fan.
+// #define EDM_FAN_AUX_OUTPUT 0
+
+typedef struct {
+  bool enabled;
+  uint8_t derate_c;
+  uint8_t full_c;
+  uint8_t min_pct;
+  bool active;             // started by M503/M504
+  int pulse_dur_10us;      // of M503/M504
+  int current_100ma;       // of M503/M504
+  int current_written;     // last written to PULSER
+  int temp_c;              // hottest unit, -1: unknown
+  uint8_t fan_pct;
+  uint32_t update_ms;
+  uint32_t derates;        // steps down
+  uint32_t write_errs;
+} thermal_t;
+
+static thermal_t thermal = {
+    .enabled = true,
+    .derate_c = EDM_THERMAL_DERATE_C,
+    .full_c = EDM_THERMAL_FULL_C,
+    .min_pct = EDM_THERMAL_MIN_PCT,
+    .temp_c = -1,
+};
+
+#ifdef EDM_FAN_AUX_OUTPUT
+static uint8_t fan_port = EDM_FAN_AUX_OUTPUT;
+static bool fan_ok = false;
+#endif
+
+// Hottest unit of the cache, -1 if none was read yet.
+static int thermal_max_temp() {
+  int max = -1;
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    if (temp_cache[u].valid && temp_cache[u].temp > max) {
+      max = temp_cache[u].temp;
+    }
+  }
+  return max;
+}
+
+// Current for temp_c, in 100mA units.
+static int thermal_target(int temp_c) {
+  int cur = thermal.current_100ma;
+  if (!thermal.enabled || temp_c <= thermal.derate_c) {
+    return cur;
+  }
+  int pct = thermal.min_pct;
+  if (temp_c < thermal.full_c) {
+    pct = 100 - (100 - thermal.min_pct) * (temp_c - thermal.derate_c) /
+                    (thermal.full_c - thermal.derate_c);
+  }
+  cur = cur * pct / 100;
+  return cur > 0 ? cur : 1;
+}
+
+// Called by exec_mcode_start() after the registers are written.
+static void thermal_start(int pulse_dur_10us, int pulse_current_100ma) {
+  thermal.active = true;
+  thermal.pulse_dur_10us = pulse_dur_10us;
+  thermal.current_100ma = thermal.current_written = pulse_current_100ma;
+  thermal.update_ms = hal.get_elapsed_ticks() - EDM_THERMAL_PERIOD_MS;
+}
+
+// Called from realtime loop.
+static void thermal_update(sys_state_t state) {
+  uint32_t now_ms = hal.get_elapsed_ticks();
+  if (now_ms - thermal.update_ms < EDM_THERMAL_PERIOD_MS) {
+    return;
+  }
+  thermal.update_ms = now_ms;
+  int temp_c = thermal.temp_c = thermal_max_temp();
+  if (temp_c < 0) {
+    return;
+  }
+
+#ifdef EDM_FAN_AUX_OUTPUT
+  if (fan_ok) {
+    int pct = 0;
+    if (temp_c >= thermal.derate_c) {
+      pct = 100;
+    } else if (temp_c >= EDM_THERMAL_FAN_C) {
+      pct = EDM_THERMAL_FAN_MIN_PCT +
+            (100 - EDM_THERMAL_FAN_MIN_PCT) * (temp_c - EDM_THERMAL_FAN_C) /
+                (thermal.derate_c - EDM_THERMAL_FAN_C);
+    }
+    if (pct != thermal.fan_pct) {
+      thermal.fan_pct = pct;
+      hal.port.analog_out(fan_port, (float)pct);
+    }
+  }
+#endif
+
+  if (!thermal.active) {
+    return;
+  }
+  int target = thermal_target(temp_c);
+  if (target == thermal.current_written) {
+    return;
+  }
+  int cur = target < thermal.current_written ? thermal.current_written - 1
+                                             : thermal.current_written + 1;
+  const reg_write_t seq[] = {{REG_PULSE_CURRENT, cur}};
+  if (!write_reg_seq(seq, 1)) {
+    thermal.write_errs++;  // retried next period
+    return;
+  }
+  if (cur < thermal.current_written) {
+    thermal.derates++;
+  }
+  thermal.current_written = cur;
+  wear.pulse_uc = cur * thermal.pulse_dur_10us;
+}
+
+static int thermal_report(char* buf, size_t len) {
+  int pct = thermal.active && thermal.current_100ma
+                ? thermal.current_written * 100 / thermal.current_100ma
+                : 100;
+  return snprintf(buf, len, ",therm=%s(%dC,I=%d%%,fan=%d%%,%d~%dC>=%d%%,-%lu%s)",
+                  thermal.enabled ? "on" : "off", thermal.temp_c, pct,
+                  thermal.fan_pct, thermal.derate_c, thermal.full_c,
+                  thermal.min_pct, thermal.derates,
+                  thermal.write_errs ? ",werr" : "");
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_thermal(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    thermal.derate_c = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    thermal.full_c = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    thermal.min_pct = block->values.r;
+  }
+  if (!isnan(block->values.s)) {
+    thermal.enabled = block->values.s > 0;
+  }
+  if (thermal.full_c <= thermal.derate_c) {
+    thermal.full_c = thermal.derate_c + 1;
+  }
+}
+#endif
+
+#if EDM_RETRACT_PROFILE
+#ifndef EDM_RETRACT_RATE
+#define EDM_RETRACT_RATE 300.0f  // mm/min
+#endif
+#ifndef EDM_RETRACT_ACCEL
+#define EDM_RETRACT_ACCEL 50.0f  // mm/s^2
+#endif
+#ifndef EDM_RETRACT_START
+#define EDM_RETRACT_START 30.0f  // mm/min
+#endif
+
+// Read by the step generator (driver.c) on every reversal and ramp step.
+volatile edm_retract_profile_t edm_retract_profile = {0};
+
+static struct {
+  bool enabled;
+  float rate_mm_min;
+  float accel_mm_s2;
+  float start_mm_min;
+} rprof = {
+    .rate_mm_min = EDM_RETRACT_RATE,
+    .accel_mm_s2 = EDM_RETRACT_ACCEL,
+    .start_mm_min = EDM_RETRACT_START,
+};
+
+// Converts to steps/s. Disabled while updated so that a ramp starting
+// meanwhile does not pick up half of the new values.
+static void retract_profile_apply() {
+  float steps_mm = settings.axis[Z_AXIS].steps_per_mm;
+  edm_retract_profile.enabled = false;
+  __DSB();
+  edm_retract_profile.v_start = max(1.0f, rprof.start_mm_min * steps_mm / 60.0f);
+  edm_retract_profile.v_retract = rprof.rate_mm_min * steps_mm / 60.0f;
+  edm_retract_profile.accel2 = 2.0f * rprof.accel_mm_s2 * steps_mm;
+#if STEP_PERIOD_DMA
+  edm_retract_profile_changed();
+#endif
+  __DSB();
+  edm_retract_profile.enabled = rprof.enabled;
+}
+
+static int retract_profile_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",rprof=%s(%.0f/%.0f/%.0f)",
+                  rprof.enabled ? "on" : "off", rprof.rate_mm_min,
+                  rprof.accel_mm_s2, rprof.start_mm_min);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_retract(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    rprof.rate_mm_min = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    rprof.accel_mm_s2 = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    rprof.start_mm_min = block->values.r;
+  }
+  if (!isnan(block->values.s)) {
+    rprof.enabled = block->values.s > 0;
+  }
+  if (rprof.start_mm_min > rprof.rate_mm_min) {
+    rprof.start_mm_min = rprof.rate_mm_min;
+  }
+  retract_profile_apply();
+}
+#endif
+
+#if EDM_RETRACT_VECTOR
+// Read by the step generator (driver.c) on every retract step tick.
+volatile edm_retract_vector_t edm_retract_vector = {0};
+
+static struct {
+  bool enabled;
+  float v[3];
+} rvec = {
+    .v = {0.0f, 0.0f, 1.0f},
+};
+
+// Scales the vector to steps, the dominant axis at 65536 per tick. Disabled
+// while updated so that a retract tick meanwhile does not mix old and new.
+static void retract_vector_apply() {
+  float s[3], m = 0.0f;
+  for (uint_fast8_t i = 0; i < 3; i++) {
+    s[i] = rvec.v[i] * settings.axis[i].steps_per_mm;
+    m = max(m, fabsf(s[i]));
+  }
+  edm_retract_vector.enabled = false;
+  __DSB();
+  edm_retract_vector.dir = 0;
+  for (uint_fast8_t i = 0; i < 3; i++) {
+    edm_retract_vector.rate_q16[i] =
+        m > 0.0f ? (uint32_t)lroundf(fabsf(s[i]) / m * 65536.0f) : 0;
+    if (s[i] < 0.0f) {
+      edm_retract_vector.dir |= 1 << i;
+    }
+  }
+  __DSB();
+  edm_retract_vector.enabled = rvec.enabled && m > 0.0f;
+}
+
+static int retract_vector_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",rvec=%s(%.3f/%.3f/%.3f),rvoff=%ld/%ld/%ld",
+                  edm_retract_vector.enabled ? "on" : "off", rvec.v[0],
+                  rvec.v[1], rvec.v[2], (long)edm_retract_excursion[X_AXIS],
+                  (long)edm_retract_excursion[Y_AXIS],
+                  (long)edm_retract_excursion[Z_AXIS]);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_retract_vector(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    rvec.v[X_AXIS] = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    rvec.v[Y_AXIS] = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    rvec.v[Z_AXIS] = block->values.r;
+  }
+  if (!isnan(block->values.s)) {
+    rvec.enabled = block->values.s > 0;
+  }
+  retract_vector_apply();
+}
+#endif
+
+#if EDM_ORBIT_ENABLE
+// Orbital motion generator. A claimed hal.timer ticks at EDM_ORBIT_TICK_US,
+// advances the orbit phase and steps the claimed X and Y motors one step
+// toward the orbit point, so the orbit costs no planner blocks or stream
+// bandwidth. The offset is tracked in steps and the orbit ends at the center,
+// machine position is not updated.
+#ifndef EDM_ORBIT_TICK_US
+#define EDM_ORBIT_TICK_US 50
+#endif
+#ifndef EDM_ORBIT_RAMP_REVS
+#define EDM_ORBIT_RAMP_REVS 2  // spiral in/out, revolutions
+#endif
+#ifndef EDM_ORBIT_RADIUS_MM
+#define EDM_ORBIT_RADIUS_MM 0.1f
+#endif
+#ifndef EDM_ORBIT_PERIOD_S
+#define EDM_ORBIT_PERIOD_S 1.0f
+#endif
+
+typedef enum {
+  ORBIT_OFF = 0,
+  ORBIT_CIRCLE,
+  ORBIT_SQUARE,
+} orbit_shape_t;
+
+typedef struct {
+  orbit_shape_t shape;
+  float radius_mm;
+  float period_s;  // effective, after the step rate limit
+  hal_timer_t timer;
+  bool claimed;
+  uint32_t revs_started;
+  // Generator state, written by the tick while running.
+  volatile bool running;
+  orbit_shape_t tick_shape;
+  uint32_t phase;  // 2^32 per revolution
+  uint32_t phase_inc;
+  float r;  // current radius
+  float r_target;
+  float r_step;  // per tick
+  float steps_per_mm[2];
+  int32_t pos[2];  // X, Y offset in steps
+} orbit_t;
+
+static orbit_t orbit = {
+    .radius_mm = EDM_ORBIT_RADIUS_MM,
+    .period_s = EDM_ORBIT_PERIOD_S,
+};
+
+// Orbit point at phase for radius r, in mm.
+static inline void orbit_point(orbit_shape_t shape,
+                               uint32_t phase,
+                               float r,
+                               float* x,
+                               float* y) {
+  if (shape == ORBIT_SQUARE) {
+    // Four sides from the corner at (r, -r), counter-clockwise.
+    float u = (phase & 0x3FFFFFFF) * (2.0f / 1073741824.0f) - 1.0f;
+    switch (phase >> 30) {
+      case 0:
+        *x = r, *y = u * r;
+        break;
+      case 1:
+        *x = -u * r, *y = r;
+        break;
+      case 2:
+        *x = -r, *y = -u * r;
+        break;
+      default:
+        *x = u * r, *y = -r;
+        break;
+    }
+  } else {
+    float a = phase * (6.2831853f / 4294967296.0f);
+    *x = r * cosf(a);
+    *y = r * sinf(a);
+  }
+}
+
+// Called from the orbit timer interrupt.
+static void orbit_tick(void* context) {
+  uint32_t prev = orbit.phase;
+  orbit.phase += orbit.phase_inc;
+  if (orbit.phase < prev) {
+    orbit.revs_started++;
+  }
+
+  if (orbit.r < orbit.r_target) {
+    orbit.r = fminf(orbit.r + orbit.r_step, orbit.r_target);
+  } else if (orbit.r > orbit.r_target) {
+    orbit.r = fmaxf(orbit.r - orbit.r_step, orbit.r_target);
+  }
+
+  float x, y;
+  orbit_point(orbit.tick_shape, orbit.phase, orbit.r, &x, &y);
+  int32_t dx = lroundf(x * orbit.steps_per_mm[0]) - orbit.pos[0];
+  int32_t dy = lroundf(y * orbit.steps_per_mm[1]) - orbit.pos[1];
+
+  if (dx == 0 && dy == 0) {
+    if (orbit.r == 0.0f && orbit.r_target == 0.0f) {
+      hal.timer.stop(orbit.timer);
+      orbit.running = false;
+    }
+    return;
+  }
+
+  // One step per axis per tick, the offset catches up on the next ticks.
+  axes_signals_t step = {.x = dx != 0, .y = dy != 0};
+  axes_signals_t dir = {.x = dx < 0, .y = dy < 0};
+  if (stepperInjectStep(step, dir)) {
+    orbit.pos[0] += dx > 0 ? 1 : (dx < 0 ? -1 : 0);
+    orbit.pos[1] += dy > 0 ? 1 : (dy < 0 ? -1 : 0);
+  }
+}
+
+static void orbit_release() {
+  if (orbit.claimed) {
+    hal.stepper.claim_motor(X_AXIS, false);
+    hal.stepper.claim_motor(Y_AXIS, false);
+    orbit.claimed = false;
+  }
+}
+
+// Stops the generator where it is, for reset.
+static void orbit_abort() {
+  if (orbit.running) {
+    hal.timer.stop(orbit.timer);
+    orbit.running = false;
+  }
+  orbit_release();
+}
+
+// Limits the period to one step per axis every other tick at the peak rate.
+static float orbit_min_period_s(orbit_shape_t shape, float radius_mm) {
+  float spm = fmaxf(settings.axis[X_AXIS].steps_per_mm,
+                    settings.axis[Y_AXIS].steps_per_mm);
+  float path = shape == ORBIT_SQUARE ? 8.0f : 6.2831853f;  // per radius
+  return path * radius_mm * spm * (2 * EDM_ORBIT_TICK_US * 1e-6f);
+}
+
+static void orbit_start() {
+  float ticks_per_rev = orbit.period_s * (1e6f / EDM_ORBIT_TICK_US);
+  float r_step =
+      orbit.radius_mm / (ticks_per_rev * (EDM_ORBIT_RAMP_REVS > 0
+                                              ? EDM_ORBIT_RAMP_REVS
+                                              : 1));
+  uint32_t phase_inc = (uint32_t)(4294967296.0f / ticks_per_rev);
+
+  if (orbit.running) {
+    // New radius or period, the change is ramped from the current radius.
+    __disable_irq();
+    orbit.phase_inc = phase_inc;
+    orbit.r_step = r_step;
+    orbit.r_target = orbit.radius_mm;
+    __enable_irq();
+    return;
+  }
+
+  if (!orbit.claimed) {
+    hal.stepper.claim_motor(X_AXIS, true);
+    hal.stepper.claim_motor(Y_AXIS, true);
+    orbit.claimed = true;
+  }
+  orbit.tick_shape = orbit.shape;
+  orbit.steps_per_mm[0] = settings.axis[X_AXIS].steps_per_mm;
+  orbit.steps_per_mm[1] = settings.axis[Y_AXIS].steps_per_mm;
+  orbit.pos[0] = orbit.pos[1] = 0;
+  orbit.phase = 0;
+  orbit.phase_inc = phase_inc;
+  orbit.r = 0.0f;
+  orbit.r_step = r_step;
+  orbit.r_target = orbit.radius_mm;
+  orbit.revs_started = 0;
+  orbit.running = true;
+  hal.timer.start(orbit.timer, EDM_ORBIT_TICK_US - 1);
+}
+
+// Spirals back to the center, waits for it and releases X and Y.
+static void orbit_stop() {
+  orbit.r_target = 0.0f;
+  while (orbit.running && protocol_execute_realtime())
+    ;
+  if (!orbit.running) {
+    orbit_release();
+  }
+}
+
+static int orbit_report(char* buf, size_t len) {
+  static const char* const shapes[] = {"off", "circle", "square"};
+  return snprintf(buf, len, ",orbit=%s(%.3fmm,%.2fs,n=%lu)",
+                  orbit.timer ? shapes[orbit.shape] : "n/a", orbit.radius_mm,
+                  orbit.period_s, orbit.revs_started);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_orbit(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    orbit.radius_mm = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    orbit.period_s = block->values.q;
+  }
+  if (!isnan(block->values.s)) {
+    orbit.shape = (orbit_shape_t)block->values.s;
+  }
+
+  float min_period_s = orbit_min_period_s(orbit.shape, orbit.radius_mm);
+  if (orbit.period_s < min_period_s) {
+    orbit.period_s = min_period_s;
+  }
+
+  if (orbit.shape == ORBIT_OFF ||
+      (orbit.running && orbit.shape != orbit.tick_shape)) {
+    orbit_stop();
+  }
+  if (orbit.shape != ORBIT_OFF) {
+    orbit_start();
+  }
+}
+#endif
+
+#if EDM_HOLD_CURRENT_ENABLE
+// Motor current reduction while burning. An axis other than Z that has not
+// moved for EDM_HOLD_IDLE_MS while energized gets IRUN and IHOLD lowered to
+// EDM_HOLD_CURRENT_PCT of the values last written by the trinamic plugin,
+// via the async TMC UART queue. The current is restored as soon as the block
+// being prepared by the step generator has steps on the axis, which is ahead
+// of its execution by the segment buffer, when the axis moves anyway, and
+// when de-energized. Motor n is taken to drive axis n.
+#ifndef EDM_HOLD_IDLE_MS
+#define EDM_HOLD_IDLE_MS 5000
+#endif
+#ifndef EDM_HOLD_CURRENT_PCT
+#define EDM_HOLD_CURRENT_PCT 30
+#endif
+
+#define TMC2209_IHOLD_IRUN 0x10
+
+typedef struct {
+  int32_t last_pos[N_AXIS];
+  uint32_t still_ms[N_AXIS];  // since
+  uint32_t saved[N_AXIS];     // IHOLD_IRUN before the reduction
+  axes_signals_t reduced;
+  uint32_t reductions;
+  uint32_t write_errs;
+} hold_t;
+
+static hold_t hold = {0};
+
+// Scales the IHOLD (bits 0~4) and IRUN (bits 8~12) fields, IHOLDDELAY is kept.
+static uint32_t hold_scale(uint32_t ihold_irun) {
+  uint32_t ihold = (ihold_irun & 0x1F) * EDM_HOLD_CURRENT_PCT / 100;
+  uint32_t irun = ((ihold_irun >> 8) & 0x1F) * EDM_HOLD_CURRENT_PCT / 100;
+  return (ihold_irun & ~0x1F1FUL) | ihold | ((irun ? irun : 1) << 8);
+}
+
+// Called from realtime loop.
+static void hold_update(sys_state_t state) {
+  uint32_t now_ms = hal.get_elapsed_ticks(), value;
+  plan_block_t* block = plan_get_current_block();
+
+  for (uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+    if (idx == Z_AXIS) {
+      continue;
+    }
+    uint32_t bit = 1 << idx;
+    bool moving = sys.position[idx] != hold.last_pos[idx];
+#if EDM_ORBIT_ENABLE
+    moving |= orbit.running && (idx == X_AXIS || idx == Y_AXIS);
+#endif
+    if (moving) {
+      hold.last_pos[idx] = sys.position[idx];
+      hold.still_ms[idx] = now_ms;
+    }
+    bool needed = moving || !edm_removal_active || (block && block->steps[idx]);
+
+    if (hold.reduced.bits & bit) {
+      if (needed) {
+        if (tmc_uart_write_async(idx, TMC2209_IHOLD_IRUN, hold.saved[idx], NULL, NULL)) {
+          hold.reduced.bits &= ~bit;
+          hold.still_ms[idx] = now_ms;
+        } else {
+          hold.write_errs++;  // queue full, retried next call
+        }
+      }
+    } else if (needed) {
+      hold.still_ms[idx] = now_ms;
+    } else if (now_ms - hold.still_ms[idx] >= EDM_HOLD_IDLE_MS &&
+               tmc_uart_shadow_get(idx, TMC2209_IHOLD_IRUN, &value)) {
+      if (tmc_uart_write_async(idx, TMC2209_IHOLD_IRUN, hold_scale(value), NULL, NULL)) {
+        hold.saved[idx] = value;
+        hold.reduced.bits |= bit;
+        hold.reductions++;
+      } else {
+        hold.write_errs++;
+      }
+    }
+  }
+}
+
+static int hold_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",hold=%02X(%d%%,%lus,n=%lu%s)", hold.reduced.bits,
+                  EDM_HOLD_CURRENT_PCT, (uint32_t)(EDM_HOLD_IDLE_MS / 1000),
+                  hold.reductions, hold.write_errs ? ",werr" : "");
+}
+#endif
+
+static on_reset_ptr other_reset;
+static void power_queue_clear();
+
+// Queued power changes belong to the aborted program and are dropped.
+// Injected steps must not continue past a reset. An interrupted lift leaves Z
+// off by the steps made, which the machine position does not know about, as
+// does an orbit stopped away from its center.
+static void edm_reset() {
+  power_queue_clear();
+#if EDM_WEAR_COMP_ENABLE || EDM_FLUSH_ENABLE || EDM_ORBIT_ENABLE || \
+    EDM_GAP_HOLD_ENABLE
+  stepperInjectAbort();
+#endif
+#if EDM_ORBIT_ENABLE
+  orbit_abort();
+#endif
+#if EDM_FLUSH_ENABLE
+  if (flush_busy()) {
+    hal.stepper.claim_motor(Z_AXIS, false);
+    flush.gate_was_on = false;
+    flush.phase = FLUSH_IDLE;
+  }
+#endif
+#if EDM_GAP_HOLD_ENABLE
+  if (gap_hold.phase == GAP_HOLD_RETRACTING) {
+    hal.stepper.claim_motor(Z_AXIS, false);
+  }
+  gap_hold.gate_was_on = false;
+  gap_hold.phase = GAP_HOLD_IDLE;
+#endif
+  if (other_reset) {
+    other_reset();
+  }
+}
+
+#if EDM_TOUCHOFF_ENABLE
+// Parameters of the last M503/M504, re-applied by M572 between its probes.
+static struct {
+  bool valid;
+  bool tool_neg;
+  int pulse_dur_10us;
+  int pulse_current_100ma;
+  int pulse_duty_pct;
+} touch_power;
+#endif
+
+// must not be called when edm_init_status != 0
+static void exec_mcode_start(bool tool_neg,
+                             int pulse_dur_10us,
+                             int pulse_current_100ma,
+                             int pulse_duty_pct) {
+  // Polarity energizes PULSER, so it must come last.
+  // (REG_TEMPERATURE is read-only, so current can't join the dur/duty burst.)
+  const reg_write_t seq[] = {
+      {REG_PULSE_CURRENT, pulse_current_100ma},
+      {REG_PULSE_DUR, pulse_dur_10us},
+      {REG_MAX_DUTY, pulse_duty_pct},
+      {REG_POLARITY, tool_neg ? 2 : 1},  // 2: T- W+, 1: T+ W-
+  };
+#if EDM_GATE_BREAK_ENABLE
+  // Don't energize PULSER while the break input holds the gate off.
+  if (gate_break.ok && edm_gate_pwm_tripped() && !edm_gate_pwm_rearm()) {
+    report_message("EDM: gate break input active", Message_Warning);
+    return;
+  }
+#endif
+  if (!write_reg_seq(seq, sizeof(seq) / sizeof(seq[0]))) {
+    system_raise_alarm(Alarm_SelftestFailed);
+    return;
+  }
+#if EDM_GATE_PWM_ENABLE
+  // PULSER timing registers stay as the envelope; MCU pulses use the same
+  // on-time and duty. Timing can only change with the pulse train stopped.
+  if (gate_pwm_ok) {
+    edm_gate_pwm_enable(false);
+    if (!edm_gate_pwm_configure(pulse_dur_10us * 10.0f, pulse_duty_pct)) {
+      set_gate(false);
+      system_raise_alarm(Alarm_SelftestFailed);
+      return;
+    }
+  }
+#endif
+#if EDM_ADAPT_ENABLE
+  adapt_start(pulse_dur_10us, pulse_duty_pct);
+#endif
+#if EDM_ARC_ENABLE
+  arc_start(pulse_duty_pct);
+#endif
+#if EDM_THERMAL_ENABLE
+  thermal_start(pulse_dur_10us, pulse_current_100ma);
+#endif
+  wear.polarity = tool_neg ? POL_TNEG : POL_TPOS;
+  wear.pulse_uc = pulse_current_100ma * pulse_dur_10us;
+#if EDM_PULSE_CAPTURE_ENABLE
+  pulse_on_ns = pulse_dur_10us * 10000;
+#endif
+#if EDM_TOUCHOFF_ENABLE
+  touch_power.valid = true;
+  touch_power.tool_neg = tool_neg;
+  touch_power.pulse_dur_10us = pulse_dur_10us;
+  touch_power.pulse_current_100ma = pulse_current_100ma;
+  touch_power.pulse_duty_pct = pulse_duty_pct;
+#endif
+  set_gate(true);
+}
+
+// must not be called when edm_init_status != 0
+static void exec_mcode_stop();
+
+// Queued (motion-synchronized) power changes, M503~M505 with L1.
+// Producer: M-code execute (foreground). Consumer: edm_block_started()
+// (stepper interrupt), which hands the change over to edm_realtime() since
+// PULSER writes are blocking I2C transactions. Gate-off is applied directly
+// in the stepper interrupt.
+#ifndef EDM_POWER_QUEUE_SIZE
+#define EDM_POWER_QUEUE_SIZE 8
+#endif
+
+typedef struct {
+  uint32_t block_tag;  // apply once edm_blocks_started reaches this
+  bool energize;
+  bool tool_neg;
+  int pulse_dur_10us;
+  int pulse_current_100ma;
+  int pulse_duty_pct;
+  uint8_t recipe_step;  // 1-based step of a running recipe, 0: M503~M505
+} power_change_t;
+
+static power_change_t power_queue[EDM_POWER_QUEUE_SIZE];
+// Written by consumer resp. producer only, or by power_queue_clear().
+static volatile uint8_t power_q_head = 0;
+static volatile uint8_t power_q_tail = 0;
+static volatile uint32_t edm_blocks_started = 0;
+
+static volatile bool power_apply_pending = false;
+static power_change_t power_apply;
+
+// Drops queued and handed over changes; a synchronous M503~M505 or a reset
+// supersedes them. Also called from on_reset, which may run in an interrupt.
+static void power_queue_clear() {
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  power_q_head = power_q_tail = 0;
+  power_apply_pending = false;
+  __set_PRIMASK(primask);
+}
+
+static bool power_queue_full() {
+  return (uint8_t)(power_q_tail + 1) % EDM_POWER_QUEUE_SIZE == power_q_head;
+}
+
+static void queue_power_change(power_change_t change) {
+  // Planned blocks will start after all blocks that are in the planner now.
+  // Approximation: a block that is executing and still in the planner, or
+  // one fully prepared but not yet started, shifts this by one block.
+  change.block_tag = edm_blocks_started + plan_get_block_buffer_count() + 1;
+  power_queue[power_q_tail] = change;
+  power_q_tail = (power_q_tail + 1) % EDM_POWER_QUEUE_SIZE;
+}
+
+// Pop all due changes; the last one wins. Interrupt context or IRQs off.
+static void consume_power_changes(bool force) {
+  while (power_q_head != power_q_tail) {
+    power_change_t* change = &power_queue[power_q_head];
+    if (!force && (int32_t)(edm_blocks_started - change->block_tag) < 0) {
+      break;
+    }
+    if (!change->energize) {
+      set_gate(false);
+    }
+    power_apply = *change;
+    power_apply_pending = true;
+    power_q_head = (power_q_head + 1) % EDM_POWER_QUEUE_SIZE;
+  }
+}
+
+ITCM_CODE void edm_block_started(void) {
+  edm_blocks_started++;
+  consume_power_changes(false);
+}
+
+#if EDM_RECIPE_ENABLE
+static void recipe_applied(const power_change_t* change);
+#endif
+
+// Called from realtime loop.
+static void apply_power_changes() {
+  // Motion stopped before reaching the tagged block (e.g. M-code at program
+  // end); apply now.
+  if (power_q_head != power_q_tail && state_get() == STATE_IDLE &&
+      plan_get_block_buffer_count() == 0) {
+    __disable_irq();
+    consume_power_changes(true);
+    __enable_irq();
+  }
+
+  if (!power_apply_pending) {
+    return;
+  }
+  __disable_irq();
+  power_change_t change = power_apply;
+  power_apply_pending = false;
+  __enable_irq();
+
+#if EDM_RECIPE_ENABLE
+  recipe_applied(&change);
+#endif
+  if (change.energize) {
+    exec_mcode_start(change.tool_neg, change.pulse_dur_10us,
+                     change.pulse_current_100ma, change.pulse_duty_pct);
+  } else {
+    exec_mcode_stop();
+  }
+}
+
+static void exec_mcode_stop() {
+  set_gate(false);
+
+  bool ok = write_reg(REG_POLARITY, 0);  // OFF
+  if (!ok) {
+    system_raise_alarm(Alarm_SelftestFailed);
+    return;
+  }
+}
+
+#if EDM_RECIPE_ENABLE
+// Pulse recipes. A step holds M503/M504 parameters and the condition ending
+// it, checked from the realtime loop against counters sampled when the step
+// was applied. The next step is handed to apply_power_changes() like a due
+// queued change, so PULSER writes stay in the realtime loop.
+#ifndef EDM_RECIPE_STEPS
+#define EDM_RECIPE_STEPS 7
+#endif
+
+#define RECIPE_MAGIC 0x5243
+
+enum {
+  RECIPE_END_NONE = 0,
+  RECIPE_END_TIME,    // limit in ms of energized time
+  RECIPE_END_DEPTH,   // limit in um of Z descent
+  RECIPE_END_PULSES,  // limit in pulses
+};
+
+typedef struct {
+  uint8_t tool_neg : 1;
+  uint8_t end : 2;
+  uint8_t pulse_dur_10us;
+  uint8_t pulse_current_100ma;
+  uint8_t pulse_duty_pct;
+  uint32_t limit;
+} recipe_step_t;
+
+typedef struct {
+  uint16_t magic;
+  uint8_t n_steps;
+  uint8_t passes;
+  uint32_t checksum;
+  recipe_step_t steps[EDM_RECIPE_STEPS];
+} recipe_record_t;
+
+#if FLASH_JOURNAL
+_Static_assert(sizeof(recipe_record_t) <= FLASH_KV_SIZE,
+               "recipe_record_t must fit a journal value");
+#endif
+
+#if EDM_AUTOTUNE_ENABLE
+// Servo gains per step from M569 L, under their own journal key.
+typedef struct {
+  uint16_t magic;
+  uint8_t valid;  // bit per step
+  uint8_t reserved;
+  uint32_t checksum;
+  struct {
+    float kp;
+    float ki;
+  } step[EDM_RECIPE_STEPS];
+} recipe_gains_t;
+
+#if FLASH_JOURNAL
+_Static_assert(sizeof(recipe_gains_t) <= FLASH_KV_SIZE,
+               "recipe_gains_t must fit a journal value");
+#endif
+
+static recipe_gains_t recipe_gains = {.magic = RECIPE_MAGIC};
+static bool recipe_gains_dirty = false;
+#endif
+
+static struct {
+  recipe_record_t rec;
+  bool dirty;       // changed since saved
+  bool running;
+  uint8_t step;     // 0-based step in use
+  uint8_t pass;     // completed passes
+  uint64_t start_us;  // energized time when the step was applied
+  int32_t start_z;    // Z steps when the step was applied
+  uint32_t start_pulses;
+  uint32_t switches;
+} recipe = {.rec = {.magic = RECIPE_MAGIC, .passes = 1}};
+
+static uint32_t checksum_bytes(uint32_t sum, const void* data, size_t len) {
+  const uint8_t* b = data;
+  for (size_t i = 0; i < len; i++) {
+    sum = (sum << 1 | sum >> 31) ^ b[i];
+  }
+  return sum;
+}
+
+static uint32_t recipe_checksum(const recipe_record_t* rec) {
+  return checksum_bytes(0x12345678 ^ rec->n_steps ^ (rec->passes << 8),
+                        rec->steps, sizeof(rec->steps));
+}
+
+static void load_recipe() {
+#if FLASH_JOURNAL
+  recipe_record_t rec;
+  if (flash_kv_read(FLASH_KV_EDM_RECIPE, &rec, sizeof(rec)) &&
+      rec.magic == RECIPE_MAGIC && rec.n_steps <= EDM_RECIPE_STEPS &&
+      rec.checksum == recipe_checksum(&rec)) {
+    recipe.rec = rec;
+  }
+#if EDM_AUTOTUNE_ENABLE
+  recipe_gains_t gains;
+  if (flash_kv_read(FLASH_KV_EDM_GAINS, &gains, sizeof(gains)) &&
+      gains.magic == RECIPE_MAGIC &&
+      gains.checksum == checksum_bytes(gains.valid, gains.step,
+                                       sizeof(gains.step))) {
+    recipe_gains = gains;
+  }
+#endif
+#endif
+}
+
+static uint64_t energized_us() {
+  return energized_total_us +
+         (edm_removal_active ? hal.get_micros() - energized_start_us : 0);
+}
+
+static uint32_t total_pulses() {
+  return wear.pulses[POL_TNEG] + wear.pulses[POL_TPOS];
+}
+
+static power_change_t recipe_change(uint8_t step) {
+  const recipe_step_t* rs = &recipe.rec.steps[step];
+  return (power_change_t){
+      .energize = true,
+      .tool_neg = rs->tool_neg,
+      .pulse_dur_10us = rs->pulse_dur_10us,
+      .pulse_current_100ma = rs->pulse_current_100ma,
+      .pulse_duty_pct = rs->pulse_duty_pct,
+      .recipe_step = step + 1,
+  };
+}
+
+// Called from apply_power_changes() for every change applied.
+static void recipe_applied(const power_change_t* change) {
+  if (!change->recipe_step) {
+    recipe.running = false;  // M503~M505 take over
+    return;
+  }
+  recipe.running = true;
+  recipe.step = change->recipe_step - 1;
+#if EDM_AUTOTUNE_ENABLE
+  if (recipe_gains.valid & (1 << recipe.step)) {
+    servo.kp = recipe_gains.step[recipe.step].kp;
+    servo.ki = recipe_gains.step[recipe.step].ki;
+  }
+#endif
+  recipe.start_us = energized_us();
+  recipe.start_z = sys.position[Z_AXIS];
+  recipe.start_pulses = total_pulses();
+}
+
+static bool recipe_step_done() {
+  const recipe_step_t* rs = &recipe.rec.steps[recipe.step];
+  switch (rs->end) {
+    case RECIPE_END_TIME:
+      return energized_us() - recipe.start_us >= (uint64_t)rs->limit * 1000;
+    case RECIPE_END_DEPTH:
+      return (recipe.start_z - sys.position[Z_AXIS]) * 1000.0f /
+                 settings.axis[Z_AXIS].steps_per_mm >= (float)rs->limit;
+    case RECIPE_END_PULSES: {
+      uint32_t pulses = total_pulses();
+      if (pulses < recipe.start_pulses) {
+        recipe.start_pulses = pulses;  // counters reset by M554
+      }
+      return pulses - recipe.start_pulses >= rs->limit;
+    }
+    default:
+      return false;
+  }
+}
+
+// Called from realtime loop.
+static void recipe_update(sys_state_t s) {
+  if (recipe.dirty && !edm_removal_active && s == STATE_IDLE) {
+#if FLASH_JOURNAL
+    recipe.rec.checksum = recipe_checksum(&recipe.rec);
+    flash_kv_write(FLASH_KV_EDM_RECIPE, &recipe.rec, sizeof(recipe.rec));
+#endif
+    recipe.dirty = false;
+  }
+#if EDM_AUTOTUNE_ENABLE
+  if (recipe_gains_dirty && !edm_removal_active && s == STATE_IDLE) {
+#if FLASH_JOURNAL
+    recipe_gains.checksum = checksum_bytes(
+        recipe_gains.valid, recipe_gains.step, sizeof(recipe_gains.step));
+    flash_kv_write(FLASH_KV_EDM_GAINS, &recipe_gains, sizeof(recipe_gains));
+#endif
+    recipe_gains_dirty = false;
+  }
+#endif
+
+  if (!recipe.running) {
+    return;
+  }
+  if (s & (STATE_ALARM | STATE_ESTOP)) {
+    recipe.running = false;
+    return;
+  }
+  // Only switch while burning: a flushing lift or gate break has the gate
+  // off, and applying a step energizes PULSER.
+  if (!edm_removal_active || power_apply_pending ||
+      recipe.step >= recipe.rec.n_steps || !recipe_step_done()) {
+    return;
+  }
+
+  uint8_t next = recipe.step + 1;
+  if (next >= recipe.rec.n_steps) {
+    if (recipe.rec.passes && ++recipe.pass >= recipe.rec.passes) {
+      recipe.running = false;  // the last step stays
+      return;
+    }
+    next = 0;
+  }
+
+  __disable_irq();
+  if (!power_apply_pending) {
+    power_apply = recipe_change(next);
+    power_apply_pending = true;
+  }
+  __enable_irq();
+  recipe.switches++;
+}
+
+static void print_recipe() {
+  char buf[96];
+  for (int i = 0; i < recipe.rec.n_steps; i++) {
+    const recipe_step_t* rs = &recipe.rec.steps[i];
+    snprintf(buf, sizeof(buf),
+             "[EDMR|step=%d,pol=%s,p=%d,q=%.1f,r=%d,end=%d,limit=%lu",
+             i + 1, rs->tool_neg ? "T-" : "T+", rs->pulse_dur_10us * 10,
+             rs->pulse_current_100ma * 0.1f, rs->pulse_duty_pct, rs->end,
+             rs->limit);
+    hal.stream.write(buf);
+#if EDM_AUTOTUNE_ENABLE
+    if (recipe_gains.valid & (1 << i)) {
+      snprintf(buf, sizeof(buf), ",kp=%.3f,ki=%.3f", recipe_gains.step[i].kp,
+               recipe_gains.step[i].ki);
+      hal.stream.write(buf);
+    }
+#endif
+    hal.stream.write("]" ASCII_EOL);
+  }
+}
+
+static int recipe_report(char* buf, size_t len) {
+  return snprintf(buf, len, ",rcp=%s(%d/%d,pass=%d/%d,sw=%lu)",
+                  recipe.running ? "on" : "off",
+                  recipe.running ? recipe.step + 1 : 0, recipe.rec.n_steps,
+                  recipe.pass, recipe.rec.passes, recipe.switches);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_recipe_step(parser_block_t* block) {
+  int step = block->values.l - 1;
+  if (block->values.s == 0) {
+    recipe.rec.n_steps = step;
+#if EDM_AUTOTUNE_ENABLE
+    recipe_gains.valid &= (1 << step) - 1;
+    recipe_gains_dirty = true;
+#endif
+  } else {
+    recipe_step_t* rs = &recipe.rec.steps[step];
+    rs->tool_neg = block->values.s == 1;
+    rs->pulse_dur_10us = isnan(block->values.p) ? 50 : block->values.p * 0.1f;
+    rs->pulse_current_100ma =
+        isnan(block->values.q) ? 10 : max(1, (int)(block->values.q * 10));
+    rs->pulse_duty_pct = isnan(block->values.r) ? 25 : block->values.r;
+    if (step == recipe.rec.n_steps) {
+      rs->end = RECIPE_END_NONE;
+      rs->limit = 0;
+      recipe.rec.n_steps++;
+    }
+  }
+  if (recipe.step >= recipe.rec.n_steps) {
+    recipe.running = false;
+  }
+  recipe.dirty = true;
+}
+
+static void exec_mcode_recipe_end(parser_block_t* block) {
+  recipe_step_t* rs = &recipe.rec.steps[(int)block->values.l - 1];
+  float q = block->values.q;
+  rs->end = block->values.p;
+  switch (rs->end) {
+    case RECIPE_END_TIME:
+    case RECIPE_END_DEPTH:
+    case RECIPE_END_PULSES:
+      rs->limit = lroundf(q * 1000.0f);
+      break;
+    default:
+      rs->limit = 0;
+      break;
+  }
+  recipe.dirty = true;
+}
+
+#if EDM_ELECTRODE_ENABLE
+static uint8_t electrode_recipe_step();
+#endif
+
+static void exec_mcode_recipe_run(parser_block_t* block) {
+  if (isnan(block->values.s)) {
+    print_recipe();
+    return;
+  }
+  if (!isnan(block->values.q) && block->values.q != recipe.rec.passes) {
+    recipe.rec.passes = block->values.q;
+    recipe.dirty = true;
+  }
+  if (block->values.s == 0) {
+    recipe.running = false;
+    return;
+  }
+  recipe.pass = 0;
+#if EDM_ELECTRODE_ENABLE
+  uint8_t first = electrode_recipe_step();
+#else
+  uint8_t first = 0;
+#endif
+  if (block->values.l) {
+    queue_power_change(recipe_change(first));
+  } else {
+    power_change_t change = recipe_change(first);
+    recipe_applied(&change);
+    exec_mcode_start(change.tool_neg, change.pulse_dur_10us,
+                     change.pulse_current_100ma, change.pulse_duty_pct);
+  }
+}
+#endif
+
+#if EDM_AUTOTUNE_ENABLE
+static void print_tune() {
+  char buf[96];
+  if (!tune.valid) {
+    hal.stream.write("[EDMT|none]" ASCII_EOL);
+    return;
+  }
+  snprintf(buf, sizeof(buf), "[EDMT|kp=%.3f,ki=%.3f,ku=%.3f,tu=%.3f]" ASCII_EOL,
+           tune.kp, tune.ki, tune.ku, tune.tu);
+  hal.stream.write(buf);
+}
+
+// Called from realtime loop, reports a finished run and stores the gains.
+static void tune_update() {
+  if (tune.state == TUNE_DONE) {
+    tune.state = TUNE_IDLE;
+    print_tune();
+#if EDM_RECIPE_ENABLE
+    if (tune.store_step) {
+      recipe_gains.step[tune.store_step - 1].kp = tune.kp;
+      recipe_gains.step[tune.store_step - 1].ki = tune.ki;
+      recipe_gains.valid |= 1 << (tune.store_step - 1);
+      recipe_gains_dirty = true;
+    }
+#endif
+  } else if (tune.state == TUNE_FAILED) {
+    tune.state = TUNE_IDLE;
+    report_message("EDM: servo autotune aborted, gains unchanged",
+                   Message_Warning);
+  }
+}
+
+static int tune_report(char* buf, size_t len) {
+  static const char* const names[] = {"idle", "armed", "run", "done", "fail"};
+  return snprintf(buf, len, ",tune=%s(%d/%d)", names[tune.state],
+                  tune.state == TUNE_RUNNING ? tune.n : 0,
+                  EDM_AUTOTUNE_SKIP + tune.cycles);
+}
+
+// Words absent from the block are passed as NAN, L as 0 (see mcode_validate).
+static void exec_mcode_autotune(parser_block_t* block) {
+  if (isnan(block->values.s)) {
+    print_tune();
+    return;
+  }
+  if (block->values.s == 0) {
+    if (tune.state == TUNE_ARMED || tune.state == TUNE_RUNNING) {
+      tune.state = TUNE_IDLE;
+    }
+    return;
+  }
+  tune.d = isnan(block->values.p) ? 0.2f : block->values.p * 0.01f;
+  tune.cycles = isnan(block->values.q) ? 4 : block->values.q;
+  tune.store_step = block->values.l;
+  tune.state = TUNE_ARMED;
+}
+#endif
+
+#if EDM_ELECTRODE_ENABLE
+// Electrode library. Each electrode is a journal key of its own, so a change
+// writes one record. Records are read into RAM at boot, with the tool numbers
+// kept apart as a compact index searched on M6.
+#ifndef EDM_ELECTRODE_REF
+#define EDM_ELECTRODE_REF 1  // tool number of the reference electrode
+#endif
+
+#define ELECTRODE_MAGIC 0x4543
+
+typedef struct {
+  uint16_t magic;
+  uint16_t tool;  // 0: free slot
+  uint32_t checksum;
+  float area_mm2;       // frontal area, as M555 P
+  float wear_scale;     // factor on EDM_WEAR_*_MM3_PER_C
+  int32_t touch_z;      // contact Z of the last M572, steps
+  uint8_t recipe_step;  // M567 S1 starts here, 0: step 1
+  uint8_t touched;      // touch_z valid
+  uint16_t reserved;
+} electrode_rec_t;
+
+_Static_assert(sizeof(electrode_rec_t) <= FLASH_KV_SIZE,
+               "electrode_rec_t must fit a journal value");
+_Static_assert(EDM_ELECTRODES <= 32, "elib.dirty has a bit per slot");
+
+static struct {
+  electrode_rec_t rec[EDM_ELECTRODES];
+  uint16_t tool[EDM_ELECTRODES];  // index, 0: free
+  int8_t sel;                     // slot in use, -1: none
+  uint32_t dirty;                 // slots changed since saved
+} elib = {.sel = -1};
+
+static on_tool_changed_ptr other_tool_changed;
+
+static uint32_t electrode_checksum(const electrode_rec_t* rec) {
+  return crc32_calc(&rec->tool, sizeof(rec->tool)) ^
+         crc32_calc(&rec->area_mm2,
+                    sizeof(*rec) - offsetof(electrode_rec_t, area_mm2));
+}
+
+static int electrode_find(uint16_t tool) {
+  for (int i = 0; i < EDM_ELECTRODES; i++) {
+    if (elib.tool[i] == tool) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void load_electrodes() {
+  for (int i = 0; i < EDM_ELECTRODES; i++) {
+    electrode_rec_t* rec = &elib.rec[i];
+    if (!flash_kv_read(FLASH_KV_EDM_ELECTRODE + i, rec, sizeof(*rec)) ||
+        rec->magic != ELECTRODE_MAGIC ||
+        rec->checksum != electrode_checksum(rec)) {
+      memset(rec, 0, sizeof(*rec));
+    }
+    elib.tool[i] = rec->tool;
+  }
+}
+
+// Step M567 S1 starts from, 0-based.
+static uint8_t electrode_recipe_step() {
+#if EDM_RECIPE_ENABLE
+  if (elib.sel >= 0) {
+    uint8_t step = elib.rec[elib.sel].recipe_step;
+    if (step > 0 && step <= recipe.rec.n_steps) {
+      return step - 1;
+    }
+  }
+#endif
+  return 0;
+}
+
+// Tool length offset of the electrode in use, from its contact Z and that of
+// the reference electrode. Unchanged while either has none.
+static void electrode_apply_offset() {
+#if EDM_TOUCHOFF_ENABLE
+  int ref = electrode_find(EDM_ELECTRODE_REF);
+  const electrode_rec_t* e = &elib.rec[elib.sel];
+  if (ref >= 0 && elib.rec[ref].touched && e->touched) {
+    gc_set_tool_offset(ToolLengthOffset_EnableDynamic, Z_AXIS,
+                       e->touch_z - elib.rec[ref].touch_z);
+  }
+#endif
+}
+
+static void electrode_select(uint16_t tool) {
+  elib.sel = tool ? electrode_find(tool) : -1;
+  if (elib.sel < 0) {
+    wear_scale = 1.0f;
+    return;
+  }
+  const electrode_rec_t* e = &elib.rec[elib.sel];
+  wear_scale = e->wear_scale;
+#if EDM_WEAR_COMP_ENABLE
+  wear_comp.area_mm2 = e->area_mm2;
+  if (wear_comp.enabled) {
+    wear_comp_reset();  // a fresh electrode
+  }
+#endif
+  electrode_apply_offset();
+}
+
+// Called by the core after M6, motion is synchronized.
+static void edm_tool_changed(tool_data_t* tool) {
+  electrode_select(tool->tool_id);
+  if (other_tool_changed) {
+    other_tool_changed(tool);
+  }
+}
+
+#if EDM_TOUCHOFF_ENABLE
+// Called on M572 contact with the refined contact Z.
+static void electrode_touched(int32_t z) {
+  if (elib.sel < 0) {
+    return;
+  }
+  elib.rec[elib.sel].touch_z = z;
+  elib.rec[elib.sel].touched = 1;
+  elib.dirty |= 1 << elib.sel;
+  electrode_apply_offset();
+}
+#endif
+
+// Called from realtime loop. Flash programming stalls code fetch, so only
+// save while de-energized and idle.
+static void electrode_update(sys_state_t s) {
+  if (!elib.dirty || edm_removal_active || s != STATE_IDLE) {
+    return;
+  }
+  for (int i = 0; i < EDM_ELECTRODES; i++) {
+    if (elib.dirty & (1 << i)) {
+      electrode_rec_t* rec = &elib.rec[i];
+      rec->magic = ELECTRODE_MAGIC;
+      rec->checksum = electrode_checksum(rec);
+      flash_kv_write(FLASH_KV_EDM_ELECTRODE + i, rec, sizeof(*rec));
+    }
+  }
+  elib.dirty = 0;
+}
+
+static void print_electrodes() {
+  char buf[128];
+  int ref = electrode_find(EDM_ELECTRODE_REF);
+  for (int i = 0; i < EDM_ELECTRODES; i++) {
+    const electrode_rec_t* e = &elib.rec[i];
+    if (!elib.tool[i]) {
+      continue;
+    }
+    int ofs = snprintf(buf, sizeof(buf),
+                       "[EDME|t=%u,area=%.2f,wear=%.3f,step=%u%s",
+                       e->tool, e->area_mm2, e->wear_scale, e->recipe_step,
+                       i == elib.sel ? ",sel" : "");
+    if (e->touched) {
+      float steps_mm = settings.axis[Z_AXIS].steps_per_mm;
+      ofs += snprintf(buf + ofs, sizeof(buf) - ofs, ",touch=%.4f",
+                      e->touch_z / steps_mm);
+      if (ref >= 0 && elib.rec[ref].touched) {
+        ofs += snprintf(buf + ofs, sizeof(buf) - ofs, ",ofs=%.4f",
+                        (e->touch_z - elib.rec[ref].touch_z) / steps_mm);
+      }
+    }
+    snprintf(buf + ofs, sizeof(buf) - ofs, "]" ASCII_EOL);
+    hal.stream.write(buf);
+  }
+}
+
+static int electrode_report(char* buf, size_t len) {
+  int n = 0;
+  for (int i = 0; i < EDM_ELECTRODES; i++) {
+    n += elib.tool[i] != 0;
+  }
+  return snprintf(buf, len, ",elec=%u(%d/%d)",
+                  elib.sel >= 0 ? elib.tool[elib.sel] : 0, n, EDM_ELECTRODES);
+}
+
+// M575 without L, set by mcode_validate as L is an integer word.
+static bool electrode_list;
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_electrode(parser_block_t* block) {
+  if (electrode_list) {
+    print_electrodes();
+    return;
+  }
+  uint16_t tool = block->values.l;
+  int i = electrode_find(tool);
+  if (block->values.s == 0) {
+    if (i < 0) {
+      return;  // checked by mcode_validate
+    }
+    elib.tool[i] = elib.rec[i].tool = 0;
+    elib.dirty |= 1 << i;
+    if (i == elib.sel) {
+      electrode_select(0);
+    }
+    return;
+  }
+  if (i < 0) {
+    i = electrode_find(0);  // free slot checked by mcode_validate
+    elib.rec[i] =
+        (electrode_rec_t){.tool = tool, .area_mm2 = 1.0f, .wear_scale = 1.0f};
+    elib.tool[i] = tool;
+  }
+  electrode_rec_t* e = &elib.rec[i];
+  if (!isnan(block->values.p)) {
+    e->area_mm2 = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    e->wear_scale = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    e->recipe_step = block->values.r;
+  }
+  elib.dirty |= 1 << i;
+  if (i == elib.sel) {
+    electrode_select(tool);
+  }
+}
+#endif
+
+#if EDM_TOUCHOFF_ENABLE
+#ifndef EDM_TOUCHOFF_FAST
+#define EDM_TOUCHOFF_FAST 100.0f  // mm/min
+#endif
+#ifndef EDM_TOUCHOFF_SLOW
+#define EDM_TOUCHOFF_SLOW 5.0f  // mm/min
+#endif
+#ifndef EDM_TOUCHOFF_BACKOFF
+#define EDM_TOUCHOFF_BACKOFF 0.2f  // mm
+#endif
+#ifndef EDM_TOUCHOFF_TRAVEL
+#define EDM_TOUCHOFF_TRAVEL 10.0f  // mm
+#endif
+
+// One G38.2 on Z from the current position, energized with touch_power.
+// edm_probe_completed() de-energizes and latches the contact position.
+static bool touchoff_probe(float dz, float feed_rate) {
+  float target[N_AXIS];
+  plan_line_data_t pl_data;
+
+  exec_mcode_start(touch_power.tool_neg, touch_power.pulse_dur_10us,
+                   touch_power.pulse_current_100ma, touch_power.pulse_duty_pct);
+  if (!edm_removal_active) {
+    return false;  // gate break or PULSER write failed, already reported
+  }
+  system_convert_array_steps_to_mpos(target, sys.position);
+  target[Z_AXIS] += dz;
+  plan_data_init(&pl_data);
+  pl_data.feed_rate = feed_rate;
+
+  return mc_probe_cycle(target, &pl_data, (gc_parser_flags_t){0}) ==
+             GCProbe_Found &&
+         !sys.abort;
+}
+
+// Moves to target, Z of NAN keeps the current Z. Waits for the move.
+static bool touchoff_move(float* target, float feed_rate) {
+  float pos[N_AXIS];
+  plan_line_data_t pl_data;
+  system_convert_array_steps_to_mpos(pos, sys.position);
+  for (int i = 0; i < N_AXIS; i++) {
+    if (isnan(target[i])) {
+      target[i] = pos[i];
+    }
+  }
+  plan_data_init(&pl_data);
+  pl_data.feed_rate = feed_rate;
+  mc_line(target, &pl_data);
+  return protocol_buffer_synchronize() && !sys.abort;
+}
+
+// Fast probe, back off and slow probe along Z. The contact Z of the fast
+// probe is returned in *fast_z, the refined one is sys.probe_position.
+static bool touchoff_cycle(float dir, float travel, float fast, float slow,
+                           float backoff, float* fast_z) {
+  if (!touchoff_probe(dir * travel, fast)) {
+    return false;
+  }
+  *fast_z = sys.probe_position[Z_AXIS] / settings.axis[Z_AXIS].steps_per_mm;
+
+  // Back off from the latched contact, de-energized.
+  float target[N_AXIS];
+  for (int i = 0; i < N_AXIS; i++) {
+    target[i] = NAN;
+  }
+  target[Z_AXIS] = *fast_z - dir * backoff;
+  return touchoff_move(target, fast) &&
+         touchoff_probe(dir * backoff * 2.0f, slow);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_touchoff(parser_block_t* block) {
+  float fast = isnan(block->values.p) ? EDM_TOUCHOFF_FAST : block->values.p;
+  float slow = isnan(block->values.q) ? EDM_TOUCHOFF_SLOW : block->values.q;
+  float backoff =
+      isnan(block->values.r) ? EDM_TOUCHOFF_BACKOFF : block->values.r;
+  float travel = isnan(block->values.d) ? EDM_TOUCHOFF_TRAVEL : block->values.d;
+  float dir = isnan(block->values.s) ? -1.0f : block->values.s;
+  float steps_mm = settings.axis[Z_AXIS].steps_per_mm;
+  uint32_t t0_us = hal.get_micros();
+  float fast_z = 0.0f;
+
+  bool found = touchoff_cycle(dir, travel, fast, slow, backoff, &fast_z);
+
+  if (!sys.abort) {
+    // The parser position is set from the block after the M-code executes.
+    system_convert_array_steps_to_mpos(block->values.xyz, sys.position);
+    gc_sync_position();
+  }
+  if (!found) {
+    return;
+  }
+
+#if EDM_ELECTRODE_ENABLE
+  electrode_touched(sys.probe_position[Z_AXIS]);
+#endif
+
+  char buf[144];
+  float contact_z = sys.probe_position[Z_AXIS] / steps_mm;
+  float stop_z = sys.position[Z_AXIS] / steps_mm;
+  snprintf(buf, sizeof(buf),
+           "[EDMTO|fast=%.4f,contact=%.4f,stop=%.4f,over=%.1fum,lat=%luus,"
+           "t=%lums]" ASCII_EOL,
+           fast_z, contact_z, stop_z, fabsf(stop_z - contact_z) * 1000.0f,
+           probe_filter.trigger_us - probe_filter.contact_us,
+           ((uint32_t)hal.get_micros() - t0_us) / 1000);
+  hal.stream.write(buf);
+}
+#endif
+
+#if EDM_SURFACE_MAP_ENABLE
+// Height map probed by M573, and Z compensation from it by queued step
+// injection in the realtime loop, as for wear compensation.
+#ifndef EDM_SURFACE_MAP_N
+#define EDM_SURFACE_MAP_N 16  // max points per axis
+#endif
+#ifndef EDM_SURFACE_MAP_RATE
+#define EDM_SURFACE_MAP_RATE 400.0f  // steps/s
+#endif
+#ifndef EDM_SURFACE_MAP_MAX_STEPS
+#define EDM_SURFACE_MAP_MAX_STEPS 32  // per burst
+#endif
+
+typedef struct {
+  bool valid;
+  bool enabled;
+  uint8_t nx;
+  uint8_t ny;
+  float x0;  // machine position of the first point
+  float y0;
+  float spacing;
+  float z[EDM_SURFACE_MAP_N][EDM_SURFACE_MAP_N];  // relative to the first
+  int32_t steps;  // Z steps queued, positive toward Z+
+} surface_map_t;
+
+static surface_map_t surface_map;
+
+// Height at machine x, y, held at the edges of the map.
+static float surface_map_height(float x, float y) {
+  float fx = clampf((x - surface_map.x0) / surface_map.spacing, 0.0f,
+                    surface_map.nx - 1);
+  float fy = clampf((y - surface_map.y0) / surface_map.spacing, 0.0f,
+                    surface_map.ny - 1);
+  int ix = fx >= surface_map.nx - 1 ? surface_map.nx - 2 : (int)fx;
+  int iy = fy >= surface_map.ny - 1 ? surface_map.ny - 2 : (int)fy;
+  ix = ix < 0 ? 0 : ix;  // single point rows or columns
+  iy = iy < 0 ? 0 : iy;
+  int ix1 = surface_map.nx > 1 ? ix + 1 : ix;
+  int iy1 = surface_map.ny > 1 ? iy + 1 : iy;
+  fx -= ix;
+  fy -= iy;
+  float z0 = surface_map.z[iy][ix] +
+             (surface_map.z[iy][ix1] - surface_map.z[iy][ix]) * fx;
+  float z1 = surface_map.z[iy1][ix] +
+             (surface_map.z[iy1][ix1] - surface_map.z[iy1][ix]) * fx;
+  return z0 + (z1 - z0) * fy;
+}
+
+// Called from realtime loop. Queues the steps the compensation is behind by
+// as one burst at a time; steps the offset back out once disabled.
+static void surface_map_update() {
+  if ((!surface_map.enabled && surface_map.steps == 0) ||
+      stepperInjectBusy()) {
+    return;
+  }
+#if EDM_FLUSH_ENABLE
+  if (flush_busy()) {
+    return;  // Z is claimed by the lift
+  }
+#endif
+  int32_t target = 0;
+  if (surface_map.enabled) {
+    float x = sys.position[X_AXIS] / settings.axis[X_AXIS].steps_per_mm;
+    float y = sys.position[Y_AXIS] / settings.axis[Y_AXIS].steps_per_mm;
+    target = lroundf(surface_map_height(x, y) *
+                     settings.axis[Z_AXIS].steps_per_mm);
+  }
+  int32_t n = target - surface_map.steps;
+  if (n == 0) {
+    return;
+  }
+  int32_t steps = n > 0 ? n : -n;
+  if (steps > EDM_SURFACE_MAP_MAX_STEPS) {
+    steps = EDM_SURFACE_MAP_MAX_STEPS;
+  }
+  axes_signals_t step = {.z = On};
+  axes_signals_t dir = {.z = n < 0};  // set: toward Z-
+  if (stepperInjectBurst(step, dir, steps, EDM_SURFACE_MAP_RATE)) {
+    surface_map.steps += n > 0 ? steps : -steps;
+  }
+}
+
+static void print_surface_map() {
+  char buf[24];
+  if (!surface_map.valid) {
+    hal.stream.write("[EDMSM|none]" ASCII_EOL);
+    return;
+  }
+  snprintf(buf, sizeof(buf), "[EDMSM|%dx%d,", surface_map.nx, surface_map.ny);
+  hal.stream.write(buf);
+  snprintf(buf, sizeof(buf), "x0=%.3f,", surface_map.x0);
+  hal.stream.write(buf);
+  snprintf(buf, sizeof(buf), "y0=%.3f,", surface_map.y0);
+  hal.stream.write(buf);
+  snprintf(buf, sizeof(buf), "d=%.3f]" ASCII_EOL, surface_map.spacing);
+  hal.stream.write(buf);
+  for (int iy = 0; iy < surface_map.ny; iy++) {
+    snprintf(buf, sizeof(buf), "[EDMSM|y%d", iy);
+    hal.stream.write(buf);
+    for (int ix = 0; ix < surface_map.nx; ix++) {
+      snprintf(buf, sizeof(buf), ",%.4f", surface_map.z[iy][ix]);
+      hal.stream.write(buf);
+    }
+    hal.stream.write("]" ASCII_EOL);
+  }
+}
+
+static int surface_map_report(char* buf, size_t len) {
+  return snprintf(
+      buf, len, ",smap=%s(%dx%d,%+.4f)",
+      surface_map.enabled ? "on" : (surface_map.valid ? "off" : "none"),
+      surface_map.nx, surface_map.ny,
+      surface_map.steps / settings.axis[Z_AXIS].steps_per_mm);
+}
+
+// Probes the grid serpentine, returns to the start position.
+static bool surface_map_probe(float x_len, float y_len, float spacing,
+                              float travel) {
+  float start[N_AXIS];
+  float target[N_AXIS];
+  system_convert_array_steps_to_mpos(start, sys.position);
+
+  surface_map.enabled = surface_map.valid = false;
+  surface_map.nx = (uint8_t)(x_len / spacing + 1.5f);
+  surface_map.ny = (uint8_t)(y_len / spacing + 1.5f);
+  surface_map.x0 = start[X_AXIS];
+  surface_map.y0 = start[Y_AXIS];
+  surface_map.spacing = spacing;
+
+  bool ok = true;
+  float z_ref = 0.0f;
+  for (int iy = 0; ok && iy < surface_map.ny; iy++) {
+    for (int k = 0; ok && k < surface_map.nx; k++) {
+      int ix = iy & 1 ? surface_map.nx - 1 - k : k;
+      memcpy(target, start, sizeof(target));
+      target[X_AXIS] = surface_map.x0 + ix * spacing;
+      target[Y_AXIS] = surface_map.y0 + iy * spacing;
+      float fast_z;
+      ok = touchoff_move(target, EDM_TOUCHOFF_FAST) &&
+           touchoff_cycle(-1.0f, travel, EDM_TOUCHOFF_FAST,
+                          EDM_TOUCHOFF_SLOW, EDM_TOUCHOFF_BACKOFF, &fast_z);
+      if (ok) {
+        float z = sys.probe_position[Z_AXIS] /
+                  settings.axis[Z_AXIS].steps_per_mm;
+        if (ix == 0 && iy == 0) {
+          z_ref = z;
+        }
+        surface_map.z[iy][ix] = z - z_ref;
+        // Back up to the start height before moving on.
+        memcpy(target, start, sizeof(target));
+        target[X_AXIS] = NAN;
+        target[Y_AXIS] = NAN;
+        ok = touchoff_move(target, EDM_TOUCHOFF_FAST);
+      }
+    }
+  }
+  if (sys.abort) {
+    return false;
+  }
+  memcpy(target, start, sizeof(target));
+  target[X_AXIS] = target[Y_AXIS] = NAN;
+  if (touchoff_move(target, EDM_TOUCHOFF_FAST)) {
+    memcpy(target, start, sizeof(target));
+    touchoff_move(target, EDM_TOUCHOFF_FAST);
+  }
+  return (surface_map.valid = ok);
+}
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_surface_map(parser_block_t* block) {
+  if (isnan(block->values.s)) {
+    print_surface_map();
+    return;
+  }
+  switch ((int)block->values.s) {
+    case 0:
+      surface_map.enabled = false;
+      break;
+    case 1: {
+      float travel =
+          isnan(block->values.d) ? EDM_TOUCHOFF_TRAVEL : block->values.d;
+      // Step out the offset of a previous map before probing.
+      surface_map.enabled = false;
+      while (surface_map.steps || stepperInjectBusy()) {
+        if (!protocol_execute_realtime()) {
+          return;
+        }
+      }
+      bool ok = surface_map_probe(block->values.p, block->values.q,
+                                  block->values.r, travel);
+      if (!sys.abort) {
+        system_convert_array_steps_to_mpos(block->values.xyz, sys.position);
+        gc_sync_position();
+      }
+      surface_map.enabled = ok;
+      if (ok) {
+        print_surface_map();
+      }
+      break;
+    }
+    case 2:
+      surface_map.enabled = surface_map.valid;
+      break;
+  }
+}
+#endif
+
+// Words absent from the block are passed as NAN (see mcode_validate).
+static void exec_mcode_servo(parser_block_t* block) {
+  if (!isnan(block->values.p)) {
+    servo.kp = block->values.p;
+  }
+  if (!isnan(block->values.q)) {
+    servo.ki = block->values.q;
+  }
+  if (!isnan(block->values.r)) {
+    servo.target = block->values.r * 0.01f;
+  }
+  if (!isnan(block->values.s)) {
+    servo.enabled = block->values.s > 0;
+  }
+  servo_reset();
+}
+
+static void exec_mcode_probe_filter(parser_block_t* block) {
+  if (!isnan(block->values.q)) {
+    probe_filter.window = block->values.q;
+  }
+  if (!isnan(block->values.p)) {
+    probe_filter.n_required = block->values.p;
+  }
+  if (probe_filter.n_required > probe_filter.window) {
+    probe_filter.n_required = probe_filter.window;
+  }
+  if (!isnan(block->values.r)) {
+    probe_filter.threshold = block->values.r;
+  }
+  if (!isnan(block->values.s)) {
+    probe_filter.burst_hz = block->values.s;
+  }
+  probe_filter_reset();
+}
+
+static inline bool is_edm_mcode(user_mcode_t m) {
+  return (m == EDM_MCODE_READ || m == EDM_MCODE_START_TNEG ||
+          m == EDM_MCODE_START_TPOS || m == EDM_MCODE_STOP ||
+          m == EDM_MCODE_LOG || m == EDM_MCODE_SERVO ||
+          m == EDM_MCODE_PROBE_FILTER || m == EDM_MCODE_WEAR_RESET
+#if EDM_WEAR_COMP_ENABLE
+          || m == EDM_MCODE_WEAR_COMP
+#endif
+#if EDM_FLUSH_ENABLE
+          || m == EDM_MCODE_FLUSH
+#endif
+#if EDM_ORBIT_ENABLE
+          || m == EDM_MCODE_ORBIT
+#endif
+#if EDM_ADAPT_ENABLE
+          || m == EDM_MCODE_ADAPT
+#endif
+#if EDM_ARC_ENABLE
+          || m == EDM_MCODE_ARC
+#endif
+#if EDM_CAPTURE_ENABLE
+          || m == EDM_MCODE_CAPTURE
+#endif
+#if EDM_THERMAL_ENABLE
+          || m == EDM_MCODE_THERMAL
+#endif
+#if EDM_PULSER_SIM
+          || m == EDM_MCODE_SIM
+#endif
+#if EDM_RECIPE_ENABLE
+          || m == EDM_MCODE_RECIPE_STEP || m == EDM_MCODE_RECIPE_END
+          || m == EDM_MCODE_RECIPE_RUN
+#endif
+#if EDM_RETRACT_PROFILE
+          || m == EDM_MCODE_RETRACT
+#endif
+#if EDM_AUTOTUNE_ENABLE
+          || m == EDM_MCODE_AUTOTUNE
+#endif
+#if EDM_TOUCHOFF_ENABLE
+          || m == EDM_MCODE_TOUCHOFF
+#endif
+#if EDM_SURFACE_MAP_ENABLE
+          || m == EDM_MCODE_SURFACE_MAP
+#endif
+#if EDM_RETRACT_VECTOR
+          || m == EDM_MCODE_RETRACT_VECTOR
+#endif
+#if EDM_ELECTRODE_ENABLE
+          || m == EDM_MCODE_ELECTRODE
+#endif
+#if EDM_GAP_HOLD_ENABLE
+          || m == EDM_MCODE_GAP_HOLD
+#endif
+  );
+}
+
+static user_mcode_type_t mcode_check(user_mcode_t m) {
+  if (!is_edm_mcode(m)) {
+    return other_mcode_ptrs.check ? other_mcode_ptrs.check(m)
+                                  : UserMCode_Unsupported;
+  }
+
+  return UserMCode_Normal;
+}
+
+static status_code_t mcode_validate(parser_block_t* block) {
+  user_mcode_t code = block->user_mcode;
+
+  if (!is_edm_mcode(code)) {
+    return other_mcode_ptrs.validate ? other_mcode_ptrs.validate(block)
+                                     : Status_Unhandled;
+  }
+
+  switch ((int)code) {
+    case EDM_MCODE_READ:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != LOG_PRINT_NONE && v != LOG_PRINT_TEXT &&
+                         v != LOG_PRINT_BINARY && v != LOG_PRINT_SPECTRUM)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = LOG_PRINT_NONE;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+    case EDM_MCODE_LOG:
+      if (!block->words.s) {
+        return Status_GcodeValueWordMissing;
+      }
+      {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1 && v != 2)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      }
+#if EDM_LOG_PERSIST
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = 0;
+      }
+#endif
+      block->user_mcode_sync = true;
+      return Status_OK;
+    case EDM_MCODE_SERVO:
+      // Word flags are consumed here, so mark absent words as NAN for
+      // exec_mcode_servo().
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0 || v > 20) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 1000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < -100 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+    case EDM_MCODE_PROBE_FILTER:
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 1 || v > 32 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 1 || v > 32 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 1 || v > 510) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && (v < 1000 || v > 5000))) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+    case EDM_MCODE_WEAR_RESET:
+      if (block->words.mask != 0) {
+        return Status_GcodeUnusedWords;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#if EDM_WEAR_COMP_ENABLE
+    case EDM_MCODE_WEAR_COMP:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0.01f || v > 10000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_FLUSH_ENABLE
+    case EDM_MCODE_FLUSH:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0 || v > 3600) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 1 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 0.01f || v > 50) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_ORBIT_ENABLE
+    case EDM_MCODE_ORBIT:
+      if (orbit.timer == NULL) {
+        return Status_InvalidStatement;  // no timer or step injection
+      }
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) ||
+            (v != ORBIT_OFF && v != ORBIT_CIRCLE && v != ORBIT_SQUARE)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0.001f || v > 5) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0.05f || v > 60) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_ADAPT_ENABLE
+    case EDM_MCODE_ADAPT: {
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 1 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 1 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 1 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      float duty_min = isnan(block->values.p) ? adapt.duty_min : block->values.p;
+      float duty_max = isnan(block->values.q) ? adapt.duty_max : block->values.q;
+      if (duty_min > duty_max) {
+        return Status_GcodeValueOutOfRange;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+    }
+#endif
+#if EDM_ARC_ENABLE
+    case EDM_MCODE_ARC:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 1 || v > 100 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_CAPTURE_ENABLE
+    case EDM_MCODE_CAPTURE:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || v < 0 || v > CAP_TRIG_ALL || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0 || v > EDM_CAPTURE_POST || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || (v != 0 && v != 1 && v != 2)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = 0;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_THERMAL_ENABLE
+    case EDM_MCODE_THERMAL:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0 || v > 150 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 150 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 10 || v > 100 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_RETRACT_PROFILE
+    case EDM_MCODE_RETRACT:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 1 || v > 6000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 1 || v > 10000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 1 || v > 6000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_AUTOTUNE_ENABLE
+    case EDM_MCODE_AUTOTUNE:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 2 || v > 45) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 2 || v > 20 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      // L is an integer word, 0 (not stored) when absent.
+#if EDM_RECIPE_ENABLE
+      if (block->words.l) {
+        if (block->values.l > recipe.rec.n_steps) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.l = 0;
+      } else {
+        block->values.l = 0;
+      }
+#else
+      block->values.l = 0;
+#endif
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_TOUCHOFF_ENABLE
+    case EDM_MCODE_TOUCHOFF:
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 1 || v > 1000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0.1f || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 0.01f || v > 5) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      if (block->words.d) {
+        float v = block->values.d;
+        if (isnan(v) || v < 0.1f || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.d = 0;
+      } else {
+        block->values.d = NAN;
+      }
+      if (block->words.s) {
+        float v = block->values.s;
+        if (v != -1 && v != 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (edm_init_status != 0) {
+        return Status_SelfTestFailed;
+      }
+      if (!touch_power.valid) {
+        return Status_GcodeUnsupportedCommand;  // needs M503 or M504 first
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_SURFACE_MAP_ENABLE
+    case EDM_MCODE_SURFACE_MAP: {
+      float mode = NAN;
+      if (block->words.s) {
+        mode = block->values.s;
+        if (mode != 0 && mode != 1 && mode != 2) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      }
+      block->values.s = mode;
+      if (mode == 1) {
+        if (!block->words.p || !block->words.q || !block->words.r) {
+          return Status_GcodeValueWordMissing;
+        }
+        float x = block->values.p, y = block->values.q, d = block->values.r;
+        if (x < 0 || x > 500 || y < 0 || y > 500 || d < 0.5f || d > 100 ||
+            x / d + 1.5f >= EDM_SURFACE_MAP_N + 1 ||
+            y / d + 1.5f >= EDM_SURFACE_MAP_N + 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = block->words.q = block->words.r = 0;
+        if (block->words.d) {
+          float v = block->values.d;
+          if (isnan(v) || v < 0.1f || v > 100) {
+            return Status_GcodeValueOutOfRange;
+          }
+          block->words.d = 0;
+        } else {
+          block->values.d = NAN;
+        }
+        if (edm_init_status != 0) {
+          return Status_SelfTestFailed;
+        }
+        if (!touch_power.valid) {
+          return Status_GcodeUnsupportedCommand;  // needs M503 or M504 first
+        }
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+    }
+#endif
+#if EDM_RETRACT_VECTOR
+    case EDM_MCODE_RETRACT_VECTOR:
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < -1 || v > 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < -1 || v > 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < -1 || v > 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_ELECTRODE_ENABLE
+    case EDM_MCODE_ELECTRODE: {
+      if ((electrode_list = !block->words.l)) {
+        if (block->words.p || block->words.q || block->words.r ||
+            block->words.s) {
+          return Status_GcodeValueWordMissing;
+        }
+        block->user_mcode_sync = true;
+        return Status_OK;
+      }
+      if (block->values.l < 1) {
+        return Status_GcodeValueOutOfRange;
+      }
+      block->words.l = 0;
+      bool defined = electrode_find(block->values.l) >= 0;
+      if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1) || (v == 0 && !defined)) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (!defined && block->values.s != 0 && electrode_find(0) < 0) {
+        return Status_GcodeValueOutOfRange;  // library full
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0.01f || v > 10000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 100) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+#if EDM_RECIPE_ENABLE
+      if (block->words.r) {
+        float v = block->values.r;
+        if (isnan(v) || v < 0 || v > EDM_RECIPE_STEPS || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+#else
+      block->values.r = NAN;
+#endif
+      block->user_mcode_sync = true;
+      return Status_OK;
+    }
+#endif
+#if EDM_GAP_HOLD_ENABLE
+    case EDM_MCODE_GAP_HOLD:
       if (block->words.s) {
+        float v = block->values.s;
+        if (isnan(v) || (v != 0 && v != 1)) {
+          return Status_GcodeValueOutOfRange;
+        }
         block->words.s = 0;
+      } else {
+        block->values.s = NAN;
+      }
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0 || v > 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
       }
       block->user_mcode_sync = true;
       return Status_OK;
-    case EDM_MCODE_LOG:
-      if (!block->words.s) {
+#endif
+#if EDM_PULSER_SIM
+    case EDM_MCODE_SIM:
+      if (block->words.p) {
+        float v = block->values.p;
+        if (isnan(v) || v < 0 || v > 10000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 65535 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+#endif
+#if EDM_RECIPE_ENABLE
+    case EDM_MCODE_RECIPE_STEP: {
+      // L (step, an integer word): defined in order, S0 deletes an existing
+      // step
+      uint8_t l = block->values.l;
+      float v = block->values.s;
+      if (!block->words.l || !block->words.s) {
         return Status_GcodeValueWordMissing;
       }
-      {
+      if (v != 0 && v != 1 && v != 2) {
+        return Status_GcodeValueOutOfRange;
+      }
+      if (l < 1 || l > EDM_RECIPE_STEPS || l > recipe.rec.n_steps + (v != 0)) {
+        return Status_GcodeValueOutOfRange;
+      }
+      block->words.l = block->words.s = 0;
+      if (block->words.p) {
+        v = block->values.p;
+        if (isnan(v) || v < 100 || v > 1000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.p = 0;
+      } else {
+        block->values.p = NAN;
+      }
+      if (block->words.q) {
+        v = block->values.q;
+        if (isnan(v) || v < 0 || v > 20) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      if (block->words.r) {
+        v = block->values.r;
+        if (isnan(v) || v < 1 || v > 95) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      block->user_mcode_sync = true;
+      return Status_OK;
+    }
+    case EDM_MCODE_RECIPE_END: {
+      uint8_t l = block->values.l;  // integer word
+      float p = block->values.p;
+      if (!block->words.l || !block->words.p) {
+        return Status_GcodeValueWordMissing;
+      }
+      if (l < 1 || l > recipe.rec.n_steps) {
+        return Status_GcodeValueOutOfRange;
+      }
+      if (p != (int)p || p < RECIPE_END_NONE || p > RECIPE_END_PULSES) {
+        return Status_GcodeValueOutOfRange;
+      }
+      if (p != RECIPE_END_NONE && !block->words.q) {
+        return Status_GcodeValueWordMissing;
+      }
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 4000000) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = 0;
+      }
+      block->words.l = block->words.p = 0;
+      block->user_mcode_sync = true;
+      return Status_OK;
+    }
+    case EDM_MCODE_RECIPE_RUN: {
+      if (block->words.s) {
         float v = block->values.s;
-        if (isnan(v) || (v != 0 && v != 1)) {
+        if (v != 0 && v != 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        if (v == 1 && recipe.rec.n_steps == 0) {
           return Status_GcodeValueOutOfRange;
         }
         block->words.s = 0;
+      } else {
+        block->values.s = NAN;
       }
-      block->user_mcode_sync = true;
+      if (block->words.q) {
+        float v = block->values.q;
+        if (isnan(v) || v < 0 || v > 255 || v != (int)v) {
+          return Status_GcodeValueOutOfRange;
+        }
+        block->words.q = 0;
+      } else {
+        block->values.q = NAN;
+      }
+      bool queued = false;
+      if (block->words.l) {
+        float v = block->values.l;
+        if (v != 0 && v != 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        queued = v == 1 && block->values.s == 1;
+        block->words.l = 0;
+      }
+      if (block->values.s == 1 && edm_init_status != 0) {
+        return Status_SelfTestFailed;
+      }
+      block->values.l = queued && !power_queue_full();
+      block->user_mcode_sync = !block->values.l;
       return Status_OK;
-    case EDM_MCODE_STOP:
+    }
+#endif
+    case EDM_MCODE_STOP: {
+      bool queued = false;
+      if (block->words.l) {
+        float v = block->values.l;
+        if (v != 0 && v != 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        queued = v == 1;
+        block->words.l = 0;
+      }
       if (block->words.mask != 0) {
         return Status_GcodeUnusedWords;
       }
       if (edm_init_status != 0) {
         return Status_SelfTestFailed;
       }
-      block->user_mcode_sync = true;
+      block->values.l = queued && !power_queue_full();
+      block->user_mcode_sync = !block->values.l;
       return Status_OK;
+    }
     default: {
+      // Word flags are consumed here, so mark absent words as NAN for
+      // mcode_execute().
       // P (pulse duration): 100us~1000us is allowed
       if (block->words.p) {
         float v = block->values.p;
@@ -312,6 +6303,8 @@ static status_code_t mcode_validate(parser_block_t* block) {
           return Status_GcodeValueOutOfRange;
         }
         block->words.p = 0;
+      } else {
+        block->values.p = NAN;
       }
       // Q (pulse current): 0(min)~20(A) is allowed
       if (block->words.q) {
@@ -320,6 +6313,8 @@ static status_code_t mcode_validate(parser_block_t* block) {
           return Status_GcodeValueOutOfRange;
         }
         block->words.q = 0;
+      } else {
+        block->values.q = NAN;
       }
       // R (duty factor): 1~95 is allowed
       if (block->words.r) {
@@ -328,11 +6323,24 @@ static status_code_t mcode_validate(parser_block_t* block) {
           return Status_GcodeValueOutOfRange;
         }
         block->words.r = 0;
+      } else {
+        block->values.r = NAN;
+      }
+      // L (queued): 0 or 1
+      bool queued = false;
+      if (block->words.l) {
+        float v = block->values.l;
+        if (v != 0 && v != 1) {
+          return Status_GcodeValueOutOfRange;
+        }
+        queued = v == 1;
+        block->words.l = 0;
       }
       if (edm_init_status != 0) {
         return Status_SelfTestFailed;
       }
-      block->user_mcode_sync = true;
+      block->values.l = queued && !power_queue_full();
+      block->user_mcode_sync = !block->values.l;
       return Status_OK;
     }
   }
@@ -348,40 +6356,159 @@ static void mcode_execute(uint_fast16_t state, parser_block_t* block) {
   }
 
   if (code == EDM_MCODE_READ) {
-    exec_mcode_read(block->words.s);
+    exec_mcode_read((int)block->values.s);
   } else if (code == EDM_MCODE_LOG) {
     bool enable = block->values.s > 0;
-    exec_mode_log(enable);
+    bool stream = block->values.s == 2;
+#if EDM_LOG_PERSIST
+    exec_mode_log(enable, stream, block->values.p > 0);
+#else
+    exec_mode_log(enable, stream, false);
+#endif
   } else if (code == EDM_MCODE_START_TNEG || code == EDM_MCODE_START_TPOS) {
     bool is_tneg = (code == EDM_MCODE_START_TNEG);
 
     int pulse_dur_10us = 50;  // 500us default
-    if (block->words.p) {
+    if (!isnan(block->values.p)) {
       pulse_dur_10us = block->values.p * 0.1f;
     }
     int pulse_current_100ma = 10;  // 1A default
-    if (block->words.q) {
+    if (!isnan(block->values.q)) {
       pulse_current_100ma = block->values.q * 10;
       if (pulse_current_100ma == 0) {
         pulse_current_100ma = 1;  // 100mA (minimum)
       }
     }
     int pulse_duty_pct = 25;  // 25% default
-    if (block->words.r) {
+    if (!isnan(block->values.r)) {
       pulse_duty_pct = block->values.r;
     }
 
-    exec_mcode_start(is_tneg, pulse_dur_10us, pulse_current_100ma,
-                     pulse_duty_pct);
+    if (block->values.l) {
+      queue_power_change((power_change_t){
+          .energize = true,
+          .tool_neg = is_tneg,
+          .pulse_dur_10us = pulse_dur_10us,
+          .pulse_current_100ma = pulse_current_100ma,
+          .pulse_duty_pct = pulse_duty_pct,
+      });
+    } else {
+      power_queue_clear();
+      exec_mcode_start(is_tneg, pulse_dur_10us, pulse_current_100ma,
+                       pulse_duty_pct);
+    }
   } else if (code == EDM_MCODE_STOP) {
-    exec_mcode_stop();
+    if (block->values.l) {
+      queue_power_change((power_change_t){.energize = false});
+    } else {
+      power_queue_clear();
+      exec_mcode_stop();
+    }
+  } else if (code == EDM_MCODE_SERVO) {
+    exec_mcode_servo(block);
+  } else if (code == EDM_MCODE_PROBE_FILTER) {
+    exec_mcode_probe_filter(block);
+  } else if (code == EDM_MCODE_WEAR_RESET) {
+    exec_mcode_wear_reset();
+  }
+#if EDM_WEAR_COMP_ENABLE
+  else if (code == EDM_MCODE_WEAR_COMP) {
+    exec_mcode_wear_comp(block);
+  }
+#endif
+#if EDM_FLUSH_ENABLE
+  else if (code == EDM_MCODE_FLUSH) {
+    exec_mcode_flush(block);
+  }
+#endif
+#if EDM_ORBIT_ENABLE
+  else if (code == EDM_MCODE_ORBIT) {
+    exec_mcode_orbit(block);
+  }
+#endif
+#if EDM_ADAPT_ENABLE
+  else if (code == EDM_MCODE_ADAPT) {
+    exec_mcode_adapt(block);
+  }
+#endif
+#if EDM_ARC_ENABLE
+  else if (code == EDM_MCODE_ARC) {
+    exec_mcode_arc(block);
+  }
+#endif
+#if EDM_CAPTURE_ENABLE
+  else if (code == EDM_MCODE_CAPTURE) {
+    exec_mcode_capture(block);
+  }
+#endif
+#if EDM_THERMAL_ENABLE
+  else if (code == EDM_MCODE_THERMAL) {
+    exec_mcode_thermal(block);
   }
+#endif
+#if EDM_PULSER_SIM
+  else if (code == EDM_MCODE_SIM) {
+    exec_mcode_sim(block);
+  }
+#endif
+#if EDM_RECIPE_ENABLE
+  else if (code == EDM_MCODE_RECIPE_STEP) {
+    exec_mcode_recipe_step(block);
+  } else if (code == EDM_MCODE_RECIPE_END) {
+    exec_mcode_recipe_end(block);
+  } else if (code == EDM_MCODE_RECIPE_RUN) {
+    exec_mcode_recipe_run(block);
+  }
+#endif
+#if EDM_RETRACT_PROFILE
+  else if (code == EDM_MCODE_RETRACT) {
+    exec_mcode_retract(block);
+  }
+#endif
+#if EDM_AUTOTUNE_ENABLE
+  else if (code == EDM_MCODE_AUTOTUNE) {
+    exec_mcode_autotune(block);
+  }
+#endif
+#if EDM_TOUCHOFF_ENABLE
+  else if (code == EDM_MCODE_TOUCHOFF) {
+    exec_mcode_touchoff(block);
+  }
+#endif
+#if EDM_SURFACE_MAP_ENABLE
+  else if (code == EDM_MCODE_SURFACE_MAP) {
+    exec_mcode_surface_map(block);
+  }
+#endif
+#if EDM_RETRACT_VECTOR
+  else if (code == EDM_MCODE_RETRACT_VECTOR) {
+    exec_mcode_retract_vector(block);
+  }
+#endif
+#if EDM_ELECTRODE_ENABLE
+  else if (code == EDM_MCODE_ELECTRODE) {
+    exec_mcode_electrode(block);
+  }
+#endif
+#if EDM_GAP_HOLD_ENABLE
+  else if (code == EDM_MCODE_GAP_HOLD) {
+    exec_mcode_gap_hold(block);
+  }
+#endif
 }
 
 static void edm_probe_completed() {
   // stop discharge to minimize work damage.
   set_gate(false);
 
+  // Report the position latched at first contact instead of the position
+  // where the contact filter (and so the stepper) stopped.
+  if (sys.flags.probe_succeeded && probe_filter.contact_latched &&
+      !probe_filter.invert) {
+    memcpy(sys.probe_position, (int32_t*)probe_filter.contact_position,
+           sizeof(sys.probe_position));
+  }
+
   bool ok = write_reg(REG_POLARITY, 0);  // OFF
   if (!ok) {
     system_raise_alarm(Alarm_SelftestFailed);
@@ -397,12 +6524,22 @@ static void edm_probe_completed() {
 ////////////////////////////////////////////////////////////////////////////////
 // EDM Probe
 
+static void set_poll_rate(uint32_t rate_hz);
+
+// \param is_probe_away true if probing away from the workpiece, false
+// otherwise. When probing away the signal must be inverted in the
+// probe_get_state_ptr() implementation.
+// \param probing true if probe cycle is active, false otherwise.
 void edm_probe_configure(bool is_probe_away, bool probing) {
-  // Maybe nothing is needed here?
-  // \param is_probe_away true if probing away from the workpiece, false
-  // otherwise. When probing away the signal must be inverted in the
-  // probe_get_state_ptr() implementation.
-  // \param probing true if probe cycle is active, false otherwise.
+  probe_filter.invert = is_probe_away;
+  if (probing && !probe_filter.probing) {
+    probe_filter_reset();
+  }
+  probe_filter.probing = probing;
+
+  if (probe_filter.burst_hz > 0) {
+    set_poll_rate(probing ? probe_filter.burst_hz : EDM_POLL_RATE_HZ);
+  }
 }
 
 void edm_probe_connected_toggle() {
@@ -412,7 +6549,7 @@ void edm_probe_connected_toggle() {
 // NOTE: Called from stepping interrupt, must run extremely quickly.
 probe_state_t edm_probe_get_state() {
   probe_state_t state = {0};
-  state.triggered = edm_has_current;
+  state.triggered = probe_filter.triggered ^ probe_filter.invert;
   state.connected = true;  // always connected
   return state;
 }
@@ -420,55 +6557,494 @@ probe_state_t edm_probe_get_state() {
 ////////////////////////////////////////////////////////////////////////////////
 // Timer
 
+// Raw PULSER telemetry (REG_CKP_N_PULSE block).
+typedef struct {
+  uint32_t t_us;  // hal.get_micros() time when the read was started
+  uint8_t n_pulse;
+  uint8_t r_pulse;
+  uint8_t r_short;
+  uint8_t r_open;
+} pulser_sample_t;
+
+// Poll is started from timer (or foreground) and completed in I2C interrupt.
+// Completed samples are published through a double buffer; poll_front always
+// points to a fully written sample, so readers never see a torn update.
+// With several PULSER units the reads are queued together and run back to
+// back; the poll completes with the last one.
+static uint8_t poll_buf[EDM_PULSER_COUNT][6];
+static i2c_transaction_t poll_tx[EDM_PULSER_COUNT];
+static pulser_sample_t poll_samples[2];
+static volatile uint8_t poll_front = 0;
+static volatile bool poll_busy = false;
+static volatile uint8_t poll_pending;  // reads still in flight
+static volatile bool poll_failed;
+static volatile uint32_t poll_start_us;
+static volatile uint32_t poll_lat_hist[EDM_PERF_LAT_BINS];
+static uint32_t poll_rate_hz = EDM_POLL_RATE_HZ;
+static int32_t poll_start_position[N_AXIS];  // only updated while probing
+
+// Raise retract request. Called from interrupt context.
+static inline void signal_short(void) {
+  if (!short_pending) {
+    short_detect_cycles = DWT->CYCCNT;
+    short_pending = true;
+  }
+  hal.edm_state.discharge_short = true;
+}
+
+// Called from stepper interrupt when retract starts.
+ITCM_CODE void edm_retract_started(void) {
+  edm_stats.in_retract = true;
+  edm_stats.retract_start_cycles = DWT->CYCCNT;
+  edm_stats.retract_cnt++;
+  TRACE(TraceEvent_RetractOn, edm_stats.retract_cnt);
+
+  if (!short_pending) {
+    return;
+  }
+  short_pending = false;
+
+  uint32_t us = (DWT->CYCCNT - short_detect_cycles) / hal.f_mcu;
+  retract_latency.last_us = us;
+  if (us > retract_latency.max_us) {
+    retract_latency.max_us = us;
+  }
+  retract_latency.count++;
+}
+
+// Retracts longer than one DWT->CYCCNT wrap (~7.8 sec at 550MHz) are
+// under-counted.
+ITCM_CODE void edm_retract_ended(void) {
+  if (!edm_stats.in_retract) {
+    return;
+  }
+  edm_stats.in_retract = false;
+  uint32_t us = (DWT->CYCCNT - edm_stats.retract_start_cycles) / hal.f_mcu;
+  edm_stats.retract_total_us += us;
+  TRACE(TraceEvent_RetractOff, us);
+}
+
+#ifdef EDM_SHORT_AUX_INPUT
+static uint8_t short_port = EDM_SHORT_AUX_INPUT;
+
+static void edm_short_irq(uint8_t port, bool state) {
+  signal_short();
+}
+#endif
+
+#if EDM_GAP_ADC_ENABLE
+// Called from ADC (watchdog) or timer interrupt on gap state change.
+static void edm_gap_event(edm_gap_state_t state) {
+  edm_has_current = state != EdmGap_Open;
+  if (state == EdmGap_Short) {
+    signal_short();
+  }
+}
+#endif
+
+#if EDM_PULSER_COUNT > 1
+// Per unit telemetry, for M550.
+typedef struct {
+  uint32_t errs;
+  uint32_t shorts;
+  bool in_short;
+  uint8_t r_pulse;
+  uint8_t r_short;
+  uint8_t r_open;
+} pulser_unit_t;
+
+static volatile pulser_unit_t units[EDM_PULSER_COUNT];
+static volatile uint8_t units_shorted;  // bit per unit, of the latest poll
+
+static void print_units() {
+  char resp[128];
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    size_t ofs = snprintf(resp, sizeof(resp), "[EDMU|unit=%d,addr=0x%02x,", u,
+                          pulser_addr[u]);
+    ofs += temp_report(u, resp + ofs, sizeof(resp) - ofs);
+    snprintf(resp + ofs, sizeof(resp) - ofs,
+             ",perr=%" PRIu32 ",shorts=%" PRIu32 ",r=%d/%d/%d]" ASCII_EOL,
+             units[u].errs, units[u].shorts, units[u].r_pulse, units[u].r_short,
+             units[u].r_open);
+    hal.stream.write(resp);
+  }
+}
+#endif
+
+// Processes one REG_CKP_N_PULSE block taken at t_us.
+static void process_sample(uint32_t t_us, const uint8_t* regs) {
+  uint8_t back = poll_front ^ 1;
+  pulser_sample_t* sample = &poll_samples[back];
+  sample->t_us = t_us;
+  sample->n_pulse = regs[0];
+  sample->r_pulse = regs[3];
+  sample->r_short = regs[4];
+  sample->r_open = regs[5];
+  poll_front = back;
+#if WATCHDOG_ENABLE
+  watchdog_alive(wdt_edm);
+#endif
+  TRACE(TraceEvent_EdmPoll,
+        regs[0] | regs[3] << 8 | regs[4] << 16 | (uint32_t)regs[5] << 24);
+
+  // Gap ADC, when running, tracks current directly at a much higher rate.
+  if (!gap_adc_ok) {
+    edm_has_current = (sample->r_pulse > 0 || sample->r_short > 0);
+  }
+
+  if (sample->r_short > 127) {
+    // retract request
+    signal_short();
+#if EDM_CAPTURE_ENABLE
+    if (!edm_stats.in_short) {
+      capture_trigger(CAP_TRIG_SHORT);
+    }
+#endif
+  }
+
+  servo_update(sample->t_us, sample->r_open, sample->r_short);
+#if EDM_FLUSH_ENABLE
+  flush_sample(sample->r_short);
+#endif
+#if EDM_ADAPT_ENABLE
+  adapt_sample(sample->r_open, sample->r_short);
+#endif
+  probe_filter_update(sample->t_us, poll_start_position, sample->r_pulse,
+                      sample->r_short);
+  uint32_t n_pulse = sample->n_pulse;
+#if EDM_PULSE_CAPTURE_ENABLE
+  // Exact count, the 8-bit PULSER counter wraps at high pulse rates.
+  if (pulse_capture_ok) {
+    n_pulse = update_capture_stats();
+  }
+#endif
+#if EDM_ARC_ENABLE
+  arc_sample(sample->r_pulse, sample->r_short, sample->r_open);
+#endif
+  update_stats(sample->t_us, sample->r_pulse, sample->r_short, sample->r_open,
+               n_pulse);
+  update_wear(n_pulse);
+
+  log_entry_t entry = {
+      .t_us = sample->t_us,
+#if EDM_PULSER_COUNT > 1
+      .status_flags = (sys.step_control.execute_sys_motion ? ST_MOTION : 0) |
+                      units_shorted << ST_UNIT_SHORT_SHIFT,
+#else
+      .status_flags = sys.step_control.execute_sys_motion ? ST_MOTION : 0,
+#endif
+      .r_open = sample->r_open,
+      .r_short = sample->r_short,
+      .r_pulse = sample->r_pulse,
+      .n_pulse = n_pulse > 255 ? 255 : n_pulse,
+  };
+  if (edm_log.active) {
+    add_log(entry);
+  }
+#if EDM_CAPTURE_ENABLE
+  capture_add(entry);
+#endif
+  edm_poll_cnt++;
+}
+
+// Merges the blocks of all units into one. They share the feed axis, so the
+// narrowest gap rules: a short on any unit retracts, the servo advances by
+// the least open one. Pulses add up.
+static void process_units(uint32_t t_us) {
+#if EDM_PULSER_COUNT > 1
+  uint8_t merged[6] = {0, 0, 0, 0, 0, 255};
+  uint32_t n_pulse = 0;
+  uint32_t r_pulse = 0;
+  uint8_t shorted = 0;
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    const uint8_t* regs = poll_buf[u];
+    bool is_short = regs[4] > 127;
+    if (is_short) {
+      shorted |= 1 << u;
+      if (!units[u].in_short) {
+        units[u].shorts++;
+      }
+    }
+    units[u].in_short = is_short;
+    units[u].r_pulse = regs[3];
+    units[u].r_short = regs[4];
+    units[u].r_open = regs[5];
+
+    n_pulse += regs[0];
+    r_pulse += regs[3];
+    if (regs[4] > merged[4]) {
+      merged[4] = regs[4];
+    }
+    if (regs[5] < merged[5]) {
+      merged[5] = regs[5];
+    }
+  }
+  merged[0] = n_pulse > 255 ? 255 : n_pulse;
+  merged[3] = r_pulse / EDM_PULSER_COUNT;
+  units_shorted = shorted;
+  process_sample(t_us, merged);
+#else
+  process_sample(t_us, poll_buf[0]);
+#endif
+}
+
+// Called from I2C interrupt when a poll read finishes.
+static void edm_poll_complete(bool ok, void* context) {
+  if (!ok) {
+    poll_failed = true;
+#if EDM_PULSER_COUNT > 1
+    units[(uintptr_t)context].errs++;
+#endif
+  }
+  if (--poll_pending > 0) {
+    return;
+  }
+  poll_busy = false;
+  uint32_t bin = 32 - __CLZ((uint32_t)hal.get_micros() - poll_start_us);
+  poll_lat_hist[bin < EDM_PERF_LAT_BINS ? bin : EDM_PERF_LAT_BINS - 1]++;
+  if (poll_failed) {
+    edm_poll_err_cnt++;
+    invalidate_reg_shadow();
+    return;
+  }
+  process_units(poll_start_us);
+}
+
+#if EDM_PULSER_CAN
+// PULSER telemetry pushed over CAN-FD, see EDM_PULSER_CAN_ID. Frame:
+//   [0] number of samples n (1..10), [1] sample period (10us units),
+//   [2 + 6 * i] REG_CKP_N_PULSE block of sample i, oldest first.
+// The last sample is timestamped at reception, earlier ones a period apart.
+// I2C polling is suspended while frames keep arriving.
+static volatile bool can_telemetry = false;
+static volatile uint32_t can_last_us = 0;
+static uint32_t can_frame_cnt = 0;
+
+// Called from FDCAN interrupt.
+static void pulser_can_rx(uint32_t id, const uint8_t* data, uint8_t len) {
+  uint32_t t_us = (uint32_t)hal.get_micros();
+  uint8_t n = data[0];
+  if (len < 2 || n == 0 || len < 2 + 6 * n) {
+    edm_poll_err_cnt++;
+    return;
+  }
+  can_last_us = t_us;
+  can_telemetry = true;
+  can_frame_cnt++;
+  uint32_t period_us = data[1] * 10;
+  if (probe_filter.probing) {
+    memcpy(poll_start_position, sys.position, sizeof(poll_start_position));
+  }
+  for (uint8_t i = 0; i < n; i++) {
+    process_sample(t_us - (n - 1 - i) * period_us, &data[2 + 6 * i]);
+  }
+}
+
+static void pulser_can_start() {
+  // Command: [0] 1 = push telemetry, [1..2] sample rate (Hz, little endian).
+  const uint8_t cmd[3] = {1, EDM_PULSER_CAN_RATE_HZ & 0xff,
+                          EDM_PULSER_CAN_RATE_HZ >> 8};
+  if (can_fd_start(EDM_PULSER_CAN_BAUD) &&
+      can_fd_add_filter(EDM_PULSER_CAN_ID, 0x7ff, false, pulser_can_rx)) {
+    can_fd_put(EDM_PULSER_CAN_ID + 1, false, cmd, sizeof(cmd));
+  }
+}
+#endif
+
+// Start I2C poll; result is handled in edm_poll_complete().
+// Sample is skipped (and counted) if previous poll is still in flight or TMC2209
+// soft UART is mid-datagram. The read is queued at high priority, so it starts
+// ahead of any pending low priority transfer as soon as the bus is free.
+static void edm_poll_start(void) {
+  temp_sample_tick();
+#if EDM_PULSER_CAN
+  if (can_telemetry) {
+    if ((uint32_t)hal.get_micros() - can_last_us < EDM_PULSER_CAN_TIMEOUT_US) {
+      return;
+    }
+    can_telemetry = false;  // fall back to polling
+  }
+#endif
+  if (poll_busy
+#if TRINAMIC_UART_ENABLE
+      || tmc_uart_busy()
+#endif
+  ) {
+    edm_poll_skip_cnt++;
+    return;
+  }
+
+  poll_start_us = (uint32_t)hal.get_micros();
+  if (probe_filter.probing) {
+    // Latch position with the sample so that contact is placed where it
+    // happened (to within one poll period), not where the filter triggered.
+    __disable_irq();
+    memcpy(poll_start_position, sys.position, sizeof(poll_start_position));
+    __enable_irq();
+  }
+  poll_busy = true;
+  poll_failed = false;
+  poll_pending = EDM_PULSER_COUNT;
+#if EDM_PULSER_SIM
+  sim_poll(poll_buf[0]);
+  edm_poll_complete(true, (void*)0);
+  return;
+#endif
+  for (int u = 0; u < EDM_PULSER_COUNT; u++) {
+    i2c_transaction_t* tx = &poll_tx[u];
+    tx->bus = I2C_BusPulser;
+    tx->op = I2C_OpMemRead;
+    tx->priority = I2C_PriorityHigh;
+    tx->address = pulser_addr[u];
+    tx->word_addr = REG_CKP_N_PULSE;
+    tx->word_addr_bytes = 1;
+    tx->count = sizeof(poll_buf[u]);
+    tx->data = poll_buf[u];
+    tx->callback = edm_poll_complete;
+    tx->context = (void*)(uintptr_t)u;
+    i2c_queue_transaction(tx);  // only fails on an invalid transaction
+  }
+}
+
+// Called from timer interrupt at EDM_POLL_RATE_HZ.
+static void edm_poll_tick(void* context) {
+  edm_poll_start();
+}
+
 on_execute_realtime_ptr other_realtime;
 
+// Fallback sampling when no hardware timer is available.
 static void edm_realtime(sys_state_t s) {
   if (other_realtime) {
     other_realtime(s);
   }
 
-  // Limit to 1ms polling rate.
+  if (gate_forced_off) {
+    gate_forced_off = false;
+    set_gate(false);
+  }
+  apply_power_changes();
+#if EDM_CAPTURE_ENABLE
+  static sys_state_t prev_state = STATE_IDLE;
+  if ((s & STATE_ALARM) && !(prev_state & STATE_ALARM)) {
+    capture_trigger(CAP_TRIG_ALARM);
+  }
+  prev_state = s;
+#endif
+#if EDM_GATE_BREAK_ENABLE
+  gate_break_update(s);
+#endif
+  persist_wear();
+#if EDM_WEAR_COMP_ENABLE
+  wear_comp_update();
+#endif
+#if EDM_SURFACE_MAP_ENABLE
+  surface_map_update();
+#endif
+#if EDM_FLUSH_ENABLE
+  flush_update(s);
+#endif
+#if EDM_GAP_HOLD_ENABLE
+  gap_hold_update(s);
+#endif
+#if EDM_ADAPT_ENABLE
+  adapt_update(s);
+#endif
+#if EDM_ARC_ENABLE
+  arc_update(s);
+#endif
+#if EDM_THERMAL_ENABLE
+  thermal_update(s);
+#endif
+#if EDM_HOLD_CURRENT_ENABLE
+  hold_update(s);
+#endif
+#if EDM_RECIPE_ENABLE
+  recipe_update(s);
+#endif
+#if EDM_AUTOTUNE_ENABLE
+  tune_update();
+#endif
+#if EDM_ELECTRODE_ENABLE
+  electrode_update(s);
+#endif
+
+  if (edm_log.streaming) {
+    edm_stream_drain();
+  }
+#if EDM_LOG_PERSIST
+  if (edm_log.persisting) {
+    edm_persist_drain();
+  }
+#endif
+
+  // Fallback polling when no hardware timer could be claimed.
+  if (poll_timer) {
+    return;
+  }
   uint64_t t_curr = hal.get_micros();
-  if (t_curr - last_poll_tick_us < 1000) {
+  if (t_curr - last_poll_tick_us < EDM_POLL_PERIOD_US) {
     return;
   }
   last_poll_tick_us = t_curr;
 
-  // Do I2C poll
-  uint8_t buf[6];
-  i2c_transfer_t tx;
-  tx.address = PULSER_ADDR;
-  tx.word_addr = REG_CKP_N_PULSE;
-  tx.word_addr_bytes = 1;
-  tx.count = 6;
-  tx.data = buf;
-  tx.no_block = false;
-  if (!i2c_transfer(&tx, true)) {
-    return;
+  edm_poll_start();
+}
+
+bool edm_active(void) {
+#if EDM_LOG_PERSIST
+  if (edm_log.persisting) {
+    return true;
   }
+#endif
+  return edm_removal_active || edm_log.streaming || !poll_timer;
+}
 
-  uint8_t n_pulse = buf[0];
-  uint8_t r_pulse = buf[3];
-  uint8_t r_short = buf[4];
-  uint8_t r_open = buf[5];
-  edm_has_current = (r_pulse > 0 || r_short > 0);
+void edm_get_telemetry(edm_telemetry_t* t) {
+  const pulser_sample_t* sample = &poll_samples[poll_front];
+  t->t_us = sample->t_us;
+  t->r_pulse = sample->r_pulse;
+  t->r_short = sample->r_short;
+  t->r_open = sample->r_open;
+  t->energized = edm_removal_active;
+  t->retracting = edm_stats.in_retract;
+  t->servo_period_q16 = edm_servo_period_q16;
+  t->pulses = (uint32_t)edm_stats.total_pulses;
+  t->shorts = edm_stats.short_cnt;
+  t->retracts = edm_stats.retract_cnt;
 
-  if (r_short > 127) {
-    // retract request
-    hal.edm_state.discharge_short = true;
+  __disable_irq();
+  uint64_t cut_us = energized_total_us;
+  if (edm_removal_active) {
+    cut_us += hal.get_micros() - energized_start_us;
   }
+  __enable_irq();
+  t->cut_ms = (uint32_t)(cut_us / 1000);
+  t->energy_j = (wear.charge_uc[POL_TNEG] + wear.charge_uc[POL_TPOS]) * 1e-6f *
+                EDM_GAP_VOLTAGE;
+}
 
-  if (edm_log.active) {
-    log_entry_t entry = {
-        .status_flags = sys.step_control.execute_sys_motion ? ST_MOTION : 0,
-        .r_open = r_open,
-        .r_short = r_short,
-        .r_pulse = r_pulse,
-        .n_pulse = n_pulse,
-    };
-    add_log(entry);
+void edm_get_perf(edm_perf_t* p) {
+  p->polls = edm_poll_cnt;
+  p->poll_errs = edm_poll_err_cnt;
+  p->poll_skips = edm_poll_skip_cnt;
+  p->poll_hz = poll_rate_hz;
+  for (int i = 0; i < EDM_PERF_LAT_BINS; i++) {
+    p->lat_hist[i] = poll_lat_hist[i];
   }
-  edm_poll_cnt++;
+  __disable_irq();
+  p->rlat_last_us = retract_latency.last_us;
+  p->rlat_max_us = retract_latency.max_us;
+  p->rlat_count = retract_latency.count;
+  __enable_irq();
+}
+
+uint8_t edm_recipe_step(void) {
+#if EDM_RECIPE_ENABLE
+  return recipe.running ? recipe.step + 1 : 0;
+#else
+  return 0;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -489,13 +7065,43 @@ static void edm_report_options(bool newopt) {
 ////////////////////////////////////////////////////////////////////////////////
 // Plugin Init
 
+// Change poll timer rate. No-op in realtime-loop fallback mode.
+static void set_poll_rate(uint32_t rate_hz) {
+  if (poll_timer) {
+    // timerStart() and counter reload each add one tick.
+    hal.timer.start(poll_timer, 1000000 / rate_hz - 2);
+    poll_rate_hz = rate_hz;
+  }
+}
+
+static void pulser_negotiate(void* data) {
+  // The bus rate follows the first unit, others are expected to keep up.
+#if !EDM_PULSER_SIM
+  i2c_bus_negotiate(I2C_BusPulser, pulser_addr[0]);
+#endif
+  BOOT_MARK("pulser_i2c");
+}
+
 void edm_init() {
   // Register report printer.
   other_reports = grbl.on_report_options;
   grbl.on_report_options = edm_report_options;
 
   // Init logging. This must come before edm_realtime starting.
+  if ((edm_nvs_address = nvs_alloc(sizeof(edm_settings_t)))) {
+    settings_register(&edm_setting_details);
+  }
   init_log();
+  reset_stats();
+  load_wear();
+#if EDM_RECIPE_ENABLE
+  load_recipe();
+#endif
+#if EDM_ELECTRODE_ENABLE
+  load_electrodes();
+  other_tool_changed = grbl.on_tool_changed;
+  grbl.on_tool_changed = edm_tool_changed;
+#endif
 
   // Register M-code handler by appending to the call chain.
   memcpy(&other_mcode_ptrs, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
@@ -504,9 +7110,38 @@ void edm_init() {
   grbl.user_mcode.execute = mcode_execute;
 
   i2c_start();
+#if BOOT_DEFER_INIT
+  // Probing an absent PULSER at each fallback speed takes ~100ms.
+  protocol_enqueue_foreground_task(pulser_negotiate, NULL);
+#else
+  pulser_negotiate(NULL);
+#endif
 
+#if WATCHDOG_ENABLE
+  wdt_edm = watchdog_register("EDM", EDM_WATCHDOG_DEADLINE_MS, false);
+#endif
   init_gate();
   set_gate(false);  // ensure it's off
+#if EDM_GATE_BREAK_ENABLE
+  // Short comparator and e-stop cut the gate in hardware.
+  gate_break.ok = gate_pwm_ok && edm_gate_pwm_break_init(edm_gate_break);
+#endif
+
+#if EDM_GAP_ADC_ENABLE
+  // Second feedback channel: gap voltage sampled on-MCU, shorts are signalled
+  // from the ADC watchdog instead of waiting for the next PULSER poll.
+  gap_adc_ok = edm_gap_adc_init(edm_gap_event);
+#endif
+
+#if EDM_PULSE_CAPTURE_ENABLE
+  // Discharges counted and timed on-MCU, claims its timer before the poll timer.
+  pulse_capture_ok = edm_pulse_capture_init();
+#endif
+
+#if EDM_SERVO_REF_ENABLE
+  // Analog feed reference for an external servo head, following the servo.
+  servo_ref_ok = edm_servo_ref_init();
+#endif
 
   // Register EDM virtual probe to HAL.
   hal.probe.configure = edm_probe_configure;
@@ -517,13 +7152,61 @@ void edm_init() {
   other_probe_completed = grbl.on_probe_completed;
   grbl.on_probe_completed = edm_probe_completed;
 
-  // Register PULSER polling as rate-limited "realtime" process.
-  // This is better than hal.timers based approach.
-  // Doing I2C in timer will cause TMC2209 init to fail, as they're bit-banging
-  // serial comm is very sensitive to timing.
+  other_reset = grbl.on_reset;
+  grbl.on_reset = edm_reset;
+
+#if EDM_GAP_HOLD_ENABLE
+  other_state_change = grbl.on_state_change;
+  grbl.on_state_change = gap_hold_state_change;
+#endif
+
+#if EDM_ORBIT_ENABLE
+  timer_cfg_t orbit_cfg = {
+      .single_shot = Off,
+      .timeout_callback = orbit_tick,
+  };
+  orbit.timer = hal.timer.claim((timer_cap_t){.periodic = On}, 1000);  // 1us
+  if (orbit.timer && (hal.stepper.claim_motor == NULL ||
+                      !hal.timer.configure(orbit.timer, &orbit_cfg))) {
+    orbit.timer = NULL;
+  }
+#endif
+
+  // Start PULSER polling at fixed rate from a hardware timer.
+  // Polls are non-blocking, and are held off while TMC2209 soft UART is busy
+  // (its bit-banged timing is sensitive to interrupt load).
+  // Fall back to rate-limited "realtime" process if no timer is available.
+  // The realtime hook is registered either way, for log streaming.
+  timer_cfg_t poll_cfg = {
+      .single_shot = Off,
+      .timeout_callback = edm_poll_tick,
+  };
+  poll_timer = hal.timer.claim((timer_cap_t){.periodic = On}, 1000);  // 1us
+  if (poll_timer && hal.timer.configure(poll_timer, &poll_cfg)) {
+    set_poll_rate(EDM_POLL_RATE_HZ);
+  } else {
+    poll_timer = NULL;
+  }
   other_realtime = grbl.on_execute_realtime;
   grbl.on_execute_realtime = edm_realtime;
 
+#ifdef EDM_SHORT_AUX_INPUT
+  if (ioport_claim(Port_Digital, Port_Input, &short_port, "PULSER short")) {
+    hal.port.register_interrupt_handler(short_port, IRQ_Mode_Rising,
+                                        edm_short_irq);
+  }
+#endif
+#if EDM_THERMAL_ENABLE && defined(EDM_FAN_AUX_OUTPUT)
+  if ((fan_ok = ioport_claim(Port_Analog, Port_Output, &fan_port,
+                             "PULSER fan"))) {
+    hal.port.analog_out(fan_port, 0.0f);
+  }
+#endif
+
+#if EDM_PULSER_CAN
+  pulser_can_start();
+#endif
+
   // Mark as OK.
   edm_init_status = 0;
 }
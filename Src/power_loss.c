@@ -0,0 +1,235 @@
+/*
+  power_loss.c - supply dip detection with a resume record in backup SRAM
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The programmable voltage detector (PVD) interrupts when VDD falls below POWER_LOSS_PVD_LEVEL
+  (PWR_CR1 PLS: 0-6 is 1.95V-2.85V on VDD, 7 compares the PVD_IN pin with 1.2V, e.g. through a
+  divider from the 24V input for an earlier warning). At IRQ_PRIO_POWER the handler turns the
+  EDM gate off, stores a resume record and requests a feed hold, so that a dip the supply
+  recovers from leaves the machine in hold with the position intact. Only register and plain
+  memory accesses are made, the record is written within a few microseconds of the dip.
+
+  The record is kept in the top POWER_LOSS_RECORD_SIZE bytes of the backup SRAM, below it is the
+  crash record (CRASH_DUMP_ENABLE). It survives loss of VDD only with a backup battery on VBAT,
+  the backup regulator is enabled for that at init. It holds:
+
+    - the machine position in steps (sys.position)
+    - the running $FS file and the line estimated to be executing: lines read by the parser
+      minus the blocks in the planner and POWER_LOSS_LINE_MARGIN, so that lines without
+      motion between queued blocks are not skipped
+    - the last resume index checkpoint (FS_INDEX_ENABLE) before that line: file offset and
+      modal state
+    - the EDM recipe step in use (EDM_RECIPE_ENABLE)
+
+  A dip while no file runs does not replace a stored record, power cycling an idle machine keeps
+  the record of the interrupted job. The magic is written last, a record cut short is not used.
+
+  At boot a warning is output while a record is stored.
+
+  $PWRLOSS     - report the record:
+                 [PWRLOSS|file=,line=,offset=,recipe=,dips=,uptime_ms=,pos=<steps per axis>]
+  $PWRLOSS=R   - resume: restores the machine position from the record, assuming the axes did
+                 not move while unpowered, and runs the file from the checkpoint as $FSR does.
+                 Idle only, clear a homing alarm with $X first. The discharge is not energized,
+                 set it up again (e.g. M567 with the reported recipe step) before cycle start.
+  $PWRLOSS=C   - clear the record
+*/
+
+#include "driver.h"
+
+#if POWER_LOSS_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/protocol.h"
+#include "grbl/planner.h"
+#include "grbl/gcode.h"
+#include "grbl/report.h"
+#include "grbl/state_machine.h"
+
+#include "power_loss.h"
+#include "sd_stream.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef POWER_LOSS_LINE_MARGIN
+#define POWER_LOSS_LINE_MARGIN 16
+#endif
+
+#define POWER_LOSS_MAGIC 0x53534C50  // "PLSS"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t dips;              // since the record was cleared
+    uint32_t uptime_ms;
+    int32_t position[N_AXIS];   // steps
+    uint32_t line;              // 1-based
+    uint8_t recipe_step;        // 0: none
+    bool cp_valid;
+    char file[32];
+    fs_checkpoint_t cp;
+} power_loss_record_t;
+
+_Static_assert(sizeof(power_loss_record_t) <= POWER_LOSS_RECORD_SIZE, "power loss record does not fit in POWER_LOSS_RECORD_SIZE");
+
+#define record ((power_loss_record_t *)(D3_BKPSRAM_BASE + 4096 - POWER_LOSS_RECORD_SIZE))
+
+static void power_loss_save (void)
+{
+    const char *name;
+    uint32_t lines, queued;
+
+    if(!sd_stream_progress(&name, &lines)) {
+        if(record->magic == POWER_LOSS_MAGIC)
+            record->dips++;
+        return;
+    }
+
+    queued = plan_get_block_buffer_count() + POWER_LOSS_LINE_MARGIN;
+
+    uint32_t dips = record->magic == POWER_LOSS_MAGIC ? record->dips + 1 : 1;
+
+    record->magic = 0;
+    __DSB();
+
+    record->dips = dips;
+    record->uptime_ms = hal.get_elapsed_ticks();
+    memcpy(record->position, (const void *)sys.position, sizeof(record->position));
+    record->line = lines + 1 > queued ? lines + 1 - queued : 1;
+#if EDM_ENABLE
+    record->recipe_step = edm_recipe_step();
+#else
+    record->recipe_step = 0;
+#endif
+    strncpy(record->file, name, sizeof(record->file) - 1);
+    record->file[sizeof(record->file) - 1] = '\0';
+
+    const fs_checkpoint_t *cp = fs_index_find(name, record->line);
+    if((record->cp_valid = cp != NULL))
+        record->cp = *cp;
+
+    __DSB();
+    record->magic = POWER_LOSS_MAGIC;
+}
+
+void PVD_AVD_IRQHandler (void)
+{
+    EXTI_D1->PR1 = EXTI_PR1_PR16;
+
+    if(!(PWR->CSR1 & PWR_CSR1_PVDO))
+        return;
+
+#if EDM_ENABLE
+    edm_gate_force_off();
+#endif
+
+    power_loss_save();
+
+    system_set_exec_state_flag(EXEC_FEED_HOLD);
+}
+
+static status_code_t power_loss_command (sys_state_t state, char *args)
+{
+    char buf[160];
+    int len;
+    uint_fast8_t idx;
+
+    if(args && args[0] == 'C' && args[1] == '\0') {
+        record->magic = 0;
+        return Status_OK;
+    }
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    if(record->magic != POWER_LOSS_MAGIC) {
+        if(args)
+            return Status_InvalidStatement;
+        hal.stream.write("[PWRLOSS|none]" ASCII_EOL);
+        return Status_OK;
+    }
+
+    if(args) {
+
+        status_code_t status;
+
+        if(state != STATE_IDLE)
+            return Status_IdleError;
+
+        memcpy(sys.position, record->position, sizeof(sys.position));
+        plan_sync_position();
+        gc_sync_position();
+
+        if((status = sd_stream_resume_at(record->file, record->cp_valid ? &record->cp : NULL)) == Status_OK)
+            record->magic = 0;
+
+        return status;
+    }
+
+    len = snprintf(buf, sizeof(buf), "[PWRLOSS|file=%s,line=%lu,offset=%lu,recipe=%u,dips=%lu,uptime_ms=%lu,pos=",
+                    record->file, record->line, record->cp_valid ? record->cp.offset : 0,
+                     record->recipe_step, record->dips, record->uptime_ms);
+
+    for(idx = 0; idx < N_AXIS && len > 0 && (size_t)len < sizeof(buf); idx++)
+        len += snprintf(buf + len, sizeof(buf) - len, idx ? ",%ld" : "%ld", (long)record->position[idx]);
+
+    hal.stream.write(buf);
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+void power_loss_init (void)
+{
+    static const sys_command_t power_loss_command_list[] = {
+        {"PWRLOSS", power_loss_command, {}, { .str = "report the power loss record, $PWRLOSS=R resumes the job, $PWRLOSS=C clears" } }
+    };
+
+    static sys_commands_t power_loss_commands = {
+        .n_commands = sizeof(power_loss_command_list) / sizeof(sys_command_t),
+        .commands = power_loss_command_list
+    };
+
+    uint32_t t = hal.get_elapsed_ticks();
+
+    RCC->AHB4ENR |= RCC_AHB4ENR_BKPRAMEN;
+    PWR->CR1 |= PWR_CR1_DBP;
+    PWR->CR2 |= PWR_CR2_BREN;
+    while(!(PWR->CR2 & PWR_CR2_BRRDY) && hal.get_elapsed_ticks() - t < 10);
+
+    if(record->magic == POWER_LOSS_MAGIC)
+        protocol_enqueue_foreground_task(report_warning, "Power loss record stored, see $PWRLOSS");
+
+    PWR->CR1 = (PWR->CR1 & ~PWR_CR1_PLS) | (POWER_LOSS_PVD_LEVEL << PWR_CR1_PLS_Pos) | PWR_CR1_PVDE;
+    EXTI->RTSR1 |= EXTI_RTSR1_TR16;
+    EXTI_D1->PR1 = EXTI_PR1_PR16;
+    EXTI_D1->IMR1 |= EXTI_IMR1_IM16;
+
+    HAL_NVIC_SetPriority(PVD_AVD_IRQn, IRQ_PRIO_POWER, 0);
+    HAL_NVIC_EnableIRQ(PVD_AVD_IRQn);
+
+    system_register_commands(&power_loss_commands);
+}
+
+#endif // POWER_LOSS_ENABLE
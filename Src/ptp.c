@@ -0,0 +1,724 @@
+/*
+  ptp.c - IEEE 1588 (PTPv2) slave on the ETH MAC timestamp unit
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Ordinary clock, slave only, end-to-end delay mechanism over UDP/IPv4 (224.0.1.129, ports 319
+  and 320) in domain PTP_DOMAIN. One-step and two-step masters are supported.
+
+  The MAC system time runs from HCLK with fine correction: the sub-second increment is fixed
+  (PTP_UPDATE_HZ) and the addend register is the frequency control. Sync messages are timestamped
+  by the MAC on reception (event messages only, slave snapshot mode), the timestamp is taken from
+  the Rx context descriptor the DMA writes after the frame. Delay_Req is timestamped in software
+  when it has been handed to the driver, the ETH driver is not ours and does not request Tx
+  timestamps. That adds a few microseconds of constant latency and some jitter to the path delay,
+  which is filtered.
+
+  Servo: offsets larger than PTP_STEP_NS (and the first one) step the clock, smaller ones feed a PI
+  controller on the frequency. The state is slave once PTP_LOCK_COUNT consecutive offsets are
+  within PTP_LOCK_NS, holdover when Syncs stop, listening again after PTP_HOLDOVER_MS.
+
+  Master selection is a reduced BMCA: the best announced dataset (priority1, class, accuracy,
+  variance, priority2, identity) wins, a master not heard for PTP_ANNOUNCE_TIMEOUT_MS is dropped.
+
+  The controller clock (hal.get_micros()) is left alone, stepping it would upset the stepper and
+  EDM timing. ptp_stamp_get() pairs the disciplined MAC time with hal.get_micros() read at the
+  same instant instead, rtc_stamp_get() and rtc_stamp_print() use it when synchronized so EDM log
+  and job reports carry PTP time.
+
+  $PTP
+
+    [PTP|state=listening|uncalibrated|slave|holdover,master=<clock id>,domain=,offset_ns=,delay_ns=,
+     ppb=,utc_offset=,syncs=,steps=,notstamp=]
+
+    notstamp  Syncs dropped because the Rx timestamp could not be found
+*/
+
+#include "driver.h"
+
+#if PTP_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/udp.h"
+#include "lwip/igmp.h"
+#include "lwip/netif.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "ptp.h"
+#include "rt_sched.h"
+
+#ifndef PTP_DOMAIN
+#define PTP_DOMAIN 0
+#endif
+#ifndef PTP_UPDATE_HZ
+#define PTP_UPDATE_HZ 50000000UL        // 20 ns sub-second increment, must be below HCLK
+#endif
+#ifndef PTP_STEP_NS
+#define PTP_STEP_NS 1000000             // step the clock above 1 ms offset
+#endif
+#ifndef PTP_LOCK_NS
+#define PTP_LOCK_NS 5000
+#endif
+#ifndef PTP_LOCK_COUNT
+#define PTP_LOCK_COUNT 4
+#endif
+#ifndef PTP_KP
+#define PTP_KP 0.7f
+#endif
+#ifndef PTP_KI
+#define PTP_KI 0.3f
+#endif
+#ifndef PTP_MAX_PPB
+#define PTP_MAX_PPB 500000
+#endif
+#ifndef PTP_DELAY_REQ_MS
+#define PTP_DELAY_REQ_MS 1000
+#endif
+#ifndef PTP_SYNC_TIMEOUT_MS
+#define PTP_SYNC_TIMEOUT_MS 4000        // enter holdover
+#endif
+#ifndef PTP_HOLDOVER_MS
+#define PTP_HOLDOVER_MS 60000           // stamps still valid in holdover
+#endif
+#ifndef PTP_ANNOUNCE_TIMEOUT_MS
+#define PTP_ANNOUNCE_TIMEOUT_MS 6000
+#endif
+#define PTP_POLL_MS 100
+
+#define PTP_EVENT_PORT      319
+#define PTP_GENERAL_PORT    320
+#define PTP_HDR_LEN         34
+#define PTP_NS_PER_S        1000000000LL
+
+typedef enum {
+    Ptp_Sync = 0x0,
+    Ptp_DelayReq = 0x1,
+    Ptp_FollowUp = 0x8,
+    Ptp_DelayResp = 0x9,
+    Ptp_Announce = 0xB
+} ptp_msg_t;
+
+typedef enum {
+    PtpState_Listening = 0,
+    PtpState_Uncalibrated,
+    PtpState_Slave,
+    PtpState_Holdover
+} ptp_state_t;
+
+static const char *state_names[] = { "listening", "uncalibrated", "slave", "holdover" };
+
+typedef struct {
+    uint8_t port_id[10];        // clock identity + port number
+    uint8_t priority1;
+    uint8_t clock_class;
+    uint8_t accuracy;
+    uint16_t variance;
+    uint8_t priority2;
+    int16_t utc_offset;
+    bool utc_valid;
+    uint32_t announce_ms;
+} ptp_master_t;
+
+typedef struct {
+    struct udp_pcb *event;
+    struct udp_pcb *general;
+    bool joined;
+    bool clock_ok;
+    ptp_state_t state;
+    ptp_master_t master;
+    uint8_t port_id[10];
+    uint32_t base_addend;
+    // Sync in progress
+    uint16_t sync_seq;
+    bool sync_pending;          // two-step, waiting for Follow_Up
+    int64_t sync_t2;
+    int64_t sync_corr;
+    float sync_interval;
+    // last complete Sync, for the delay measurement
+    int64_t t1;
+    int64_t t2;
+    // Delay_Req in flight
+    uint16_t req_seq;
+    bool req_pending;
+    int64_t req_t1;
+    int64_t req_t2;
+    int64_t t3;
+    uint32_t req_steps;
+    uint32_t req_ms;
+    // servo
+    int64_t delay_ns;
+    bool delay_valid;
+    int64_t offset_ns;
+    float drift_ppb;
+    int32_t ppb;
+    uint_fast8_t lock_count;
+    uint32_t sync_ms;
+    uint32_t syncs;
+    uint32_t steps;
+    uint32_t notstamp;
+    uint32_t poll_ms;
+} ptp_t;
+
+static ptp_t ptp = {0};
+#if !RT_SCHED_ENABLE
+static on_execute_realtime_ptr on_execute_realtime;
+#endif
+
+static inline uint16_t get16 (const uint8_t *p)
+{
+    return ((uint16_t)p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32 (const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// 48 bit seconds + 32 bit nanoseconds
+static int64_t get_timestamp (const uint8_t *p)
+{
+    return (int64_t)(((uint64_t)get16(p) << 32) | get32(p + 2)) * PTP_NS_PER_S + get32(p + 6);
+}
+
+// correctionField is nanoseconds * 2^16
+static int64_t get_correction (const uint8_t *hdr)
+{
+    return (int64_t)(((uint64_t)get32(hdr + 8) << 32) | get32(hdr + 12)) >> 16;
+}
+
+static inline void put16 (uint8_t *p, uint16_t v)
+{
+    p[0] = v >> 8;
+    p[1] = v & 0xFF;
+}
+
+// MAC system time
+
+static inline int64_t clock_ns (uint32_t s, uint32_t ns)
+{
+    return (int64_t)s * PTP_NS_PER_S + ns;
+}
+
+static int64_t clock_read (void)
+{
+    uint32_t s, ns;
+
+    do {
+        s = ETH->MACSTSR;
+        ns = ETH->MACSTNR & ETH_MACSTNR_TSSS;
+    } while(s != ETH->MACSTSR);
+
+    return clock_ns(s, ns);
+}
+
+static bool clock_wait (uint32_t bit)
+{
+    uint32_t timeout = 100000;
+
+    while((ETH->MACTSCR & bit) && --timeout);
+
+    return timeout != 0;
+}
+
+static void clock_set_addend (uint32_t addend)
+{
+    if(clock_wait(ETH_MACTSCR_TSADDREG)) {
+        ETH->MACTSAR = addend;
+        ETH->MACTSCR |= ETH_MACTSCR_TSADDREG;
+    }
+}
+
+// Adds delta_ns to the system time (fine update mode keeps running while the offset is applied).
+static void clock_step (int64_t delta_ns)
+{
+    bool sub = delta_ns < 0;
+    uint64_t mag = sub ? -delta_ns : delta_ns;
+    uint32_t s = (uint32_t)(mag / PTP_NS_PER_S), ns = (uint32_t)(mag % PTP_NS_PER_S);
+
+    if(!clock_wait(ETH_MACTSCR_TSUPDT))
+        return;
+
+    if(sub) {
+        // Digital rollover: program 2^32 - seconds and 10^9 - nanoseconds with ADDSUB set.
+        ETH->MACSTSUR = 0xFFFFFFFFUL - s + 1UL;
+        ETH->MACSTNUR = ETH_MACSTNUR_ADDSUB | (PTP_NS_PER_S - ns);
+    } else {
+        ETH->MACSTSUR = s;
+        ETH->MACSTNUR = ns;
+    }
+
+    ETH->MACTSCR |= ETH_MACTSCR_TSUPDT;
+    ptp.steps++;
+}
+
+static void clock_set_ppb (int32_t ppb)
+{
+    ptp.ppb = ppb;
+    clock_set_addend(ptp.base_addend + (int32_t)(((int64_t)ptp.base_addend * ppb) / PTP_NS_PER_S));
+}
+
+static bool clock_init (void)
+{
+    uint32_t hclk = HAL_RCC_GetHCLKFreq();
+
+    if(hclk <= PTP_UPDATE_HZ)
+        return false;
+
+    ETH->MACIER &= ~ETH_MACIER_TSIE;
+
+    // Snapshot PTPv2 event messages over IPv4 only, slave mode (Sync), nanosecond rollover.
+    ETH->MACTSCR = ETH_MACTSCR_TSENA|ETH_MACTSCR_TSCTRLSSR|ETH_MACTSCR_TSVER2ENA|ETH_MACTSCR_TSIPV4ENA|ETH_MACTSCR_TSEVNTENA;
+    ETH->MACSSIR = (1000000000UL / PTP_UPDATE_HZ) << ETH_MACMACSSIR_SSINC_Pos;
+    ETH->MACTSCR |= ETH_MACTSCR_TSCFUPDT;
+
+    ptp.base_addend = (uint32_t)(((uint64_t)PTP_UPDATE_HZ << 32) / hclk);
+    clock_set_addend(ptp.base_addend);
+    ptp.ppb = 0;
+
+    if(!clock_wait(ETH_MACTSCR_TSADDREG))
+        return false;
+
+    ETH->MACSTSUR = 0;
+    ETH->MACSTNUR = 0;
+    ETH->MACTSCR |= ETH_MACTSCR_TSINIT;
+
+    return clock_wait(ETH_MACTSCR_TSINIT);
+}
+
+// The HAL stores the Rx context descriptor timestamp on the next read, one frame late. The context
+// descriptor of the Sync just delivered is still in the ring (owned by software, not yet rebuilt),
+// it is only used if exactly one is found.
+static bool rx_timestamp (int64_t *t)
+{
+    uint_fast8_t idx = ETH_RX_DESC_CNT, found = 0;
+    ETH_DMADescTypeDef *desc = (ETH_DMADescTypeDef *)ETH->DMACRDLAR;
+
+    do {
+        uint32_t desc3 = desc[--idx].DESC3;
+        if(!(desc3 & ETH_DMARXNDESCWBF_OWN) && (desc3 & ETH_DMARXNDESCWBF_CTXT)) {
+            uint32_t s = desc[idx].DESC1, ns = desc[idx].DESC0;
+            if(s == 0xFFFFFFFFUL && ns == 0xFFFFFFFFUL)     // corrupted snapshot
+                return false;
+            *t = clock_ns(s, ns);
+            found++;
+        }
+    } while(idx);
+
+    return found == 1;
+}
+
+// Servo
+
+static void servo_reset (void)
+{
+    ptp.state = PtpState_Listening;
+    ptp.sync_pending = ptp.req_pending = ptp.delay_valid = false;
+    ptp.t1 = ptp.t2 = ptp.delay_ns = ptp.offset_ns = 0;
+    ptp.drift_ppb = 0.0f;
+    ptp.lock_count = 0;
+}
+
+static void servo_sample (int64_t t1, int64_t t2, int64_t corr)
+{
+    int64_t offset = t2 - t1 - corr - (ptp.delay_valid ? ptp.delay_ns : 0);
+
+    ptp.offset_ns = offset;
+    ptp.sync_ms = hal.get_elapsed_ticks();
+    ptp.syncs++;
+
+    if(ptp.state == PtpState_Listening || llabs(offset) > PTP_STEP_NS) {
+        if(ptp.state == PtpState_Listening) {
+            ptp.drift_ppb = 0.0f;
+            clock_set_ppb(0);
+        }
+        clock_step(-offset);
+        ptp.state = PtpState_Uncalibrated;
+        ptp.lock_count = 0;
+        ptp.t1 = ptp.t2 = 0;
+        return;
+    }
+
+    ptp.t1 = t1;
+    ptp.t2 = t2 - corr;
+
+    // Offset positive: running fast, lower the frequency.
+    float drift = ptp.drift_ppb + PTP_KI * (float)offset * ptp.sync_interval;
+
+    if(drift > PTP_MAX_PPB)
+        drift = PTP_MAX_PPB;
+    else if(drift < -PTP_MAX_PPB)
+        drift = -PTP_MAX_PPB;
+
+    ptp.drift_ppb = drift;
+
+    float ppb = PTP_KP * (float)offset + drift;
+
+    if(ppb > PTP_MAX_PPB)
+        ppb = PTP_MAX_PPB;
+    else if(ppb < -PTP_MAX_PPB)
+        ppb = -PTP_MAX_PPB;
+
+    clock_set_ppb(-(int32_t)ppb);
+
+    if(llabs(offset) <= PTP_LOCK_NS) {
+        if(ptp.lock_count < PTP_LOCK_COUNT && ++ptp.lock_count == PTP_LOCK_COUNT)
+            ptp.state = PtpState_Slave;
+        else if(ptp.state == PtpState_Holdover)
+            ptp.state = PtpState_Slave;
+    } else if(llabs(offset) > PTP_LOCK_NS * 10) {
+        ptp.lock_count = 0;
+        ptp.state = PtpState_Uncalibrated;
+    }
+}
+
+static void delay_sample (int64_t t4)
+{
+    // Mean path delay from the Sync before the request and the request itself.
+    int64_t delay = ((ptp.req_t2 - ptp.req_t1) + (t4 - ptp.t3)) / 2;
+
+    if(delay < 0)
+        return;
+
+    if(!ptp.delay_valid) {
+        ptp.delay_ns = delay;
+        ptp.delay_valid = true;
+    } else if(delay < ptp.delay_ns * 4 + 10000)     // drop outliers, queuing in switches
+        ptp.delay_ns += (delay - ptp.delay_ns) / 8;
+}
+
+static void send_delay_req (void)
+{
+    struct pbuf *p;
+
+    if(ptp.t2 == 0 || hal.get_elapsed_ticks() - ptp.req_ms < PTP_DELAY_REQ_MS)
+        return;
+
+    if((p = pbuf_alloc(PBUF_TRANSPORT, 44, PBUF_RAM)) == NULL)
+        return;
+
+    uint8_t *msg = (uint8_t *)p->payload;
+
+    memset(msg, 0, 44);
+    msg[0] = Ptp_DelayReq;
+    msg[1] = 2;
+    put16(msg + 2, 44);
+    msg[4] = PTP_DOMAIN;
+    memcpy(msg + 20, ptp.port_id, sizeof(ptp.port_id));
+    put16(msg + 30, ++ptp.req_seq);
+    msg[32] = 1;            // control field, Delay_Req
+    msg[33] = 0x7F;
+
+    ptp.req_ms = hal.get_elapsed_ticks();
+    ptp.req_t1 = ptp.t1;
+    ptp.req_t2 = ptp.t2;
+    ptp.req_steps = ptp.steps;
+
+    ip_addr_t group;
+    IP_ADDR4(&group, 224, 0, 1, 129);
+
+    if(udp_sendto(ptp.event, p, &group, PTP_EVENT_PORT) == ERR_OK) {
+        ptp.t3 = clock_read();
+        ptp.req_pending = true;
+    }
+
+    pbuf_free(p);
+}
+
+// Message handling
+
+static bool from_master (const uint8_t *hdr)
+{
+    return ptp.master.announce_ms && !memcmp(hdr + 20, ptp.master.port_id, sizeof(ptp.master.port_id));
+}
+
+// Returns true if the announced dataset in msg is better than the current master.
+static bool announce_better (const uint8_t *msg)
+{
+    int cmp;
+
+    if(!ptp.master.announce_ms || hal.get_elapsed_ticks() - ptp.master.announce_ms > PTP_ANNOUNCE_TIMEOUT_MS)
+        return true;
+
+    if((cmp = (int)msg[47] - ptp.master.priority1) == 0 &&
+        (cmp = (int)msg[48] - ptp.master.clock_class) == 0 &&
+         (cmp = (int)msg[49] - ptp.master.accuracy) == 0 &&
+          (cmp = (int)get16(msg + 50) - ptp.master.variance) == 0 &&
+           (cmp = (int)msg[52] - ptp.master.priority2) == 0)
+        cmp = memcmp(msg + 20, ptp.master.port_id, 8);
+
+    return cmp < 0;
+}
+
+static void on_announce (const uint8_t *msg, uint16_t len)
+{
+    if(len < 64)
+        return;
+
+    if(!from_master(msg)) {
+        if(!announce_better(msg))
+            return;
+        if(ptp.master.announce_ms)
+            servo_reset();
+        memcpy(ptp.master.port_id, msg + 20, sizeof(ptp.master.port_id));
+    }
+
+    ptp.master.priority1 = msg[47];
+    ptp.master.clock_class = msg[48];
+    ptp.master.accuracy = msg[49];
+    ptp.master.variance = get16(msg + 50);
+    ptp.master.priority2 = msg[52];
+    ptp.master.utc_offset = (int16_t)get16(msg + 44);
+    ptp.master.utc_valid = (msg[7] & 0x0C) == 0x0C;     // currentUtcOffsetValid and ptpTimescale
+    ptp.master.announce_ms = hal.get_elapsed_ticks();
+}
+
+static void on_sync (const uint8_t *msg, uint16_t len)
+{
+    int64_t t2;
+
+    if(len < 44 || !from_master(msg))
+        return;
+
+    if(!rx_timestamp(&t2)) {
+        ptp.notstamp++;
+        ptp.sync_pending = false;
+        return;
+    }
+
+    int8_t log_interval = (int8_t)msg[33];
+    ptp.sync_interval = log_interval >= 0 ? (float)(1 << (log_interval > 4 ? 4 : log_interval))
+                                          : 1.0f / (float)(1 << (log_interval < -7 ? 7 : -log_interval));
+
+    if(msg[6] & 0x02) {     // two-step, origin time follows
+        ptp.sync_seq = get16(msg + 30);
+        ptp.sync_t2 = t2;
+        ptp.sync_corr = get_correction(msg);
+        ptp.sync_pending = true;
+    } else {
+        ptp.sync_pending = false;
+        servo_sample(get_timestamp(msg + 34), t2, get_correction(msg));
+        send_delay_req();
+    }
+}
+
+static void on_follow_up (const uint8_t *msg, uint16_t len)
+{
+    if(len < 44 || !ptp.sync_pending || !from_master(msg) || get16(msg + 30) != ptp.sync_seq)
+        return;
+
+    ptp.sync_pending = false;
+    servo_sample(get_timestamp(msg + 34), ptp.sync_t2, ptp.sync_corr + get_correction(msg));
+    send_delay_req();
+}
+
+static void on_delay_resp (const uint8_t *msg, uint16_t len)
+{
+    if(len < 54 || !ptp.req_pending || !from_master(msg) || get16(msg + 30) != ptp.req_seq ||
+        memcmp(msg + 44, ptp.port_id, sizeof(ptp.port_id)))
+        return;
+
+    ptp.req_pending = false;
+
+    // Discard if the clock was stepped between the Sync and the response.
+    if(ptp.req_steps == ptp.steps && ptp.req_t2)
+        delay_sample(get_timestamp(msg + 34) - get_correction(msg));
+}
+
+static void ptp_recv (void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+    uint8_t msg[64];
+    uint16_t len = pbuf_copy_partial(p, msg, sizeof(msg), 0);
+
+    pbuf_free(p);
+
+    if(len < PTP_HDR_LEN || (msg[1] & 0x0F) != 2 || msg[4] != PTP_DOMAIN || !ptp.clock_ok)
+        return;
+
+    switch(msg[0] & 0x0F) {
+
+        case Ptp_Sync:
+            on_sync(msg, len);
+            break;
+
+        case Ptp_FollowUp:
+            on_follow_up(msg, len);
+            break;
+
+        case Ptp_DelayResp:
+            on_delay_resp(msg, len);
+            break;
+
+        case Ptp_Announce:
+            on_announce(msg, len);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static bool join_group (struct netif *netif)
+{
+    ip4_addr_t group;
+
+    IP4_ADDR(&group, 224, 0, 1, 129);
+
+    if(netif->igmp_mac_filter == NULL)
+        ETH->MACPFR |= ETH_MACPFR_PM;
+
+    // EUI-64 clock identity from the MAC address.
+    memcpy(ptp.port_id, netif->hwaddr, 3);
+    ptp.port_id[3] = 0xFF;
+    ptp.port_id[4] = 0xFE;
+    memcpy(ptp.port_id + 5, netif->hwaddr + 3, 3);
+    ptp.port_id[8] = 0;
+    ptp.port_id[9] = 1;
+
+    return igmp_joingroup_netif(netif, &group) == ERR_OK;
+}
+
+static void ptp_poll (void)
+{
+    ptp.poll_ms = hal.get_elapsed_ticks();
+
+    if(!ptp.joined && netif_default && netif_is_up(netif_default) && netif_is_link_up(netif_default))
+        ptp.joined = join_group(netif_default);
+
+    // A MAC reinit by the ETH driver clears the timestamp unit.
+    if(ptp.clock_ok && !(ETH->MACTSCR & ETH_MACTSCR_TSENA)) {
+        servo_reset();
+        ptp.clock_ok = clock_init();
+    }
+
+    if(ptp.state != PtpState_Listening) {
+        uint32_t silent = ptp.poll_ms - ptp.sync_ms;
+        if(silent > PTP_HOLDOVER_MS || (ptp.state == PtpState_Uncalibrated && silent > PTP_SYNC_TIMEOUT_MS))
+            servo_reset();
+        else if(silent > PTP_SYNC_TIMEOUT_MS && ptp.state == PtpState_Slave)
+            ptp.state = PtpState_Holdover;
+    }
+}
+
+#if RT_SCHED_ENABLE
+
+static void ptp_task (void *context)
+{
+    ptp_poll();
+}
+
+#else
+
+static void ptp_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(hal.get_elapsed_ticks() - ptp.poll_ms >= PTP_POLL_MS)
+        ptp_poll();
+}
+
+#endif
+
+bool ptp_stamp_get (rtc_stamp_t *stamp)
+{
+    if(!(ptp.state == PtpState_Slave || ptp.state == PtpState_Holdover) ||
+        hal.get_elapsed_ticks() - ptp.sync_ms > PTP_HOLDOVER_MS)
+        return false;
+
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    stamp->t_us = (uint32_t)hal.get_micros();
+    int64_t t = clock_read();
+
+    __set_PRIMASK(primask);
+
+    if(ptp.master.utc_valid)
+        t -= (int64_t)ptp.master.utc_offset * PTP_NS_PER_S;
+
+    stamp->epoch = (uint32_t)(t / PTP_NS_PER_S);
+    stamp->us = (uint32_t)((t % PTP_NS_PER_S) / 1000);
+
+    return true;
+}
+
+static status_code_t ptp_command (sys_state_t state, char *args)
+{
+    char buf[200];
+    const uint8_t *id = ptp.master.port_id;
+
+    snprintf(buf, sizeof(buf), "[PTP|state=%s,master=%02X%02X%02X.%02X%02X.%02X%02X%02X-%u,domain=%d,offset_ns=%ld,delay_ns=%ld,ppb=%ld,utc_offset=%d,syncs=%lu,steps=%lu,notstamp=%lu]" ASCII_EOL,
+              ptp.clock_ok ? state_names[ptp.state] : "noclock", id[0], id[1], id[2], id[3], id[4], id[5], id[6], id[7], get16(id + 8),
+               PTP_DOMAIN, (long)ptp.offset_ns, (long)ptp.delay_ns, (long)ptp.ppb, ptp.master.utc_valid ? ptp.master.utc_offset : 0,
+                ptp.syncs, ptp.steps, ptp.notstamp);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+bool ptp_init (void)
+{
+    static const sys_command_t ptp_command_list[] = {
+        {"PTP", ptp_command, { .noargs = On }, { .str = "report IEEE 1588 slave state" } }
+    };
+
+    static sys_commands_t ptp_commands = {
+        .n_commands = sizeof(ptp_command_list) / sizeof(sys_command_t),
+        .commands = ptp_command_list
+    };
+
+    if(ptp.event)
+        return false;
+
+    if((ptp.event = udp_new()) == NULL || (ptp.general = udp_new()) == NULL ||
+        udp_bind(ptp.event, IP_ADDR_ANY, PTP_EVENT_PORT) != ERR_OK ||
+         udp_bind(ptp.general, IP_ADDR_ANY, PTP_GENERAL_PORT) != ERR_OK)
+        return false;
+
+    udp_recv(ptp.event, ptp_recv, NULL);
+    udp_recv(ptp.general, ptp_recv, NULL);
+
+    servo_reset();
+    ptp.clock_ok = clock_init();
+    ptp.poll_ms = hal.get_elapsed_ticks();
+
+#if RT_SCHED_ENABLE
+    static rt_task_t poll_task = {
+        .name = "ptp",
+        .fn = ptp_task,
+        .period_us = PTP_POLL_MS * 1000,
+        .budget_us = 20,
+        .priority = 150
+    };
+
+    rt_task_register(&poll_task);
+#else
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = ptp_execute_realtime;
+#endif
+
+    system_register_commands(&ptp_commands);
+
+    return true;
+}
+
+#endif // PTP_ENABLE
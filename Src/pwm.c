@@ -22,6 +22,10 @@
 
 #include "driver.h"
 
+#if PWM_PROFILE_ENABLE
+#include "cache.h"
+#endif
+
 typedef struct {
     TIM_TypeDef *timer;
     __IO uint32_t *ccr;
@@ -59,6 +63,10 @@ static const pwm_signal_t pwm_pin[] = {
         .port = GPIOA, .pin = 5, .timer = timer(2), .ccr = &timerCCR(2, 1), .ccmr = &timerCCMR(2, 1), .af = timerAF(2, 1),
         .en = timerCCEN(1, ), .pol = timerCCP(1, ), .ois = timerCR2OIS(1,), .ocm = timerOCM(1, 1), .ocmc = timerOCM(1, 1)
     },
+    {
+        .port = GPIOA, .pin = 15, .timer = timer(2), .ccr = &timerCCR(2, 1), .ccmr = &timerCCMR(2, 1), .af = timerAF(2, 1),
+        .en = timerCCEN(1, ), .pol = timerCCP(1, ), .ois = timerCR2OIS(1, ), .ocm = timerOCM(1, 1), .ocmc = timerOCM(1, 1)
+    },
     {
         .port = GPIOB, .pin = 3, .timer = timer(2), .ccr = &timerCCR(1, 2), .ccmr = &timerCCMR(1, 1), .af = timerAF(2, 1),
         .en = timerCCEN(2, ), .pol = timerCCP(2, ), .ois = timerCR2OIS(2, ), .ocm = timerOCM(1, 2), .ocmc = timerOCM(1, 2)
@@ -213,3 +221,128 @@ uint32_t pwm_get_clock_hz (const pwm_signal_t *pwm)
 {
     return timer_get_clock_hz(pwm->timer);
 }
+
+#if PWM_PROFILE_ENABLE
+
+/*
+  Duty profiles: on every update event of the PWM timer DMA writes the next CCR value from a
+  buffer, one-shot (the last value is then kept) or circular. For profiles longer than the
+  buffer, timers with a repetition counter (TIM1, TIM15 and TIM17 here) hold each value for
+  several PWM periods. Only one output can run a profile at a time.
+*/
+
+typedef struct {
+    const pwm_signal_t *pwm;
+    DMA_HandleTypeDef dma;
+    uint_fast16_t entries;
+    uint32_t hold;              // PWM periods per entry
+    bool loop;
+} pwm_profile_t;
+
+static pwm_profile_t profile = {0};
+static DMA_BUFFER uint32_t profile_ccr[PWM_PROFILE_SIZE];
+
+// Ends the profile run by pwm if any, CCR keeps the value last written.
+void pwm_profile_stop (const pwm_signal_t *pwm)
+{
+    if(profile.pwm && (pwm == NULL || profile.pwm == pwm)) {
+        profile.pwm->timer->DIER &= ~TIM_DIER_UDE;
+        HAL_DMA_Abort(&profile.dma);
+        if(IS_TIM_REPETITION_COUNTER_INSTANCE(profile.pwm->timer))
+            profile.pwm->timer->RCR = 0;
+        profile.pwm = NULL;
+    }
+}
+
+bool pwm_profile_active (const pwm_signal_t *pwm)
+{
+    // A finished one-shot profile is cleaned up here.
+    if(profile.pwm && !(profile.dma.Instance->CR & DMA_SxCR_EN))
+        pwm_profile_stop(NULL);
+
+    return profile.pwm && (pwm == NULL || profile.pwm == pwm);
+}
+
+// Runs the piecewise linear profile through n_points CCR values, over ms milliseconds.
+bool pwm_profile_start (const pwm_signal_t *pwm, const uint32_t *points, uint_fast8_t n_points, uint32_t ms, bool loop)
+{
+    uint32_t request, periods, hold = 1, max_hold;
+    uint_fast16_t idx, entries;
+    uint_fast8_t seg;
+    float pos;
+
+    if(n_points < 2 || ms == 0 || (request = timer_dma_request(pwm->timer, TimerEvent_Update)) == 0)
+        return false;
+
+    periods = (uint32_t)((uint64_t)pwm_get_clock_hz(pwm) * ms / 1000 / ((pwm->timer->PSC + 1) * (pwm->timer->ARR + 1)));
+    max_hold = IS_TIM_REPETITION_COUNTER_INSTANCE(pwm->timer) ? (pwm->timer == TIM1 ? 65536 : 256) : 1;
+
+    if(periods > PWM_PROFILE_SIZE)
+        hold = (periods + PWM_PROFILE_SIZE - 1) / PWM_PROFILE_SIZE;
+
+    if(periods < n_points || hold > max_hold)
+        return false;
+
+    pwm_profile_stop(NULL);
+
+    entries = periods / hold;
+    for(idx = 0; idx < entries; idx++) {
+        pos = (float)idx * (float)(n_points - 1) / (float)(entries - 1);
+        seg = (uint_fast8_t)pos < n_points - 1 ? (uint_fast8_t)pos : n_points - 2;
+        pos -= (float)seg;
+        profile_ccr[idx] = (uint32_t)((float)points[seg] + ((float)points[seg + 1] - (float)points[seg]) * pos + 0.5f);
+    }
+
+    dma_buffer_clean(profile_ccr, entries * sizeof(uint32_t));
+
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    profile.dma.Instance = PWM_PROFILE_DMA_STREAM;
+    profile.dma.Init.Request = request;
+    profile.dma.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    profile.dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    profile.dma.Init.MemInc = DMA_MINC_ENABLE;
+    profile.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    profile.dma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    profile.dma.Init.Mode = loop ? DMA_CIRCULAR : DMA_NORMAL;
+    profile.dma.Init.Priority = DMA_PRIORITY_LOW;
+    profile.dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&profile.dma) != HAL_OK)
+        return false;
+
+    if(max_hold > 1)
+        pwm->timer->RCR = hold - 1;     // loaded at the next update event
+
+    // A one-shot profile starts with the first value now, a loop repeats all entries.
+    if(!loop)
+        *pwm->ccr = profile_ccr[0];
+
+    if(HAL_DMA_Start(&profile.dma, (uint32_t)&profile_ccr[loop ? 0 : 1], (uint32_t)pwm->ccr, loop ? entries : entries - 1) != HAL_OK) {
+        if(max_hold > 1)
+            pwm->timer->RCR = 0;
+        return false;
+    }
+
+    if(pwm->timer == TIM1)
+        pwm->timer->BDTR |= TIM_BDTR_MOE;
+
+    profile.pwm = pwm;
+    profile.entries = entries;
+    profile.hold = hold;
+    profile.loop = loop;
+
+    pwm->timer->DIER |= TIM_DIER_UDE;
+
+    return true;
+}
+
+uint_fast16_t pwm_profile_info (uint32_t *hold, bool *loop)
+{
+    *hold = profile.hold;
+    *loop = profile.loop;
+
+    return profile.entries;
+}
+
+#endif // PWM_PROFILE_ENABLE
@@ -0,0 +1,285 @@
+/*
+  quadrature.c - quadrature encoder position by timer encoder interface
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The A and B signals of a quadrature encoder (e.g. on a rotary electrode spindle) on
+  QUADRATURE_A/B_PORT/PIN are fed to channels 1 and 2 of a 32-bit timer (TIM2, TIM23, TIM24) in
+  encoder mode 3: the counter counts up or down on every edge of both, x4 the encoder lines,
+  without any interrupt. The 32-bit counter does not need overflow handling either.
+
+  The optional index signal on QUADRATURE_INDEX_PORT/PIN, channel 3 of the same timer, is input
+  captured on its rising edge so CCR3 holds the exact count at the last index pulse. The H7
+  timers cannot reset the counter on an index in encoder mode, the angle within the revolution
+  is thus taken relative to the latched count, which has the same effect without losing the
+  absolute position.
+
+  The velocity is the position change over QUADRATURE_VELOCITY_MS sampled from the realtime loop.
+
+  $QEI[=R]
+
+    Reports the encoder state, R resets the position to 0:
+
+    [QEI|pos=,index=,cpr=,vel=,rpm=]
+
+    index is -1 until an index pulse has been seen, vel is in counts/s.
+*/
+
+#include "driver.h"
+
+#if QUADRATURE_ENABLE
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "timers.h"
+#include "quadrature.h"
+
+#ifndef QUADRATURE_PPR
+#define QUADRATURE_PPR 1000         // encoder lines per revolution
+#endif
+#ifndef QUADRATURE_FILTER
+#define QUADRATURE_FILTER 3         // IC1F/IC2F/IC3F, 3: 8 timer kernel clocks
+#endif
+#ifndef QUADRATURE_VELOCITY_MS
+#define QUADRATURE_VELOCITY_MS 10
+#endif
+
+#define QUADRATURE_CPR (QUADRATURE_PPR * 4)
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint8_t pin;
+    uint8_t af;
+    uint8_t channel;
+    TIM_TypeDef *timer;
+} quadrature_pin_t;
+
+static const quadrature_pin_t quadrature_pins[] = {
+    { .port = GPIOA, .pin = 0,  .af = GPIO_AF1_TIM2,   .channel = 1, .timer = TIM2 },
+    { .port = GPIOA, .pin = 5,  .af = GPIO_AF1_TIM2,   .channel = 1, .timer = TIM2 },
+    { .port = GPIOA, .pin = 15, .af = GPIO_AF1_TIM2,   .channel = 1, .timer = TIM2 },
+    { .port = GPIOA, .pin = 1,  .af = GPIO_AF1_TIM2,   .channel = 2, .timer = TIM2 },
+    { .port = GPIOB, .pin = 3,  .af = GPIO_AF1_TIM2,   .channel = 2, .timer = TIM2 },
+    { .port = GPIOA, .pin = 2,  .af = GPIO_AF1_TIM2,   .channel = 3, .timer = TIM2 },
+    { .port = GPIOB, .pin = 10, .af = GPIO_AF1_TIM2,   .channel = 3, .timer = TIM2 },
+#ifdef TIM23
+    { .port = GPIOF, .pin = 0,  .af = GPIO_AF13_TIM23, .channel = 1, .timer = TIM23 },
+    { .port = GPIOG, .pin = 12, .af = GPIO_AF13_TIM23, .channel = 1, .timer = TIM23 },
+    { .port = GPIOF, .pin = 1,  .af = GPIO_AF13_TIM23, .channel = 2, .timer = TIM23 },
+    { .port = GPIOG, .pin = 13, .af = GPIO_AF13_TIM23, .channel = 2, .timer = TIM23 },
+    { .port = GPIOF, .pin = 2,  .af = GPIO_AF13_TIM23, .channel = 3, .timer = TIM23 },
+    { .port = GPIOG, .pin = 14, .af = GPIO_AF13_TIM23, .channel = 3, .timer = TIM23 },
+#endif
+#ifdef TIM24
+    { .port = GPIOF, .pin = 11, .af = GPIO_AF14_TIM24, .channel = 1, .timer = TIM24 },
+    { .port = GPIOF, .pin = 12, .af = GPIO_AF14_TIM24, .channel = 2, .timer = TIM24 },
+    { .port = GPIOF, .pin = 13, .af = GPIO_AF14_TIM24, .channel = 3, .timer = TIM24 },
+#endif
+};
+
+typedef struct {
+    TIM_TypeDef *timer;
+    bool index_seen;
+    int32_t index_position;
+    int32_t last_position;      // at the last velocity sample
+    uint32_t last_ms;
+    float velocity;
+} quadrature_t;
+
+static quadrature_t qei = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static const quadrature_pin_t *quadrature_pin (GPIO_TypeDef *port, uint8_t pin, uint8_t channel)
+{
+    uint_fast8_t idx = sizeof(quadrature_pins) / sizeof(quadrature_pin_t);
+
+    do {
+        idx--;
+        if(quadrature_pins[idx].port == port && quadrature_pins[idx].pin == pin && quadrature_pins[idx].channel == channel)
+            return &quadrature_pins[idx];
+    } while(idx);
+
+    return NULL;
+}
+
+static void quadrature_pin_init (const quadrature_pin_t *pin)
+{
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << pin->pin,
+        .Mode = GPIO_MODE_AF_PP,
+        .Pull = GPIO_PULLUP,
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Alternate = pin->af
+    };
+
+    HAL_GPIO_Init(pin->port, &gpio_init);
+}
+
+ITCM_CODE int32_t quadrature_get_position (void)
+{
+    return qei.timer ? (int32_t)qei.timer->CNT : 0;
+}
+
+// Latches the index count when a new capture is flagged, reading CCR3 clears the flag.
+static void quadrature_index_update (void)
+{
+    if(qei.timer->SR & TIM_SR_CC3IF) {
+        qei.index_position = (int32_t)qei.timer->CCR3;
+        qei.index_seen = true;
+    }
+}
+
+uint32_t quadrature_get_angle (void)
+{
+    int32_t angle;
+
+    if(qei.timer == NULL)
+        return 0;
+
+    quadrature_index_update();
+
+    angle = ((int32_t)qei.timer->CNT - qei.index_position) % QUADRATURE_CPR;
+
+    return (uint32_t)(angle < 0 ? angle + QUADRATURE_CPR : angle);
+}
+
+void quadrature_get_data (quadrature_data_t *data)
+{
+    if(qei.timer)
+        quadrature_index_update();
+
+    data->position = quadrature_get_position();
+    data->index_position = qei.index_position;
+    data->index_seen = qei.index_seen;
+    data->velocity = qei.velocity;
+}
+
+static void quadrature_execute_realtime (sys_state_t state)
+{
+    uint32_t ms = hal.get_elapsed_ticks(), dt;
+    int32_t position;
+
+    on_execute_realtime(state);
+
+    if((dt = ms - qei.last_ms) >= QUADRATURE_VELOCITY_MS) {
+        position = (int32_t)qei.timer->CNT;
+        qei.velocity = (float)(position - qei.last_position) * 1000.0f / (float)dt;
+        qei.last_position = position;
+        qei.last_ms = ms;
+    }
+}
+
+static status_code_t quadrature_command (sys_state_t state, char *args)
+{
+    char buf[100];
+    quadrature_data_t data;
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    if(args) {
+        // The latched index moves along so that the angle is kept.
+        qei.index_position -= (int32_t)qei.timer->CNT;
+        qei.last_position -= (int32_t)qei.timer->CNT;
+        qei.timer->CNT = 0;
+    }
+
+    quadrature_get_data(&data);
+
+    snprintf(buf, sizeof(buf), "[QEI|pos=%ld,index=%ld,cpr=%d,vel=%.1f,rpm=%.2f]" ASCII_EOL,
+              data.position, data.index_seen ? data.index_position : -1L, QUADRATURE_CPR,
+               data.velocity, data.velocity * 60.0f / (float)QUADRATURE_CPR);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+bool quadrature_init (void)
+{
+    static const sys_command_t quadrature_command_list[] = {
+        {"QEI", quadrature_command, {}, { .str = "report quadrature encoder position and velocity, $QEI=R to zero the position" } }
+    };
+
+    static sys_commands_t quadrature_commands = {
+        .n_commands = sizeof(quadrature_command_list) / sizeof(sys_command_t),
+        .commands = quadrature_command_list
+    };
+
+    const timer_capture_t input = {
+        .edge = TimerCapture_Rising,
+        .filter = QUADRATURE_FILTER
+    };
+
+    const quadrature_pin_t *a = quadrature_pin(QUADRATURE_A_PORT, QUADRATURE_A_PIN, 1),
+                           *b = quadrature_pin(QUADRATURE_B_PORT, QUADRATURE_B_PIN, 2);
+
+    if(qei.timer || a == NULL || b == NULL || a->timer != b->timer)
+        return false;
+
+#ifdef QUADRATURE_INDEX_PORT
+    const quadrature_pin_t *index = quadrature_pin(QUADRATURE_INDEX_PORT, QUADRATURE_INDEX_PIN, 3);
+
+    if(index == NULL || index->timer != a->timer)
+        return false;
+#endif
+
+    if(!timer_claim(a->timer))
+        return false;
+
+    quadrature_pin_init(a);
+    quadrature_pin_init(b);
+
+    timer_clk_enable(a->timer);
+
+    a->timer->CR1 = 0;
+    a->timer->DIER = 0;
+    a->timer->PSC = 0;
+    a->timer->ARR = 0xFFFFFFFF;
+
+    // TI1 and TI2 mapped on IC1 and IC2, non-inverted, counting on both edges of both (x4).
+    if(!timer_capture_cfg(a->timer, 1, &input) || !timer_capture_cfg(a->timer, 2, &input))
+        return false;
+
+    a->timer->SMCR = TIM_SMCR_SMS_0|TIM_SMCR_SMS_1;
+
+#ifdef QUADRATURE_INDEX_PORT
+    quadrature_pin_init(index);
+    if(!timer_capture_cfg(a->timer, 3, &input))
+        return false;
+#endif
+
+    a->timer->EGR = TIM_EGR_UG;
+    a->timer->CNT = 0;
+    a->timer->SR = 0;
+    a->timer->CR1 = TIM_CR1_CEN;
+
+    qei.timer = a->timer;
+    qei.last_ms = hal.get_elapsed_ticks();
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = quadrature_execute_realtime;
+
+    system_register_commands(&quadrature_commands);
+
+    return true;
+}
+
+#endif // QUADRATURE_ENABLE
@@ -0,0 +1,241 @@
+/*
+  rt_sched.c - periodic tasks run from the realtime loop
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A single grbl.on_execute_realtime hook runs all registered periodic tasks, instead of each
+  plugin chaining its own hook and reading the clock on every pass. The clock is read once per
+  pass and compared with the earliest due time, nothing else is done on passes where no task
+  is due. Tasks are kept sorted by priority and are run cooperatively: when several are due the
+  higher priority ones run first, and once RT_SCHED_PASS_BUDGET_US has been used in a pass the
+  remaining due tasks are deferred to the next pass so that the loop keeps serving the stream
+  and the realtime commands.
+
+  Due times advance by whole periods, a task that is late by more than a period skips the
+  missed runs instead of running back to back. One-shot and delayed work stays with grbl/task.h.
+
+  Tasks with period 0 are hooks run on every pass, replacing a chained grbl.on_execute_realtime
+  hook: they are called from a table, in priority order and ahead of the periodic tasks, without
+  reading the clock and without the pass budget. A task that has nothing to do sets its
+  suspended flag, e.g. while its connection is closed, and is then skipped without a call.
+
+  $SCHED[=R] - report and optionally clear the per task statistics, run times are measured
+  with the DWT cycle counter:
+
+    [SCHED|<name>,prio=,period_us=,budget_us=,runs=,late=,overruns=,deferred=,max_us=,max_lag_us=,suspended=]
+*/
+
+#include "driver.h"
+
+#if RT_SCHED_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "rt_sched.h"
+
+#ifndef RT_SCHED_PASS_BUDGET_US
+#define RT_SCHED_PASS_BUDGET_US 200
+#endif
+#ifndef RT_SCHED_MAX_HOOKS
+#define RT_SCHED_MAX_HOOKS 12
+#endif
+
+static rt_task_t *tasks = NULL;
+static rt_task_t *hooks[RT_SCHED_MAX_HOOKS];
+static uint_fast8_t n_hooks = 0;
+static uint32_t next_due_us;
+static uint32_t cycles_per_us;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static inline bool time_reached (uint32_t now_us, uint32_t t_us)
+{
+    return (int32_t)(now_us - t_us) >= 0;
+}
+
+static void sched_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    uint_fast8_t idx;
+    rt_task_t *hook;
+
+    for(idx = 0; idx < n_hooks; idx++) {
+        if(!(hook = hooks[idx])->suspended) {
+            uint32_t start = DWT->CYCCNT, run_us;
+            hook->fn(hook->context);
+            hook->runs++;
+            if((run_us = (DWT->CYCCNT - start) / cycles_per_us) > hook->max_us)
+                hook->max_us = run_us;
+            if(hook->budget_us && run_us > hook->budget_us)
+                hook->overruns++;
+        }
+    }
+
+    uint32_t now_us = (uint32_t)hal.get_micros();
+
+    if(tasks == NULL || !time_reached(now_us, next_due_us))
+        return;
+
+    rt_task_t *task = tasks;
+    uint32_t pass_start = DWT->CYCCNT, start, run_us, lag_us;
+    bool budget_used = false;
+
+    next_due_us = now_us + 0x7FFFFFFF;
+
+    do {
+        if(time_reached(now_us, task->due_us) && task->suspended)
+            task->due_us = now_us + task->period_us;
+
+        else if(time_reached(now_us, task->due_us)) {
+
+            if(budget_used) {
+                task->deferred++;
+                next_due_us = now_us;
+                continue;
+            }
+
+            if((lag_us = now_us - task->due_us) > task->max_lag_us)
+                task->max_lag_us = lag_us;
+
+            if(lag_us >= task->period_us) {
+                task->late++;
+                task->due_us = now_us + task->period_us;
+            } else
+                task->due_us += task->period_us;
+
+            start = DWT->CYCCNT;
+            task->fn(task->context);
+            run_us = (DWT->CYCCNT - start) / cycles_per_us;
+
+            task->runs++;
+            if(run_us > task->max_us)
+                task->max_us = run_us;
+            if(task->budget_us && run_us > task->budget_us)
+                task->overruns++;
+
+            budget_used = (DWT->CYCCNT - pass_start) / cycles_per_us >= RT_SCHED_PASS_BUDGET_US;
+        }
+
+        if((int32_t)(task->due_us - next_due_us) < 0)
+            next_due_us = task->due_us;
+
+    } while((task = task->next));
+}
+
+bool rt_task_register (rt_task_t *task)
+{
+    rt_task_t **link = &tasks, *t;
+    uint_fast8_t idx;
+
+    if(task->fn == NULL)
+        return false;
+
+    for(t = tasks; t; t = t->next) {
+        if(t == task)
+            return false;
+    }
+
+    for(idx = 0; idx < n_hooks; idx++) {
+        if(hooks[idx] == task)
+            return false;
+    }
+
+    task->runs = task->late = task->overruns = task->deferred = task->max_us = task->max_lag_us = 0;
+
+    if(task->period_us == 0) {
+
+        if(n_hooks == RT_SCHED_MAX_HOOKS)
+            return false;
+
+        for(idx = n_hooks; idx && hooks[idx - 1]->priority > task->priority; idx--)
+            hooks[idx] = hooks[idx - 1];
+
+        hooks[idx] = task;
+        n_hooks++;
+
+        return true;
+    }
+
+    while(*link && (*link)->priority <= task->priority)
+        link = &(*link)->next;
+
+    task->due_us = (uint32_t)hal.get_micros() + task->period_us;
+
+    if(tasks == NULL || (int32_t)(task->due_us - next_due_us) < 0)
+        next_due_us = task->due_us;
+
+    task->next = *link;
+    *link = task;
+
+    return true;
+}
+
+static void task_report (rt_task_t *task, bool clear)
+{
+    char buf[170];
+
+    snprintf(buf, sizeof(buf), "[SCHED|%s,prio=%u,period_us=%lu,budget_us=%lu,runs=%lu,late=%lu,overruns=%lu,deferred=%lu,max_us=%lu,max_lag_us=%lu,suspended=%u]" ASCII_EOL,
+              task->name ? task->name : "?", task->priority, task->period_us, task->budget_us, task->runs,
+               task->late, task->overruns, task->deferred, task->max_us, task->max_lag_us, task->suspended);
+    hal.stream.write(buf);
+
+    if(clear)
+        task->runs = task->late = task->overruns = task->deferred = task->max_us = task->max_lag_us = 0;
+}
+
+static status_code_t sched_report (sys_state_t state, char *args)
+{
+    rt_task_t *task;
+    uint_fast8_t idx;
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < n_hooks; idx++)
+        task_report(hooks[idx], args != NULL);
+
+    for(task = tasks; task; task = task->next)
+        task_report(task, args != NULL);
+
+    return Status_OK;
+}
+
+void rt_sched_init (void)
+{
+    static const sys_command_t sched_command_list[] = {
+        {"SCHED", sched_report, {}, { .str = "report realtime task statistics, $SCHED=R to clear" } }
+    };
+
+    static sys_commands_t sched_commands = {
+        .n_commands = sizeof(sched_command_list) / sizeof(sys_command_t),
+        .commands = sched_command_list
+    };
+
+    cycles_per_us = SystemCoreClock / 1000000;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = sched_execute_realtime;
+
+    system_register_commands(&sched_commands);
+}
+
+#endif // RT_SCHED_ENABLE
@@ -0,0 +1,199 @@
+/*
+  sd_cache.c - LRU sector cache for the FatFs FAT and directory window
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  FatFs keeps a single sector window per volume for FAT and directory sectors, following a
+  cluster chain or listing a directory therefore keeps reloading the same few sectors from the
+  card. With SD_CACHE_ENABLE ff.c reads its window through this cache, SD_CACHE_SECTORS sectors
+  with least recently used replacement. File data does not go through the window (except with
+  FF_FS_TINY) and is not cached, so a program run does not evict the FAT sectors.
+
+  Writes are write-through: all disk_write() calls of ff.c come here, cached copies of written
+  sectors are updated. The cache is cleared by disk_initialize(), i.e. on (re)mount.
+
+  The sectors are placed with DMA_BUFFER, in the non-cacheable DMA arena when enabled, else cache
+  line aligned, so the SD driver reads them by DMA without bouncing.
+
+  SD_CACHE_ENABLE must be a build flag as ff.c does not include driver.h.
+
+  $SDCACHE[=R]
+
+    [SDCACHE|sectors=,hits=,misses=,writes=]
+*/
+
+#include "driver.h"
+
+#if SD_CACHE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "cache.h"
+#include "sd_cache.h"
+
+#ifndef SD_CACHE_SECTORS
+#define SD_CACHE_SECTORS 8
+#endif
+
+#if SD_CACHE_SECTORS < 2 || SD_CACHE_SECTORS > 64
+#error "SD_CACHE_SECTORS must be within 2..64!"
+#endif
+
+typedef struct {
+    LBA_t sector;
+    uint32_t used;              // LRU stamp, 0: free
+    BYTE pdrv;
+} sd_cache_entry_t;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writes;
+} sd_cache_stats_t;
+
+static uint8_t cache_data[SD_CACHE_SECTORS][FF_MAX_SS] DMA_BUFFER;
+static sd_cache_entry_t cache[SD_CACHE_SECTORS] = {0};
+static uint32_t stamp = 0;
+static sd_cache_stats_t stats = {0};
+
+static int_fast8_t cache_find (BYTE pdrv, LBA_t sector)
+{
+    int_fast8_t idx;
+
+    for(idx = 0; idx < SD_CACHE_SECTORS; idx++) {
+        if(cache[idx].used && cache[idx].sector == sector && cache[idx].pdrv == pdrv)
+            return idx;
+    }
+
+    return -1;
+}
+
+static int_fast8_t cache_victim (void)
+{
+    int_fast8_t idx, lru = 0;
+
+    for(idx = 0; idx < SD_CACHE_SECTORS; idx++) {
+        if(cache[idx].used == 0)
+            return idx;
+        if(cache[idx].used < cache[lru].used)
+            lru = idx;
+    }
+
+    return lru;
+}
+
+static void cache_clear (void)
+{
+    memset(cache, 0, sizeof(cache));
+    stamp = 0;
+}
+
+DSTATUS sd_cache_initialize (BYTE pdrv)
+{
+    cache_clear();
+
+    return disk_initialize(pdrv);
+}
+
+DRESULT sd_cache_read (BYTE pdrv, BYTE *buff, LBA_t sector, UINT count)
+{
+    DRESULT res;
+    int_fast8_t idx;
+
+    if(count != 1)
+        return disk_read(pdrv, buff, sector, count);
+
+    if((idx = cache_find(pdrv, sector)) >= 0)
+        stats.hits++;
+
+    else {
+        stats.misses++;
+        idx = cache_victim();
+        cache[idx].used = 0;
+        if((res = disk_read(pdrv, cache_data[idx], sector, 1)) != RES_OK)
+            return res;
+        cache[idx].sector = sector;
+        cache[idx].pdrv = pdrv;
+    }
+
+    if(++stamp == 0)            // wrapped, restart the ages
+        cache_clear();
+    else
+        cache[idx].used = stamp;
+
+    memcpy(buff, cache_data[idx], FF_MAX_SS);
+
+    return RES_OK;
+}
+
+DRESULT sd_cache_write (BYTE pdrv, const BYTE *buff, LBA_t sector, UINT count)
+{
+    UINT n;
+    int_fast8_t idx;
+    DRESULT res = disk_write(pdrv, buff, sector, count);
+
+    stats.writes++;
+
+    for(n = 0; n < count; n++) {
+        if((idx = cache_find(pdrv, sector + n)) >= 0) {
+            if(res == RES_OK)
+                memcpy(cache_data[idx], buff + n * FF_MAX_SS, FF_MAX_SS);
+            else
+                cache[idx].used = 0;    // card content unknown
+        }
+    }
+
+    return res;
+}
+
+static status_code_t sd_cache_command (sys_state_t state, char *args)
+{
+    char buf[80];
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    snprintf(buf, sizeof(buf), "[SDCACHE|sectors=%d,hits=%lu,misses=%lu,writes=%lu]" ASCII_EOL,
+              SD_CACHE_SECTORS, stats.hits, stats.misses, stats.writes);
+    hal.stream.write(buf);
+
+    if(args)
+        memset(&stats, 0, sizeof(stats));
+
+    return Status_OK;
+}
+
+void sd_cache_init (void)
+{
+    static const sys_command_t sd_cache_command_list[] = {
+        {"SDCACHE", sd_cache_command, {}, { .str = "report SD sector cache hits and misses, $SDCACHE=R to clear" } }
+    };
+
+    static sys_commands_t sd_cache_commands = {
+        .n_commands = sizeof(sd_cache_command_list) / sizeof(sys_command_t),
+        .commands = sd_cache_command_list
+    };
+
+    system_register_commands(&sd_cache_commands);
+}
+
+#endif // SD_CACHE_ENABLE
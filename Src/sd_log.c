@@ -0,0 +1,251 @@
+/*
+  sd_log.c - EDM log recording to preallocated contiguous SD card files
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Appending to a file through f_write() makes FatFs look up and link a new cluster each time the
+  file grows past one, with FAT sector reads and writes in between the data writes. Here the file
+  is given its full size up front with f_expand() as one contiguous run of clusters, the FAT chain
+  (or exFAT bitmap) is written once at start. The data is then written as raw multi-block writes
+  straight to the sectors of that run with disk_write(), bypassing FatFs, so a write costs the
+  same at any file position. At stop the file is truncated to the data written, which frees the
+  unused clusters and updates the directory entry, the only FatFs metadata work after start.
+
+  New EDM log entries (EDM_LOG_ENTRY_SIZE bytes each, the format of $EDM log output) are copied
+  from the log ring in the realtime loop into two SD_LOG_SECTORS sector halves. A full half is
+  written while the other fills, so the log ring only has to cover the time of one multi-block
+  write. Entries overwritten in the ring before they were copied are counted as lost.
+
+  Logging starts with the retained log. The file holds packed entries only: entries = size / 9.
+  Logs over 4 GB need an exFAT formatted card and FatFs built with FF_FS_EXFAT.
+
+  $SDLOG=<file>[,<MB>]  - start, preallocates MB (default SD_LOG_SIZE_MB), fails if the card has
+                          no contiguous free run of that size
+  $SDLOG=0              - stop and truncate the file
+  $SDLOG                - report: [SDLOG|file=,active=,bytes=,alloc=,writes=,lost=,maxwrite_us=]
+*/
+
+#include "driver.h"
+
+#if SD_LOG_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+
+#include "sd_log.h"
+#include "plugin_edm.h"
+
+#if !FF_USE_EXPAND
+#error "SD_LOG_ENABLE requires FF_USE_EXPAND in ffconf.h!"
+#endif
+
+#ifndef SD_LOG_SECTORS
+#define SD_LOG_SECTORS 32       // per half, 16 KB with 512 byte sectors
+#endif
+#ifndef SD_LOG_SIZE_MB
+#define SD_LOG_SIZE_MB 256
+#endif
+
+#define SD_LOG_HALF (SD_LOG_SECTORS * FF_MAX_SS)
+
+typedef struct {
+    FIL file;
+    char name[32];
+    bool active;
+    LBA_t sector;               // next sector to write
+    LBA_t end;                  // first sector after the allocation
+    uint32_t fill;              // next byte in buffer, 0..2 * SD_LOG_HALF - 1
+    uint_fast8_t half;          // half being filled, written once fill moves past it
+    uint32_t seq;               // EDM log entry number
+    uint64_t bytes;             // written to the card
+    uint64_t alloc;
+    uint32_t writes;
+    uint32_t lost;
+    uint32_t max_write_us;
+} sd_log_t;
+
+static uint8_t buffer[2][SD_LOG_HALF] DMA_BUFFER;
+static sd_log_t sdl = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static bool sd_log_write_half (uint_fast8_t half, uint32_t len)
+{
+    uint32_t t = hal.get_micros(), count = (len + FF_MAX_SS - 1) / FF_MAX_SS;
+
+    if(len < SD_LOG_HALF)
+        memset(buffer[half] + len, 0, count * FF_MAX_SS - len);
+
+    if(sdl.sector + count > sdl.end || disk_write(sdl.file.obj.fs->pdrv, buffer[half], sdl.sector, count) != RES_OK)
+        return false;
+
+    if((t = hal.get_micros() - t) > sdl.max_write_us)
+        sdl.max_write_us = t;
+
+    sdl.sector += count;
+    sdl.bytes += len;
+    sdl.writes++;
+
+    return true;
+}
+
+static void sd_log_stop (const char *msg)
+{
+    if(!sdl.active)
+        return;
+
+    uint32_t len = sdl.fill - sdl.half * SD_LOG_HALF;
+
+    sdl.active = false;
+
+    if(len && sdl.sector < sdl.end)
+        sd_log_write_half(sdl.half, len);
+
+    // Drop the unused part of the allocation, updates the directory entry on close.
+    if(f_lseek(&sdl.file, sdl.bytes) == FR_OK)
+        f_truncate(&sdl.file);
+    f_close(&sdl.file);
+
+    report_message(msg, Message_Plain);
+}
+
+static void sd_log_execute_realtime (sys_state_t state)
+{
+    static uint8_t entries[64 * EDM_LOG_ENTRY_SIZE];
+
+    on_execute_realtime(state);
+
+    if(!sdl.active)
+        return;
+
+    uint8_t *ring = &buffer[0][0];
+    uint32_t seq = sdl.seq, n, len, first;
+
+    while((n = edm_log_since(&sdl.seq, entries, sizeof(entries) / EDM_LOG_ENTRY_SIZE))) {
+
+        sdl.lost += sdl.seq - seq - n;
+        seq = sdl.seq;
+
+        // Entries continue across the halves, the file holds them packed.
+        len = n * EDM_LOG_ENTRY_SIZE;
+        first = len < 2 * SD_LOG_HALF - sdl.fill ? len : 2 * SD_LOG_HALF - sdl.fill;
+        memcpy(ring + sdl.fill, entries, first);
+        memcpy(ring, entries + first, len - first);
+        sdl.fill = (sdl.fill + len) % (2 * SD_LOG_HALF);
+
+        if(sdl.fill / SD_LOG_HALF != sdl.half) {
+            if(!sd_log_write_half(sdl.half, SD_LOG_HALF)) {
+                sdl.fill = sdl.half * SD_LOG_HALF;
+                sd_log_stop(sdl.sector >= sdl.end ? "SDLOG: file full" : "SDLOG: write error");
+                return;
+            }
+            sdl.half ^= 1;
+        }
+    }
+}
+
+static status_code_t sd_log_start (char *args)
+{
+    char *size = strchr(args, ',');
+    uint32_t mb = SD_LOG_SIZE_MB;
+    FATFS *fs;
+
+    if(sdl.active)
+        return Status_InvalidStatement;
+
+    if(size) {
+        char *end;
+        *size++ = '\0';
+        mb = strtoul(size, &end, 10);
+        if(*end != '\0' || mb == 0)
+            return Status_BadNumberFormat;
+    }
+
+    if(*args == '\0' || strlen(args) >= sizeof(sdl.name))
+        return Status_InvalidStatement;
+
+    if(f_open(&sdl.file, args, FA_WRITE|FA_CREATE_ALWAYS) != FR_OK)
+        return Status_SDReadError;
+
+    sdl.alloc = (uint64_t)mb << 20;
+
+    if(f_expand(&sdl.file, (FSIZE_t)sdl.alloc, 1) != FR_OK || f_sync(&sdl.file) != FR_OK) {
+        f_close(&sdl.file);
+        f_unlink(args);
+        return Status_SDReadError;
+    }
+
+    fs = sdl.file.obj.fs;
+
+    strcpy(sdl.name, args);
+    sdl.sector = fs->database + (LBA_t)fs->csize * (sdl.file.obj.sclust - 2);
+    sdl.end = sdl.sector + (LBA_t)(sdl.alloc / FF_MAX_SS);
+    sdl.fill = 0;
+    sdl.half = 0;
+    sdl.seq = 0;
+    sdl.bytes = 0;
+    sdl.writes = sdl.lost = sdl.max_write_us = 0;
+    sdl.active = true;
+
+    return Status_OK;
+}
+
+static status_code_t sd_log_command (sys_state_t state, char *args)
+{
+    char buf[140];
+
+    if(args) {
+        if(args[0] == '0' && args[1] == '\0') {
+            sd_log_stop("SDLOG: stopped");
+            return Status_OK;
+        }
+        return sd_log_start(args);
+    }
+
+    snprintf(buf, sizeof(buf), "[SDLOG|file=%s,active=%d,bytes=%llu,alloc=%llu,writes=%lu,lost=%lu,maxwrite_us=%lu]" ASCII_EOL,
+              sdl.name, sdl.active, sdl.bytes, sdl.alloc, sdl.writes, sdl.lost, sdl.max_write_us);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void sd_log_init (void)
+{
+    static const sys_command_t sd_log_command_list[] = {
+        {"SDLOG", sd_log_command, {}, { .str = "EDM log to a preallocated file, $SDLOG=<file>[,<MB>] starts, $SDLOG=0 stops" } }
+    };
+
+    static sys_commands_t sd_log_commands = {
+        .n_commands = sizeof(sd_log_command_list) / sizeof(sys_command_t),
+        .commands = sd_log_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = sd_log_execute_realtime;
+
+    system_register_commands(&sd_log_commands);
+}
+
+#endif // SD_LOG_ENABLE
@@ -0,0 +1,407 @@
+/*
+  sd_stream.c - SD card program streaming with double buffered read-ahead
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  $FS=<file>
+
+    Runs a G-code file from the (mounted) card. Input comes from two SD_STREAM_BUFFER_SIZE
+    buffers: the parser reads lines out of one while the other is refilled from the realtime
+    loop, i.e. while the planner is full and the parser is waiting anyway. A refill only has to
+    be done in line with the parser (an underrun) when a whole buffer has been consumed before the
+    realtime loop got to run, so card latency spikes up to the execution time of a buffer are
+    hidden from the planner.
+
+    The buffers are a multiple of the sector size, file reads thus always start on a sector
+    boundary and f_read() passes them to disk_read() as multi block reads directly into the
+    buffer instead of going sector by sector through the file window. They are cache line
+    aligned so that the SDMMC driver can DMA directly into them.
+
+    With FF_USE_FASTSEEK the cluster chain of the file is mapped at start (SD_STREAM_CLMT_SIZE),
+    seeks then find their cluster in the map instead of following the FAT from the start.
+
+    The job ends at the end of the file, a missing LF on the last line is added. A reset aborts
+    it. Realtime commands are still taken from the stream the job was started from, other input
+    from it is not read while the job runs.
+
+    The progress is added to the real time report as |FS:<percent>.
+
+  $FSR=<line>
+
+    Resumes the last file at the last FS_INDEX_ENABLE checkpoint before the 1-based <line>, or
+    from the start if there is none, see fs_index.c. Reports where it starts:
+
+    [FSR|line=,offset=,index=<checkpoints>/<interval>]
+
+  $FS
+
+    Reports the current or last job:
+
+    [FS|file=,size=,bytes=,lines=,refills=,underruns=,maxread_us=]
+*/
+
+#include "driver.h"
+
+#if SD_STREAM_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ff.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+#include "grbl/state_machine.h"
+
+#include "sd_stream.h"
+#include "fs_index.h"
+
+#ifndef SD_STREAM_BUFFER_SIZE
+#define SD_STREAM_BUFFER_SIZE 4096  // per buffer
+#endif
+#ifndef SD_STREAM_CLMT_SIZE
+#define SD_STREAM_CLMT_SIZE 64      // FastSeek cluster link map entries, 2 per fragment + 1
+#endif
+
+#if SD_STREAM_BUFFER_SIZE % FF_MAX_SS
+#error "SD_STREAM_BUFFER_SIZE must be a multiple of the sector size!"
+#endif
+
+typedef struct {
+    FIL file;
+    char name[32];
+    bool active;
+    bool eof;                   // last buffer read
+    bool lf;                    // last character returned was LF
+    uint_fast8_t cur;           // buffer being read
+    uint32_t pos;               // in cur
+    uint32_t len[2];            // valid bytes
+    bool ready[2];              // filled, not consumed yet
+    uint32_t size;
+    uint32_t bytes;
+    uint32_t lines;
+    uint32_t refills;
+    uint32_t underruns;
+    uint32_t max_read_us;
+    const char *preamble;       // returned before the file content
+    char preamble_buf[80];
+    stream_read_ptr read;       // of the stream the job was started from
+    sd_stream_on_end_ptr on_end;
+} sd_stream_t;
+
+static uint8_t buffer[2][SD_STREAM_BUFFER_SIZE] __ALIGNED(__SCB_DCACHE_LINE_SIZE);
+#if FF_USE_FASTSEEK
+static DWORD clmt[SD_STREAM_CLMT_SIZE];
+#endif
+
+static sd_stream_t sds = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+static on_realtime_report_ptr on_realtime_report;
+static on_reset_ptr on_reset;
+
+static void sd_stream_end (const char *msg, bool completed)
+{
+    if(sds.active) {
+        sds.active = false;
+        hal.stream.read = sds.read;
+        f_close(&sds.file);
+        report_message(msg, Message_Plain);
+        if(sds.on_end)
+            sds.on_end(completed);
+    }
+}
+
+static bool sd_stream_refill (uint_fast8_t idx)
+{
+    UINT br = 0;
+    uint32_t t = hal.get_micros();
+    FRESULT res = f_read(&sds.file, buffer[idx], SD_STREAM_BUFFER_SIZE, &br);
+
+    if((t = hal.get_micros() - t) > sds.max_read_us)
+        sds.max_read_us = t;
+
+    sds.refills++;
+
+    if(res != FR_OK) {
+        sd_stream_end("FS: read error", false);
+        return false;
+    }
+
+    sds.len[idx] = br;
+    sds.ready[idx] = true;
+    sds.eof = br < SD_STREAM_BUFFER_SIZE;
+
+    return true;
+}
+
+static int16_t sd_stream_read (void)
+{
+    char c;
+
+    if(*sds.preamble)
+        return (int16_t)*sds.preamble++;
+
+    if(sds.pos >= sds.len[sds.cur]) {
+
+        uint_fast8_t next = sds.cur ^ 1;
+
+        if(!sds.ready[next] && !sds.eof) {
+            sds.underruns++;
+            if(!sd_stream_refill(next))
+                return SERIAL_NO_DATA;
+        }
+
+        sds.ready[sds.cur] = false;
+
+        if(!sds.ready[next] || sds.len[next] == 0) {
+            if(!sds.lf) {
+                sds.lf = true;
+                return ASCII_LF;
+            }
+            sd_stream_end("FS: done", true);
+            return SERIAL_NO_DATA;
+        }
+
+        sds.cur = next;
+        sds.pos = 0;
+    }
+
+#if FS_INDEX_ENABLE
+    if(sds.lf)
+        fs_index_line(sds.lines, sds.bytes);
+#endif
+
+    c = (char)buffer[sds.cur][sds.pos++];
+
+    sds.bytes++;
+    if((sds.lf = c == ASCII_LF))
+        sds.lines++;
+
+    return (int16_t)c;
+}
+
+static void sd_stream_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(sds.active && !sds.eof && !sds.ready[sds.cur ^ 1])
+        sd_stream_refill(sds.cur ^ 1);
+}
+
+static void sd_stream_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    if(sds.active) {
+        char buf[12];
+
+        snprintf(buf, sizeof(buf), "|FS:%lu", sds.size ? (uint32_t)((uint64_t)sds.bytes * 100 / sds.size) : 100);
+        stream_write(buf);
+    }
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
+}
+
+static void sd_stream_reset (void)
+{
+    sd_stream_end("FS: aborted", false);
+
+    if(on_reset)
+        on_reset();
+}
+
+#if FS_INDEX_ENABLE
+static status_code_t sd_stream_start (const char *filename, const fs_checkpoint_t *cp)
+#else
+static status_code_t sd_stream_start (const char *filename)
+#endif
+{
+    uint32_t offset = 0;
+
+    if(state_get() != STATE_IDLE)
+        return Status_IdleError;
+
+    if(sds.active)
+        return Status_InvalidStatement;
+
+    if(f_open(&sds.file, filename, FA_READ) != FR_OK)
+        return Status_SDReadError;
+
+    if((sds.size = f_size(&sds.file)) == 0) {
+        f_close(&sds.file);
+        return Status_SDFileEmpty;
+    }
+
+#if FF_USE_FASTSEEK
+    // Cluster chain as a link map so that seeks do not follow the FAT, left off if too fragmented.
+    sds.file.cltbl = clmt;
+    clmt[0] = SD_STREAM_CLMT_SIZE;
+    if(f_lseek(&sds.file, CREATE_LINKMAP) != FR_OK)
+        sds.file.cltbl = NULL;
+#endif
+
+    if(filename != sds.name) {
+        strncpy(sds.name, filename, sizeof(sds.name) - 1);
+        sds.name[sizeof(sds.name) - 1] = '\0';
+    }
+    sds.cur = 0;
+    sds.pos = 0;
+    sds.len[1] = 0;
+    sds.ready[1] = false;
+    sds.eof = false;
+    sds.lf = false;
+    sds.lines = 0;
+    sds.preamble = "";
+    sds.on_end = NULL;
+    sds.refills = sds.underruns = sds.max_read_us = 0;
+
+#if FS_INDEX_ENABLE
+    fs_index_start(sds.name, sds.size);
+
+    if(cp) {
+        // Reads stay sector aligned, the part before the checkpoint is skipped in the buffer.
+        offset = cp->offset;
+        sds.pos = offset % FF_MAX_SS;
+        sds.lines = cp->line;
+        sds.lf = true;
+        fs_index_preamble(cp, sds.preamble_buf, sizeof(sds.preamble_buf));
+        sds.preamble = sds.preamble_buf;
+        if(f_lseek(&sds.file, offset - sds.pos) != FR_OK) {
+            f_close(&sds.file);
+            return Status_SDReadError;
+        }
+    }
+#endif
+
+    sds.bytes = offset;
+    sds.read = hal.stream.read;
+    sds.active = true;
+
+    if(!sd_stream_refill(0))    // closes the file
+        return Status_SDReadError;
+
+    hal.stream.read = sd_stream_read;
+
+    return Status_OK;
+}
+
+status_code_t sd_stream_run (const char *name, const char *preamble, sd_stream_on_end_ptr on_end)
+{
+#if FS_INDEX_ENABLE
+    status_code_t status = sd_stream_start(name, NULL);
+#else
+    status_code_t status = sd_stream_start(name);
+#endif
+
+    if(status == Status_OK) {
+        if(preamble)
+            sds.preamble = preamble;
+        sds.on_end = on_end;
+    }
+
+    return status;
+}
+
+bool sd_stream_progress (const char **name, uint32_t *lines)
+{
+    if(!sds.active)
+        return false;
+
+    *name = sds.name;
+    *lines = sds.lines;
+
+    return true;
+}
+
+#if FS_INDEX_ENABLE
+
+status_code_t sd_stream_resume_at (const char *name, const fs_checkpoint_t *cp)
+{
+    return sd_stream_start(name, cp);
+}
+
+static status_code_t sd_stream_resume (sys_state_t state, char *args)
+{
+    char *end, buf[64];
+    uint32_t line, every;
+    const fs_checkpoint_t *cp;
+
+    if(args == NULL || *sds.name == '\0')
+        return Status_InvalidStatement;
+
+    line = strtoul(args, &end, 10);
+    if(*end != '\0' || line == 0)
+        return Status_BadNumberFormat;
+
+    cp = fs_index_find(sds.name, line);
+
+    snprintf(buf, sizeof(buf), "[FSR|line=%lu,offset=%lu,index=%u/%lu]" ASCII_EOL,
+              cp ? cp->line + 1 : 1, cp ? cp->offset : 0, (unsigned int)fs_index_count(&every), every);
+    hal.stream.write(buf);
+
+    return sd_stream_start(sds.name, cp);
+}
+
+#endif
+
+static status_code_t sd_stream_command (sys_state_t state, char *args)
+{
+    char buf[140];
+
+    if(args)
+#if FS_INDEX_ENABLE
+        return sd_stream_start(args, NULL);
+#else
+        return sd_stream_start(args);
+#endif
+
+    snprintf(buf, sizeof(buf), "[FS|file=%s,size=%lu,bytes=%lu,lines=%lu,refills=%lu,underruns=%lu,maxread_us=%lu]" ASCII_EOL,
+              sds.name, sds.size, sds.bytes, sds.lines, sds.refills, sds.underruns, sds.max_read_us);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void sd_stream_init (void)
+{
+    static const sys_command_t sd_stream_command_list[] = {
+        {"FS", sd_stream_command, {}, { .str = "run a file from the SD card with read-ahead, $FS reports the last run" } },
+#if FS_INDEX_ENABLE
+        {"FSR", sd_stream_resume, {}, { .str = "resume the last $FS file at the checkpoint before $FSR=<line>" } }
+#endif
+    };
+
+    static sys_commands_t sd_stream_commands = {
+        .n_commands = sizeof(sd_stream_command_list) / sizeof(sys_command_t),
+        .commands = sd_stream_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = sd_stream_execute_realtime;
+
+    on_realtime_report = grbl.on_realtime_report;
+    grbl.on_realtime_report = sd_stream_realtime_report;
+
+    on_reset = grbl.on_reset;
+    grbl.on_reset = sd_stream_reset;
+
+    system_register_commands(&sd_stream_commands);
+}
+
+#endif // SD_STREAM_ENABLE
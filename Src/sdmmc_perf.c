@@ -0,0 +1,233 @@
+/*
+  sdmmc_perf.c - SDMMC 4-bit high speed mode and SD card read benchmark
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  SDMMC_HIGH_SPEED
+
+    The card is initialized by the FatFs disk layer with the bus width and clock divider of
+    hsd1.Init. Once it is ready this switches it to the 4-bit bus if needed, then to high speed
+    (SDR25, CMD6) and raises SDMMC_CK to the highest frequency not above 50 MHz that the SDMMC
+    kernel clock allows (48 MHz from PLL1Q, undivided). hsd1.Init is left as is, so a card that
+    is initialized again starts at the default speed and is switched again. Cards that refuse
+    high speed are kept at the 4-bit default speed and not retried until another card (CID) is
+    inserted.
+
+    The check runs from the realtime loop every SDMMC_PERF_POLL_MS, only when the HAL is idle.
+
+  $SDBENCH[=<file>]
+
+    Sequential read benchmark, SD_BENCH_CHUNK bytes per call into a cache line aligned buffer so
+    that each call is a single multi block DMA read. Without a file SD_BENCH_BYTES are read from
+    the start of the card with disk_read(), with a file it is read through f_read(). Reports:
+
+    [SDBENCH|bytes=,us=,MBps=,calls=,avg_us=,min_us=,max_us=,clk_khz=,bus=,hs=]
+
+    min/max_us are the per call latencies, clk_khz the SDMMC_CK frequency, bus the bus width and hs
+    1 when high speed is active.
+*/
+
+#include "driver.h"
+
+#if SDMMC_HIGH_SPEED || SD_BENCH_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ff.h"
+#include "diskio.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "sdmmc_perf.h"
+
+#ifndef SDMMC_PERF_POLL_MS
+#define SDMMC_PERF_POLL_MS 500
+#endif
+#ifndef SD_BENCH_CHUNK
+#define SD_BENCH_CHUNK 16384        // bytes per read call
+#endif
+#ifndef SD_BENCH_BYTES
+#define SD_BENCH_BYTES (4 * 1024 * 1024)
+#endif
+
+#if SD_BENCH_CHUNK % FF_MAX_SS
+#error "SD_BENCH_CHUNK must be a multiple of the sector size!"
+#endif
+
+#define SDMMC_HS_FREQ 50000000
+
+extern SD_HandleTypeDef hsd1;
+
+static bool hs_active = false;
+
+static inline bool sdmmc_is_4bit (void)
+{
+    return (hsd1.Instance->CLKCR & SDMMC_CLKCR_WIDBUS) == SDMMC_BUS_WIDE_4B;
+}
+
+#if SDMMC_HIGH_SPEED
+
+static uint32_t refused_cid[4] = {0};
+static uint32_t poll_ms;
+static on_execute_realtime_ptr on_execute_realtime;
+
+// CLKDIV for the highest frequency not above 50 MHz, 0 bypasses the divider.
+static uint32_t sdmmc_hs_clkdiv (void)
+{
+    uint32_t clk = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SDMMC);
+
+    return clk <= SDMMC_HS_FREQ ? 0 : (clk + 2 * SDMMC_HS_FREQ - 1) / (2 * SDMMC_HS_FREQ);
+}
+
+static void sdmmc_high_speed (void)
+{
+    uint32_t clkdiv = sdmmc_hs_clkdiv();
+
+    if((hs_active = (hsd1.Instance->CLKCR & SDMMC_CLKCR_CLKDIV) == clkdiv && sdmmc_is_4bit()))
+        return;
+
+    if(!memcmp(hsd1.CID, refused_cid, sizeof(refused_cid)))
+        return;
+
+    if(!sdmmc_is_4bit() && HAL_SD_ConfigWideBusOperation(&hsd1, SDMMC_BUS_WIDE_4B) != HAL_OK) {
+        memcpy(refused_cid, hsd1.CID, sizeof(refused_cid));
+        return;
+    }
+
+    if(HAL_SD_ConfigSpeedBusOperation(&hsd1, SDMMC_SPEED_MODE_HIGH) != HAL_OK) {
+        memcpy(refused_cid, hsd1.CID, sizeof(refused_cid));
+        return;
+    }
+
+    MODIFY_REG(hsd1.Instance->CLKCR, SDMMC_CLKCR_CLKDIV, clkdiv);
+
+    hs_active = true;
+}
+
+static void sdmmc_perf_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(hal.get_elapsed_ticks() - poll_ms >= SDMMC_PERF_POLL_MS) {
+        poll_ms = hal.get_elapsed_ticks();
+        if(hsd1.State == HAL_SD_STATE_READY)
+            sdmmc_high_speed();
+        else if(hsd1.State == HAL_SD_STATE_RESET)
+            hs_active = false;
+    }
+}
+
+#endif // SDMMC_HIGH_SPEED
+
+#if SD_BENCH_ENABLE
+
+static uint8_t bench_buf[SD_BENCH_CHUNK] __ALIGNED(__SCB_DCACHE_LINE_SIZE);
+
+static status_code_t sd_bench (sys_state_t state, char *args)
+{
+    FIL file;
+    char buf[140];
+    bool ok = true;
+    uint32_t t, t_call, us, bytes = 0, calls = 0, min_us = UINT32_MAX, max_us = 0, kclk, clkdiv;
+
+    if(state_get() != STATE_IDLE)
+        return Status_IdleError;
+
+    if(args) {
+        if(f_open(&file, args, FA_READ) != FR_OK)
+            return Status_SDReadError;
+    } else if(disk_status(0) & STA_NOINIT)
+        return Status_SDMountError;
+
+    t = hal.get_micros();
+
+    while(ok && (args || bytes < SD_BENCH_BYTES)) {
+
+        UINT br = SD_BENCH_CHUNK;
+
+        t_call = hal.get_micros();
+
+        if(args)
+            ok = f_read(&file, bench_buf, SD_BENCH_CHUNK, &br) == FR_OK && br > 0;
+        else
+            ok = disk_read(0, bench_buf, bytes / FF_MAX_SS, SD_BENCH_CHUNK / FF_MAX_SS) == RES_OK;
+
+        t_call = hal.get_micros() - t_call;
+
+        if(ok) {
+            bytes += br;
+            calls++;
+            if(t_call < min_us)
+                min_us = t_call;
+            if(t_call > max_us)
+                max_us = t_call;
+        }
+
+        if(args && br < SD_BENCH_CHUNK)
+            break;
+    }
+
+    us = hal.get_micros() - t;
+
+    if(args)
+        f_close(&file);
+
+    if(calls == 0)
+        return Status_SDReadError;
+
+    kclk = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_SDMMC) / 1000;
+    clkdiv = hsd1.Instance->CLKCR & SDMMC_CLKCR_CLKDIV;
+
+    snprintf(buf, sizeof(buf), "[SDBENCH|bytes=%lu,us=%lu,MBps=%.2f,calls=%lu,avg_us=%lu,min_us=%lu,max_us=%lu,clk_khz=%lu,bus=%d,hs=%d]" ASCII_EOL,
+              bytes, us, (float)bytes / (float)us, calls, us / calls, min_us, max_us,
+               clkdiv ? kclk / (2 * clkdiv) : kclk,
+                sdmmc_is_4bit() ? 4 : 1, hs_active);
+    hal.stream.write(buf);
+
+    return ok || args ? Status_OK : Status_SDReadError;
+}
+
+#endif // SD_BENCH_ENABLE
+
+void sdmmc_perf_init (void)
+{
+#if SDMMC_HIGH_SPEED
+    poll_ms = hal.get_elapsed_ticks();
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = sdmmc_perf_execute_realtime;
+#endif
+
+#if SD_BENCH_ENABLE
+    static const sys_command_t bench_command_list[] = {
+        {"SDBENCH", sd_bench, {}, { .str = "SD card sequential read benchmark, $SDBENCH=<file> to read a file" } }
+    };
+
+    static sys_commands_t bench_commands = {
+        .n_commands = sizeof(bench_command_list) / sizeof(sys_command_t),
+        .commands = bench_command_list
+    };
+
+    system_register_commands(&bench_commands);
+#endif
+}
+
+#endif // SDMMC_HIGH_SPEED || SD_BENCH_ENABLE
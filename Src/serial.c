@@ -24,10 +24,33 @@
 
 #include "main.h"
 #include "driver.h"
+#include "isr_profile.h"
+#include "modbus_dma.h"
+#include "serial.h"
+#include "stream_fanout.h"
 
 #include "grbl/hal.h"
 #include "grbl/protocol.h"
 
+#if SERIAL_FIFO
+// Use the 16 byte hardware FIFOs: RX interrupts at half full or on receiver timeout,
+// TX interrupts when the FIFO is empty and is then refilled in one go.
+#define USART_CR1_FIFO      (USART_CR1_FIFOEN|USART_CR1_RTOIE)
+#define USART_CR2_FIFO      USART_CR2_RTOEN
+#define USART_CR3_FIFO      (USART_CR3_RXFTIE|(0b010 << USART_CR3_RXFTCFG_Pos))
+#define USART_CR1_RXIE      USART_CR1_RTOIE
+#define USART_CR3_RXIE      USART_CR3_RXFTIE
+#define USART_CR1_TXIE      USART_CR1_TXFEIE
+#define USART_RX_TIMEOUT    20  // bit times after last character received
+#else
+#define USART_CR1_FIFO      0
+#define USART_CR2_FIFO      0
+#define USART_CR3_FIFO      0
+#define USART_CR1_RXIE      USART_CR1_RXNEIE
+#define USART_CR3_RXIE      0
+#define USART_CR1_TXIE      USART_CR1_TXEIE
+#endif
+
 #ifdef SERIAL_PORT
 static stream_rx_buffer_t rxbuf = {0};
 static stream_tx_buffer_t txbuf = {0};
@@ -66,26 +89,36 @@ static const io_stream_t *serial2Init(uint32_t baud_rate);
 #define UART0_IRQ        usartINT(1)
 #define UART0_IRQHandler usartHANDLER(1)
 #define UART0_CLK_En     usartCLKEN(1)
+#define UART0_DMA_RX_REQ usartDMARX(1)
+#define UART0_DMA_TX_REQ usartDMATX(1)
 #elif (SERIAL_PORT >= 20 && SERIAL_PORT < 29)
 #define UART0            usart(2)
 #define UART0_IRQ        usartINT(2)
 #define UART0_IRQHandler usartHANDLER(2)
 #define UART0_CLK_En     usartCLKEN(2)
+#define UART0_DMA_RX_REQ usartDMARX(2)
+#define UART0_DMA_TX_REQ usartDMATX(2)
 #elif (SERIAL_PORT >= 30 && SERIAL_PORT < 39)
 #define UART0            usart(3)
 #define UART0_IRQ        usartINT(3)
 #define UART0_IRQHandler usartHANDLER(3)
 #define UART0_CLK_En     usartCLKEN(3)
+#define UART0_DMA_RX_REQ usartDMARX(3)
+#define UART0_DMA_TX_REQ usartDMATX(3)
 #elif (SERIAL_PORT >= 60 && SERIAL_PORT < 69)
 #define UART0            usart(6)
 #define UART0_IRQ        usartINT(6)
 #define UART0_IRQHandler usartHANDLER(6)
 #define UART0_CLK_En     usartCLKEN(6)
+#define UART0_DMA_RX_REQ usartDMARX(6)
+#define UART0_DMA_TX_REQ usartDMATX(6)
 #else
 #define UART0            usart(SERIAL_PORT)
 #define UART0_IRQ        usartINT(SERIAL_PORT)
 #define UART0_IRQHandler usartHANDLER(SERIAL_PORT)
 #define UART0_CLK_En     usartCLKEN(SERIAL_PORT)
+#define UART0_DMA_RX_REQ usartDMARX(SERIAL_PORT)
+#define UART0_DMA_TX_REQ usartDMATX(SERIAL_PORT)
 #endif
 #if SERIAL_PORT == 1 || (SERIAL_PORT >= 10 && SERIAL_PORT < 19) || SERIAL_PORT == 6 || (SERIAL_PORT >= 60 && SERIAL_PORT < 69)
 #define UART0_CLK HAL_RCC_GetPCLK2Freq()
@@ -147,6 +180,72 @@ static const io_stream_t *serial2Init(uint32_t baud_rate);
 #error Code has to be added to support serial port
 #endif
 
+#if SERIAL_RX_DMA || SERIAL_TX_DMA
+#include "cache.h"
+#endif
+
+#if SERIAL_RX_DMA
+
+// Circular DMA receive, bytes are moved to rxbuf (stripping realtime commands)
+// in batches on line idle, half and full transfer events instead of per byte.
+// Worst case realtime command latency is the time to receive half the buffer.
+#ifndef SERIAL_RX_DMA_SIZE
+#define SERIAL_RX_DMA_SIZE 128
+#endif
+
+// H7 has a DMAMUX, DMA1 streams 5 & 6 are used by SPI
+#define UART0_RX_DMA_STREAM     DMA2_Stream0
+#define UART0_RX_DMA_IRQ        DMA2_Stream0_IRQn
+#define UART0_RX_DMA_IRQHandler DMA2_Stream0_IRQHandler
+
+static uint8_t dma_rxbuf[align_up(SERIAL_RX_DMA_SIZE, __SCB_DCACHE_LINE_SIZE)] DMA_BUFFER;
+static uint_fast16_t dma_rx_tail = 0;
+
+static DMA_HandleTypeDef uart0_dma_rx = {
+    .Instance                 = UART0_RX_DMA_STREAM,
+    .Init.Request             = UART0_DMA_RX_REQ,
+    .Init.FIFOMode            = DMA_FIFOMODE_DISABLE,
+    .Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL,
+    .Init.MemBurst            = DMA_MBURST_SINGLE,
+    .Init.PeriphBurst         = DMA_PBURST_SINGLE,
+    .Init.Direction           = DMA_PERIPH_TO_MEMORY,
+    .Init.PeriphInc           = DMA_PINC_DISABLE,
+    .Init.MemInc              = DMA_MINC_ENABLE,
+    .Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE,
+    .Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE,
+    .Init.Mode                = DMA_CIRCULAR,
+    .Init.Priority            = DMA_PRIORITY_HIGH,
+};
+
+#endif // SERIAL_RX_DMA
+
+#if SERIAL_TX_DMA
+
+// DMA transmit directly from txbuf, one contiguous span at a time.
+#define UART0_TX_DMA_STREAM     DMA2_Stream1
+#define UART0_TX_DMA_IRQ        DMA2_Stream1_IRQn
+#define UART0_TX_DMA_IRQHandler DMA2_Stream1_IRQHandler
+
+static volatile uint16_t dma_tx_len = 0; // length of span in flight, 0 if idle
+
+static DMA_HandleTypeDef uart0_dma_tx = {
+    .Instance                 = UART0_TX_DMA_STREAM,
+    .Init.Request             = UART0_DMA_TX_REQ,
+    .Init.FIFOMode            = DMA_FIFOMODE_DISABLE,
+    .Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL,
+    .Init.MemBurst            = DMA_MBURST_SINGLE,
+    .Init.PeriphBurst         = DMA_PBURST_SINGLE,
+    .Init.Direction           = DMA_MEMORY_TO_PERIPH,
+    .Init.PeriphInc           = DMA_PINC_DISABLE,
+    .Init.MemInc              = DMA_MINC_ENABLE,
+    .Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE,
+    .Init.MemDataAlignment    = DMA_MDATAALIGN_BYTE,
+    .Init.Mode                = DMA_NORMAL,
+    .Init.Priority            = DMA_PRIORITY_LOW,
+};
+
+#endif // SERIAL_TX_DMA
+
 #endif // SERIAL_PORT
 
 #if SERIAL1_PORT
@@ -160,26 +259,36 @@ static const io_stream_t *serial2Init(uint32_t baud_rate);
 #define UART1_IRQ        usartINT(1)
 #define UART1_IRQHandler usartHANDLER(1)
 #define UART1_CLK_En     usartCLKEN(1)
+#define UART1_DMA_RX_REQ usartDMARX(1)
+#define UART1_DMA_TX_REQ usartDMATX(1)
 #elif (SERIAL1_PORT >= 20 && SERIAL1_PORT < 29)
 #define UART1            usart(2)
 #define UART1_IRQ        usartINT(2)
 #define UART1_IRQHandler usartHANDLER(2)
 #define UART1_CLK_En     usartCLKEN(2)
+#define UART1_DMA_RX_REQ usartDMARX(2)
+#define UART1_DMA_TX_REQ usartDMATX(2)
 #elif (SERIAL1_PORT >= 30 && SERIAL1_PORT < 39)
 #define UART1            usart(3)
 #define UART1_IRQ        usartINT(3)
 #define UART1_IRQHandler usartHANDLER(3)
 #define UART1_CLK_En     usartCLKEN(3)
+#define UART1_DMA_RX_REQ usartDMARX(3)
+#define UART1_DMA_TX_REQ usartDMATX(3)
 #elif (SERIAL1_PORT >= 60 && SERIAL1_PORT < 69)
 #define UART1            usart(6)
 #define UART1_IRQ        usartINT(6)
 #define UART1_IRQHandler usartHANDLER(6)
 #define UART1_CLK_En     usartCLKEN(6)
+#define UART1_DMA_RX_REQ usartDMARX(6)
+#define UART1_DMA_TX_REQ usartDMATX(6)
 #else
 #define UART1            usart(SERIAL1_PORT)
 #define UART1_IRQ        usartINT(SERIAL1_PORT)
 #define UART1_IRQHandler usartHANDLER(SERIAL1_PORT)
 #define UART1_CLK_En     usartCLKEN(SERIAL1_PORT)
+#define UART1_DMA_RX_REQ usartDMARX(SERIAL1_PORT)
+#define UART1_DMA_TX_REQ usartDMATX(SERIAL1_PORT)
 #endif
 #if SERIAL1_PORT == 1 || (SERIAL1_PORT >= 10 && SERIAL1_PORT < 19) || SERIAL1_PORT == 6 || (SERIAL1_PORT >= 60 && SERIAL1_PORT < 69)
 #define UART1_CLK HAL_RCC_GetPCLK2Freq()
@@ -254,26 +363,36 @@ static const io_stream_t *serial2Init(uint32_t baud_rate);
 #define UART2_IRQ        usartINT(1)
 #define UART2_IRQHandler usartHANDLER(1)
 #define UART2_CLK_En     usartCLKEN(1)
+#define UART2_DMA_RX_REQ usartDMARX(1)
+#define UART2_DMA_TX_REQ usartDMATX(1)
 #elif (SERIAL2_PORT >= 20 && SERIAL2_PORT < 29)
 #define UART2            usart(2)
 #define UART2_IRQ        usartINT(2)
 #define UART2_IRQHandler usartHANDLER(2)
 #define UART2_CLK_En     usartCLKEN(2)
+#define UART2_DMA_RX_REQ usartDMARX(2)
+#define UART2_DMA_TX_REQ usartDMATX(2)
 #elif (SERIAL2_PORT >= 30 && SERIAL2_PORT < 39)
 #define UART2            usart(3)
 #define UART2_IRQ        usartINT(3)
 #define UART2_IRQHandler usartHANDLER(3)
 #define UART2_CLK_En     usartCLKEN(3)
+#define UART2_DMA_RX_REQ usartDMARX(3)
+#define UART2_DMA_TX_REQ usartDMATX(3)
 #elif (SERIAL2_PORT >= 60 && SERIAL2_PORT < 69)
 #define UART2            usart(6)
 #define UART2_IRQ        usartINT(6)
 #define UART2_IRQHandler usartHANDLER(6)
 #define UART2_CLK_En     usartCLKEN(6)
+#define UART2_DMA_RX_REQ usartDMARX(6)
+#define UART2_DMA_TX_REQ usartDMATX(6)
 #else
 #define UART2            usart(SERIAL2_PORT)
 #define UART2_IRQ        usartINT(SERIAL2_PORT)
 #define UART2_IRQHandler usartHANDLER(SERIAL2_PORT)
 #define UART2_CLK_En     usartCLKEN(SERIAL2_PORT)
+#define UART2_DMA_RX_REQ usartDMARX(SERIAL2_PORT)
+#define UART2_DMA_TX_REQ usartDMATX(SERIAL2_PORT)
 #endif
 #if SERIAL2_PORT == 1 || (SERIAL2_PORT >= 10 && SERIAL2_PORT < 19) || SERIAL2_PORT == 6 || (SERIAL2_PORT >= 60 && SERIAL2_PORT < 69)
 #define UART2_CLK HAL_RCC_GetPCLK2Freq()
@@ -337,6 +456,95 @@ static const io_stream_t *serial2Init(uint32_t baud_rate);
 
 #endif // SERIAL2_PORT
 
+#if SERIAL_HW_FLOW
+
+// CTS (alternate function, pauses the transmitter in hardware) and RTS (GPIO output, driven from
+// the input buffer level) pins by SERIAL*_PORT number.
+
+#define serialFLOW(n, f) serialflow(n, f)
+#define serialflow(n, f) FLOW ## n ## _ ## f
+
+#define FLOW1_CTS_PORT  GPIOA
+#define FLOW1_CTS_PIN   11
+#define FLOW1_RTS_PORT  GPIOA
+#define FLOW1_RTS_PIN   12
+#define FLOW1_AF        GPIO_AF7_USART1
+#define FLOW11_CTS_PORT GPIOA
+#define FLOW11_CTS_PIN  11
+#define FLOW11_RTS_PORT GPIOA
+#define FLOW11_RTS_PIN  12
+#define FLOW11_AF       GPIO_AF7_USART1
+#define FLOW12_CTS_PORT GPIOA
+#define FLOW12_CTS_PIN  11
+#define FLOW12_RTS_PORT GPIOA
+#define FLOW12_RTS_PIN  12
+#define FLOW12_AF       GPIO_AF7_USART1
+#define FLOW2_CTS_PORT  GPIOA
+#define FLOW2_CTS_PIN   0
+#define FLOW2_RTS_PORT  GPIOA
+#define FLOW2_RTS_PIN   1
+#define FLOW2_AF        GPIO_AF7_USART2
+#define FLOW21_CTS_PORT GPIOD
+#define FLOW21_CTS_PIN  3
+#define FLOW21_RTS_PORT GPIOD
+#define FLOW21_RTS_PIN  4
+#define FLOW21_AF       GPIO_AF7_USART2
+#define FLOW3_CTS_PORT  GPIOB
+#define FLOW3_CTS_PIN   13
+#define FLOW3_RTS_PORT  GPIOB
+#define FLOW3_RTS_PIN   14
+#define FLOW3_AF        GPIO_AF7_USART3
+#define FLOW31_CTS_PORT GPIOB
+#define FLOW31_CTS_PIN  13
+#define FLOW31_RTS_PORT GPIOB
+#define FLOW31_RTS_PIN  14
+#define FLOW31_AF       GPIO_AF7_USART3
+#define FLOW32_CTS_PORT GPIOD
+#define FLOW32_CTS_PIN  11
+#define FLOW32_RTS_PORT GPIOD
+#define FLOW32_RTS_PIN  12
+#define FLOW32_AF       GPIO_AF7_USART3
+#define FLOW6_CTS_PORT  GPIOG
+#define FLOW6_CTS_PIN   13
+#define FLOW6_RTS_PORT  GPIOG
+#define FLOW6_RTS_PIN   8
+#define FLOW6_AF        GPIO_AF7_USART6
+#define FLOW61_CTS_PORT GPIOG
+#define FLOW61_CTS_PIN  13
+#define FLOW61_RTS_PORT GPIOG
+#define FLOW61_RTS_PIN  8
+#define FLOW61_AF       GPIO_AF7_USART6
+
+#if (SERIAL_HW_FLOW & 0b001) && !SERIAL_PORT
+#error "SERIAL_HW_FLOW bit 0 set but no SERIAL_PORT!"
+#endif
+#if (SERIAL_HW_FLOW & 0b010) && !SERIAL1_PORT
+#error "SERIAL_HW_FLOW bit 1 set but no SERIAL1_PORT!"
+#endif
+#if (SERIAL_HW_FLOW & 0b100) && !SERIAL2_PORT
+#error "SERIAL_HW_FLOW bit 2 set but no SERIAL2_PORT!"
+#endif
+#if MODBUS_DMA_ENABLE && (SERIAL_HW_FLOW & (1 << MODBUS_DMA_STREAM))
+#error "SERIAL_HW_FLOW cannot be used on the Modbus DMA port!"
+#endif
+
+// Free input buffer space at which RTS is deasserted, it is asserted again at twice that. Covers
+// the characters a host sends after RTS goes high, and with SERIAL_RX_DMA the characters that can
+// be in the DMA buffer before they are moved to the input buffer.
+#ifndef SERIAL_RTS_MARGIN
+#if SERIAL_RX_DMA
+#define SERIAL_RTS_MARGIN (32 + SERIAL_RX_DMA_SIZE / 2)
+#else
+#define SERIAL_RTS_MARGIN 32
+#endif
+#endif
+
+#if SERIAL_RTS_MARGIN * 2 >= RX_BUFFER_SIZE
+#error "SERIAL_RTS_MARGIN too large for RX_BUFFER_SIZE!"
+#endif
+
+#endif // SERIAL_HW_FLOW
+
 static io_stream_properties_t serial[] = {
 #if SERIAL_PORT
     {
@@ -353,7 +561,7 @@ static io_stream_properties_t serial[] = {
     {
       .type = StreamType_Serial,
       .instance = 1,
-      .flags.claimable = On,
+      .flags.claimable = MODBUS_DMA_STREAM != 1,
       .flags.claimed = Off,
       .flags.can_set_baud = On,
       .flags.modbus_ready = On,
@@ -364,7 +572,7 @@ static io_stream_properties_t serial[] = {
     {
       .type = StreamType_Serial,
       .instance = 2,
-      .flags.claimable = On,
+      .flags.claimable = MODBUS_DMA_STREAM != 2,
       .flags.claimed = Off,
       .flags.can_set_baud = On,
       .flags.modbus_ready = On,
@@ -477,16 +685,112 @@ static bool serialClaimPort (uint8_t instance)
     return ok;
 }
 
+//
+// Port descriptors, the generic implementation below is inlined into thin per-port
+// wrappers (io_stream_t callbacks have no context argument) so that all peripheral
+// and buffer addresses resolve at compile time.
+//
+
+typedef struct {
+    USART_TypeDef *uart;
+    stream_rx_buffer_t *rxbuf;
+    stream_tx_buffer_t *txbuf;
+    enqueue_realtime_command_ptr *enqueue_realtime_command;
+    GPIO_TypeDef *port;
+    uint32_t pins;
+    uint8_t af;
+    IRQn_Type irq;
+    uint32_t cr2;   // additional CR2 bits, e.g. auto baud rate detection
+    uint32_t cr3;   // additional CR3 bits, e.g. DMA enable
+#if SERIAL_HW_FLOW
+    GPIO_TypeDef *rts_port; // NULL if no flow control
+    uint32_t rts_pin;
+    GPIO_TypeDef *cts_port;
+    uint32_t cts_pin;
+    uint8_t flow_af;
 #endif
+} serial_port_t;
 
 #if SERIAL_PORT
+static const serial_port_t serial_port = {
+    .uart = UART0,
+    .rxbuf = &rxbuf,
+    .txbuf = &txbuf,
+    .enqueue_realtime_command = &enqueue_realtime_command,
+    .port = UART0_PORT,
+    .pins = (1 << UART0_RX_PIN)|(1 << UART0_TX_PIN),
+    .af = UART0_AF,
+    .irq = UART0_IRQ,
+#if SERIAL_AUTOBAUD
+    .cr2 = USART_CR2_ABREN,
+#endif
+#if SERIAL_HW_FLOW & 0b001
+    .rts_port = serialFLOW(SERIAL_PORT, RTS_PORT),
+    .rts_pin = 1 << serialFLOW(SERIAL_PORT, RTS_PIN),
+    .cts_port = serialFLOW(SERIAL_PORT, CTS_PORT),
+    .cts_pin = 1 << serialFLOW(SERIAL_PORT, CTS_PIN),
+    .flow_af = serialFLOW(SERIAL_PORT, AF),
+#endif
+#if SERIAL_TX_DMA && (SERIAL_HW_FLOW & 0b001)
+    .cr3 = USART_CR3_DMAT|USART_CR3_CTSE
+#elif SERIAL_TX_DMA
+    .cr3 = USART_CR3_DMAT
+#elif SERIAL_HW_FLOW & 0b001
+    .cr3 = USART_CR3_CTSE
+#endif
+};
+#endif
+
+#if SERIAL1_PORT
+static const serial_port_t serial1_port = {
+    .uart = UART1,
+    .rxbuf = &rxbuf1,
+    .txbuf = &txbuf1,
+    .enqueue_realtime_command = &enqueue_realtime_command1,
+    .port = UART1_PORT,
+    .pins = (1 << UART1_RX_PIN)|(1 << UART1_TX_PIN),
+    .af = UART1_AF,
+    .irq = UART1_IRQ,
+#if SERIAL_HW_FLOW & 0b010
+    .cr3 = USART_CR3_CTSE,
+    .rts_port = serialFLOW(SERIAL1_PORT, RTS_PORT),
+    .rts_pin = 1 << serialFLOW(SERIAL1_PORT, RTS_PIN),
+    .cts_port = serialFLOW(SERIAL1_PORT, CTS_PORT),
+    .cts_pin = 1 << serialFLOW(SERIAL1_PORT, CTS_PIN),
+    .flow_af = serialFLOW(SERIAL1_PORT, AF)
+#endif
+};
+#endif
+
+#if SERIAL2_PORT
+static const serial_port_t serial2_port = {
+    .uart = UART2,
+    .rxbuf = &rxbuf2,
+    .txbuf = &txbuf2,
+    .enqueue_realtime_command = &enqueue_realtime_command2,
+    .port = UART2_PORT,
+    .pins = (1 << UART2_RX_PIN)|(1 << UART2_TX_PIN),
+    .af = UART2_AF,
+    .irq = UART2_IRQ,
+#if SERIAL_HW_FLOW & 0b100
+    .cr3 = USART_CR3_CTSE,
+    .rts_port = serialFLOW(SERIAL2_PORT, RTS_PORT),
+    .rts_pin = 1 << serialFLOW(SERIAL2_PORT, RTS_PIN),
+    .cts_port = serialFLOW(SERIAL2_PORT, CTS_PORT),
+    .cts_pin = 1 << serialFLOW(SERIAL2_PORT, CTS_PIN),
+    .flow_af = serialFLOW(SERIAL2_PORT, AF)
+#endif
+};
+#endif
+
+#define SERIAL_INLINE static inline __attribute__((always_inline))
 
 //
 // Returns number of free characters in serial input buffer
 //
-static uint16_t serialRxFree (void)
+SERIAL_INLINE uint16_t serial_rx_free (const serial_port_t *port)
 {
-    uint16_t tail = rxbuf.tail, head = rxbuf.head;
+    uint32_t tail = port->rxbuf->tail, head = port->rxbuf->head;
 
     return (RX_BUFFER_SIZE - 1) - BUFCOUNT(head, tail, RX_BUFFER_SIZE);
 }
@@ -494,508 +798,583 @@ static uint16_t serialRxFree (void)
 //
 // Returns number of characters in serial input buffer
 //
-static uint16_t serialRxCount (void)
+SERIAL_INLINE uint16_t serial_rx_count (const serial_port_t *port)
 {
-    uint32_t tail = rxbuf.tail, head = rxbuf.head;
+    uint32_t tail = port->rxbuf->tail, head = port->rxbuf->head;
 
     return BUFCOUNT(head, tail, RX_BUFFER_SIZE);
 }
 
+//
+// Drives RTS from the input buffer level when flow control is enabled for the port. Characters
+// keep being read while RTS is deasserted so realtime commands are still acted upon, the margin
+// takes what the host sends before it stops. The receive interrupt only deasserts and the
+// foreground only asserts, a race costs at most one character period of RTS asserted.
+//
+SERIAL_INLINE void serial_rts_stop (const serial_port_t *port)
+{
+#if SERIAL_HW_FLOW
+    if(port->rts_port && serial_rx_free(port) < SERIAL_RTS_MARGIN)
+        port->rts_port->BSRR = port->rts_pin;
+#endif
+}
+
+SERIAL_INLINE void serial_rts_resume (const serial_port_t *port)
+{
+#if SERIAL_HW_FLOW
+    if(port->rts_port && (port->rts_port->ODR & port->rts_pin) && serial_rx_free(port) >= SERIAL_RTS_MARGIN * 2)
+        port->rts_port->BSRR = port->rts_pin << 16;
+#endif
+}
+
 //
 // Flushes the serial input buffer
 //
-static void serialRxFlush (void)
+SERIAL_INLINE void serial_rx_flush (const serial_port_t *port)
 {
-    rxbuf.tail = rxbuf.head;
+    port->rxbuf->tail = port->rxbuf->head;
+    serial_rts_resume(port);
 }
 
 //
 // Flushes and adds a CAN character to the serial input buffer
 //
-static void serialRxCancel (void)
+SERIAL_INLINE void serial_rx_cancel (const serial_port_t *port)
 {
-    rxbuf.data[rxbuf.head] = ASCII_CAN;
-    rxbuf.tail = rxbuf.head;
-    rxbuf.head = BUFNEXT(rxbuf.head, rxbuf);
+    stream_rx_buffer_t *rxbuf = port->rxbuf;
+
+    rxbuf->data[rxbuf->head] = ASCII_CAN;
+    rxbuf->tail = rxbuf->head;
+    rxbuf->head = BUFNEXT(rxbuf->head, (*rxbuf));
+    serial_rts_resume(port);
 }
 
 //
-// Writes a character to the serial output stream
+// Adds a received character to the serial input buffer, stripping realtime commands
 //
-static bool serialPutC (const char c)
+SERIAL_INLINE void serial_rx_put (const serial_port_t *port, char data)
 {
-    uint16_t next_head = BUFNEXT(txbuf.head, txbuf);    // Get pointer to next free slot in buffer
-
-    while(txbuf.tail == next_head) {                    // While TX buffer full
-        if(!hal.stream_blocking_callback())             // check if blocking for space,
-            return false;                               // exit if not (leaves TX buffer in an inconsistent state)
+    stream_rx_buffer_t *rxbuf = port->rxbuf;
+
+    if(!(*port->enqueue_realtime_command)(data)) {          // Check and strip realtime commands...
+        uint16_t next_head = BUFNEXT(rxbuf->head, (*rxbuf)); // Get and increment buffer pointer
+        if(next_head == rxbuf->tail)                        // If buffer full
+            rxbuf->overflow = 1;                            // flag overflow
+        else {
+            rxbuf->data[rxbuf->head] = data;                // if not add data to buffer
+            rxbuf->head = next_head;                        // and update pointer
+        }
     }
-    txbuf.data[txbuf.head] = c;                         // Add data to buffer,
-    txbuf.head = next_head;                             // update head pointer and
-    UART0->CR1 |= USART_CR1_TXEIE;                      // enable TX interrupts
-
-    return true;
 }
 
 //
-// Writes a null terminated string to the serial output stream, blocks if buffer full
+// serialGetC - returns -1 if no data available
 //
-static void serialWriteS (const char *s)
+SERIAL_INLINE int16_t serial_getc (const serial_port_t *port)
 {
-    char c, *ptr = (char *)s;
+    stream_rx_buffer_t *rxbuf = port->rxbuf;
+    uint_fast16_t tail = rxbuf->tail;       // Get buffer pointer
+
+    if(tail == rxbuf->head)
+        return -1; // no data available
 
-    while((c = *ptr++) != '\0')
-        serialPutC(c);
+    char data = rxbuf->data[tail];          // Get next character
+    rxbuf->tail = BUFNEXT(tail, (*rxbuf));  // and update pointer
+    serial_rts_resume(port);
+
+    return (int16_t)data;
 }
 
 //
-// Writes a number of characters from string to the serial output stream followed by EOL, blocks if buffer full
+// Writes a character to the serial output stream
 //
-static void serialWrite (const char *s, uint16_t length)
+SERIAL_INLINE bool serial_putc (const serial_port_t *port, const char c)
 {
-    char *ptr = (char *)s;
+    stream_tx_buffer_t *txbuf = port->txbuf;
+    uint16_t next_head = BUFNEXT(txbuf->head, (*txbuf));    // Get pointer to next free slot in buffer
+
+    while(txbuf->tail == next_head) {                       // While TX buffer full
+        if(!hal.stream_blocking_callback())                 // check if blocking for space,
+            return false;                                   // exit if not (leaves TX buffer in an inconsistent state)
+        port->uart->CR1 |= USART_CR1_TXIE;                  // Enable TX interrupts???
+    }
+
+    txbuf->data[txbuf->head] = c;                           // Add data to buffer,
+    txbuf->head = next_head;                                // update head pointer and
+    port->uart->CR1 |= USART_CR1_TXIE;                      // enable TX interrupts
 
-    while(length--)
-        serialPutC(*ptr++);
+    return true;
 }
 
 //
 // Flushes the serial output buffer
 //
-static void serialTxFlush (void)
+SERIAL_INLINE void serial_tx_flush (const serial_port_t *port)
 {
-    UART0->CR1 &= ~USART_CR1_TXEIE;     // Disable TX interrupts
-    txbuf.tail = txbuf.head;
+    port->uart->CR1 &= ~USART_CR1_TXIE;     // Disable TX interrupts
+    port->txbuf->tail = port->txbuf->head;
 }
 
 //
 // Returns number of characters pending transmission
 //
-static uint16_t serialTxCount (void)
+SERIAL_INLINE uint16_t serial_tx_count (const serial_port_t *port)
 {
-    uint32_t tail = txbuf.tail, head = txbuf.head;
+    uint32_t tail = port->txbuf->tail, head = port->txbuf->head;
 
-    return BUFCOUNT(head, tail, TX_BUFFER_SIZE) + (UART0->ISR & USART_ISR_TC ? 0 : 1);
+    return BUFCOUNT(head, tail, TX_BUFFER_SIZE) + (port->uart->ISR & USART_ISR_TC ? 0 : 1);
 }
 
+#if STREAM_FANOUT_NONBLOCK
+
 //
-// serialGetC - returns -1 if no data available
+// Returns number of characters that can be added to the output buffer without blocking
 //
-static int16_t serialGetC (void)
+SERIAL_INLINE uint16_t serial_tx_free (const serial_port_t *port)
 {
-    uint_fast16_t tail = rxbuf.tail;    // Get buffer pointer
-
-    if(tail == rxbuf.head)
-        return -1; // no data available
-
-    char data = rxbuf.data[tail];       // Get next character
-    rxbuf.tail = BUFNEXT(tail, rxbuf);  // and update pointer
+    uint32_t tail = port->txbuf->tail, head = port->txbuf->head;
 
-    return (int16_t)data;
+    return (TX_BUFFER_SIZE - 1) - BUFCOUNT(head, tail, TX_BUFFER_SIZE);
 }
 
-static bool serialSuspendInput (bool suspend)
-{
-    return stream_rx_suspend(&rxbuf, suspend);
-}
+#endif
 
-static bool serialSetBaudRate (uint32_t baud_rate)
+//
+// Returns the BRR value and sets OVER8 in *cr1 if 8x oversampling is closer to the requested rate,
+// or needed for rates above clock / 16 (up to clock / 8). The baud rate granularity of 8x is half
+// that of 16x, which matters at Mbaud rates where BRR is small. 16x is kept on a tie as it samples
+// each bit more often and tolerates more clock deviation.
+//
+static uint32_t serial_brr (uint32_t clock, uint32_t baud_rate, uint32_t *cr1)
 {
-    UART0->CR1 |= (USART_CR1_UE|USART_CR1_RXNEIE);
-    UART0->CR1 = USART_CR1_RE|USART_CR1_TE;
-    UART0->CR3 = USART_CR3_OVRDIS;
-    UART0->BRR = UART_DIV_SAMPLING16(UART0_CLK, baud_rate, UART_PRESCALER_DIV1);
-    UART0->CR1 |= (USART_CR1_UE|USART_CR1_RXNEIE);
+    uint32_t div16 = UART_DIV_SAMPLING16(clock, baud_rate, UART_PRESCALER_DIV1),
+             div8 = UART_DIV_SAMPLING8(clock, baud_rate, UART_PRESCALER_DIV1);
 
-    rxbuf.tail = rxbuf.head;
-    txbuf.tail = txbuf.head;
+    if(div8 < 16)   // BRR minimum, rate out of reach
+        div8 = 16;
 
-    return true;
+    if(div16 >= 16) {
+        // Rate errors |clock / div16 - baud| and |2 * clock / div8 - baud|, cross multiplied.
+        int64_t err16 = ((int64_t)clock - (int64_t)div16 * baud_rate) * div8,
+                err8 = ((int64_t)clock * 2 - (int64_t)div8 * baud_rate) * div16;
+
+        if((err8 < 0 ? -err8 : err8) >= (err16 < 0 ? -err16 : err16))
+            return div16;
+    }
+
+    *cr1 |= USART_CR1_OVER8;
+
+    return (div8 & 0xFFF0) | ((div8 & 0x000F) >> 1);
 }
 
-static bool serialDisable (bool disable)
+SERIAL_INLINE bool serial_set_baud_rate (const serial_port_t *port, uint32_t clock, uint32_t baud_rate)
 {
-    if(disable)
-        UART0->CR1 &= ~USART_CR1_RXNEIE;
-    else
-        UART0->CR1 |= USART_CR1_RXNEIE;
+    USART_TypeDef *uart = port->uart;
+    uint32_t cr1 = USART_CR1_RE|USART_CR1_TE|USART_CR1_FIFO;
+
+    uart->CR1 = 0;
+    uart->BRR = serial_brr(clock, baud_rate, &cr1);
+    uart->CR1 = cr1;
+    uart->CR2 = USART_CR2_FIFO|port->cr2;
+    uart->CR3 = USART_CR3_OVRDIS|USART_CR3_FIFO|port->cr3;
+#if SERIAL_FIFO
+    uart->RTOR = USART_RX_TIMEOUT;
+#endif
+    uart->CR1 |= (USART_CR1_UE|USART_CR1_RXIE);
+
+    port->rxbuf->tail = port->rxbuf->head;
+    port->txbuf->tail = port->txbuf->head;
+    serial_rts_resume(port);
 
     return true;
 }
 
-static bool serialEnqueueRtCommand (char c)
+SERIAL_INLINE bool serial_disable (const serial_port_t *port, bool disable)
 {
-    return enqueue_realtime_command(c);
+    if(disable) {
+        port->uart->CR1 &= ~USART_CR1_RXIE;
+        port->uart->CR3 &= ~USART_CR3_RXIE;
+    } else {
+        port->uart->CR1 |= USART_CR1_RXIE;
+        port->uart->CR3 |= USART_CR3_RXIE;
+    }
+
+    return true;
 }
 
-static enqueue_realtime_command_ptr serialSetRtHandler (enqueue_realtime_command_ptr handler)
+SERIAL_INLINE enqueue_realtime_command_ptr serial_set_rt_handler (const serial_port_t *port, enqueue_realtime_command_ptr handler)
 {
-    enqueue_realtime_command_ptr prev = enqueue_realtime_command;
+    enqueue_realtime_command_ptr prev = *port->enqueue_realtime_command;
 
     if(handler)
-        enqueue_realtime_command = handler;
+        *port->enqueue_realtime_command = handler;
 
     return prev;
 }
 
-static const io_stream_t *serialInit (uint32_t baud_rate)
+//
+// Configures the pins, call after enabling the peripheral clock
+//
+SERIAL_INLINE void serial_gpio_init (const serial_port_t *port)
 {
-    static const io_stream_t stream = {
-        .type = StreamType_Serial,
-        .is_connected = stream_connected,
-        .read = serialGetC,
-        .write = serialWriteS,
-        .write_n =  serialWrite,
-        .write_char = serialPutC,
-        .enqueue_rt_command = serialEnqueueRtCommand,
-        .get_rx_buffer_free = serialRxFree,
-        .get_rx_buffer_count = serialRxCount,
-        .get_tx_buffer_count = serialTxCount,
-        .reset_write_buffer = serialTxFlush,
-        .reset_read_buffer = serialRxFlush,
-        .cancel_read_buffer = serialRxCancel,
-        .suspend_read = serialSuspendInput,
-        .disable_rx = serialDisable,
-        .set_baud_rate = serialSetBaudRate,
-        .set_enqueue_rt_handler = serialSetRtHandler
-    };
-
-    if(!serialClaimPort(stream.instance))
-        return NULL;
-
-    UART0_CLK_En();
-
     GPIO_InitTypeDef GPIO_InitStructure = {
         .Mode      = GPIO_MODE_AF_PP,
         .Pull      = GPIO_NOPULL,
         .Speed     = GPIO_SPEED_FREQ_VERY_HIGH,
-        .Pin       = (1 << UART0_RX_PIN)|(1 << UART0_TX_PIN),
-        .Alternate = UART0_AF
+        .Pin       = port->pins,
+        .Alternate = port->af
     };
-    HAL_GPIO_Init(UART0_PORT, &GPIO_InitStructure);
-
-    serialSetBaudRate(baud_rate);
+    HAL_GPIO_Init(port->port, &GPIO_InitStructure);
+
+#if SERIAL_HW_FLOW
+    if(port->rts_port) {
+        // An unconnected CTS reads as clear to send.
+        GPIO_InitStructure.Pin = port->cts_pin;
+        GPIO_InitStructure.Pull = GPIO_PULLDOWN;
+        GPIO_InitStructure.Alternate = port->flow_af;
+        HAL_GPIO_Init(port->cts_port, &GPIO_InitStructure);
+
+        // RTS deasserted until the baud rate is set.
+        port->rts_port->BSRR = port->rts_pin;
+        GPIO_InitStructure.Mode = GPIO_MODE_OUTPUT_PP;
+        GPIO_InitStructure.Pin = port->rts_pin;
+        GPIO_InitStructure.Pull = GPIO_NOPULL;
+        GPIO_InitStructure.Speed = GPIO_SPEED_FREQ_LOW;
+        GPIO_InitStructure.Alternate = 0;
+        HAL_GPIO_Init(port->rts_port, &GPIO_InitStructure);
+    }
+#endif
+}
 
-    HAL_NVIC_SetPriority(UART0_IRQ, 0, 0);
-    HAL_NVIC_EnableIRQ(UART0_IRQ);
+SERIAL_INLINE void serial_irq_enable (const serial_port_t *port)
+{
+    HAL_NVIC_SetPriority(port->irq, IRQ_PRIO_SERIAL, 0);
+    HAL_NVIC_EnableIRQ(port->irq);
+}
 
-    return &stream;
+SERIAL_INLINE void serial_rx_irq (const serial_port_t *port)
+{
+#if SERIAL_FIFO
+    port->uart->ICR = USART_ICR_RTOCF;
+#endif
+    while(port->uart->ISR & USART_ISR_RXNE_RXFNE)           // Drain RX FIFO (one character if FIFO disabled)
+        serial_rx_put(port, (char)port->uart->RDR);
+    serial_rts_stop(port);
 }
 
-void UART0_IRQHandler (void)
+SERIAL_INLINE void serial_tx_irq (const serial_port_t *port)
 {
-    if(UART0->ISR & USART_ISR_RXNE_RXFNE) {
-        uint32_t data = UART0->RDR;
-        if(!enqueue_realtime_command((char)data)) {             // Check and strip realtime commands...
-            uint16_t next_head = BUFNEXT(rxbuf.head, rxbuf);    // Get and increment buffer pointer
-            if(next_head == rxbuf.tail)                         // If buffer full
-                rxbuf.overflow = 1;                             // flag overflow
-            else {
-                rxbuf.data[rxbuf.head] = (char)data;            // if not add data to buffer
-                rxbuf.head = next_head;                         // and update pointer
-            }
+    USART_TypeDef *uart = port->uart;
+    stream_tx_buffer_t *txbuf = port->txbuf;
+
+    if(uart->CR1 & USART_CR1_TXIE) {
+        uint_fast16_t tail = txbuf->tail;                   // Get buffer pointer
+        while((uart->ISR & USART_ISR_TXE_TXFNF) && tail != txbuf->head) { // Fill TX FIFO (one character if FIFO disabled)
+            uart->TDR = txbuf->data[tail];                  // Send next character
+            tail = BUFNEXT(tail, (*txbuf));                 // and increment pointer
         }
+        txbuf->tail = tail;
+        if(tail == txbuf->head)                             // If buffer empty then
+            uart->CR1 &= ~USART_CR1_TXIE;                   // disable UART TX interrupt
     }
-
-    if((UART0->ISR & USART_ISR_TXE_TXFNF) && (UART0->CR1 & USART_CR1_TXEIE)) {
-        uint_fast16_t tail = txbuf.tail;            // Get buffer pointer
-        UART0->TDR = txbuf.data[tail];              // Send next character
-        txbuf.tail = tail = BUFNEXT(tail, txbuf);   // and increment pointer
-        if(tail == txbuf.head)                      // If buffer empty then
-            UART0->CR1 &= ~USART_CR1_TXEIE;         // disable UART TX interrupt
-   }
 }
 
-#endif // SERIAL_PORT
-
-#if SERIAL1_PORT
-
 //
-// Returns number of free characters in serial input buffer
+// Per-port wrappers, n is the function name infix: empty for the main port, 1 or 2 otherwise
 //
-static uint16_t serial1RxFree (void)
-{
-    uint32_t tail = rxbuf1.tail, head = rxbuf1.head;
 
-    return (RX_BUFFER_SIZE - 1) - BUFCOUNT(head, tail, RX_BUFFER_SIZE);
+#define SERIAL_RX_FUNCTIONS(n) \
+static uint16_t serial##n##RxFree (void) { return serial_rx_free(&serial##n##_port); } \
+static uint16_t serial##n##RxCount (void) { return serial_rx_count(&serial##n##_port); } \
+static void serial##n##RxFlush (void) { serial_rx_flush(&serial##n##_port); } \
+static void serial##n##RxCancel (void) { serial_rx_cancel(&serial##n##_port); } \
+static int16_t serial##n##GetC (void) { return serial_getc(&serial##n##_port); } \
+static bool serial##n##SuspendInput (bool suspend) { return stream_rx_suspend(serial##n##_port.rxbuf, suspend); } \
+static uint16_t serial##n##TxCount (void) { return serial_tx_count(&serial##n##_port); } \
+static bool serial##n##EnqueueRtCommand (char c) { return (*serial##n##_port.enqueue_realtime_command)(c); } \
+static enqueue_realtime_command_ptr serial##n##SetRtHandler (enqueue_realtime_command_ptr handler) { return serial_set_rt_handler(&serial##n##_port, handler); }
+
+#if STREAM_FANOUT_NONBLOCK
+
+// Output is dropped instead of blocking when the port is not the active stream, see stream_fanout.h
+#define SERIAL_TX_ACCEPT(n) \
+static stream_fanout_t serial##n##_fanout = {0}; \
+static inline bool serial##n##TxAccept (const char *s, uint16_t length) { \
+    return hal.stream.get_rx_buffer_free == serial##n##RxFree || \
+            stream_fanout_accept(&serial##n##_fanout, s, length, serial_tx_free(&serial##n##_port)); \
 }
 
-//
-// Returns number of characters in serial input buffer
-//
-static uint16_t serial1RxCount (void)
-{
-    uint32_t tail = rxbuf1.tail, head = rxbuf1.head;
+#define SERIAL_TX_FUNCTIONS(n) \
+SERIAL_TX_ACCEPT(n) \
+static bool serial##n##PutC (const char c) { return !serial##n##TxAccept(&c, 1) || serial_putc(&serial##n##_port, c); } \
+static void serial##n##WriteS (const char *s) { char c; if(serial##n##TxAccept(s, strlen(s))) while((c = *s++) != '\0') serial_putc(&serial##n##_port, c); } \
+static void serial##n##Write (const char *s, uint16_t length) { if(serial##n##TxAccept(s, length)) while(length--) serial_putc(&serial##n##_port, *s++); } \
+static void serial##n##TxFlush (void) { serial_tx_flush(&serial##n##_port); }
 
-    return BUFCOUNT(head, tail, RX_BUFFER_SIZE);
-}
+#else
 
-//
-// Flushes the serial input buffer
-//
-static void serial1RxFlush (void)
-{
-    rxbuf1.tail = rxbuf1.head;
-}
+#define SERIAL_TX_FUNCTIONS(n) \
+static bool serial##n##PutC (const char c) { return serial_putc(&serial##n##_port, c); } \
+static void serial##n##WriteS (const char *s) { char c; while((c = *s++) != '\0') serial_putc(&serial##n##_port, c); } \
+static void serial##n##Write (const char *s, uint16_t length) { while(length--) serial_putc(&serial##n##_port, *s++); } \
+static void serial##n##TxFlush (void) { serial_tx_flush(&serial##n##_port); }
+
+#endif // STREAM_FANOUT_NONBLOCK
+
+#define SERIAL_CTRL_FUNCTIONS(n, clock) \
+static bool serial##n##SetBaudRate (uint32_t baud_rate) { return serial_set_baud_rate(&serial##n##_port, clock, baud_rate); } \
+static bool serial##n##Disable (bool disable) { return serial_disable(&serial##n##_port, disable); }
+
+#define SERIAL_STREAM(n, inst) \
+static const io_stream_t serial##n##_stream = { \
+    .type = StreamType_Serial, \
+    .instance = inst, \
+    .is_connected = stream_connected, \
+    .read = serial##n##GetC, \
+    .write = serial##n##WriteS, \
+    .write_n = serial##n##Write, \
+    .write_char = serial##n##PutC, \
+    .enqueue_rt_command = serial##n##EnqueueRtCommand, \
+    .get_rx_buffer_free = serial##n##RxFree, \
+    .get_rx_buffer_count = serial##n##RxCount, \
+    .get_tx_buffer_count = serial##n##TxCount, \
+    .reset_write_buffer = serial##n##TxFlush, \
+    .reset_read_buffer = serial##n##RxFlush, \
+    .cancel_read_buffer = serial##n##RxCancel, \
+    .suspend_read = serial##n##SuspendInput, \
+    .disable_rx = serial##n##Disable, \
+    .set_baud_rate = serial##n##SetBaudRate, \
+    .set_enqueue_rt_handler = serial##n##SetRtHandler \
+};
 
-//
-// Flushes and adds a CAN character to the serial input buffer
-//
-static void serial1RxCancel (void)
-{
-    rxbuf1.data[rxbuf1.head] = ASCII_CAN;
-    rxbuf1.tail = rxbuf1.head;
-    rxbuf1.head = BUFNEXT(rxbuf1.head, rxbuf1);
-}
+#if MODBUS_DMA_ENABLE
 
 //
-// Writes a character to the serial output stream
+// Hands the UART of a stream instance to a driver doing its own UART and DMA handling,
+// the instance is not claimable as a stream then. Enables the clock and configures the pins,
+// the UART interrupt is forwarded to modbus_dma_irq_handler().
 //
-static bool serial1PutC (const char c)
+bool serialClaimRaw (uint8_t instance, serial_raw_port_t *raw)
 {
-    uint32_t next_head = BUFNEXT(txbuf1.head, txbuf1);   // Set and update head pointer
+    uint_fast8_t idx = sizeof(serial) / sizeof(io_stream_properties_t);
 
-    while(txbuf1.tail == next_head) {           // While TX buffer full
-        if(!hal.stream_blocking_callback())     // check if blocking for space,
-            return false;                       // exit if not (leaves TX buffer in an inconsistent state)
-        UART1->CR1 |= USART_CR1_TXEIE;          // Enable TX interrupts???
-    }
+    if(instance != MODBUS_DMA_STREAM)
+        return false;
 
-    txbuf1.data[txbuf1.head] = c;               // Add data to buffer
-    txbuf1.head = next_head;                    // and update head pointer
+    do {
+        if(serial[--idx].instance == instance) {
+            if(serial[idx].flags.claimed)
+                return false;
+            serial[idx].flags.claimed = On;
+            break;
+        }
+    } while(idx);
 
-    UART1->CR1 |= USART_CR1_TXEIE;              // Enable TX interrupts
+#if MODBUS_DMA_STREAM == 1
+    UART1_CLK_En();
+    serial_gpio_init(&serial1_port);
+    raw->uart = UART1;
+    raw->clock = UART1_CLK;
+    raw->dma_rx_request = UART1_DMA_RX_REQ;
+    raw->dma_tx_request = UART1_DMA_TX_REQ;
+    raw->irq = UART1_IRQ;
+#else
+    UART2_CLK_En();
+    serial_gpio_init(&serial2_port);
+    raw->uart = UART2;
+    raw->clock = UART2_CLK;
+    raw->dma_rx_request = UART2_DMA_RX_REQ;
+    raw->dma_tx_request = UART2_DMA_TX_REQ;
+    raw->irq = UART2_IRQ;
+#endif
 
     return true;
 }
 
-//
-// Writes a null terminated string to the serial output stream, blocks if buffer full
-//
-static void serial1WriteS (const char *s)
-{
-    char c, *ptr = (char *)s;
+#endif // MODBUS_DMA_ENABLE
 
-    while((c = *ptr++) != '\0')
-        serial1PutC(c);
-}
+#endif // SERIAL_PORT || SERIAL1_PORT || SERIAL2_PORT
 
-// Writes a number of characters from a buffer to the serial output stream, blocks if buffer full
-//
-static void serial1Write (const char *s, uint16_t length)
-{
-    char *ptr = (char *)s;
+#if SERIAL_PORT
 
-    while(length--)
-        serial1PutC(*ptr++);
-}
+SERIAL_RX_FUNCTIONS()
 
-//
-// Flushes the serial output buffer
-//
-static void serial1TxFlush (void)
-{
-    UART1->CR1 &= ~USART_CR1_TXEIE;     // Disable TX interrupts
-    txbuf1.tail = txbuf1.head;
-}
+#if SERIAL_RX_DMA
 
 //
-// Returns number of characters pending transmission
+// Moves bytes received by DMA since last call to the serial input buffer
 //
-static uint16_t serial1TxCount (void)
+static void serialRxDMAProcess (void)
 {
-    uint32_t tail = txbuf1.tail, head = txbuf1.head;
+    uint_fast16_t head = SERIAL_RX_DMA_SIZE - __HAL_DMA_GET_COUNTER(&uart0_dma_rx), tail = dma_rx_tail;
 
-    return BUFCOUNT(head, tail, TX_BUFFER_SIZE) + (UART1->ISR & USART_ISR_TC ? 0 : 1);
-}
+    if(head == SERIAL_RX_DMA_SIZE)
+        head = 0;
 
-//
-// serialGetC - returns -1 if no data available
-//
-static int16_t serial1GetC (void)
-{
-    uint_fast16_t tail = rxbuf1.tail;       // Get buffer pointer
+    if(head == tail)
+        return;
 
-    if(tail == rxbuf1.head)
-        return -1; // no data available
+    // CPU never writes the buffer so there are no dirty lines, safe to invalidate all of it
+    dma_buffer_invalidate(dma_rxbuf, sizeof(dma_rxbuf));
+
+    do {
+        char data = (char)dma_rxbuf[tail];
+        tail = tail == SERIAL_RX_DMA_SIZE - 1 ? 0 : tail + 1;
+        serial_rx_put(&serial_port, data);
+    } while(tail != head);
 
-    char data = rxbuf1.data[tail];          // Get next character
-    rxbuf1.tail = BUFNEXT(tail, rxbuf1);    // and update pointer
+    dma_rx_tail = tail;
+    serial_rts_stop(&serial_port);
+}
 
-    return (int16_t)data;
+static void serialRxDMAStart (void)
+{
+    HAL_DMA_Abort(&uart0_dma_rx); // no-op if not running
+    dma_rx_tail = 0;
+    HAL_DMA_Start(&uart0_dma_rx, (uint32_t)&UART0->RDR, (uint32_t)dma_rxbuf, SERIAL_RX_DMA_SIZE);
+    __HAL_DMA_ENABLE_IT(&uart0_dma_rx, DMA_IT_HT|DMA_IT_TC);
 }
 
-static bool serial1SuspendInput (bool suspend)
+void UART0_RX_DMA_IRQHandler (void)
 {
-    return stream_rx_suspend(&rxbuf1, suspend);
+    __HAL_DMA_CLEAR_FLAG(&uart0_dma_rx, __HAL_DMA_GET_HT_FLAG_INDEX(&uart0_dma_rx)|__HAL_DMA_GET_TC_FLAG_INDEX(&uart0_dma_rx));
+    serialRxDMAProcess();
 }
 
-static bool serial1SetBaudRate (uint32_t baud_rate)
+static bool serialSetBaudRate (uint32_t baud_rate)
 {
-    UART1->CR1 = USART_CR1_RE|USART_CR1_TE;
-    UART1->CR3 = USART_CR3_OVRDIS;
-    UART1->BRR = UART_DIV_SAMPLING16(UART1_CLK, baud_rate, UART_PRESCALER_DIV1);
-    UART1->CR1 |= (USART_CR1_UE|USART_CR1_RXNEIE);
+    uint32_t cr1 = USART_CR1_RE|USART_CR1_TE|(USART_CR1_FIFO & USART_CR1_FIFOEN);
 
-    rxbuf1.tail = rxbuf1.head;
-    txbuf1.tail = txbuf1.head;
+    UART0->CR1 = 0;
+    UART0->BRR = serial_brr(UART0_CLK, baud_rate, &cr1);
+    UART0->CR1 = cr1;
+    UART0->CR2 = serial_port.cr2;
+    UART0->CR3 = USART_CR3_OVRDIS|USART_CR3_DMAR|serial_port.cr3;
+    serialRxDMAStart();
+    UART0->CR1 |= (USART_CR1_UE|USART_CR1_IDLEIE);
+
+    rxbuf.tail = rxbuf.head;
+    txbuf.tail = txbuf.head;
+    serial_rts_resume(&serial_port);
 
     return true;
 }
 
-static bool serial1Disable (bool disable)
+static bool serialDisable (bool disable)
 {
-    if(disable)
-        UART1->CR1 &= ~USART_CR1_RXNEIE;
-    else
-        UART1->CR1 |= USART_CR1_RXNEIE;
+    if(disable) {
+        UART0->CR1 &= ~USART_CR1_IDLEIE;
+        UART0->CR3 &= ~USART_CR3_DMAR;
+    } else {
+        serialRxDMAStart(); // discard anything received while disabled
+        UART0->CR3 |= USART_CR3_DMAR;
+        UART0->CR1 |= USART_CR1_IDLEIE;
+    }
 
     return true;
 }
 
-static bool serial1EnqueueRtCommand (char c)
-{
-    return enqueue_realtime_command1(c);
-}
+#else
 
-static enqueue_realtime_command_ptr serial1SetRtHandler (enqueue_realtime_command_ptr handler)
-{
-    enqueue_realtime_command_ptr prev = enqueue_realtime_command1;
+SERIAL_CTRL_FUNCTIONS(, UART0_CLK)
 
-    if(handler)
-        enqueue_realtime_command1 = handler;
+#endif // SERIAL_RX_DMA
 
-    return prev;
-}
+#if SERIAL_TX_DMA
 
-static const io_stream_t *serial1Init (uint32_t baud_rate)
+//
+// Starts DMA transfer of the next contiguous span of the output buffer, if idle.
+// Must be called from the DMA interrupt or with interrupts disabled.
+//
+static void serialTxDMAKick (void)
 {
-    static const io_stream_t stream = {
-        .type = StreamType_Serial,
-        .instance = 1,
-        .is_connected = stream_connected,
-        .read = serial1GetC,
-        .write = serial1WriteS,
-        .write_n =  serial1Write,
-        .write_char = serial1PutC,
-        .enqueue_rt_command = serial1EnqueueRtCommand,
-        .get_rx_buffer_free = serial1RxFree,
-        .get_rx_buffer_count = serial1RxCount,
-        .get_tx_buffer_count = serial1TxCount,
-        .reset_write_buffer = serial1TxFlush,
-        .reset_read_buffer = serial1RxFlush,
-        .cancel_read_buffer = serial1RxCancel,
-        .suspend_read = serial1SuspendInput,
-        .disable_rx = serial1Disable,
-        .set_baud_rate = serial1SetBaudRate,
-        .set_enqueue_rt_handler = serial1SetRtHandler
-    };
+    uint_fast16_t head = txbuf.head, tail = txbuf.tail;
 
-    if(!serialClaimPort(stream.instance))
-        return NULL;
+    if(dma_tx_len || head == tail)
+        return;
 
-    UART1_CLK_En();
+    uint16_t len = head > tail ? head - tail : TX_BUFFER_SIZE - tail;
 
-    GPIO_InitTypeDef GPIO_InitStructure = {
-        .Mode      = GPIO_MODE_AF_PP,
-        .Pull      = GPIO_NOPULL,
-        .Speed     = GPIO_SPEED_FREQ_VERY_HIGH,
-        .Pin       = (1 << UART1_RX_PIN)|(1 << UART1_TX_PIN),
-        .Alternate = UART1_AF
-    };
-    HAL_GPIO_Init(UART1_PORT, &GPIO_InitStructure);
-
-    serial1SetBaudRate(baud_rate);
+    SCB_CleanDCache_by_Addr((uint32_t *)&txbuf.data[tail], len);
 
-    HAL_NVIC_SetPriority(UART1_IRQ, 0, 0);
-    HAL_NVIC_EnableIRQ(UART1_IRQ);
-
-    return &stream;
+    dma_tx_len = len;
+    __HAL_DMA_CLEAR_FLAG(&uart0_dma_tx, __HAL_DMA_GET_TC_FLAG_INDEX(&uart0_dma_tx)|__HAL_DMA_GET_TE_FLAG_INDEX(&uart0_dma_tx)|__HAL_DMA_GET_FE_FLAG_INDEX(&uart0_dma_tx));
+    UART0_TX_DMA_STREAM->M0AR = (uint32_t)&txbuf.data[tail];
+    UART0_TX_DMA_STREAM->NDTR = len;
+    UART0_TX_DMA_STREAM->CR |= DMA_SxCR_TCIE|DMA_SxCR_EN;
 }
 
-void UART1_IRQHandler (void)
+void UART0_TX_DMA_IRQHandler (void)
 {
-    if(UART1->ISR & USART_ISR_RXNE_RXFNE) {
-        uint32_t data = UART1->RDR;
-        if(!enqueue_realtime_command1((char)data)) {            // Check and strip realtime commands...
-            uint16_t next_head = BUFNEXT(rxbuf1.head, rxbuf1);  // Get and increment buffer pointer
-            if(next_head == rxbuf1.tail)                        // If buffer full
-                rxbuf1.overflow = 1;                            // flag overflow
-            else {
-                rxbuf1.data[rxbuf1.head] = (char)data;          // if not add data to buffer
-                rxbuf1.head = next_head;                        // and update pointer
-            }
-        }
-    }
+    __HAL_DMA_CLEAR_FLAG(&uart0_dma_tx, __HAL_DMA_GET_TC_FLAG_INDEX(&uart0_dma_tx)|__HAL_DMA_GET_TE_FLAG_INDEX(&uart0_dma_tx)|__HAL_DMA_GET_FE_FLAG_INDEX(&uart0_dma_tx));
 
-    if((UART1->ISR & USART_ISR_TXE_TXFNF) && (UART1->CR1 & USART_CR1_TXEIE)) {
-        uint_fast16_t tail = txbuf1.tail;           // Get buffer pointer
-        UART1->TDR = txbuf1.data[tail];             // Send next character
-        txbuf1.tail = tail = BUFNEXT(tail, txbuf1); // and increment pointer
-        if(tail == txbuf1.head)                     // If buffer empty then
-            UART1->CR1 &= ~USART_CR1_TXEIE;         // disable UART TX interrupt
-   }
+    txbuf.tail = (txbuf.tail + dma_tx_len) & (TX_BUFFER_SIZE - 1);
+    dma_tx_len = 0;
+    serialTxDMAKick();
 }
 
-#endif // SERIAL1_PORT
-
-#if SERIAL2_PORT
+#if STREAM_FANOUT_NONBLOCK
+SERIAL_TX_ACCEPT()
+#endif
 
 //
-// Returns number of free characters in serial input buffer
+// Writes a number of characters from string to the serial output stream, blocks if buffer full
 //
-static uint16_t serial2RxFree (void)
+static void serialWriteBuf (const char *s, uint16_t length)
 {
-    uint32_t tail = rxbuf2.tail, head = rxbuf2.head;
+    while(length) {
 
-    return (RX_BUFFER_SIZE - 1) - BUFCOUNT(head, tail, RX_BUFFER_SIZE);
-}
+        uint_fast16_t head = txbuf.head, tail = txbuf.tail;
+        uint16_t span = tail > head ? tail - head - 1 : TX_BUFFER_SIZE - head - (tail == 0 ? 1 : 0);
 
-//
-// Returns number of characters in serial input buffer
-//
-static uint16_t serial2RxCount (void)
-{
-    uint32_t tail = rxbuf2.tail, head = rxbuf2.head;
+        if(span == 0) {                                     // TX buffer full
+            if(!hal.stream_blocking_callback())             // check if blocking for space,
+                return;                                     // exit if not
+            continue;
+        }
 
-    return BUFCOUNT(head, tail, RX_BUFFER_SIZE);
-}
+        if(span > length)
+            span = length;
 
-//
-// Flushes the serial input buffer
-//
-static void serial2RxFlush (void)
-{
-    rxbuf2.tail = rxbuf2.head;
+        memcpy(&txbuf.data[head], s, span);                 // Add data to buffer,
+        txbuf.head = (head + span) & (TX_BUFFER_SIZE - 1);  // update head pointer and
+        s += span;
+        length -= span;
+
+        __disable_irq();
+        serialTxDMAKick();                                  // start transfer if idle
+        __enable_irq();
+    }
 }
 
-//
-// Flushes and adds a CAN character to the serial input buffer
-//
-static void serial2RxCancel (void)
+static void serialWrite (const char *s, uint16_t length)
 {
-    rxbuf2.data[rxbuf2.head] = ASCII_CAN;
-    rxbuf2.tail = rxbuf2.head;
-    rxbuf2.head = BUFNEXT(rxbuf2.head, rxbuf2);
+#if STREAM_FANOUT_NONBLOCK
+    if(!serialTxAccept(s, length))
+        return;
+#endif
+
+    serialWriteBuf(s, length);
 }
 
 //
 // Writes a character to the serial output stream
 //
-static bool serial2PutC (const char c)
+static bool serialPutC (const char c)
 {
-    uint32_t next_head = BUFNEXT(txbuf2.head, txbuf2);   // Set and update head pointer
+    uint16_t next_head = BUFNEXT(txbuf.head, txbuf);    // Get pointer to next free slot in buffer
 
-    while(txbuf2.tail == next_head) {           // While TX buffer full
-        if(!hal.stream_blocking_callback())     // check if blocking for space,
-            return false;                       // exit if not (leaves TX buffer in an inconsistent state)
-        UART2->CR1 |= USART_CR1_TXEIE;          // Enable TX interrupts???
-    }
+#if STREAM_FANOUT_NONBLOCK
+    if(!serialTxAccept(&c, 1))
+        return true;
+#endif
 
-    txbuf2.data[txbuf2.head] = c;               // Add data to buffer
-    txbuf2.head = next_head;                    // and update head pointer
+    while(txbuf.tail == next_head) {                    // While TX buffer full
+        if(!hal.stream_blocking_callback())             // check if blocking for space,
+            return false;                               // exit if not
+    }
 
-    UART2->CR1 |= USART_CR1_TXEIE;              // Enable TX interrupts
+    serialWriteBuf(&c, 1);
 
     return true;
 }
@@ -1003,169 +1382,153 @@ static bool serial2PutC (const char c)
 //
 // Writes a null terminated string to the serial output stream, blocks if buffer full
 //
-static void serial2WriteS (const char *s)
+static void serialWriteS (const char *s)
 {
-    char c, *ptr = (char *)s;
-
-    while((c = *ptr++) != '\0')
-        serial2PutC(c);
-}
-
-// Writes a number of characters from a buffer to the serial output stream, blocks if buffer full
-//
-static void serial2Write (const char *s, uint16_t length)
-{
-    char *ptr = (char *)s;
-
-    while(length--)
-        serial2PutC(*ptr++);
+    serialWrite(s, strlen(s));
 }
 
 //
 // Flushes the serial output buffer
 //
-static void serial2TxFlush (void)
+static void serialTxFlush (void)
 {
-    UART2->CR1 &= ~USART_CR1_TXEIE;     // Disable TX interrupts
-    txbuf2.tail = txbuf2.head;
+    __disable_irq();
+    UART0_TX_DMA_STREAM->CR &= ~(DMA_SxCR_TCIE|DMA_SxCR_EN);
+    while(UART0_TX_DMA_STREAM->CR & DMA_SxCR_EN);
+    dma_tx_len = 0;
+    txbuf.tail = txbuf.head;
+    __enable_irq();
 }
 
-//
-// Returns number of characters pending transmission
-//
-static uint16_t serial2TxCount (void)
-{
-    uint32_t tail = txbuf2.tail, head = txbuf2.head;
+#else
 
-    return BUFCOUNT(head, tail, TX_BUFFER_SIZE) + (UART2->ISR & USART_ISR_TC ? 0 : 1);
-}
+SERIAL_TX_FUNCTIONS()
 
-//
-// serialGetC - returns -1 if no data available
-//
-static int16_t serial2GetC (void)
+#endif // SERIAL_TX_DMA
+
+SERIAL_STREAM(, 0)
+
+static const io_stream_t *serialInit (uint32_t baud_rate)
 {
-    uint_fast16_t tail = rxbuf2.tail;       // Get buffer pointer
+    if(!serialClaimPort(serial_stream.instance))
+        return NULL;
 
-    if(tail == rxbuf2.head)
-        return -1; // no data available
+    UART0_CLK_En();
 
-    char data = rxbuf2.data[tail];          // Get next character
-    rxbuf2.tail = BUFNEXT(tail, rxbuf2);    // and update pointer
+    serial_gpio_init(&serial_port);
 
-    return (int16_t)data;
-}
+#if SERIAL_RX_DMA
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    HAL_DMA_Init(&uart0_dma_rx);
 
-static bool serial2SuspendInput (bool suspend)
-{
-    return stream_rx_suspend(&rxbuf2, suspend);
+    HAL_NVIC_SetPriority(UART0_RX_DMA_IRQ, IRQ_PRIO_SERIAL, 0);
+    HAL_NVIC_EnableIRQ(UART0_RX_DMA_IRQ);
+#endif
+
+#if SERIAL_TX_DMA
+    __HAL_RCC_DMA2_CLK_ENABLE();
+    HAL_DMA_Init(&uart0_dma_tx);
+    UART0_TX_DMA_STREAM->PAR = (uint32_t)&UART0->TDR;
+
+    HAL_NVIC_SetPriority(UART0_TX_DMA_IRQ, IRQ_PRIO_SERIAL, 0);
+    HAL_NVIC_EnableIRQ(UART0_TX_DMA_IRQ);
+#endif
+
+    serialSetBaudRate(baud_rate);
+
+    serial_irq_enable(&serial_port);
+
+    return &serial_stream;
 }
 
-static bool serial2SetBaudRate (uint32_t baud_rate)
+void UART0_IRQHandler (void)
 {
-    UART2->CR1 = USART_CR1_RE|USART_CR1_TE;
-    UART2->CR3 = USART_CR3_OVRDIS;
-    UART2->BRR = UART_DIV_SAMPLING16(UART2_CLK, baud_rate, UART_PRESCALER_DIV1);
-    UART2->CR1 |= (USART_CR1_UE|USART_CR1_RXNEIE);
+    ISR_PROFILE_ENTER();
 
-    rxbuf2.tail = rxbuf2.head;
-    txbuf2.tail = txbuf2.head;
+#if SERIAL_AUTOBAUD
+    if(UART0->ISR & USART_ISR_ABRE)     // Measurement failed (first character had bit 0 clear or
+        UART0->RQR = USART_RQR_ABRRQ;   // out of range), measure the next one
+#endif
 
-    return true;
+#if SERIAL_RX_DMA
+    if((UART0->ISR & USART_ISR_IDLE) && (UART0->CR1 & USART_CR1_IDLEIE)) {
+        UART0->ICR = USART_ICR_IDLECF;
+        serialRxDMAProcess();
+    }
+#else
+    serial_rx_irq(&serial_port);
+#endif
+#if !SERIAL_TX_DMA
+    serial_tx_irq(&serial_port);
+#endif
+
+    ISR_PROFILE_EXIT(IsrProfile_UART0);
 }
 
-static bool serial2Disable (bool disable)
+#endif // SERIAL_PORT
+
+#if SERIAL1_PORT
+
+SERIAL_RX_FUNCTIONS(1)
+SERIAL_TX_FUNCTIONS(1)
+SERIAL_CTRL_FUNCTIONS(1, UART1_CLK)
+SERIAL_STREAM(1, 1)
+
+static const io_stream_t *serial1Init (uint32_t baud_rate)
 {
-    if(disable)
-        UART2->CR1 &= ~USART_CR1_RXNEIE;
-    else
-        UART2->CR1 |= USART_CR1_RXNEIE;
+    if(!serialClaimPort(serial1_stream.instance))
+        return NULL;
 
-    return true;
+    UART1_CLK_En();
+
+    serial_gpio_init(&serial1_port);
+    serial1SetBaudRate(baud_rate);
+    serial_irq_enable(&serial1_port);
+
+    return &serial1_stream;
 }
 
-static bool serial2EnqueueRtCommand (char c)
+void UART1_IRQHandler (void)
 {
-    return enqueue_realtime_command2(c);
+#if MODBUS_DMA_STREAM == 1
+    modbus_dma_irq_handler();
+#else
+    serial_rx_irq(&serial1_port);
+    serial_tx_irq(&serial1_port);
+#endif
 }
 
-static enqueue_realtime_command_ptr serial2SetRtHandler (enqueue_realtime_command_ptr handler)
-{
-    enqueue_realtime_command_ptr prev = enqueue_realtime_command2;
+#endif // SERIAL1_PORT
 
-    if(handler)
-        enqueue_realtime_command2 = handler;
+#if SERIAL2_PORT
 
-    return prev;
-}
+SERIAL_RX_FUNCTIONS(2)
+SERIAL_TX_FUNCTIONS(2)
+SERIAL_CTRL_FUNCTIONS(2, UART2_CLK)
+SERIAL_STREAM(2, 2)
 
 static const io_stream_t *serial2Init (uint32_t baud_rate)
 {
-    static const io_stream_t stream = {
-        .type = StreamType_Serial,
-        .instance = 2,
-        .is_connected = stream_connected,
-        .read = serial2GetC,
-        .write = serial2WriteS,
-        .write_n =  serial2Write,
-        .write_char = serial2PutC,
-        .enqueue_rt_command = serial2EnqueueRtCommand,
-        .get_rx_buffer_free = serial2RxFree,
-        .get_rx_buffer_count = serial2RxCount,
-        .get_tx_buffer_count = serial2TxCount,
-        .reset_write_buffer = serial2TxFlush,
-        .reset_read_buffer = serial2RxFlush,
-        .cancel_read_buffer = serial2RxCancel,
-        .suspend_read = serial2SuspendInput,
-        .disable_rx = serial2Disable,
-        .set_baud_rate = serial2SetBaudRate,
-        .set_enqueue_rt_handler = serial2SetRtHandler
-    };
-
-    if(!serialClaimPort(stream.instance))
+    if(!serialClaimPort(serial2_stream.instance))
         return NULL;
 
     UART2_CLK_En();
 
-    GPIO_InitTypeDef GPIO_InitStructure = {
-        .Mode      = GPIO_MODE_AF_PP,
-        .Pull      = GPIO_NOPULL,
-        .Speed     = GPIO_SPEED_FREQ_VERY_HIGH,
-        .Pin       = (1 << UART2_RX_PIN)|(1 << UART2_TX_PIN),
-        .Alternate = UART2_AF
-    };
-    HAL_GPIO_Init(UART2_PORT, &GPIO_InitStructure);
-
+    serial_gpio_init(&serial2_port);
     serial2SetBaudRate(baud_rate);
+    serial_irq_enable(&serial2_port);
 
-    HAL_NVIC_SetPriority(UART2_IRQ, 0, 0);
-    HAL_NVIC_EnableIRQ(UART2_IRQ);
-
-    return &stream;
+    return &serial2_stream;
 }
 
 void UART2_IRQHandler (void)
 {
-    if(UART2->ISR & USART_ISR_RXNE_RXFNE) {
-        uint32_t data = UART2->RDR;
-        if(!enqueue_realtime_command2((char)data)) {            // Check and strip realtime commands...
-            uint16_t next_head = BUFNEXT(rxbuf2.head, rxbuf2);  // Get and increment buffer pointer
-            if(next_head == rxbuf2.tail)                        // If buffer full
-                rxbuf2.overflow = 1;                            // flag overflow
-            else {
-                rxbuf2.data[rxbuf2.head] = (char)data;          // if not add data to buffer
-                rxbuf2.head = next_head;                        // and update pointer
-            }
-        }
-    }
-
-    if((UART2->ISR & USART_ISR_TXE_TXFNF) && (UART2->CR1 & USART_CR1_TXEIE)) {
-        uint_fast16_t tail = txbuf2.tail;           // Get buffer pointer
-        UART2->TDR = txbuf2.data[tail];             // Send next character
-        txbuf2.tail = tail = BUFNEXT(tail, txbuf2); // and increment pointer
-        if(tail == txbuf2.head)                     // If buffer empty then
-            UART2->CR1 &= ~USART_CR1_TXEIE;         // disable UART TX interrupt
-   }
+#if MODBUS_DMA_STREAM == 2
+    modbus_dma_irq_handler();
+#else
+    serial_rx_irq(&serial2_port);
+    serial_tx_irq(&serial2_port);
+#endif
 }
 
 #endif // SERIAL2_PORT
@@ -23,6 +23,11 @@
 #include "main.h"
 #include "driver.h"
 #include "cache.h"
+#include "spi.h"
+
+#include <stdio.h>
+
+#include "grbl/system.h"
 
 #ifndef SPI_DMA_THRESHOLD
 #define SPI_DMA_THRESHOLD 32
@@ -32,9 +37,8 @@
 #define SPI_SCRATCH_BUFFER_SIZE 128
 #endif
 
-// Used for debugging info only
-static uint32_t tx_count_dma, tx_count_poll;
-static uint32_t rx_count_dma, rx_count_poll;
+// Used for debugging info only, see spi_get_stats()
+static spi_stats_t stats = {0};
 
 #define SPIport(p) SPIportI(p)
 #define SPIportI(p) SPI ## p
@@ -138,9 +142,63 @@ static DMA_HandleTypeDef spi_dma_rx = {
 
 #if USE_SPI_DMA && L1_CACHE_ENABLE
 /* Scratch buffer must start and end on cache line boundaries for safe cache maintenance */
-static uint8_t scratch_buffer[align_up(SPI_SCRATCH_BUFFER_SIZE, __SCB_DCACHE_LINE_SIZE)] __ALIGNED(__SCB_DCACHE_LINE_SIZE);
+static uint8_t scratch_buffer[align_up(SPI_SCRATCH_BUFFER_SIZE, __SCB_DCACHE_LINE_SIZE)] DMA_BUFFER;
 #endif
 
+// Cache maintenance for caller buffers, not needed for buffers from the non-cacheable DMA arena.
+static inline void spi_cache_clean (uint8_t *data, uint16_t len)
+{
+    if(!is_dma_arena(data))
+        SCB_CleanDCache_by_Addr((uint32_t*)data, len);
+}
+
+static inline void spi_cache_invalidate (uint8_t *data, uint16_t len)
+{
+    if(!is_dma_arena(data))
+        SCB_InvalidateDCache_by_Addr((uint32_t*)data, len);
+}
+
+// RX buffers must not share cache lines with other data unless non-cacheable.
+static inline bool spi_dma_safe (uint8_t *data, uint16_t len)
+{
+    return is_dma_arena(data) || is_cache_aligned(data, len);
+}
+
+/*
+ * Non-blocking transfers are queued as a linked list of caller owned transactions and run back
+ * to back from the HAL completion callbacks. Blocking calls wait for the queue to drain first.
+ */
+static struct {
+    spi_transaction_t *volatile head;
+    spi_transaction_t *tail;
+    volatile bool running;
+    bool dma;
+} spi_queue = {0};
+
+static inline void spi_wait_idle (void)
+{
+    while(spi_queue.running || spi_queue.head);
+}
+
+// $SPISTATS - report transfer counters, $SPISTATS=R to reset
+static status_code_t spi_report_stats (sys_state_t state, char *args)
+{
+    char buf[140];
+    spi_stats_t spi_stats;
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    spi_get_stats(&spi_stats, args != NULL);
+
+    snprintf(buf, sizeof(buf), "[SPI|txdma=%lu,txpoll=%lu,rxdma=%lu,rxpoll=%lu,bounce=%lu,bounce_bytes=%lu,unaligned=%lu]" ASCII_EOL,
+              spi_stats.tx_dma, spi_stats.tx_poll, spi_stats.rx_dma, spi_stats.rx_poll,
+               spi_stats.rx_bounce, spi_stats.rx_bounce_bytes, spi_stats.rx_unaligned);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
 void spi_init (void)
 {
     static bool init = false;
@@ -342,13 +400,13 @@ void spi_init (void)
         HAL_DMA_Init(&spi_dma_tx);
         __HAL_LINKDMA(&spi_port, hdmatx, spi_dma_tx);
 
-        HAL_NVIC_SetPriority(DMA_RX_IRQ, 1, 1);
+        HAL_NVIC_SetPriority(DMA_RX_IRQ, IRQ_PRIO_SPI, 0);
         HAL_NVIC_EnableIRQ(DMA_RX_IRQ);
-        HAL_NVIC_SetPriority(DMA_TX_IRQ, 1, 1);
+        HAL_NVIC_SetPriority(DMA_TX_IRQ, IRQ_PRIO_SPI, 0);
         HAL_NVIC_EnableIRQ(DMA_TX_IRQ);
 #endif
 
-        HAL_NVIC_SetPriority(SPI_IRQ, 1, 0);
+        HAL_NVIC_SetPriority(SPI_IRQ, IRQ_PRIO_SPI, 0);
         HAL_NVIC_EnableIRQ(SPI_IRQ);
 
         HAL_SPI_Init(&spi_port);
@@ -357,6 +415,17 @@ void spi_init (void)
         hal.periph_port.register_pin(&sdo);
         hal.periph_port.register_pin(&sdi);
 
+        static const sys_command_t spi_command_list[] = {
+            {"SPISTATS", spi_report_stats, {}, { .str = "report SPI transfer counters, $SPISTATS=R to reset" } }
+        };
+
+        static sys_commands_t spi_commands = {
+            .n_commands = sizeof(spi_command_list) / sizeof(sys_command_t),
+            .commands = spi_command_list
+        };
+
+        system_register_commands(&spi_commands);
+
         init = true;
     }
 }
@@ -364,6 +433,8 @@ void spi_init (void)
 // set the SPI speed to the max setting
 void spi_set_max_speed (void)
 {
+    spi_wait_idle();
+
     __HAL_SPI_DISABLE(&spi_port);
     MODIFY_REG(spi_port.Instance->CFG1, SPI_CFG1_MBR, SPI_BAUDRATEPRESCALER_2); // should be able to go to 24Mhz...
     __HAL_SPI_ENABLE(&spi_port);
@@ -371,6 +442,8 @@ void spi_set_max_speed (void)
 
 uint32_t spi_set_speed (uint32_t prescaler)
 {
+    spi_wait_idle();
+
     __HAL_SPI_DISABLE(&spi_port);
     MODIFY_REG(spi_port.Instance->CFG1, SPI_CFG1_MBR, prescaler);
     __HAL_SPI_ENABLE(&spi_port);
@@ -380,6 +453,9 @@ uint32_t spi_set_speed (uint32_t prescaler)
 uint8_t spi_get_byte (void)
 {
     uint8_t byte;
+
+    spi_wait_idle();
+
     HAL_SPI_Receive(&spi_port, &byte, 1, 1000);
     return byte;
 }
@@ -388,6 +464,8 @@ uint8_t spi_put_byte (uint8_t tx_byte)
 {
     uint8_t rx_byte;
 
+    spi_wait_idle();
+
     // using TransmitReceive as TMC_SPI code uses the RX byte in some cases.
     HAL_SPI_TransmitReceive(&spi_port, &tx_byte, &rx_byte, 1, 1000);
 
@@ -398,6 +476,8 @@ void spi_write (uint8_t *data, uint16_t len)
 {
     bool use_dma = false;
 
+    spi_wait_idle();
+
 #if USE_SPI_DMA
     if (len >= SPI_DMA_THRESHOLD)
         use_dma = true;
@@ -405,7 +485,7 @@ void spi_write (uint8_t *data, uint16_t len)
 
     if (use_dma) {
 
-        tx_count_dma++;
+        stats.tx_dma++;
 
         /*
          * Cache aligned buffers not strictly required for TX only.
@@ -413,7 +493,7 @@ void spi_write (uint8_t *data, uint16_t len)
          * See notes in cache.c for context.
          */
 #if L1_CACHE_ENABLE
-        SCB_CleanDCache_by_Addr((uint32_t*)data, len);
+        spi_cache_clean(data, len);
 #endif
 
         if(HAL_SPI_Transmit_DMA(&spi_port, data, len) == HAL_OK)
@@ -421,7 +501,7 @@ void spi_write (uint8_t *data, uint16_t len)
 
         __HAL_DMA_DISABLE(&spi_dma_tx);
     } else {
-        tx_count_poll++;
+        stats.tx_poll++;
         HAL_SPI_Transmit(&spi_port, data, len, 1000);
     }
 }
@@ -431,19 +511,21 @@ void spi_read (uint8_t *data, uint16_t len)
     bool use_dma = false;
     bool use_scratch_buffer = false;
 
+    spi_wait_idle();
+
 #if USE_SPI_DMA
     if (len >= SPI_DMA_THRESHOLD)
         use_dma = true;
 #if L1_CACHE_ENABLE
     // If using data cache, the RX buffer must be aligned to cache line boundaries
-    if (!is_cache_aligned(data, len))
+    if (!spi_dma_safe(data, len))
         use_scratch_buffer = true;
 #endif // L1_CACHE_ENABLE
 #endif // USE_SPI_DMA
 
     if (use_dma) {
 
-        rx_count_dma++;
+        stats.rx_dma++;
 
         /*
          * Cache aligned buffers are required for RX.
@@ -455,29 +537,32 @@ void spi_read (uint8_t *data, uint16_t len)
         if(!use_scratch_buffer) {
 
 #if L1_CACHE_ENABLE
-            SCB_InvalidateDCache_by_Addr((uint32_t*)data, len);
+            spi_cache_invalidate(data, len);
 #endif
 
             if(HAL_SPI_Receive_DMA(&spi_port, data, len) == HAL_OK)
                 while(spi_port.State != HAL_SPI_STATE_READY);
 
 #if L1_CACHE_ENABLE
-            SCB_InvalidateDCache_by_Addr((uint32_t*)data, len);
+            spi_cache_invalidate(data, len);
 #endif
 
         } else {
 #if L1_CACHE_ENABLE
             // buffer is not aligned for safe cache maintenance, using scratch buffer for DMA access
             int remain = len;
+
+            stats.rx_bounce++;
+            stats.rx_bounce_bytes += len;
             while (remain > 0) {
                 int bytes = remain > SPI_SCRATCH_BUFFER_SIZE ? SPI_SCRATCH_BUFFER_SIZE : remain;
 
-                SCB_InvalidateDCache_by_Addr((uint32_t*)scratch_buffer, bytes);
+                dma_buffer_invalidate(scratch_buffer, bytes);
 
                 if(HAL_SPI_Receive_DMA(&spi_port, scratch_buffer, bytes) == HAL_OK)
                     while(spi_port.State != HAL_SPI_STATE_READY);
 
-                SCB_InvalidateDCache_by_Addr((uint32_t*)scratch_buffer, bytes);
+                dma_buffer_invalidate(scratch_buffer, bytes);
 
                 memcpy(data, scratch_buffer, bytes);
 
@@ -490,11 +575,221 @@ void spi_read (uint8_t *data, uint16_t len)
         __HAL_DMA_DISABLE(&spi_dma_tx);
 
     } else {
-        rx_count_poll++;
+        stats.rx_poll++;
         HAL_SPI_Receive(&spi_port, data, len, 1000);
     }
 }
 
+// Full duplex transfer, DMA is used at or above SPI_DMA_THRESHOLD when rx is cache aligned.
+void spi_transfer (uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+    bool use_dma = false;
+
+    spi_wait_idle();
+
+#if USE_SPI_DMA
+    if (len >= SPI_DMA_THRESHOLD)
+        use_dma = true;
+#if L1_CACHE_ENABLE
+    // no scratch buffer fallback for full duplex, poll unaligned RX buffers
+    if (use_dma && !spi_dma_safe(rx, len)) {
+        stats.rx_unaligned++;
+        use_dma = false;
+    }
+#endif // L1_CACHE_ENABLE
+#endif // USE_SPI_DMA
+
+    if (use_dma) {
+
+        stats.rx_dma++;
+
+#if L1_CACHE_ENABLE
+        spi_cache_clean(tx, len);
+        spi_cache_invalidate(rx, len);
+#endif
+
+        if(HAL_SPI_TransmitReceive_DMA(&spi_port, tx, rx, len) == HAL_OK)
+            while(spi_port.State != HAL_SPI_STATE_READY);
+
+#if L1_CACHE_ENABLE
+        spi_cache_invalidate(rx, len);
+#endif
+
+        __HAL_DMA_DISABLE(&spi_dma_rx);
+        __HAL_DMA_DISABLE(&spi_dma_tx);
+
+    } else {
+        stats.rx_poll++;
+        HAL_SPI_TransmitReceive(&spi_port, tx, rx, len, 1000);
+    }
+}
+
+// Starts the transaction at the head of the queue, returns false if the HAL refused it.
+static bool spi_queue_start (spi_transaction_t *t)
+{
+    HAL_StatusTypeDef ret;
+
+#if USE_SPI_DMA
+    spi_queue.dma = t->len >= SPI_DMA_THRESHOLD;
+#if L1_CACHE_ENABLE
+    // unaligned RX buffers are not safe for cache maintenance, use interrupt mode instead
+    if (spi_queue.dma && t->rx && !spi_dma_safe(t->rx, t->len)) {
+        stats.rx_unaligned++;
+        spi_queue.dma = false;
+    }
+#endif
+#else
+    spi_queue.dma = false;
+#endif
+
+    if(t->cs_port)
+        DIGITAL_OUT(t->cs_port, 1 << t->cs_pin, 0);
+
+    if(spi_queue.dma) {
+
+#if L1_CACHE_ENABLE
+        if(t->tx)
+            spi_cache_clean(t->tx, t->len);
+        if(t->rx)
+            spi_cache_invalidate(t->rx, t->len);
+#endif
+
+        if(t->tx && t->rx)
+            ret = HAL_SPI_TransmitReceive_DMA(&spi_port, t->tx, t->rx, t->len);
+        else if(t->tx)
+            ret = HAL_SPI_Transmit_DMA(&spi_port, t->tx, t->len);
+        else
+            ret = HAL_SPI_Receive_DMA(&spi_port, t->rx, t->len);
+    } else {
+        if(t->tx && t->rx)
+            ret = HAL_SPI_TransmitReceive_IT(&spi_port, t->tx, t->rx, t->len);
+        else if(t->tx)
+            ret = HAL_SPI_Transmit_IT(&spi_port, t->tx, t->len);
+        else
+            ret = HAL_SPI_Receive_IT(&spi_port, t->rx, t->len);
+    }
+
+    if(ret != HAL_OK && t->cs_port)
+        DIGITAL_OUT(t->cs_port, 1 << t->cs_pin, 1);
+
+    return ret == HAL_OK;
+}
+
+static spi_transaction_t *spi_queue_remove (void)
+{
+    spi_transaction_t *t = spi_queue.head;
+
+    if((spi_queue.head = t->next) == NULL)
+        spi_queue.tail = NULL;
+
+    return t;
+}
+
+// Runs queued transactions until one is started, failed ones are completed with ok = false.
+// Must be called from interrupt context or with interrupts disabled.
+static void spi_queue_run (void)
+{
+    spi_transaction_t *t;
+
+    while(!spi_queue.running && (t = spi_queue.head)) {
+        if(spi_queue_start(t))
+            spi_queue.running = true;
+        else {
+            spi_queue_remove();
+            if(t->callback)
+                t->callback(false, t->context);
+        }
+    }
+}
+
+static void spi_queue_complete (bool ok)
+{
+    spi_transaction_t *t;
+
+    if(!spi_queue.running)
+        return; // blocking transfer
+
+    if(spi_queue.dma) {
+        __HAL_DMA_DISABLE(&spi_dma_rx);
+        __HAL_DMA_DISABLE(&spi_dma_tx);
+    }
+
+    t = spi_queue_remove();
+
+#if L1_CACHE_ENABLE
+    if(spi_queue.dma && t->rx)
+        spi_cache_invalidate(t->rx, t->len);
+#endif
+
+    if(t->cs_port)
+        DIGITAL_OUT(t->cs_port, 1 << t->cs_pin, 1);
+
+    spi_queue.running = false;
+
+    if(t->callback)
+        t->callback(ok, t->context);
+
+    spi_queue_run();
+}
+
+// Queues a transfer and returns immediately, the transaction must stay valid until the callback is called.
+// Returns false if the transaction is invalid, callback is only called when true is returned.
+bool spi_transfer_async (spi_transaction_t *transaction)
+{
+    if(transaction->len == 0 || (transaction->tx == NULL && transaction->rx == NULL))
+        return false;
+
+    transaction->next = NULL;
+
+    __disable_irq();
+
+    if(spi_queue.tail)
+        spi_queue.tail->next = transaction;
+    else
+        spi_queue.head = transaction;
+    spi_queue.tail = transaction;
+
+    spi_queue_run();
+
+    __enable_irq();
+
+    return true;
+}
+
+void spi_get_stats (spi_stats_t *spi_stats, bool reset)
+{
+    __disable_irq();
+    memcpy(spi_stats, &stats, sizeof(spi_stats_t));
+    if(reset)
+        memset(&stats, 0, sizeof(spi_stats_t));
+    __enable_irq();
+}
+
+bool spi_busy (void)
+{
+    return spi_queue.running || spi_queue.head;
+}
+
+void HAL_SPI_TxCpltCallback (SPI_HandleTypeDef *hspi)
+{
+    spi_queue_complete(true);
+}
+
+void HAL_SPI_RxCpltCallback (SPI_HandleTypeDef *hspi)
+{
+    spi_queue_complete(true);
+}
+
+void HAL_SPI_TxRxCpltCallback (SPI_HandleTypeDef *hspi)
+{
+    spi_queue_complete(true);
+}
+
+void HAL_SPI_ErrorCallback (SPI_HandleTypeDef *hspi)
+{
+    spi_queue_complete(false);
+}
+
 void DMA_RX_IRQ_HANDLER(void)
 {
   HAL_DMA_IRQHandler(&spi_dma_rx);
@@ -40,6 +40,14 @@
 #include "../grbl/protocol.h"
 #include "spiflash.h"
 
+#if SPIFLASH_ASYNC || SPIFLASH_BENCH
+#include "../grbl/hal.h"
+#endif
+#if SPIFLASH_BENCH
+#include "../grbl/system.h"
+#include "../grbl/state_machine.h"
+#endif
+
 #if defined (STM32H743xx)
 QSPI_HandleTypeDef hxspi;
 static int  QSPI_Init(void);
@@ -98,8 +106,23 @@ const flash_cmd_t wb_cmds[CMD_COUNT] = {
     [CMD_BE]     = CMD_DEF(0xD8, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_0,    0), // Block Erase 64KB
     [CMD_PP]     = CMD_DEF(0x32, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_4,    0), // Quad Input Page Program
     [CMD_READ]   = CMD_DEF(0xEB, LINES_1, LINES_4, ADDR_SIZE_24B, LINES_4,    6), // Fast Read Quad I/O
+    [CMD_RDSFDP] = CMD_DEF(0x5A, LINES_1, LINES_1, ADDR_SIZE_24B, LINES_1,    8), // Read SFDP
 };
 
+// Read command used for memory mapped mode and indirect reads, selected by xSPI_SelectReadMode().
+static const flash_cmd_t *read_cmd = CMD(READ);
+static flash_cmd_t read_cmd_tuned;
+
+typedef struct {
+    bool valid;
+    bool dtr;           // DTR clocking supported
+    bool qpi;           // 4-4-4 fast read supported
+    uint8_t op_144;     // 1-4-4 fast read instruction, 0 if not supported
+    uint8_t dummy_144;  // mode + wait clocks
+} sfdp_info_t;
+
+static sfdp_info_t sfdp = {0};
+
 #if SPIFLASH_MEMORY_MAPPED
 static int xSPI_DisableMemoryMappedMode(void)
 {
@@ -110,6 +133,24 @@ static int xSPI_DisableMemoryMappedMode(void)
     }
     return SPIFLASH_OK;
 }
+
+/*
+ * Re-enable memory mapped mode after the flash content was changed by a program or erase and
+ * drop the D-cache lines of the changed range, the window is mapped cacheable by MPU_Config().
+ */
+static int xSPI_MemoryMappedUpdated(uint32_t offset, size_t len)
+{
+    uint32_t start = (SPIFLASH_BASE_ADDRESS + offset) & ~(__SCB_DCACHE_LINE_SIZE - 1);
+    uint32_t end = SPIFLASH_BASE_ADDRESS + offset + len;
+
+    if (xSPI_(EnableMemoryMappedMode)() != SPIFLASH_OK) {
+        return SPIFLASH_ERROR;
+    }
+
+    SCB_InvalidateDCache_by_Addr((uint32_t *)start, (int32_t)(end - start));
+
+    return SPIFLASH_OK;
+}
 #endif
 
 static int xSPI_ReadBytes(const flash_cmd_t *cmd, uint32_t offset, uint8_t *data, size_t len)
@@ -139,7 +180,7 @@ static int xSPI_Read(uint32_t offset, uint8_t *buffer, size_t buffer_size)
     unsigned char *address = (unsigned char *)SPIFLASH_BASE_ADDRESS + offset;
     memcpy(buffer, address, buffer_size);
 #else
-    if (xSPI_ReadBytes(CMD(READ), offset, (uint8_t *) buffer, buffer_size) != SPIFLASH_OK) {
+    if (xSPI_ReadBytes(read_cmd, offset, (uint8_t *) buffer, buffer_size) != SPIFLASH_OK) {
         return SPIFLASH_ERROR;
     }
 #endif
@@ -218,32 +259,28 @@ static int xSPI_WriteEnable(void)
 
 static int xSPI_SectorErase(uint32_t address)
 {
+    int res = SPIFLASH_ERROR;
+
 #if SPIFLASH_MEMORY_MAPPED
     if (xSPI_DisableMemoryMappedMode() != SPIFLASH_OK) {
         return SPIFLASH_ERROR;
     }
 #endif
 
-    if (xSPI_WriteEnable() != SPIFLASH_OK) {
-        return SPIFLASH_ERROR;
-    }
-
-    if (xSPI_WriteBytes(CMD(SE), address, NULL, 0) != SPIFLASH_OK) {
-        return SPIFLASH_ERROR;
-    }
-
-    // Wait for BUSY bit to be cleared..
-    if (xSPI_WaitForStatus(WB_SR1_BUSY_MATCH, WB_SR1_BUSY_MASK, xSPI_TIMEOUT_DEFAULT) != SPIFLASH_OK) {
-        return SPIFLASH_ERROR;
+    if (xSPI_WriteEnable() == SPIFLASH_OK &&
+         xSPI_WriteBytes(CMD(SE), address, NULL, 0) == SPIFLASH_OK) {
+        // Wait for BUSY bit to be cleared..
+        res = xSPI_WaitForStatus(WB_SR1_BUSY_MATCH, WB_SR1_BUSY_MASK, xSPI_TIMEOUT_DEFAULT);
     }
 
 #if SPIFLASH_MEMORY_MAPPED
-    if (xSPI_(EnableMemoryMappedMode)() != SPIFLASH_OK) {
+    // Back to memory mapped mode also on failure, reads expect it.
+    if (xSPI_MemoryMappedUpdated(address, SPIFLASH_SECTOR_SIZE) != SPIFLASH_OK) {
         return SPIFLASH_ERROR;
     }
 #endif
 
-    return SPIFLASH_OK;
+    return res;
 }
 
 static int xSPI_PageProgram(uint32_t address, const uint8_t *buffer, size_t buffer_size)
@@ -266,6 +303,8 @@ static int xSPI_PageProgram(uint32_t address, const uint8_t *buffer, size_t buff
 
 static int xSPI_Program(uint32_t address, const uint8_t *buffer, size_t buffer_size)
 {
+    int res = SPIFLASH_OK;
+    size_t size = buffer_size;
     unsigned iterations = (buffer_size + 255) / 256;
     unsigned dest_page = address / 256;
 
@@ -277,25 +316,25 @@ static int xSPI_Program(uint32_t address, const uint8_t *buffer, size_t buffer_s
     }
 #endif
 
-    for (int i = 0; i < iterations; i++) {
-        if (xSPI_WriteEnable() != SPIFLASH_OK) {
-            return SPIFLASH_ERROR;
-        }
-        if (xSPI_PageProgram((i + dest_page) * 256,
-                         buffer + (i * 256),
-                         buffer_size > 256 ? 256 : buffer_size) != SPIFLASH_OK) {
-            return SPIFLASH_ERROR;
+    for (int i = 0; i < iterations && res == SPIFLASH_OK; i++) {
+        if ((res = xSPI_WriteEnable()) == SPIFLASH_OK) {
+            res = xSPI_PageProgram((i + dest_page) * 256,
+                                   buffer + (i * 256),
+                                   buffer_size > 256 ? 256 : buffer_size);
         }
         buffer_size -= 256;
     }
 
 #if SPIFLASH_MEMORY_MAPPED
-    if (xSPI_(EnableMemoryMappedMode)() != SPIFLASH_OK) {
+    // Back to memory mapped mode also on failure, reads expect it.
+    if (xSPI_MemoryMappedUpdated(address, size) != SPIFLASH_OK) {
         return SPIFLASH_ERROR;
     }
+#else
+    (void)size;
 #endif
 
-    return SPIFLASH_OK;
+    return res;
 }
 
 /*
@@ -636,8 +675,8 @@ static void QSPI_SetCmd(QSPI_CommandTypeDef *qspi_cmd, const flash_cmd_t *cmd, u
     qspi_cmd->AlternateByteMode = QSPI_ALTERNATE_BYTES_NONE;
     qspi_cmd->DummyCycles = cmd->dummy;
 
-    qspi_cmd->DdrMode = QSPI_DDR_MODE_DISABLE;
-    qspi_cmd->DdrHoldHalfCycle = QSPI_DDR_HHC_ANALOG_DELAY;
+    qspi_cmd->DdrMode = cmd->dtr ? QSPI_DDR_MODE_ENABLE : QSPI_DDR_MODE_DISABLE;
+    qspi_cmd->DdrHoldHalfCycle = cmd->dtr ? QSPI_DDR_HHC_HALF_CLK_DELAY : QSPI_DDR_HHC_ANALOG_DELAY;
 
     qspi_cmd->SIOOMode = QSPI_SIOO_INST_EVERY_CMD;
 
@@ -654,7 +693,7 @@ static int QSPI_EnableMemoryMappedMode(void)
 {
     QSPI_CommandTypeDef      qspi_cmd = { 0 };
     QSPI_MemoryMappedTypeDef mem_mapped_cfg = { 0 };
-    const flash_cmd_t       *cmd = CMD(READ);
+    const flash_cmd_t       *cmd = read_cmd;
 
     xSPI_(SetCmd)(&qspi_cmd, cmd, 0, NULL, 0);
 
@@ -750,6 +789,9 @@ static void OSPI_SetCmd(OSPI_RegularCmdTypeDef *ospi_cmd, const flash_cmd_t *cmd
     ospi_cmd->DQSMode = HAL_OSPI_DQS_DISABLE;
     ospi_cmd->SIOOMode = HAL_OSPI_SIOO_INST_EVERY_CMD;
     ospi_cmd->InstructionDtrMode = HAL_OSPI_INSTRUCTION_DTR_DISABLE;
+    ospi_cmd->AddressDtrMode = cmd->dtr ? HAL_OSPI_ADDRESS_DTR_ENABLE : HAL_OSPI_ADDRESS_DTR_DISABLE;
+    ospi_cmd->AlternateBytesDtrMode = HAL_OSPI_ALTERNATE_BYTES_DTR_DISABLE;
+    ospi_cmd->DataDtrMode = cmd->dtr ? HAL_OSPI_DATA_DTR_ENABLE : HAL_OSPI_DATA_DTR_DISABLE;
 
     ospi_cmd->Address = address;
     ospi_cmd->AddressSize = address_size_map[cmd->addr_size];
@@ -764,7 +806,7 @@ static int OSPI_EnableMemoryMappedMode(void)
 {
     OSPI_RegularCmdTypeDef   ospi_cmd = { 0 };
     OSPI_MemoryMappedTypeDef mem_mapped_cfg = { 0 };
-    const flash_cmd_t       *cmd = CMD(READ);
+    const flash_cmd_t       *cmd = read_cmd;
 
     xSPI_(SetCmd)(&ospi_cmd, cmd, 0, NULL, 0);
 
@@ -795,40 +837,443 @@ static int OSPI_EnableMemoryMappedMode(void)
 
 #endif // STM32H743xx / STM32H723xx specific code
 
-void spiflash_init(void)
+/*
+ * Read the JEDEC SFDP basic flash parameter table (JESD216) for the supported fast read modes.
+ */
+static void xSPI_ReadSFDP(void)
+{
+    uint8_t hdr[16];
+    uint32_t dw[5], ptp;
+
+    if (xSPI_ReadBytes(CMD(RDSFDP), 0, hdr, sizeof(hdr)) != SPIFLASH_OK ||
+         memcmp(hdr, "SFDP", 4) || hdr[8] != 0x00 || hdr[11] < 5) {
+        return;
+    }
+
+    ptp = hdr[12] | (hdr[13] << 8) | (hdr[14] << 16);
+
+    if (xSPI_ReadBytes(CMD(RDSFDP), ptp, (uint8_t *)dw, sizeof(dw)) != SPIFLASH_OK) {
+        return;
+    }
+
+    sfdp.valid = true;
+    sfdp.dtr = !!(dw[0] & (1 << 19));
+    sfdp.qpi = !!(dw[4] & (1 << 4));
+    if (dw[0] & (1 << 21)) {
+        sfdp.op_144 = (dw[2] >> 8) & 0xFF;
+        sfdp.dummy_144 = ((dw[2] >> 5) & 0x07) + (dw[2] & 0x1F);
+    }
+
+    debug_printf("SFDP: DTR %d 4-4-4 %d 1-4-4 %02X/%d\n", sfdp.dtr, sfdp.qpi, sfdp.op_144, sfdp.dummy_144);
+}
+
+static void xSPI_SetSampleShift(bool dtr)
+{
+#if defined(STM32H743xx)
+    // Sample shifting is not supported in DDR mode.
+    MODIFY_REG(hxspi.Instance->CR, QUADSPI_CR_SSHIFT, dtr ? 0 : QUADSPI_CR_SSHIFT);
+#elif defined(STM32H723xx)
+    // Quarter cycle output hold for DTR, no effect on SDR commands.
+    MODIFY_REG(hxspi.Instance->TCR, OCTOSPI_TCR_DHQC, dtr ? OCTOSPI_TCR_DHQC : 0);
+#endif
+}
+
+/*
+ * Select the fastest read command the flash supports for memory mapped mode and indirect reads:
+ *
+ * - 1-4-4 DTR (Fast Read Quad I/O DTR, 0xED) when SFDP reports DTR and reads back the same as SDR,
+ *   twice the data rate at the same clock.
+ * - 1-4-4 SDR with the instruction and dummy clocks reported by SFDP, else the default 0xEB.
+ *
+ * 4-4-4 (QPI) is not used even if supported: all other commands would have to be sent as 4-4-4,
+ * and in memory mapped sequential reads the 8 instruction clocks are only sent per burst.
+ */
+static void xSPI_SelectReadMode(void)
+{
+    static uint8_t sdr[64], dtr[64];
+
+    xSPI_ReadSFDP();
+
+    if (sfdp.op_144 && sfdp.op_144 != 0xFF) {
+        read_cmd_tuned = *CMD(READ);
+        read_cmd_tuned.cmd = sfdp.op_144;
+        read_cmd_tuned.dummy = sfdp.dummy_144;
+        read_cmd = &read_cmd_tuned;
+    }
+
+#if SPIFLASH_READ_MODE != 1
+    if (sfdp.dtr || SPIFLASH_READ_MODE == 2) {
+
+        flash_cmd_t cmd = CMD_DEF(0xED, LINES_1, LINES_4, ADDR_SIZE_24B, LINES_4, SPIFLASH_DTR_DUMMY);
+        uint32_t offset = SPIFLASH_SECTOR_SIZE;     // skip possibly blank sector 0
+
+        cmd.dtr = 1;
+
+        if (xSPI_ReadBytes(read_cmd, offset, sdr, sizeof(sdr)) == SPIFLASH_OK) {
+            xSPI_SetSampleShift(true);
+            if (xSPI_ReadBytes(&cmd, offset, dtr, sizeof(dtr)) == SPIFLASH_OK && !memcmp(sdr, dtr, sizeof(sdr))) {
+                read_cmd_tuned = cmd;
+                read_cmd = &read_cmd_tuned;
+            } else {
+                xSPI_SetSampleShift(false);
+            }
+        }
+    }
+#endif
+
+    debug_printf("SPI flash read: %02X %s dummy %d\n", read_cmd->cmd, read_cmd->dtr ? "DTR" : "SDR", read_cmd->dummy);
+}
+
+#if SPIFLASH_BENCH && SPIFLASH_MEMORY_MAPPED
+
+#ifndef SPIFLASH_BENCH_BYTES
+#define SPIFLASH_BENCH_BYTES (1024 * 1024)
+#endif
+
+/*
+ * $SPIFBENCH - memory mapped sequential read benchmark
+ *
+ *  [SPIFBENCH|bytes=,us=,MBps=,op=,dtr=,dummy=,clk_khz=,sfdp=]
+ *
+ * The D-cache lines of the window are invalidated first, so this is the uncached read rate.
+ */
+static status_code_t spiflash_bench(sys_state_t state, char *args)
+{
+    static uint8_t buf[4096] __ALIGNED(__SCB_DCACHE_LINE_SIZE);
+
+    char resp[140];
+    uint32_t t, bytes, clk, size = SPIFLASH_SIZE * 1024 * 1024 / 8;
+
+    if (state_get() != STATE_IDLE) {
+        return Status_IdleError;
+    }
+
+#if SPIFLASH_ASYNC
+    spiflash_flush();
+#endif
+
+    if (size > SPIFLASH_BENCH_BYTES) {
+        size = SPIFLASH_BENCH_BYTES;
+    }
+
+    SCB_InvalidateDCache_by_Addr((uint32_t *)SPIFLASH_BASE_ADDRESS, size);
+
+    t = hal.get_micros();
+    for (bytes = 0; bytes < size; bytes += sizeof(buf)) {
+        memcpy(buf, (const void *)(SPIFLASH_BASE_ADDRESS + bytes), sizeof(buf));
+    }
+    t = hal.get_micros() - t;
+
+#if defined(STM32H743xx)
+    clk = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_QSPI) / (hxspi.Init.ClockPrescaler + 1);
+#else
+    clk = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_OSPI) / hxspi.Init.ClockPrescaler;
+#endif
+
+    snprintf(resp, sizeof(resp), "[SPIFBENCH|bytes=%lu,us=%lu,MBps=%.2f,op=%02X,dtr=%d,dummy=%d,clk_khz=%lu,sfdp=%d]" ASCII_EOL,
+              bytes, t, (float)bytes / (float)t, read_cmd->cmd, read_cmd->dtr, read_cmd->dummy, clk / 1000, sfdp.valid);
+    hal.stream.write(resp);
+
+    return Status_OK;
+}
+
+#endif // SPIFLASH_BENCH && SPIFLASH_MEMORY_MAPPED
+
+#if SPIFLASH_ASYNC
+
+/*
+ * Background erase/program job queue.
+ *
+ * Jobs are started and their completion polled from the realtime loop, once per millisecond,
+ * so a sector erase (up to ~400ms) no longer stalls the caller. Program data is copied into the
+ * job, a job covers at most one page. Memory mapped mode is left while jobs are pending and
+ * restored when the queue is drained.
+ *
+ * All other flash access (reads, synchronous program/erase) first waits for the queue to drain
+ * with spiflash_flush(), which also returns the status of the jobs done since the last flush.
+ */
+
+#ifndef SPIFLASH_JOB_QUEUE
+#define SPIFLASH_JOB_QUEUE 8        // jobs, 256 bytes of data each
+#endif
+
+typedef enum {
+    Job_Erase,
+    Job_Program
+} spiflash_job_op_t;
+
+typedef struct {
+    spiflash_job_op_t op;
+    uint32_t address;
+    uint16_t len;
+    uint8_t data[SPIFLASH_PAGE_SIZE];
+} spiflash_job_t;
+
+typedef struct {
+    spiflash_job_t job[SPIFLASH_JOB_QUEUE];
+    uint_fast8_t head;
+    uint_fast8_t tail;
+    bool active;                // job at tail started, flash busy
+    bool indirect;              // memory mapped mode left for jobs
+    uint32_t lo, hi;            // range changed while indirect
+    uint32_t polled;
+    int status;
+} spiflash_queue_t;
+
+static spiflash_queue_t jobs = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static inline uint_fast8_t job_next (uint_fast8_t idx)
+{
+    return idx == SPIFLASH_JOB_QUEUE - 1 ? 0 : idx + 1;
+}
+
+static inline uint_fast8_t job_free (void)
+{
+    return (jobs.tail + SPIFLASH_JOB_QUEUE - jobs.head - 1) % SPIFLASH_JOB_QUEUE;
+}
+
+static int job_start(const spiflash_job_t *job)
+{
+    uint8_t sr1 = 0;
+
+    // WEL is set when the command completes, a single status read is enough to check it.
+    if (xSPI_WriteBytes(CMD(WREN), 0, NULL, 0) != SPIFLASH_OK ||
+         xSPI_ReadBytes(CMD(RDSR1), 0, &sr1, 1) != SPIFLASH_OK ||
+          (sr1 & WB_SR1_WEL_MASK) != WB_SR1_WEL_MATCH) {
+        return SPIFLASH_ERROR;
+    }
+
+    if (job->op == Job_Erase) {
+        return xSPI_WriteBytes(CMD(SE), job->address, NULL, 0);
+    }
+
+    return xSPI_WriteBytes(CMD(PP), job->address, job->data, job->len);
+}
+
+static void jobs_poll(void)
+{
+    uint8_t sr1;
+
+    if (jobs.active) {
+        if (xSPI_ReadBytes(CMD(RDSR1), 0, &sr1, 1) != SPIFLASH_OK) {
+            jobs.status = SPIFLASH_ERROR;
+        } else if ((sr1 & WB_SR1_BUSY_MASK) != WB_SR1_BUSY_MATCH) {
+            return;
+        }
+        jobs.active = false;
+        jobs.tail = job_next(jobs.tail);
+    }
+
+    if (jobs.tail != jobs.head) {
+
+        spiflash_job_t *job = &jobs.job[jobs.tail];
+        uint32_t end = job->address + (job->op == Job_Erase ? SPIFLASH_SECTOR_SIZE : job->len);
+
+        if (!jobs.indirect) {
+#if SPIFLASH_MEMORY_MAPPED
+            if (xSPI_DisableMemoryMappedMode() != SPIFLASH_OK) {
+                jobs.status = SPIFLASH_ERROR;
+                return;
+            }
+#endif
+            jobs.indirect = true;
+            jobs.lo = job->address;
+            jobs.hi = end;
+        }
+
+        if (job->address < jobs.lo) {
+            jobs.lo = job->address;
+        }
+        if (end > jobs.hi) {
+            jobs.hi = end;
+        }
+
+        if (job_start(job) == SPIFLASH_OK) {
+            jobs.active = true;
+        } else {
+            jobs.status = SPIFLASH_ERROR;
+            jobs.tail = job_next(jobs.tail);
+        }
+    } else if (jobs.indirect) {
+#if SPIFLASH_MEMORY_MAPPED
+        if (xSPI_MemoryMappedUpdated(jobs.lo, jobs.hi - jobs.lo) != SPIFLASH_OK) {
+            jobs.status = SPIFLASH_ERROR;
+        }
+#endif
+        jobs.indirect = false;
+    }
+}
+
+static void spiflash_execute_realtime(sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if ((jobs.indirect || jobs.tail != jobs.head) && jobs.polled != hal.get_elapsed_ticks()) {
+        jobs.polled = hal.get_elapsed_ticks();
+        jobs_poll();
+    }
+}
+
+int spiflash_flush(void)
+{
+    int status;
+    uint32_t start_time = HAL_GetTick();
+
+    while (jobs.indirect || jobs.tail != jobs.head) {
+        jobs_poll();
+        if (HAL_GetTick() - start_time > xSPI_TIMEOUT_DEFAULT * (SPIFLASH_JOB_QUEUE + 1)) {
+            jobs.status = SPIFLASH_ERROR;
+            break;
+        }
+    }
+
+    status = jobs.status;
+    jobs.status = SPIFLASH_OK;
+
+    return status;
+}
+
+bool spiflash_busy(void)
+{
+    return jobs.indirect || jobs.tail != jobs.head;
+}
+
+bool spiflash_sector_erase_async(uint32_t address)
+{
+    if (job_free() == 0) {
+        return false;
+    }
+
+    jobs.job[jobs.head].op = Job_Erase;
+    jobs.job[jobs.head].address = address & ~(SPIFLASH_SECTOR_SIZE - 1);
+    jobs.head = job_next(jobs.head);
+
+    return true;
+}
+
+bool spiflash_program_async(uint32_t offset, const uint8_t *buffer, size_t buffer_size)
+{
+    size_t len;
+
+    assert((offset & 0xff) == 0);
+
+    if (job_free() < (buffer_size + SPIFLASH_PAGE_SIZE - 1) / SPIFLASH_PAGE_SIZE) {
+        return false;
+    }
+
+    while (buffer_size) {
+        len = buffer_size > SPIFLASH_PAGE_SIZE ? SPIFLASH_PAGE_SIZE : buffer_size;
+        jobs.job[jobs.head].op = Job_Program;
+        jobs.job[jobs.head].address = offset;
+        jobs.job[jobs.head].len = len;
+        memcpy(jobs.job[jobs.head].data, buffer, len);
+        jobs.head = job_next(jobs.head);
+        offset += len;
+        buffer += len;
+        buffer_size -= len;
+    }
+
+    return true;
+}
+
+#endif // SPIFLASH_ASYNC
+
+static int spiflash_hw_init(void)
 {
     // Initialise the QSPI/OPSI peripheral
     if (xSPI_(Init)() != SPIFLASH_OK) {
-        protocol_enqueue_foreground_task(report_warning, "SPI Flash initialisation failed!");
-        return;
+        return SPIFLASH_ERROR;
     }
 
     // Initialise the Winbond memory
     if (W25Qxx_Init() != SPIFLASH_OK) {
-        protocol_enqueue_foreground_task(report_warning, "SPI Flash initialisation failed!");
-        return;
+        return SPIFLASH_ERROR;
     }
 
+    xSPI_SelectReadMode();
+
 #if SPIFLASH_MEMORY_MAPPED
     if (xSPI_(EnableMemoryMappedMode)() != SPIFLASH_OK) {
+        return SPIFLASH_ERROR;
+    }
+#endif
+
+    return SPIFLASH_OK;
+}
+
+#if SPIFLASH_XIP
+
+static int xip_status = SPIFLASH_ERROR;
+
+// Called by main() before grbl_enter(), code placed in the SPI flash can run from then on.
+void spiflash_xip_init(void)
+{
+    xip_status = spiflash_hw_init();
+}
+
+#endif
+
+void spiflash_init(void)
+{
+#if SPIFLASH_XIP
+    if (xip_status != SPIFLASH_OK) {
+#else
+    if (spiflash_hw_init() != SPIFLASH_OK) {
+#endif
         protocol_enqueue_foreground_task(report_warning, "SPI Flash initialisation failed!");
         return;
     }
+
+#if SPIFLASH_ASYNC
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = spiflash_execute_realtime;
+#endif
+
+#if SPIFLASH_BENCH && SPIFLASH_MEMORY_MAPPED
+    static const sys_command_t bench_command_list[] = {
+        {"SPIFBENCH", spiflash_bench, {}, { .str = "SPI flash memory mapped read benchmark" } }
+    };
+
+    static sys_commands_t bench_commands = {
+        .n_commands = sizeof(bench_command_list) / sizeof(sys_command_t),
+        .commands = bench_command_list
+    };
+
+    system_register_commands(&bench_commands);
 #endif
 }
 
 int spiflash_read(uint32_t offset, uint8_t *buffer, size_t buffer_size)
 {
+#if SPIFLASH_ASYNC
+    if (spiflash_flush() != SPIFLASH_OK) {
+        return SPIFLASH_ERROR;
+    }
+#endif
+
     return (xSPI_Read(offset, buffer, buffer_size));
 }
 
 int spiflash_program(uint32_t offset, const uint8_t *buffer, size_t buffer_size)
 {
+#if SPIFLASH_ASYNC
+    if (spiflash_flush() != SPIFLASH_OK) {
+        return SPIFLASH_ERROR;
+    }
+#endif
+
     return (xSPI_Program(offset, buffer, buffer_size));
 }
 
 int spiflash_sector_erase(uint32_t address)
 {
+#if SPIFLASH_ASYNC
+    if (spiflash_flush() != SPIFLASH_OK) {
+        return SPIFLASH_ERROR;
+    }
+#endif
+
     return (xSPI_SectorErase(address));
 }
 
@@ -0,0 +1,187 @@
+/*
+  status_bin.c - compact binary realtime status report
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Sending the STATUS_BINARY_CMD realtime character (default 0xB0) instead of ? returns one
+  status_bin_frame_t (little-endian, no padding) on the stream that is active when the realtime
+  loop next runs. The frame is built in one go and sent with a single write_n call, requests
+  received before it is sent are merged. Streams without write_n do not get a reply.
+
+  The frame starts with STATUS_BIN_SYNC (0xA5), which cannot start a text response line, and
+  ends with the CRC-32 (crc32.h) of all preceding bytes. Position is sys.position in steps.
+
+  $STATBIN - report the command character, frame size and counters:
+
+    [STATBIN|cmd=,size=,frames=,nowrite=]
+*/
+
+#include "driver.h"
+
+#if STATUS_BINARY_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
+
+#include "crc32.h"
+#include "status_bin.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#if STATUS_BINARY_CMD < 0x80 || STATUS_BINARY_CMD > 0xBF
+#error "STATUS_BINARY_CMD must be in the 0x80 - 0xBF range!"
+#endif
+
+#define STATUS_BIN_SYNC     0xA5
+#define STATUS_BIN_VERSION  1
+
+typedef struct __attribute__((packed)) {
+    uint8_t sync;
+    uint8_t version;
+    uint8_t size;               // of the whole frame
+    uint8_t n_axis;
+    uint16_t seq;
+    uint16_t state;             // sys_state_t bits (STATE_IDLE etc.)
+    int32_t position[N_AXIS];   // machine position, steps
+    uint16_t planner_free;      // free planner blocks
+    uint16_t rx_free;           // free stream input buffer, characters
+    uint8_t flags;              // STATUS_BIN_FLAG_*
+    // EDM, zero if EDM_ENABLE is off
+    uint8_t r_pulse;            // ratios of the last PULSER sample, 0 - 255
+    uint8_t r_short;
+    uint8_t r_open;
+    uint32_t servo_period_q16;  // 65536: programmed feed rate
+    uint32_t crc;
+} status_bin_frame_t;
+
+#define STATUS_BIN_FLAG_ENERGIZED  0x01
+#define STATUS_BIN_FLAG_RETRACTING 0x02
+
+typedef struct {
+    volatile bool pending;
+    uint16_t seq;
+    uint32_t frames;
+    uint32_t nowrite;
+} status_bin_t;
+
+static status_bin_t sbin = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+static on_unknown_realtime_cmd_ptr on_unknown_realtime_cmd;
+
+static void status_bin_send (void)
+{
+    uint_fast8_t idx;
+    status_bin_frame_t frame;
+
+    if(hal.stream.write_n == NULL) {
+        sbin.nowrite++;
+        return;
+    }
+
+    memset(&frame, 0, sizeof(status_bin_frame_t));
+
+    frame.sync = STATUS_BIN_SYNC;
+    frame.version = STATUS_BIN_VERSION;
+    frame.size = sizeof(status_bin_frame_t);
+    frame.n_axis = N_AXIS;
+    frame.seq = sbin.seq++;
+    frame.state = (uint16_t)state_get();
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        frame.position[idx] = sys.position[idx];
+
+    frame.planner_free = (uint16_t)plan_get_block_buffer_available();
+    frame.rx_free = hal.stream.get_rx_buffer_free ? (uint16_t)hal.stream.get_rx_buffer_free() : 0;
+
+#if EDM_ENABLE
+    edm_telemetry_t edm;
+
+    edm_get_telemetry(&edm);
+    frame.flags = (edm.energized ? STATUS_BIN_FLAG_ENERGIZED : 0) | (edm.retracting ? STATUS_BIN_FLAG_RETRACTING : 0);
+    frame.r_pulse = edm.r_pulse;
+    frame.r_short = edm.r_short;
+    frame.r_open = edm.r_open;
+    frame.servo_period_q16 = edm.servo_period_q16;
+#endif
+
+    frame.crc = crc32_calc(&frame, offsetof(status_bin_frame_t, crc));
+
+    hal.stream.write_n((const uint8_t *)&frame, sizeof(status_bin_frame_t));
+    sbin.frames++;
+}
+
+// Called from the stream receive interrupt, the frame is sent from the realtime loop.
+static bool status_bin_realtime_cmd (char c)
+{
+    if((uint8_t)c == STATUS_BINARY_CMD) {
+        sbin.pending = true;
+        return true;
+    }
+
+    return on_unknown_realtime_cmd == NULL || on_unknown_realtime_cmd(c);
+}
+
+static void status_bin_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(sbin.pending) {
+        sbin.pending = false;
+        status_bin_send();
+    }
+}
+
+static status_code_t status_bin_command (sys_state_t state, char *args)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), "[STATBIN|cmd=0x%02X,size=%u,frames=%lu,nowrite=%lu]" ASCII_EOL,
+              STATUS_BINARY_CMD, (uint16_t)sizeof(status_bin_frame_t), sbin.frames, sbin.nowrite);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void status_bin_init (void)
+{
+    static const sys_command_t status_bin_command_list[] = {
+        {"STATBIN", status_bin_command, { .noargs = On }, { .str = "report binary status frame command and counters" } }
+    };
+
+    static sys_commands_t status_bin_commands = {
+        .n_commands = sizeof(status_bin_command_list) / sizeof(sys_command_t),
+        .commands = status_bin_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = status_bin_execute_realtime;
+
+    on_unknown_realtime_cmd = grbl.on_unknown_realtime_cmd;
+    grbl.on_unknown_realtime_cmd = status_bin_realtime_cmd;
+
+    system_register_commands(&status_bin_commands);
+}
+
+#endif // STATUS_BINARY_ENABLE
@@ -0,0 +1,460 @@
+/*
+
+  step_bench.c - step rate stress benchmark with loopback verification
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  $STEPBENCH[=<axis>]
+
+    Idle only. Drives the step output of <axis> (X, Y, Z..., default X) through the normal
+    stepper interrupt and pulse start code at increasing rates, STEP_BENCH_STAGE_MS per rate,
+    with the core's segment stream replaced by a synthetic one: a step on every interrupt and
+    the direction reversed every STEP_BENCH_DIR_STEPS steps, so the motor only oscillates.
+    The drivers are enabled as for a move.
+
+    The step output is to be wired to STEP_BENCH_PORT/PIN, a timer channel 1 input, and
+    optionally the direction output to STEP_BENCH_DIR_PORT/PIN, channel 3 of the same timer.
+    Step edges and direction changes are captured by the timer and copied by DMA, so every
+    emitted pulse is counted, and the last STEP_BENCH_BUFFER are timed. Per rate:
+
+    [STEPBENCH|f=<Hz>,isr=<interrupts>,seen=<pulses>,fact=<Hz>,w=<avg>/<min>/<max>ns,jit=<h0>/<h1>/<h2>/<h3>/<h4>,dsu=<min>ns]
+
+    isr is the number of stepper interrupts run, seen the pulses counted at the input, fact the
+    interrupt rate achieved. jit is a histogram of the step period deviation from the average:
+    <=25, <=100, <=250, <=1000 and >1000ns. dsu is the shortest direction setup time, the time
+    from a direction change to the next rising step edge. A rate passes when every interrupt
+    produced a pulse and the achieved rate is within 1%; the sweep stops at the first failure
+    or when the period gets below twice the step pulse time. Summary:
+
+    [STEPBENCH|max=<Hz>]
+*/
+
+#include "driver.h"
+
+#if STEP_BENCH_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cache.h"
+#include "timers.h"
+#include "grbl/hal.h"
+#include "grbl/nuts_bolts.h"
+#include "grbl/state_machine.h"
+#include "grbl/system.h"
+
+#ifndef STEP_BENCH_CLOCK
+#define STEP_BENCH_CLOCK 50000000    // Hz, capture resolution
+#endif
+#ifndef STEP_BENCH_BUFFER
+#define STEP_BENCH_BUFFER 256        // pulses, power of 2
+#endif
+#ifndef STEP_BENCH_STAGE_MS
+#define STEP_BENCH_STAGE_MS 200
+#endif
+#ifndef STEP_BENCH_DIR_STEPS
+#define STEP_BENCH_DIR_STEPS 64
+#endif
+
+#if (STEP_BENCH_BUFFER & (STEP_BENCH_BUFFER - 1)) != 0
+#error "STEP_BENCH_BUFFER must be a power of 2!"
+#endif
+
+#define BENCH_DMA_STREAM      dmaStream(2, STEP_BENCH_DMA_STREAM)
+#define BENCH_DMA_IRQ         dmaINT(2, STEP_BENCH_DMA_STREAM)
+#define BENCH_DMA_IRQHandler  dmaHANDLER(2, STEP_BENCH_DMA_STREAM)
+#define BENCH_DMA_ISR         dmaISR(2, STEP_BENCH_DMA_STREAM)
+#define BENCH_DMA_IFCR        dmaIFCR(2, STEP_BENCH_DMA_STREAM)
+#define BENCH_DMA_TCIF        dmaTCIF(STEP_BENCH_DMA_STREAM)
+#define BENCH_WORDS       (STEP_BENCH_BUFFER * 3)
+
+typedef struct {
+    GPIO_TypeDef *port;
+    uint8_t pin;
+    uint8_t af;
+    TIM_TypeDef *timer;
+    uint8_t channel;
+} bench_pin_t;
+
+static const bench_pin_t bench_pins[] = {
+    { .port = GPIOA, .pin = 0,  .af = GPIO_AF1_TIM2, .timer = TIM2, .channel = 1 },
+    { .port = GPIOA, .pin = 5,  .af = GPIO_AF1_TIM2, .timer = TIM2, .channel = 1 },
+    { .port = GPIOA, .pin = 15, .af = GPIO_AF1_TIM2, .timer = TIM2, .channel = 1 },
+    { .port = GPIOA, .pin = 2,  .af = GPIO_AF1_TIM2, .timer = TIM2, .channel = 3 },
+    { .port = GPIOB, .pin = 10, .af = GPIO_AF1_TIM2, .timer = TIM2, .channel = 3 },
+    { .port = GPIOA, .pin = 6,  .af = GPIO_AF2_TIM3, .timer = TIM3, .channel = 1 },
+    { .port = GPIOB, .pin = 4,  .af = GPIO_AF2_TIM3, .timer = TIM3, .channel = 1 },
+    { .port = GPIOC, .pin = 6,  .af = GPIO_AF2_TIM3, .timer = TIM3, .channel = 1 },
+    { .port = GPIOB, .pin = 0,  .af = GPIO_AF2_TIM3, .timer = TIM3, .channel = 3 },
+    { .port = GPIOC, .pin = 8,  .af = GPIO_AF2_TIM3, .timer = TIM3, .channel = 3 },
+    { .port = GPIOB, .pin = 6,  .af = GPIO_AF2_TIM4, .timer = TIM4, .channel = 1 },
+    { .port = GPIOD, .pin = 12, .af = GPIO_AF2_TIM4, .timer = TIM4, .channel = 1 },
+    { .port = GPIOB, .pin = 8,  .af = GPIO_AF2_TIM4, .timer = TIM4, .channel = 3 },
+    { .port = GPIOD, .pin = 14, .af = GPIO_AF2_TIM4, .timer = TIM4, .channel = 3 },
+    { .port = GPIOA, .pin = 8,  .af = GPIO_AF1_TIM1, .timer = TIM1, .channel = 1 },
+    { .port = GPIOE, .pin = 9,  .af = GPIO_AF1_TIM1, .timer = TIM1, .channel = 1 },
+    { .port = GPIOA, .pin = 10, .af = GPIO_AF1_TIM1, .timer = TIM1, .channel = 3 },
+    { .port = GPIOE, .pin = 13, .af = GPIO_AF1_TIM1, .timer = TIM1, .channel = 3 }
+};
+
+static const uint32_t bench_rates[] = {
+    5000, 10000, 20000, 50000, 100000, 150000, 200000, 250000, 300000, 400000, 500000, 750000, 1000000
+};
+
+typedef struct {
+    TIM_TypeDef *timer;
+    bool dir_capture;
+    DMA_HandleTypeDef dma;
+    uint32_t counter_mask;
+    uint32_t ns_per_tick_q16;
+    volatile uint32_t laps;
+    // Synthetic segment stream, run by the stepper interrupt.
+    stepper_t st;
+    axes_signals_t axis;
+    uint32_t cycles;
+    volatile bool started;
+    volatile uint32_t steps;
+    uint32_t n_dir;
+} step_bench_t;
+
+static step_bench_t bench = {0};
+// CCR1 (falling step edge), CCR2 (rising step edge), CCR3 (direction edge) as written by the DMA burst.
+static DMA_BUFFER uint32_t bench_buffer[STEP_BENCH_BUFFER][3];
+
+void BENCH_DMA_IRQHandler (void)
+{
+    if(BENCH_DMA_ISR & BENCH_DMA_TCIF) {
+        BENCH_DMA_IFCR = BENCH_DMA_TCIF;
+        bench.laps++;
+    }
+}
+
+// Pulses captured since init, call with interrupts disabled.
+static uint32_t bench_pos (void)
+{
+    uint32_t laps = bench.laps, ndtr = BENCH_DMA_STREAM->NDTR;
+
+    if(BENCH_DMA_ISR & BENCH_DMA_TCIF) {
+        ndtr = BENCH_DMA_STREAM->NDTR;
+        laps++;
+    }
+
+    return laps * STEP_BENCH_BUFFER + (BENCH_WORDS - ndtr) / 3;
+}
+
+static const bench_pin_t *bench_pin (GPIO_TypeDef *port, uint8_t pin, uint8_t channel)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < sizeof(bench_pins) / sizeof(bench_pin_t); idx++) {
+        if(bench_pins[idx].port == port && bench_pins[idx].pin == pin && bench_pins[idx].channel == channel)
+            return &bench_pins[idx];
+    }
+
+    return NULL;
+}
+
+static void bench_pin_init (const bench_pin_t *pin)
+{
+    GPIO_InitTypeDef gpio_init = {
+        .Pin = 1 << pin->pin,
+        .Mode = GPIO_MODE_AF_PP,
+        .Pull = GPIO_PULLDOWN,
+        .Speed = GPIO_SPEED_FREQ_HIGH,
+        .Alternate = pin->af
+    };
+
+    HAL_GPIO_Init(pin->port, &gpio_init);
+}
+
+static bool bench_capture_init (void)
+{
+    uint32_t clock_hz, prescaler, request;
+    const bench_pin_t *step, *dir = NULL;
+    const timer_capture_t falling_edge = {
+        .edge = TimerCapture_Falling
+    }, rising_edge = {
+        .indirect = true,
+        .edge = TimerCapture_Rising
+    }, both_edges = {
+        .edge = TimerCapture_Both
+    };
+
+    if(bench.timer)
+        return true;
+
+    if((step = bench_pin(STEP_BENCH_PORT, STEP_BENCH_PIN, 1)) == NULL || !timer_claim(step->timer))
+        return false;
+
+#ifdef STEP_BENCH_DIR_PORT
+    if((dir = bench_pin(STEP_BENCH_DIR_PORT, STEP_BENCH_DIR_PIN, 3)) && dir->timer != step->timer)
+        dir = NULL;
+#endif
+
+    bench_pin_init(step);
+    if(dir)
+        bench_pin_init(dir);
+
+    clock_hz = timer_clk_enable(step->timer);
+    if((prescaler = clock_hz / STEP_BENCH_CLOCK) == 0)
+        prescaler = 1;
+
+    bench.counter_mask = IS_TIM_32B_COUNTER_INSTANCE(step->timer) ? 0xFFFFFFFF : 0xFFFF;
+    bench.ns_per_tick_q16 = (uint32_t)((1000000000ULL * prescaler << 16) / clock_hz);
+
+    step->timer->CR1 = 0;
+    step->timer->DIER = 0;
+    step->timer->SMCR = 0;
+    step->timer->PSC = prescaler - 1;
+    step->timer->ARR = bench.counter_mask;
+    step->timer->EGR = TIM_EGR_UG;
+
+    // CC1 captures the falling and CC2 the rising step edge, CC3 direction changes.
+    // Each CC1 capture (end of a step pulse) triggers a DMA burst of CCR1 - CCR3.
+    if((request = timer_dma_request(step->timer, TimerEvent_CC1)) == 0 ||
+        !timer_capture_cfg(step->timer, 1, &falling_edge) ||
+         !timer_capture_cfg(step->timer, 2, &rising_edge) ||
+          (dir && !timer_capture_cfg(step->timer, 3, &both_edges)) ||
+           !timer_dma_burst(step->timer, &step->timer->CCR1, 3))
+        return false;
+
+    __HAL_RCC_DMA2_CLK_ENABLE();
+
+    bench.dma.Instance = BENCH_DMA_STREAM;
+    bench.dma.Init.Request = request;
+    bench.dma.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    bench.dma.Init.PeriphInc = DMA_PINC_DISABLE;
+    bench.dma.Init.MemInc = DMA_MINC_ENABLE;
+    bench.dma.Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    bench.dma.Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    bench.dma.Init.Mode = DMA_CIRCULAR;
+    bench.dma.Init.Priority = DMA_PRIORITY_HIGH;
+    bench.dma.Init.FIFOMode = DMA_FIFOMODE_DISABLE;
+
+    if(HAL_DMA_Init(&bench.dma) != HAL_OK ||
+        HAL_DMA_Start(&bench.dma, (uint32_t)&step->timer->DMAR, (uint32_t)bench_buffer, BENCH_WORDS) != HAL_OK)
+        return false;
+
+    BENCH_DMA_STREAM->CR |= DMA_SxCR_TCIE;
+    HAL_NVIC_SetPriority(BENCH_DMA_IRQ, IRQ_PRIO_TIMER, 0);
+    NVIC_EnableIRQ(BENCH_DMA_IRQ);
+
+    bench.timer = step->timer;
+    bench.dir_capture = !!dir;
+    bench.timer->SR = 0;
+    timer_dma_enable(bench.timer, TimerEvent_CC1, true);
+    bench.timer->CR1 = TIM_CR1_CEN;
+
+    return true;
+}
+
+// Replaces the core's stepper interrupt handler while a rate runs.
+static void bench_stepper_interrupt (void)
+{
+    // The first interrupt comes after the driver wake up delay.
+    if(!bench.started) {
+        bench.started = true;
+        hal.stepper.cycles_per_tick(bench.cycles);
+    }
+
+    bench.st.dir_changed.bits = 0;
+    if(++bench.n_dir == STEP_BENCH_DIR_STEPS) {
+        bench.n_dir = 0;
+        bench.st.dir_out.bits ^= bench.axis.bits;
+        bench.st.dir_changed.bits = bench.axis.bits;
+    }
+
+    hal.stepper.pulse_start(&bench.st);
+    bench.steps++;
+}
+
+typedef struct {
+    uint32_t isr;                   // interrupts run
+    uint32_t timed;                 // of which within STEP_BENCH_STAGE_MS
+    uint32_t seen;                  // pulses captured
+    uint32_t w_avg, w_min, w_max;   // ns
+    uint32_t jit[5];
+    uint32_t dsu_min;               // ns, UINT32_MAX if not measured
+} bench_result_t;
+
+static inline uint32_t ticks_to_ns (uint32_t ticks)
+{
+    return (uint32_t)(((uint64_t)ticks * bench.ns_per_tick_q16) >> 16);
+}
+
+// Times the last buffered pulses, up to pos.
+static void bench_analyze (uint32_t pos, uint32_t n, bench_result_t *res)
+{
+    static const uint32_t jit_ns[] = { 25, 100, 250, 1000 };
+
+    uint32_t idx, i, w, period, sum_w = 0, sum_p = 0, n_p = 0;
+    uint32_t (*e)[3] = bench_buffer;
+
+    res->w_min = res->dsu_min = UINT32_MAX;
+    res->w_max = 0;
+    memset(res->jit, 0, sizeof(res->jit));
+
+    // The oldest entry of a full buffer may already be overwritten by the next burst, it is skipped.
+    if(n > STEP_BENCH_BUFFER - 1)
+        n = STEP_BENCH_BUFFER - 1;
+    if(n == 0)
+        return;
+
+    dma_buffer_invalidate(bench_buffer, sizeof(bench_buffer));
+
+    for(idx = pos - n; idx != pos; idx++) {
+        i = idx & (STEP_BENCH_BUFFER - 1);
+        w = ticks_to_ns((e[i][0] - e[i][1]) & bench.counter_mask);
+        sum_w += w;
+        if(w < res->w_min)
+            res->w_min = w;
+        if(w > res->w_max)
+            res->w_max = w;
+        if(idx != pos - n) {
+            uint32_t prev = (idx - 1) & (STEP_BENCH_BUFFER - 1);
+            sum_p += (e[i][1] - e[prev][1]) & bench.counter_mask;
+            n_p++;
+            if(bench.dir_capture && e[i][2] != e[prev][2]) {
+                uint32_t dsu = ticks_to_ns((e[i][1] - e[i][2]) & bench.counter_mask);
+                if(dsu < res->dsu_min)
+                    res->dsu_min = dsu;
+            }
+        }
+    }
+    res->w_avg = sum_w / n;
+
+    // Period deviation from the average.
+    if(n_p) for(idx = pos - n + 1; idx != pos; idx++) {
+        i = idx & (STEP_BENCH_BUFFER - 1);
+        period = (e[i][1] - e[(idx - 1) & (STEP_BENCH_BUFFER - 1)][1]) & bench.counter_mask;
+        uint32_t dev = ticks_to_ns(period * n_p > sum_p ? (period * n_p - sum_p) / n_p : (sum_p - period * n_p) / n_p);
+        w = 0;
+        while(w < sizeof(jit_ns) / sizeof(uint32_t) && dev > jit_ns[w])
+            w++;
+        res->jit[w]++;
+    }
+}
+
+static void bench_run (uint32_t rate, bench_result_t *res)
+{
+    uint32_t pos;
+    stepper_interrupt_callback_ptr interrupt_callback = hal.stepper.interrupt_callback;
+
+    memset(&bench.st, 0, sizeof(stepper_t));
+    bench.st.step_out = bench.axis;
+    bench.st.dir_changed = bench.axis;
+    bench.cycles = hal.f_step_timer / rate;
+    bench.started = false;
+    bench.steps = bench.n_dir = 0;
+
+    __disable_irq();
+    uint32_t pos0 = bench_pos();
+    __enable_irq();
+
+    hal.stepper.interrupt_callback = bench_stepper_interrupt;
+    hal.stepper.wake_up();
+    while(!bench.started);
+    uint32_t steps0 = bench.steps;
+    hal.delay_ms(STEP_BENCH_STAGE_MS, NULL);
+    res->timed = bench.steps - steps0;
+    hal.stepper.go_idle(true);
+    hal.stepper.interrupt_callback = interrupt_callback;
+    hal.delay_ms(2, NULL); // let the last pulse end
+
+    __disable_irq();
+    pos = bench_pos();
+    __enable_irq();
+
+    res->isr = bench.steps;
+    res->seen = pos - pos0;
+    bench_analyze(pos, res->seen, res);
+}
+
+static status_code_t step_bench (sys_state_t state, char *args)
+{
+    char msg[160];
+    uint_fast8_t idx, axis = X_AXIS;
+    uint32_t max = 0, min_period_ns = (uint32_t)(settings.steppers.pulse_microseconds * 2000.0f);
+    bench_result_t res;
+
+    if(state != STATE_IDLE)
+        return Status_IdleError;
+
+    if(args && *args) {
+        for(axis = 0; axis < N_AXIS; axis++) {
+            if(*axis_letter[axis] == *args && args[1] == '\0')
+                break;
+        }
+        if(axis == N_AXIS)
+            return Status_InvalidStatement;
+    }
+
+    if(!bench_capture_init()) {
+        hal.stream.write("[STEPBENCH|capture input not available]" ASCII_EOL);
+        return Status_OK;
+    }
+
+    bench.axis.bits = 1 << axis;
+
+    for(idx = 0; idx < sizeof(bench_rates) / sizeof(uint32_t); idx++) {
+
+        if(1000000000UL / bench_rates[idx] < min_period_ns)
+            break;
+
+        bench_run(bench_rates[idx], &res);
+
+        uint32_t fact = res.timed * 1000UL / STEP_BENCH_STAGE_MS;
+        bool ok = res.seen == res.isr && fact * 100ULL >= bench_rates[idx] * 99ULL;
+
+        snprintf(msg, sizeof(msg), "[STEPBENCH|f=%lu,isr=%lu,seen=%lu,fact=%lu,w=%lu/%lu/%luns,jit=%lu/%lu/%lu/%lu/%lu",
+                  bench_rates[idx], res.isr, res.seen, fact, res.w_avg, res.w_min == UINT32_MAX ? 0 : res.w_min, res.w_max,
+                   res.jit[0], res.jit[1], res.jit[2], res.jit[3], res.jit[4]);
+        hal.stream.write(msg);
+        if(res.dsu_min != UINT32_MAX) {
+            snprintf(msg, sizeof(msg), ",dsu=%luns", res.dsu_min);
+            hal.stream.write(msg);
+        }
+        hal.stream.write(ok ? "]" ASCII_EOL : ",fail]" ASCII_EOL);
+
+        if(!ok)
+            break;
+        max = bench_rates[idx];
+    }
+
+    snprintf(msg, sizeof(msg), "[STEPBENCH|max=%lu]" ASCII_EOL, max);
+    hal.stream.write(msg);
+
+    return Status_OK;
+}
+
+void step_bench_init (void)
+{
+    static const sys_command_t bench_command_list[] = {
+        {"STEPBENCH", step_bench, { .allow_blocking = On }, { .str = "step rate benchmark with loopback capture, $STEPBENCH[=<axis>]" } }
+    };
+
+    static sys_commands_t bench_commands = {
+        .n_commands = sizeof(bench_command_list) / sizeof(sys_command_t),
+        .commands = bench_command_list
+    };
+
+    system_register_commands(&bench_commands);
+}
+
+#endif // STEP_BENCH_ENABLE
@@ -82,6 +82,8 @@ void NMI_Handler(void)
   /* USER CODE END NonMaskableInt_IRQn 1 */
 }
 
+#if !CRASH_DUMP_ENABLE // crash_dump.c provides the fault handlers
+
 /**
   * @brief This function handles Hard fault interrupt.
   */
@@ -142,6 +144,8 @@ void UsageFault_Handler(void)
   }
 }
 
+#endif
+
 /**
   * @brief This function handles System service call via SWI instruction.
   */
@@ -0,0 +1,240 @@
+/*
+
+  stream_bench.c - throughput benchmark for the active io_stream_t backend
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  $BENCHRX=<bytes>
+
+    Replies [BENCH|RX,ready] and then consumes <bytes> of input (plain G-code text, may contain
+    realtime commands) via hal.stream.read(). Realtime processing is run at every LF and whenever
+    the input buffer is empty, as the main loop does. Ends when all bytes are received or after
+    one second without input. Summary:
+
+    [BENCH|RX,bytes=,us=,Bps=,lines=,lps=,rt=,rtavg_us=,rtmax_us=,minfree=,lost=]
+
+    lost is the number of characters sent but never seen, i.e. dropped on input buffer overflow.
+    rtavg/rtmax is the latency from a realtime command arriving in the driver to the next run of
+    realtime processing.
+
+  $BENCHTX=<bytes>
+
+    Writes <bytes> of [BENCHD|...] filler lines via hal.stream.write() and waits for the output
+    buffer to drain. Summary:
+
+    [BENCH|TX,bytes=,us=,Bps=]
+*/
+
+#include "driver.h"
+
+#if STREAM_BENCH_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+
+#define BENCH_IDLE_TIMEOUT_MS 1000
+#define BENCH_LINE_LENGTH     64
+
+static enqueue_realtime_command_ptr enqueue_realtime_command;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static volatile bool rt_pending;
+static volatile uint32_t rt_count, rt_stamp;
+static uint32_t rt_max, rt_n;
+static uint64_t rt_total;
+
+// Runs in interrupt context, timestamps the first pending realtime command
+static bool bench_enqueue_rt_command (char c)
+{
+    bool ok;
+
+    if((ok = enqueue_realtime_command(c))) {
+        rt_count++;
+        if(!rt_pending) {
+            rt_stamp = DWT->CYCCNT;
+            rt_pending = true;
+        }
+    }
+
+    return ok;
+}
+
+static void bench_execute_realtime (uint_fast16_t state)
+{
+    if(rt_pending) {
+        uint32_t cycles = DWT->CYCCNT - rt_stamp;
+        rt_pending = false;
+        rt_total += cycles;
+        rt_n++;
+        if(cycles > rt_max)
+            rt_max = cycles;
+    }
+
+    on_execute_realtime(state);
+}
+
+static bool get_count (char *args, uint32_t *count)
+{
+    char *end;
+
+    if(args == NULL || *args == '\0')
+        return false;
+
+    *count = strtoul(args, &end, 10);
+
+    return *end == '\0' && *count > 0;
+}
+
+static uint32_t per_second (uint32_t n, uint32_t us)
+{
+    return us ? (uint32_t)(((uint64_t)n * 1000000ULL) / us) : 0;
+}
+
+static status_code_t bench_rx (sys_state_t state, char *args)
+{
+    char msg[160];
+    bool ok = true;
+    int16_t c;
+    uint32_t expected, bytes = 0, lines = 0, t_first = 0, t_last = 0, t_idle;
+    uint16_t rx_free, min_free = hal.stream.get_rx_buffer_free();
+
+    if(!get_count(args, &expected))
+        return Status_BadNumberFormat;
+
+    rt_pending = false;
+    rt_count = rt_max = rt_n = 0;
+    rt_total = 0;
+
+    if(hal.stream.set_enqueue_rt_handler)
+        enqueue_realtime_command = hal.stream.set_enqueue_rt_handler(bench_enqueue_rt_command);
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = bench_execute_realtime;
+
+    hal.stream.write("[BENCH|RX,ready]" ASCII_EOL);
+
+    t_idle = hal.get_elapsed_ticks();
+
+    while(ok && bytes + rt_count < expected) {
+
+        if((c = hal.stream.read()) == SERIAL_NO_DATA) {
+            ok = protocol_execute_realtime();
+            if(hal.get_elapsed_ticks() - t_idle >= BENCH_IDLE_TIMEOUT_MS)
+                break;
+            continue;
+        }
+
+        t_last = hal.get_micros();
+        if(bytes++ == 0)
+            t_first = t_last;
+        t_idle = hal.get_elapsed_ticks();
+
+        if((rx_free = hal.stream.get_rx_buffer_free()) < min_free)
+            min_free = rx_free;
+
+        if(c == ASCII_LF) {
+            lines++;
+            ok = protocol_execute_realtime();
+        }
+    }
+
+    grbl.on_execute_realtime = on_execute_realtime;
+    if(hal.stream.set_enqueue_rt_handler)
+        hal.stream.set_enqueue_rt_handler(enqueue_realtime_command);
+
+    uint32_t us = t_last - t_first;
+
+    snprintf(msg, sizeof(msg), "[BENCH|RX,bytes=%lu,us=%lu,Bps=%lu,lines=%lu,lps=%lu,rt=%lu,rtavg_us=%lu,rtmax_us=%lu,minfree=%u,lost=%lu]" ASCII_EOL,
+              bytes, us, per_second(bytes, us), lines, per_second(lines, us), rt_count,
+              rt_n ? (uint32_t)(rt_total / rt_n / hal.f_mcu) : 0, rt_max / hal.f_mcu,
+              min_free, expected > bytes + rt_count ? expected - bytes - rt_count : 0);
+    hal.stream.write(msg);
+
+    return Status_OK;
+}
+
+static status_code_t bench_tx (sys_state_t state, char *args)
+{
+    char line[BENCH_LINE_LENGTH + 1], msg[80];
+    bool ok = true;
+    uint32_t bytes, n = 0, t_start;
+
+    if(!get_count(args, &bytes))
+        return Status_BadNumberFormat;
+
+    // [BENCHD|<10 digit offset>|filler]\r\n
+    memset(line, 'x', BENCH_LINE_LENGTH);
+    line[BENCH_LINE_LENGTH - 3] = ']';
+    line[BENCH_LINE_LENGTH - 2] = ASCII_CR;
+    line[BENCH_LINE_LENGTH - 1] = ASCII_LF;
+    line[BENCH_LINE_LENGTH] = '\0';
+
+    t_start = hal.get_micros();
+
+    while(n < bytes) {
+        char offset[11];
+        sprintf(offset, "%010lu", n);
+        memcpy(line, "[BENCHD|", 8);
+        memcpy(line + 8, offset, 10);
+        line[18] = '|';
+        if(bytes - n < BENCH_LINE_LENGTH) {
+            line[bytes - n] = '\0'; // truncate last line
+            hal.stream.write(line);
+            n = bytes;
+        } else {
+            hal.stream.write(line);
+            n += BENCH_LINE_LENGTH;
+        }
+    }
+
+    // Wait for output to drain, realtime processing keeps deferred transmitters going
+    if(hal.stream.get_tx_buffer_count) {
+        while(ok && hal.stream.get_tx_buffer_count())
+            ok = protocol_execute_realtime();
+    }
+
+    uint32_t us = hal.get_micros() - t_start;
+
+    snprintf(msg, sizeof(msg), "[BENCH|TX,bytes=%lu,us=%lu,Bps=%lu]" ASCII_EOL, bytes, us, per_second(bytes, us));
+    hal.stream.write(msg);
+
+    return Status_OK;
+}
+
+void stream_bench_init (void)
+{
+    static const sys_command_t bench_command_list[] = {
+        {"BENCHRX", bench_rx, { .allow_blocking = On }, { .str = "stream RX benchmark, $BENCHRX=<bytes>" } },
+        {"BENCHTX", bench_tx, { .allow_blocking = On }, { .str = "stream TX benchmark, $BENCHTX=<bytes>" } }
+    };
+
+    static sys_commands_t bench_commands = {
+        .n_commands = sizeof(bench_command_list) / sizeof(sys_command_t),
+        .commands = bench_command_list
+    };
+
+    system_register_commands(&bench_commands);
+}
+
+#endif // STREAM_BENCH_ENABLE
@@ -0,0 +1,422 @@
+/*
+  tcp_stream.c - raw TCP G-code stream with zero-copy receive
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A single client stream on TCP_STREAM_PORT, no Telnet option negotiation.
+
+  Received pbufs are kept as the input buffer: realtime commands are stripped in place when a pbuf
+  arrives, then the chain is read directly from the pbuf payloads and each pbuf is freed once
+  consumed. The receive window is only reopened (tcp_recved()) for consumed bytes, so the TCP
+  window is the flow control and can never overflow the input. Window updates are batched to
+  TCP_STREAM_WND_UPDATE bytes, or sent as soon as the buffer runs empty.
+
+  Nagle is disabled so that "ok" responses are not held back waiting for an ACK, which would
+  limit the line rate of the sender. Output is copied into lwIP and pushed out (tcp_output())
+  from the realtime loop instead, coalescing responses into fewer segments: pending output is
+  sent once a full segment is queued, once the oldest unsent byte is TCP_STREAM_COALESCE_US old,
+  or right away when the input buffer is empty, as the sender then waits for a response. Status
+  reports (lines starting with '<') are sent at the end of the pass they are written in.
+
+  Held pbufs are bounded by TCP_WND, the lwIP RX pool must be sized for a full window on top of
+  what the Ethernet driver keeps queued for reception.
+
+  lwIP runs in the foreground (NO_SYS), all callbacks here are called from the main loop.
+*/
+
+#include "driver.h"
+
+#if TCP_STREAM_ENABLE
+
+#include <string.h>
+
+#include "lwip/tcp.h"
+
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+
+#include "tcp_stream.h"
+#include "stream_fanout.h"
+
+#ifndef TCP_STREAM_WND_UPDATE
+#define TCP_STREAM_WND_UPDATE TCP_MSS   // bytes consumed before the window is reopened
+#endif
+#ifndef TCP_STREAM_COALESCE_US
+#define TCP_STREAM_COALESCE_US 2000     // max age of unsent output while input is pending
+#endif
+
+typedef struct {
+    struct tcp_pcb *listen;
+    struct tcp_pcb *pcb;
+    struct pbuf *head;          // input, read from head->payload + offset
+    struct pbuf *tail;
+    uint16_t offset;
+    uint32_t count;             // unread bytes
+    uint32_t consumed;          // read or stripped bytes not yet passed to tcp_recved()
+    bool cancel;
+    bool suspended;
+    bool tx_pending;
+    bool tx_urgent;             // status report written, send at the end of the pass
+    uint32_t tx_bytes;          // written since the last tcp_output()
+    uint32_t tx_first_us;       // time of the first of them
+    enqueue_realtime_command_ptr enqueue_realtime_command;
+} tcp_stream_t;
+
+static tcp_stream_t tcps = {
+    .enqueue_realtime_command = protocol_enqueue_realtime_command
+};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void tcp_stream_recved (bool force)
+{
+    if(tcps.pcb && tcps.consumed && (force || tcps.consumed >= TCP_STREAM_WND_UPDATE)) {
+        tcp_recved(tcps.pcb, tcps.consumed);
+        tcps.consumed = 0;
+    }
+}
+
+// Frees the head pbuf only, the rest of the chain becomes the new head.
+static struct pbuf *rx_free_head (struct pbuf *q)
+{
+    struct pbuf *next = q->next;
+
+    q->next = NULL;
+    pbuf_free(q);
+
+    return next;
+}
+
+static void rx_free_all (void)
+{
+    while(tcps.head)
+        tcps.head = rx_free_head(tcps.head);
+
+    tcps.tail = NULL;
+    tcps.offset = 0;
+    tcps.consumed += tcps.count;
+    tcps.count = 0;
+}
+
+static bool tcpStreamIsConnected (void)
+{
+    return tcps.pcb != NULL;
+}
+
+static int16_t tcpStreamGetC (void)
+{
+    char c;
+
+    if(tcps.cancel) {
+        tcps.cancel = false;
+        return ASCII_CAN;
+    }
+
+    if(tcps.count == 0 || tcps.suspended)
+        return -1;
+
+    // Segments may have been emptied by realtime command stripping.
+    while(tcps.offset >= tcps.head->len) {
+        tcps.head = rx_free_head(tcps.head);
+        tcps.offset = 0;
+    }
+
+    c = ((char *)tcps.head->payload)[tcps.offset++];
+    tcps.consumed++;
+
+    if(--tcps.count == 0) {
+        rx_free_all();
+        tcp_stream_recved(true);
+    } else
+        tcp_stream_recved(false);
+
+    return (int16_t)c;
+}
+
+static uint16_t tcpStreamRxFree (void)
+{
+    return tcps.count >= TCP_WND ? 0 : (uint16_t)(TCP_WND - tcps.count);
+}
+
+static uint16_t tcpStreamRxCount (void)
+{
+    return (uint16_t)tcps.count;
+}
+
+static void tcpStreamRxFlush (void)
+{
+    rx_free_all();
+    tcp_stream_recved(true);
+}
+
+static void tcpStreamRxCancel (void)
+{
+    tcpStreamRxFlush();
+    tcps.cancel = true;
+}
+
+static bool tcpStreamSuspendInput (bool suspend)
+{
+    return (tcps.suspended = suspend);
+}
+
+#if STREAM_FANOUT_NONBLOCK
+static stream_fanout_t fanout = {0};
+#endif
+
+static void tcp_stream_output (void)
+{
+    tcp_output(tcps.pcb);
+    tcps.tx_pending = tcps.tx_urgent = false;
+    tcps.tx_bytes = 0;
+}
+
+static void tcpStreamWrite (const char *s, uint16_t length)
+{
+    uint16_t n;
+
+#if STREAM_FANOUT_NONBLOCK
+    // Not the active stream, drop instead of blocking on a slow client (see stream_fanout.h)
+    if(tcps.pcb && hal.stream.get_rx_buffer_free != tcpStreamRxFree &&
+        !stream_fanout_accept(&fanout, s, length, tcp_sndqueuelen(tcps.pcb) < TCP_SND_QUEUELEN ? tcp_sndbuf(tcps.pcb) : 0))
+        return;
+#endif
+
+    if(length && *s == '<')
+        tcps.tx_urgent = true;
+
+    while(length && tcps.pcb) {
+
+        if((n = tcp_sndbuf(tcps.pcb)) > length)
+            n = length;
+
+        if(n && tcp_sndqueuelen(tcps.pcb) < TCP_SND_QUEUELEN && tcp_write(tcps.pcb, s, n, TCP_WRITE_FLAG_COPY) == ERR_OK) {
+            if(tcps.tx_bytes == 0)
+                tcps.tx_first_us = hal.get_micros();
+            s += n;
+            length -= n;
+            tcps.tx_pending = true;
+            if((tcps.tx_bytes += n) >= TCP_MSS)
+                tcp_stream_output();
+        } else {
+            if(tcps.tx_pending)
+                tcp_stream_output();
+            if(!hal.stream_blocking_callback())     // runs the stack, may drop the connection
+                break;
+        }
+    }
+}
+
+static void tcpStreamWriteS (const char *s)
+{
+    tcpStreamWrite(s, (uint16_t)strlen(s));
+}
+
+static bool tcpStreamPutC (const char c)
+{
+    tcpStreamWrite(&c, 1);
+
+    return tcps.pcb != NULL;
+}
+
+static uint16_t tcpStreamTxCount (void)
+{
+    return tcps.pcb ? (uint16_t)(TCP_SND_BUF - tcp_sndbuf(tcps.pcb)) : 0;
+}
+
+static void tcpStreamTxFlush (void)
+{
+    // Data already passed to lwIP cannot be taken back.
+}
+
+static bool tcpStreamEnqueueRtCommand (char c)
+{
+    return tcps.enqueue_realtime_command(c);
+}
+
+static enqueue_realtime_command_ptr tcpStreamSetRtHandler (enqueue_realtime_command_ptr handler)
+{
+    enqueue_realtime_command_ptr prev = tcps.enqueue_realtime_command;
+
+    if(handler)
+        tcps.enqueue_realtime_command = handler;
+
+    return prev;
+}
+
+static const io_stream_t tcp_stream = {
+    .type = StreamType_Telnet,
+    .is_connected = tcpStreamIsConnected,
+    .read = tcpStreamGetC,
+    .write = tcpStreamWriteS,
+    .write_n = tcpStreamWrite,
+    .write_char = tcpStreamPutC,
+    .enqueue_rt_command = tcpStreamEnqueueRtCommand,
+    .get_rx_buffer_free = tcpStreamRxFree,
+    .get_rx_buffer_count = tcpStreamRxCount,
+    .get_tx_buffer_count = tcpStreamTxCount,
+    .reset_write_buffer = tcpStreamTxFlush,
+    .reset_read_buffer = tcpStreamRxFlush,
+    .cancel_read_buffer = tcpStreamRxCancel,
+    .suspend_read = tcpStreamSuspendInput,
+    .set_enqueue_rt_handler = tcpStreamSetRtHandler
+};
+
+static void tcp_stream_closed (void)
+{
+    rx_free_all();
+    tcps.pcb = NULL;
+    tcps.consumed = 0;
+    tcps.cancel = tcps.suspended = tcps.tx_pending = tcps.tx_urgent = false;
+    tcps.tx_bytes = 0;
+
+    stream_disconnect(&tcp_stream);
+}
+
+// Returns ERR_ABRT if the pcb had to be aborted, as to be returned from the recv callback.
+static err_t tcp_stream_close (struct tcp_pcb *pcb)
+{
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_err(pcb, NULL);
+
+    tcp_stream_closed();
+
+    if(tcp_close(pcb) == ERR_OK)
+        return ERR_OK;
+
+    tcp_abort(pcb);
+
+    return ERR_ABRT;
+}
+
+static void tcp_stream_err (void *arg, err_t err)
+{
+    // pcb already freed by lwIP
+    tcp_stream_closed();
+}
+
+// Strips realtime commands from the payloads in place, the segment lengths are reduced
+// accordingly (tot_len is left as is and not used further). Returns the kept byte count.
+static uint32_t rx_strip (struct pbuf *p)
+{
+    char c, *src, *dst;
+    uint32_t kept = 0;
+    uint16_t len;
+
+    for(; p; p = p->next) {
+        src = dst = (char *)p->payload;
+        len = p->len;
+        while(len--) {
+            c = *src++;
+            if(!tcps.enqueue_realtime_command(c))   // Check and strip realtime commands...
+                *dst++ = c;
+        }
+        p->len = (uint16_t)(dst - (char *)p->payload);
+        kept += p->len;
+    }
+
+    return kept;
+}
+
+static err_t tcp_stream_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    uint32_t total, kept;
+
+    if(p == NULL)                   // remote closed
+        return tcp_stream_close(pcb);
+
+    if(err != ERR_OK) {
+        pbuf_free(p);
+        return err;
+    }
+
+    total = p->tot_len;
+    kept = rx_strip(p);             // may reset the input buffer (realtime reset), p is not in it yet
+
+    tcps.consumed += total - kept;
+
+    if(kept == 0)
+        pbuf_free(p);
+    else {
+        // Linked up manually, pbuf_cat() asserts on the adjusted lengths.
+        if(tcps.tail)
+            tcps.tail->next = p;
+        else {
+            tcps.head = p;
+            tcps.offset = 0;
+        }
+        for(tcps.tail = p; tcps.tail->next; tcps.tail = tcps.tail->next);
+        tcps.count += kept;
+    }
+
+    tcp_stream_recved(false);
+
+    return ERR_OK;
+}
+
+static err_t tcp_stream_accept (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    if(err != ERR_OK || pcb == NULL)
+        return ERR_VAL;
+
+    if(tcps.pcb) {                  // single client only
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    tcps.pcb = pcb;
+    tcp_nagle_disable(pcb);
+    tcp_setprio(pcb, TCP_PRIO_MAX);
+    tcp_recv(pcb, tcp_stream_recv);
+    tcp_err(pcb, tcp_stream_err);
+
+    stream_connect(&tcp_stream);
+
+    return ERR_OK;
+}
+
+static void tcp_stream_poll (sys_state_t state)
+{
+    if(tcps.tx_pending && tcps.pcb &&
+        (tcps.tx_urgent || tcps.count == 0 || hal.get_micros() - tcps.tx_first_us >= TCP_STREAM_COALESCE_US))
+        tcp_stream_output();
+
+    on_execute_realtime(state);
+}
+
+bool tcp_stream_init (void)
+{
+    struct tcp_pcb *pcb;
+
+    if(tcps.listen || (pcb = tcp_new()) == NULL)
+        return false;
+
+    if(tcp_bind(pcb, IP_ADDR_ANY, TCP_STREAM_PORT) != ERR_OK || (tcps.listen = tcp_listen(pcb)) == NULL) {
+        tcp_close(pcb);
+        return false;
+    }
+
+    tcp_accept(tcps.listen, tcp_stream_accept);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = tcp_stream_poll;
+
+    return true;
+}
+
+#endif // TCP_STREAM_ENABLE
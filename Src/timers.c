@@ -30,11 +30,13 @@ typedef struct {
     timer_cap_t cap;
     IRQn_Type irq;
     uint32_t freq_hz;
+    timer_irq_handler_ptr update_callback; // set by timerCfg() when the update event is the only interrupt source
 } dtimer_t;
 
 #define LAST_TIDX -1
 
-static dtimer_t timers[] = {
+// In DTCM along with the handlers in ITCM, no cache misses on dispatch.
+static dtimer_t timers[] DTCM_DATA = {
 #if !IS_TIMER_CLAIMED(TIM1_BASE)
     {
         .timer = TIM1,
@@ -211,6 +213,28 @@ static dtimer_t timers[] = {
         }
     },
 #endif
+#ifdef TIM23
+    {
+        .timer = TIM23,
+        .irq = TIM23_IRQn,
+        .resolution = IS_TIM_32B_COUNTER_INSTANCE(TIM23) ? Timer_32bit : Timer_16bit,
+        .cap = {
+          .comp1 = IS_TIM_CC1_INSTANCE(TIM23),
+          .comp2 = IS_TIM_CC2_INSTANCE(TIM23)
+        }
+    },
+#endif
+#ifdef TIM24
+    {
+        .timer = TIM24,
+        .irq = TIM24_IRQn,
+        .resolution = IS_TIM_32B_COUNTER_INSTANCE(TIM24) ? Timer_32bit : Timer_16bit,
+        .cap = {
+          .comp1 = IS_TIM_CC1_INSTANCE(TIM24),
+          .comp2 = IS_TIM_CC2_INSTANCE(TIM24)
+        }
+    },
+#endif
 };
 
 static dtimer_t *timer_get (TIM_TypeDef *timer)
@@ -346,6 +370,16 @@ uint32_t timer_clk_enable (TIM_TypeDef *timer)
             case (uint32_t)TIM17:
                 __HAL_RCC_TIM17_CLK_ENABLE();
                 break;
+#endif
+#ifdef TIM23
+            case (uint32_t)TIM23:
+                __HAL_RCC_TIM23_CLK_ENABLE();
+                break;
+#endif
+#ifdef TIM24
+            case (uint32_t)TIM24:
+                __HAL_RCC_TIM24_CLK_ENABLE();
+                break;
 #endif
         }
 
@@ -355,6 +389,149 @@ uint32_t timer_clk_enable (TIM_TypeDef *timer)
     return dtimer ? dtimer->freq_hz : 0;
 }
 
+TIM_TypeDef *timer_get_instance (hal_timer_t timer)
+{
+    return timer ? ((dtimer_t *)timer)->timer : NULL;
+}
+
+bool timer_capture_cfg (TIM_TypeDef *timer, uint_fast8_t channel, const timer_capture_t *cfg)
+{
+    uint32_t ccmr, ccmr_shift, ccer_shift;
+    volatile uint32_t *ccmrx;
+
+    if(channel < 1 || channel > 4 || !IS_TIM_CCX_INSTANCE(timer, (channel - 1) * 4) || cfg->filter > 15 || cfg->prescaler > 3)
+        return false;
+
+    ccmrx = channel <= 2 ? &timer->CCMR1 : &timer->CCMR2;
+    ccmr_shift = (channel - 1) & 0x01 ? 8 : 0;
+    ccer_shift = (channel - 1) * 4;
+    ccmr = (cfg->indirect ? TIM_CCMR1_CC1S_1 : TIM_CCMR1_CC1S_0) |
+            (cfg->prescaler << TIM_CCMR1_IC1PSC_Pos) |
+             (cfg->filter << TIM_CCMR1_IC1F_Pos);
+
+    // CCxS is only writable with the channel disabled.
+    timer->CCER &= ~((TIM_CCER_CC1E|TIM_CCER_CC1P|TIM_CCER_CC1NP) << ccer_shift);
+    *ccmrx = (*ccmrx & ~(0xFF << ccmr_shift)) | (ccmr << ccmr_shift);
+    timer->CCER |= (TIM_CCER_CC1E |
+                     (cfg->edge == TimerCapture_Rising ? 0 : TIM_CCER_CC1P) |
+                      (cfg->edge == TimerCapture_Both ? TIM_CCER_CC1NP : 0)) << ccer_shift;
+
+    return true;
+}
+
+uint32_t timer_dma_request (TIM_TypeDef *timer, timer_event_t event)
+{
+    static const struct {
+        TIM_TypeDef *timer;
+        uint8_t request[5];     // indexed by timer_event_t
+    } requests[] = {
+        { TIM1,  { DMA_REQUEST_TIM1_UP, DMA_REQUEST_TIM1_CH1, DMA_REQUEST_TIM1_CH2, DMA_REQUEST_TIM1_CH3, DMA_REQUEST_TIM1_CH4 } },
+        { TIM2,  { DMA_REQUEST_TIM2_UP, DMA_REQUEST_TIM2_CH1, DMA_REQUEST_TIM2_CH2, DMA_REQUEST_TIM2_CH3, DMA_REQUEST_TIM2_CH4 } },
+        { TIM3,  { DMA_REQUEST_TIM3_UP, DMA_REQUEST_TIM3_CH1, DMA_REQUEST_TIM3_CH2, DMA_REQUEST_TIM3_CH3, DMA_REQUEST_TIM3_CH4 } },
+        { TIM4,  { DMA_REQUEST_TIM4_UP, DMA_REQUEST_TIM4_CH1, DMA_REQUEST_TIM4_CH2, DMA_REQUEST_TIM4_CH3, 0 } },
+        { TIM5,  { DMA_REQUEST_TIM5_UP, DMA_REQUEST_TIM5_CH1, DMA_REQUEST_TIM5_CH2, DMA_REQUEST_TIM5_CH3, DMA_REQUEST_TIM5_CH4 } },
+        { TIM6,  { DMA_REQUEST_TIM6_UP } },
+        { TIM7,  { DMA_REQUEST_TIM7_UP } },
+        { TIM8,  { DMA_REQUEST_TIM8_UP, DMA_REQUEST_TIM8_CH1, DMA_REQUEST_TIM8_CH2, DMA_REQUEST_TIM8_CH3, DMA_REQUEST_TIM8_CH4 } },
+        { TIM15, { DMA_REQUEST_TIM15_UP, DMA_REQUEST_TIM15_CH1 } },
+        { TIM16, { DMA_REQUEST_TIM16_UP, DMA_REQUEST_TIM16_CH1 } },
+        { TIM17, { DMA_REQUEST_TIM17_UP, DMA_REQUEST_TIM17_CH1 } },
+#ifdef TIM23
+        { TIM23, { DMA_REQUEST_TIM23_UP, DMA_REQUEST_TIM23_CH1, DMA_REQUEST_TIM23_CH2, DMA_REQUEST_TIM23_CH3, DMA_REQUEST_TIM23_CH4 } },
+#endif
+#ifdef TIM24
+        { TIM24, { DMA_REQUEST_TIM24_UP, DMA_REQUEST_TIM24_CH1, DMA_REQUEST_TIM24_CH2, DMA_REQUEST_TIM24_CH3, DMA_REQUEST_TIM24_CH4 } },
+#endif
+    };
+
+    uint_fast8_t idx = sizeof(requests) / sizeof(requests[0]);
+
+    if(event <= TimerEvent_CC4) do {
+        if(requests[--idx].timer == timer)
+            return requests[idx].request[event];
+    } while(idx);
+
+    return 0;
+}
+
+bool timer_dma_enable (TIM_TypeDef *timer, timer_event_t event, bool on)
+{
+    static const uint32_t dma_enable[] = { TIM_DIER_UDE, TIM_DIER_CC1DE, TIM_DIER_CC2DE, TIM_DIER_CC3DE, TIM_DIER_CC4DE };
+
+    if(timer_dma_request(timer, event) == 0)
+        return false;
+
+    if(on)
+        timer->DIER |= dma_enable[event];
+    else
+        timer->DIER &= ~dma_enable[event];
+
+    return true;
+}
+
+bool timer_dma_burst (TIM_TypeDef *timer, volatile uint32_t *reg, uint_fast8_t count)
+{
+    uint32_t offset = (uint32_t)reg - (uint32_t)timer;
+
+    // DBA is the register offset in words, DBL the number of transfers - 1 (max 18 transfers).
+    if(!IS_TIM_DMABURST_INSTANCE(timer) || count < 1 || count > 18 || (offset & 0x03) || offset / 4 > 0x1F)
+        return false;
+
+    timer->DCR = ((count - 1) << TIM_DCR_DBL_Pos) | ((offset / 4) << TIM_DCR_DBA_Pos);
+
+    return true;
+}
+
+bool timer_trgo_cfg (TIM_TypeDef *timer, timer_trgo_t trgo)
+{
+    if(!IS_TIM_MASTER_INSTANCE(timer) || trgo > TimerTrgo_OC4Ref)
+        return false;
+
+    timer->CR2 = (timer->CR2 & ~TIM_CR2_MMS) | (trgo << TIM_CR2_MMS_Pos);
+
+    return true;
+}
+
+bool timer_slave_cfg (TIM_TypeDef *timer, TIM_TypeDef *master, timer_slave_mode_t mode)
+{
+    // Internal trigger connections ITR0 - ITR3, see the reference manual TIMx internal trigger connection tables.
+    static const struct {
+        TIM_TypeDef *slave;
+        TIM_TypeDef *itr[4];
+    } triggers[] = {
+        { TIM1,  { TIM15, TIM2, TIM3, TIM4 } },
+        { TIM2,  { TIM1, TIM8, TIM3, TIM4 } },
+        { TIM3,  { TIM1, TIM2, TIM15, TIM4 } },
+        { TIM4,  { TIM1, TIM2, TIM3, TIM8 } },
+        { TIM8,  { TIM1, TIM2, TIM4, TIM5 } },
+        { TIM15, { TIM1, TIM3, NULL, NULL } }
+    };
+
+    uint_fast8_t idx, itr;
+
+    if(!IS_TIM_SLAVE_INSTANCE(timer))
+        return false;
+
+    if(mode == TimerSlave_Off) {
+        timer->SMCR &= ~(TIM_SMCR_SMS|TIM_SMCR_TS);
+        return true;
+    }
+
+    for(idx = 0; idx < sizeof(triggers) / sizeof(triggers[0]); idx++) {
+        if(triggers[idx].slave == timer) {
+            for(itr = 0; itr < 4; itr++) {
+                if(master && triggers[idx].itr[itr] == master) {
+                    timer->SMCR = (timer->SMCR & ~(TIM_SMCR_SMS|TIM_SMCR_TS)) | (itr << TIM_SMCR_TS_Pos) | (mode << TIM_SMCR_SMS_Pos);
+                    return true;
+                }
+            }
+            break;
+        }
+    }
+
+    return false;
+}
+
 hal_timer_t timerClaim (timer_cap_t cap, uint32_t timebase)
 {
     hal_timer_t t;
@@ -371,7 +548,7 @@ hal_timer_t timerClaim (timer_cap_t cap, uint32_t timebase)
             timers[idx].timer->SR &= ~(TIM_SR_UIF|TIM_SR_CC1IF|TIM_SR_CC2IF);
             timers[idx].timer->CNT = 0;
 
-            HAL_NVIC_SetPriority(timers[idx].irq, 0, 1);
+            HAL_NVIC_SetPriority(timers[idx].irq, IRQ_PRIO_TIMER, 0);
             NVIC_EnableIRQ(timers[idx].irq);
             break;
         }
@@ -395,13 +572,13 @@ bool timerCfg(hal_timer_t timer, timer_cfg_t* cfg) {
     dtimer->timer->CR1 &= ~TIM_CR1_OPM;
   }
 
-  if (dtimer->cap.comp1) {
+  if (dtimer->cap.comp1 && cfg->irq0_callback) {
     dtimer->timer->DIER |= TIM_DIER_CC1IE;
   } else {
     dtimer->timer->DIER &= ~TIM_DIER_CC1IE;
   }
 
-  if (dtimer->cap.comp2) {
+  if (dtimer->cap.comp2 && cfg->irq1_callback) {
     dtimer->timer->DIER |= TIM_DIER_CC2IE;
   } else {
     dtimer->timer->DIER &= ~TIM_DIER_CC2IE;
@@ -413,6 +590,12 @@ bool timerCfg(hal_timer_t timer, timer_cfg_t* cfg) {
     dtimer->timer->DIER &= ~TIM_DIER_UIE;
   }
 
+  // Bind the callback for direct dispatch from the interrupt handler.
+  dtimer->update_callback =
+      (dtimer->timer->DIER & (TIM_DIER_CC1IE | TIM_DIER_CC2IE))
+          ? NULL
+          : cfg->timeout_callback;
+
   return true;
 }
 
@@ -453,8 +636,16 @@ bool timerStop (hal_timer_t timer)
     return true;
 }
 
-__attribute__((always_inline)) static inline void _irq_handler (TIM_TypeDef *timer, timer_cfg_t *cfg)
+__attribute__((always_inline)) static inline void _irq_handler (TIM_TypeDef *timer, dtimer_t *dtimer)
 {
+    // Update event only: no flag tests, a single branch to the bound callback.
+    if(dtimer->update_callback) {
+        timer->SR = ~TIM_SR_UIF;
+        dtimer->update_callback(dtimer->cfg.context);
+        return;
+    }
+
+    timer_cfg_t *cfg = &dtimer->cfg;
     uint32_t irq = timer->SR & timer->DIER;
 
     timer->SR &= ~(TIM_SR_UIF|TIM_SR_CC1IF|TIM_SR_CC2IF);
@@ -478,9 +669,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM1_IDX
 
-void TIM1_UP_TIM10_IRQHandler (void)
+ITCM_CODE void TIM1_UP_TIM10_IRQHandler (void)
 {
-    _irq_handler(TIM1, &timers[TIM1_IDX].cfg);
+    _irq_handler(TIM1, &timers[TIM1_IDX]);
 }
 
 #endif // TIM1
@@ -494,9 +685,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM2_IDX
 
-void TIM2_IRQHandler (void)
+ITCM_CODE void TIM2_IRQHandler (void)
 {
-    _irq_handler(TIM2, &timers[TIM2_IDX].cfg);
+    _irq_handler(TIM2, &timers[TIM2_IDX]);
 }
 
 #endif // TIM2
@@ -510,9 +701,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM3_IDX
 
-void TIM3_IRQHandler (void)
+ITCM_CODE void TIM3_IRQHandler (void)
 {
-    _irq_handler(TIM3, &timers[TIM3_IDX].cfg);
+    _irq_handler(TIM3, &timers[TIM3_IDX]);
 }
 
 #endif // TIM3
@@ -526,9 +717,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM4_IDX
 
-void TIM4_IRQHandler (void)
+ITCM_CODE void TIM4_IRQHandler (void)
 {
-    _irq_handler(TIM4, &timers[TIM4_IDX].cfg);
+    _irq_handler(TIM4, &timers[TIM4_IDX]);
 }
 
 #endif // TIM4
@@ -542,9 +733,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM5_IDX
 
-void TIM5_IRQHandler (void)
+ITCM_CODE void TIM5_IRQHandler (void)
 {
-    _irq_handler(TIM5, &timers[TIM5_IDX].cfg);
+    _irq_handler(TIM5, &timers[TIM5_IDX]);
 }
 
 #endif // TIM5
@@ -558,9 +749,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM6_IDX
 
-void TIM6_DAC_IRQHandler (void)
+ITCM_CODE void TIM6_DAC_IRQHandler (void)
 {
-    _irq_handler(TIM6, &timers[TIM6_IDX].cfg);
+    _irq_handler(TIM6, &timers[TIM6_IDX]);
 }
 
 #endif // TIM6
@@ -574,9 +765,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM7_IDX
 
-void TIM7_IRQHandler (void)
+ITCM_CODE void TIM7_IRQHandler (void)
 {
-    _irq_handler(TIM7, &timers[TIM7_IDX].cfg);
+    _irq_handler(TIM7, &timers[TIM7_IDX]);
 }
 
 #endif // TIM7
@@ -590,9 +781,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM8_IDX
 
-void TIM8_IRQHandler (void)
+ITCM_CODE void TIM8_IRQHandler (void)
 {
-    _irq_handler(TIM8, &timers[TIM8_IDX].cfg);
+    _irq_handler(TIM8, &timers[TIM8_IDX]);
 }
 
 #endif // TIM8
@@ -606,9 +797,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM9_IDX
 
-void TIM9_IRQHandler (void)
+ITCM_CODE void TIM9_IRQHandler (void)
 {
-    _irq_handler(TIM9, &timers[TIM9_IDX].cfg);
+    _irq_handler(TIM9, &timers[TIM9_IDX]);
 }
 
 #endif // TIM9
@@ -622,9 +813,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM10_IDX
 
-void TIM10_IRQHandler (void)
+ITCM_CODE void TIM10_IRQHandler (void)
 {
-    _irq_handler(TIM10, &timers[TIM10_IDX].cfg);
+    _irq_handler(TIM10, &timers[TIM10_IDX]);
 }
 
 #endif // TIM10
@@ -638,9 +829,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM11_IDX
 
-void TIM11_IRQHandler (void)
+ITCM_CODE void TIM11_IRQHandler (void)
 {
-    _irq_handler(TIM11, &timers[TIM11_IDX].cfg);
+    _irq_handler(TIM11, &timers[TIM11_IDX]);
 }
 
 #endif // TIM11
@@ -654,9 +845,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM12_IDX
 
-void TIM12_IRQHandler (void)
+ITCM_CODE void TIM12_IRQHandler (void)
 {
-    _irq_handler(TIM12, &timers[TIM12_IDX].cfg);
+    _irq_handler(TIM12, &timers[TIM12_IDX]);
 }
 
 #endif // TIM12
@@ -670,9 +861,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM13_IDX
 
-void TIM13_IRQHandler (void)
+ITCM_CODE void TIM13_IRQHandler (void)
 {
-    _irq_handler(TIM13, &timers[TIM13_IDX].cfg);
+    _irq_handler(TIM13, &timers[TIM13_IDX]);
 }
 
 #endif // TIM13
@@ -686,9 +877,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM14_IDX
 
-void TIM14_IRQHandler (void)
+ITCM_CODE void TIM14_IRQHandler (void)
 {
-    _irq_handler(TIM14, &timers[TIM14_IDX].cfg);
+    _irq_handler(TIM14, &timers[TIM14_IDX]);
 }
 
 #endif // TIM14
@@ -702,9 +893,9 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM15_IDX
 
-void TIM15_IRQHandler (void)
+ITCM_CODE void TIM15_IRQHandler (void)
 {
-    _irq_handler(TIM15, &timers[TIM15_IDX].cfg);
+    _irq_handler(TIM15, &timers[TIM15_IDX]);
 }
 
 #endif // TIM15
@@ -718,9 +909,41 @@ enum {
 #undef LAST_TIDX
 #define LAST_TIDX TIM17_IDX
 
-void TIM17_IRQHandler (void)
+ITCM_CODE void TIM17_IRQHandler (void)
 {
-    _irq_handler(TIM17, &timers[TIM17_IDX].cfg);
+    _irq_handler(TIM17, &timers[TIM17_IDX]);
 }
 
 #endif // TIM17
+
+#ifdef TIM23
+
+enum {
+  TIM23_TIDX = LAST_TIDX,
+  TIM23_IDX
+};
+#undef LAST_TIDX
+#define LAST_TIDX TIM23_IDX
+
+ITCM_CODE void TIM23_IRQHandler (void)
+{
+    _irq_handler(TIM23, &timers[TIM23_IDX]);
+}
+
+#endif // TIM23
+
+#ifdef TIM24
+
+enum {
+  TIM24_TIDX = LAST_TIDX,
+  TIM24_IDX
+};
+#undef LAST_TIDX
+#define LAST_TIDX TIM24_IDX
+
+ITCM_CODE void TIM24_IRQHandler (void)
+{
+    _irq_handler(TIM24, &timers[TIM24_IDX]);
+}
+
+#endif // TIM24
@@ -0,0 +1,256 @@
+/*
+
+  tmc_mres.c - speed dependent TMC2209 microstep resolution switching
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  The planner and the step generator always work at the configured (fine) microstep resolution,
+  steps/mm is never changed. When an axis steps faster than TMC_MRES_COARSE_RATE steps/s during
+  a cycle or jog the MRES field of its driver CHOPCONF register is raised by TMC_MRES_SHIFT,
+  each step pulse output then moves the motor 2^TMC_MRES_SHIFT fine steps and only every
+  2^TMC_MRES_SHIFT'th step generated is output. Below TMC_MRES_FINE_RATE the fine resolution is
+  restored. The rates must be exceeded for TMC_MRES_SWITCH_COUNT consecutive steps.
+
+  The changeover is synchronized in the step ISR: while the CHOPCONF write is in flight no pulses
+  are output for the axis and the generated steps are accumulated, these are output at the new
+  resolution as soon as the queued write has completed, on the next stepper interrupts where the
+  direction matches. No steps are lost, at most 2^TMC_MRES_SHIFT - 1 fine steps are held back
+  while at the coarse resolution.
+  CHOPCONF is read back from the drivers each time the controller goes idle so that changes made
+  by the trinamic plugin are picked up, an axis still at the coarse resolution is switched back.
+
+  Motor n is assumed to drive axis n, ganged and auto squared axes are not supported.
+
+  $TMCMRES - report per axis state: [TMCMRES|<axis>:<fine mres>/<coarse mres>,<F|C|>F|>C>,sw=<switches>,held=<fine steps>]
+*/
+
+#include "driver.h"
+
+#if TMC_MRES_SWITCH_ENABLE
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "tmc_uart.h"
+#include "tmc_mres.h"
+
+#ifndef TMC_MRES_SHIFT
+#define TMC_MRES_SHIFT          2       // coarse resolution is 1/4 of the configured one
+#endif
+#ifndef TMC_MRES_COARSE_RATE
+#define TMC_MRES_COARSE_RATE    40000   // steps/s at the configured resolution
+#endif
+#ifndef TMC_MRES_FINE_RATE
+#define TMC_MRES_FINE_RATE      20000   // steps/s at the configured resolution
+#endif
+#ifndef TMC_MRES_SWITCH_COUNT
+#define TMC_MRES_SWITCH_COUNT   16
+#endif
+
+#if TMC_MRES_FINE_RATE >= TMC_MRES_COARSE_RATE
+#error "TMC_MRES_FINE_RATE must be lower than TMC_MRES_COARSE_RATE!"
+#endif
+
+#define TMC2209_CHOPCONF        0x6C
+#define CHOPCONF_MRES_SHIFT     24
+#define CHOPCONF_MRES_MASK      (0xFUL << CHOPCONF_MRES_SHIFT)
+#define MRES_FULLSTEP           8
+
+typedef enum {
+    Mres_Fine = 0,
+    Mres_ToCoarse,
+    Mres_Coarse,
+    Mres_ToFine
+} mres_state_t;
+
+typedef struct {
+    volatile bool enabled;
+    volatile mres_state_t state;
+    uint32_t chopconf;              // with the configured (fine) resolution
+    int32_t held;                   // generated steps not yet output, in fine steps
+    uint32_t last_step;             // DWT cycle count
+    uint_fast8_t count;
+    uint32_t switches;
+} mres_axis_t;
+
+static bool allowed = false;        // cycle or jog in progress
+static uint32_t coarse_cycles, fine_cycles;
+static mres_axis_t mres[N_AXIS];
+static on_state_change_ptr on_state_change;
+
+static void chopconf_write_complete (uint8_t motor, bool ok, uint8_t reg, uint32_t value, void *context)
+{
+    mres_axis_t *axis = &mres[motor];
+
+    if(axis->state == Mres_ToCoarse)
+        axis->state = ok ? Mres_Coarse : Mres_Fine;
+    else if(axis->state == Mres_ToFine)
+        axis->state = ok ? Mres_Fine : Mres_Coarse;
+}
+
+static void chopconf_read_complete (uint8_t motor, bool ok, uint8_t reg, uint32_t value, void *context)
+{
+    mres_axis_t *axis = &mres[motor];
+
+    if(ok && axis->state == Mres_Fine) {
+        axis->chopconf = value;
+        axis->enabled = ((value & CHOPCONF_MRES_MASK) >> CHOPCONF_MRES_SHIFT) + TMC_MRES_SHIFT <= MRES_FULLSTEP;
+    }
+}
+
+// Queues the CHOPCONF write for a resolution change, called from the step ISR.
+static inline void mres_switch (uint_fast8_t idx, bool coarse)
+{
+    mres_axis_t *axis = &mres[idx];
+
+    axis->state = coarse ? Mres_ToCoarse : Mres_ToFine;
+
+    if(tmc_uart_write_async(idx, TMC2209_CHOPCONF,
+                             coarse ? axis->chopconf + (TMC_MRES_SHIFT << CHOPCONF_MRES_SHIFT) : axis->chopconf,
+                              chopconf_write_complete, NULL))
+        axis->switches++;
+    else
+        axis->state = coarse ? Mres_Fine : Mres_Coarse;
+}
+
+ITCM_CODE void tmc_mres_step_filter (stepper_t *stepper)
+{
+    int32_t dir, div;
+    uint32_t bit, period, now = DWT->CYCCNT;
+    uint_fast8_t idx = N_AXIS;
+    mres_axis_t *axis;
+
+    do {
+        axis = &mres[--idx];
+
+        if(!axis->enabled)
+            continue;
+
+        bit = 1 << idx;
+        dir = (stepper->dir_out.bits & bit) ? -1 : 1;
+
+        if(stepper->step_out.bits & bit) {
+
+            axis->held += dir;
+            period = now - axis->last_step;
+            axis->last_step = now;
+
+            switch(axis->state) {
+
+                case Mres_Fine:
+                    if(allowed && period < coarse_cycles) {
+                        if(++axis->count >= TMC_MRES_SWITCH_COUNT) {
+                            axis->count = 0;
+                            mres_switch(idx, true);
+                        }
+                    } else
+                        axis->count = 0;
+                    break;
+
+                case Mres_Coarse:
+                    if(!allowed || period > fine_cycles) {
+                        if(++axis->count >= TMC_MRES_SWITCH_COUNT) {
+                            axis->count = 0;
+                            mres_switch(idx, false);
+                        }
+                    } else
+                        axis->count = 0;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+
+        // Output a pulse when a full step at the current resolution is held in the current direction,
+        // this also catches up on steps held during a changeover on ticks where the axis is not stepped.
+        div = axis->state == Mres_Fine ? 1 : (axis->state == Mres_Coarse ? (1 << TMC_MRES_SHIFT) : 0);
+
+        if(div && axis->held * dir >= div) {
+            axis->held -= dir * div;
+            stepper->step_out.bits |= bit;
+        } else
+            stepper->step_out.bits &= ~bit;
+
+    } while(idx);
+}
+
+static void mres_state_change (sys_state_t state)
+{
+    uint_fast8_t idx;
+
+    allowed = state == STATE_CYCLE || state == STATE_JOG;
+
+    if(state == STATE_IDLE) {
+        for(idx = 0; idx < N_AXIS; idx++) {
+            mres[idx].count = 0;
+            if(mres[idx].state == Mres_Coarse)
+                mres_switch(idx, false);
+            else if(mres[idx].state == Mres_Fine)
+                tmc_uart_read_async(idx, TMC2209_CHOPCONF, chopconf_read_complete, NULL);
+        }
+    }
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+static status_code_t mres_report (sys_state_t state, char *args)
+{
+    static const char *const state_name[] = { "F", ">C", "C", ">F" };
+
+    char buf[64];
+    uint_fast8_t idx, fine;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        if(mres[idx].enabled) {
+            fine = (mres[idx].chopconf & CHOPCONF_MRES_MASK) >> CHOPCONF_MRES_SHIFT;
+            snprintf(buf, sizeof(buf), "[TMCMRES|%s:%u/%u,%s,sw=%lu,held=%ld]" ASCII_EOL, axis_letter[idx],
+                      256 >> fine, 256 >> (fine + TMC_MRES_SHIFT), state_name[mres[idx].state], mres[idx].switches, mres[idx].held);
+            hal.stream.write(buf);
+        }
+    }
+
+    return Status_OK;
+}
+
+void tmc_mres_init (void)
+{
+    static const sys_command_t mres_command_list[] = {
+        {"TMCMRES", mres_report, { .noargs = On }, { .str = "report TMC microstep resolution switching state" } }
+    };
+
+    static sys_commands_t mres_commands = {
+        .n_commands = sizeof(mres_command_list) / sizeof(sys_command_t),
+        .commands = mres_command_list
+    };
+
+    coarse_cycles = SystemCoreClock / TMC_MRES_COARSE_RATE;
+    fine_cycles = SystemCoreClock / TMC_MRES_FINE_RATE;
+
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = mres_state_change;
+
+    system_register_commands(&mres_commands);
+}
+
+#endif // TMC_MRES_SWITCH_ENABLE
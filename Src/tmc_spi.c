@@ -26,6 +26,8 @@
 
 #include "driver.h"
 #include "spi.h"
+#include "cache.h"
+#include "tmc_spi.h"
 
 #if TRINAMIC_SPI_ENABLE
 
@@ -117,6 +119,8 @@ static void add_cs_pin (xbar_t *gpio, void *data)
     }
 }
 
+#ifdef TRINAMIC_SOFT_SPI
+
 TMC_spi_status_t tmc_spi_read (trinamic_motor_t driver, TMC_spi_datagram_t *datagram)
 {
     TMC_spi_status_t status;
@@ -167,11 +171,163 @@ TMC_spi_status_t tmc_spi_write (trinamic_motor_t driver, TMC_spi_datagram_t *dat
     return status;
 }
 
+#else // Hardware SPI, a datagram is sent as a single full duplex transfer
+
+#define TMC_SPI_DATAGRAM_SIZE 5
+
+#if TRINAMIC_SPI_CHAIN
+
+/*
+  All drivers share the X motor chip select with SDO of each driver connected to SDI of the next,
+  motor 0 is the first in the chain. A transfer clocks one datagram through every driver so the
+  frame holds the datagram for motor 0 last and that of the last motor first, the reply to each
+  driver's previous datagram comes back in the same position. Drivers not addressed are sent a
+  GSTAT read, this has no side effects.
+*/
+
+#define TMC_SPI_FRAME_SIZE align_up(TMC_N_MOTORS_MAX * TMC_SPI_DATAGRAM_SIZE, __SCB_DCACHE_LINE_SIZE)
+#define TMC_SPI_GSTAT 0x01
+
+static uint8_t n_chain = 1;
+static uint8_t tx_frame[TMC_SPI_FRAME_SIZE] DMA_BUFFER;
+static uint8_t rx_frame[TMC_SPI_FRAME_SIZE] DMA_BUFFER;
+
+static inline uint8_t *chain_slot (uint8_t *frame, uint_fast8_t id)
+{
+    return &frame[(n_chain - 1 - id) * TMC_SPI_DATAGRAM_SIZE];
+}
+
+static void frame_put (uint_fast8_t id, TMC_spi_datagram_t *datagram)
+{
+    uint8_t *slot = chain_slot(tx_frame, id);
+
+    slot[0] = datagram->addr.value;
+    slot[1] = datagram->payload.data[3];
+    slot[2] = datagram->payload.data[2];
+    slot[3] = datagram->payload.data[1];
+    slot[4] = datagram->payload.data[0];
+}
+
+static TMC_spi_status_t frame_get (uint_fast8_t id, TMC_spi_datagram_t *datagram)
+{
+    uint8_t *slot = chain_slot(rx_frame, id);
+
+    datagram->payload.data[3] = slot[1];
+    datagram->payload.data[2] = slot[2];
+    datagram->payload.data[1] = slot[3];
+    datagram->payload.data[0] = slot[4];
+
+    return slot[0];
+}
+
+static void frame_xfer (void)
+{
+    DIGITAL_OUT(cs[0].port, 1 << cs[0].pin, 0);
+    spi_transfer(tx_frame, rx_frame, n_chain * TMC_SPI_DATAGRAM_SIZE);
+    DIGITAL_OUT(cs[0].port, 1 << cs[0].pin, 1);
+    delay(TRINAMIC_SPI_DELAY*2);
+}
+
+static TMC_spi_status_t datagram_xfer (uint_fast8_t id, TMC_spi_datagram_t *datagram)
+{
+    uint_fast8_t motor;
+    TMC_spi_datagram_t nop = { .addr.value = TMC_SPI_GSTAT };
+
+    for(motor = 0; motor < n_chain; motor++)
+        frame_put(motor, motor == id ? datagram : &nop);
+
+    frame_xfer();
+
+    return frame_get(id, datagram);
+}
+
+// Reads the registers addressed by datagram[0 .. n_chain - 1] from all drivers in two transfers.
+// Returns the status of the last driver in the chain, status[] holds that of each driver when not NULL.
+TMC_spi_status_t tmc_spi_read_all (TMC_spi_datagram_t datagram[], TMC_spi_status_t status[])
+{
+    uint_fast8_t motor;
+    TMC_spi_status_t last = 0;
+
+    for(motor = 0; motor < n_chain; motor++) {
+        datagram[motor].addr.write = 0;
+        datagram[motor].payload.value = 0;
+        frame_put(motor, &datagram[motor]);
+    }
+
+    frame_xfer(); // latch addresses
+    frame_xfer(); // clock out the replies
+
+    for(motor = 0; motor < n_chain; motor++) {
+        last = frame_get(motor, &datagram[motor]);
+        if(status)
+            status[motor] = last;
+    }
+
+    return last;
+}
+
+#else
+
+static TMC_spi_status_t datagram_xfer (uint_fast8_t id, TMC_spi_datagram_t *datagram)
+{
+    uint8_t tx[TMC_SPI_DATAGRAM_SIZE], rx[TMC_SPI_DATAGRAM_SIZE];
+
+    tx[0] = datagram->addr.value;
+    tx[1] = datagram->payload.data[3];
+    tx[2] = datagram->payload.data[2];
+    tx[3] = datagram->payload.data[1];
+    tx[4] = datagram->payload.data[0];
+
+    DIGITAL_OUT(cs[id].port, 1 << cs[id].pin, 0);
+    spi_transfer(tx, rx, TMC_SPI_DATAGRAM_SIZE);
+    DIGITAL_OUT(cs[id].port, 1 << cs[id].pin, 1);
+    delay(TRINAMIC_SPI_DELAY*2);
+
+    datagram->payload.data[3] = rx[1];
+    datagram->payload.data[2] = rx[2];
+    datagram->payload.data[1] = rx[3];
+    datagram->payload.data[0] = rx[4];
+
+    return rx[0];
+}
+
+#endif // TRINAMIC_SPI_CHAIN
+
+TMC_spi_status_t tmc_spi_read (trinamic_motor_t driver, TMC_spi_datagram_t *datagram)
+{
+    datagram->payload.value = 0;
+    datagram->addr.write = 0;
+
+    datagram_xfer(driver.id, datagram); // latch address, reply is to the previous datagram
+
+    datagram->payload.value = 0;
+
+    return datagram_xfer(driver.id, datagram);
+}
+
+TMC_spi_status_t tmc_spi_write (trinamic_motor_t driver, TMC_spi_datagram_t *datagram)
+{
+    uint32_t value = datagram->payload.value;
+    TMC_spi_status_t status;
+
+    datagram->addr.write = 1;
+    status = datagram_xfer(driver.id, datagram);
+    datagram->payload.value = value;
+
+    return status;
+}
+
+#endif // TRINAMIC_SOFT_SPI
+
 void if_init(uint8_t motors, axes_signals_t enabled)
 {
   static bool init_ok = false;
 
+#if TRINAMIC_SPI_CHAIN
+  n_chain = motors > TMC_N_MOTORS_MAX ? TMC_N_MOTORS_MAX : (motors ? motors : 1);
+#else
   UNUSED(motors);
+#endif
 
   if (!init_ok) {
 
@@ -0,0 +1,321 @@
+/*
+
+  tmc_telemetry.c - background StallGuard/CoolStep sampling of TMC2209 drivers
+
+  Part of grblHAL
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+
+*/
+
+/*
+  Every TMC_TELEMETRY_PERIOD ms SG_RESULT and DRV_STATUS are read from all drivers via the
+  non-blocking UART queue and the sweep is stored in a ring of TMC_TELEMETRY_SIZE samples.
+
+  The latest sample is added to the real time report as |SG:<motor 0>,<motor 1>,...|CS:...
+  with SG_RESULT and CS_ACTUAL per motor; motors that did not reply are left blank.
+
+  $TMCSG   - dump the ring, oldest sample first:
+             [TMCSG|t=<ms>,<motor>:<sg>/<cs>/<drv_status hex>,...]
+             followed by [TMCSG|n=<samples>,err=<failed reads>]
+  $TMCSG=R - dump, then clear the ring
+
+  $SGCAL=<axis> - StallGuard threshold calibration from the samples taken while the axis was moving,
+                  jog the axis at the homing seek rate first. Reports the lowest and the average SG_RESULT
+                  and the SGTHRS that stalls at TMC_SGCAL_PCT of the lowest (stall when SG_RESULT <= 2 * SGTHRS):
+                  [SGCAL|<axis>,n=<samples>,min=<sg>,avg=<sg>,sgthrs=<value>]
+                  Set the homing sensitivity of the trinamic plugin for the axis to the SGTHRS value.
+*/
+
+#include "driver.h"
+
+#if TMC_TELEMETRY_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "trinamic/common.h"
+#include "tmc_uart.h"
+
+#ifndef TMC_TELEMETRY_PERIOD
+#define TMC_TELEMETRY_PERIOD 50 // ms
+#endif
+#ifndef TMC_TELEMETRY_SIZE
+#define TMC_TELEMETRY_SIZE  64  // power of 2
+#endif
+
+#ifndef TMC_SGCAL_PCT
+#define TMC_SGCAL_PCT       60
+#endif
+
+#if (TMC_TELEMETRY_SIZE & (TMC_TELEMETRY_SIZE - 1)) != 0
+#error "TMC_TELEMETRY_SIZE must be a power of 2!"
+#endif
+
+#define TMC2209_SG_RESULT   0x41
+#define TMC2209_DRV_STATUS  0x6F
+
+typedef struct {
+    uint32_t t_ms;
+    uint32_t valid;                             // bitmask of motors with a complete reading
+    uint32_t moving;                            // bitmask of axes that moved since the previous sample
+    uint16_t sg_result[TMC_N_MOTORS_MAX];
+    uint8_t cs_actual[TMC_N_MOTORS_MAX];
+    uint32_t drv_status[TMC_N_MOTORS_MAX];
+} tmc_sample_t;
+
+typedef struct {
+    volatile uint_fast16_t head;
+    volatile uint_fast16_t count;
+    tmc_sample_t sample[TMC_TELEMETRY_SIZE];
+} tmc_samples_t;
+
+static volatile bool sweep_active = false;
+static volatile uint32_t errors = 0;
+static uint32_t sweep_start = 0;
+static int32_t sweep_position[N_AXIS];
+static tmc_sample_t sweep;
+static tmc_samples_t samples = {0};
+
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+static on_realtime_report_ptr on_realtime_report;
+
+static void sweep_next (uint_fast8_t motor);
+
+// Called from interrupt context when a queued register read has completed.
+static void sweep_read_complete (uint8_t motor, bool ok, uint8_t reg, uint32_t value, void *context)
+{
+    if(!ok)
+        errors++;
+
+    if(reg == TMC2209_SG_RESULT) {
+        if(ok && tmc_uart_read_async(motor, TMC2209_DRV_STATUS, sweep_read_complete, NULL)) {
+            sweep.sg_result[motor] = value & 0x3FF;
+            return;
+        }
+    } else if(ok) {
+        sweep.drv_status[motor] = value;
+        sweep.cs_actual[motor] = (value >> 16) & 0x1F;
+        sweep.valid |= 1 << motor;
+    }
+
+    sweep_next(motor + 1);
+}
+
+// Queues the reads for the next motor with a UART port, or stores the sample when done.
+// Motors without a port are rejected by the queue and skipped.
+static void sweep_next (uint_fast8_t motor)
+{
+    for(; motor < TMC_N_MOTORS_MAX; motor++) {
+        if(tmc_uart_read_async(motor, TMC2209_SG_RESULT, sweep_read_complete, NULL))
+            return;
+    }
+
+    if(sweep.valid) {
+        memcpy(&samples.sample[samples.head], &sweep, sizeof(tmc_sample_t));
+        samples.head = (samples.head + 1) & (TMC_TELEMETRY_SIZE - 1);
+        if(samples.count < TMC_TELEMETRY_SIZE)
+            samples.count++;
+    }
+
+    sweep_active = false;
+}
+
+static void telemetry_poll (void)
+{
+    uint32_t now = hal.get_elapsed_ticks();
+
+    if(!sweep_active && now - sweep_start >= TMC_TELEMETRY_PERIOD) {
+        sweep_start = now;
+        memset(&sweep, 0, sizeof(tmc_sample_t));
+        sweep.t_ms = now;
+        for(uint_fast8_t idx = 0; idx < N_AXIS; idx++) {
+            if(sys.position[idx] != sweep_position[idx])
+                sweep.moving |= 1 << idx;
+            sweep_position[idx] = sys.position[idx];
+        }
+        sweep_active = true;
+        sweep_next(0);
+    }
+}
+
+static void telemetry_execute_realtime (uint_fast16_t state)
+{
+    telemetry_poll();
+
+    on_execute_realtime(state);
+}
+
+static void telemetry_execute_delay (uint_fast16_t state)
+{
+    telemetry_poll();
+
+    on_execute_delay(state);
+}
+
+// Copies the sample idx places back from the newest, returns false if not available.
+static bool sample_get (tmc_sample_t *sample, uint_fast16_t idx)
+{
+    bool ok;
+
+    __disable_irq();
+    if((ok = idx < samples.count))
+        memcpy(sample, &samples.sample[(samples.head - 1 - idx) & (TMC_TELEMETRY_SIZE - 1)], sizeof(tmc_sample_t));
+    __enable_irq();
+
+    return ok;
+}
+
+static void telemetry_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    char buf[8];
+    uint_fast8_t motor, last;
+    tmc_sample_t sample;
+
+    if(sample_get(&sample, 0)) {
+
+        last = 31 - __CLZ(sample.valid);
+
+        stream_write("|SG:");
+        for(motor = 0; motor <= last; motor++) {
+            if(sample.valid & (1 << motor)) {
+                snprintf(buf, sizeof(buf), "%u", sample.sg_result[motor]);
+                stream_write(buf);
+            }
+            if(motor < last)
+                stream_write(",");
+        }
+
+        stream_write("|CS:");
+        for(motor = 0; motor <= last; motor++) {
+            if(sample.valid & (1 << motor)) {
+                snprintf(buf, sizeof(buf), "%u", sample.cs_actual[motor]);
+                stream_write(buf);
+            }
+            if(motor < last)
+                stream_write(",");
+        }
+    }
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
+}
+
+static status_code_t telemetry_dump (sys_state_t state, char *args)
+{
+    char buf[40];
+    uint_fast8_t motor;
+    uint_fast16_t idx, n = samples.count;
+    tmc_sample_t sample;
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    for(idx = n; idx; idx--) {
+
+        if(!sample_get(&sample, idx - 1))
+            continue;
+
+        snprintf(buf, sizeof(buf), "[TMCSG|t=%lu", sample.t_ms);
+        hal.stream.write(buf);
+
+        for(motor = 0; motor < TMC_N_MOTORS_MAX; motor++) {
+            if(sample.valid & (1 << motor)) {
+                snprintf(buf, sizeof(buf), ",%u:%u/%u/%08lX", motor, sample.sg_result[motor], sample.cs_actual[motor], sample.drv_status[motor]);
+                hal.stream.write(buf);
+            }
+        }
+
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    snprintf(buf, sizeof(buf), "[TMCSG|n=%u,err=%lu]" ASCII_EOL, n, errors);
+    hal.stream.write(buf);
+
+    if(args) {
+        __disable_irq();
+        samples.count = 0;
+        errors = 0;
+        __enable_irq();
+    }
+
+    return Status_OK;
+}
+
+static status_code_t stallguard_calibrate (sys_state_t state, char *args)
+{
+    char buf[64];
+    uint_fast8_t axis;
+    uint_fast16_t idx, n = 0, min = UINT16_MAX;
+    uint32_t total = 0;
+    tmc_sample_t sample;
+
+    if(args == NULL || args[1] != '\0')
+        return Status_InvalidStatement;
+
+    for(axis = 0; axis < N_AXIS && *axis_letter[axis] != *args; axis++);
+
+    if(axis == N_AXIS)
+        return Status_InvalidStatement;
+
+    for(idx = 0; sample_get(&sample, idx); idx++) {
+        if((sample.valid & sample.moving) & (1 << axis)) {
+            n++;
+            total += sample.sg_result[axis];
+            if(sample.sg_result[axis] < min)
+                min = sample.sg_result[axis];
+        }
+    }
+
+    if(n == 0) {
+        snprintf(buf, sizeof(buf), "[SGCAL|%s,n=0]" ASCII_EOL, axis_letter[axis]);
+        hal.stream.write(buf);
+        return Status_OK;
+    }
+
+    snprintf(buf, sizeof(buf), "[SGCAL|%s,n=%u,min=%u,avg=%lu,sgthrs=%u]" ASCII_EOL, axis_letter[axis], n, min,
+              total / n, (min * TMC_SGCAL_PCT / 100) >> 1);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void tmc_telemetry_init (void)
+{
+    static const sys_command_t telemetry_command_list[] = {
+        {"TMCSG", telemetry_dump, {}, { .str = "dump TMC StallGuard/CoolStep samples, $TMCSG=R to clear" } },
+        {"SGCAL", stallguard_calibrate, {}, { .str = "StallGuard threshold from the samples of a moving axis, $SGCAL=<axis>" } }
+    };
+
+    static sys_commands_t telemetry_commands = {
+        .n_commands = sizeof(telemetry_command_list) / sizeof(sys_command_t),
+        .commands = telemetry_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = telemetry_execute_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = telemetry_execute_delay;
+
+    on_realtime_report = grbl.on_realtime_report;
+    grbl.on_realtime_report = telemetry_realtime_report;
+
+    system_register_commands(&telemetry_commands);
+}
+
+#endif // TMC_TELEMETRY_ENABLE
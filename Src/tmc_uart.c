@@ -26,7 +26,17 @@
 
 #if TRINAMIC_UART_ENABLE
 
+#include <stdio.h>
+#include <string.h>
+
 #include "trinamic/common.h"
+#include "tmc_uart.h"
+#include "cache.h"
+
+#if TMC_UART_BATCH
+#include "grbl/protocol.h"
+#include "grbl/report.h"
+#endif
 
 #define TMC_UART_TIMER          timer(TMC_UART_TIMER_N)
 #define TMC_UART_IRQn           timerINT(TMC_UART_TIMER_N)
@@ -62,8 +72,11 @@ typedef struct {
 } tmc_uart_rx_buffer_t;
 
 static uint32_t period_div_2;
+#if !TMC_UART_DMA
+static volatile bool xfer_active = false;
 static tmc_uart_tx_buffer_t tx_buf;
 static tmc_uart_rx_buffer_t rx_buf;
+#endif
 static tmc_uart_t uart[TMC_N_MOTORS_MAX], *active_uart;
 
 static inline void setTX ()
@@ -90,6 +103,832 @@ static inline void setRX (void)
     HAL_GPIO_Init(active_uart->port, &GPIO_InitStruct);
 }
 
+#if TMC_UART_DMA
+
+/*
+  Timer paced DMA bit engine. A datagram is expanded into one BSRR word per bit that the DMA
+  writes to the pin on each timer update. The reply is captured by the DMA sampling the port
+  input register at RX_OVERSAMPLE times the bit rate and is decoded afterwards. No interrupts
+  are involved in the bit timing, so it is immune to other interrupt activity.
+
+  Register accesses can also be queued with tmc_uart_read_async() and tmc_uart_write_async(),
+  these are chained in the background from the DMA transfer complete interrupt. The blocking
+  tmc_uart_read() and tmc_uart_write() used by the trinamic plugin wait for the engine to be
+  idle and claim it for the duration of the transfer.
+  NOTE: DMA1 stream 4 is used, buffers must not be placed in DTCM.
+*/
+
+#define TMC_UART_DMA_STREAM     DMA1_Stream4
+#define TMC_UART_DMA_IRQ        DMA1_Stream4_IRQn
+#define TMC_UART_DMA_IRQHandler DMA1_Stream4_IRQHandler
+#define TMC_UART_DMA_TIMEOUT    10          // ms
+#define RX_OVERSAMPLE           4
+#define RX_WINDOW_BITS          208         // max SENDDELAY (120 bit times) + 8 byte reply + margin
+#define TX_MAX_BITS             81          // 8 byte datagram + trailing idle
+#define TMC_UART_SYNC           0x05
+#define TMC_UART_WRITE          0x80
+
+typedef enum {
+    Xfer_Idle = 0,
+    Xfer_Sync,      // claimed by a blocking transfer
+    Xfer_Write,     // queued request, datagram being sent
+    Xfer_Read       // queued request, reply being captured
+} xfer_state_t;
+
+typedef struct {
+    uint8_t motor;
+    uint8_t reg;    // TMC_UART_WRITE set for writes
+    uint32_t value;
+    tmc_uart_complete_ptr callback;
+    void *context;
+} tmc_uart_request_t;
+
+typedef struct {
+    volatile uint_fast8_t head;
+    volatile uint_fast8_t tail;
+    tmc_uart_request_t request[TMC_UART_QUEUE_SIZE];
+} tmc_uart_queue_t;
+
+#if TMC_UART_BATCH
+static void batch_flush (void);
+#endif
+#if TMC_UART_SHADOW
+static void shadow_write (uint8_t motor, uint8_t reg, uint32_t value);
+static void shadow_read_done (uint8_t motor, uint8_t reg, uint32_t value);
+#endif
+
+static uint32_t tx_wave[(TX_MAX_BITS + 7) & ~7] DMA_BUFFER;
+static uint16_t rx_samples[RX_WINDOW_BITS * RX_OVERSAMPLE] DMA_BUFFER;
+static volatile xfer_state_t xfer_state = Xfer_Idle;
+static tmc_uart_queue_t queue = {0};
+
+static DMA_HandleTypeDef tmc_dma = {
+    .Instance                 = TMC_UART_DMA_STREAM,
+    .Init.Request             = timerDMAREQ(TMC_UART_TIMER_N, UP),
+    .Init.FIFOMode            = DMA_FIFOMODE_DISABLE,
+    .Init.FIFOThreshold       = DMA_FIFO_THRESHOLD_FULL,
+    .Init.MemBurst            = DMA_MBURST_SINGLE,
+    .Init.PeriphBurst         = DMA_PBURST_SINGLE,
+    .Init.PeriphInc           = DMA_PINC_DISABLE,
+    .Init.MemInc              = DMA_MINC_ENABLE,
+    .Init.Mode                = DMA_NORMAL,
+    .Init.Priority            = DMA_PRIORITY_HIGH,
+};
+
+static uint8_t tmc_crc (const uint8_t *data, uint_fast8_t length)
+{
+    uint_fast8_t i, byte;
+    uint8_t crc = 0;
+
+    while(length--) {
+        byte = *data++;
+        for(i = 0; i < 8; i++) {
+            crc = ((crc >> 7) ^ (byte & 1)) ? (crc << 1) ^ 0x07 : crc << 1;
+            byte >>= 1;
+        }
+    }
+
+    return crc;
+}
+
+// Starts one DMA transfer paced by the timer at period timer ticks,
+// with the transfer complete interrupt enabled if irq is set.
+static void dma_start (uint32_t direction, uint32_t src, uint32_t dst, uint32_t count, uint32_t align, uint32_t period, bool irq)
+{
+    tmc_dma.Init.Direction = direction;
+    tmc_dma.Init.PeriphDataAlignment = align == 4 ? DMA_PDATAALIGN_WORD : DMA_PDATAALIGN_HALFWORD;
+    tmc_dma.Init.MemDataAlignment = align == 4 ? DMA_MDATAALIGN_WORD : DMA_MDATAALIGN_HALFWORD;
+    HAL_DMA_Init(&tmc_dma);
+
+    TMC_UART_TIMER->CR1 = 0;
+    TMC_UART_TIMER->DIER = 0;
+    TMC_UART_TIMER->ARR = period - 1;
+    TMC_UART_TIMER->EGR = TIM_EGR_UG;
+    TMC_UART_TIMER->SR = 0;
+
+    __HAL_DMA_CLEAR_FLAG(&tmc_dma, __HAL_DMA_GET_TC_FLAG_INDEX(&tmc_dma)|__HAL_DMA_GET_TE_FLAG_INDEX(&tmc_dma)|__HAL_DMA_GET_FE_FLAG_INDEX(&tmc_dma));
+    HAL_DMA_Start(&tmc_dma, src, dst, count);
+    if(irq)
+        TMC_UART_DMA_STREAM->CR |= DMA_SxCR_TCIE|DMA_SxCR_TEIE;
+
+    TMC_UART_TIMER->DIER = TIM_DIER_UDE;
+    TMC_UART_TIMER->CR1 = TIM_CR1_CEN;
+}
+
+static inline void dma_stop (void)
+{
+    TMC_UART_TIMER->CR1 = 0;
+    TMC_UART_TIMER->DIER = 0;
+}
+
+// Runs one DMA transfer to completion, returns false on timeout.
+static bool dma_transfer (uint32_t direction, uint32_t src, uint32_t dst, uint32_t count, uint32_t align, uint32_t period)
+{
+    bool ok;
+
+    dma_start(direction, src, dst, count, align, period, false);
+
+    ok = HAL_DMA_PollForTransfer(&tmc_dma, HAL_DMA_FULL_TRANSFER, TMC_UART_DMA_TIMEOUT) == HAL_OK;
+
+    dma_stop();
+
+    if(!ok)
+        HAL_DMA_Abort(&tmc_dma);
+
+    return ok;
+}
+
+// Expands a datagram per pin into BSRR words that drive all the pins (of one port) at once,
+// returns the number of words.
+static uint32_t tx_build_pins (const uint8_t *data[], const uint32_t pin[], uint_fast8_t n_pins, uint32_t length)
+{
+    uint32_t all = 0, word, *wave = tx_wave;
+    uint_fast8_t i, p, byte;
+
+    for(p = 0; p < n_pins; p++)
+        all |= pin[p];
+
+    for(byte = 0; byte < length; byte++) {
+        *wave++ = all << 16;                        // START
+        for(i = 0; i < 8; i++) {
+            for(p = 0, word = 0; p < n_pins; p++)
+                word |= (data[p][byte] >> i) & 1 ? pin[p] : pin[p] << 16;
+            *wave++ = word;
+        }
+        *wave++ = all;                              // STOP
+    }
+    *wave++ = all;                                  // hold STOP for a full bit period until the transfer completes
+
+    dma_buffer_clean(tx_wave, sizeof(tx_wave));
+
+    return wave - tx_wave;
+}
+
+// Expands a datagram into BSRR words for the active pin, returns the number of words.
+static inline uint32_t tx_build (const uint8_t data[], uint32_t length)
+{
+    uint32_t pin = 1 << active_uart->pin;
+
+    return tx_build_pins(&data, &pin, 1, length);
+}
+
+static inline void tx_start (uint32_t n_bits, bool irq)
+{
+    setTX();
+    dma_start(DMA_MEMORY_TO_PERIPH, (uint32_t)tx_wave, (uint32_t)&active_uart->port->BSRR, n_bits, 4, period_div_2 << 1, irq);
+}
+
+// Switches to input and starts capturing the reply window.
+// NOTE: the TMC2209 waits at least SENDDELAY (8) bit times before replying.
+static inline void rx_start (bool irq)
+{
+    setRX();
+    dma_buffer_invalidate(rx_samples, sizeof(rx_samples));
+    dma_start(DMA_PERIPH_TO_MEMORY, (uint32_t)&active_uart->port->IDR, (uint32_t)rx_samples,
+               RX_WINDOW_BITS * RX_OVERSAMPLE, 2, (period_div_2 << 1) / RX_OVERSAMPLE, irq);
+}
+
+// Decodes length bytes for pin from the captured samples, returns false on missing or malformed data.
+static bool rx_decode_pin (uint32_t pin, uint8_t data[], uint32_t length)
+{
+    uint32_t i = 0, c;
+    uint_fast8_t bit, byte;
+
+    while(length) {
+
+        while(i < RX_WINDOW_BITS * RX_OVERSAMPLE && (rx_samples[i] & pin))
+            i++;                                    // look for START (0)
+
+        if((c = i + RX_OVERSAMPLE / 2) + 9 * RX_OVERSAMPLE >= RX_WINDOW_BITS * RX_OVERSAMPLE)
+            return false;
+
+        if(rx_samples[c] & pin) {                   // glitch, not a START bit
+            i++;
+            continue;
+        }
+
+        for(bit = 0, byte = 0; bit < 8; bit++) {    // sample in the center of each bit
+            c += RX_OVERSAMPLE;
+            if(rx_samples[c] & pin)
+                byte |= 1 << bit;
+        }
+
+        if(!(rx_samples[c += RX_OVERSAMPLE] & pin)) // STOP must be 1
+            return false;
+
+        *data++ = byte;
+        length--;
+        i = c;
+    }
+
+    return true;
+}
+
+// Decodes the reply on the active pin.
+static bool rx_decode (uint8_t data[], uint32_t length)
+{
+    dma_buffer_invalidate(rx_samples, sizeof(rx_samples));
+
+    // the reply has ended well before the capture window, so the TMC has released the line
+    setTX();
+
+    return rx_decode_pin(1 << active_uart->pin, data, length);
+}
+
+// Starts the next queued request if the engine is idle.
+// Must be called from the DMA interrupt or with interrupts disabled.
+static void queue_kick (void)
+{
+    uint8_t dgr[8];
+    tmc_uart_request_t *request;
+
+    if(xfer_state != Xfer_Idle || queue.tail == queue.head)
+        return;
+
+    request = &queue.request[queue.tail];
+    active_uart = &uart[request->motor];
+
+    dgr[0] = TMC_UART_SYNC;
+    dgr[1] = 0;                                     // slave address, one UART pin per driver
+    dgr[2] = request->reg;
+
+    if(request->reg & TMC_UART_WRITE) {
+        dgr[3] = request->value >> 24;
+        dgr[4] = request->value >> 16;
+        dgr[5] = request->value >> 8;
+        dgr[6] = request->value;
+        dgr[7] = tmc_crc(dgr, 7);
+        xfer_state = Xfer_Write;
+        tx_start(tx_build(dgr, 8), true);
+    } else {
+        dgr[3] = tmc_crc(dgr, 3);
+        xfer_state = Xfer_Write;
+        tx_start(tx_build(dgr, 4), true);
+    }
+}
+
+static bool queue_add (uint8_t motor, uint8_t reg, uint32_t value, tmc_uart_complete_ptr callback, void *context)
+{
+    bool ok;
+    uint_fast8_t next;
+
+    if(motor >= TMC_N_MOTORS_MAX || uart[motor].port == NULL)
+        return false;
+
+#if TMC_UART_BATCH
+    if(__get_IPSR() == 0)               // posted writes go first
+        batch_flush();
+#endif
+
+    __disable_irq();
+
+    next = (queue.head + 1) & (TMC_UART_QUEUE_SIZE - 1);
+
+    if((ok = next != queue.tail)) {
+        queue.request[queue.head].motor = motor;
+        queue.request[queue.head].reg = reg;
+        queue.request[queue.head].value = value;
+        queue.request[queue.head].callback = callback;
+        queue.request[queue.head].context = context;
+        queue.head = next;
+        queue_kick();
+    }
+
+    __enable_irq();
+
+    return ok;
+}
+
+bool tmc_uart_read_async (uint8_t motor, uint8_t reg, tmc_uart_complete_ptr callback, void *context)
+{
+    return queue_add(motor, reg & ~TMC_UART_WRITE, 0, callback, context);
+}
+
+bool tmc_uart_write_async (uint8_t motor, uint8_t reg, uint32_t value, tmc_uart_complete_ptr callback, void *context)
+{
+    return queue_add(motor, reg | TMC_UART_WRITE, value, callback, context);
+}
+
+void TMC_UART_DMA_IRQHandler (void)
+{
+    bool ok = !__HAL_DMA_GET_FLAG(&tmc_dma, __HAL_DMA_GET_TE_FLAG_INDEX(&tmc_dma));
+    uint8_t reply[8];
+    uint32_t value = 0;
+    tmc_uart_request_t *request = &queue.request[queue.tail];
+
+    __HAL_DMA_CLEAR_FLAG(&tmc_dma, __HAL_DMA_GET_TC_FLAG_INDEX(&tmc_dma)|__HAL_DMA_GET_TE_FLAG_INDEX(&tmc_dma)|__HAL_DMA_GET_FE_FLAG_INDEX(&tmc_dma));
+    TMC_UART_DMA_STREAM->CR &= ~(DMA_SxCR_TCIE|DMA_SxCR_TEIE);
+    dma_stop();
+
+    tmc_dma.State = HAL_DMA_STATE_READY;    // HAL_DMA_Start() leaves the handle locked until polled
+    __HAL_UNLOCK(&tmc_dma);
+
+    if(xfer_state == Xfer_Write && ok && !(request->reg & TMC_UART_WRITE)) {
+        xfer_state = Xfer_Read;
+        rx_start(true);
+        return;
+    }
+
+    if(xfer_state == Xfer_Read) {
+        if((ok = ok && rx_decode(reply, sizeof(reply)) && reply[0] == TMC_UART_SYNC &&
+                        reply[1] == 0xFF && reply[2] == request->reg && reply[7] == tmc_crc(reply, 7)))
+            value = (reply[3] << 24) | (reply[4] << 16) | (reply[5] << 8) | reply[6];
+    } else
+        setTX();
+
+#if TMC_UART_SHADOW
+    if(ok) {
+        if(request->reg & TMC_UART_WRITE)
+            shadow_write(request->motor, request->reg, request->value);
+        else
+            shadow_read_done(request->motor, request->reg, value);
+    }
+#endif
+
+    queue.tail = (queue.tail + 1) & (TMC_UART_QUEUE_SIZE - 1);
+    xfer_state = Xfer_Idle;
+
+    if(request->callback)
+        request->callback(request->motor, ok, request->reg & ~TMC_UART_WRITE, value, request->context);
+
+    queue_kick();
+}
+
+// Waits for queued requests in flight to complete and claims the engine for a blocking transfer.
+static bool sync_claim (void)
+{
+    bool ok = false;
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    do {
+        __disable_irq();
+        if((ok = xfer_state == Xfer_Idle))
+            xfer_state = Xfer_Sync;
+        __enable_irq();
+    } while(!ok && hal.get_elapsed_ticks() - ms <= TMC_UART_DMA_TIMEOUT);
+
+    return ok;
+}
+
+static void sync_release (void)
+{
+    __disable_irq();
+    xfer_state = Xfer_Idle;
+    queue_kick();
+    __enable_irq();
+}
+
+#if TMC_UART_BATCH
+
+/*
+  Batched writes at boot. From the interface init until the first pass of the realtime loop
+  tmc_uart_write() only posts the datagram. The posted writes are sent before a read or a queued
+  request, when TMC_UART_BATCH_SIZE are pending and at the end of the batch. Each frame carries
+  the oldest pending write of every motor that has its UART pin on the same GPIO port, the bits
+  for all the pins are combined in the same BSRR words. Writes to a motor are sent in order and a
+  read sees all earlier writes to it.
+
+  The IFCNT value of each read of it (the trinamic plugin reads it before and after configuring
+  a driver) is kept, at the end of the batch IFCNT is read back from all these motors in a single
+  request per port to verify that every write sent since has been received.
+*/
+
+#ifndef TMC_UART_BATCH_SIZE
+#define TMC_UART_BATCH_SIZE 64
+#endif
+
+#define TMC2209_REG_IFCNT 0x02
+
+typedef struct {
+    uint8_t motor;
+    uint8_t data[8];
+} tmc_uart_posted_t;
+
+typedef struct {
+    bool active;
+    bool done;
+    uint_fast8_t n;
+    tmc_uart_posted_t write[TMC_UART_BATCH_SIZE];
+    bool ifcnt_valid[TMC_N_MOTORS_MAX];
+    uint8_t ifcnt[TMC_N_MOTORS_MAX];        // last read
+    uint8_t sent[TMC_N_MOTORS_MAX];         // writes sent since
+} tmc_uart_batch_t;
+
+static tmc_uart_batch_t batch = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void set_pins (GPIO_TypeDef *port, uint32_t mask, bool tx)
+{
+    GPIO_InitTypeDef GPIO_InitStruct = {
+        .Pin = mask,
+        .Mode = tx ? GPIO_MODE_OUTPUT_PP : GPIO_MODE_INPUT,
+        .Pull = tx ? GPIO_NOPULL : GPIO_PULLUP
+    };
+
+    if(tx)
+        port->BSRR = mask;                          // idle high
+    HAL_GPIO_Init(port, &GPIO_InitStruct);
+}
+
+// Sends the pending writes, the engine must be claimed.
+static void batch_send (void)
+{
+    bool taken[TMC_UART_BATCH_SIZE];
+    const uint8_t *data[TMC_N_MOTORS_MAX];
+    uint32_t pin[TMC_N_MOTORS_MAX], mask, seen, bit;
+    uint_fast8_t idx, n, n_pins;
+    GPIO_TypeDef *port;
+
+    while(batch.n) {
+
+        port = uart[batch.write[0].motor].port;
+        mask = seen = n_pins = 0;
+
+        // the oldest pending write of each motor on the port
+        for(idx = 0; idx < batch.n; idx++) {
+            bit = 1 << uart[batch.write[idx].motor].pin;
+            if((taken[idx] = uart[batch.write[idx].motor].port == port && !(seen & bit) && n_pins < TMC_N_MOTORS_MAX)) {
+                mask |= bit;
+                pin[n_pins] = bit;
+                data[n_pins++] = batch.write[idx].data;
+                batch.sent[batch.write[idx].motor]++;
+            }
+            if(uart[batch.write[idx].motor].port == port)
+                seen |= bit;
+        }
+
+        set_pins(port, mask, true);
+        dma_transfer(DMA_MEMORY_TO_PERIPH, (uint32_t)tx_wave, (uint32_t)&port->BSRR,
+                      tx_build_pins(data, pin, n_pins, 8), 4, period_div_2 << 1);
+
+        for(idx = n = 0; idx < batch.n; idx++) {
+            if(!taken[idx])
+                memcpy(&batch.write[n++], &batch.write[idx], sizeof(tmc_uart_posted_t));
+        }
+        batch.n = n;
+    }
+}
+
+static void batch_flush (void)
+{
+    if(batch.n && sync_claim()) {
+        batch_send();
+        sync_release();
+    }
+}
+
+// Reads IFCNT from all motors with a known count in one request per port, returns a bit per
+// motor with missing writes or no reply.
+static uint32_t batch_verify (void)
+{
+    static const uint8_t request[4] = { TMC_UART_SYNC, 0, TMC2209_REG_IFCNT, 0x00 };
+
+    uint8_t dgr[4], reply[8];
+    const uint8_t *data[TMC_N_MOTORS_MAX];
+    uint32_t pin[TMC_N_MOTORS_MAX], mask, failed = 0, checked = 0;
+    uint_fast8_t motor, n_pins, idx;
+    GPIO_TypeDef *port;
+
+    memcpy(dgr, request, 3);
+    dgr[3] = tmc_crc(dgr, 3);
+
+    if(!sync_claim())
+        return 0;
+
+    for(motor = 0; motor < TMC_N_MOTORS_MAX; motor++) {
+
+        if(!batch.ifcnt_valid[motor] || batch.sent[motor] == 0 || (checked & (1 << motor)))
+            continue;
+
+        port = uart[motor].port;
+        mask = n_pins = 0;
+
+        for(idx = motor; idx < TMC_N_MOTORS_MAX; idx++) {
+            if(batch.ifcnt_valid[idx] && batch.sent[idx] && uart[idx].port == port) {
+                checked |= 1 << idx;
+                mask |= 1 << uart[idx].pin;
+                pin[n_pins] = 1 << uart[idx].pin;
+                data[n_pins++] = dgr;
+            }
+        }
+
+        set_pins(port, mask, true);
+        if(dma_transfer(DMA_MEMORY_TO_PERIPH, (uint32_t)tx_wave, (uint32_t)&port->BSRR,
+                         tx_build_pins(data, pin, n_pins, sizeof(dgr)), 4, period_div_2 << 1)) {
+            set_pins(port, mask, false);
+            dma_buffer_invalidate(rx_samples, sizeof(rx_samples));
+            dma_transfer(DMA_PERIPH_TO_MEMORY, (uint32_t)&port->IDR, (uint32_t)rx_samples,
+                          RX_WINDOW_BITS * RX_OVERSAMPLE, 2, (period_div_2 << 1) / RX_OVERSAMPLE);
+            dma_buffer_invalidate(rx_samples, sizeof(rx_samples));
+        }
+        set_pins(port, mask, true);
+
+        for(idx = motor; idx < TMC_N_MOTORS_MAX; idx++) {
+            if((checked & (1 << idx)) && uart[idx].port == port) {
+                if(!(rx_decode_pin(1 << uart[idx].pin, reply, sizeof(reply)) && reply[7] == tmc_crc(reply, 7) &&
+                      reply[6] == (uint8_t)(batch.ifcnt[idx] + batch.sent[idx])))
+                    failed |= 1 << idx;
+            }
+        }
+    }
+
+    sync_release();
+
+    return failed;
+}
+
+static void batch_end (void)
+{
+    static char msg[48];
+
+    uint32_t failed;
+
+    batch.active = false;
+    batch.done = true;
+
+    batch_flush();
+
+    if((failed = batch_verify())) {
+
+        uint_fast8_t motor, len = snprintf(msg, sizeof(msg), "TMC UART: writes lost, motor");
+
+        for(motor = 0; motor < TMC_N_MOTORS_MAX && len < sizeof(msg) - 3; motor++) {
+            if(failed & (1 << motor))
+                len += snprintf(msg + len, sizeof(msg) - len, " %d", motor);
+        }
+
+        protocol_enqueue_foreground_task(report_warning, msg);
+    }
+}
+
+static void batch_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(batch.active)
+        batch_end();
+}
+
+// Posts a write, returns false when not batching.
+static bool batch_post (trinamic_motor_t driver, TMC_uart_write_datagram_t *dgr)
+{
+    if(!batch.active || driver.id >= TMC_N_MOTORS_MAX || uart[driver.id].port == NULL)
+        return false;
+
+    if(batch.n == TMC_UART_BATCH_SIZE)
+        batch_flush();
+
+    batch.write[batch.n].motor = driver.id;
+    memcpy(batch.write[batch.n++].data, dgr->data, sizeof(batch.write[0].data));
+
+    return true;
+}
+
+// Keeps the count of an IFCNT read.
+static inline void batch_read_done (uint8_t motor, const uint8_t request[], const uint8_t reply[], bool ok)
+{
+    if(batch.active && motor < TMC_N_MOTORS_MAX && (request[2] & ~TMC_UART_WRITE) == TMC2209_REG_IFCNT) {
+        batch.ifcnt_valid[motor] = ok;
+        batch.ifcnt[motor] = reply[6];
+        batch.sent[motor] = 0;
+    }
+}
+
+#endif // TMC_UART_BATCH
+
+#if TMC_UART_SHADOW
+
+/*
+  Shadow copies of the configuration registers. Writes to GCONF, IHOLD_IRUN, CHOPCONF and PWMCONF
+  are kept per motor and reads of them are answered from the copy without a bus round trip, the
+  first read of a readable register that has not been written yet goes to the driver and fills
+  the copy. IHOLD_IRUN is write only and is never filled from a read.
+  All copies of a motor are dropped when a GSTAT read reports a reset or a driver error, or when
+  an IFCNT read does not match the count of the last one plus the writes sent since.
+*/
+
+#define TMC2209_REG_GCONF       0x00
+#define TMC2209_REG_GSTAT       0x01
+#define TMC2209_REG_IHOLD_IRUN  0x10
+#define TMC2209_REG_CHOPCONF    0x6C
+#define TMC2209_REG_PWMCONF     0x70
+#ifndef TMC2209_REG_IFCNT
+#define TMC2209_REG_IFCNT       0x02
+#endif
+
+#define GSTAT_RESET_DRV_ERR     0x03
+
+typedef struct {
+    uint8_t valid;                  // bit per slot
+    bool ifcnt_valid;
+    uint8_t ifcnt;                  // last read
+    uint8_t sent;                   // writes sent since
+    uint32_t value[4];
+} tmc_uart_shadow_t;
+
+static tmc_uart_shadow_t shadow[TMC_N_MOTORS_MAX] = {0};
+
+// Returns the shadow slot of a register, -1 if not cached.
+static inline int_fast8_t shadow_slot (uint8_t reg)
+{
+    switch(reg & ~TMC_UART_WRITE) {
+        case TMC2209_REG_GCONF:      return 0;
+        case TMC2209_REG_IHOLD_IRUN: return 1;
+        case TMC2209_REG_CHOPCONF:   return 2;
+        case TMC2209_REG_PWMCONF:    return 3;
+        default:                     return -1;
+    }
+}
+
+// Keeps a written value, may be called from interrupt context.
+static void shadow_write (uint8_t motor, uint8_t reg, uint32_t value)
+{
+    int_fast8_t slot;
+
+    if(motor >= TMC_N_MOTORS_MAX)
+        return;
+
+    __disable_irq();
+    shadow[motor].sent++;
+    if((slot = shadow_slot(reg)) >= 0) {
+        shadow[motor].value[slot] = value;
+        shadow[motor].valid |= 1 << slot;
+    }
+    __enable_irq();
+}
+
+// Builds the reply to a read of a cached register, returns false if not cached.
+static bool shadow_read (uint8_t motor, const uint8_t request[], uint8_t reply[])
+{
+    bool ok;
+    uint32_t value = 0;
+    int_fast8_t slot = shadow_slot(request[2]);
+
+    if(motor >= TMC_N_MOTORS_MAX || slot < 0)
+        return false;
+
+    __disable_irq();
+    if((ok = !!(shadow[motor].valid & (1 << slot))))
+        value = shadow[motor].value[slot];
+    __enable_irq();
+
+    if(ok) {
+        reply[0] = TMC_UART_SYNC;
+        reply[1] = 0xFF;                            // master address
+        reply[2] = request[2];
+        reply[3] = value >> 24;
+        reply[4] = value >> 16;
+        reply[5] = value >> 8;
+        reply[6] = value;
+        reply[7] = tmc_crc(reply, 7);
+    }
+
+    return ok;
+}
+
+// Fills the copy from a register read from the driver and checks the reset and interface counters.
+static void shadow_read_done (uint8_t motor, uint8_t reg, uint32_t value)
+{
+    int_fast8_t slot;
+    tmc_uart_shadow_t *s;
+
+    if(motor >= TMC_N_MOTORS_MAX)
+        return;
+
+    s = &shadow[motor];
+
+    __disable_irq();
+
+    switch(reg) {
+
+        case TMC2209_REG_GSTAT:
+            if(value & GSTAT_RESET_DRV_ERR)
+                s->valid = 0;
+            break;
+
+        case TMC2209_REG_IFCNT:
+            if(s->ifcnt_valid && (uint8_t)value != (uint8_t)(s->ifcnt + s->sent))
+                s->valid = 0;
+            s->ifcnt_valid = true;
+            s->ifcnt = (uint8_t)value;
+            s->sent = 0;
+            break;
+
+        case TMC2209_REG_IHOLD_IRUN:
+            break;
+
+        default:
+            if((slot = shadow_slot(reg)) >= 0) {
+                s->value[slot] = value;
+                s->valid |= 1 << slot;
+            }
+            break;
+    }
+
+    __enable_irq();
+}
+
+bool tmc_uart_shadow_get (uint8_t motor, uint8_t reg, uint32_t *value)
+{
+    bool ok;
+    int_fast8_t slot = shadow_slot(reg);
+
+    if(motor >= TMC_N_MOTORS_MAX || slot < 0)
+        return false;
+
+    __disable_irq();
+    if((ok = !!(shadow[motor].valid & (1 << slot))))
+        *value = shadow[motor].value[slot];
+    __enable_irq();
+
+    return ok;
+}
+
+#endif // TMC_UART_SHADOW
+
+TMC_uart_write_datagram_t *tmc_uart_read (trinamic_motor_t driver, TMC_uart_read_datagram_t *rdgr)
+{
+    static TMC_uart_write_datagram_t wdgr = {0};
+    static TMC_uart_write_datagram_t bad = {0};
+
+    bool ok;
+
+#if TMC_UART_SHADOW
+    if(shadow_read(driver.id, rdgr->data, wdgr.data))
+        return &wdgr;
+#endif
+
+#if TMC_UART_BATCH
+    batch_flush();
+#endif
+
+    if(!sync_claim())
+        return &bad;
+
+    active_uart = &uart[driver.id];
+
+    tx_start(tx_build(rdgr->data, sizeof(TMC_uart_read_datagram_t)), false); // send read request
+    if((ok = HAL_DMA_PollForTransfer(&tmc_dma, HAL_DMA_FULL_TRANSFER, TMC_UART_DMA_TIMEOUT) == HAL_OK)) {
+        dma_stop();
+        setRX();
+        dma_buffer_invalidate(rx_samples, sizeof(rx_samples));
+        ok = dma_transfer(DMA_PERIPH_TO_MEMORY, (uint32_t)&active_uart->port->IDR, (uint32_t)rx_samples,
+                           RX_WINDOW_BITS * RX_OVERSAMPLE, 2, (period_div_2 << 1) / RX_OVERSAMPLE);
+    } else {
+        dma_stop();
+        HAL_DMA_Abort(&tmc_dma);
+    }
+
+    ok = ok && rx_decode(wdgr.data, sizeof(TMC_uart_write_datagram_t));
+
+    if(!ok)
+        setTX();
+
+#if TMC_UART_BATCH
+    batch_read_done(driver.id, rdgr->data, wdgr.data, ok);
+#endif
+
+#if TMC_UART_SHADOW
+    if(ok && wdgr.data[0] == TMC_UART_SYNC && wdgr.data[1] == 0xFF && wdgr.data[2] == rdgr->data[2] && wdgr.data[7] == tmc_crc(wdgr.data, 7))
+        shadow_read_done(driver.id, wdgr.data[2], (wdgr.data[3] << 24) | (wdgr.data[4] << 16) | (wdgr.data[5] << 8) | wdgr.data[6]);
+#endif
+
+    sync_release();
+
+    return ok ? &wdgr : &bad;
+}
+
+void tmc_uart_write (trinamic_motor_t driver, TMC_uart_write_datagram_t *dgr)
+{
+#if TMC_UART_SHADOW
+    shadow_write(driver.id, dgr->data[2], (dgr->data[3] << 24) | (dgr->data[4] << 16) | (dgr->data[5] << 8) | dgr->data[6]);
+#endif
+
+#if TMC_UART_BATCH
+    if(batch_post(driver, dgr))
+        return;
+#endif
+
+    if(!sync_claim())
+        return;
+
+    active_uart = &uart[driver.id];
+
+    setTX();
+    dma_transfer(DMA_MEMORY_TO_PERIPH, (uint32_t)tx_wave, (uint32_t)&active_uart->port->BSRR,
+                  tx_build(dgr->data, sizeof(TMC_uart_write_datagram_t)), 4, period_div_2 << 1);
+
+    sync_release();
+}
+
+// Bit timing is generated by DMA and is not affected by interrupt load from other buses.
+bool tmc_uart_busy (void)
+{
+    return false;
+}
+
+#else
+
 /**
   * @brief Software Serial send byte
   * @param None
@@ -224,6 +1063,7 @@ TMC_uart_write_datagram_t *tmc_uart_read (trinamic_motor_t driver, TMC_uart_read
 
     // Remember the port and pin we are using
     active_uart = &uart[driver.id];
+    xfer_active = true;
 
     // claim the semaphore or wait until free
     //
@@ -244,6 +1084,7 @@ TMC_uart_write_datagram_t *tmc_uart_read (trinamic_motor_t driver, TMC_uart_read
         if (hal.get_elapsed_ticks() - ms > ABORT_TIMEOUT) {
             hal.delay_ms(TWELVE_BIT_TIMES + 1, NULL);
             setTX();                // turn on our driver
+            xfer_active = false;
             return &bad;            // return {0}
         }
     }
@@ -267,6 +1108,7 @@ TMC_uart_write_datagram_t *tmc_uart_read (trinamic_motor_t driver, TMC_uart_read
             TMC_UART_TIMER->CR1 |= TIM_CR1_UDIS;        // turn off interrupts
             hal.delay_ms(TWELVE_BIT_TIMES + 1, NULL);
             setTX();                                    // turn on our driver
+            xfer_active = false;
             return &bad;
         }
 
@@ -279,6 +1121,8 @@ TMC_uart_write_datagram_t *tmc_uart_read (trinamic_motor_t driver, TMC_uart_read
 
     stop_listening();
 
+    xfer_active = false;
+
     return &wdgr;
 }
 
@@ -286,10 +1130,23 @@ void tmc_uart_write (trinamic_motor_t driver, TMC_uart_write_datagram_t *dgr)
 {
     // Remember the port and pin we are using
     active_uart = &uart[driver.id];
+    xfer_active = true;
 
     write_n(dgr->data, sizeof(TMC_uart_write_datagram_t));
+
+    xfer_active = false;
 }
 
+// Returns true while a datagram is being bit-banged.
+// Interrupt driven users of other buses should hold off while this is true
+// as their interrupt load will corrupt the soft UART bit timing.
+bool tmc_uart_busy (void)
+{
+    return xfer_active;
+}
+
+#endif // TMC_UART_DMA
+
 static void add_uart_pin (xbar_t *gpio, void *data)
 {
     if (gpio->group == PinGroup_MotorUART)
@@ -347,6 +1204,16 @@ static void if_init (uint8_t motors, axes_signals_t enabled)
         timer_clock_freq = HAL_RCC_GetPCLK1Freq() * (clock.APB1CLKDivider == 0 ? 1 : 2);
 
         TMC_UART_CLKENA();
+#if TMC_UART_DMA
+        __HAL_RCC_DMA1_CLK_ENABLE();
+
+        TMC_UART_TIMER->CR1 = 0;
+        TMC_UART_TIMER->PSC = 0;
+        period_div_2 = (timer_clock_freq / SWS_BAUDRATE) >> 1;          // bit period is set per transfer
+
+        HAL_NVIC_SetPriority(TMC_UART_DMA_IRQ, IRQ_PRIO_TMC, 0);
+        HAL_NVIC_EnableIRQ(TMC_UART_DMA_IRQ);
+#else
         TMC_UART_TIMER->CR1 &= ~TIM_CR1_CEN;
         TMC_UART_TIMER->SR &= ~TIM_SR_UIF;
         TMC_UART_TIMER->CNT = 0;
@@ -356,11 +1223,16 @@ static void if_init (uint8_t motors, axes_signals_t enabled)
 
         period_div_2 = TMC_UART_TIMER->ARR >> 1;                        // save this for use by receive
 
-        HAL_NVIC_SetPriority(TMC_UART_IRQn, 0, 0);
+        HAL_NVIC_SetPriority(TMC_UART_IRQn, IRQ_PRIO_TMC, 0);
         HAL_NVIC_EnableIRQ(TMC_UART_IRQn);
+#endif
 
         hal.enumerate_pins(true, add_uart_pin, NULL);
     }
+
+#if TMC_UART_BATCH
+    batch.active = !batch.done;
+#endif
 }
 
 void driver_preinit (motor_map_t motor, trinamic_driver_config_t *config)
@@ -384,8 +1256,15 @@ void tmc_uart_init (void)
     };
 
     trinamic_if_init(&driver_if);
+
+#if TMC_UART_BATCH
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = batch_execute_realtime;
+#endif
 }
 
+#if !TMC_UART_DMA
+
 void TMC_UART_IRQHandler (void)
 {
     TMC_UART_TIMER->SR = ~TIM_SR_UIF; // clear UIF flag
@@ -401,4 +1280,6 @@ void TMC_UART_IRQHandler (void)
     }
 }
 
+#endif // !TMC_UART_DMA
+
 #endif // TRINAMIC_UART_ENABLE
@@ -0,0 +1,126 @@
+/*
+  trace.c - binary event trace over ITM stimulus ports or an RTT channel
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  TRACE(id, payload) records hot path events with a 32-bit payload, for timing analysis with
+  host tools instead of printf output that changes the timing. The event IDs are in trace.h.
+
+  TRACE_BACKEND 1 (ITM/SWO): each event is a single 32-bit write to stimulus port 8 + id, the
+  host decodes the port number as the ID. Timestamps are the ITM local timestamps, enabled by
+  the debugger together with the ports 8..8 + TraceEvent_N - 1.
+
+  TRACE_BACKEND 2 (RTT): each event is a 12 byte record on RTT up channel TRACE_RTT_CHANNEL,
+  little endian { DWT->CYCCNT, id, payload }, in a TRACE_RTT_BUFFER_SIZE buffer that drops
+  records when full. Expects the Segger RTT sources in the project, as with DEBUGOUT_BACKEND 2.
+
+  Events that cannot be written are counted, $TRACE reports:
+
+  [TRACE|backend=,events=,dropped=]
+*/
+
+#include "driver.h"
+
+#if TRACE_ENABLE
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+
+#include "trace.h"
+
+#if TRACE_BACKEND == 2
+
+#include "SEGGER_RTT.h"
+
+#ifndef TRACE_RTT_CHANNEL
+#define TRACE_RTT_CHANNEL 1
+#endif
+#ifndef TRACE_RTT_BUFFER_SIZE
+#define TRACE_RTT_BUFFER_SIZE 4096
+#endif
+
+typedef struct {
+    uint32_t cycles;
+    uint32_t id;
+    uint32_t payload;
+} trace_record_t;
+
+static uint8_t rtt_buffer[TRACE_RTT_BUFFER_SIZE];
+
+uint32_t trace_dropped = 0;
+
+void trace_event (trace_event_t id, uint32_t payload)
+{
+    trace_record_t record = {
+        .cycles = DWT->CYCCNT,
+        .id = id,
+        .payload = payload
+    };
+
+#if CRASH_DUMP_ENABLE
+    crash_dump_trace(id, payload);
+#endif
+
+    if(SEGGER_RTT_Write(TRACE_RTT_CHANNEL, &record, sizeof(record)) != sizeof(record))
+        trace_dropped++;
+}
+
+#else
+
+uint32_t trace_dropped = 0;
+
+#endif // TRACE_BACKEND
+
+static status_code_t trace_report (sys_state_t state, char *args)
+{
+    char buf[60];
+
+    if(args && !(args[0] == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    snprintf(buf, sizeof(buf), "[TRACE|backend=%s,events=%d,dropped=%lu]" ASCII_EOL,
+              TRACE_BACKEND == 1 ? "ITM" : "RTT", (int)TraceEvent_N, trace_dropped);
+    hal.stream.write(buf);
+
+    if(args)
+        trace_dropped = 0;
+
+    return Status_OK;
+}
+
+void trace_init (void)
+{
+    static const sys_command_t trace_command_list[] = {
+        {"TRACE", trace_report, {}, { .str = "report the event trace backend and dropped events, $TRACE=R to clear" } }
+    };
+
+    static sys_commands_t trace_commands = {
+        .n_commands = sizeof(trace_command_list) / sizeof(sys_command_t),
+        .commands = trace_command_list
+    };
+
+#if TRACE_BACKEND == 2
+    SEGGER_RTT_ConfigUpBuffer(TRACE_RTT_CHANNEL, "Trace", rtt_buffer, sizeof(rtt_buffer), SEGGER_RTT_MODE_NO_BLOCK_SKIP);
+#endif
+
+    system_register_commands(&trace_commands);
+}
+
+#endif // TRACE_ENABLE
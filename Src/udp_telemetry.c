@@ -0,0 +1,225 @@
+/*
+  udp_telemetry.c - periodic binary UDP broadcast of motion and EDM state
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  $UDPTLM=<hz>
+
+    Sets the broadcast rate, 0 (off) or 100 - 1000 Hz. $UDPTLM reports the rate and packet counts:
+
+    [UDPTLM|hz=,port=,packets=,dropped=]
+
+  Packets (udp_telemetry_packet_t, little-endian, no padding) go to the subnet broadcast address on
+  UDP_TELEMETRY_PORT, so any number of stations can listen without adding load per station. They
+  are sent from the realtime loop, late packets are skipped rather than sent in a burst; seq and
+  t_us let receivers detect gaps. Position is the machine position in mm from sys.position.
+
+  Packets are allocated from the lwIP heap (PBUF_RAM), which is in the DMA accessible non-cached
+  region, so the Ethernet TX DMA can send them without a copy. dropped counts allocation or send
+  failures.
+*/
+
+#include "driver.h"
+
+#if UDP_TELEMETRY_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/udp.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "udp_telemetry.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef UDP_TELEMETRY_HZ
+#define UDP_TELEMETRY_HZ 0      // rate at boot, 0: off
+#endif
+
+#if UDP_TELEMETRY_HZ && (UDP_TELEMETRY_HZ < 100 || UDP_TELEMETRY_HZ > 1000)
+#error "UDP_TELEMETRY_HZ must be 0 or within 100..1000."
+#endif
+
+#define TLM_MAGIC   0x4D4C5453  // "STLM"
+#define TLM_VERSION 1
+
+typedef struct __attribute__((packed)) {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;              // of the whole packet
+    uint32_t seq;
+    uint32_t t_us;              // send time, lower 32 bits of hal.get_micros()
+    uint16_t state;             // sys_state_t bits (STATE_IDLE etc.)
+    uint8_t n_axis;
+    uint8_t flags;              // TLM_FLAG_*
+    float position[N_AXIS];     // machine position, mm
+    // EDM, zero if EDM_ENABLE is off
+    uint32_t edm_t_us;          // PULSER sample time
+    uint8_t r_pulse;            // ratios of the last sample, 0 - 255
+    uint8_t r_short;
+    uint8_t r_open;
+    uint8_t reserved;
+    uint32_t servo_period_q16;  // 65536: programmed feed rate
+    uint32_t pulses;
+    uint32_t shorts;
+    uint32_t retracts;
+} udp_telemetry_packet_t;
+
+#define TLM_FLAG_ENERGIZED  0x01
+#define TLM_FLAG_RETRACTING 0x02
+
+typedef struct {
+    struct udp_pcb *pcb;
+    uint32_t period_us;         // 0: off
+    uint64_t next_us;
+    uint32_t seq;
+    uint32_t dropped;
+} udp_telemetry_t;
+
+static udp_telemetry_t tlm = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void telemetry_fill (udp_telemetry_packet_t *pkt, uint64_t now_us)
+{
+    uint_fast8_t idx;
+
+    memset(pkt, 0, sizeof(udp_telemetry_packet_t));
+
+    pkt->magic = TLM_MAGIC;
+    pkt->version = TLM_VERSION;
+    pkt->size = sizeof(udp_telemetry_packet_t);
+    pkt->seq = tlm.seq++;
+    pkt->t_us = (uint32_t)now_us;
+    pkt->state = (uint16_t)state_get();
+    pkt->n_axis = N_AXIS;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        pkt->position[idx] = (float)sys.position[idx] / settings.axis[idx].steps_per_mm;
+
+#if EDM_ENABLE
+    edm_telemetry_t edm;
+
+    edm_get_telemetry(&edm);
+    pkt->flags = (edm.energized ? TLM_FLAG_ENERGIZED : 0) | (edm.retracting ? TLM_FLAG_RETRACTING : 0);
+    pkt->edm_t_us = edm.t_us;
+    pkt->r_pulse = edm.r_pulse;
+    pkt->r_short = edm.r_short;
+    pkt->r_open = edm.r_open;
+    pkt->servo_period_q16 = edm.servo_period_q16;
+    pkt->pulses = edm.pulses;
+    pkt->shorts = edm.shorts;
+    pkt->retracts = edm.retracts;
+#endif
+}
+
+static void telemetry_send (uint64_t now_us)
+{
+    struct pbuf *p;
+
+    if((p = pbuf_alloc(PBUF_TRANSPORT, sizeof(udp_telemetry_packet_t), PBUF_RAM)) == NULL) {
+        tlm.dropped++;
+        return;
+    }
+
+    telemetry_fill((udp_telemetry_packet_t *)p->payload, now_us);
+
+    if(udp_sendto(tlm.pcb, p, IP_ADDR_BROADCAST, UDP_TELEMETRY_PORT) != ERR_OK)
+        tlm.dropped++;
+
+    pbuf_free(p);
+}
+
+static void telemetry_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(tlm.period_us) {
+
+        uint64_t now_us = hal.get_micros();
+
+        if(now_us >= tlm.next_us) {
+            // Keep the phase, skip periods missed while the loop was blocked.
+            tlm.next_us += tlm.period_us;
+            if(tlm.next_us <= now_us)
+                tlm.next_us = now_us + tlm.period_us;
+            telemetry_send(now_us);
+        }
+    }
+}
+
+static void telemetry_set_rate (uint32_t hz)
+{
+    tlm.period_us = hz ? 1000000 / hz : 0;
+    tlm.next_us = hal.get_micros();
+}
+
+static status_code_t telemetry_command (sys_state_t state, char *args)
+{
+    char buf[64];
+
+    if(args) {
+        char *end;
+        uint32_t hz = strtoul(args, &end, 10);
+
+        if(*end != '\0' || (hz && (hz < 100 || hz > 1000)))
+            return Status_BadNumberFormat;
+
+        telemetry_set_rate(hz);
+    }
+
+    snprintf(buf, sizeof(buf), "[UDPTLM|hz=%lu,port=%u,packets=%lu,dropped=%lu]" ASCII_EOL,
+              tlm.period_us ? 1000000 / tlm.period_us : 0, UDP_TELEMETRY_PORT, tlm.seq, tlm.dropped);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+bool udp_telemetry_init (void)
+{
+    static const sys_command_t telemetry_command_list[] = {
+        {"UDPTLM", telemetry_command, {}, { .str = "UDP telemetry broadcast rate, $UDPTLM=<0 or 100-1000 Hz>" } }
+    };
+
+    static sys_commands_t telemetry_commands = {
+        .n_commands = sizeof(telemetry_command_list) / sizeof(sys_command_t),
+        .commands = telemetry_command_list
+    };
+
+    if(tlm.pcb || (tlm.pcb = udp_new()) == NULL)
+        return false;
+
+    ip_set_option(tlm.pcb, SOF_BROADCAST);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = telemetry_execute_realtime;
+
+    system_register_commands(&telemetry_commands);
+
+    telemetry_set_rate(UDP_TELEMETRY_HZ);
+
+    return true;
+}
+
+#endif // UDP_TELEMETRY_ENABLE
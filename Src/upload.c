@@ -0,0 +1,398 @@
+/*
+  upload.c - block transfer upload of files over the active stream
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  $UPLOAD=<file>,<size>[,<crc>]
+
+    Receives a file with a windowed block protocol over the stream the command came from and
+    writes it to the mounted filesystem (SD card or littlefs, the latter through the queued
+    flash writes with SPIFLASH_ASYNC). <size> is the file size in bytes, <crc> the optional
+    CRC-32 of the whole file in hex. The command reports the block size and the number of
+    blocks the host may send ahead without waiting for an acknowledgment, sized so that they
+    fit the stream input buffer:
+
+    [UPLOAD|block=,window=]
+
+    After the ok the host sends blocks, the sequence number starting at 0 and incrementing by
+    one, all values little endian:
+
+    SOH (0x01), seq (2 bytes), len (2 bytes, 1..block), data (len bytes), crc (4 bytes)
+
+    crc is the CRC-32 of seq, len and data. Each block is answered in order with [UPLOAD|ack=<seq>].
+    A block with a bad CRC or out of sequence is answered once with [UPLOAD|nak=<seq>], <seq>
+    being the next expected block, following blocks are dropped until that block arrives again:
+    the host then resends from <seq> (go-back-N). Duplicates of already acknowledged blocks are
+    dropped silently.
+
+    EOT (0x04) between blocks ends the transfer, the file is closed and checked against <size>
+    and <crc>. CAN (0x18) between blocks, a reset or UPLOAD_TIMEOUT_MS without input abort it.
+    A failed or aborted upload deletes the file. The result:
+
+    [UPLOAD|file=,bytes=,crc=,us=,naks=]
+
+    Realtime commands are not acted upon from the stream while the upload runs, all bytes are
+    data.
+
+  $FWUPDATE=<size>,<crc>
+
+    Same protocol, the image is programmed into the inactive flash bank instead of a file and
+    verified against <crc>, see fw_update.c (FW_UPDATE_ENABLE).
+*/
+
+#include "driver.h"
+
+#if UPLOAD_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/vfs.h"
+#include "grbl/system.h"
+#include "grbl/report.h"
+#include "grbl/state_machine.h"
+
+#include "crc32.h"
+#include "upload.h"
+#include "fw_update.h"
+#include "macro_cache.h"
+
+#ifndef UPLOAD_BLOCK_SIZE
+#define UPLOAD_BLOCK_SIZE 1024      // max data bytes per block
+#endif
+#ifndef UPLOAD_TIMEOUT_MS
+#define UPLOAD_TIMEOUT_MS 5000
+#endif
+
+#define UPLOAD_SOH 0x01
+#define UPLOAD_EOT 0x04
+#define UPLOAD_CAN 0x18
+#define UPLOAD_HDR_SIZE 5           // SOH, seq, len
+#define UPLOAD_FRAME_SIZE(len) (UPLOAD_HDR_SIZE + (len) + 4)
+
+typedef struct {
+    bool active;
+    bool nak_sent;
+    bool firmware;                  // image to the inactive flash bank instead of a file
+    vfs_file_t *file;
+    char name[32];
+    uint32_t size;
+    uint32_t crc;
+    bool check_crc;
+    uint32_t file_crc;
+    uint32_t bytes;
+    uint32_t naks;
+    uint16_t block;
+    uint16_t seq;                   // next expected
+    uint16_t pos;                   // in frame
+    uint16_t len;
+    uint32_t t_start;
+    uint32_t rx_ms;                 // last input
+    stream_read_ptr read;           // of the stream the upload came from
+    enqueue_realtime_command_ptr enqueue_rt;
+    uint8_t frame[UPLOAD_FRAME_SIZE(UPLOAD_BLOCK_SIZE)] __ALIGNED(4);
+} upload_t;
+
+static upload_t upload = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+static on_reset_ptr on_reset;
+
+static int16_t upload_stream_read (void)
+{
+    return SERIAL_NO_DATA;
+}
+
+static bool upload_rt_passthru (char c)
+{
+    return false;
+}
+
+static void upload_reply (const char *key, uint16_t seq)
+{
+    char buf[24];
+
+    snprintf(buf, sizeof(buf), "[UPLOAD|%s=%u]" ASCII_EOL, key, seq);
+    hal.stream.write(buf);
+}
+
+static void upload_end (const char *msg, bool ok)
+{
+    char buf[110];
+
+    if(!upload.active)
+        return;
+
+    upload.active = false;
+    hal.stream.read = upload.read;
+    hal.stream.set_enqueue_rt_handler(upload.enqueue_rt);
+
+    if(!upload.firmware) {
+        vfs_close(upload.file);
+#if MACRO_CACHE_ENABLE
+        macro_cache_invalidate(upload.name);
+#endif
+    }
+
+    if(ok && upload.bytes != upload.size) {
+        ok = false;
+        msg = "UPLOAD: size mismatch";
+    }
+
+    if(ok && upload.check_crc && upload.file_crc != upload.crc) {
+        ok = false;
+        msg = "UPLOAD: CRC mismatch";
+    }
+
+#if FW_UPDATE_ENABLE
+    if(upload.firmware) {
+        const char *error = fw_update_end(ok, upload.crc);
+        if(ok && error) {
+            ok = false;
+            msg = error;
+        } else if(ok)
+            msg = "FWUPDATE: image staged, $FW=S to start it";
+    } else
+#endif
+    if(!ok)
+        vfs_unlink(upload.name);
+
+    snprintf(buf, sizeof(buf), "[UPLOAD|file=%s,bytes=%lu,crc=%08lX,us=%lu,naks=%lu]" ASCII_EOL,
+              upload.name, upload.bytes, upload.file_crc, hal.get_micros() - upload.t_start, upload.naks);
+    hal.stream.write(buf);
+
+    report_message(msg, ok ? Message_Plain : Message_Warning);
+}
+
+static bool upload_write (const uint8_t *data, uint16_t len)
+{
+#if FW_UPDATE_ENABLE
+    if(upload.firmware)
+        return fw_update_write(data, len);
+#endif
+
+    return vfs_write(data, 1, len, upload.file) == len;
+}
+
+static void upload_nak (void)
+{
+    if(!upload.nak_sent) {
+        upload.nak_sent = true;
+        upload.naks++;
+        upload_reply("nak", upload.seq);
+    }
+}
+
+static void upload_block (void)
+{
+    uint16_t seq = upload.frame[1] | (upload.frame[2] << 8);
+    uint32_t crc = upload.frame[UPLOAD_HDR_SIZE + upload.len] |
+                    (upload.frame[UPLOAD_HDR_SIZE + upload.len + 1] << 8) |
+                     (upload.frame[UPLOAD_HDR_SIZE + upload.len + 2] << 16) |
+                      ((uint32_t)upload.frame[UPLOAD_HDR_SIZE + upload.len + 3] << 24);
+
+    if(crc != crc32_calc(&upload.frame[1], UPLOAD_HDR_SIZE - 1 + upload.len)) {
+        upload_nak();
+        return;
+    }
+
+    if(seq != upload.seq) {
+        if((int16_t)(seq - upload.seq) > 0)     // a block was lost
+            upload_nak();
+        return;
+    }
+
+    if(upload.bytes + upload.len > upload.size) {
+        upload_end("UPLOAD: size exceeded", false);
+        return;
+    }
+
+    if(!upload_write(&upload.frame[UPLOAD_HDR_SIZE], upload.len)) {
+        upload_end("UPLOAD: write error", false);
+        return;
+    }
+
+    upload.file_crc = crc32_update(upload.file_crc, &upload.frame[UPLOAD_HDR_SIZE], upload.len);
+    upload.bytes += upload.len;
+    upload.nak_sent = false;
+    upload_reply("ack", upload.seq++);
+}
+
+static void upload_input (uint8_t c)
+{
+    if(upload.pos == 0) {
+        switch(c) {
+
+            case UPLOAD_SOH:
+                break;
+
+            case UPLOAD_EOT:
+                upload_end("UPLOAD: done", true);
+                return;
+
+            case UPLOAD_CAN:
+                upload_end("UPLOAD: aborted", false);
+                return;
+
+            default:                // noise between blocks
+                return;
+        }
+    }
+
+    upload.frame[upload.pos++] = c;
+
+    if(upload.pos == UPLOAD_HDR_SIZE) {
+        upload.len = upload.frame[3] | (upload.frame[4] << 8);
+        if(upload.len == 0 || upload.len > upload.block) {
+            upload.pos = 0;         // not a header, resync on the next SOH
+            upload_nak();
+        }
+    } else if(upload.pos == UPLOAD_FRAME_SIZE(upload.len)) {
+        upload.pos = 0;
+        upload_block();
+    }
+}
+
+static void upload_execute_realtime (sys_state_t state)
+{
+    int16_t c;
+
+    on_execute_realtime(state);
+
+    if(!upload.active)
+        return;
+
+    while(upload.active && (c = upload.read()) != SERIAL_NO_DATA) {
+        upload.rx_ms = hal.get_elapsed_ticks();
+        upload_input((uint8_t)c);
+    }
+
+    if(upload.active && hal.get_elapsed_ticks() - upload.rx_ms >= UPLOAD_TIMEOUT_MS)
+        upload_end("UPLOAD: timeout", false);
+}
+
+static void upload_reset (void)
+{
+    upload_end("UPLOAD: aborted", false);
+
+    if(on_reset)
+        on_reset();
+}
+
+// param: <size>[,<crc>]
+static status_code_t upload_open (const char *name, char *param, bool firmware)
+{
+    char buf[40];
+    uint16_t free;
+
+    if(state_get() != STATE_IDLE)
+        return Status_IdleError;
+
+    if(upload.active || hal.stream.set_enqueue_rt_handler == NULL)
+        return Status_InvalidStatement;
+
+    upload.size = strtoul(param, &param, 10);
+    if((upload.check_crc = *param == ','))
+        upload.crc = strtoul(param + 1, &param, 16);
+    if(*param != '\0' || *name == '\0' || strlen(name) >= sizeof(upload.name) || (firmware && !upload.check_crc))
+        return Status_BadNumberFormat;
+
+    // Blocks in flight have to fit the input buffer, which is empty but for the command line tail.
+    if((free = hal.stream.get_rx_buffer_free()) < UPLOAD_FRAME_SIZE(16))
+        return Status_InvalidStatement;
+
+    upload.block = UPLOAD_BLOCK_SIZE;
+    if(UPLOAD_FRAME_SIZE(upload.block) > free)
+        upload.block = free - UPLOAD_FRAME_SIZE(0);
+
+#if FW_UPDATE_ENABLE
+    if(firmware) {
+        if(!fw_update_begin(upload.size))
+            return Status_InvalidStatement;
+    } else
+#endif
+    if((upload.file = vfs_open(name, "w")) == NULL)
+        return Status_SDReadError;
+
+    upload.firmware = firmware;
+    strcpy(upload.name, name);
+    upload.bytes = upload.naks = upload.file_crc = 0;
+    upload.seq = upload.pos = 0;
+    upload.nak_sent = false;
+    upload.t_start = hal.get_micros();
+    upload.rx_ms = hal.get_elapsed_ticks();
+    upload.read = hal.stream.read;
+    upload.enqueue_rt = hal.stream.set_enqueue_rt_handler(upload_rt_passthru);
+    hal.stream.read = upload_stream_read;
+    upload.active = true;
+
+    snprintf(buf, sizeof(buf), "[UPLOAD|block=%u,window=%u]" ASCII_EOL, upload.block, free / UPLOAD_FRAME_SIZE(upload.block));
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+static status_code_t upload_start (sys_state_t state, char *args)
+{
+    char *param;
+
+    if(args == NULL || (param = strchr(args, ',')) == NULL)
+        return Status_InvalidStatement;
+
+    *param++ = '\0';
+
+    return upload_open(args, param, false);
+}
+
+#if FW_UPDATE_ENABLE
+
+static status_code_t fw_upload_start (sys_state_t state, char *args)
+{
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    return upload_open("firmware", args, true);
+}
+
+#endif
+
+void upload_init (void)
+{
+    static const sys_command_t upload_command_list[] = {
+        {"UPLOAD", upload_start, {}, { .str = "receive $UPLOAD=<file>,<size>[,<crc>] in CRC checked blocks" } },
+#if FW_UPDATE_ENABLE
+        {"FWUPDATE", fw_upload_start, {}, { .str = "receive $FWUPDATE=<size>,<crc> into the inactive flash bank" } }
+#endif
+    };
+
+    static sys_commands_t upload_commands = {
+        .n_commands = sizeof(upload_command_list) / sizeof(sys_command_t),
+        .commands = upload_command_list
+    };
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = upload_execute_realtime;
+
+    on_reset = grbl.on_reset;
+    grbl.on_reset = upload_reset;
+
+    system_register_commands(&upload_commands);
+}
+
+#endif // UPLOAD_ENABLE
@@ -0,0 +1,589 @@
+/*
+  usb_bulk.c - vendor bulk IN interface next to the USB CDC for binary telemetry
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The USB device becomes a composite of the CDC ACM function (interfaces 0 and 1, the G-code
+  stream), grouped by an interface association descriptor, and a vendor specific interface 2 with
+  a single bulk IN endpoint (0x83). Telemetry has its own endpoint, Tx FIFO and host pipe: it never
+  takes space in the stream transmit buffer and neither waits for nor holds up CDC flow control.
+  The class is USBD_CDC wrapped, the CDC code itself is unchanged. Hosts do not bind a driver to
+  class 0xFF, read it with libusb (WinUSB on Windows, e.g. installed by Zadig).
+
+  Data is a byte stream of frames, all little-endian and packed, as the ws_telemetry.c frames:
+
+    type 1, samples:  u8 type, u8 n, u16 sample_size, u32 seq, n * usb_sample_t
+    type 2, EDM log:  u8 type, u8 n, u16 entry_size, u32 seq, n * EDM_LOG_ENTRY_SIZE bytes
+                      (entry format as [EDMS|...], seq is the log entry number)
+
+  Frames are queued whole in a USB_BULK_BUFFER_SIZE ring or dropped and counted when it is full
+  (no host reading), so the stream always starts on a frame boundary and seq shows gaps. The ring
+  is sent in transfers as large as its contiguous part, chained from the endpoint interrupt, with
+  a ZLP when the data ends on a packet boundary.
+
+  $USBTLM[=<hz>] sets the sample rate, 0 (off) or 10 - 1000 Hz.
+  $USBLOG[=<0|1>] EDM log entries off/on, on starts with the retained log (a dump) and continues
+  with new entries. Both report [USBTLM|hz=,log=,host=,samples=,frames=,dropped=]
+
+  Build flag, USB_DEVICE(_H723) Target/App files do not include driver.h.
+*/
+
+#include "driver.h"
+
+#if USB_BULK_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "usbd_cdc.h"
+#include "usbd_ctlreq.h"
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "usb_bulk.h"
+#include "rt_sched.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifdef STM32H723xx
+#define usb_device hUsbDeviceHS
+#else
+#define usb_device hUsbDeviceFS
+#endif
+
+extern USBD_HandleTypeDef usb_device;
+
+#ifndef USB_BULK_HZ
+#define USB_BULK_HZ 0               // rate at boot, 0: off
+#endif
+#ifndef USB_BULK_BATCH
+#define USB_BULK_BATCH 20           // samples per frame
+#endif
+#ifndef USB_BULK_FLUSH_MS
+#define USB_BULK_FLUSH_MS 50
+#endif
+#ifndef USB_BULK_LOG_ENTRIES
+#define USB_BULK_LOG_ENTRIES 50     // per frame
+#endif
+
+#define BULK_ITF            0x02
+#define BULK_IN_EP          0x83
+#define BULK_FS_PACKET_SIZE 64
+#define BULK_HS_PACKET_SIZE 512
+#define BULK_CFG_DESC_SIZ   (USB_CDC_CONFIG_DESC_SIZ + 8 + 9 + 7)   // + IAD, interface, endpoint
+
+#define BUF_MASK (USB_BULK_BUFFER_SIZE - 1)
+
+#define TLM_TYPE_SAMPLES    1
+#define TLM_TYPE_LOG        2
+
+#define TLM_FLAG_ENERGIZED  0x01
+#define TLM_FLAG_RETRACTING 0x02
+
+typedef struct __attribute__((packed)) {
+    uint32_t t_us;              // lower 32 bits of hal.get_micros()
+    uint16_t state;             // sys_state_t bits (STATE_IDLE etc.)
+    uint8_t flags;              // TLM_FLAG_*
+    uint8_t r_pulse;            // EDM ratios of the last PULSER sample, 0 - 255
+    uint8_t r_short;
+    uint8_t r_open;
+    uint16_t reserved;
+    uint32_t servo_period_q16;  // 65536: programmed feed rate
+    uint32_t pulses;
+    uint32_t shorts;
+    uint32_t retracts;
+    float position[N_AXIS];     // machine position, mm
+} usb_sample_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t n;
+    uint16_t size;              // of a sample or entry
+    uint32_t seq;
+} usb_tlm_header_t;
+
+typedef struct {
+    uint32_t period_us;         // sample period, 0: off
+    uint64_t next_us;
+    uint32_t batch_ms;          // first sample of the batch taken
+    uint8_t batch_n;
+    bool log_on;
+    uint32_t log_seq;
+    uint32_t samples;
+    uint32_t frames;
+    uint32_t dropped;
+} usb_bulk_t;
+
+_Static_assert((USB_BULK_BUFFER_SIZE & BUF_MASK) == 0, "USB_BULK_BUFFER_SIZE must be a power of 2");
+
+static usb_bulk_t bulk = {0};
+static uint8_t tx_buf[USB_BULK_BUFFER_SIZE];
+static volatile uint32_t tx_head = 0, tx_tail = 0;   // free running, head written by the foreground only
+static volatile bool tx_busy = false;                // transfer or ZLP in progress
+static uint32_t tx_len = 0;                          // length of the transfer in progress
+static uint8_t batch_buf[sizeof(usb_tlm_header_t) + USB_BULK_BATCH * sizeof(usb_sample_t)];
+#if EDM_ENABLE
+static uint8_t log_buf[sizeof(usb_tlm_header_t) + USB_BULK_LOG_ENTRIES * EDM_LOG_ENTRY_SIZE];
+#endif
+__ALIGN_BEGIN static uint8_t cfg_desc_hs[BULK_CFG_DESC_SIZ] __ALIGN_END;
+__ALIGN_BEGIN static uint8_t cfg_desc_fs[BULK_CFG_DESC_SIZ] __ALIGN_END;
+__ALIGN_BEGIN static uint8_t cfg_desc_other[BULK_CFG_DESC_SIZ] __ALIGN_END;
+#if !RT_SCHED_ENABLE
+static on_execute_realtime_ptr on_execute_realtime;
+#endif
+
+/*
+ * USB class, USBD_CDC with the bulk interface added. Called from the USB interrupt.
+ */
+
+static inline uint16_t bulk_packet_size (USBD_HandleTypeDef *pdev)
+{
+    return pdev->dev_speed == USBD_SPEED_HIGH ? BULK_HS_PACKET_SIZE : BULK_FS_PACKET_SIZE;
+}
+
+// Starts a transfer of the contiguous part of the ring, clears tx_busy if empty.
+// From the endpoint interrupt, or from the foreground when not tx_busy.
+static void bulk_start (USBD_HandleTypeDef *pdev)
+{
+    uint32_t ofs = tx_tail & BUF_MASK, count = tx_head - tx_tail;
+
+    if(count > USB_BULK_BUFFER_SIZE - ofs)
+        count = USB_BULK_BUFFER_SIZE - ofs;
+
+    if((tx_len = count)) {
+        tx_busy = true;
+        USBD_LL_Transmit(pdev, BULK_IN_EP, &tx_buf[ofs], count);
+    } else
+        tx_busy = false;
+}
+
+static uint8_t bulk_init (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+    uint8_t ret = USBD_CDC.Init(pdev, cfgidx);
+
+    USBD_LL_OpenEP(pdev, BULK_IN_EP, USBD_EP_TYPE_BULK, bulk_packet_size(pdev));
+    pdev->ep_in[BULK_IN_EP & 0xFU].is_used = 1U;
+
+    // Frames queued before (re)configuration are stale.
+    tx_len = 0;
+    tx_tail = tx_head;
+    tx_busy = false;
+
+    return ret;
+}
+
+static uint8_t bulk_deinit (USBD_HandleTypeDef *pdev, uint8_t cfgidx)
+{
+    USBD_LL_CloseEP(pdev, BULK_IN_EP);
+    pdev->ep_in[BULK_IN_EP & 0xFU].is_used = 0U;
+    tx_busy = false;
+
+    return USBD_CDC.DeInit(pdev, cfgidx);
+}
+
+static uint8_t bulk_setup (USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
+{
+    // The vendor interface has no class or vendor requests, do not let the CDC code answer them.
+    if((req->bmRequest & USB_REQ_RECIPIENT_MASK) == USB_REQ_RECIPIENT_INTERFACE &&
+         LOBYTE(req->wIndex) == BULK_ITF && (req->bmRequest & USB_REQ_TYPE_MASK) != USB_REQ_TYPE_STANDARD) {
+        USBD_CtlError(pdev, req);
+        return (uint8_t)USBD_FAIL;
+    }
+
+    return USBD_CDC.Setup(pdev, req);
+}
+
+static uint8_t bulk_data_in (USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    if(epnum != (BULK_IN_EP & 0xFU))
+        return USBD_CDC.DataIn(pdev, epnum);
+
+    if(tx_len) {
+        tx_tail += tx_len;
+        // End the host read with a ZLP when nothing follows a transfer of whole packets.
+        if(tx_len % bulk_packet_size(pdev) == 0 && tx_head == tx_tail) {
+            tx_len = 0;
+            USBD_LL_Transmit(pdev, BULK_IN_EP, NULL, 0U);
+            return (uint8_t)USBD_OK;
+        }
+    }
+
+    bulk_start(pdev);
+
+    return (uint8_t)USBD_OK;
+}
+
+static uint8_t bulk_ep0_rx_ready (USBD_HandleTypeDef *pdev)
+{
+    return USBD_CDC.EP0_RxReady(pdev);
+}
+
+static uint8_t bulk_data_out (USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+    return USBD_CDC.DataOut(pdev, epnum);
+}
+
+// Copies the CDC configuration descriptor, adds the IAD in front of the CDC interfaces and the
+// bulk interface after them. Composite devices (class 0xEF) need the IAD to bind the CDC driver.
+static uint8_t *bulk_cfg_desc (uint8_t *desc, uint8_t *cdc, uint16_t cdc_len, uint16_t packet_size, uint16_t *length)
+{
+    static const uint8_t iad[8] = {
+        0x08, USB_DESC_TYPE_IAD,
+        0x00,               // bFirstInterface
+        0x02,               // bInterfaceCount
+        0x02, 0x02, 0x01,   // CDC ACM, AT commands, as the CDC interface
+        0x00
+    };
+    uint8_t *p = desc;
+
+    memcpy(p, cdc, 9);
+    p += 9;
+    memcpy(p, iad, sizeof(iad));
+    p += sizeof(iad);
+    memcpy(p, cdc + 9, cdc_len - 9);
+    p += cdc_len - 9;
+
+    *p++ = 0x09;            // interface
+    *p++ = USB_DESC_TYPE_INTERFACE;
+    *p++ = BULK_ITF;
+    *p++ = 0x00;            // bAlternateSetting
+    *p++ = 0x01;            // bNumEndpoints
+    *p++ = 0xFF;            // vendor specific
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = 0x00;
+
+    *p++ = 0x07;            // endpoint
+    *p++ = USB_DESC_TYPE_ENDPOINT;
+    *p++ = BULK_IN_EP;
+    *p++ = USBD_EP_TYPE_BULK;
+    *p++ = LOBYTE(packet_size);
+    *p++ = HIBYTE(packet_size);
+    *p++ = 0x00;
+
+    *length = (uint16_t)(p - desc);
+    desc[2] = LOBYTE(*length);
+    desc[3] = HIBYTE(*length);
+    desc[4] = 0x03;         // bNumInterfaces
+
+    return desc;
+}
+
+static uint8_t *bulk_get_hs_cfg_desc (uint16_t *length)
+{
+    uint16_t cdc_len;
+    uint8_t *cdc = USBD_CDC.GetHSConfigDescriptor(&cdc_len);
+
+    return bulk_cfg_desc(cfg_desc_hs, cdc, cdc_len, BULK_HS_PACKET_SIZE, length);
+}
+
+static uint8_t *bulk_get_fs_cfg_desc (uint16_t *length)
+{
+    uint16_t cdc_len;
+    uint8_t *cdc = USBD_CDC.GetFSConfigDescriptor(&cdc_len);
+
+    return bulk_cfg_desc(cfg_desc_fs, cdc, cdc_len, BULK_FS_PACKET_SIZE, length);
+}
+
+static uint8_t *bulk_get_other_speed_cfg_desc (uint16_t *length)
+{
+    uint16_t cdc_len;
+    uint8_t *cdc = USBD_CDC.GetOtherSpeedConfigDescriptor(&cdc_len);
+
+    return bulk_cfg_desc(cfg_desc_other, cdc, cdc_len, BULK_FS_PACKET_SIZE, length);
+}
+
+static uint8_t *bulk_get_device_qualifier_desc (uint16_t *length)
+{
+    return USBD_CDC.GetDeviceQualifierDescriptor(length);
+}
+
+// Registered instead of USBD_CDC by usb_device.c.
+USBD_ClassTypeDef USBD_CDC_Bulk = {
+    bulk_init,
+    bulk_deinit,
+    bulk_setup,
+    NULL,                   // EP0_TxSent
+    bulk_ep0_rx_ready,
+    bulk_data_in,
+    bulk_data_out,
+    NULL,
+    NULL,
+    NULL,
+    bulk_get_hs_cfg_desc,
+    bulk_get_fs_cfg_desc,
+    bulk_get_other_speed_cfg_desc,
+    bulk_get_device_qualifier_desc
+};
+
+/*
+ * Foreground
+ */
+
+static inline bool host_connected (void)
+{
+    return usb_device.dev_state == USBD_STATE_CONFIGURED;
+}
+
+bool usb_bulk_write (const void *data, uint32_t len)
+{
+    uint32_t head = tx_head, ofs = head & BUF_MASK, n;
+
+    if(!host_connected() || len > USB_BULK_BUFFER_SIZE - (head - tx_tail))
+        return false;
+
+    n = len < USB_BULK_BUFFER_SIZE - ofs ? len : USB_BULK_BUFFER_SIZE - ofs;
+    memcpy(&tx_buf[ofs], data, n);
+    memcpy(tx_buf, (const uint8_t *)data + n, len - n);
+
+    __DMB();
+    tx_head = head + len;
+
+    return true;
+}
+
+static inline uint32_t tx_free (void)
+{
+    return USB_BULK_BUFFER_SIZE - (tx_head - tx_tail);
+}
+
+static void telemetry_set_rate (uint32_t hz)
+{
+    bulk.period_us = hz ? 1000000 / hz : 0;
+    bulk.next_us = hal.get_micros();
+}
+
+static void telemetry_sample (uint64_t now_us)
+{
+    usb_tlm_header_t *hdr = (usb_tlm_header_t *)batch_buf;
+    usb_sample_t *sample = (usb_sample_t *)&batch_buf[sizeof(usb_tlm_header_t)] + bulk.batch_n;
+    uint_fast8_t idx;
+
+    if(bulk.batch_n == 0) {
+        hdr->type = TLM_TYPE_SAMPLES;
+        hdr->size = sizeof(usb_sample_t);
+        hdr->seq = bulk.samples;
+        bulk.batch_ms = hal.get_elapsed_ticks();
+    }
+
+    memset(sample, 0, sizeof(usb_sample_t));
+    sample->t_us = (uint32_t)now_us;
+    sample->state = (uint16_t)state_get();
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        sample->position[idx] = (float)sys.position[idx] / settings.axis[idx].steps_per_mm;
+
+#if EDM_ENABLE
+    edm_telemetry_t edm;
+
+    edm_get_telemetry(&edm);
+    sample->flags = (edm.energized ? TLM_FLAG_ENERGIZED : 0) | (edm.retracting ? TLM_FLAG_RETRACTING : 0);
+    sample->r_pulse = edm.r_pulse;
+    sample->r_short = edm.r_short;
+    sample->r_open = edm.r_open;
+    sample->servo_period_q16 = edm.servo_period_q16;
+    sample->pulses = edm.pulses;
+    sample->shorts = edm.shorts;
+    sample->retracts = edm.retracts;
+#endif
+
+    bulk.samples++;
+    hdr->n = ++bulk.batch_n;
+}
+
+static void telemetry_flush (void)
+{
+    if(bulk.batch_n == 0)
+        return;
+
+    if(usb_bulk_write(batch_buf, sizeof(usb_tlm_header_t) + bulk.batch_n * sizeof(usb_sample_t)))
+        bulk.frames++;
+    else
+        bulk.dropped++;
+
+    bulk.batch_n = 0;
+}
+
+#if EDM_ENABLE
+
+// Entries stay in the EDM log until there is room to queue them, a dump is paced by the host.
+static void telemetry_log (void)
+{
+    usb_tlm_header_t *hdr = (usb_tlm_header_t *)log_buf;
+    uint32_t seq = bulk.log_seq, n;
+
+    while(tx_free() >= sizeof(log_buf)) {
+
+        if((n = edm_log_since(&seq, &log_buf[sizeof(usb_tlm_header_t)], USB_BULK_LOG_ENTRIES)) == 0)
+            break;
+
+        hdr->type = TLM_TYPE_LOG;
+        hdr->n = (uint8_t)n;
+        hdr->size = EDM_LOG_ENTRY_SIZE;
+        hdr->seq = seq - n;
+
+        if(!usb_bulk_write(log_buf, sizeof(usb_tlm_header_t) + n * EDM_LOG_ENTRY_SIZE))
+            return;
+
+        bulk.log_seq = seq;
+        bulk.frames++;
+    }
+
+    bulk.log_seq = seq;
+}
+
+#endif
+
+static void bulk_poll (void)
+{
+    if(!host_connected()) {
+        bulk.batch_n = 0;
+        return;
+    }
+
+    if(bulk.period_us) {
+
+        uint64_t now_us = hal.get_micros();
+
+        if(now_us >= bulk.next_us) {
+            // Keep the phase, skip periods missed while the loop was blocked.
+            bulk.next_us += bulk.period_us;
+            if(bulk.next_us <= now_us)
+                bulk.next_us = now_us + bulk.period_us;
+            telemetry_sample(now_us);
+        }
+    }
+
+    if(bulk.batch_n == USB_BULK_BATCH || (bulk.batch_n && hal.get_elapsed_ticks() - bulk.batch_ms >= USB_BULK_FLUSH_MS))
+        telemetry_flush();
+
+#if EDM_ENABLE
+    if(bulk.log_on)
+        telemetry_log();
+#endif
+
+    // No endpoint interrupt can be pending while idle, the interrupt chains transfers otherwise.
+    if(!tx_busy && tx_head != tx_tail)
+        bulk_start(&usb_device);
+}
+
+#if RT_SCHED_ENABLE
+
+static void bulk_task (void *context)
+{
+    bulk_poll();
+}
+
+#else
+
+static void bulk_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    bulk_poll();
+}
+
+#endif
+
+static status_code_t report (void)
+{
+    char buf[100];
+
+    snprintf(buf, sizeof(buf), "[USBTLM|hz=%lu,log=%u,host=%d,samples=%lu,frames=%lu,dropped=%lu]" ASCII_EOL,
+              bulk.period_us ? 1000000 / bulk.period_us : 0, bulk.log_on, host_connected(),
+               bulk.samples, bulk.frames, bulk.dropped);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+static status_code_t telemetry_command (sys_state_t state, char *args)
+{
+    if(args) {
+        char *end;
+        uint32_t hz = strtoul(args, &end, 10);
+
+        if(*end != '\0' || (hz && (hz < 10 || hz > 1000)))
+            return Status_BadNumberFormat;
+
+        telemetry_set_rate(hz);
+    }
+
+    return report();
+}
+
+static status_code_t log_command (sys_state_t state, char *args)
+{
+#if EDM_ENABLE
+    if(args) {
+        char *end;
+        uint32_t on = strtoul(args, &end, 10);
+
+        if(*end != '\0' || on > 1)
+            return Status_BadNumberFormat;
+
+        // From entry 0 edm_log_since() skips forward to the oldest retained entry.
+        bulk.log_seq = 0;
+        bulk.log_on = on == 1;
+    }
+
+    return report();
+#else
+    return Status_InvalidStatement;
+#endif
+}
+
+bool usb_bulk_init (void)
+{
+    static const sys_command_t bulk_command_list[] = {
+        {"USBTLM", telemetry_command, {}, { .str = "USB bulk telemetry sample rate, $USBTLM=<0 or 10-1000 Hz>" } },
+        {"USBLOG", log_command, {}, { .str = "USB bulk EDM log entries, $USBLOG=<0 or 1>, on starts with the retained log" } }
+    };
+
+    static sys_commands_t bulk_commands = {
+        .n_commands = sizeof(bulk_command_list) / sizeof(sys_command_t),
+        .commands = bulk_command_list
+    };
+
+#if RT_SCHED_ENABLE
+    static rt_task_t poll_task = {
+        .name = "usbbulk",
+        .fn = bulk_task,
+        .budget_us = 20,
+        .priority = 100
+    };
+
+    rt_task_register(&poll_task);
+#else
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = bulk_execute_realtime;
+#endif
+
+    system_register_commands(&bulk_commands);
+
+    telemetry_set_rate(USB_BULK_HZ);
+
+    return true;
+}
+
+#endif // USB_BULK_ENABLE
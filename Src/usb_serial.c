@@ -23,6 +23,8 @@
 
 #include "driver.h"
 
+#include <string.h>
+
 #if USB_SERIAL_CDC
 
 #include "main.h"
@@ -30,6 +32,8 @@
 #include "usb_device.h"
 
 #include "usb_serial.h"
+#include "trace.h"
+#include "stream_fanout.h"
 #include "../grbl/grbl.h"
 #include "../grbl/protocol.h"
 
@@ -71,35 +75,51 @@ static void usbRxCancel (void)
     rxbuf.head =  BUFNEXT(rxbuf.head, rxbuf);;
 }
 
+#ifdef STM32H723xx
+#define CDC_Transmit CDC_Transmit_HS
+#define usb_device hUsbDeviceHS
+#else
+#define CDC_Transmit CDC_Transmit_FS
+#define usb_device hUsbDeviceFS
+#endif
+
+extern USBD_HandleTypeDef usb_device;
+
+// Output is coalesced into the current buffer and handed to the USB stack when full, from
+// the foreground loop when the IN endpoint goes idle or after USB_TX_FLUSH_MS at the latest.
+#ifndef USB_TX_FLUSH_MS
+#define USB_TX_FLUSH_MS 1
+#endif
+
+static volatile bool tx_busy = false;  // set while foreground code is adding to the buffer
+static uint32_t tx_pending_ms;         // time first pending character was buffered
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+
+static inline uint16_t usb_packet_size (void)
+{
+    return usb_device.dev_speed == USBD_SPEED_HIGH ? CDC_DATA_HS_MAX_PACKET_SIZE : CDC_DATA_FS_MAX_PACKET_SIZE;
+}
+
+static inline bool usb_tx_idle (void)
+{
+    USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef *)usb_device.pClassData;
+
+    return hcdc && hcdc->TxState == 0;
+}
+
 //
-// Writes current buffer to the USB output stream, swaps buffers
+// Writes current buffer to the USB output stream, swaps buffers.
+// The CDC class sends a ZLP when the transfer length is a multiple of the packet size.
 //
 static inline bool usb_write (void)
 {
-    static uint8_t dummy = 0;
-
     txbuf.s = txbuf.use_tx2data ? txbuf.data2 : txbuf.data;
 
-#ifdef STM32H723xx
-    while(CDC_Transmit_HS((uint8_t *)txbuf.s, txbuf.length) == USBD_BUSY) {
-#else
-    while(CDC_Transmit_FS((uint8_t *)txbuf.s, txbuf.length) == USBD_BUSY) {
-#endif
+    while(CDC_Transmit((uint8_t *)txbuf.s, txbuf.length) == USBD_BUSY) {
         if(!hal.stream_blocking_callback())
             return false;
     }
 
-    if(txbuf.length % 64 == 0) {
-#ifdef STM32H723xx
-        while(CDC_Transmit_HS(&dummy, 0) == USBD_BUSY) {
-#else
-        while(CDC_Transmit_FS(&dummy, 0) == USBD_BUSY) {
-#endif
-            if(!hal.stream_blocking_callback())
-                return false;
-        }
-    }
-
     txbuf.use_tx2data = !txbuf.use_tx2data;
     txbuf.s = txbuf.use_tx2data ? txbuf.data2 : txbuf.data;
     txbuf.length = 0;
@@ -107,90 +127,104 @@ static inline bool usb_write (void)
     return true;
 }
 
+#if STREAM_FANOUT_NONBLOCK
+
+static stream_fanout_t fanout = {0};
+
+// Free space without blocking: the current buffer, and the other one if the IN endpoint is idle.
+static inline uint16_t usb_tx_free (void)
+{
+    return txbuf.max_length - txbuf.length + (usb_tx_idle() ? txbuf.max_length : 0);
+}
+
+#endif
+
 //
-// Writes a single character to the USB output stream, blocks if buffer full
+// Adds characters to the current buffer, transmits it when full
 //
-static bool usbPutC (const char c)
+static bool usb_buffer (const char *s, size_t length)
 {
-    static uint8_t buf[1];
+    bool ok = true;
+    uint16_t span;
 
-    *buf = c;
-
-#ifdef STM32H723xx
-    while(CDC_Transmit_HS(buf, 1) == USBD_BUSY) {
-#else
-    while(CDC_Transmit_FS(buf, 1) == USBD_BUSY) {
+#if STREAM_FANOUT_NONBLOCK
+    // Not the active stream, drop instead of blocking when the host does not read (see stream_fanout.h)
+    if(hal.stream.get_rx_buffer_free != usbRxFree && !stream_fanout_accept(&fanout, s, length, usb_tx_free()))
+        return true;
 #endif
-        if(!hal.stream_blocking_callback())
-            return false;
+
+    tx_busy = true;
+
+    if(txbuf.length == 0)
+        tx_pending_ms = hal.get_elapsed_ticks();
+
+    while(length) {
+        if((span = txbuf.max_length - txbuf.length) > length)
+            span = length;
+        memcpy(txbuf.s, s, span);
+        txbuf.length += span;
+        txbuf.s += span;
+        s += span;
+        length -= span;
+        if(txbuf.length == txbuf.max_length) {
+            if(!(ok = usb_write()))
+                break;
+            tx_pending_ms = hal.get_elapsed_ticks();
+        }
     }
 
-    return true;
+    tx_busy = false;
+
+    return ok;
 }
 
 //
-// Writes a null terminated string to the USB output stream, blocks if buffer full
-// Buffers string up to EOL (LF) before transmitting
+// Transmits pending output if the IN endpoint is idle, never blocks
 //
-static void usbWriteS (const char *s)
+static void usb_flush (void)
 {
-    size_t length = strlen(s);
+    if(txbuf.length && !tx_busy && (txbuf.length >= usb_packet_size() || hal.get_elapsed_ticks() - tx_pending_ms >= USB_TX_FLUSH_MS) && usb_tx_idle())
+        usb_write();
+}
 
-    if(length == 0)
-        return;
+static void usb_execute_realtime (uint_fast16_t state)
+{
+    usb_flush();
 
-    if(txbuf.length && (txbuf.length + length) > txbuf.max_length) {
-        if(!usb_write())
-            return;
-    }
+    on_execute_realtime(state);
+}
 
-    while(length > txbuf.max_length) {
-        txbuf.length = txbuf.max_length;
-        memcpy(txbuf.s, s, txbuf.length);
-        if(!usb_write())
-            return;
-        length -= txbuf.max_length;
-        s += txbuf.max_length;
-    }
+static void usb_execute_delay (uint_fast16_t state)
+{
+    usb_flush();
 
-    if(length) {
-        memcpy(txbuf.s, s, length);
-        txbuf.length += length;
-        txbuf.s += length;
-        if(s[length - 1] == ASCII_LF)
-            usb_write();
-    }
+    on_execute_delay(state);
 }
 
 //
-// Writes a number of characters from string to the USB output stream, blocks if buffer full
+// Writes a single character to the USB output stream, blocks if buffer full
 //
-static void usbWrite (const char *s, uint16_t length)
+static bool usbPutC (const char c)
 {
-    if(length == 0)
-        return;
-
-    if(txbuf.length && (txbuf.length + length) > txbuf.max_length) {
-        if(!usb_write())
-            return;
-    }
+    return usb_buffer(&c, 1);
+}
 
-    while(length > txbuf.max_length) {
-        txbuf.length = txbuf.max_length;
-        memcpy(txbuf.s, s, txbuf.length);
-        if(!usb_write())
-            return;
-        length -= txbuf.max_length;
-        s += txbuf.max_length;
-    }
+//
+// Writes a null terminated string to the USB output stream, blocks if buffer full
+//
+static void usbWriteS (const char *s)
+{
+    usb_buffer(s, strlen(s));
+}
 
-    if(length) {
-        memcpy(txbuf.s, s, length);
-        txbuf.length += length;
-        txbuf.s += length;
-        usb_write();
-    }
+//
+// Writes a number of characters from string to the USB output stream, blocks if buffer full
+//
+static void usbWrite (const char *s, uint16_t length)
+{
+    usb_buffer(s, length);
 }
+
 //
 // usbGetC - returns -1 if no data available
 //
@@ -253,24 +287,127 @@ const io_stream_t *usbInit (void)
     txbuf.s = txbuf.data;
     txbuf.max_length = BLOCK_TX_BUFFER_SIZE;
 
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = usb_execute_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = usb_execute_delay;
+
     return &stream;
 }
 
+// Input is scanned a word at a time for bytes that may be realtime commands or change how the
+// core interprets them: control characters (incl. CR and LF), '!', '$', '?' and '~' and up.
+// Runs without such bytes are copied to the buffer in bulk, the others, and the first byte after
+// each of them, are passed to the realtime command handler one by one as before.
+// Custom realtime handlers, e.g. from a stream redirect, get every byte.
+
+static inline uint32_t word_has_zero (uint32_t w)
+{
+    return (w - 0x01010101) & ~w & 0x80808080;
+}
+
+static inline bool word_has_special (uint32_t w)
+{
+    return ((w - 0x20202020) & ~w & 0x80808080) ||   // < 0x20
+            word_has_zero(w ^ 0x21212121) || word_has_zero(w ^ 0x24242424) || word_has_zero(w ^ 0x3F3F3F3F) ||
+             (((w + 0x02020202) | w) & 0x80808080);  // > 0x7D
+}
+
+static inline bool is_special (uint8_t c)
+{
+    return c < ' ' || c == '!' || c == '$' || c == '?' || c >= '~';
+}
+
+// Returns the number of leading bytes that can be copied without realtime command processing.
+static uint32_t plain_run (const uint8_t *data, uint32_t length)
+{
+    uint32_t w, n = 0;
+
+    while(length - n >= 4) {
+        memcpy(&w, data + n, 4);
+        if(word_has_special(w))
+            break;
+        n += 4;
+    }
+
+    while(n < length && !is_special(data[n]))
+        n++;
+
+    return n;
+}
+
+static void rx_put_run (const uint8_t *data, uint32_t length)
+{
+    uint16_t head = rxbuf.head;
+    uint32_t free = RX_BUFFER_SIZE - 1 - BUFCOUNT(head, rxbuf.tail, RX_BUFFER_SIZE), chunk;
+
+    if(length > free) {
+        rxbuf.overflow = 1;
+        length = free;
+    }
+
+    chunk = RX_BUFFER_SIZE - head;
+    if(chunk > length)
+        chunk = length;
+
+    memcpy(&rxbuf.data[head], data, chunk);
+    memcpy(rxbuf.data, data + chunk, length - chunk);
+
+    rxbuf.head = (head + length) & (RX_BUFFER_SIZE - 1);
+}
+
+static inline void rx_put (uint8_t c)
+{
+    if(!enqueue_realtime_command(c)) {                  // Check and strip realtime commands,
+        uint16_t next_head = BUFNEXT(rxbuf.head, rxbuf);    // Get and increment buffer pointer
+        if(next_head == rxbuf.tail)                         // If buffer full
+            rxbuf.overflow = 1;                             // flag overflow
+        else {
+            rxbuf.data[rxbuf.head] = c;                     // if not add data to buffer
+            rxbuf.head = next_head;                         // and update pointer
+        }
+    }
+}
+
 // NOTE: A call to this function should be added as the first line of CDC_Receive_FS() & CDC_Receive_HS().
 //       These are found in the usbd_cdc_if.c support files for H743 and H723 parts.
 void usbBufferInput (uint8_t *data, uint32_t length)
 {
-    while(length--) {
-        if(!enqueue_realtime_command(*data)) {                  // Check and strip realtime commands,
-            uint16_t next_head = BUFNEXT(rxbuf.head, rxbuf);    // Get and increment buffer pointer
-            if(next_head == rxbuf.tail)                         // If buffer full
-                rxbuf.overflow = 1;                             // flag overflow
-            else {
-                rxbuf.data[rxbuf.head] = *data;                 // if not add data to buffer
-                rxbuf.head = next_head;                         // and update pointer
-            }
+    static bool after_special = true;
+
+    uint32_t run;
+
+    TRACE(TraceEvent_StreamRx, length);
+
+    if(enqueue_realtime_command != protocol_enqueue_realtime_command) {
+        while(length--)
+            rx_put(*data++);
+        after_special = true;
+        return;
+    }
+
+    while(length) {
+
+        // The core counts the characters of a line, it has to see the first one after a line end.
+        if(after_special) {
+            after_special = is_special(*data);
+            rx_put(*data++);
+            length--;
+            continue;
+        }
+
+        if((run = plain_run(data, length))) {
+            rx_put_run(data, run);
+            data += run;
+            length -= run;
+        }
+
+        if(length) {
+            rx_put(*data++);
+            length--;
+            after_special = true;
         }
-        data++;                                                 // next...
     }
 }
 
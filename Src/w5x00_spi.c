@@ -0,0 +1,114 @@
+/*
+  w5x00_spi.c - WIZnet W5x00 socket buffer bursts as queued SPI DMA transfers
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The ioLibrary frames every W5x00 buffer access as chip select, a 3 byte address/control header
+  and the data, the header and the data are passed to the burst callbacks registered here. Headers
+  and register accesses are short and stay polled in spi_write()/spi_read(), socket buffer data
+  is sent as one transaction through the queued SPI layer (spi_transfer_async()) and thus by DMA.
+
+  Reads go to lwIP pbuf payloads which are not cache line aligned, spi_read() would bounce them
+  through its scratch buffer in SPI_SCRATCH_BUFFER_SIZE chunks, each with a DMA restart and a copy.
+  Here only the unaligned head and tail, less than a cache line each, are read polled and the
+  aligned middle part is received by DMA directly into the payload. Since the chip select is held
+  by the ioLibrary for the whole frame, the three reads make up a single burst on the wire.
+
+  The ioLibrary API is blocking so the callbacks wait for completion, interrupts are serviced
+  while the DMA runs. No other SPI device may queue transfers from interrupt context while the
+  W5x00 is selected.
+
+  w5x00_spi_init() must be called after wizchip_initialize() (enet_start()) which registers the
+  default callbacks.
+*/
+
+#include "driver.h"
+
+#if W5X00_SPI_BURST
+
+#include "wizchip_conf.h"
+
+#include "spi.h"
+#include "cache.h"
+#include "w5x00_spi.h"
+
+#ifndef W5X00_SPI_DMA_MIN
+#define W5X00_SPI_DMA_MIN 64    // shorter bursts are polled, not worth the DMA setup
+#endif
+
+static volatile bool burst_done;
+
+static void burst_complete (bool ok, void *context)
+{
+    burst_done = true;
+}
+
+static void burst_run (uint8_t *tx, uint8_t *rx, uint16_t len)
+{
+    static spi_transaction_t burst = {
+        .callback = burst_complete
+    };
+
+    burst.tx = tx;
+    burst.rx = rx;
+    burst.len = len;
+    burst_done = false;
+
+    if(spi_transfer_async(&burst))
+        while(!burst_done);
+}
+
+static void w5x00_read_burst (uint8_t *data, uint16_t len)
+{
+    uint16_t head = 0, body = len;
+
+    if(len < W5X00_SPI_DMA_MIN) {
+        spi_read(data, len);
+        return;
+    }
+
+#if L1_CACHE_ENABLE
+    if(!is_dma_arena(data)) {
+        head = (uint16_t)(align_up((uint32_t)data, __SCB_DCACHE_LINE_SIZE) - (uint32_t)data);
+        body = (len - head) & ~(__SCB_DCACHE_LINE_SIZE - 1);
+    }
+#endif
+
+    if(head)
+        spi_read(data, head);
+
+    burst_run(NULL, data + head, body);
+
+    if(len - head - body)
+        spi_read(data + head + body, len - head - body);
+}
+
+static void w5x00_write_burst (uint8_t *data, uint16_t len)
+{
+    if(len < W5X00_SPI_DMA_MIN)
+        spi_write(data, len);
+    else
+        burst_run(data, NULL, len);
+}
+
+void w5x00_spi_init (void)
+{
+    reg_wizchip_spiburst_cbfunc(w5x00_read_burst, w5x00_write_burst);
+}
+
+#endif // W5X00_SPI_BURST
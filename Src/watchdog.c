@@ -0,0 +1,242 @@
+/*
+  watchdog.c - independent watchdog fed on per-subsystem liveness
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  IWDG1 is started on the first pass of the realtime loop with a WATCHDOG_TIMEOUT_MS timeout
+  and is reloaded from the realtime loop (and from delays) only. A foreground that is stuck in
+  a busy-wait, e.g. on a hung I2C or SPI transfer, thus resets the controller.
+
+  Subsystems running from interrupts register a deadline and report liveness with
+  watchdog_alive(), which is a single store. While a client is armed and has not reported within
+  its deadline the watchdog is no longer reloaded, the client is recorded in DTCM (retained over
+  the reset) and reported at the next boot. An IWDG reset without a recorded client is reported
+  as a realtime loop stall. Registered here and in the drivers:
+
+    STEP - stepper interrupt, armed while the stepper timer runs (WATCHDOG_STEP_DEADLINE_MS)
+    EDM  - PULSER samples, armed while energized (plugin_edm.c)
+
+  The stream and network stacks are serviced from the realtime loop, they are covered by it.
+  Known long blocking operations (flash sector erases) call watchdog_extend().
+
+  The IWDG is frozen while the core is halted by a debugger.
+
+  $WDT - report clients: [WDT|<name>,<deadline ms>,<armed 0|1>,<ms since last report>]
+*/
+
+#include "driver.h"
+
+#if WATCHDOG_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/system.h"
+#include "grbl/protocol.h"
+#include "grbl/report.h"
+
+#include "watchdog.h"
+
+#ifndef WATCHDOG_TIMEOUT_MS
+#define WATCHDOG_TIMEOUT_MS 1000
+#endif
+
+#define IWDG_KEY_RELOAD 0xAAAA
+#define IWDG_KEY_ENABLE 0xCCCC
+#define IWDG_KEY_ACCESS 0x5555
+#define IWDG_PRESCALER  4       // LSI (32 kHz) / 64, 2 ms per count
+#define IWDG_MS(ms)     ((ms) / 2 > 0xFFF ? 0xFFF : (ms) / 2)
+
+#if IWDG_MS(WATCHDOG_TIMEOUT_MS) < 10
+#error "WATCHDOG_TIMEOUT_MS too short!"
+#endif
+
+#define WATCHDOG_MAGIC 0x54445757   // "WWDT"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t late_ms;
+    char name[12];
+} watchdog_cause_t;
+
+// Not zero-initialized (NOLOAD), retained over the reset.
+static watchdog_cause_t cause __attribute__((section(".dtcmdata")));
+
+watchdog_client_t watchdog_clients[WATCHDOG_CLIENTS + 1] = {0};
+
+static uint_fast8_t n_clients = 0;
+static bool started = false, expired = false, extended = false;
+static char boot_msg[40];
+static on_execute_realtime_ptr on_execute_realtime, on_execute_delay;
+
+watchdog_id_t watchdog_register (const char *name, uint32_t deadline_ms, bool armed)
+{
+    if(n_clients == WATCHDOG_CLIENTS)
+        return WATCHDOG_CLIENTS;
+
+    watchdog_clients[n_clients].name = name;
+    watchdog_clients[n_clients].deadline_ms = deadline_ms;
+    watchdog_clients[n_clients].alive_ms = uwTick;
+    watchdog_clients[n_clients].armed = armed;
+
+    return n_clients++;
+}
+
+void watchdog_arm (watchdog_id_t id, bool on)
+{
+    watchdog_clients[id].alive_ms = uwTick;
+    watchdog_clients[id].armed = on && id < WATCHDOG_CLIENTS;
+}
+
+// Reload value updates take effect after up to ~5 LSI periods, a pending one is not overwritten.
+static inline bool set_reload (uint32_t count)
+{
+    if(IWDG1->SR & IWDG_SR_RVU)
+        return false;
+
+    IWDG1->KR = IWDG_KEY_ACCESS;
+    IWDG1->RLR = count;
+    IWDG1->KR = IWDG_KEY_RELOAD;
+
+    return true;
+}
+
+void watchdog_extend (uint32_t ms)
+{
+    if(started && !expired) {
+        uint32_t timeout = SystemCoreClock / 1000;
+
+        while((IWDG1->SR & IWDG_SR_RVU) && --timeout);
+
+        extended = set_reload(IWDG_MS(ms)) || extended;
+    }
+}
+
+static void watchdog_start (void)
+{
+    DBGMCU->APB4FZ1 |= DBGMCU_APB4FZ1_DBG_IWDG1;
+
+    IWDG1->KR = IWDG_KEY_ENABLE;
+    IWDG1->KR = IWDG_KEY_ACCESS;
+    IWDG1->PR = IWDG_PRESCALER;
+    IWDG1->RLR = IWDG_MS(WATCHDOG_TIMEOUT_MS);
+    IWDG1->KR = IWDG_KEY_RELOAD;
+
+    started = true;
+}
+
+static void watchdog_check (void)
+{
+    uint_fast8_t idx;
+    uint32_t now = uwTick, late;
+
+    if(!started)
+        watchdog_start();
+
+    if(expired)
+        return;
+
+    // Back from a blocking operation: restore the timeout, the clients may have been held up too.
+    if(extended && set_reload(IWDG_MS(WATCHDOG_TIMEOUT_MS))) {
+        extended = false;
+        for(idx = 0; idx < n_clients; idx++)
+            watchdog_clients[idx].alive_ms = now;
+    }
+
+    for(idx = 0; idx < n_clients; idx++) {
+        watchdog_client_t *client = &watchdog_clients[idx];
+        if(client->armed && (late = now - client->alive_ms) > client->deadline_ms) {
+            strncpy(cause.name, client->name, sizeof(cause.name) - 1);
+            cause.name[sizeof(cause.name) - 1] = '\0';
+            cause.late_ms = late;
+            cause.magic = WATCHDOG_MAGIC;
+            expired = true;
+            return;
+        }
+    }
+
+    IWDG1->KR = IWDG_KEY_RELOAD;
+}
+
+static void watchdog_execute_realtime (sys_state_t state)
+{
+    watchdog_check();
+
+    on_execute_realtime(state);
+}
+
+static void watchdog_execute_delay (sys_state_t state)
+{
+    watchdog_check();
+
+    on_execute_delay(state);
+}
+
+static status_code_t watchdog_report (sys_state_t state, char *args)
+{
+    char buf[64];
+    uint_fast8_t idx;
+    uint32_t now = uwTick;
+
+    snprintf(buf, sizeof(buf), "[WDT|timeout=%u,%s]" ASCII_EOL, WATCHDOG_TIMEOUT_MS, expired ? "expired" : (started ? "running" : "stopped"));
+    hal.stream.write(buf);
+
+    for(idx = 0; idx < n_clients; idx++) {
+        snprintf(buf, sizeof(buf), "[WDT|%s,%lu,%u,%lu]" ASCII_EOL, watchdog_clients[idx].name, watchdog_clients[idx].deadline_ms,
+                  watchdog_clients[idx].armed, now - watchdog_clients[idx].alive_ms);
+        hal.stream.write(buf);
+    }
+
+    return Status_OK;
+}
+
+void watchdog_init (void)
+{
+    static const sys_command_t watchdog_command_list[] = {
+        {"WDT", watchdog_report, { .noargs = On }, { .str = "report watchdog liveness clients" } }
+    };
+
+    static sys_commands_t watchdog_commands = {
+        .n_commands = sizeof(watchdog_command_list) / sizeof(sys_command_t),
+        .commands = watchdog_command_list
+    };
+
+    // Called before crash_dump_init(), which clears the reset flags.
+    if(RCC->RSR & RCC_RSR_IWDG1RSTF) {
+        if(cause.magic == WATCHDOG_MAGIC)
+            snprintf(boot_msg, sizeof(boot_msg), "Watchdog reset: %s late %lu ms", cause.name, cause.late_ms);
+        else
+            strcpy(boot_msg, "Watchdog reset: realtime loop stalled");
+        protocol_enqueue_foreground_task(report_warning, boot_msg);
+#if !CRASH_DUMP_ENABLE
+        RCC->RSR |= RCC_RSR_RMVF;
+#endif
+    }
+    cause.magic = 0;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = watchdog_execute_realtime;
+
+    on_execute_delay = grbl.on_execute_delay;
+    grbl.on_execute_delay = watchdog_execute_delay;
+
+    system_register_commands(&watchdog_commands);
+}
+
+#endif // WATCHDOG_ENABLE
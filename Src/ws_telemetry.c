@@ -0,0 +1,983 @@
+/*
+  ws_telemetry.c - WebSocket G-code stream with a binary telemetry channel
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  A single WebSocket client (RFC 6455) on WS_TELEMETRY_PORT, e.g. ws://<host>:8081/.
+
+  Text frames carry the G-code stream both ways: input is unmasked into a TCP_WND sized buffer
+  with realtime commands stripped on arrival, and the receive window is only reopened for
+  consumed characters, so the window is the flow control. Output of one realtime loop pass is
+  coalesced into one text frame.
+
+  Binary frames from the server carry telemetry, all little-endian and packed:
+
+    type 1, samples:  u8 type, u8 n, u16 sample_size, u32 seq, n * ws_sample_t
+    type 2, EDM log:  u8 type, u8 n, u16 entry_size, u32 seq, n * EDM_LOG_ENTRY_SIZE bytes
+                      (entry format as [EDMS|...], seq is the log entry number)
+
+  Samples are taken at the set rate and batched, a frame is sent when WS_TELEMETRY_BATCH samples
+  are collected or WS_TELEMETRY_FLUSH_MS after the first one. Telemetry never waits for the
+  network: a frame that does not fit the TCP send buffer is dropped and counted, seq shows the
+  gap. All buffers are static, memory use does not depend on the client.
+
+  Binary frames from the client control the channel:
+
+    0x01 <u16 hz>     sample rate, 0 (off) or 10 - 1000 Hz
+    0x02 <u8 on>      EDM log entries on/off
+
+  $WSTLM[=<hz>] sets the sample rate and reports: [WSTLM|hz=,port=,client=,samples=,frames=,dropped=]
+
+  lwIP runs in the foreground (NO_SYS), all callbacks here are called from the main loop.
+*/
+
+#include "driver.h"
+
+#if WS_TELEMETRY_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lwip/tcp.h"
+
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+#include "grbl/system.h"
+#include "grbl/state_machine.h"
+
+#include "ws_telemetry.h"
+#include "stream_fanout.h"
+#include "rt_sched.h"
+
+#if EDM_ENABLE
+#include "plugin_edm.h"
+#endif
+
+#ifndef WS_TELEMETRY_HZ
+#define WS_TELEMETRY_HZ 0           // rate at boot, 0: off
+#endif
+#ifndef WS_TELEMETRY_BATCH
+#define WS_TELEMETRY_BATCH 20       // samples per frame
+#endif
+#ifndef WS_TELEMETRY_FLUSH_MS
+#define WS_TELEMETRY_FLUSH_MS 50
+#endif
+#ifndef WS_TELEMETRY_LOG_ENTRIES
+#define WS_TELEMETRY_LOG_ENTRIES 50 // per frame
+#endif
+#ifndef WS_TELEMETRY_TX_SIZE
+#define WS_TELEMETRY_TX_SIZE 1024   // text output coalescing buffer
+#endif
+
+#define WS_RX_SIZE      TCP_WND
+#define WS_REQ_MAX      512         // handshake request
+#define WS_HEADROOM     4           // frame header space in front of outgoing payloads
+#define WS_GUID         "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OP_CONT      0x0
+#define WS_OP_TEXT      0x1
+#define WS_OP_BINARY    0x2
+#define WS_OP_CLOSE     0x8
+#define WS_OP_PING      0x9
+#define WS_OP_PONG      0xA
+
+#define TLM_TYPE_SAMPLES    1
+#define TLM_TYPE_LOG        2
+
+#define TLM_FLAG_ENERGIZED  0x01
+#define TLM_FLAG_RETRACTING 0x02
+
+typedef struct __attribute__((packed)) {
+    uint32_t t_us;              // lower 32 bits of hal.get_micros()
+    uint16_t state;             // sys_state_t bits (STATE_IDLE etc.)
+    uint8_t flags;              // TLM_FLAG_*
+    uint8_t r_pulse;            // EDM ratios of the last PULSER sample, 0 - 255
+    uint8_t r_short;
+    uint8_t r_open;
+    uint16_t reserved;
+    uint32_t servo_period_q16;  // 65536: programmed feed rate
+    uint32_t pulses;
+    uint32_t shorts;
+    uint32_t retracts;
+    float position[N_AXIS];     // machine position, mm
+} ws_sample_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t n;
+    uint16_t size;              // of a sample or entry
+    uint32_t seq;
+} ws_tlm_header_t;
+
+typedef enum {
+    WS_Closed = 0,
+    WS_Handshake,
+    WS_Open
+} ws_state_t;
+
+typedef enum {
+    Rx_Header = 0,
+    Rx_Payload
+} ws_rx_state_t;
+
+typedef struct {
+    ws_rx_state_t state;
+    uint8_t hdr[14];
+    uint8_t hdr_len;
+    uint8_t hdr_need;
+    uint8_t opcode;             // of the current frame
+    bool fin;
+    uint8_t msg_opcode;         // of the current (fragmented) message
+    uint8_t mask[4];
+    uint8_t mask_ix;
+    uint32_t remaining;
+    uint8_t ctrl[WS_HEADROOM + 125];    // control and client binary frame payload
+    uint8_t ctrl_len;
+} ws_rx_t;
+
+typedef struct {
+    struct tcp_pcb *listen;
+    struct tcp_pcb *pcb;
+    ws_state_t state;
+    ws_rx_t rx;
+    uint32_t rx_head;           // input buffer, written at head, read at tail
+    uint32_t rx_tail;
+    uint32_t consumed;          // bytes not yet passed to tcp_recved()
+    uint16_t req_len;
+    bool cancel;
+    bool suspended;
+    bool tx_pending;
+    uint16_t text_len;
+    uint32_t period_us;         // sample period, 0: off
+    uint64_t next_us;
+    uint32_t batch_ms;          // first sample of the batch taken
+    uint8_t batch_n;
+    bool log_on;
+    uint32_t log_seq;
+    uint32_t samples;
+    uint32_t frames;
+    uint32_t dropped;
+    enqueue_realtime_command_ptr enqueue_realtime_command;
+} ws_telemetry_t;
+
+static ws_telemetry_t ws = {
+    .enqueue_realtime_command = protocol_enqueue_realtime_command
+};
+static char rx_buf[WS_RX_SIZE];
+static char req_buf[WS_REQ_MAX];
+static uint8_t text_buf[WS_HEADROOM + WS_TELEMETRY_TX_SIZE];
+static uint8_t batch_buf[WS_HEADROOM + sizeof(ws_tlm_header_t) + WS_TELEMETRY_BATCH * sizeof(ws_sample_t)];
+#if EDM_ENABLE
+static uint8_t log_buf[WS_HEADROOM + sizeof(ws_tlm_header_t) + WS_TELEMETRY_LOG_ENTRIES * EDM_LOG_ENTRY_SIZE];
+#endif
+#if RT_SCHED_ENABLE
+static void ws_task (void *context);
+// Suspended unless a client is connected, no call is made per pass then.
+static rt_task_t poll_task = {
+    .name = "ws",
+    .fn = ws_task,
+    .budget_us = 50,
+    .priority = 100,
+    .suspended = true
+};
+#else
+static on_execute_realtime_ptr on_execute_realtime;
+#endif
+
+_Static_assert(sizeof(batch_buf) <= 0xFFFF && sizeof(text_buf) <= 0xFFFF, "WebSocket telemetry frames are limited to 64K");
+
+/*
+ * SHA-1 and base64 for the handshake (Sec-WebSocket-Accept) only.
+ */
+
+static void sha1 (const uint8_t *data, uint32_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    uint32_t w[80], a, b, c, d, e, f, k, t, i, j, n_blocks = (len + 8) / 64 + 1;
+    uint8_t block[64];
+
+    for(i = 0; i < n_blocks; i++) {
+
+        for(j = 0; j < 64; j++) {
+            uint32_t pos = i * 64 + j;
+            if(pos < len)
+                block[j] = data[pos];
+            else if(pos == len)
+                block[j] = 0x80;
+            else if(i == n_blocks - 1 && j >= 56)
+                block[j] = j < 59 ? 0 : (uint8_t)(((uint64_t)len * 8) >> ((63 - j) * 8));
+            else
+                block[j] = 0;
+        }
+
+        for(j = 0; j < 16; j++)
+            w[j] = (block[j * 4] << 24) | (block[j * 4 + 1] << 16) | (block[j * 4 + 2] << 8) | block[j * 4 + 3];
+        for(; j < 80; j++) {
+            t = w[j - 3] ^ w[j - 8] ^ w[j - 14] ^ w[j - 16];
+            w[j] = (t << 1) | (t >> 31);
+        }
+
+        a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+        for(j = 0; j < 80; j++) {
+            if(j < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if(j < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if(j < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            t = ((a << 5) | (a >> 27)) + f + e + k + w[j];
+            e = d;
+            d = c;
+            c = (b << 30) | (b >> 2);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+
+    for(i = 0; i < 20; i++)
+        digest[i] = (uint8_t)(h[i >> 2] >> (24 - (i & 3) * 8));
+}
+
+static void base64 (const uint8_t *in, uint32_t len, char *out)
+{
+    static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    uint32_t v;
+
+    for(; len >= 3; len -= 3, in += 3) {
+        v = (in[0] << 16) | (in[1] << 8) | in[2];
+        *out++ = b64[v >> 18];
+        *out++ = b64[(v >> 12) & 0x3F];
+        *out++ = b64[(v >> 6) & 0x3F];
+        *out++ = b64[v & 0x3F];
+    }
+
+    if(len) {
+        v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+        *out++ = b64[v >> 18];
+        *out++ = b64[(v >> 12) & 0x3F];
+        *out++ = len > 1 ? b64[(v >> 6) & 0x3F] : '=';
+        *out++ = '=';
+    }
+
+    *out = '\0';
+}
+
+/*
+ * Frame output
+ */
+
+// Sends payload buf[WS_HEADROOM..WS_HEADROOM + len - 1] as one frame, the header is written
+// into the headroom. Returns false, and sends nothing, if it does not fit the send buffer.
+static bool ws_send (uint8_t opcode, uint8_t *buf, uint16_t len)
+{
+    uint8_t *frame = buf + WS_HEADROOM - (len < 126 ? 2 : 4);
+    uint16_t frame_len = len + (uint16_t)(buf + WS_HEADROOM - frame);
+
+    if(ws.state != WS_Open || tcp_sndbuf(ws.pcb) < frame_len || tcp_sndqueuelen(ws.pcb) >= TCP_SND_QUEUELEN)
+        return false;
+
+    frame[0] = 0x80 | opcode;
+    if(len < 126)
+        frame[1] = (uint8_t)len;
+    else {
+        frame[1] = 126;
+        frame[2] = len >> 8;
+        frame[3] = len & 0xFF;
+    }
+
+    if(tcp_write(ws.pcb, frame, frame_len, TCP_WRITE_FLAG_COPY) != ERR_OK)
+        return false;
+
+    ws.tx_pending = true;
+
+    return true;
+}
+
+static bool text_flush (void)
+{
+    if(ws.text_len && ws_send(WS_OP_TEXT, text_buf, ws.text_len))
+        ws.text_len = 0;
+
+    return ws.text_len == 0;
+}
+
+/*
+ * Stream
+ */
+
+static inline uint32_t rx_count (void)
+{
+    return ws.rx_head - ws.rx_tail;
+}
+
+static void ws_recved (bool force)
+{
+    if(ws.pcb && ws.consumed && (force || ws.consumed >= TCP_MSS)) {
+        tcp_recved(ws.pcb, ws.consumed);
+        ws.consumed = 0;
+    }
+}
+
+static bool wsStreamIsConnected (void)
+{
+    return ws.state == WS_Open;
+}
+
+static int16_t wsStreamGetC (void)
+{
+    char c;
+
+    if(ws.cancel) {
+        ws.cancel = false;
+        return ASCII_CAN;
+    }
+
+    if(rx_count() == 0 || ws.suspended)
+        return -1;
+
+    c = rx_buf[ws.rx_tail++ % WS_RX_SIZE];
+    ws.consumed++;
+    ws_recved(rx_count() == 0);
+
+    return (int16_t)c;
+}
+
+static uint16_t wsStreamRxFree (void)
+{
+    return (uint16_t)(WS_RX_SIZE - rx_count());
+}
+
+static uint16_t wsStreamRxCount (void)
+{
+    return (uint16_t)rx_count();
+}
+
+static void wsStreamRxFlush (void)
+{
+    ws.consumed += rx_count();
+    ws.rx_tail = ws.rx_head;
+    ws_recved(true);
+}
+
+static void wsStreamRxCancel (void)
+{
+    wsStreamRxFlush();
+    ws.cancel = true;
+}
+
+static bool wsStreamSuspendInput (bool suspend)
+{
+    return (ws.suspended = suspend);
+}
+
+#if STREAM_FANOUT_NONBLOCK
+static stream_fanout_t fanout = {0};
+#endif
+
+static void wsStreamWrite (const char *s, uint16_t length)
+{
+    uint16_t n;
+
+#if STREAM_FANOUT_NONBLOCK
+    // Not the active stream, drop instead of blocking on a slow client (see stream_fanout.h)
+    if(ws.state == WS_Open && hal.stream.get_rx_buffer_free != wsStreamRxFree) {
+        if(WS_TELEMETRY_TX_SIZE - ws.text_len < length)
+            text_flush();
+        if(!stream_fanout_accept(&fanout, s, length, WS_TELEMETRY_TX_SIZE - ws.text_len))
+            return;
+    }
+#endif
+
+    while(length && ws.state == WS_Open) {
+
+        if((n = WS_TELEMETRY_TX_SIZE - ws.text_len) > length)
+            n = length;
+
+        if(n) {
+            memcpy(&text_buf[WS_HEADROOM + ws.text_len], s, n);
+            ws.text_len += n;
+            s += n;
+            length -= n;
+        } else if(!text_flush()) {
+            if(ws.tx_pending) {
+                tcp_output(ws.pcb);
+                ws.tx_pending = false;
+            }
+            if(!hal.stream_blocking_callback())     // runs the stack, may drop the connection
+                break;
+        }
+    }
+}
+
+static void wsStreamWriteS (const char *s)
+{
+    wsStreamWrite(s, (uint16_t)strlen(s));
+}
+
+static bool wsStreamPutC (const char c)
+{
+    wsStreamWrite(&c, 1);
+
+    return ws.state == WS_Open;
+}
+
+static uint16_t wsStreamTxCount (void)
+{
+    return ws.pcb ? (uint16_t)(ws.text_len + TCP_SND_BUF - tcp_sndbuf(ws.pcb)) : 0;
+}
+
+static void wsStreamTxFlush (void)
+{
+    ws.text_len = 0;
+}
+
+static bool wsStreamEnqueueRtCommand (char c)
+{
+    return ws.enqueue_realtime_command(c);
+}
+
+static enqueue_realtime_command_ptr wsStreamSetRtHandler (enqueue_realtime_command_ptr handler)
+{
+    enqueue_realtime_command_ptr prev = ws.enqueue_realtime_command;
+
+    if(handler)
+        ws.enqueue_realtime_command = handler;
+
+    return prev;
+}
+
+static const io_stream_t ws_stream = {
+    .type = StreamType_WebSocket,
+    .is_connected = wsStreamIsConnected,
+    .read = wsStreamGetC,
+    .write = wsStreamWriteS,
+    .write_n = wsStreamWrite,
+    .write_char = wsStreamPutC,
+    .enqueue_rt_command = wsStreamEnqueueRtCommand,
+    .get_rx_buffer_free = wsStreamRxFree,
+    .get_rx_buffer_count = wsStreamRxCount,
+    .get_tx_buffer_count = wsStreamTxCount,
+    .reset_write_buffer = wsStreamTxFlush,
+    .reset_read_buffer = wsStreamRxFlush,
+    .cancel_read_buffer = wsStreamRxCancel,
+    .suspend_read = wsStreamSuspendInput,
+    .set_enqueue_rt_handler = wsStreamSetRtHandler
+};
+
+/*
+ * Connection
+ */
+
+static void ws_closed (void)
+{
+    bool connected = ws.state == WS_Open;
+
+    ws.pcb = NULL;
+    ws.state = WS_Closed;
+#if RT_SCHED_ENABLE
+    poll_task.suspended = true;
+#endif
+    ws.rx_tail = ws.rx_head;
+    ws.consumed = ws.req_len = ws.text_len = 0;
+    ws.cancel = ws.suspended = ws.tx_pending = ws.log_on = false;
+
+    if(connected)
+        stream_disconnect(&ws_stream);
+}
+
+// Returns ERR_ABRT if the pcb had to be aborted, as to be returned from the recv callback.
+static err_t ws_close (struct tcp_pcb *pcb)
+{
+    tcp_arg(pcb, NULL);
+    tcp_recv(pcb, NULL);
+    tcp_err(pcb, NULL);
+
+    ws_closed();
+
+    if(tcp_close(pcb) == ERR_OK)
+        return ERR_OK;
+
+    tcp_abort(pcb);
+
+    return ERR_ABRT;
+}
+
+static void ws_err (void *arg, err_t err)
+{
+    // pcb already freed by lwIP
+    ws_closed();
+}
+
+static bool header_match (const char *line, const char *name)
+{
+    while(*name) {
+        char c = *line++;
+        if((c >= 'A' && c <= 'Z' ? c + 32 : c) != *name++)
+            return false;
+    }
+
+    return true;
+}
+
+// Returns false if the request is not a WebSocket upgrade.
+static bool ws_handshake (void)
+{
+    static const char response[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+
+    char *line, *key = NULL, *end, accept[64 + sizeof(WS_GUID)];
+    uint8_t digest[20];
+    size_t len;
+
+    req_buf[ws.req_len] = '\0';
+
+    if(strncmp(req_buf, "GET ", 4))
+        return false;
+
+    for(line = strstr(req_buf, "\r\n"); line && !key; line = strstr(line, "\r\n")) {
+        line += 2;
+        if(header_match(line, "sec-websocket-key:"))
+            key = line + 18;
+    }
+
+    if(key == NULL)
+        return false;
+
+    while(*key == ' ')
+        key++;
+
+    for(end = key; *end > ' '; end++);
+
+    if((len = end - key) == 0 || len > 64)
+        return false;
+
+    memcpy(accept, key, len);
+    memcpy(accept + len, WS_GUID, sizeof(WS_GUID) - 1);
+    sha1((uint8_t *)accept, len + sizeof(WS_GUID) - 1, digest);
+    base64(digest, sizeof(digest), accept);
+    strcat(accept, "\r\n\r\n");
+
+    if(tcp_write(ws.pcb, response, sizeof(response) - 1, 0) != ERR_OK ||
+        tcp_write(ws.pcb, accept, strlen(accept), TCP_WRITE_FLAG_COPY) != ERR_OK)
+        return false;
+
+    tcp_output(ws.pcb);
+
+    ws.state = WS_Open;
+#if RT_SCHED_ENABLE
+    poll_task.suspended = false;
+#endif
+    ws.rx.state = Rx_Header;
+    ws.rx.hdr_len = 0;
+    ws.rx.hdr_need = 2;
+    ws.log_seq = 0;
+
+    stream_connect(&ws_stream);
+
+    return true;
+}
+
+static void telemetry_set_rate (uint32_t hz)
+{
+    ws.period_us = hz ? 1000000 / hz : 0;
+    ws.next_us = hal.get_micros();
+}
+
+static void ws_control (const uint8_t *data, uint_fast8_t len)
+{
+    uint32_t hz;
+
+    switch(len ? data[0] : 0) {
+
+        case 0x01:
+            if(len >= 3 && ((hz = data[1] | (data[2] << 8)) == 0 || (hz >= 10 && hz <= 1000)))
+                telemetry_set_rate(hz);
+            break;
+
+        case 0x02:
+            if(len >= 2)
+                ws.log_on = data[1] != 0;
+            break;
+    }
+}
+
+// Handles a complete control or client binary frame, returns false if the connection is to be closed.
+static bool ws_frame_done (void)
+{
+    uint8_t *payload = &ws.rx.ctrl[WS_HEADROOM];
+
+    switch(ws.rx.opcode) {
+
+        case WS_OP_PING:
+            ws_send(WS_OP_PONG, ws.rx.ctrl, ws.rx.ctrl_len);
+            break;
+
+        case WS_OP_CLOSE:
+            ws_send(WS_OP_CLOSE, ws.rx.ctrl, ws.rx.ctrl_len >= 2 ? 2 : 0);     // echo the status code
+            tcp_output(ws.pcb);
+            return false;
+
+        case WS_OP_BINARY:
+        case WS_OP_CONT:
+            if(ws.rx.msg_opcode == WS_OP_BINARY && ws.rx.fin)
+                ws_control(payload, ws.rx.ctrl_len);
+            break;
+    }
+
+    return true;
+}
+
+// Parses one received byte, returns false on a protocol error.
+static bool ws_rx_byte (uint8_t c)
+{
+    uint_fast8_t len7;
+
+    if(ws.rx.state == Rx_Header) {
+
+        ws.consumed++;
+        ws.rx.hdr[ws.rx.hdr_len++] = c;
+
+        if(ws.rx.hdr_len == 2) {
+            if(!(ws.rx.hdr[1] & 0x80))      // client frames must be masked
+                return false;
+            len7 = ws.rx.hdr[1] & 0x7F;
+            ws.rx.hdr_need = 2 + (len7 == 126 ? 2 : (len7 == 127 ? 8 : 0)) + 4;
+        }
+
+        if(ws.rx.hdr_len < ws.rx.hdr_need)
+            return true;
+
+        len7 = ws.rx.hdr[1] & 0x7F;
+        ws.rx.opcode = ws.rx.hdr[0] & 0x0F;
+        ws.rx.fin = !!(ws.rx.hdr[0] & 0x80);
+        if(len7 == 126)
+            ws.rx.remaining = (ws.rx.hdr[2] << 8) | ws.rx.hdr[3];
+        else if(len7 == 127)
+            ws.rx.remaining = (ws.rx.hdr[6] << 24) | (ws.rx.hdr[7] << 16) | (ws.rx.hdr[8] << 8) | ws.rx.hdr[9];
+        else
+            ws.rx.remaining = len7;
+        memcpy(ws.rx.mask, &ws.rx.hdr[ws.rx.hdr_need - 4], 4);
+        ws.rx.mask_ix = 0;
+        ws.rx.ctrl_len = 0;
+        ws.rx.hdr_len = 0;
+        ws.rx.hdr_need = 2;
+
+        if(ws.rx.opcode == WS_OP_TEXT || ws.rx.opcode == WS_OP_BINARY)
+            ws.rx.msg_opcode = ws.rx.opcode;
+
+        if(ws.rx.remaining)
+            ws.rx.state = Rx_Payload;
+        else
+            return ws_frame_done();
+
+        return true;
+    }
+
+    c ^= ws.rx.mask[ws.rx.mask_ix++ & 3];
+
+    if((ws.rx.opcode == WS_OP_TEXT || ws.rx.opcode == WS_OP_CONT) && ws.rx.msg_opcode == WS_OP_TEXT) {
+        // Check and strip realtime commands, the buffer cannot overflow as it holds a full window.
+        if(ws.enqueue_realtime_command((char)c) || rx_count() >= WS_RX_SIZE)
+            ws.consumed++;
+        else
+            rx_buf[ws.rx_head++ % WS_RX_SIZE] = (char)c;
+    } else {
+        ws.consumed++;
+        if(ws.rx.ctrl_len < sizeof(ws.rx.ctrl) - WS_HEADROOM)
+            ws.rx.ctrl[WS_HEADROOM + ws.rx.ctrl_len++] = c;
+    }
+
+    if(--ws.rx.remaining == 0) {
+        ws.rx.state = Rx_Header;
+        if(ws.rx.opcode != WS_OP_TEXT && !(ws.rx.opcode == WS_OP_CONT && ws.rx.msg_opcode == WS_OP_TEXT))
+            return ws_frame_done();
+    }
+
+    return true;
+}
+
+static err_t ws_recv (void *arg, struct tcp_pcb *pcb, struct pbuf *p, err_t err)
+{
+    struct pbuf *q;
+    uint8_t *data;
+    uint16_t len;
+    bool ok = true;
+
+    if(p == NULL)                   // remote closed
+        return ws_close(pcb);
+
+    if(err != ERR_OK) {
+        pbuf_free(p);
+        return err;
+    }
+
+    for(q = p; q && ok && ws.state != WS_Closed; q = q->next) {
+        data = (uint8_t *)q->payload;
+        len = q->len;
+        while(len-- && ok) {
+            if(ws.state == WS_Handshake) {
+                ws.consumed++;
+                if(ws.req_len < WS_REQ_MAX - 1)
+                    req_buf[ws.req_len++] = (char)*data;
+                data++;
+                if(ws.req_len >= 4 && !memcmp(&req_buf[ws.req_len - 4], "\r\n\r\n", 4))
+                    ok = ws_handshake();
+                else
+                    ok = ws.req_len < WS_REQ_MAX - 1;
+            } else
+                ok = ws_rx_byte(*data++);
+        }
+    }
+
+    pbuf_free(p);
+
+    if(!ok)
+        return ws_close(pcb);
+
+    ws_recved(rx_count() == 0);
+
+    return ERR_OK;
+}
+
+static err_t ws_accept (void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    if(err != ERR_OK || pcb == NULL)
+        return ERR_VAL;
+
+    if(ws.pcb) {                    // single client only
+        tcp_abort(pcb);
+        return ERR_ABRT;
+    }
+
+    ws.pcb = pcb;
+    ws.state = WS_Handshake;
+    ws.req_len = 0;
+    tcp_nagle_disable(pcb);
+    tcp_recv(pcb, ws_recv);
+    tcp_err(pcb, ws_err);
+
+    return ERR_OK;
+}
+
+/*
+ * Telemetry
+ */
+
+static void telemetry_sample (uint64_t now_us)
+{
+    ws_tlm_header_t *hdr = (ws_tlm_header_t *)&batch_buf[WS_HEADROOM];
+    ws_sample_t *sample = (ws_sample_t *)&batch_buf[WS_HEADROOM + sizeof(ws_tlm_header_t)] + ws.batch_n;
+    uint_fast8_t idx;
+
+    if(ws.batch_n == 0) {
+        hdr->type = TLM_TYPE_SAMPLES;
+        hdr->size = sizeof(ws_sample_t);
+        hdr->seq = ws.samples;
+        ws.batch_ms = hal.get_elapsed_ticks();
+    }
+
+    memset(sample, 0, sizeof(ws_sample_t));
+    sample->t_us = (uint32_t)now_us;
+    sample->state = (uint16_t)state_get();
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        sample->position[idx] = (float)sys.position[idx] / settings.axis[idx].steps_per_mm;
+
+#if EDM_ENABLE
+    edm_telemetry_t edm;
+
+    edm_get_telemetry(&edm);
+    sample->flags = (edm.energized ? TLM_FLAG_ENERGIZED : 0) | (edm.retracting ? TLM_FLAG_RETRACTING : 0);
+    sample->r_pulse = edm.r_pulse;
+    sample->r_short = edm.r_short;
+    sample->r_open = edm.r_open;
+    sample->servo_period_q16 = edm.servo_period_q16;
+    sample->pulses = edm.pulses;
+    sample->shorts = edm.shorts;
+    sample->retracts = edm.retracts;
+#endif
+
+    ws.samples++;
+    hdr->n = ++ws.batch_n;
+}
+
+static void telemetry_flush (void)
+{
+    if(ws.batch_n == 0)
+        return;
+
+    if(ws_send(WS_OP_BINARY, batch_buf, sizeof(ws_tlm_header_t) + ws.batch_n * sizeof(ws_sample_t)))
+        ws.frames++;
+    else
+        ws.dropped++;
+
+    ws.batch_n = 0;
+}
+
+#if EDM_ENABLE
+
+static void telemetry_log (void)
+{
+    ws_tlm_header_t *hdr = (ws_tlm_header_t *)&log_buf[WS_HEADROOM];
+    uint32_t seq = ws.log_seq, n;
+
+    // Entries stay in the EDM log until there is room to send them.
+    if(tcp_sndbuf(ws.pcb) < sizeof(log_buf))
+        return;
+
+    if((n = edm_log_since(&seq, &log_buf[WS_HEADROOM + sizeof(ws_tlm_header_t)], WS_TELEMETRY_LOG_ENTRIES)) == 0) {
+        ws.log_seq = seq;
+        return;
+    }
+
+    hdr->type = TLM_TYPE_LOG;
+    hdr->n = (uint8_t)n;
+    hdr->size = EDM_LOG_ENTRY_SIZE;
+    hdr->seq = seq - n;
+
+    if(ws_send(WS_OP_BINARY, log_buf, sizeof(ws_tlm_header_t) + n * EDM_LOG_ENTRY_SIZE)) {
+        ws.log_seq = seq;
+        ws.frames++;
+    }
+}
+
+#endif
+
+static void ws_poll (void)
+{
+    if(ws.state != WS_Open)
+        return;
+
+    text_flush();
+
+    if(ws.period_us) {
+
+        uint64_t now_us = hal.get_micros();
+
+        if(now_us >= ws.next_us) {
+            // Keep the phase, skip periods missed while the loop was blocked.
+            ws.next_us += ws.period_us;
+            if(ws.next_us <= now_us)
+                ws.next_us = now_us + ws.period_us;
+            telemetry_sample(now_us);
+        }
+    }
+
+    if(ws.batch_n == WS_TELEMETRY_BATCH || (ws.batch_n && hal.get_elapsed_ticks() - ws.batch_ms >= WS_TELEMETRY_FLUSH_MS))
+        telemetry_flush();
+
+#if EDM_ENABLE
+    if(ws.log_on)
+        telemetry_log();
+#endif
+
+    if(ws.tx_pending && ws.pcb) {
+        tcp_output(ws.pcb);
+        ws.tx_pending = false;
+    }
+}
+
+#if RT_SCHED_ENABLE
+
+static void ws_task (void *context)
+{
+    ws_poll();
+}
+
+#else
+
+static void ws_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    ws_poll();
+}
+
+#endif
+
+static status_code_t telemetry_command (sys_state_t state, char *args)
+{
+    char buf[100];
+
+    if(args) {
+        char *end;
+        uint32_t hz = strtoul(args, &end, 10);
+
+        if(*end != '\0' || (hz && (hz < 10 || hz > 1000)))
+            return Status_BadNumberFormat;
+
+        telemetry_set_rate(hz);
+    }
+
+    snprintf(buf, sizeof(buf), "[WSTLM|hz=%lu,port=%u,client=%d,samples=%lu,frames=%lu,dropped=%lu]" ASCII_EOL,
+              ws.period_us ? 1000000 / ws.period_us : 0, WS_TELEMETRY_PORT, ws.state == WS_Open,
+               ws.samples, ws.frames, ws.dropped);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+bool ws_telemetry_init (void)
+{
+    static const sys_command_t telemetry_command_list[] = {
+        {"WSTLM", telemetry_command, {}, { .str = "WebSocket telemetry sample rate, $WSTLM=<0 or 10-1000 Hz>" } }
+    };
+
+    static sys_commands_t telemetry_commands = {
+        .n_commands = sizeof(telemetry_command_list) / sizeof(sys_command_t),
+        .commands = telemetry_command_list
+    };
+
+    struct tcp_pcb *pcb;
+
+    if(ws.listen || (pcb = tcp_new()) == NULL)
+        return false;
+
+    if(tcp_bind(pcb, IP_ADDR_ANY, WS_TELEMETRY_PORT) != ERR_OK || (ws.listen = tcp_listen(pcb)) == NULL) {
+        tcp_close(pcb);
+        return false;
+    }
+
+    tcp_accept(ws.listen, ws_accept);
+
+#if RT_SCHED_ENABLE
+    rt_task_register(&poll_task);
+#else
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = ws_execute_realtime;
+#endif
+
+    system_register_commands(&telemetry_commands);
+
+    telemetry_set_rate(WS_TELEMETRY_HZ);
+
+    return true;
+}
+
+#endif // WS_TELEMETRY_ENABLE
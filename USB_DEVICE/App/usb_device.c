@@ -32,6 +32,10 @@
 /* USER CODE END Includes */
 
 /* USER CODE BEGIN PV */
+#if USB_BULK_ENABLE
+/* CDC with a vendor bulk IN interface for telemetry, see Src/usb_bulk.c */
+extern USBD_ClassTypeDef USBD_CDC_Bulk;
+#endif
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE END PV */
@@ -73,7 +77,11 @@ void MX_USB_DEVICE_Init(void)
   {
     Error_Handler();
   }
+#if USB_BULK_ENABLE
+  if (USBD_RegisterClass(&hUsbDeviceFS, &USBD_CDC_Bulk) != USBD_OK)
+#else
   if (USBD_RegisterClass(&hUsbDeviceFS, &USBD_CDC) != USBD_OK)
+#endif
   {
     Error_Handler();
   }
@@ -26,9 +26,28 @@
 #include "usbd_cdc.h"
 
 /* USER CODE BEGIN Includes */
+#include "irq_priority.h"
 
 /* USER CODE END Includes */
 
+/*
+ * USB_HS_ULPI: the HS core runs at high speed (480 Mbit/s) through an external ULPI PHY instead
+ * of at full speed on the internal FS PHY, for boards that have one wired to the default ULPI
+ * pins. The CDC class then uses 512 byte bulk packets. A PHY reset line, if any, is left to the
+ * board. Must be a build flag as this file does not include driver.h.
+ */
+#ifndef USB_HS_ULPI
+#define USB_HS_ULPI 0
+#endif
+
+/*
+ * CPU_FREQ_550MHZ: PLL1Q is no longer 48MHz, the USB clock is the HSI48 oscillator (enabled in
+ * SystemClock_Config()), trimmed to the host SOF by the CRS. Must be a build flag as well.
+ */
+#ifndef CPU_FREQ_550MHZ
+#define CPU_FREQ_550MHZ 0
+#endif
+
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
 /* Private macro -------------------------------------------------------------*/
@@ -76,12 +95,30 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
   /** Initializes the peripherals clock
   */
     PeriphClkInitStruct.PeriphClockSelection = RCC_PERIPHCLK_USB;
+#if CPU_FREQ_550MHZ
+    PeriphClkInitStruct.UsbClockSelection = RCC_USBCLKSOURCE_HSI48;
+#else
     PeriphClkInitStruct.UsbClockSelection = RCC_USBCLKSOURCE_PLL;
+#endif
     if (HAL_RCCEx_PeriphCLKConfig(&PeriphClkInitStruct) != HAL_OK)
     {
       Error_Handler();
     }
 
+#if CPU_FREQ_550MHZ
+    RCC_CRSInitTypeDef CRSInitStruct = {
+        .Prescaler = RCC_CRS_SYNC_DIV1,
+        .Source = RCC_CRS_SYNC_SOURCE_USB1,
+        .Polarity = RCC_CRS_SYNC_POLARITY_RISING,
+        .ReloadValue = __HAL_RCC_CRS_RELOADVALUE_CALCULATE(48000000, 1000),
+        .ErrorLimitValue = RCC_CRS_ERRORLIMIT_DEFAULT,
+        .HSI48CalibrationValue = RCC_CRS_HSI48CALIBRATION_DEFAULT
+    };
+
+    __HAL_RCC_CRS_CLK_ENABLE();
+    HAL_RCCEx_CRSConfig(&CRSInitStruct);
+#endif
+
   /** Enable USB Voltage detector
   */
     HAL_PWREx_EnableUSBVoltageDetector();
@@ -91,6 +128,41 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
     PA11     ------> USB_DM
     PA12     ------> USB_DP
     */
+#if USB_HS_ULPI
+    __HAL_RCC_GPIOB_CLK_ENABLE();
+    __HAL_RCC_GPIOC_CLK_ENABLE();
+    /**USB GPIO Configuration
+    PA3      ------> USB_OTG_HS_ULPI_D0
+    PA5      ------> USB_OTG_HS_ULPI_CK
+    PB0      ------> USB_OTG_HS_ULPI_D1
+    PB1      ------> USB_OTG_HS_ULPI_D2
+    PB5      ------> USB_OTG_HS_ULPI_D7
+    PB10     ------> USB_OTG_HS_ULPI_D3
+    PB11     ------> USB_OTG_HS_ULPI_D4
+    PB12     ------> USB_OTG_HS_ULPI_D5
+    PB13     ------> USB_OTG_HS_ULPI_D6
+    PC0      ------> USB_OTG_HS_ULPI_STP
+    PC2      ------> USB_OTG_HS_ULPI_DIR
+    PC3      ------> USB_OTG_HS_ULPI_NXT
+    */
+    /* PC2 and PC3 are disconnected from their analog pads */
+    HAL_SYSCFG_AnalogSwitchConfig(SYSCFG_SWITCH_PC2|SYSCFG_SWITCH_PC3, SYSCFG_SWITCH_PC2_OPEN|SYSCFG_SWITCH_PC3_OPEN);
+
+    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Pull = GPIO_NOPULL;
+    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+    GPIO_InitStruct.Alternate = GPIO_AF10_OTG1_HS;
+    GPIO_InitStruct.Pin = GPIO_PIN_3|GPIO_PIN_5;
+    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+    GPIO_InitStruct.Pin = GPIO_PIN_0|GPIO_PIN_1|GPIO_PIN_5|GPIO_PIN_10|GPIO_PIN_11|GPIO_PIN_12|GPIO_PIN_13;
+    HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+    GPIO_InitStruct.Pin = GPIO_PIN_0|GPIO_PIN_2|GPIO_PIN_3;
+    HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+    /* Peripheral clock enable, the ULPI clock is supplied by the PHY */
+    __HAL_RCC_USB_OTG_HS_CLK_ENABLE();
+    __HAL_RCC_USB_OTG_HS_ULPI_CLK_ENABLE();
+#else
     GPIO_InitStruct.Pin = GPIO_PIN_11|GPIO_PIN_12;
     GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
     GPIO_InitStruct.Pull = GPIO_NOPULL;
@@ -100,9 +172,10 @@ void HAL_PCD_MspInit(PCD_HandleTypeDef* pcdHandle)
 
     /* Peripheral clock enable */
     __HAL_RCC_USB_OTG_HS_CLK_ENABLE();
+#endif
 
     /* Peripheral interrupt init */
-    HAL_NVIC_SetPriority(OTG_HS_IRQn, 0, 0);
+    HAL_NVIC_SetPriority(OTG_HS_IRQn, IRQ_PRIO_USB, 0);
     HAL_NVIC_EnableIRQ(OTG_HS_IRQn);
   /* USER CODE BEGIN USB_OTG_HS_MspInit 1 */
 
@@ -119,6 +192,9 @@ void HAL_PCD_MspDeInit(PCD_HandleTypeDef* pcdHandle)
   /* USER CODE END USB_OTG_HS_MspDeInit 0 */
     /* Peripheral clock disable */
     __HAL_RCC_USB_OTG_HS_CLK_DISABLE();
+#if USB_HS_ULPI
+    __HAL_RCC_USB_OTG_HS_ULPI_CLK_DISABLE();
+#endif
 
     /* Peripheral interrupt Deinit*/
     HAL_NVIC_DisableIRQ(OTG_HS_IRQn);
@@ -339,9 +415,15 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
 
   hpcd_USB_OTG_HS.Instance = USB_OTG_HS;
   hpcd_USB_OTG_HS.Init.dev_endpoints = 9;
+#if USB_HS_ULPI
+  hpcd_USB_OTG_HS.Init.speed = PCD_SPEED_HIGH;
+  hpcd_USB_OTG_HS.Init.dma_enable = DISABLE;
+  hpcd_USB_OTG_HS.Init.phy_itface = USB_OTG_ULPI_PHY;
+#else
   hpcd_USB_OTG_HS.Init.speed = PCD_SPEED_FULL;
   hpcd_USB_OTG_HS.Init.dma_enable = DISABLE;
   hpcd_USB_OTG_HS.Init.phy_itface = USB_OTG_EMBEDDED_PHY;
+#endif
   hpcd_USB_OTG_HS.Init.Sof_enable = DISABLE;
   hpcd_USB_OTG_HS.Init.low_power_enable = DISABLE;
   hpcd_USB_OTG_HS.Init.lpm_enable = DISABLE;
@@ -369,9 +451,21 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev)
   HAL_PCD_RegisterIsoInIncpltCallback(&hpcd_USB_OTG_HS, PCD_ISOINIncompleteCallback);
 #endif /* USE_HAL_PCD_REGISTER_CALLBACKS */
   /* USER CODE BEGIN TxRx_Configuration */
+#if USB_BULK_ENABLE
+  /* 4 KB shared with the telemetry bulk IN endpoint EP3 (Src/usb_bulk.c): 1.4 KB RX FIFO, 1 KB TX
+     FIFO for two 512 byte packets on each bulk IN endpoint, EP2 CDC notifications */
+  HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_HS, 0x160);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 0, 0x40);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 1, 0x100);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 2, 0x10);
+  HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 3, 0x100);
+#else
+  /* Sized for high speed too: 2 KB RX FIFO for 512 byte OUT packets, 1.5 KB TX FIFO on the bulk
+     IN endpoint for two 512 byte packets */
   HAL_PCDEx_SetRxFiFo(&hpcd_USB_OTG_HS, 0x200);
   HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 0, 0x80);
   HAL_PCDEx_SetTxFiFo(&hpcd_USB_OTG_HS, 1, 0x174);
+#endif
   /* USER CODE END TxRx_Configuration */
   }
   return USBD_OK;
@@ -63,7 +63,11 @@
   */
 
 /*---------- -----------*/
+#if USB_BULK_ENABLE
+#define USBD_MAX_NUM_INTERFACES     3U  /* CDC + vendor bulk interface 2 */
+#else
 #define USBD_MAX_NUM_INTERFACES     1U
+#endif
 /*---------- -----------*/
 #define USBD_MAX_NUM_CONFIGURATION     1U
 /*---------- -----------*/
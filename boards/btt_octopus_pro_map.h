@@ -36,6 +36,7 @@
 #define SERIAL1_PORT                21      // GPIOD: TX = 5, RX = 6,   USART 2
 #define SERIAL2_PORT                32      // GPIOD: TX = 8, RX = 9,   USART 3
 #define I2C_PORT                    1       // GPIOB: SCL = 8, SDA = 9
+//#define EDM_PULSER_I2C_PORT       2       // GPIOB: SCL = 10 (RGB), SDA = 11 (HE3), PULSER on its own bus
 #define SPI_PORT                    1       // GPIOA: SCK = 5, MISO = 6, MOSI = 7
 
 //we have multiple SPI but only one can be used, for now
@@ -80,6 +81,8 @@
 #define Z_ENABLE_PIN                5
 
 // Define homing/hard limit switch input pins.
+// With the DIAG jumpers fitted MIN1 - MIN8 are the StallGuard outputs of the drivers in the
+// same slot, build with TMC_DIAG_HOMING for sensorless homing.
 #define X_LIMIT_PORT                GPIOG
 #define X_LIMIT_PIN                 6       // MIN1
 #define Y_LIMIT_PORT                GPIOG
@@ -0,0 +1,232 @@
+/*
+  bench.c - host microbenchmarks of the EDM plugin
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  The plugin is included as a whole so that the benchmarks can call its static functions, the
+  core, the HAL and the I2C bus are the mocks in mock.c. Timings are host timings: use them to
+  compare revisions of the plugin on the same machine, not as MCU figures.
+
+  edm_bench [scale] - scale multiplies the iteration counts, default 1
+
+  Output, one line per benchmark:
+
+    <name> n=<iterations> ns_op=<ns per iteration>[ <extra>]
+
+  A new controller in the sample path (e.g. a replacement for servo_update()) gets its own entry
+  in benches[] next to servo_update.
+*/
+
+#include "plugin_edm.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mock.h"
+
+typedef struct {
+    const char *name;
+    uint32_t n;
+    void (*run)(uint32_t n);
+    void (*extra)(char *buf, size_t size, uint32_t n);
+} bench_t;
+
+static log_entry_t sample_entry (uint32_t i)
+{
+    return (log_entry_t){
+        .t_us = i * 1000,
+        .status_flags = i & ST_MOTION,
+        .r_open = (uint8_t)(i * 13),
+        .r_short = (uint8_t)(i * 37),
+        .r_pulse = 180,
+        .n_pulse = (uint8_t)i,
+    };
+}
+
+static void fill_log (void)
+{
+    exec_mode_log(true, false, false);
+    for(uint32_t i = 0; i < log_depth; i++)
+        add_log(sample_entry(i));
+    edm_log.active = false;
+}
+
+// Log
+
+static void run_log_append (uint32_t n)
+{
+    exec_mode_log(true, false, false);
+    for(uint32_t i = 0; i < n; i++)
+        add_log(sample_entry(i));
+    edm_log.active = false;
+}
+
+static void run_log_dump_binary (uint32_t n)
+{
+    while(n--)
+        print_log_binary();
+}
+
+static void run_log_dump_text (uint32_t n)
+{
+    while(n--)
+        print_log_text();
+}
+
+static void extra_dump (char *buf, size_t size, uint32_t n)
+{
+    snprintf(buf, size, "entries=%lu bytes_op=%llu", (unsigned long)log_depth,
+              (unsigned long long)(mock_stats.stream_bytes / n));
+}
+
+// M-codes, validate and execute as the parser calls them.
+
+static void mcode_run (user_mcode_t code, const parser_block_t *words, uint32_t n)
+{
+    parser_block_t block;
+
+    while(n--) {
+        block = *words;
+        block.user_mcode = code;
+        if(mcode_check(code) != UserMCode_Normal || mcode_validate(&block) != Status_OK) {
+            fprintf(stderr, "M%u rejected\n", code);
+            exit(1);
+        }
+        mcode_execute(mock_state, &block);
+    }
+}
+
+static void run_mcode_servo (uint32_t n)
+{
+    parser_block_t block = {0};
+
+    block.words.p = block.words.q = block.words.r = block.words.s = 1;
+    block.values.p = 1.0f;
+    block.values.q = 50.0f;
+    block.values.r = 20.0f;
+    block.values.s = 1.0f;
+
+    mcode_run(EDM_MCODE_SERVO, &block, n);
+}
+
+static void run_mcode_start_stop (uint32_t n)
+{
+    parser_block_t start = {0}, stop = {0};
+
+    start.words.p = start.words.q = start.words.r = 1;
+    start.values.q = 2.0f;
+    start.values.r = 30.0f;
+
+    for(uint32_t i = 0; i < n; i++) {
+        // Alternating pulse durations defeat the register shadow, every start writes PULSER.
+        start.values.p = i & 1 ? 500.0f : 400.0f;
+        mcode_run(EDM_MCODE_START_TNEG, &start, 1);
+        mcode_run(EDM_MCODE_STOP, &stop, 1);
+    }
+}
+
+static void run_mcode_read (uint32_t n)
+{
+    parser_block_t block = {0};
+
+    mcode_run(EDM_MCODE_READ, &block, n);
+}
+
+static void extra_i2c (char *buf, size_t size, uint32_t n)
+{
+    snprintf(buf, size, "i2c_writes_op=%.1f", (double)mock_stats.i2c_writes / n);
+}
+
+static void extra_stream (char *buf, size_t size, uint32_t n)
+{
+    snprintf(buf, size, "bytes_op=%llu", (unsigned long long)(mock_stats.stream_bytes / n));
+}
+
+// Sample path
+
+static void run_servo_update (uint32_t n)
+{
+    set_gate(true);
+    for(uint32_t i = 0; i < n; i++)
+        servo_update(i * 1000, (uint8_t)(i * 13 % 60), (uint8_t)(i * 37 % 40));
+    set_gate(false);
+}
+
+static void run_poll (uint32_t n)
+{
+    exec_mode_log(true, false, false);
+    set_gate(true);
+    while(n--)
+        edm_poll_start();
+    set_gate(false);
+    edm_log.active = false;
+}
+
+static void extra_poll (char *buf, size_t size, uint32_t n)
+{
+    snprintf(buf, size, "i2c_reads_op=%.2f errs=%lu", (double)mock_stats.i2c_reads / n,
+              (unsigned long)edm_poll_err_cnt);
+}
+
+static const bench_t benches[] = {
+    { "log_append",       10000000, run_log_append,       NULL },
+    { "log_dump_binary",  20,       run_log_dump_binary,  extra_dump },
+    { "log_dump_text",    20,       run_log_dump_text,    extra_dump },
+    { "mcode_servo",      1000000,  run_mcode_servo,      NULL },
+    { "mcode_start_stop", 200000,   run_mcode_start_stop, extra_i2c },
+    { "mcode_read",       100000,   run_mcode_read,       extra_stream },
+    { "servo_update",     10000000, run_servo_update,     NULL },
+    { "poll_sample",      2000000,  run_poll,             extra_poll },
+};
+
+int main (int argc, char **argv)
+{
+    char extra[80];
+    uint32_t scale = argc > 1 ? (uint32_t)atoi(argv[1]) : 1;
+
+    mock_init();
+    edm_init();
+
+    if(edm_init_status != 0) {
+        fprintf(stderr, "edm_init() failed: %u\n", edm_init_status);
+        return 1;
+    }
+
+    for(uint_fast8_t idx = 0; idx < sizeof(benches) / sizeof(bench_t); idx++) {
+
+        const bench_t *bench = &benches[idx];
+        uint32_t n = bench->n * (scale ? scale : 1);
+
+        if(bench->run == run_log_dump_binary || bench->run == run_log_dump_text)
+            fill_log();
+
+        memset(&mock_stats, 0, sizeof(mock_stats));
+
+        uint64_t t = mock_nanos();
+        bench->run(n);
+        t = mock_nanos() - t;
+
+        *extra = '\0';
+        if(bench->extra)
+            bench->extra(extra, sizeof(extra), n);
+
+        printf("%-16s n=%-9lu ns_op=%-10.1f %s\n", bench->name, (unsigned long)n, (double)t / n, extra);
+    }
+
+    return 0;
+}
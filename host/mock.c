@@ -0,0 +1,347 @@
+/*
+  mock.c - host stand-ins for the grblHAL core, the HAL and the I2C driver
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Everything runs on the calling thread: timers are claimed but never fire, queued I2C
+  transactions complete before i2c_queue_transaction() returns and stream output is only counted.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#include "mock.h"
+#include "flash.h"
+#include "i2c.h"
+#include "grbl/nvs_buffer.h"
+#include "grbl/vfs.h"
+
+#define MOCK_F_MCU 550  // MHz, the cycle counter rate
+
+hal_t hal;
+grbl_t grbl;
+system_t sys;
+settings_t settings;
+GPIO_TypeDef mock_gpio;
+
+mock_stats_t mock_stats;
+uint8_t mock_pulser_regs[128][0x20];
+uint32_t mock_short_every = 50, mock_open_every = 7;
+sys_state_t mock_state = STATE_IDLE;
+uint_fast8_t mock_planner_blocks = 0;
+setting_details_t *mock_settings = NULL;
+
+static uint8_t flash_emul[128 * 1024];
+static uint8_t nvs[1024];
+static nvs_address_t nvs_used = 0;
+static uint32_t sample_n = 0;
+
+uint64_t mock_nanos (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+uint32_t mock_cyccnt (void)
+{
+    return (uint32_t)(mock_nanos() * MOCK_F_MCU / 1000);
+}
+
+static uint64_t get_micros (void)
+{
+    return mock_nanos() / 1000;
+}
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return (uint32_t)(mock_nanos() / 1000000);
+}
+
+static void stream_write (const char *s)
+{
+    mock_stats.stream_bytes += strlen(s);
+}
+
+static void stream_write_n (const uint8_t *s, uint16_t len)
+{
+    mock_stats.stream_bytes += len;
+}
+
+static uint16_t stream_get_tx_buffer_count (void)
+{
+    return 0;
+}
+
+static void claim_motor (uint_fast8_t axis_id, bool claim)
+{
+}
+
+static hal_timer_t timer_claim (timer_cap_t cap, uint32_t timebase)
+{
+    static int timer;
+
+    return &timer;
+}
+
+static bool timer_configure (hal_timer_t timer, timer_cfg_t *cfg)
+{
+    return true;
+}
+
+static bool timer_start (hal_timer_t timer, uint32_t period)
+{
+    return true;
+}
+
+static bool timer_stop (hal_timer_t timer)
+{
+    return true;
+}
+
+static nvs_transfer_result_t memcpy_to_nvs (nvs_address_t destination, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(destination + size > sizeof(nvs))
+        return NVS_TransferResult_Failed;
+
+    memcpy(&nvs[destination], source, size);
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t memcpy_from_nvs (uint8_t *destination, nvs_address_t source, uint32_t size, bool with_checksum)
+{
+    if(source + size > sizeof(nvs))
+        return NVS_TransferResult_Failed;
+
+    memcpy(destination, &nvs[source], size);
+
+    return NVS_TransferResult_OK;
+}
+
+static bool enqueue_realtime_command (char c)
+{
+    return true;
+}
+
+void mock_init (void)
+{
+    hal.f_mcu = MOCK_F_MCU;
+    hal.f_step_timer = MOCK_F_MCU * 1000000 / 2;
+    hal.get_micros = get_micros;
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.stream.write = stream_write;
+    hal.stream.write_n = stream_write_n;
+    hal.stream.get_tx_buffer_count = stream_get_tx_buffer_count;
+    hal.stepper.claim_motor = claim_motor;
+    hal.timer.claim = timer_claim;
+    hal.timer.configure = timer_configure;
+    hal.timer.start = timer_start;
+    hal.timer.stop = timer_stop;
+    hal.nvs.type = NVS_Emulated;
+    hal.nvs.memcpy_to_nvs = memcpy_to_nvs;
+    hal.nvs.memcpy_from_nvs = memcpy_from_nvs;
+
+    grbl.enqueue_realtime_command = enqueue_realtime_command;
+
+    for(uint_fast8_t idx = 0; idx < N_AXIS; idx++)
+        settings.axis[idx].steps_per_mm = 400.0f;
+
+    memset(flash_emul, 0xFF, sizeof(flash_emul));
+}
+
+// Core
+
+sys_state_t state_get (void)
+{
+    return mock_state;
+}
+
+uint_fast8_t plan_get_block_buffer_count (void)
+{
+    return mock_planner_blocks;
+}
+
+void system_raise_alarm (alarm_code_t alarm)
+{
+    mock_stats.alarms++;
+}
+
+void report_message (const char *msg, message_type_t type)
+{
+    mock_stats.stream_bytes += strlen(msg);
+}
+
+void report_plugin (const char *name, const char *version)
+{
+}
+
+// Address 0 is taken as allocation failure by the plugins, as in the core.
+nvs_address_t nvs_alloc (size_t size)
+{
+    if(nvs_used == 0)
+        nvs_used = 1;
+
+    if(nvs_used + size > sizeof(nvs))
+        return 0;
+
+    nvs_used += size;
+
+    return nvs_used - size;
+}
+
+void settings_register (setting_details_t *details)
+{
+    mock_settings = details;
+    details->load();
+}
+
+bool rtc_stamp_get (rtc_stamp_t *stamp)
+{
+    return false;
+}
+
+int rtc_stamp_print (char *buf, size_t size)
+{
+    *buf = '\0';
+
+    return 0;
+}
+
+// VFS, a single file that only counts what is written to it.
+
+static vfs_file_t vfs_file;
+
+vfs_file_t *vfs_open (const char *filename, const char *mode)
+{
+    return &vfs_file;
+}
+
+void vfs_close (vfs_file_t *file)
+{
+}
+
+size_t vfs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    file->size += size * count;
+    mock_stats.vfs_bytes += size * count;
+
+    return count;
+}
+
+// Flash, the EEPROM emulation sector in RAM.
+
+void *flash_emul_base (void)
+{
+    return flash_emul;
+}
+
+bool flash_emul_erase (void)
+{
+    memset(flash_emul, 0xFF, sizeof(flash_emul));
+
+    return true;
+}
+
+bool flash_emul_program (uint32_t offset, const void *source, uint32_t size)
+{
+    if(offset + size > sizeof(flash_emul))
+        return false;
+
+    memcpy(&flash_emul[offset], source, size);
+
+    return true;
+}
+
+// I2C, PULSER register files.
+
+static void pulser_sample (uint8_t *regs)
+{
+    uint32_t n = ++sample_n;
+    bool is_short = mock_short_every && n % mock_short_every == 0;
+    bool is_open = !is_short && mock_open_every && n % mock_open_every == 0;
+
+    regs[0] = is_open ? 0 : 20 + n % 8;                 // n_pulse
+    regs[3] = is_open ? 0 : 180;                        // r_pulse
+    regs[4] = is_short ? 200 : (uint8_t)(n * 37 % 40);  // r_short
+    regs[5] = is_open ? 255 : (uint8_t)(n * 13 % 60);   // r_open
+}
+
+static void mem_read (i2c_address_t address, uint16_t reg, uint8_t *data, uint16_t count)
+{
+    uint8_t *regs = mock_pulser_regs[address & 0x7F];
+
+    if(reg == 0x10)
+        pulser_sample(&regs[reg]);
+
+    while(count--)
+        *data++ = reg < sizeof(mock_pulser_regs[0]) ? regs[reg++] : 0;
+
+    mock_stats.i2c_reads++;
+}
+
+static void mem_write (i2c_address_t address, uint16_t reg, const uint8_t *data, uint16_t count)
+{
+    uint8_t *regs = mock_pulser_regs[address & 0x7F];
+
+    while(count-- && reg < sizeof(mock_pulser_regs[0]))
+        regs[reg++] = *data++;
+
+    mock_stats.i2c_writes++;
+}
+
+void i2c_start (void)
+{
+}
+
+bool i2c_bus_negotiate (i2c_bus_id_t bus, i2c_address_t i2cAddr)
+{
+    return true;
+}
+
+uint32_t i2c_bus_get_speed (i2c_bus_id_t bus)
+{
+    return 1000;
+}
+
+bool i2c_bus_transfer (i2c_bus_id_t bus, i2c_transfer_t *i2c, bool read)
+{
+    if(read)
+        mem_read(i2c->address, i2c->word_addr, i2c->data, i2c->count);
+    else
+        mem_write(i2c->address, i2c->word_addr, i2c->data, i2c->count);
+
+    return true;
+}
+
+bool i2c_queue_transaction (i2c_transaction_t *transaction)
+{
+    mock_stats.i2c_queued++;
+
+    if(transaction->op == I2C_OpMemRead)
+        mem_read(transaction->address, transaction->word_addr, transaction->data, transaction->count);
+    else
+        mem_write(transaction->address, transaction->word_addr, transaction->data, transaction->count);
+
+    if(transaction->callback)
+        transaction->callback(true, transaction->context);
+
+    return true;
+}
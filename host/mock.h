@@ -0,0 +1,51 @@
+/*
+  mock.h - host stand-ins for the grblHAL core, the HAL and the I2C driver
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "driver.h"
+#include "grbl/settings.h"
+
+typedef struct {
+    uint64_t stream_bytes;      // written to hal.stream
+    uint32_t i2c_reads;
+    uint32_t i2c_writes;
+    uint32_t i2c_queued;        // i2c_queue_transaction() calls, completed at once
+    uint32_t alarms;
+    uint64_t vfs_bytes;         // written to the log file (EDM_LOG_PERSIST)
+} mock_stats_t;
+
+extern mock_stats_t mock_stats;
+
+// PULSER register file behind the mock I2C bus, one per address. Reads of the REG_CKP_N_PULSE block
+// (0x10) return the next sample of a synthetic gap: mostly sparking, with a short every
+// mock_short_every samples and an open gap every mock_open_every samples.
+extern uint8_t mock_pulser_regs[128][0x20];
+extern uint32_t mock_short_every, mock_open_every;
+
+extern sys_state_t mock_state;
+extern uint_fast8_t mock_planner_blocks;
+
+// Plugin settings registered with settings_register(), load() is called at once as the core does
+// at startup. The NVS is blank (zeroed) RAM until saved to.
+extern setting_details_t *mock_settings;
+
+// Sets up hal and grbl with the mock handlers, call before edm_init().
+void mock_init (void);
+uint64_t mock_nanos (void);
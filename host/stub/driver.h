@@ -0,0 +1,115 @@
+/*
+  driver.h - host stand-in for Inc/driver.h, see host/Makefile
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Same guard as Inc/driver.h, the Inc/ headers include that one from their own directory.
+#ifndef __DRIVER_H__
+#define __DRIVER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "grbl/hal.h"
+
+// Feature flags left undefined are 0 as on the target with the default configuration.
+
+#ifndef EDM_PULSER_I2C_PORT
+#define EDM_PULSER_I2C_PORT 0
+#endif
+
+// Memory placement has no meaning on the host.
+#define ITCM_CODE
+#define DTCM_DATA
+#define DTCM_BSS
+#define DMA_BUFFER
+
+// CMSIS core stand-ins: interrupts are not preempting on the host, the cycle counter runs
+// from the monotonic clock (host/mock.c) at mock_f_mcu MHz.
+#define __disable_irq()
+#define __enable_irq()
+#define __get_PRIMASK() 0UL
+#define __set_PRIMASK(primask) (void)(primask)
+#define __CLZ(x) ((x) ? (uint32_t)__builtin_clz(x) : 32UL)
+
+typedef struct {
+    volatile uint32_t CYCCNT;
+} DWT_Type;
+
+uint32_t mock_cyccnt (void);
+
+#define DWT ((const DWT_Type *)&(const DWT_Type){ .CYCCNT = mock_cyccnt() })
+
+// HAL GPIO, the gate output is a variable.
+typedef struct {
+    uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef struct {
+    uint32_t Pin;
+    uint32_t Mode;
+    uint32_t Pull;
+    uint32_t Speed;
+    uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+#define GPIO_MODE_OUTPUT_PP    1
+#define GPIO_NOPULL            0
+#define GPIO_SPEED_FREQ_MEDIUM 1
+
+extern GPIO_TypeDef mock_gpio;
+
+#define PULSER_GATE_PORT (&mock_gpio)
+#define PULSER_GATE_PIN  15
+
+// Gates of the additional units with EDM_PULSER_COUNT > 1, normally from the board map.
+#ifndef EDM_PULSER1_GATE_PORT
+#define EDM_PULSER1_GATE_PORT (&mock_gpio)
+#define EDM_PULSER1_GATE_PIN  14
+#endif
+#ifndef EDM_PULSER2_GATE_PORT
+#define EDM_PULSER2_GATE_PORT (&mock_gpio)
+#define EDM_PULSER2_GATE_PIN  13
+#endif
+#ifndef EDM_PULSER3_GATE_PORT
+#define EDM_PULSER3_GATE_PORT (&mock_gpio)
+#define EDM_PULSER3_GATE_PIN  12
+#endif
+
+#define HAL_GPIO_Init(port, init) (void)(init)
+#define DIGITAL_OUT(port, pin, on) { if(on) (port)->ODR |= (pin); else (port)->ODR &= ~(pin); }
+
+// RTC stamps of log dumps and log pages, the RTC is never set on the host.
+typedef struct {
+    uint32_t epoch;
+    uint32_t us;
+    uint32_t t_us;
+} rtc_stamp_t;
+
+bool rtc_stamp_get (rtc_stamp_t *stamp);
+int rtc_stamp_print (char *buf, size_t size);
+
+// EDM_LOG_PERSIST writes to the mock VFS (host/mock.c).
+#ifndef EDM_LOG_FILE
+#define EDM_LOG_FILE "/edm.log"
+#endif
+
+// Flash programming word of the STM32H7.
+#define FLASH_WRITE_SIZE 32
+
+#endif // __DRIVER_H__
@@ -0,0 +1,303 @@
+/*
+  hal.h - host stand-in for the grblHAL core API used by the plugins, see host/Makefile
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Only the declarations the host build needs, with the names and layout of the core. Where the
+  core type is a large union or bitfield only the members used here are declared.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define N_AXIS 3
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+
+#define ASCII_EOL "\r\n"
+
+#define Off 0
+#define On  1
+
+#define bit(n) (1UL << (n))
+
+#define CMD_CYCLE_START '~'
+#define CMD_FEED_HOLD   '!'
+
+// State machine
+
+typedef uint_fast16_t sys_state_t;
+
+#define STATE_IDLE          0
+#define STATE_ALARM         bit(0)
+#define STATE_CHECK_MODE    bit(1)
+#define STATE_HOMING        bit(2)
+#define STATE_CYCLE         bit(3)
+#define STATE_HOLD          bit(4)
+#define STATE_JOG           bit(5)
+#define STATE_SAFETY_DOOR   bit(6)
+#define STATE_SLEEP         bit(7)
+#define STATE_ESTOP         bit(8)
+#define STATE_TOOL_CHANGE   bit(9)
+
+typedef enum {
+    Hold_NotHolding = 0,
+    Hold_Complete = 1,
+    Hold_Pending = 2
+} hold_state_t;
+
+sys_state_t state_get (void);
+
+// Status, alarm and message codes
+
+typedef enum {
+    Status_OK = 0,
+    Status_InvalidStatement = 3,
+    Status_SelfTestFailed = 49,
+    Status_GcodeUnsupportedCommand = 20,
+    Status_GcodeValueWordMissing = 31,
+    Status_GcodeUnusedWords = 36,
+    Status_GcodeValueOutOfRange = 34,
+    Status_Unhandled = 253
+} status_code_t;
+
+typedef enum {
+    Alarm_None = 0,
+    Alarm_SelftestFailed = 16
+} alarm_code_t;
+
+typedef enum {
+    Message_Plain = 0,
+    Message_Info,
+    Message_Warning
+} message_type_t;
+
+void report_message (const char *msg, message_type_t type);
+void report_plugin (const char *name, const char *version);
+void system_raise_alarm (alarm_code_t alarm);
+
+// Parser
+
+typedef union {
+    uint32_t mask;
+    struct {
+        uint32_t a :1, b :1, c :1, d :1, e :1, f :1, h :1, i :1,
+                 j :1, k :1, l :1, n :1, o :1, p :1, q :1, r :1,
+                 s :1, t :1, x :1, y :1, z :1;
+    };
+} parameter_words_t;
+
+typedef struct {
+    float d, e, f, h, i, j, k, p, q, r, s, t;
+    float xyz[N_AXIS];
+    uint8_t l;
+} gc_values_t;
+
+typedef uint16_t user_mcode_t;
+
+typedef enum {
+    UserMCode_Unsupported = 0,
+    UserMCode_Normal = 1,
+    UserMCode_NoValueWords = 2
+} user_mcode_type_t;
+
+typedef struct {
+    gc_values_t values;
+    parameter_words_t words;
+    user_mcode_t user_mcode;
+    bool user_mcode_sync;
+} parser_block_t;
+
+typedef user_mcode_type_t (*user_mcode_check_ptr)(user_mcode_t mcode);
+typedef status_code_t (*user_mcode_validate_ptr)(parser_block_t *gc_block);
+typedef void (*user_mcode_execute_ptr)(uint_fast16_t state, parser_block_t *gc_block);
+
+typedef struct {
+    user_mcode_check_ptr check;
+    user_mcode_validate_ptr validate;
+    user_mcode_execute_ptr execute;
+} user_mcode_ptrs_t;
+
+// Settings and system state
+
+typedef struct {
+    float steps_per_mm;
+    float max_rate;
+    float acceleration;
+    float max_travel;
+} axis_settings_t;
+
+typedef struct {
+    axis_settings_t axis[N_AXIS];
+} settings_t;
+
+extern settings_t settings;
+
+typedef struct {
+    bool probe_succeeded;
+} system_flags_t;
+
+typedef struct {
+    bool execute_sys_motion;
+} step_control_t;
+
+typedef struct {
+    bool abort;
+    hold_state_t holding_state;
+    system_flags_t flags;
+    step_control_t step_control;
+    int32_t position[N_AXIS];
+    int32_t probe_position[N_AXIS];
+} system_t;
+
+extern system_t sys;
+
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps);
+
+// Planner, protocol and motion control
+
+typedef struct {
+    uint32_t steps[N_AXIS];
+} plan_block_t;
+
+typedef struct {
+    float feed_rate;
+    struct {
+        uint8_t value;
+    } condition;
+} plan_line_data_t;
+
+typedef void (*foreground_task_ptr)(void *data);
+
+uint_fast8_t plan_get_block_buffer_count (void);
+plan_block_t *plan_get_current_block (void);
+void plan_data_init (plan_line_data_t *plan_data);
+bool protocol_buffer_synchronize (void);
+bool protocol_execute_realtime (void);
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+bool mc_line (float *target, plan_line_data_t *pl_data);
+uint8_t mc_probe_cycle (float *target, plan_line_data_t *pl_data, uint8_t parser_flags);
+
+// HAL
+
+typedef struct {
+    uint8_t triggered :1,
+            connected :1;
+} probe_state_t;
+
+typedef void (*probe_configure_ptr)(bool is_probe_away, bool probing);
+typedef void (*probe_connected_toggle_ptr)(void);
+typedef probe_state_t (*probe_get_state_ptr)(void);
+
+typedef void *hal_timer_t;
+typedef void (*timer_irq_handler_ptr)(void *context);
+
+typedef struct {
+    uint8_t periodic :1;
+} timer_cap_t;
+
+typedef struct {
+    void *context;
+    bool single_shot;
+    timer_irq_handler_ptr timeout_callback;
+} timer_cfg_t;
+
+typedef enum {
+    NVS_None = 0,
+    NVS_EEPROM,
+    NVS_FRAM,
+    NVS_Flash,
+    NVS_Emulated
+} nvs_type;
+
+typedef uint32_t nvs_address_t;
+
+typedef enum {
+    NVS_TransferResult_Failed = 0,
+    NVS_TransferResult_Busy,
+    NVS_TransferResult_OK
+} nvs_transfer_result_t;
+
+typedef struct {
+    void (*write)(const char *s);
+    void (*write_n)(const uint8_t *s, uint16_t len);
+    uint16_t (*get_tx_buffer_count)(void);
+} io_stream_t;
+
+typedef struct {
+    uint32_t f_mcu;
+    uint32_t f_step_timer;
+    uint32_t (*get_elapsed_ticks)(void);
+    uint64_t (*get_micros)(void);
+    io_stream_t stream;
+    struct {
+        void (*claim_motor)(uint_fast8_t axis_id, bool claim);
+    } stepper;
+    struct {
+        hal_timer_t (*claim)(timer_cap_t cap, uint32_t timebase);
+        bool (*configure)(hal_timer_t timer, timer_cfg_t *cfg);
+        bool (*start)(hal_timer_t timer, uint32_t period);
+        bool (*stop)(hal_timer_t timer);
+    } timer;
+    struct {
+        probe_configure_ptr configure;
+        probe_connected_toggle_ptr connected_toggle;
+        probe_get_state_ptr get_state;
+    } probe;
+    struct {
+        nvs_type type;
+        nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t destination, uint8_t *source, uint32_t size, bool with_checksum);
+        nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *destination, nvs_address_t source, uint32_t size, bool with_checksum);
+    } nvs;
+    struct {
+        bool discharge_short;
+    } edm_state;
+} hal_t;
+
+extern hal_t hal;
+
+// Core event handlers
+
+typedef struct {
+    uint32_t tool_id;
+} tool_data_t;
+
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_probe_completed_ptr)(void);
+typedef void (*on_reset_ptr)(void);
+typedef void (*on_state_change_ptr)(sys_state_t state);
+typedef void (*on_tool_changed_ptr)(tool_data_t *tool);
+typedef bool (*enqueue_realtime_command_ptr)(char c);
+
+typedef struct {
+    on_execute_realtime_ptr on_execute_realtime;
+    on_report_options_ptr on_report_options;
+    on_probe_completed_ptr on_probe_completed;
+    on_reset_ptr on_reset;
+    on_state_change_ptr on_state_change;
+    on_tool_changed_ptr on_tool_changed;
+    enqueue_realtime_command_ptr enqueue_realtime_command;
+    user_mcode_ptrs_t user_mcode;
+} grbl_t;
+
+extern grbl_t grbl;
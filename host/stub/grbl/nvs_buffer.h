@@ -0,0 +1,5 @@
+#pragma once
+
+#include "grbl/hal.h"
+
+nvs_address_t nvs_alloc (size_t size);
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "grbl/hal.h"
+
+typedef uint8_t i2c_address_t;
+
+typedef struct {
+    i2c_address_t address;
+    uint16_t word_addr;
+    uint8_t word_addr_bytes;
+    bool no_block;
+    uint16_t count;
+    uint8_t *data;
+} i2c_transfer_t;
+
+void i2c_start (void);
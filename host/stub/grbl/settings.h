@@ -0,0 +1,46 @@
+#pragma once
+
+#include "grbl/hal.h"
+
+// The plugin settings subset of the core settings API, registered with host/mock.c.
+
+typedef enum {
+    Setting_UserDefined_0 = 450
+} setting_id_t;
+
+typedef enum {
+    Group_UserSettings
+} setting_group_t;
+
+typedef enum {
+    Format_Integer
+} setting_datatype_t;
+
+typedef enum {
+    Setting_NonCore
+} setting_type_t;
+
+typedef struct setting_detail {
+    setting_id_t id;
+    setting_group_t group;
+    const char *name;
+    const char *unit;
+    setting_datatype_t datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    setting_type_t type;
+    void *value;
+    void *get_value;
+    bool (*is_available)(const struct setting_detail *setting, uint_fast16_t offset);
+} setting_detail_t;
+
+typedef struct {
+    const setting_detail_t *settings;
+    uint8_t n_settings;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+} setting_details_t;
+
+void settings_register (setting_details_t *details);
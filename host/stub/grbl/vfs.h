@@ -0,0 +1,13 @@
+#pragma once
+
+#include "grbl/hal.h"
+
+// The log persistence subset of the core VFS, backed by host/mock.c.
+
+typedef struct {
+    size_t size;
+} vfs_file_t;
+
+vfs_file_t *vfs_open (const char *filename, const char *mode);
+void vfs_close (vfs_file_t *file);
+size_t vfs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file);
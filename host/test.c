@@ -0,0 +1,368 @@
+/*
+  test.c - host checks of the EDM plugin
+
+  Part of grblHAL driver for STM32H7xx
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+  Pass/fail checks of the log ring and of the M-code validate paths, built like bench.c against
+  the mocks in mock.c. Prints one line per failed check and exits non-zero if any failed.
+*/
+
+#include "plugin_edm.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mock.h"
+
+static uint32_t checks, failures;
+
+#define CHECK(cond) check((cond), #cond, __LINE__)
+
+static void check (bool ok, const char *what, int line)
+{
+    checks++;
+    if(!ok) {
+        failures++;
+        printf("FAIL test.c:%d: %s\n", line, what);
+    }
+}
+
+static log_entry_t entry (uint32_t t_us)
+{
+    return (log_entry_t){ .t_us = t_us };
+}
+
+// Log ring
+
+// Entry n back from the newest one, 0 is the newest.
+static uint32_t log_t_us (uint32_t n)
+{
+    return log_entries[(edm_log.ix_write + log_depth - 1 - n) % log_depth].t_us;
+}
+
+static void test_log_ring (void)
+{
+    exec_mode_log(true, false, false);
+    CHECK(edm_log.num_valid == 0 && edm_log.num_written == 0);
+
+    for(uint32_t i = 1; i <= 3; i++)
+        add_log(entry(i));
+
+    CHECK(edm_log.num_valid == 3);
+    CHECK(log_t_us(0) == 3 && log_t_us(2) == 1);
+
+    // Wrap the ring, the oldest entries are overwritten.
+    for(uint32_t i = 4; i <= log_depth + 10; i++)
+        add_log(entry(i));
+
+    CHECK(edm_log.num_valid == log_depth);
+    CHECK(edm_log.num_written == log_depth + 10);
+    CHECK(log_t_us(0) == log_depth + 10);
+    CHECK(log_t_us(log_depth - 1) == 11);
+
+    edm_log.active = false;
+}
+
+static log_entry_t buf[EDM_LOG_SIZE];
+
+// n entries in buf with consecutive t_us from first.
+static bool in_order (const log_entry_t *entries, uint32_t n, uint32_t first)
+{
+    for(uint32_t i = 0; i < n; i++) {
+        if(entries[i].t_us != first + i)
+            return false;
+    }
+
+    return true;
+}
+
+// Fills the log with t_us equal to the entry's seq, counted from num_written.
+static void fill_log (uint32_t num_written, uint32_t n)
+{
+    exec_mode_log(true, false, false);
+    edm_log.num_written = num_written;
+    for(uint32_t i = 0; i < n; i++)
+        add_log(entry(num_written + i));
+    edm_log.active = false;
+}
+
+static void test_log_tail (void)
+{
+    fill_log(0, 50);
+    CHECK(edm_log_tail((uint8_t *)buf, 10) == 10 && in_order(buf, 10, 40));
+    CHECK(edm_log_tail((uint8_t *)buf, 100) == 50 && in_order(buf, 50, 0));
+
+    fill_log(0, log_depth + 5);
+    CHECK(edm_log_tail((uint8_t *)buf, 10) == 10 && in_order(buf, 10, log_depth - 5));
+}
+
+static void test_log_since (void)
+{
+    uint32_t seq = 0, n;
+
+    fill_log(0, 50);
+    n = edm_log_since(&seq, (uint8_t *)buf, 20);
+    CHECK(n == 20 && seq == 20 && in_order(buf, n, 0));
+    n = edm_log_since(&seq, (uint8_t *)buf, 100);
+    CHECK(n == 30 && seq == 50 && in_order(buf, n, 20));
+    CHECK(edm_log_since(&seq, (uint8_t *)buf, 100) == 0);
+
+    // Lapped, skips forward leaving n entries of margin.
+    seq = 0;
+    fill_log(0, log_depth + 200);
+    n = edm_log_since(&seq, (uint8_t *)buf, 100);
+    CHECK(n == 100 && seq == edm_log.num_written - log_depth + 200);
+    CHECK(in_order(buf, n, seq - 100));
+
+    // A seq ahead of num_written is from before a restart.
+    seq = edm_log.num_written + 10;
+    CHECK(edm_log_since(&seq, (uint8_t *)buf, 100) == 0 && seq == edm_log.num_written);
+}
+
+// num_written wrapping around with a depth that is not a power of 2.
+static void test_log_wrap (void)
+{
+    uint32_t seq = UINT32_MAX - 99, n;
+
+    mock_settings->restore();
+    edm_settings.log_depth = 1000;
+    exec_mode_log(true, false, false);
+    CHECK(log_depth == 1000);
+
+    fill_log(UINT32_MAX - 99, 300);
+    CHECK(edm_log.num_written == 200);
+    n = edm_log_since(&seq, (uint8_t *)buf, 150);
+    CHECK(n == 150 && seq == 50 && in_order(buf, n, UINT32_MAX - 99));
+    n = edm_log_since(&seq, (uint8_t *)buf, 500);
+    CHECK(n == 150 && seq == 200 && in_order(buf, n, 50));
+
+    mock_settings->restore();
+    exec_mode_log(false, false, false);
+}
+
+// Log depth setting, restored from blank NVS by edm_init().
+
+static void test_settings (void)
+{
+    CHECK(mock_settings != NULL && mock_settings->n_settings == 1);
+    CHECK(edm_settings.log_depth == EDM_LOG_SIZE);
+
+    edm_settings.log_depth = 2000;
+    mock_settings->save();
+    edm_settings.log_depth = 0;
+    mock_settings->load();
+    CHECK(edm_settings.log_depth == 2000);
+
+    // Out of range in NVS, e.g. saved by a build with a larger EDM_LOG_SIZE.
+    edm_settings.log_depth = EDM_LOG_SIZE + 1;
+    mock_settings->save();
+    mock_settings->load();
+    CHECK(edm_settings.log_depth == EDM_LOG_SIZE);
+
+    // Applied when the log starts.
+    edm_settings.log_depth = 2000;
+    exec_mode_log(true, false, false);
+    CHECK(log_depth == 2000);
+    mock_settings->restore();
+    exec_mode_log(true, false, false);
+    CHECK(log_depth == EDM_LOG_SIZE);
+    edm_log.active = false;
+}
+
+static void test_log_poll (void)
+{
+    exec_mode_log(true, false, false);
+    set_gate(true);
+
+    for(uint32_t i = 0; i < 10; i++)
+        edm_poll_start();
+
+    set_gate(false);
+
+    CHECK(edm_log.num_written == 10);
+    CHECK(edm_poll_err_cnt == 0);
+
+    edm_log.active = false;
+}
+
+// M-codes, validate and execute as the parser calls them.
+
+static status_code_t mcode_run (user_mcode_t code, parser_block_t *block)
+{
+    status_code_t status;
+
+    block->user_mcode = code;
+    if(mcode_check(code) != UserMCode_Normal)
+        return Status_Unhandled;
+
+    if((status = mcode_validate(block)) == Status_OK)
+        mcode_execute(mock_state, block);
+
+    return status;
+}
+
+static void test_mcode_check (void)
+{
+    CHECK(mcode_check(EDM_MCODE_SERVO) == UserMCode_Normal);
+    CHECK(mcode_check((user_mcode_t)599) == UserMCode_Unsupported);
+}
+
+static void test_mcode_servo (void)
+{
+    parser_block_t block;
+
+    block = (parser_block_t){0};
+    block.words.s = 1;
+    block.values.s = 2.0f;
+    CHECK(mcode_run(EDM_MCODE_SERVO, &block) == Status_GcodeValueOutOfRange);
+
+    block = (parser_block_t){0};
+    block.words.p = 1;
+    block.values.p = 21.0f;
+    CHECK(mcode_run(EDM_MCODE_SERVO, &block) == Status_GcodeValueOutOfRange);
+
+    block = (parser_block_t){0};
+    block.words.r = 1;
+    block.values.r = -101.0f;
+    CHECK(mcode_run(EDM_MCODE_SERVO, &block) == Status_GcodeValueOutOfRange);
+
+    block = (parser_block_t){0};
+    block.words.p = block.words.q = block.words.r = block.words.s = 1;
+    block.values.p = 1.0f;
+    block.values.q = 50.0f;
+    block.values.r = 20.0f;
+    block.values.s = 1.0f;
+    CHECK(mcode_run(EDM_MCODE_SERVO, &block) == Status_OK);
+    CHECK(block.words.mask == 0);
+    CHECK(servo.kp == 1.0f && servo.ki == 50.0f && servo.target == 20.0f * 0.01f);
+    CHECK(servo.enabled);
+
+    // Absent words leave the settings as they are.
+    block = (parser_block_t){0};
+    block.words.s = 1;
+    block.values.s = 0.0f;
+    CHECK(mcode_run(EDM_MCODE_SERVO, &block) == Status_OK);
+    CHECK(!servo.enabled && servo.kp == 1.0f && servo.ki == 50.0f);
+}
+
+static void test_mcode_log (void)
+{
+    parser_block_t block;
+
+    block = (parser_block_t){0};
+    CHECK(mcode_run(EDM_MCODE_LOG, &block) == Status_GcodeValueWordMissing);
+
+    block = (parser_block_t){0};
+    block.words.s = 1;
+    block.values.s = 3.0f;
+    CHECK(mcode_run(EDM_MCODE_LOG, &block) == Status_GcodeValueOutOfRange);
+
+    block = (parser_block_t){0};
+    block.words.s = 1;
+    block.values.s = 1.0f;
+    CHECK(mcode_run(EDM_MCODE_LOG, &block) == Status_OK);
+    CHECK(block.words.mask == 0);
+    CHECK(edm_log.active && !edm_log.streaming);
+
+    block = (parser_block_t){0};
+    block.words.s = 1;
+    block.values.s = 0.0f;
+    CHECK(mcode_run(EDM_MCODE_LOG, &block) == Status_OK);
+    CHECK(!edm_log.active);
+}
+
+static void test_mcode_read (void)
+{
+    parser_block_t block;
+
+    block = (parser_block_t){0};
+    block.words.s = 1;
+    block.values.s = 9.0f;
+    CHECK(mcode_run(EDM_MCODE_READ, &block) == Status_GcodeValueOutOfRange);
+
+    block = (parser_block_t){0};
+    CHECK(mcode_run(EDM_MCODE_READ, &block) == Status_OK);
+    CHECK(block.values.s == LOG_PRINT_NONE);
+}
+
+static void test_mcode_start_stop (void)
+{
+    parser_block_t block;
+
+    block = (parser_block_t){0};
+    block.words.p = 1;
+    block.values.p = 99.0f;
+    CHECK(mcode_run(EDM_MCODE_START_TNEG, &block) == Status_GcodeValueOutOfRange);
+
+    block = (parser_block_t){0};
+    block.words.p = 1;
+    block.values.p = 1001.0f;
+    CHECK(mcode_run(EDM_MCODE_START_TNEG, &block) == Status_GcodeValueOutOfRange);
+
+    memset(&mock_stats, 0, sizeof(mock_stats));
+
+    block = (parser_block_t){0};
+    block.words.p = block.words.q = block.words.r = 1;
+    block.values.p = 500.0f;
+    block.values.q = 2.0f;
+    block.values.r = 30.0f;
+    CHECK(mcode_run(EDM_MCODE_START_TNEG, &block) == Status_OK);
+    CHECK(block.words.mask == 0);
+    CHECK(edm_removal_active);
+    CHECK(mock_stats.i2c_writes > 0);
+
+    block = (parser_block_t){0};
+    block.words.x = 1;
+    CHECK(mcode_run(EDM_MCODE_STOP, &block) == Status_GcodeUnusedWords);
+
+    block = (parser_block_t){0};
+    CHECK(mcode_run(EDM_MCODE_STOP, &block) == Status_OK);
+    CHECK(!edm_removal_active);
+}
+
+static void (*const tests[])(void) = {
+    test_settings,
+    test_log_ring,
+    test_log_tail,
+    test_log_since,
+    test_log_wrap,
+    test_log_poll,
+    test_mcode_check,
+    test_mcode_servo,
+    test_mcode_log,
+    test_mcode_read,
+    test_mcode_start_stop,
+};
+
+int main (void)
+{
+    mock_init();
+    edm_init();
+
+    if(edm_init_status != 0) {
+        fprintf(stderr, "edm_init() failed: %u\n", edm_init_status);
+        return 1;
+    }
+
+    for(uint_fast8_t idx = 0; idx < sizeof(tests) / sizeof(tests[0]); idx++)
+        tests[idx]();
+
+    printf("%lu checks, %lu failed\n", (unsigned long)checks, (unsigned long)failures);
+
+    return failures ? 1 : 0;
+}